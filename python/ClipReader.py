@@ -411,6 +411,19 @@ class ClipReader(object):
         return self.prevMs
 
 
+    ###########################################################
+    def getDecodeAheadStats(self):
+        """Return how decode-ahead kept up with getNextFrame().
+
+        @return stats  See FfMpegClipReader.getDecodeAheadStats(); None if
+                       decode-ahead is off, or nothing was read in sequence.
+        """
+        if self._seqReader is None:
+            return None
+
+        return self._seqReader.getDecodeAheadStats()
+
+
     ###########################################################
     def setOutputSize(self, resolution):
         """Set the size retrieved frames shoudl be.
@@ -435,6 +448,15 @@ class ClipFrame(object):
         raise NotImplementedError
 
 
+    ###########################################################
+    def asBufferView(self):
+        """Return a read-only view of our data, without copying.
+
+        @return view  A FrameBufferView of our data.
+        """
+        raise NotImplementedError
+
+
     ###########################################################
     def asPil(self):
         """Return a PIL version of our data.
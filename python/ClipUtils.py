@@ -39,7 +39,7 @@ Contains an interface to clip manipulation functions from the videolib module.
 """
 
 
-from ctypes import CFUNCTYPE, POINTER, pointer, cdll, Structure, c_int
+from ctypes import CFUNCTYPE, POINTER, pointer, byref, cdll, Structure, c_int
 from ctypes import c_char_p, c_uint64, c_longlong
 from ctypes.util import find_library
 import os
@@ -82,6 +82,15 @@ _videolib.fast_create_clip.argtypes = [c_int, POINTER(c_char_p), POINTER(c_uint6
         c_uint64, c_uint64, c_char_p, c_char_p, LOGFUNC, PROGFUNC]
 _videolib.fast_create_clip.restype = c_uint64
 
+_videolib.build_clip_indexes.argtypes = [c_int, POINTER(c_char_p), c_int,
+        LOGFUNC, PROGFUNC]
+_videolib.build_clip_indexes.restype = c_int
+
+_videolib.set_export_limits.argtypes = [c_int, c_int, c_int]
+_videolib.set_export_limits.restype = None
+_videolib.get_export_queue_state.argtypes = [POINTER(c_int)]*5
+_videolib.get_export_queue_state.restype = c_int
+
 SetVideoLibDataPath()
 
 ###########################################################
@@ -253,3 +262,65 @@ def getRealClipSize(sourceWidth, sourceHeight, requestedWidth, requestedHeight):
     _videolib.preserve_aspect_ratio(sourceWidth, sourceHeight, pointerWidth,
             pointerHeight, 1)
     return pointerWidth.contents.value, pointerHeight.contents.value
+
+
+###########################################################
+def buildClipIndexes(filenames, maxWorkers=0, logFn=None, progFn=None):
+    """Build the frame indexes missing from already recorded clips.
+
+    Clips that already have one are skipped, so an interrupted or canceled
+    run picks up where it was when started over with the same list.
+
+    @param  filenames   Paths of the clips to index.
+    @param  maxWorkers  Clips indexed at once; 0 for the library's default.
+    @param  logFn       Function for logging; should be suitable for
+                        passing to ctypes.
+    @param  progFn      Function for reporting progress/aborting the call
+    @return failed      Number of clips left without an index, or -1 if
+                        canceled
+    """
+    if logFn is None:
+        logFn = LOGFUNC(lambda lvl, s: sys.stderr.write("%d: %s" % (lvl,s)))
+    if progFn is None:
+        progFn = PROGFUNC(defaultProggressCb)
+
+    numFiles = len(filenames)
+    paths = (c_char_p*numFiles)()
+    for i in range(numFiles):
+        paths[i] = filenames[i].encode('utf-8')
+
+    return _videolib.build_clip_indexes(numFiles, paths, maxWorkers, logFn,
+                                        progFn)
+
+
+###########################################################
+def setExportLimits(maxJobs=0, maxReencodeJobs=0, threadBudget=0):
+    """Limit the clip exports that run at once.
+
+    Exports past the limits wait their turn inside createClip / remuxClip,
+    remuxes ahead of re-encodes; their progress stays at 0 meanwhile, and
+    they can still be canceled. Cores of the live cameras are kept out of
+    the thread budget regardless.
+
+    @param  maxJobs          Exports running at once; 0 leaves it as it is.
+    @param  maxReencodeJobs  Re-encoding exports among them; 0 leaves it.
+    @param  threadBudget     Threads the exports have between them; 0
+                             leaves it.
+    """
+    _videolib.set_export_limits(maxJobs, maxReencodeJobs, threadBudget)
+
+
+###########################################################
+def getExportQueueState():
+    """Return the state of the clip export queue, for the UI.
+
+    @return state  A dict with 'running', 'runningReencodes', 'queued',
+                   'threadsInUse' and 'threadBudget'.
+    """
+    values = [c_int() for _ in range(5)]
+    _videolib.get_export_queue_state(*[byref(v) for v in values])
+    running, runningReencodes, queued, threadsInUse, threadBudget = \
+        [v.value for v in values]
+    return { 'running': running, 'runningReencodes': runningReencodes,
+             'queued': queued, 'threadsInUse': threadsInUse,
+             'threadBudget': threadBudget }
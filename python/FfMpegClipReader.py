@@ -59,6 +59,7 @@ from vitaToolbox.strUtils.EnsureUnicode import ensureUtf8
 
 from videoLib2.python.ClipReader import ClipFrame
 from videoLib2.python.VideoLibUtils import SetVideoLibDataPath, getTimestampFlags
+from videoLib2.python.VideoLibUtils import GetFrameBufferView
 
 
 _libName = 'videolib'
@@ -118,6 +119,10 @@ _lib.get_next_frame_offset.restype = c_longlong
 _lib.get_frame_at.argtypes = [c_void_p, c_longlong]
 _lib.get_frame_at.restype = POINTER(FfMpegClipFrameStruct)
 _lib.free_clip_frame.argtypes = [POINTER(POINTER(FfMpegClipFrameStruct))]
+_lib.get_clip_frame_buffer_layout.argtypes = [POINTER(FfMpegClipFrameStruct),
+                                              POINTER(c_int), POINTER(c_int),
+                                              POINTER(c_int)]
+_lib.get_clip_frame_buffer_layout.restype = c_int
 _lib.get_ms_list.argtypes = [c_void_p]
 _lib.get_ms_list.restype = POINTER(c_longlong)
 _lib.get_ms_list2.argtypes = [c_char_p, LOGFUNC]
@@ -125,8 +130,18 @@ _lib.get_ms_list2.restype = POINTER(c_longlong)
 _lib.get_duration.argtypes = [c_char_p, LOGFUNC]
 _lib.get_duration.restype = c_int64
 _lib.free_ms_list.argtypes = [POINTER(POINTER(c_longlong))]
+_lib.get_thumbnails.argtypes = [c_char_p, c_int, c_int, c_int, c_int,
+                                POINTER(POINTER(FfMpegClipFrameStruct)), c_int,
+                                LOGFUNC]
+_lib.get_thumbnails.restype = c_int
+_lib.flush_clip_cache.argtypes = [c_char_p]
 _lib.set_output_size.argtypes = [c_void_p, c_int, c_int]
 _lib.set_output_size.restype = c_int
+_lib.set_clip_decode_ahead.argtypes = [c_void_p, c_int, c_int, c_int]
+_lib.set_clip_decode_ahead.restype = c_int
+_lib.get_clip_decode_ahead_stats.argtypes = [c_void_p, POINTER(c_int64),
+                                             POINTER(c_int64), POINTER(c_int)]
+_lib.get_clip_decode_ahead_stats.restype = c_int
 
 SetVideoLibDataPath()
 
@@ -181,6 +196,20 @@ class FfMpegClipFrame(ClipFrame):
         return self.numpyFrame
 
 
+    ###########################################################
+    def asBufferView(self):
+        """Return a read-only view of our data, without copying.
+
+        numpy.asarray(view) gives a (height, width, channels) array; the
+        view keeps this frame alive.
+
+        @return view  A FrameBufferView of our data.
+        """
+        return GetFrameBufferView(_lib.get_clip_frame_buffer_layout,
+                                  self.structPtr, self, self.buffer.value,
+                                  self.width, self.height)
+
+
     ###########################################################
     def asPil(self):
         """Return a PIL version of our data.
@@ -240,6 +269,36 @@ def getMsList(filename, logFn=None):
     else:
         return []
 
+##############################################################################
+def getThumbnails(filename, width, height, count=0, intervalMs=0, logFn=None):
+    """ Extracts a strip of keyframe thumbnails of a file in one pass; either
+    count of them spread across the clip, or one every intervalMs.
+
+    @return thumbnails  A list of FfMpegClipFrame, at most one per slot.
+    """
+    if logFn is None:
+        logFn = LOGFUNC(getStderrLogCB())
+
+    maxFrames = count
+    if count <= 0:
+        duration = _lib.get_duration(ensureUtf8(filename), logFn)
+        if duration < 0 or intervalMs <= 0:
+            return []
+        maxFrames = int(duration // intervalMs) + 1
+
+    frames = (POINTER(FfMpegClipFrameStruct) * maxFrames)()
+    numFrames = _lib.get_thumbnails(ensureUtf8(filename), count, intervalMs,
+                                    width, height, frames, maxFrames, logFn)
+    return [FfMpegClipFrame(frames[i], width, height)
+            for i in xrange(max(numFrames, 0))]
+
+##############################################################################
+def flushClipCache(filename=None):
+    """ Drops what's cached about a file (and any idle reader holding it open),
+    or about all files; call before deleting or replacing a clip.
+    """
+    _lib.flush_clip_cache(ensureUtf8(filename) if filename is not None else None)
+
 
 
 ##############################################################################
@@ -290,6 +349,9 @@ class FfMpegClipReader(object):
         enableDebug = 0
         enableTimestamp = 0
         keyframeOnly = 0
+        decodeAhead = False
+        decodeAheadFrames = 0
+        decodeAheadMb = 0
         if not extras is None:
             boxList = extras.get('boxList', [])
             zonesList = extras.get('zonesList', [])
@@ -302,6 +364,10 @@ class FfMpegClipReader(object):
             enableTimestamp = getTimestampFlags(extras)
             enableThread = extras.get('asyncRead', 0)
             keyframeOnly = extras.get('keyframeOnly', 0)
+            # frames decoded ahead of getNextFrame; 0 for the library defaults
+            decodeAhead = extras.get('decodeAhead', False)
+            decodeAheadFrames = extras.get('decodeAheadFrames', 0)
+            decodeAheadMb = extras.get('decodeAheadMb', 0)
             self._mute = extras.get('audioMute', self._mute)
 
 
@@ -332,6 +398,9 @@ class FfMpegClipReader(object):
                 self._width = _lib.get_output_width(self._clip)
                 self._height = _lib.get_output_height(self._clip)
                 self.setMute(self._mute)
+                if decodeAhead:
+                    _lib.set_clip_decode_ahead(self._clip, 1, decodeAheadFrames,
+                                               decodeAheadMb)
                 return True
         except:
             try:
@@ -514,6 +583,27 @@ class FfMpegClipReader(object):
         return FfMpegClipFrame(result, self._width, self._height)
 
 
+    ###########################################################
+    def getDecodeAheadStats(self):
+        """Return how decode-ahead kept up with getNextFrame().
+
+        @return stats  A dict with the frames taken from decode-ahead, how many
+                       of them had to be waited for ('starved'), and how many
+                       are queued; None if decode-ahead is off.
+        """
+        if not self._clip:
+            return None
+
+        taken = c_int64()
+        starved = c_int64()
+        queued = c_int()
+        if _lib.get_clip_decode_ahead_stats(self._clip, byref(taken),
+                                            byref(starved), byref(queued)) < 0:
+            return None
+        return { 'taken': taken.value, 'starved': starved.value,
+                 'queued': queued.value }
+
+
     ###########################################################
     def setOutputSize(self, resolution):
         """Set the size retrieved frames shoudl be.
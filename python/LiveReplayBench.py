@@ -0,0 +1,269 @@
+#! /usr/local/bin/python
+
+#*****************************************************************************
+#
+# LiveReplayBench.py
+#   Load test of the live pipeline, against cameras replayed from a capture
+#
+#*****************************************************************************
+#
+# Copyright 2013-2022 Sighthound, Inc.
+#
+# Licensed under the GNU GPLv3 license found at
+# https://www.gnu.org/licenses/gpl-3.0.txt
+#
+# Alternative licensing available from Sighthound, Inc.
+# by emailing opensource@sighthound.com
+#
+# This file is part of the Sighthound Video project which can be found at
+# https://github.url/thing
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; using version 3 of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+#
+#*****************************************************************************
+
+"""
+## @file
+Opens N virtual cameras on a capture made with enablePacketCapture, served
+back over RTSP by svpcap, and reports how the live pipeline kept up with
+them: frames delivered, latency, frames dropped on the way, and CPU.
+
+The capture's timing is kept (scaled by --speed), so runs are repeatable.
+With --workers each camera runs in a worker process of its own (see
+StreamWorker.py), which is also what lets CPU be reported per camera;
+otherwise it's the whole process's, split evenly.
+
+    python LiveReplayBench.py capture.pcap --cameras 16 --duration 60
+
+ctest runs a short one-camera pass of it when BENCH_CAPTURE_PATH is set
+(see src/bench/CMakeLists.txt).
+"""
+
+
+from ctypes import POINTER, byref, c_char_p, c_int, c_longlong
+import argparse
+import json
+import os
+import shutil
+import sys
+import tempfile
+import threading
+import time
+
+from vitaToolbox.loggingUtils.LoggingUtils import getStderrLogCB
+from vitaToolbox.strUtils.EnsureUnicode import ensureUtf8
+
+from videoLib2.python.StreamReader import LOGFUNC, _videolib
+
+from backEnd.BackEndPrefs import kRecordInMemory
+
+
+_videolib.enable_packet_replay.argtypes = [c_char_p, c_int, c_int, c_int, LOGFUNC]
+_videolib.enable_packet_replay.restype = c_int
+_videolib.get_packet_replay_stats.argtypes = [POINTER(c_longlong)]*4
+_videolib.get_packet_replay_stats.restype = c_int
+_videolib.disable_packet_replay.argtypes = []
+
+kReplayErrCodes = {
+    -2:"svpcap can't be loaded",
+    -3:"a replay is already running",
+    -4:"the capture can't be served",
+}
+
+# How long each camera waits for frames before checking the clock
+kPollMs = 100
+
+
+##############################################################################
+class CameraStats(object):
+    """What one camera saw over the run."""
+    ###########################################################
+    def __init__(self, index):
+        self.index = index
+        self.opened = False
+        self.openSec = 0
+        self.frames = 0
+        self.stoppedAt = None
+        self.latency = None
+        self.dropped = 0
+        self.cpuSec = None
+
+
+###############################################################
+def _getProcessCpuSec(pid):
+    """Return the CPU time used by a process so far, or None if unknown."""
+    try:
+        with open("/proc/%d/stat" % pid) as f:
+            fields = f.read().rsplit(')', 1)[1].split()
+        # utime and stime, fields 14 and 15 of stat(5)
+        return (int(fields[11]) + int(fields[12])) / \
+               float(os.sysconf('SC_CLK_TCK'))
+    except Exception:
+        return None
+
+
+###############################################################
+def _getDropped(reader):
+    """Frames lost between the nodes of the reader's graph."""
+    dropped = 0
+    for name, stats in reader.getPipelineStats() or []:
+        framesIn = stats.get('framesIn', -1)
+        framesOut = stats.get('framesOut', 0)
+        # thread connectors are where frames get dropped under load
+        if name.startswith('tc') and framesIn >= framesOut:
+            dropped += framesIn - framesOut
+    return dropped
+
+
+###############################################################
+def _runCamera(reader, url, extras, stats, deadline):
+    """Read a camera until the deadline, counting what comes out."""
+    start = time.time()
+    stats.opened = reader.open(url, extras)
+    stats.openSec = time.time() - start
+    if not stats.opened:
+        return
+
+    while time.time() < deadline:
+        frames = reader.getNewFrames(timeoutMs=kPollMs)
+        stats.frames += len(frames)
+        if not reader.isRunning:
+            stats.stoppedAt = time.time() - start
+            return
+
+    stats.latency = reader.getLatencyStats()
+    stats.dropped = _getDropped(reader)
+    worker = getattr(reader, '_worker', None)
+    if worker is not None:
+        stats.cpuSec = _getProcessCpuSec(worker.pid)
+
+
+###############################################################
+def main(argv):
+    parser = argparse.ArgumentParser(description="Load test of the live "
+                                     "pipeline, on cameras replayed from a "
+                                     "packet capture")
+    parser.add_argument('capture', help="capture made by enablePacketCapture")
+    parser.add_argument('--cameras', type=int, default=4)
+    parser.add_argument('--duration', type=float, default=30,
+                        help="seconds to read the cameras for")
+    parser.add_argument('--speed', type=int, default=100,
+                        help="replay speed in percent; 0 for as fast as "
+                        "the cameras read")
+    parser.add_argument('--fps', type=int, default=10)
+    parser.add_argument('--size', default="320x240",
+                        help="analytics frame size")
+    parser.add_argument('--record', action='store_true',
+                        help="record, as cameras normally do")
+    parser.add_argument('--workers', action='store_true',
+                        help="run each camera in a worker process")
+    parser.add_argument('--json', help="also write the results here")
+    args = parser.parse_args(argv)
+
+    if args.workers:
+        os.environ["SV_CAMERA_WORKERS"] = "1"
+    # after the environment is set
+    from videoLib2.python.StreamWorker import createStreamReader
+
+    logFn = LOGFUNC(getStderrLogCB())
+    port = _videolib.enable_packet_replay(ensureUtf8(args.capture), 0,
+                                          args.speed, 1, logFn)
+    if port < 0:
+        print >>sys.stderr, "Failed to replay %s: %s" % (args.capture,
+                            kReplayErrCodes.get(port, str(port)))
+        return 1
+
+    workDir = tempfile.mkdtemp(prefix="svreplay")
+    width, height = [int(v) for v in args.size.split('x')]
+    extras = { 'forceTCP': True, 'recordSize': (width, height),
+               'fpsLimit': args.fps, kRecordInMemory: False }
+
+    readers = []
+    threads = []
+    results = []
+    cpuStart = os.times()
+    wallStart = time.time()
+    deadline = wallStart + args.duration
+    try:
+        for i in xrange(args.cameras):
+            reader = createStreamReader(name="cam%d" % i, recordDir=workDir,
+                                        storageDir=workDir, configDir=workDir,
+                                        logFn=logFn, record=args.record)
+            stats = CameraStats(i)
+            thread = threading.Thread(target=_runCamera, name="cam%d" % i,
+                args=(reader, "rtsp://127.0.0.1:%d/cam%d" % (port, i),
+                      extras, stats, deadline))
+            thread.start()
+            readers.append(reader)
+            threads.append(thread)
+            results.append(stats)
+        for thread in threads:
+            thread.join()
+
+        wallSec = time.time() - wallStart
+        cpuEnd = os.times()
+        processCpuSec = (cpuEnd[0] - cpuStart[0]) + (cpuEnd[1] - cpuStart[1])
+
+        values = [c_longlong() for _ in range(4)]
+        _videolib.get_packet_replay_stats(*[byref(v) for v in values])
+        sessions, packets, bytesSent, maxLagUs = [v.value for v in values]
+    finally:
+        for reader in readers:
+            reader.close()
+        _videolib.disable_packet_replay()
+        shutil.rmtree(workDir, ignore_errors=True)
+
+    # Report
+    report = { 'cameras': [], 'wallSec': wallSec,
+               'processCpuSec': processCpuSec,
+               'replay': { 'packets': packets, 'bytes': bytesSent,
+                           'maxLagMs': maxLagUs/1000. } }
+    print "%-6s %6s %8s %8s %8s %8s %8s %8s" % ("camera", "open", "frames",
+            "fps", "p50ms", "p99ms", "dropped", "cpu%")
+    for stats in results:
+        total = (stats.latency or {}).get('total', {})
+        cpuSec = stats.cpuSec
+        if cpuSec is None:
+            cpuSec = processCpuSec / max(args.cameras, 1)
+        camera = { 'index': stats.index, 'opened': stats.opened,
+                   'openSec': stats.openSec, 'frames': stats.frames,
+                   'fps': stats.frames / wallSec, 'stoppedAt': stats.stoppedAt,
+                   'latency': stats.latency, 'dropped': stats.dropped,
+                   'cpuPct': 100. * cpuSec / wallSec,
+                   'cpuPerCamera': stats.cpuSec is not None }
+        report['cameras'].append(camera)
+        print "%-6d %6s %8d %8.1f %8.1f %8.1f %8d %8.1f%s" % (stats.index,
+                "%.1fs" % stats.openSec if stats.opened else "failed",
+                stats.frames, camera['fps'], total.get('p50Us', 0)/1000.,
+                total.get('p99Us', 0)/1000., stats.dropped, camera['cpuPct'],
+                "" if camera['cpuPerCamera'] else " (avg)")
+        if stats.stoppedAt is not None:
+            print "       stopped after %.1fs" % stats.stoppedAt
+
+    frames = sum(stats.frames for stats in results)
+    print "total: %d frames, %.1f fps, process cpu %.1f%%, replay sent %d " \
+          "packets, max lag %.1fms" % (frames, frames / wallSec,
+          100. * processCpuSec / wallSec, packets, maxLagUs/1000.)
+
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(report, f, indent=2)
+
+    failed = [stats for stats in results if not stats.opened or
+              stats.stoppedAt is not None]
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
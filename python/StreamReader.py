@@ -40,7 +40,8 @@ Contains an interface to the c videolib module.
 
 
 from ctypes import CFUNCTYPE, POINTER, Structure, c_int, c_float, c_void_p
-from ctypes import c_longlong, c_char_p, string_at, byref
+from ctypes import c_longlong, c_char_p, string_at, byref, create_string_buffer
+from ctypes import c_size_t, c_ubyte
 import ConfigParser
 import os
 import shutil
@@ -61,7 +62,7 @@ from vitaToolbox.ctypesUtils.LoadLibrary import LoadLibrary
 from vitaToolbox.profiling.StatItem import StatItem
 from vitaToolbox.profiling.MarkTime import TimerLogger
 
-from videoLib2.python.VideoLibUtils import SetVideoLibDataPath
+from videoLib2.python.VideoLibUtils import SetVideoLibDataPath, GetFrameBufferView
 
 from backEnd.BackEndPrefs import kLiveEnableFastStart, kLiveEnableFastStartDefault, kRecordInMemory, kRecordInMemoryDefault, kHardwareAccelerationDevice
 
@@ -71,6 +72,17 @@ _libName = 'videolib'
 _videolib = LoadLibrary(None, _libName)
 
 kCodecConfigFilename = "output_config"
+# Frame index the recorder writes next to each clip; must match CLIP_INDEX_EXT
+kClipIndexExt = ".idx"
+
+# Shared memory layouts understood by open_mmap (see stream_mmap.cpp)
+kMmapLayoutV1 = 1
+kMmapLayoutV2 = 2
+
+# Latency stages reported by get_latency_stats, in its stage order; 'total'
+# runs from packet arrival to delivery, the rest from the preceding stage
+kLatencyStages = ['total', 'decode', 'resize', 'enqueue', 'queue', 'deliver']
+
 kCodecDefaults = {
             'bit_rate_multiplier':0,
             'max_bit_rate':0,
@@ -137,9 +149,18 @@ _videolib.free_stream_data.argtypes = [c_void_p]
 _videolib.flush_output.argtypes = [c_void_p]
 _videolib.get_new_frame.argtypes = [c_void_p, c_int]
 _videolib.get_new_frame.restype = POINTER(StreamFrameStruct)
+_videolib.get_new_frames.argtypes = [c_void_p, POINTER(POINTER(StreamFrameStruct)),
+                                     c_int, c_int]
+_videolib.get_new_frames.restype = c_int
+_videolib.get_frame_ready_handle.argtypes = [c_void_p]
+_videolib.get_frame_ready_handle.restype = c_longlong
 _videolib.get_large_frame.argtypes = [c_void_p]
 _videolib.get_large_frame.restype = POINTER(StreamFrameStruct)
 _videolib.free_frame_data.argtypes = [POINTER(POINTER(StreamFrameStruct))]
+_videolib.get_frame_buffer_layout.argtypes = [POINTER(StreamFrameStruct),
+                                              POINTER(c_int), POINTER(c_int),
+                                              POINTER(c_int)]
+_videolib.get_frame_buffer_layout.restype = c_int
 _videolib.get_local_camera_count.argtypes = [LOGFUNC]
 _videolib.get_local_camera_count.restype = c_int
 _videolib.get_local_camera_name.argtypes = [c_int]
@@ -151,12 +172,25 @@ _videolib.get_number_of_supported_resolutions_of_local_camera.restype = c_int
 _videolib.get_supported_resolution_pair_of_device.argtypes = [c_int, c_int]
 _videolib.get_supported_resolution_pair_of_device.restype = POINTER(DimensionsStruct)
 _videolib.get_fps_info.argtypes = [c_void_p, POINTER(c_float), POINTER(c_float)]
+_videolib.get_decode_stats.argtypes = [c_void_p, POINTER(c_longlong), POINTER(c_int), POINTER(c_int), POINTER(c_longlong)]
+_videolib.get_decode_stats.restype = c_int
+_videolib.get_decoder_pool_stats.argtypes = [c_void_p, POINTER(c_int), POINTER(c_int), POINTER(c_int)]
+_videolib.get_decoder_pool_stats.restype = c_int
+_videolib.get_latency_stats.argtypes = [c_void_p, c_int, POINTER(c_longlong),
+                                        POINTER(c_longlong), POINTER(c_longlong),
+                                        POINTER(c_longlong), POINTER(c_longlong),
+                                        POINTER(c_longlong)]
+_videolib.get_latency_stats.restype = c_int
+_videolib.get_pipeline_stats.argtypes = [c_void_p, c_char_p, c_int]
+_videolib.get_pipeline_stats.restype = c_int
 _videolib.get_proc_width.argtypes = [c_void_p]
 _videolib.get_proc_width.restype = c_int
 _videolib.get_proc_height.argtypes = [c_void_p]
 _videolib.get_proc_height.restype = c_int
 _videolib.open_mmap.argtypes = [c_void_p, c_char_p]
 _videolib.open_mmap.restype = c_int
+_videolib.open_mmap2.argtypes = [c_void_p, c_char_p, c_int]
+_videolib.open_mmap2.restype = c_int
 _videolib.is_running.argtypes = [c_void_p]
 _videolib.is_running.restype = c_int
 _videolib.close_mmap.argtypes = [c_void_p]
@@ -167,6 +201,16 @@ _videolib.set_live_stream_limits.restype = c_int
 _videolib.enable_live_stream.argtypes = [c_void_p, c_int, c_char_p, c_int, c_longlong]
 _videolib.enable_live_stream.restype = c_int
 _videolib.disable_live_stream.argtypes = [c_void_p, c_int]
+_videolib.enable_live_stream_on_demand.argtypes = [c_void_p, c_int, c_char_p, c_int, c_longlong, c_int]
+_videolib.enable_live_stream_on_demand.restype = c_int
+_videolib.touch_live_stream.argtypes = [c_void_p, c_int]
+_videolib.touch_live_stream.restype = c_int
+_videolib.wait_live_stream_part.argtypes = [c_char_p, c_longlong, c_int, c_int]
+_videolib.wait_live_stream_part.restype = c_int
+_videolib.get_live_stream_file.argtypes = [c_char_p, POINTER(c_void_p),
+                                           POINTER(c_size_t)]
+_videolib.get_live_stream_file.restype = c_void_p
+_videolib.release_live_stream_file.argtypes = [POINTER(c_void_p)]
 _videolib.get_newest_frame_as_jpeg.argtypes = [c_void_p, c_int, c_int,
                                                POINTER(c_int)]
 _videolib.get_newest_frame_as_jpeg.restype = c_void_p
@@ -239,6 +283,19 @@ class StreamFrame(object):
             return StreamFrame(result)
         return None
 
+    ###########################################################
+    def asBufferView(self):
+        """Return a read-only view of the frame's pixels, without copying.
+
+        numpy.asarray(view) gives a (height, width, channels) array for
+        packed formats. The view keeps this frame alive.
+
+        @return view  A FrameBufferView, or None for dummy frames.
+        """
+        return GetFrameBufferView(_videolib.get_frame_buffer_layout,
+                                  self.structPtr, self, self.buffer.value,
+                                  self.width, self.height)
+
 ##############################################################################
 class StreamReader(object):
     """A class for accessing video streams."""
@@ -594,12 +651,27 @@ class StreamReader(object):
                     # Even if we've failed to create a folder, we try to move the file,
                     # so a `moveFailed' callback is triggered
                     shutil.move(src, dst)
+                    self._moveClipIndex(src, dst)
             except Exception, e:
                 self._logFn(kLogLevelError, "Failed to move file (" + ensureUtf8(src) + "->" + ensureUtf8(dst) + "): " + str(e))
                 self._moveFailedFn(os.path.join(self._curDirPath,
                                                 self._curFilename))
             self._timeToMoveClipStat.report(timer.diff_sec())
 
+        ###########################################################
+        def _moveClipIndex(self, src, dst):
+            """Move the clip's frame index along with it, if there is one.
+
+            The index is only an optimization, so failing to move it is
+            logged, but doesn't fail the move of the clip itself.
+            """
+            if not os.path.exists(src + kClipIndexExt):
+                return
+            try:
+                shutil.move(src + kClipIndexExt, dst + kClipIndexExt)
+            except Exception, e:
+                self._logFn(kLogLevelError, "Failed to move frame index of " + ensureUtf8(src) + ": " + str(e))
+
         ###########################################################
         def addFileToDb(self):
             timer = TimerLogger("addFile")
@@ -677,6 +749,58 @@ class StreamReader(object):
         if not result:
             return None
 
+        return self._onNewFrame(result)
+
+    ###########################################################
+    def getNewFrames(self, maxFrames=8, timeoutMs=0):
+        """Get all frames that are ready, up to maxFrames, in one call
+
+        @param  maxFrames  The most frames to return.
+        @param  timeoutMs  How long to wait, if no frames are ready.
+        @return frames     A list of StreamFrame, empty if no new frame has
+                           been read in the time given or on error. To
+                           determine which of the latter is true, check
+                           isRunning.
+        """
+        if not self._stream or not self.isRunning:
+            return []
+
+        timer = TimerLogger("getFrames")
+        results = (POINTER(StreamFrameStruct) * maxFrames)()
+        count = _videolib.get_new_frames(self._stream, results, maxFrames,
+                                         timeoutMs)
+        self._timeToGetFrameStat.report(timer.diff_sec())
+
+        frames = [ self._onNewFrame(results[i]) for i in xrange(max(count, 0)) ]
+        if count <= 0 and _videolib.is_running(self._stream) == 0:
+            self.close()
+        return frames
+
+    ###########################################################
+    def getReadyHandle(self):
+        """Get an OS handle to wait on for new frames
+
+        The handle is a file descriptor on POSIX, for select/poll/epoll, and
+        an event HANDLE on Windows, for WaitForMultipleObjects. It's readable
+        (signaled) while getNewFrames(timeoutMs=0) has frames to return, or
+        once the stream stopped, so a single thread can serve many streams.
+        It belongs to the stream: don't read from it or close it, and stop
+        waiting on it once the stream is closed.
+
+        @return handle  The handle, or None if the stream can't provide one.
+        """
+        if not self._stream:
+            return None
+        handle = _videolib.get_frame_ready_handle(self._stream)
+        return handle if handle >= 0 else None
+
+    ###########################################################
+    def _onNewFrame(self, result):
+        """Account for a frame returned by the c library
+
+        @param  result  A StreamFrameStruct pointer.
+        @return frame   A StreamFrame wrapping it.
+        """
         if self._clipManager and result.contents.filename != self._curFilePath:
             self._curFilePath = result.contents.filename
             self._addFileToDb()
@@ -733,6 +857,124 @@ class StreamReader(object):
         return requestFps.value, captureFps.value
 
 
+    ###########################################################
+    def getDecodeStats(self):
+        """Get info on the cost of decoding the stream.
+
+        @return decodeTimeUs   Total time (in microseconds) spent in the decoder.
+        @return framesDecoded  Number of frames the decoder produced.
+        @return decodeThreads  Number of threads assigned to the decoder.
+        @return decodeTimeSavedUs  Estimated decoder time (in microseconds)
+                                   saved by skipping frames no consumer needed.
+                               All values are None, if stream isn't decoded.
+        """
+        if not self._stream or not self.isRunning:
+            return None, None, None, None
+
+        decodeTimeUs = c_longlong()
+        framesDecoded = c_int()
+        decodeThreads = c_int()
+        decodeTimeSavedUs = c_longlong()
+
+        if _videolib.get_decode_stats(self._stream, byref(decodeTimeUs),
+                                      byref(framesDecoded), byref(decodeThreads),
+                                      byref(decodeTimeSavedUs)) < 0:
+            return None, None, None, None
+
+        return decodeTimeUs.value, framesDecoded.value, decodeThreads.value, \
+               decodeTimeSavedUs.value
+
+
+    ###########################################################
+    def getDecoderPoolStats(self):
+        """Get the occupancy of the decoder's picture buffer pool.
+
+        @return outstanding     Buffers held by the decoder or downstream of it;
+                                one that keeps growing means frames are being
+                                held on to.
+        @return pooled          Buffers free for reuse.
+        @return maxOutstanding  The most buffers ever held at once.
+                                All values are None, if the stream isn't
+                                decoded from a pool.
+        """
+        if not self._stream or not self.isRunning:
+            return None, None, None
+
+        outstanding = c_int()
+        pooled = c_int()
+        maxOutstanding = c_int()
+
+        if _videolib.get_decoder_pool_stats(self._stream, byref(outstanding),
+                                            byref(pooled),
+                                            byref(maxOutstanding)) < 0:
+            return None, None, None
+
+        return outstanding.value, pooled.value, maxOutstanding.value
+
+
+    ###########################################################
+    def getPipelineStats(self):
+        """Get per-node stats of the stream's processing graph.
+
+        @return stats  A list of (nodeName, statsDict) tuples, from the last
+                       node to the first, with integer values for 'calls',
+                       'framesIn', 'framesOut', 'errors', 'bytes' and the
+                       time spent in the node itself / upstream of it, in
+                       microseconds. Suitable for dumping as JSON. None on
+                       error.
+        """
+        if not self._stream:
+            return None
+
+        size = 8192
+        for _ in range(2):
+            buf = create_string_buffer(size)
+            res = _videolib.get_pipeline_stats(self._stream, buf, size)
+            if res <= 0:
+                break
+            size = res
+        if res != 0:
+            return None
+
+        result = []
+        for line in buf.value.splitlines():
+            name, _, values = line.partition(': ')
+            stats = {}
+            for item in values.split():
+                key, _, value = item.partition('=')
+                try:
+                    stats[key] = int(value)
+                except ValueError:
+                    pass
+            result.append((name, stats))
+        return result
+
+
+    ###########################################################
+    def getLatencyStats(self):
+        """Get the latency of frames, from packet arrival to being returned.
+
+        @return stats  A dict keyed by the stage names in kLatencyStages, of
+                       dicts with 'count', 'avgUs', 'p50Us', 'p90Us', 'p99Us'
+                       and 'maxUs'. Stages no frame went through are left out.
+                       None, if no traced frames had been returned yet.
+        """
+        if not self._stream:
+            return None
+
+        result = {}
+        for stage, name in enumerate(kLatencyStages):
+            values = [c_longlong() for _ in range(6)]
+            if _videolib.get_latency_stats(self._stream, stage,
+                                           *[byref(v) for v in values]) < 0:
+                return None
+            if values[0].value:
+                result[name] = dict(zip(('count', 'avgUs', 'p50Us', 'p90Us',
+                                         'p99Us', 'maxUs'),
+                                        [v.value for v in values]))
+        return result
+
+
     ###########################################################
     def flush(self, msNeeded=None):
         """Ensure all data written to this point is readable.
@@ -748,15 +990,17 @@ class StreamReader(object):
 
 
     ###########################################################
-    def open_mmap(self, filename):
+    def open_mmap(self, filename, layout=kMmapLayoutV1):
         """Open a memory map for sharing live frames with other processes.
 
         @param  filename  The filename for the memory map.  On windows this
                           is simply a shared memory name.
+        @param  layout    kMmapLayoutV1 for the single frame layout, or
+                          kMmapLayoutV2 for rotating seqlock-protected slots.
         """
         if self._stream:
-            return bool(_videolib.open_mmap(self._stream,
-                                            ensureUtf8(filename)))
+            return bool(_videolib.open_mmap2(self._stream,
+                                             ensureUtf8(filename), layout))
         return False
 
 
@@ -807,6 +1051,26 @@ class StreamReader(object):
                         tsOption, startIndex)
         return -1
 
+    ###########################################################
+    def enableLiveStreamOnDemand(self, profileId, path, tsOption, startIndex,
+                                 idleTimeoutMs):
+        """Enables a live stream that only transcodes while it is being read.
+
+        touchLiveStream() needs to be called on every read of its playlist or
+        segments; it is paused again idleTimeoutMs after the last one.
+        """
+        if self._stream:
+            return _videolib.enable_live_stream_on_demand(self._stream,
+                        profileId, ensureUtf8(path), tsOption, startIndex,
+                        idleTimeoutMs)
+        return -1
+
+    ###########################################################
+    def touchLiveStream(self, profileId):
+        if self._stream:
+            return _videolib.touch_live_stream(self._stream, profileId)
+        return -1
+
     ###########################################################
     def disableLiveStream(self, profileId):
         if self._stream:
@@ -829,6 +1093,56 @@ class StreamReader(object):
         _videolib.free_newest_frame(jpeg)
         return result
 
+###########################################################
+def waitForLiveStreamPart(path, msn, part, timeoutMs):
+    """Blocks until a low-latency HLS playlist lists the given part.
+
+    Meant for serving blocking playlist reloads (_HLS_msn/_HLS_part).
+
+    @param  path       path of the playlist, as passed to enableLiveStream
+    @param  msn        media sequence number of the segment
+    @param  part       index of the part within it; -1 for the whole segment
+    @param  timeoutMs  how long to wait
+    @return 0 once listed, -1 on timeout, -2 if the playlist isn't being written
+    """
+    return _videolib.wait_live_stream_part(ensureUtf8(path), msn, part,
+                                           timeoutMs)
+
+###########################################################
+class _LiveStreamFileRef(object):
+    """Holds on to the library's reference to a file in memory."""
+    def __init__(self, handle):
+        self._handle = c_void_p(handle)
+
+    def __del__(self):
+        _videolib.release_live_stream_file(byref(self._handle))
+
+###########################################################
+def getLiveStreamFile(path):
+    """Returns a playlist or segment of a stream kept in memory.
+
+    Only for live streams enabled with SV_HLS_IN_MEMORY set; nothing of those
+    is written to disk. The data isn't copied: the result is a ctypes array
+    over the library's buffer (wrap it in a memoryview to hand it out), which
+    stays valid for as long as the array is referenced.
+
+    @param  path  path the file would have on disk
+    @return the file contents, or None if there's no such file
+    """
+    data = c_void_p()
+    size = c_size_t()
+    handle = _videolib.get_live_stream_file(ensureUtf8(path), byref(data),
+                                            byref(size))
+    if not handle:
+        return None
+    ref = _LiveStreamFileRef(handle)
+    if not data.value:
+        return (c_ubyte * 0)()
+    result = (c_ubyte * size.value).from_address(data.value)
+    # Same as with frame buffers: the array keeps the data alive
+    result.__refToLiveStreamFile = ref
+    return result
+
 ###########################################################
 def getHardwareDevicesList(logFn = None):
     maxLen = 32
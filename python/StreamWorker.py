@@ -0,0 +1,593 @@
+#! /usr/local/bin/python
+
+#*****************************************************************************
+#
+# StreamWorker.py
+#   Runs a StreamReader's camera pipeline in a worker process of its own
+#
+#*****************************************************************************
+#
+# Copyright 2013-2022 Sighthound, Inc.
+#
+# Licensed under the GNU GPLv3 license found at
+# https://www.gnu.org/licenses/gpl-3.0.txt
+#
+# Alternative licensing available from Sighthound, Inc.
+# by emailing opensource@sighthound.com
+#
+# This file is part of the Sighthound Video project which can be found at
+# https://github.url/thing
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; using version 3 of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+#
+#*****************************************************************************
+
+"""
+## @file
+Contains a StreamReader whose pipeline lives in a worker process.
+
+The worker opens the camera with a plain StreamReader and publishes its
+frames into a shared-memory ring (see worker_ring.cpp); the host reads them
+back from there. A crash or a hang in a camera's demuxer or decoder then
+only takes that camera's worker down, and the host sees the stream stop,
+as it would on a camera disconnect. Recording happens in the worker, but
+moving finished clips and adding them to the database stays on the host.
+"""
+
+
+from ctypes import POINTER, c_int, c_void_p, c_char_p, byref
+import cPickle
+import os
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import traceback
+import uuid
+
+from vitaToolbox.loggingUtils.LoggingUtils import kLogLevelError, kLogLevelInfo
+from vitaToolbox.loggingUtils.LoggingUtils import getStderrLogCB
+from vitaToolbox.strUtils.EnsureUnicode import ensureUtf8
+
+from videoLib2.python.StreamReader import StreamReader, StreamFrameStruct
+from videoLib2.python.StreamReader import LOGFUNC, _videolib
+
+from backEnd.BackEndPrefs import kRecordInMemory
+
+
+# Set to 1 to have createStreamReader run each camera in a worker process
+kCameraWorkersVar = "SV_CAMERA_WORKERS"
+
+# Ring geometry; a slot must fit one analytics frame
+kRingSlots = 4
+kRingSlotSize = 4*1024*1024
+
+# Worker states reported by worker_ring_get_state; must match worker_ring.h
+kWorkerStarting = 0
+kWorkerRunning = 1
+kWorkerStopped = 2
+
+# A worker that shows no sign of life for this long is considered hung
+kWorkerStaleMs = 10000
+
+# How long the worker waits for frames before it refreshes its heartbeat
+kWorkerPollMs = 20
+
+# How long to give a worker to open its camera, or to close it
+kWorkerOpenTimeout = 60
+kWorkerCloseTimeout = 15
+
+
+_videolib.worker_ring_create.argtypes = [c_char_p, c_int, c_int, LOGFUNC]
+_videolib.worker_ring_create.restype = c_void_p
+_videolib.worker_ring_attach.argtypes = [c_char_p, LOGFUNC]
+_videolib.worker_ring_attach.restype = c_void_p
+_videolib.worker_ring_close.argtypes = [POINTER(c_void_p)]
+_videolib.worker_ring_publish.argtypes = [c_void_p, POINTER(StreamFrameStruct)]
+_videolib.worker_ring_publish.restype = c_int
+_videolib.worker_ring_set_state.argtypes = [c_void_p, c_int]
+_videolib.worker_ring_read.argtypes = [c_void_p, c_int]
+_videolib.worker_ring_read.restype = POINTER(StreamFrameStruct)
+_videolib.worker_ring_get_state.argtypes = [c_void_p, c_int]
+_videolib.worker_ring_get_state.restype = c_int
+_videolib.worker_ring_get_dropped.argtypes = [c_void_p]
+_videolib.worker_ring_get_dropped.restype = c_int
+
+
+# Get the worker to import this module the way the host did
+_kWorkerBootstrap = """import sys
+sys.path[:0] = %r
+from videoLib2.python.StreamWorker import _workerMain
+_workerMain()
+"""
+
+
+###############################################################
+def createStreamReader(*args, **kwargs):
+    """Create the StreamReader the environment asks for.
+
+    Takes the same arguments as StreamReader.
+
+    @return reader  A WorkerStreamReader if SV_CAMERA_WORKERS is 1, else a
+                    StreamReader.
+    """
+    if os.environ.get(kCameraWorkersVar, "0") == "1":
+        return WorkerStreamReader(*args, **kwargs)
+    return StreamReader(*args, **kwargs)
+
+
+###############################################################
+def _getRingDir():
+    """Return where to create rings; RAM-backed if we can."""
+    if os.path.isdir("/dev/shm"):
+        return "/dev/shm"
+    return tempfile.gettempdir()
+
+
+##############################################################################
+class WorkerStreamReader(StreamReader):
+    """A StreamReader whose pipeline runs in a worker process.
+
+    Other than getLargeFrame and getReadyHandle, which it can't provide,
+    it's used just like a StreamReader. Recording to memory isn't supported,
+    since the files would be in the worker; it always records to disk.
+    """
+    ###########################################################
+    def __init__(self, name='', clipManager=None, clipManagerLock=None, recordDir=u'.',
+                 storageDir=u'.', configDir=u'.', logFn=None, record=True,
+                 moveFailedCallback=None,
+                 initFrameBufferSize=0,
+                 statsInterval=0):
+        """WorkerStreamReader constructor; see StreamReader."""
+        # What the worker needs to build its own StreamReader
+        self._workerArgs = {
+            'name': name,
+            'recordDir': recordDir,
+            'storageDir': storageDir,
+            'configDir': configDir,
+            'record': record,
+            'initFrameBufferSize': initFrameBufferSize,
+        }
+        self._worker = None
+        self._ring = None
+        self._ringPath = None
+        self._workerLock = threading.Lock()
+
+        super(WorkerStreamReader, self).__init__(name, clipManager,
+            clipManagerLock, recordDir, storageDir, configDir, logFn, record,
+            moveFailedCallback, initFrameBufferSize, statsInterval)
+
+
+    ###########################################################
+    def open(self, path, extras={}):
+        """Open a video stream for reading, in a new worker
+
+        @param  path     Path to the stream to open
+        @param  extras   A dictionary containing optional configuration values
+        @return success  True if the stream was opened
+        """
+        if self._worker:
+            self.close()
+
+        extras = dict(extras)
+        extras[kRecordInMemory] = False
+        self._recordInMemory = False
+
+        self._ringPath = os.path.join(_getRingDir(), "svworker-%d-%s.ring" %
+                                      (os.getpid(), uuid.uuid4().hex))
+        self._ring = c_void_p(_videolib.worker_ring_create(
+            ensureUtf8(self._ringPath), kRingSlots, kRingSlotSize,
+            self._logFn))
+        if not self._ring:
+            self._logFn(kLogLevelError, "Failed to create a frame ring for %s" %
+                        self.locationName)
+            self._closeRing()
+            return False
+
+        try:
+            self._worker = subprocess.Popen([sys.executable, '-c',
+                                             _kWorkerBootstrap % sys.path],
+                                            stdin=subprocess.PIPE,
+                                            stdout=subprocess.PIPE,
+                                            close_fds=(os.name != 'nt'))
+        except Exception, e:
+            self._logFn(kLogLevelError, "Failed to start a worker for %s: %s" %
+                        (self.locationName, str(e)))
+            self._worker = None
+            self._closeRing()
+            return False
+
+        ok, result = self._call('open', (self._workerArgs, self._ringPath,
+                                         path, extras,
+                                         (self._isMmapLargeView,
+                                          self._mmapViewWidth,
+                                          self._mmapViewHeight,
+                                          self._mmapViewFps)),
+                                kWorkerOpenTimeout)
+        if not ok or not result:
+            if not ok:
+                self._logFn(kLogLevelError, "Worker for %s failed to open: %s" %
+                            (self.locationName, result))
+            self._stopWorker()
+            self._closeRing()
+            return False
+
+        self._stream = self._ring
+        self.isRunning = True
+        return True
+
+
+    ###########################################################
+    def close(self, killableCallback=None):
+        """Close the currently opened clip, and its worker
+
+        @param  killableCallback  A callback function that will be called
+                                  after the video has been flushed and it is
+                                  'safe' to kill this process.
+        """
+        self.flush()
+
+        self.isRunning = False
+
+        # Closing the stream in the worker completes the current file
+        self._stopWorker()
+
+        if self._curFilename:
+            self._addFileToDb()
+
+        self._terminateMoverThread()
+
+        if killableCallback:
+            killableCallback()
+
+        self._closeRing()
+        self._initVariables()
+
+
+    ###########################################################
+    def _closeRing(self):
+        """Release the ring, and the file behind it."""
+        if self._ring:
+            _videolib.worker_ring_close(byref(self._ring))
+        self._ring = None
+        if self._ringPath:
+            try:
+                os.remove(self._ringPath)
+            except Exception:
+                pass
+            self._ringPath = None
+
+
+    ###########################################################
+    def _stopWorker(self):
+        """Have the worker close its stream and exit; kill it if it won't."""
+        if not self._worker:
+            return
+
+        self._call('close', (), kWorkerCloseTimeout)
+
+        deadline = time.time() + kWorkerCloseTimeout
+        while self._worker.poll() is None and time.time() < deadline:
+            time.sleep(0.05)
+        if self._worker.poll() is None:
+            self._logFn(kLogLevelError, "Killing the worker for %s" %
+                        self.locationName)
+            try:
+                self._worker.kill()
+                self._worker.wait()
+            except Exception:
+                pass
+        self._worker = None
+
+
+    ###########################################################
+    def _call(self, method, args, timeout=kWorkerCloseTimeout):
+        """Run a method in the worker.
+
+        @param  method  Name of the command, or of the worker's StreamReader
+                        method to call.
+        @param  args    Its arguments.
+        @param  timeout How long to wait for the reply; the worker is killed
+                        if it takes longer.
+        @return ok      True if the call was made and didn't raise.
+        @return result  What it returned, or a description of the failure.
+        """
+        worker = self._worker
+        if not worker or worker.poll() is not None:
+            return False, "worker is not running"
+
+        with self._workerLock:
+            # cPickle.load blocks; a watchdog kills a worker that hangs, which
+            # gets us out of it
+            watchdog = threading.Timer(timeout, self._killHungWorker, [worker])
+            watchdog.daemon = True
+            watchdog.start()
+            try:
+                cPickle.dump((method, args), worker.stdin, 2)
+                worker.stdin.flush()
+                return cPickle.load(worker.stdout)
+            except Exception, e:
+                return False, "worker is gone: %s" % str(e)
+            finally:
+                watchdog.cancel()
+
+
+    ###########################################################
+    def _killHungWorker(self, worker):
+        """Kill a worker that didn't answer in time."""
+        if worker.poll() is None:
+            self._logFn(kLogLevelError, "Worker for %s isn't responding" %
+                        self.locationName)
+            try:
+                worker.kill()
+            except Exception:
+                pass
+
+
+    ###########################################################
+    def _forward(self, method, *args):
+        """Run a StreamReader method in the worker, returning its result.
+
+        @return result  What it returned, or None if it couldn't be run.
+        """
+        ok, result = self._call(method, args)
+        if not ok:
+            if self._worker:
+                self._logFn(kLogLevelError, "Worker for %s failed %s: %s" %
+                            (self.locationName, method, result))
+            return None
+        return result
+
+
+    ###########################################################
+    def _isWorkerAlive(self):
+        """Return False if the worker exited, stopped or stalled."""
+        if not self._worker or self._worker.poll() is not None:
+            return False
+        return _videolib.worker_ring_get_state(self._ring, kWorkerStaleMs) != \
+               kWorkerStopped
+
+
+    ###########################################################
+    def getNewFrame(self, isLive=False):
+        """Get the most recently obtained frame from a stream
+
+        @param  isLive Ignored; the worker always copies frames to the
+                       memory map, if one is open.
+        @return frame  A StreamFrame or None if no new frame has been read
+                       since the previous getNewFrame call or on error. To
+                       determine which of the latter is true, check isRunning.
+        """
+        frames = self.getNewFrames(1)
+        if frames:
+            return frames[0]
+        return None
+
+
+    ###########################################################
+    def getNewFrames(self, maxFrames=8, timeoutMs=0):
+        """Get all frames that are ready, up to maxFrames, in one call
+
+        @param  maxFrames  The most frames to return.
+        @param  timeoutMs  How long to wait, if no frames are ready.
+        @return frames     A list of StreamFrame; see StreamReader.
+        """
+        if not self._stream or not self.isRunning:
+            return []
+
+        frames = []
+        while len(frames) < maxFrames:
+            result = _videolib.worker_ring_read(self._ring,
+                                                0 if frames else timeoutMs)
+            if not result:
+                break
+            frames.append(self._onNewFrame(result))
+
+        if not frames and not self._isWorkerAlive():
+            # The worker stopped, crashed or hung; close ourselves, which
+            # adds what it recorded to the database
+            self._logFn(kLogLevelInfo, "Worker for %s stopped, closing" %
+                        self.locationName)
+            self.close()
+        return frames
+
+
+    ###########################################################
+    def getReadyHandle(self):
+        """Frames come from the worker's ring, which has no handle to wait on
+
+        @return handle  Always None.
+        """
+        return None
+
+
+    ###########################################################
+    def flush(self, msNeeded=None):
+        """Ensure all data written to this point is readable; see StreamReader.
+        """
+        if self._worker and self.isRunning and \
+           ((msNeeded is None) or (msNeeded >= self._curStartMs)):
+            self._forward('flush')
+
+
+    ###########################################################
+    def getWorkerDroppedFrames(self):
+        """Return how many frames the worker dropped as the ring was full."""
+        if not self._ring:
+            return 0
+        return _videolib.worker_ring_get_dropped(self._ring)
+
+
+    ###########################################################
+    def getProcSize(self):
+        if self.isRunning and self._worker:
+            result = self._forward('getProcSize')
+            if result is not None:
+                self._cachedProcSize = result
+        return self._cachedProcSize
+
+    def getInitialFrameBufferSize(self):
+        return self._forward('getInitialFrameBufferSize') or 0
+
+    def getFpsInfo(self):
+        return self._forward('getFpsInfo')
+
+    def getDecodeStats(self):
+        return self._forward('getDecodeStats')
+
+    def getDecoderPoolStats(self):
+        return self._forward('getDecoderPoolStats')
+
+    def getPipelineStats(self):
+        return self._forward('getPipelineStats')
+
+    def getLatencyStats(self):
+        return self._forward('getLatencyStats')
+
+    def open_mmap(self, *args):
+        return bool(self._forward('open_mmap', *args))
+
+    def close_mmap(self):
+        self._forward('close_mmap')
+
+    def setMmapParams(self, isLargeView=True, width=320, height=240, fps=0):
+        # Remember these for the next open, as StreamReader does
+        self._isMmapLargeView = 1 if isLargeView else 0
+        self._mmapViewWidth = width
+        self._mmapViewHeight = height
+        self._mmapViewFps = fps
+        if self._worker:
+            self._forward('setMmapParams', isLargeView, width, height, fps)
+
+    def setAudioVolume(self, *args):
+        return self._forward('setAudioVolume', *args)
+
+    def setLiveStreamLimits(self, *args):
+        return self._forward('setLiveStreamLimits', *args)
+
+    def enableLiveStream(self, *args):
+        return self._forward('enableLiveStream', *args)
+
+    def enableLiveStreamOnDemand(self, *args):
+        return self._forward('enableLiveStreamOnDemand', *args)
+
+    def touchLiveStream(self, *args):
+        return self._forward('touchLiveStream', *args)
+
+    def disableLiveStream(self, *args):
+        return self._forward('disableLiveStream', *args)
+
+    def getNewestFrameAsJpeg(self, *args):
+        return self._forward('getNewestFrameAsJpeg', *args)
+
+
+###############################################################
+def _workerMain():
+    """Serve one WorkerStreamReader; the entry point of the worker process.
+
+    Requests come pickled on stdin and replies go back on stdout. Anything
+    else written to stdout, by this or by the library, goes to stderr, so
+    it can't corrupt the replies.
+    """
+    requests = sys.stdin
+    replies = os.fdopen(os.dup(sys.stdout.fileno()), 'wb')
+    os.dup2(sys.stderr.fileno(), sys.stdout.fileno())
+
+    logFn = LOGFUNC(getStderrLogCB())
+    state = { 'reader': None, 'ring': None, 'closeRequested': False }
+    replyLock = threading.Lock()
+    # Forwarded calls and the frame pump take turns with the reader
+    readerLock = threading.Lock()
+    stopEvent = threading.Event()
+
+    def reply(ok, result):
+        with replyLock:
+            cPickle.dump((ok, result), replies, 2)
+            replies.flush()
+
+    def openReader(readerArgs, ringPath, path, extras, mmapParams):
+        ring = c_void_p(_videolib.worker_ring_attach(ensureUtf8(ringPath),
+                                                     logFn))
+        if not ring:
+            return False
+        state['ring'] = ring
+        # The host moves clips and adds them to the database
+        reader = StreamReader(clipManager=None, logFn=logFn, **readerArgs)
+        reader.setMmapParams(*mmapParams)
+        state['reader'] = reader
+        return reader.open(path, extras)
+
+    def serveRequests():
+        while True:
+            try:
+                method, args = cPickle.load(requests)
+            except Exception:
+                # The host went away
+                break
+
+            if method == 'close':
+                state['closeRequested'] = True
+                stopEvent.set()
+                break
+
+            try:
+                with readerLock:
+                    if method == 'open':
+                        result = openReader(*args)
+                    else:
+                        result = getattr(state['reader'], method)(*args)
+                reply(True, result)
+            except Exception:
+                reply(False, traceback.format_exc())
+
+            if method == 'open' and not result:
+                stopEvent.set()
+                break
+        stopEvent.set()
+
+    requestThread = threading.Thread(target=serveRequests,
+                                     name="WorkerRequests")
+    requestThread.daemon = True
+    requestThread.start()
+
+    # Pump frames until the host says to stop, or the stream does
+    while not stopEvent.isSet():
+        reader = state['reader']
+        ring = state['ring']
+        if reader is None or not reader.isRunning:
+            stopEvent.wait(kWorkerPollMs/1000.)
+            if reader is not None:
+                break
+            continue
+
+        _videolib.worker_ring_set_state(ring, kWorkerRunning)
+        with readerLock:
+            frames = reader.getNewFrames(timeoutMs=kWorkerPollMs)
+        for frame in frames:
+            _videolib.worker_ring_publish(ring, frame.structPtr)
+
+    reader = state['reader']
+    if reader is not None:
+        with readerLock:
+            reader.close()
+    if state['ring']:
+        _videolib.worker_ring_close(byref(state['ring']))
+
+    # Answer the close request, now that the file is complete
+    if state['closeRequested']:
+        try:
+            reply(True, None)
+        except Exception:
+            pass
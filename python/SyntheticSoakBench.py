@@ -0,0 +1,385 @@
+#! /usr/local/bin/python
+
+#*****************************************************************************
+#
+# SyntheticSoakBench.py
+#   Soak and scale test of the live pipeline, against synthetic cameras
+#
+#*****************************************************************************
+#
+# Copyright 2013-2022 Sighthound, Inc.
+#
+# Licensed under the GNU GPLv3 license found at
+# https://www.gnu.org/licenses/gpl-3.0.txt
+#
+# Alternative licensing available from Sighthound, Inc.
+# by emailing opensource@sighthound.com
+#
+# This file is part of the Sighthound Video project which can be found at
+# https://github.url/thing
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; using version 3 of the License.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+#
+#*****************************************************************************
+
+"""
+## @file
+Opens M synthetic cameras (see stream_synthetic_source.cpp) through the
+regular live graph, and keeps reading them for as long as asked, hours if
+need be. Every --interval seconds it samples CPU, RSS, videolib's memory
+accounting, frame rate, drops and p99 latency; at the end it reports the
+steady state after --warmup, and how fast RSS and accounted memory grew
+over it.
+
+The cameras need no network or capture, and their bitstream is encoded
+before the run starts, so the numbers are the pipeline's alone. That makes
+it the tool for "how many cameras fit on this box", and for memory creep.
+With --workers, CPU and RSS add up the workers' too, but videolib's memory
+accounting is the host process's only.
+
+    python SyntheticSoakBench.py --cameras 16 --size 1920x1080 --fps 15 \\
+        --bitrate 4000 --duration 14400 --record
+"""
+
+
+from ctypes import create_string_buffer, c_char_p, c_int
+import argparse
+import json
+import os
+import shutil
+import sys
+import tempfile
+import threading
+import time
+
+from vitaToolbox.loggingUtils.LoggingUtils import getStderrLogCB
+
+from videoLib2.python.StreamReader import LOGFUNC, _videolib
+
+from backEnd.BackEndPrefs import kRecordInMemory
+
+
+_videolib.get_memory_stats.argtypes = [c_char_p, c_int]
+_videolib.get_memory_stats.restype = c_int
+
+# How long each camera waits for frames before checking for the end
+kPollMs = 100
+
+# Initial size of the buffer for get_memory_stats, grown as it asks
+kMemoryStatsSize = 16384
+
+
+##############################################################################
+class CameraStats(object):
+    """What one camera saw over the run."""
+    ###########################################################
+    def __init__(self, index):
+        self.index = index
+        self.opened = False
+        self.openSec = 0
+        self.frames = 0
+        self.stoppedAt = None
+
+
+###############################################################
+def _getProcessCpuSec(pid):
+    """Return the CPU time used by a process so far, or None if unknown."""
+    try:
+        with open("/proc/%d/stat" % pid) as f:
+            fields = f.read().rsplit(')', 1)[1].split()
+        # utime and stime, fields 14 and 15 of stat(5)
+        return (int(fields[11]) + int(fields[12])) / \
+               float(os.sysconf('SC_CLK_TCK'))
+    except Exception:
+        return None
+
+
+###############################################################
+def _getRssBytes(pid):
+    """Return the resident set of a process, or None if unknown."""
+    try:
+        with open("/proc/%d/status" % pid) as f:
+            for line in f:
+                if line.startswith("VmRSS:"):
+                    return int(line.split()[1]) * 1024
+    except Exception:
+        pass
+    if pid == os.getpid():
+        try:
+            import resource
+            # only the peak is available here; kB on Linux, bytes on macOS
+            peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+            return peak if sys.platform == 'darwin' else peak * 1024
+        except Exception:
+            pass
+    return None
+
+
+###############################################################
+def _getMemoryStats():
+    """Parse videolib's memory accounting into a dict.
+
+    @return stats  { 'pressure': level, '<category>': {'bytes', 'peak',
+                   'budget'}, 'tags': { '<name or tag>': {'bytes', 'peak'} } }
+    """
+    size = kMemoryStatsSize
+    while True:
+        buf = create_string_buffer(size)
+        res = _videolib.get_memory_stats(buf, size)
+        if res <= 0:
+            break
+        size = res
+    if res < 0:
+        return {}
+
+    stats = { 'tags': {} }
+    for line in buf.value.splitlines():
+        if line.startswith("pressure="):
+            stats['pressure'] = int(line.split('=', 1)[1])
+        elif line.startswith("tag="):
+            values = dict(field.split('=', 1) for field in line.split())
+            name = values.get('name', values['tag'])
+            stats['tags'][name] = dict((k, int(values[k])) for k in
+                                       ('bytes', 'peak') if k in values)
+        elif ':' in line:
+            name, fields = line.split(':', 1)
+            stats[name] = dict((k, int(v)) for k, v in
+                               (field.split('=', 1) for field in fields.split()))
+    return stats
+
+
+###############################################################
+def _getDropped(reader):
+    """Frames lost between the nodes of the reader's graph."""
+    dropped = 0
+    for name, stats in reader.getPipelineStats() or []:
+        framesIn = stats.get('framesIn', -1)
+        framesOut = stats.get('framesOut', 0)
+        # thread connectors are where frames get dropped under load
+        if name.startswith('tc') and framesIn >= framesOut:
+            dropped += framesIn - framesOut
+    return dropped
+
+
+###############################################################
+def _slopePerHour(points):
+    """Least squares slope of (seconds, value) points, in value per hour."""
+    if len(points) < 2:
+        return 0.
+    n = float(len(points))
+    meanX = sum(x for x, _ in points) / n
+    meanY = sum(y for _, y in points) / n
+    varX = sum((x - meanX)**2 for x, _ in points)
+    if not varX:
+        return 0.
+    covXY = sum((x - meanX) * (y - meanY) for x, y in points)
+    return 3600. * covXY / varX
+
+
+###############################################################
+def _runCamera(reader, url, extras, stats, stopEvent):
+    """Read a camera until told to stop, counting what comes out."""
+    start = time.time()
+    stats.opened = reader.open(url, extras)
+    stats.openSec = time.time() - start
+    if not stats.opened:
+        return
+
+    while not stopEvent.is_set():
+        frames = reader.getNewFrames(timeoutMs=kPollMs)
+        stats.frames += len(frames)
+        if not reader.isRunning:
+            stats.stoppedAt = time.time() - start
+            return
+
+
+###############################################################
+def _sample(readers, results, elapsed, cpuStart):
+    """Take one sample of the whole run's vitals."""
+    cpuNow = os.times()
+    cpuSec = (cpuNow[0] - cpuStart[0]) + (cpuNow[1] - cpuStart[1])
+    rss = _getRssBytes(os.getpid()) or 0
+    for reader in readers:
+        worker = getattr(reader, '_worker', None)
+        if worker is not None:
+            cpuSec += _getProcessCpuSec(worker.pid) or 0
+            rss += _getRssBytes(worker.pid) or 0
+
+    p99Us = 0
+    dropped = 0
+    for reader, stats in zip(readers, results):
+        if not stats.opened or stats.stoppedAt is not None:
+            continue
+        latency = reader.getLatencyStats() or {}
+        p99Us = max(p99Us, latency.get('total', {}).get('p99Us', 0))
+        dropped += _getDropped(reader)
+
+    memory = _getMemoryStats()
+    return { 'sec': elapsed, 'cpuSec': cpuSec, 'rss': rss,
+             'accounted': memory.get('total', {}).get('bytes', 0),
+             'frames': sum(stats.frames for stats in results),
+             'dropped': dropped, 'p99Us': p99Us, 'memory': memory }
+
+
+###############################################################
+def main(argv):
+    parser = argparse.ArgumentParser(description="Soak and scale test of the "
+                                     "live pipeline, on synthetic cameras")
+    parser.add_argument('--cameras', type=int, default=4)
+    parser.add_argument('--duration', type=float, default=3600,
+                        help="seconds to read the cameras for")
+    parser.add_argument('--interval', type=float, default=60,
+                        help="seconds between samples")
+    parser.add_argument('--warmup', type=float, default=300,
+                        help="seconds before the steady state is measured")
+    parser.add_argument('--size', default="1280x720",
+                        help="camera resolution")
+    parser.add_argument('--fps', type=int, default=15,
+                        help="camera frame rate")
+    parser.add_argument('--bitrate', type=int, default=2000,
+                        help="camera bitrate, in kbps")
+    parser.add_argument('--gop', type=int, default=0,
+                        help="camera keyframe interval, in frames; 0 for "
+                        "two seconds' worth")
+    parser.add_argument('--loop', type=int, default=10,
+                        help="seconds of video encoded and repeated")
+    parser.add_argument('--proc-size', default="320x240",
+                        help="analytics frame size")
+    parser.add_argument('--proc-fps', type=int, default=10,
+                        help="analytics frame rate")
+    parser.add_argument('--record', action='store_true',
+                        help="record, as cameras normally do")
+    parser.add_argument('--workers', action='store_true',
+                        help="run each camera in a worker process")
+    parser.add_argument('--json', help="also write the results here")
+    args = parser.parse_args(argv)
+
+    if args.workers:
+        os.environ["SV_CAMERA_WORKERS"] = "1"
+    # after the environment is set
+    from videoLib2.python.StreamWorker import createStreamReader
+
+    logFn = LOGFUNC(getStderrLogCB())
+    workDir = tempfile.mkdtemp(prefix="svsoak")
+    width, height = [int(v) for v in args.proc_size.split('x')]
+    extras = { 'recordSize': (width, height), 'fpsLimit': args.proc_fps,
+               kRecordInMemory: False }
+    url = "synthetic:%s@%d?bitrate=%d&loop=%d" % (args.size, args.fps,
+                                                  args.bitrate, args.loop)
+    if args.gop:
+        url += "&gop=%d" % args.gop
+
+    readers = []
+    threads = []
+    results = []
+    samples = []
+    stopEvent = threading.Event()
+    cpuStart = os.times()
+    wallStart = time.time()
+    try:
+        for i in xrange(args.cameras):
+            reader = createStreamReader(name="cam%d" % i, recordDir=workDir,
+                                        storageDir=workDir, configDir=workDir,
+                                        logFn=logFn, record=args.record)
+            stats = CameraStats(i)
+            thread = threading.Thread(target=_runCamera, name="cam%d" % i,
+                args=(reader, url, extras, stats, stopEvent))
+            thread.start()
+            readers.append(reader)
+            threads.append(thread)
+            results.append(stats)
+
+        print "%8s %8s %8s %10s %10s %8s %8s" % ("sec", "fps", "cpu%",
+                "rssMB", "accountMB", "dropped", "p99ms")
+        deadline = wallStart + args.duration
+        prev = None
+        while time.time() < deadline:
+            time.sleep(max(0, min(args.interval, deadline - time.time())))
+            sample = _sample(readers, results, time.time() - wallStart,
+                             cpuStart)
+            span = sample['sec'] - (prev['sec'] if prev else 0)
+            sample['fps'] = (sample['frames'] -
+                             (prev['frames'] if prev else 0)) / max(span, 1e-3)
+            sample['cpuPct'] = 100. * (sample['cpuSec'] -
+                             (prev['cpuSec'] if prev else 0)) / max(span, 1e-3)
+            samples.append(sample)
+            prev = sample
+            print "%8d %8.1f %8.1f %10.1f %10.1f %8d %8.1f" % (sample['sec'],
+                    sample['fps'], sample['cpuPct'], sample['rss']/1048576.,
+                    sample['accounted']/1048576., sample['dropped'],
+                    sample['p99Us']/1000.)
+            sys.stdout.flush()
+            # every camera failed or stopped, nothing left to soak
+            if not any(thread.is_alive() for thread in threads):
+                break
+    finally:
+        stopEvent.set()
+        for thread in threads:
+            thread.join()
+        for reader in readers:
+            reader.close()
+        shutil.rmtree(workDir, ignore_errors=True)
+
+    # Report the steady state, i.e. the samples past the warmup
+    steady = [s for s in samples if s['sec'] >= args.warmup] or samples[-1:]
+    report = { 'url': url, 'cameras': args.cameras, 'samples': samples,
+               'failed': [stats.index for stats in results if not stats.opened],
+               'stopped': dict((stats.index, stats.stoppedAt) for stats in
+                               results if stats.stoppedAt is not None) }
+    if steady:
+        n = float(len(steady))
+        report['steady'] = {
+            'sinceSec': steady[0]['sec'],
+            'fps': sum(s['fps'] for s in steady) / n,
+            'fpsPerCamera': sum(s['fps'] for s in steady) / n /
+                            max(args.cameras, 1),
+            'cpuPct': sum(s['cpuPct'] for s in steady) / n,
+            'rssMB': steady[-1]['rss'] / 1048576.,
+            'rssGrowthMBPerHour': _slopePerHour(
+                [(s['sec'], s['rss'] / 1048576.) for s in steady]),
+            'accountedGrowthMBPerHour': _slopePerHour(
+                [(s['sec'], s['accounted'] / 1048576.) for s in steady]),
+            'dropped': steady[-1]['dropped'] - (steady[0]['dropped']
+                       if len(steady) > 1 else 0),
+            'p99Ms': max(s['p99Us'] for s in steady) / 1000.,
+        }
+        st = report['steady']
+        print "steady state after %ds: %.1f fps (%.1f per camera), cpu " \
+              "%.1f%%, rss %.1fMB growing %.2fMB/h, accounted memory " \
+              "growing %.2fMB/h, %d dropped, p99 %.1fms" % (st['sinceSec'],
+              st['fps'], st['fpsPerCamera'], st['cpuPct'], st['rssMB'],
+              st['rssGrowthMBPerHour'], st['accountedGrowthMBPerHour'],
+              st['dropped'], st['p99Ms'])
+        tags = steady[-1]['memory'].get('tags', {})
+        for name in sorted(tags, key=lambda t: -tags[t].get('bytes', 0))[:10]:
+            print "  %-32s %10.1fMB (peak %.1fMB)" % (name,
+                  tags[name].get('bytes', 0)/1048576.,
+                  tags[name].get('peak', 0)/1048576.)
+
+    for stats in results:
+        if not stats.opened:
+            print "camera %d failed to open" % stats.index
+        elif stats.stoppedAt is not None:
+            print "camera %d stopped after %.1fs" % (stats.index,
+                                                     stats.stoppedAt)
+
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(report, f, indent=2)
+
+    return 1 if report['failed'] or report['stopped'] else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
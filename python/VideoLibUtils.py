@@ -37,7 +37,8 @@
 # Python imports...
 import sys
 import os
-from ctypes import c_int, c_char_p, c_void_p, POINTER
+from ctypes import c_int, c_char_p, c_void_p, POINTER, byref
+from ctypes import create_string_buffer
 from vitaToolbox.ctypesUtils.LoadLibrary import LoadLibrary
 from vitaToolbox.loggingUtils.LoggingUtils import setLogParams
 
@@ -140,6 +141,36 @@ def GetVideolibModulesList():
 
     return reslist
 
+##############################################################################
+def GetCpuKernels():
+    """Return which variant of each SIMD kernel videolib runs.
+
+    @return info  A dict with 'detected' and 'allowed', the lists of CPU
+                  features found and allowed (SV_CPU_FEATURES), and
+                  'kernels', {kernel: variant} for the kernels used so far.
+    """
+    _videoLib.get_cpu_kernels.argtypes = [c_char_p, c_int]
+    _videoLib.get_cpu_kernels.restype = c_int
+
+    size = 1024
+    while True:
+        buf = create_string_buffer(size)
+        res = _videoLib.get_cpu_kernels(buf, size)
+        if res <= 0:
+            break
+        size = res
+    info = { 'detected': [], 'allowed': [], 'kernels': {} }
+    if res < 0:
+        return info
+
+    for line in buf.value.splitlines():
+        name, _, value = line.partition('=')
+        if name in ('detected', 'allowed'):
+            info[name] = [] if value == 'none' else value.split(',')
+        elif name:
+            info['kernels'][name] = value
+    return info
+
 ##############################################################################
 def SetVideoLibDebugConfig(dict):
     _videoLib.set_module_trace_level.argtypes = [c_char_p, c_int]
@@ -210,4 +241,71 @@ def getTimestampFlags(extras):
             enableTimestamps |= TSOption.USE_12HR_TIME
         if extras.get('useUSDate', False):
             enableTimestamps |= TSOption.USE_US_DATE
-    return enableTimestamps
\ No newline at end of file
+    return enableTimestamps
+
+##############################################################################
+class FrameBufferView(object):
+    """Read-only, zero-copy view of a frame's pixel buffer.
+
+    Exposes __array_interface__, so numpy.asarray(view) wraps the frame's
+    memory directly. The view (and any array made from it) holds a reference
+    to the frame, which keeps the underlying buffer alive.
+    """
+    ###########################################################
+    def __init__(self, owner, address, width, height, size, stride,
+                 bytesPerPixel):
+        """FrameBufferView constructor.
+
+        @param  owner          Object whose lifetime the buffer is tied to.
+        @param  address        Address of the pixel buffer.
+        @param  width          Width of the frame, in pixels.
+        @param  height         Height of the frame, in pixels.
+        @param  size           Size of the buffer, in bytes.
+        @param  stride         Bytes between rows; 0 for planar formats.
+        @param  bytesPerPixel  Bytes per pixel; 0 for planar formats.
+        """
+        self._owner = owner
+        self.address = address
+        self.width = width
+        self.height = height
+        self.size = size
+        self.stride = stride
+        self.bytesPerPixel = bytesPerPixel
+
+    ###########################################################
+    @property
+    def __array_interface__(self):
+        if self.bytesPerPixel:
+            shape = (self.height, self.width, self.bytesPerPixel)
+            strides = (self.stride, self.bytesPerPixel, 1)
+        else:
+            # planar formats are handed out as the raw bytes
+            shape = (self.size,)
+            strides = None
+        return {
+            'version': 3,
+            'shape': shape,
+            'typestr': '|u1',
+            'data': (self.address, True),
+            'strides': strides,
+        }
+
+
+##############################################################################
+def GetFrameBufferView(layoutFn, framePtr, owner, address, width, height):
+    """Builds a FrameBufferView of a frame returned by the c library.
+
+    @param  layoutFn  get_frame_buffer_layout or get_clip_frame_buffer_layout
+    @param  framePtr  The frame structure pointer to pass to layoutFn.
+    @param  owner     Object keeping the frame alive.
+    @param  address   Address of the pixel buffer.
+    @param  width     Width of the frame.
+    @param  height    Height of the frame.
+    @return view      A FrameBufferView, or None if the frame has no buffer.
+    """
+    size, stride, bytesPerPixel = c_int(0), c_int(0), c_int(0)
+    if not address or layoutFn(framePtr, byref(size), byref(stride),
+                               byref(bytesPerPixel)) < 0:
+        return None
+    return FrameBufferView(owner, address, width, height, size.value,
+                           stride.value, bytesPerPixel.value)
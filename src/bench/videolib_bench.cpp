@@ -0,0 +1,924 @@
+/*****************************************************************************
+ *
+ * videolib_bench.cpp
+ *   Benchmarks of videolib: microbenchmarks of the hot paths (NAL scanning,
+ *   frame pools, resize, pixelate, thread connector queue), and pipeline
+ *   benchmarks (decode, create_clip, get_ms_list2, get_frame_at) over a set
+ *   of reference clips. Results are written as JSON.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+#undef SV_MODULE_VAR
+#define SV_MODULE_VAR repeat
+#define SV_MODULE_ID "BENCH"
+#include "sv_module_def.hpp"
+
+#include "streamprv.h"
+
+#include "videolibUtils.h"
+#include "streamFactories.h"
+#include "frame_basic.h"
+#include "nalu.h"
+#include "sv_internal.h"
+#if SIGHTHOUND_VIDEO
+#include "videolib.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Usage:
+//   videolib_bench [--micro] [--pipeline <clip or directory>] [--short]
+//                  [--filter <substring>] [--json <file>] [--verbose]
+//
+// Without --micro or --pipeline, only the microbenchmarks run. The JSON goes
+// to stdout unless --json is given. --short cuts the iteration counts by 10x,
+// for a smoke run under ctest. Kernel variants can be compared by narrowing
+// the CPU features with SV_CPU_FEATURES (see sv_cpu.cpp); the variants picked
+// are in the "kernels" section of the output.
+
+#define BENCH_MAGIC           0x7543
+#define REPEAT_SOURCE_MAGIC   0x7544
+
+static int _gVerbose = 0;
+
+//-----------------------------------------------------------------------------
+typedef struct bench_result {
+    std::string     name;
+    std::string     config;
+    INT64_T         iterations;
+    double          totalUs;
+    double          bytesPerIteration;  // 0 where throughput means nothing
+    int             ok;
+} bench_result;
+
+typedef struct bench_context {
+    int             shortRun;
+    std::string     filter;
+    std::vector<bench_result> results;
+    int             failures;
+} bench_context;
+
+//-----------------------------------------------------------------------------
+static void        _bench_log                      (int level, const char* msg)
+{
+    if ( level >= logWarning || _gVerbose ) {
+        fprintf(stderr, "%s\n", msg);
+    }
+}
+
+//-----------------------------------------------------------------------------
+static double      _bench_now_us                   ()
+{
+    using namespace std::chrono;
+    return (double)duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count()/1000.0;
+}
+
+//-----------------------------------------------------------------------------
+static INT64_T     _bench_iterations               (bench_context* ctx, INT64_T full)
+{
+    INT64_T res = ctx->shortRun ? full/10 : full;
+    return res > 0 ? res : 1;
+}
+
+//-----------------------------------------------------------------------------
+// Runs fn a tenth as many times to warm up (caches, pools, backend
+// calibration), then times it; fn returns false to fail the benchmark
+template<typename Fn>
+static void        _bench_run                      (bench_context* ctx,
+                                                    const char* name,
+                                                    const std::string& config,
+                                                    INT64_T iterations,
+                                                    double bytesPerIteration,
+                                                    Fn fn)
+{
+    if ( !ctx->filter.empty() && strstr(name, ctx->filter.c_str()) == NULL ) {
+        return;
+    }
+
+    bench_result r;
+    r.name = name;
+    r.config = config;
+    r.iterations = 0;
+    r.totalUs = 0;
+    r.bytesPerIteration = bytesPerIteration;
+    r.ok = 1;
+
+    INT64_T warmup = std::max<INT64_T>(iterations/10, 1);
+    for (INT64_T nI=0; nI<warmup && r.ok; nI++) {
+        r.ok = fn() ? 1 : 0;
+    }
+
+    double start = _bench_now_us();
+    for (INT64_T nI=0; nI<iterations && r.ok; nI++) {
+        r.ok = fn() ? 1 : 0;
+        r.iterations++;
+    }
+    r.totalUs = _bench_now_us() - start;
+
+    if ( !r.ok ) {
+        ctx->failures++;
+    }
+    fprintf(stderr, "%-24s %-40s %10.3f us/op%s\n", name, config.c_str(),
+            r.iterations ? r.totalUs/r.iterations : 0.0, r.ok ? "" : " FAILED");
+    ctx->results.push_back(r);
+}
+
+//-----------------------------------------------------------------------------
+// A picture of the given format with some texture in it; the sizes used are
+// multiples of 32, so the planes are laid out the same at any alignment
+static basic_frame_obj* _bench_alloc_picture       (int width, int height, int pixfmt)
+{
+    int dataSize = ( pixfmt == pfmtRGB24 || pixfmt == pfmtBGR24 ) ?
+                        width*height*3 :
+                        width*height + 2*((width+1)/2)*((height+1)/2);
+    basic_frame_obj* f = alloc_basic_frame(BENCH_MAGIC, dataSize, _bench_log);
+    f->keyframe = 1;
+    f->width = width;
+    f->height = height;
+    f->pixelFormat = pixfmt;
+    f->mediaType = mediaVideo;
+    f->dataSize = dataSize;
+    f->pts = f->dts = 0;
+    for (int nI=0; nI<dataSize; nI++) {
+        f->data[nI] = (uint8_t)(16 + ((nI + (nI>>11)) & 0x7f));
+    }
+    return f;
+}
+
+
+//-----------------------------------------------------------------------------
+// Repeat source: hands out the same frame, newly referenced, a set number of
+// times and then reports EOF. Stands in for a decoder at the head of the
+// graph, without the cost of one.
+//-----------------------------------------------------------------------------
+typedef struct repeat_source_stream : public stream_base {
+    frame_obj*          frame;
+    INT64_T             remaining;
+} repeat_source_stream;
+
+static stream_obj* repeat_stream_create            (const char* name);
+static int         repeat_stream_set_param         (stream_obj* stream,
+                                                    const CHAR_T* name,
+                                                    const void* value);
+static int         repeat_stream_get_param         (stream_obj* stream,
+                                                    const CHAR_T* name,
+                                                    void* value,
+                                                    size_t* size);
+static int         repeat_stream_open_in           (stream_obj* stream);
+static size_t      repeat_stream_get_width         (stream_obj* stream);
+static size_t      repeat_stream_get_height        (stream_obj* stream);
+static int         repeat_stream_get_pixel_format  (stream_obj* stream);
+static int         repeat_stream_read_frame        (stream_obj* stream, frame_obj** frame);
+static int         repeat_stream_close             (stream_obj* stream);
+static void        repeat_stream_destroy           (stream_obj* stream);
+
+//-----------------------------------------------------------------------------
+static stream_api_t _g_repeat_stream_provider = {
+    repeat_stream_create,
+    NULL, // set_source,
+    get_default_stream_api()->set_log_cb,
+    get_default_stream_api()->get_name,
+    get_default_stream_api()->find_element,
+    get_default_stream_api()->remove_element,
+    get_default_stream_api()->insert_element,
+    repeat_stream_set_param,
+    repeat_stream_get_param,
+    repeat_stream_open_in,
+    NULL, // seek
+    repeat_stream_get_width,
+    repeat_stream_get_height,
+    repeat_stream_get_pixel_format,
+    repeat_stream_read_frame,
+    get_default_stream_api()->print_pipeline,
+    repeat_stream_close,
+    _set_module_trace_level
+} ;
+
+//-----------------------------------------------------------------------------
+#define DECLARE_STREAM_REPEAT(stream, name) \
+    DECLARE_OBJ(repeat_source_stream, name,  stream, REPEAT_SOURCE_MAGIC, -1)
+
+#define DECLARE_STREAM_REPEAT_V(stream, name) \
+    DECLARE_OBJ_V(repeat_source_stream, name,  stream, REPEAT_SOURCE_MAGIC)
+
+static stream_obj*   repeat_stream_create          (const char* name)
+{
+    repeat_source_stream* res = (repeat_source_stream*)stream_init(sizeof(repeat_source_stream),
+                                        REPEAT_SOURCE_MAGIC,
+                                        &_g_repeat_stream_provider,
+                                        name,
+                                        repeat_stream_destroy );
+    res->frame = NULL;
+    res->remaining = 0;
+    return (stream_obj*)res;
+}
+
+//-----------------------------------------------------------------------------
+static int         repeat_stream_set_param         (stream_obj* stream,
+                                                    const CHAR_T* name,
+                                                    const void* value)
+{
+    DECLARE_STREAM_REPEAT(stream, repeat);
+    name = stream_param_name_apply_scope(stream, name);
+    if ( !_stricmp(name, "frame") ) {
+        frame_unref(&repeat->frame);
+        repeat->frame = (frame_obj*)value;
+        frame_ref(repeat->frame);
+        return 0;
+    }
+    SET_PARAM_IF(stream, name, "count", INT64_T, repeat->remaining);
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+static int         repeat_stream_get_param         (stream_obj* stream,
+                                                    const CHAR_T* name,
+                                                    void* value,
+                                                    size_t* size)
+{
+    DECLARE_STREAM_REPEAT(stream, repeat);
+    name = stream_param_name_apply_scope(stream, name);
+    COPY_PARAM_IF(repeat, name, "eof",            int,   repeat->remaining <= 0 ? 1 : 0);
+    COPY_PARAM_IF(repeat, name, "videoCodecId",   int,   streamBitmap);
+    COPY_PARAM_IF(repeat, name, "audioCodecId",   int,   streamUnknown);
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+static int         repeat_stream_open_in           (stream_obj* stream)
+{
+    DECLARE_STREAM_REPEAT(stream, repeat);
+    if ( repeat->frame == NULL ) {
+        repeat->logCb(logError, "Repeat source needs its frame set before opening");
+        return -1;
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static size_t      repeat_stream_get_width         (stream_obj* stream)
+{
+    DECLARE_STREAM_REPEAT(stream, repeat);
+    return repeat->frame ? frame_get_api(repeat->frame)->get_width(repeat->frame) : 0;
+}
+
+//-----------------------------------------------------------------------------
+static size_t      repeat_stream_get_height        (stream_obj* stream)
+{
+    DECLARE_STREAM_REPEAT(stream, repeat);
+    return repeat->frame ? frame_get_api(repeat->frame)->get_height(repeat->frame) : 0;
+}
+
+//-----------------------------------------------------------------------------
+static int         repeat_stream_get_pixel_format  (stream_obj* stream)
+{
+    DECLARE_STREAM_REPEAT(stream, repeat);
+    return repeat->frame ? frame_get_api(repeat->frame)->get_pixel_format(repeat->frame) : pfmtUndefined;
+}
+
+//-----------------------------------------------------------------------------
+static int         repeat_stream_read_frame        (stream_obj* stream, frame_obj** frame)
+{
+    DECLARE_STREAM_REPEAT(stream, repeat);
+    *frame = NULL;
+    if ( repeat->remaining <= 0 ) {
+        return 0;
+    }
+    repeat->remaining--;
+    frame_ref(repeat->frame);
+    *frame = repeat->frame;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static int         repeat_stream_close             (stream_obj* stream)
+{
+    DECLARE_STREAM_REPEAT(stream, repeat);
+    frame_unref(&repeat->frame);
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void        repeat_stream_destroy           (stream_obj* stream)
+{
+    DECLARE_STREAM_REPEAT_V(stream, repeat);
+    frame_unref(&repeat->frame);
+    stream_destroy( stream );
+}
+
+//-----------------------------------------------------------------------------
+// Repeat source feeding the filter; the source is owned by the filter from
+// here on. Returns the filter with a reference taken, or NULL.
+static stream_obj* _bench_open_filter              (stream_api_t* api,
+                                                    stream_obj* filter,
+                                                    basic_frame_obj* picture,
+                                                    INT64_T count)
+{
+    stream_obj* src = repeat_stream_create("source");
+
+    stream_ref(filter);
+    api->set_log_cb(filter, _bench_log);
+    _g_repeat_stream_provider.set_log_cb(src, _bench_log);
+    _g_repeat_stream_provider.set_param(src, "frame", picture);
+    _g_repeat_stream_provider.set_param(src, "count", &count);
+    api->set_source(filter, src, svFlagNone);
+    return filter;
+}
+
+//-----------------------------------------------------------------------------
+static void        _bench_close_filter             (stream_api_t* api,
+                                                    stream_obj** filter)
+{
+    if ( *filter ) {
+        api->close(*filter);
+        stream_unref(filter);
+    }
+}
+
+
+//-----------------------------------------------------------------------------
+// Microbenchmarks
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// Annex-B buffer: NALUs of random sizes, with payloads free of start codes
+static std::vector<uint8_t> _bench_make_annexb     (size_t size, int minNal, int maxNal)
+{
+    std::vector<uint8_t> res;
+    uint32_t             seed = 12345;
+
+    res.reserve(size + maxNal + 5);
+    while ( res.size() < size ) {
+        seed = seed*1103515245 + 12345;
+        int len = minNal + (int)((seed >> 8) % (uint32_t)(maxNal - minNal + 1));
+        res.push_back(0); res.push_back(0); res.push_back(0); res.push_back(1);
+        res.push_back(res.size() < 8 ? kNALIFrame : kNALCodedSlice);
+        for (int nI=0; nI<len; nI++) {
+            seed = seed*1103515245 + 12345;
+            uint8_t b = (uint8_t)(seed >> 16);
+            // a lone zero now and then keeps the scanner honest
+            res.push_back( (b == 0 && (nI&1)) ? 1 : b );
+        }
+    }
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+static void        _bench_nal_scan                 (bench_context* ctx)
+{
+    // a chunk of elementary stream, walked NALU by NALU
+    std::vector<uint8_t> es = _bench_make_annexb(8*1024*1024, 200, 6000);
+    _bench_run(ctx, "nal_find_next", "8MB, 200-6000B NALUs", _bench_iterations(ctx, 50),
+               (double)es.size(), [&]() {
+        uint8_t* p = es.data();
+        int      remaining = (int)es.size();
+        size_t   nalHdrSize;
+        uint8_t  nalType;
+        int      found = 0;
+        while ( (p = videolibapi_find_next_nal(p, &remaining, &nalHdrSize, &nalType, _bench_log)) != NULL ) {
+            p += nalHdrSize;
+            remaining -= (int)nalHdrSize;
+            found++;
+        }
+        return found > 0;
+    });
+
+    // one IDR packet as a camera sends it: SPS, PPS, SEI, then the slice
+    std::vector<uint8_t> pkt;
+    static const uint8_t kHeaders[] = { 0,0,0,1, kNALSPS, 0x64,0x00,0x1f,0xac,0xd9,
+                                        0,0,0,1, kNALPPS, 0xeb,0xe3,0xcb,
+                                        0,0,0,1, kNALSEI, 0x05,0x10,0x20 };
+    pkt.insert(pkt.end(), kHeaders, kHeaders + sizeof(kHeaders));
+    std::vector<uint8_t> slice = _bench_make_annexb(60*1024, 60*1024, 60*1024);
+    pkt.insert(pkt.end(), slice.begin(), slice.end());
+    _bench_run(ctx, "nal_scan_packet", "IDR packet, 60KB", _bench_iterations(ctx, 200000),
+               (double)pkt.size(), [&]() {
+        int      offsets[16];
+        int      sizes[16];
+        uint8_t  types[16];
+        return videolibapi_scan_nalus(pkt.data(), pkt.size(), 1, 16,
+                                      offsets, sizes, types, _bench_log) >= 4;
+    });
+}
+
+//-----------------------------------------------------------------------------
+static void        _bench_frame_allocator          (bench_context* ctx)
+{
+    static const struct {
+        const char* config;
+        size_t      size;
+    } kSizes[] = {
+        { "packet 4KB",             4*1024 },
+        { "720p YUV420P",           1280*720*3/2 },
+        { "1080p YUV420P",          1920*1080*3/2 },
+    };
+
+    frame_allocator* fa = create_frame_allocator("bench");
+    for (size_t nI=0; nI<sizeof(kSizes)/sizeof(kSizes[0]); nI++) {
+        size_t size = kSizes[nI].size;
+        _bench_run(ctx, "frame_pool", kSizes[nI].config, _bench_iterations(ctx, 200000), 0, [&]() {
+            basic_frame_obj* f = alloc_basic_frame2(BENCH_MAGIC, size, _bench_log, fa);
+            if ( f == NULL ) {
+                return false;
+            }
+            frame_unref((frame_obj**)&f);
+            return true;
+        });
+        _bench_run(ctx, "frame_unpooled", kSizes[nI].config, _bench_iterations(ctx, 20000), 0, [&]() {
+            basic_frame_obj* f = alloc_basic_frame2(BENCH_MAGIC, size, _bench_log, NULL);
+            if ( f == NULL ) {
+                return false;
+            }
+            frame_unref((frame_obj**)&f);
+            return true;
+        });
+    }
+    destroy_frame_allocator(&fa, _bench_log);
+}
+
+//-----------------------------------------------------------------------------
+static void        _bench_resize                   (bench_context* ctx)
+{
+    static const struct {
+        int         srcWidth, srcHeight, srcPixfmt;
+        int         dstWidth, dstHeight, dstPixfmt;
+        const char* config;
+    } kCases[] = {
+        { 1920, 1080, pfmtYUV420P,  640,  360, pfmtYUV420P, "1080p->360p YUV420P" },
+        { 1920, 1080, pfmtYUV420P,  640,  360, pfmtRGB24,   "1080p->360p YUV420P->RGB24" },
+        { 1280,  720, pfmtYUV420P,  320,  180, pfmtRGB24,   "720p->180p YUV420P->RGB24" },
+        { 1280,  720, pfmtYUV420P, 1280,  720, pfmtRGB24,   "720p YUV420P->RGB24" },
+        { 1280,  720, pfmtNV12,     640,  360, pfmtYUV420P, "720p->360p NV12->YUV420P" },
+    };
+
+    stream_api_t* api = get_resize_factory_api();
+    for (size_t nI=0; nI<sizeof(kCases)/sizeof(kCases[0]); nI++) {
+        INT64_T          iterations = _bench_iterations(ctx, 1000);
+        basic_frame_obj* picture = _bench_alloc_picture(kCases[nI].srcWidth, kCases[nI].srcHeight,
+                                                        kCases[nI].srcPixfmt);
+        stream_obj*      rsz = _bench_open_filter(api, api->create("resize"), picture,
+                                                  2*iterations + 1);
+        int              noSharing = 0;
+        char*            backend = NULL;
+        size_t           size = sizeof(backend);
+        std::string      config = kCases[nI].config;
+
+        api->set_param(rsz, "resize.width", &kCases[nI].dstWidth);
+        api->set_param(rsz, "resize.height", &kCases[nI].dstHeight);
+        api->set_param(rsz, "resize.pixfmt", &kCases[nI].dstPixfmt);
+        // every read is of the same source frame, which sharing would answer from cache
+        api->set_param(rsz, "resize.allowSharedResults", &noSharing);
+        if ( api->open_in(rsz) < 0 ) {
+            _bench_log(logError, _FMT("Failed to open the resize for " << config));
+            ctx->failures++;
+        } else {
+            _bench_run(ctx, "resize_factory", config, iterations,
+                       (double)picture->dataSize, [&]() {
+                frame_obj* out = NULL;
+                if ( api->read_frame(rsz, &out) < 0 || out == NULL ) {
+                    return false;
+                }
+                frame_unref(&out);
+                return true;
+            });
+            if ( api->get_param(rsz, "resize.backend", &backend, &size) >= 0 && backend != NULL &&
+                 !ctx->results.empty() && ctx->results.back().config == config ) {
+                ctx->results.back().config += std::string(" (") + backend + ")";
+            }
+        }
+        _bench_close_filter(api, &rsz);
+        frame_unref((frame_obj**)&picture);
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void        _bench_pixelate                 (bench_context* ctx)
+{
+    static const char* kFilters[] = { "usePixelate", "useBlur", "useFill", "useBox" };
+    static const struct {
+        int         pixfmt;
+        const char* name;
+    } kFormats[] = {
+        { pfmtYUV420P,  "YUV420P" },
+        { pfmtRGB24,    "RGB24" },
+    };
+    static const int kWidth = 1280, kHeight = 720;
+
+    stream_api_t* api = get_pixelate_filter_api();
+    for (size_t nF=0; nF<sizeof(kFormats)/sizeof(kFormats[0]); nF++) {
+        for (size_t nI=0; nI<sizeof(kFilters)/sizeof(kFilters[0]); nI++) {
+            INT64_T          iterations = _bench_iterations(ctx, 1000);
+            basic_frame_obj* picture = _bench_alloc_picture(kWidth, kHeight, kFormats[nF].pixfmt);
+            stream_obj*      pix = _bench_open_filter(api, api->create("pixelate"), picture,
+                                                      2*iterations + 1);
+            std::string      type;
+            std::string      config = std::string(kFilters[nI] + 3) + ", 720p " + kFormats[nF].name +
+                                      ", 4 boxes";
+            std::ostringstream meta;
+
+            api->set_param(pix, (std::string("pixelate.") + kFilters[nI]).c_str(), NULL);
+            type = kFilters[nI] + 3;
+            std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+            if ( type == "box" ) {
+                type = "boundingbox";
+            }
+            // four boxes of different sizes, in frame coordinates
+            meta << "type=" << type << ";duration=1000000;"
+                 << "40:40:320:180:" << kWidth << ":" << kHeight << ":2:1:red;"
+                 << "400:100:160:320:" << kWidth << ":" << kHeight << ":2:2:green;"
+                 << "640:360:480:300:" << kWidth << ":" << kHeight << ":2:3:blue;"
+                 << "100:500:96:96:" << kWidth << ":" << kHeight << ":2:4:yellow";
+            api->set_param(pix, "pixelate.metadata", meta.str().c_str());
+            if ( api->open_in(pix) < 0 ) {
+                _bench_log(logError, _FMT("Failed to open the filter for " << config));
+                ctx->failures++;
+            } else {
+                _bench_run(ctx, "pixelate", config, iterations,
+                           (double)picture->dataSize, [&]() {
+                    frame_obj* out = NULL;
+                    if ( api->read_frame(pix, &out) < 0 || out == NULL ) {
+                        return false;
+                    }
+                    frame_unref(&out);
+                    return true;
+                });
+            }
+            _bench_close_filter(api, &pix);
+            frame_unref((frame_obj**)&picture);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Frames through the thread connector: one iteration is a whole run of
+// kFrames, from the source thread to ours, so the us/op is per run
+static void        _bench_tc_queue                 (bench_context* ctx)
+{
+    static const int kFrames = 10000;
+
+    stream_api_t*    api = get_tc_api();
+    basic_frame_obj* picture = _bench_alloc_picture(320, 240, pfmtYUV420P);
+
+    for (int lockFree=0; lockFree<=1; lockFree++) {
+        std::string config = std::string(lockFree ? "lock-free" : "mutex") + " queue, " +
+                             std::to_string(kFrames) + " frames";
+        _bench_run(ctx, "tc_queue", config, _bench_iterations(ctx, 50), 0, [&]() {
+            stream_obj* tc = _bench_open_filter(api, api->create("tc"), picture, kFrames);
+            int         zero = 0;
+            int         queueSize = 64;
+            int         received = 0;
+            int         eof = 0;
+            size_t      size = sizeof(eof);
+
+            api->set_param(tc, "tc.lossy", &zero);
+            api->set_param(tc, "tc.maxQueueSize", &queueSize);
+            api->set_param(tc, "tc.lockFreeQueue", &lockFree);
+            if ( api->open_in(tc) < 0 ) {
+                _bench_close_filter(api, &tc);
+                return false;
+            }
+            while ( received < kFrames ) {
+                frame_obj* out = NULL;
+                if ( api->read_frame(tc, &out) < 0 ) {
+                    break;
+                }
+                if ( out != NULL ) {
+                    received++;
+                    frame_unref(&out);
+                } else if ( api->get_param(tc, "eof", &eof, &size) >= 0 && eof ) {
+                    break;
+                }
+            }
+            _bench_close_filter(api, &tc);
+            return received == kFrames;
+        });
+    }
+    frame_unref((frame_obj**)&picture);
+}
+
+
+#if SIGHTHOUND_VIDEO
+//-----------------------------------------------------------------------------
+// Pipeline benchmarks, over reference clips
+//-----------------------------------------------------------------------------
+static const int _kZero = 0;
+
+//-----------------------------------------------------------------------------
+static std::vector<std::string> _bench_find_clips  (const char* path)
+{
+    namespace fs = std::filesystem;
+    static const char* kExtensions[] = { ".mp4", ".mov", ".mkv", ".ts", ".avi" };
+
+    std::vector<std::string> res;
+    std::error_code          ec;
+    if ( !fs::is_directory(path, ec) ) {
+        res.push_back(path);
+        return res;
+    }
+    for ( const auto& it: fs::directory_iterator(path, ec) ) {
+        std::string ext = it.path().extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        for (size_t nI=0; nI<sizeof(kExtensions)/sizeof(kExtensions[0]); nI++) {
+            if ( ext == kExtensions[nI] && it.is_regular_file(ec) ) {
+                res.push_back(it.path().string());
+            }
+        }
+    }
+    std::sort(res.begin(), res.end());
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+static int         _bench_progress                 (int pct)
+{
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void        _bench_clip                     (bench_context* ctx, const std::string& filename)
+{
+    std::string  clip = std::filesystem::path(filename).filename().string();
+    INT64_T      iterations = ctx->shortRun ? 1 : 3;
+    int64_t*     msList = get_ms_list2(filename.c_str(), _bench_log);
+    int64_t      frames = msList ? msList[0] : 0;
+    double       fileSize = 0;
+    std::error_code ec;
+
+    if ( frames <= 0 ) {
+        _bench_log(logError, _FMT("No frames found in " << filename));
+        free_ms_list(&msList);
+        ctx->failures++;
+        return;
+    }
+    fileSize = (double)std::filesystem::file_size(filename, ec);
+
+    // every frame of the clip through demux and decoder
+    _bench_run(ctx, "decode", clip, iterations, fileSize, [&]() {
+        stream_api_t* api = get_ffmpeg_demux_api();
+        stream_obj*   demux = api->create("demux");
+        frame_obj*    frame = NULL;
+        int64_t       decoded = 0;
+
+        stream_ref(demux);
+        api->set_log_cb(demux, _bench_log);
+        APPEND_FILTER(api, demux, ffdec_stream_api, "decoder");
+        api->set_param(demux, "url", filename.c_str());
+        api->set_param(demux, "liveStream", &_kZero);
+        api->set_param(demux, "mmapAccess", "sequential");
+        if ( api->open_in(demux) >= 0 ) {
+            while ( api->read_frame(demux, &frame) >= 0 && frame != NULL ) {
+                if ( frame_get_api(frame)->get_media_type(frame) == mediaVideo ) {
+                    decoded++;
+                }
+                frame_unref(&frame);
+            }
+        }
+        api->close(demux);
+        stream_unref(&demux);
+        return decoded > 0;
+    });
+
+    // a scan of the file, then the same list again from the cache
+    _bench_run(ctx, "get_ms_list2", clip + ", uncached", iterations, fileSize, [&]() {
+        flush_clip_cache(filename.c_str());
+        int64_t* list = get_ms_list2(filename.c_str(), _bench_log);
+        bool     ok = list != NULL && list[0] == frames;
+        free_ms_list(&list);
+        return ok;
+    });
+    _bench_run(ctx, "get_ms_list2", clip + ", cached", _bench_iterations(ctx, 1000), 0, [&]() {
+        int64_t* list = get_ms_list2(filename.c_str(), _bench_log);
+        bool     ok = list != NULL && list[0] == frames;
+        free_ms_list(&list);
+        return ok;
+    });
+
+    // random access, as the timeline does it when scrubbing
+    {
+        static const int kSeeks = 20;
+        ClipStream* stream = open_clip(filename.c_str(), 320, 240, 0, 0, 0, 0, 0, 0,
+                                       0, NULL, 0, NULL, _bench_log);
+        uint32_t    seed = 12345;
+        if ( stream == NULL ) {
+            _bench_log(logError, _FMT("Failed to open " << filename));
+            ctx->failures++;
+        } else {
+            _bench_run(ctx, "get_frame_at", clip + ", 320x240", iterations*kSeeks, 0, [&]() {
+                seed = seed*1103515245 + 12345;
+                int64_t    ms = msList[1 + (seed >> 8) % frames];
+                ClipFrame* frame = (ClipFrame*)get_frame_at(stream, ms);
+                if ( frame == NULL ) {
+                    return false;
+                }
+                free_clip_frame(&frame);
+                return true;
+            });
+            free_clip_stream(&stream);
+        }
+    }
+
+    // an export of the first 10 seconds, with the default codec settings
+    {
+        std::string  outfile = (std::filesystem::temp_directory_path(ec) / "videolib_bench.mp4").string();
+        const char*  files[] = { filename.c_str() };
+        uint64_t     offsets[] = { 0 };
+        uint64_t     firstMs = (uint64_t)msList[1];
+        uint64_t     lastMs = (uint64_t)std::min<int64_t>(msList[frames], msList[1] + 10000);
+        CodecConfig  codecConfig;
+
+        memset(&codecConfig, 0, sizeof(codecConfig));
+        codecConfig.gop_size = 42;
+        codecConfig.keyint_min = 10;
+        codecConfig.preset = (char*)"ultrafast";
+        codecConfig.sv_profile = -1;
+        _bench_run(ctx, "create_clip", clip + ", first 10s", iterations, 0, [&]() {
+            uint64_t res = create_clip(1, files, offsets, firstMs, lastMs, outfile.c_str(),
+                                       &codecConfig, 0, 0, NULL, "mp4", 0,
+                                       _bench_log, _bench_progress);
+            std::filesystem::remove(outfile, ec);
+            return res != (uint64_t)-1;
+        });
+    }
+
+    free_ms_list(&msList);
+}
+#endif
+
+
+//-----------------------------------------------------------------------------
+// JSON output
+//-----------------------------------------------------------------------------
+static std::string _bench_json_str                 (const std::string& s)
+{
+    std::ostringstream res;
+    res << '"';
+    for (size_t nI=0; nI<s.length(); nI++) {
+        char c = s[nI];
+        if ( c == '"' || c == '\\' ) {
+            res << '\\' << c;
+        } else if ( (unsigned char)c < 0x20 ) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            res << buf;
+        } else {
+            res << c;
+        }
+    }
+    res << '"';
+    return res.str();
+}
+
+//-----------------------------------------------------------------------------
+static void        _bench_write_json               (bench_context* ctx, FILE* f)
+{
+    std::ostringstream out;
+    char               kernels[2048];
+    size_t             size = sizeof(kernels);
+
+    out << "{\n  \"benchmark\": \"videolib_bench\",\n"
+        << "  \"short\": " << (ctx->shortRun ? "true" : "false") << ",\n"
+        << "  \"kernels\": {";
+    // "<name>=<variant>" lines
+    if ( sv_cpu_get_kernels(kernels, &size) == 0 ) {
+        std::istringstream lines(kernels);
+        std::string        line;
+        const char*        sep = "";
+        while ( std::getline(lines, line) ) {
+            size_t eq = line.find('=');
+            if ( eq != std::string::npos ) {
+                out << sep << "\n    " << _bench_json_str(line.substr(0, eq)) << ": "
+                    << _bench_json_str(line.substr(eq+1));
+                sep = ",";
+            }
+        }
+    }
+    out << "\n  },\n  \"results\": [";
+    for (size_t nI=0; nI<ctx->results.size(); nI++) {
+        const bench_result& r = ctx->results[nI];
+        double usPerOp = r.iterations ? r.totalUs/r.iterations : 0;
+        out << (nI ? "," : "") << "\n    { "
+            << "\"name\": " << _bench_json_str(r.name) << ", "
+            << "\"config\": " << _bench_json_str(r.config) << ", "
+            << "\"ok\": " << (r.ok ? "true" : "false") << ", "
+            << "\"iterations\": " << r.iterations << ", "
+            << "\"totalMs\": " << r.totalUs/1000 << ", "
+            << "\"usPerOp\": " << usPerOp << ", "
+            << "\"opsPerSec\": " << (usPerOp > 0 ? 1000000/usPerOp : 0);
+        if ( r.bytesPerIteration > 0 && usPerOp > 0 ) {
+            out << ", \"mbPerSec\": " << r.bytesPerIteration/usPerOp;
+        }
+        out << " }";
+    }
+    out << "\n  ]\n}\n";
+    fputs(out.str().c_str(), f);
+}
+
+//-----------------------------------------------------------------------------
+static void        _bench_usage                    ()
+{
+    fprintf(stderr, "Usage: videolib_bench [--micro] [--pipeline <clip or directory>] [--short]\n"
+                    "                      [--filter <substring>] [--json <file>] [--verbose]\n");
+}
+
+//-----------------------------------------------------------------------------
+int main(int argc, char** argv)
+{
+    bench_context ctx;
+    int           micro = 0;
+    const char*   clips = NULL;
+    const char*   jsonPath = NULL;
+
+    ctx.shortRun = 0;
+    ctx.failures = 0;
+    for (int nI=1; nI<argc; nI++) {
+        if ( !strcmp(argv[nI], "--micro") ) {
+            micro = 1;
+        } else if ( !strcmp(argv[nI], "--pipeline") && nI+1 < argc ) {
+            clips = argv[++nI];
+        } else if ( !strcmp(argv[nI], "--short") ) {
+            ctx.shortRun = 1;
+        } else if ( !strcmp(argv[nI], "--filter") && nI+1 < argc ) {
+            ctx.filter = argv[++nI];
+        } else if ( !strcmp(argv[nI], "--json") && nI+1 < argc ) {
+            jsonPath = argv[++nI];
+        } else if ( !strcmp(argv[nI], "--verbose") ) {
+            _gVerbose = 1;
+        } else {
+            _bench_usage();
+            return 2;
+        }
+    }
+    if ( clips == NULL ) {
+        micro = 1;
+    }
+
+    stream_set_default_log_cb(_bench_log);
+
+    if ( micro ) {
+        _bench_nal_scan(&ctx);
+        _bench_frame_allocator(&ctx);
+        _bench_resize(&ctx);
+        _bench_pixelate(&ctx);
+        _bench_tc_queue(&ctx);
+    }
+    if ( clips ) {
+#if SIGHTHOUND_VIDEO
+        std::vector<std::string> files = _bench_find_clips(clips);
+        if ( files.empty() ) {
+            _bench_log(logError, _FMT("No reference clips in " << clips));
+            ctx.failures++;
+        }
+        for (size_t nI=0; nI<files.size(); nI++) {
+            _bench_clip(&ctx, files[nI]);
+        }
+#else
+        _bench_log(logError, "Pipeline benchmarks need the WITH_SV build of videolib");
+        ctx.failures++;
+#endif
+    }
+
+    FILE* f = jsonPath ? fopen(jsonPath, "w") : stdout;
+    if ( f == NULL ) {
+        _bench_log(logError, _FMT("Failed to open " << jsonPath));
+        return 1;
+    }
+    _bench_write_json(&ctx, f);
+    if ( f != stdout ) {
+        fclose(f);
+    }
+    return ctx.failures ? 1 : 0;
+}
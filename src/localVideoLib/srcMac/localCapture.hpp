@@ -78,7 +78,7 @@
     AVCaptureVideoDataOutput *_videoDeviceOutput;
 
     /**
-     Stores an Objective-C Mutex that prevents the |framePixelBuffer| from being read from and written to at the same time.
+     Stores an Objective-C Mutex that prevents the |latestImageBuffer| from being read from and written to at the same time.
      */
     NSLock *_nsLock;
 
@@ -92,9 +92,10 @@
     size_t _frameBufferPixelDataSize;
 
     /**
-     Address to the current frame data. Specifically, it's a pointer to the first byte data in |frameData| object.
+     The most recent frame, as the capture device delivered it. It's retained rather than copied, so that frames
+     nobody asks for aren't copied at all, and the ones that are get copied once, straight to where they're needed.
      */
-    unsigned char *_framePixelBuffer;
+    CVImageBufferRef _latestImageBuffer;
 
     /**
      Stores the ready state of the frame. 1 if the frame is ready to be copied/viewed, 0 otherwise.
@@ -215,11 +216,13 @@
 
 
 /**
- Returns a pointer to the current video frame from the capture device.
+ Copies the current video frame from the capture device. The frame must be locked with |lockFrame|.
 
- @return pointer to the first byte data in the video frame.
+ @param dst A pre-allocated buffer of at least |getPixelDataSize| bytes.
+
+ @return Number of bytes copied; 0 if there is no frame.
  */
-- (unsigned char*)  getPixels;
+- (long)            copyPixels:(unsigned char*)dst;
 
 
 /**
@@ -50,7 +50,7 @@ using namespace std;
 @property (retain) NSLock *nsLock;
 @property (assign) dispatch_queue_t frameQueue;
 @property (assign) size_t frameBufferPixelDataSize;
-@property (assign) unsigned char *framePixelBuffer;
+@property (assign) CVImageBufferRef latestImageBuffer;
 @property (assign) int frameWidth;
 @property (assign) int frameHeight;
 
@@ -65,7 +65,7 @@ using namespace std;
 @synthesize nsLock = _nsLock;
 @synthesize frameQueue = _frameQueue;
 @synthesize frameBufferPixelDataSize = _frameBufferPixelDataSize;
-@synthesize framePixelBuffer = _framePixelBuffer;
+@synthesize latestImageBuffer = _latestImageBuffer;
 @synthesize isFrameUpdated = _isFrameUpdated;
 @synthesize frameWidth = _frameWidth;
 @synthesize frameHeight = _frameHeight;
@@ -81,10 +81,10 @@ using namespace std;
     [self setVideoDeviceInput:nil];
     [self setVideoDeviceOutput:nil];
     [self setNsLock:nil];
-    if ([self framePixelBuffer]) {
-        free([self framePixelBuffer]);
+    if ([self latestImageBuffer]) {
+        CFRelease([self latestImageBuffer]);
     }
-    [self setFramePixelBuffer:NULL];
+    [self setLatestImageBuffer:NULL];
     [self setIsFrameUpdated:0];
     [self setFrameWidth:0];
     [self setFrameHeight:0];
@@ -503,10 +503,30 @@ using namespace std;
     return err;
 }
 
-- (unsigned char*) getPixels
+- (long) copyPixels:(unsigned char*)dst
 
 {
-    return [self framePixelBuffer];
+    CVImageBufferRef imageBuffer = [self latestImageBuffer];
+    if (!imageBuffer) {
+        return 0;
+    }
+
+    CVPixelBufferLockBaseAddress(imageBuffer, kCVPixelBufferLock_ReadOnly);
+    size_t bytesPerRow = CVPixelBufferGetBytesPerRow(imageBuffer);
+    size_t height = CVPixelBufferGetHeight(imageBuffer);
+    size_t rowSize = CVPixelBufferGetWidth(imageBuffer)*2; // yuvs is 2 bytes per pixel
+    const unsigned char *src = (const unsigned char*)CVPixelBufferGetBaseAddress(imageBuffer);
+
+    // Rows may be padded in the pixel buffer; they aren't in the copy.
+    if (bytesPerRow == rowSize) {
+        memcpy(dst, src, rowSize*height);
+    } else {
+        for (size_t y = 0; y < height; y++) {
+            memcpy(dst + y*rowSize, src + y*bytesPerRow, rowSize);
+        }
+    }
+    CVPixelBufferUnlockBaseAddress(imageBuffer, kCVPixelBufferLock_ReadOnly);
+    return (long)(rowSize*height);
 }
 
 - (int) lockFrame
@@ -598,23 +618,10 @@ using namespace std;
     // Cast the |sampleBuffer| to a |CVImageBufferRef| to retrieve video frame info.
     CVImageBufferRef imageBuffer = CMSampleBufferGetImageBuffer(sampleBuffer);
 
-    // Take ownership of sampleBuffer and imageBuffer, in case their original owners don't want them anymore.
-    CFRetain(sampleBuffer);
-    CFRetain(imageBuffer);
-
-    // Lock the base address of the pixel buffer.
-    CVPixelBufferLockBaseAddress(imageBuffer,0);
-
-    // Get the number of bytes per row for the pixel buffer. This value is ( width * numBytesPerPixel ) with padding.
-    size_t bytesPerRow = CVPixelBufferGetBytesPerRow(imageBuffer);
-
     // Get the pixel buffer width and height.
     size_t width = CVPixelBufferGetWidth(imageBuffer);
     size_t height = CVPixelBufferGetHeight(imageBuffer);
 
-    // Get the base address of the pixel buffer.
-    void *baseAddress = CVPixelBufferGetBaseAddress(imageBuffer);
-
     // If the frame dimensions don't match the desired dimensions, return.
     // That means the capture device is not set to the right dimensions yet. After a few
     // frame captures, however, it will be set to the correct dimensions.  This happens
@@ -622,43 +629,24 @@ using namespace std;
     // it can be changed. Therefore, the first 2 or 3 frames are usually the default size.
     // After that, they should be the right size.
     if (([self frameWidth] != width) || ([self frameHeight] != height)) {
-        goto endCaptureOutput;
+        return;
     }
 
-    // Get the data size for contiguous planes of the pixel buffer.
-    //size_t bufferSize = CVPixelBufferGetDataSize(imageBuffer);
-
-    // Cache the frame buffer data size.
-    [self setFrameBufferPixelDataSize:(bytesPerRow*height)];
-
-    // If |_framePixelBuffer| is NULL, then allocate the space needed to store the frame.
-    if (![self framePixelBuffer]) {
-        [self setFramePixelBuffer: (unsigned char*) malloc (bytesPerRow*height)];
-        // If |malloc| returns NULL, return, since the frame won't be ready.
-        if (![self framePixelBuffer]) {
-            goto endCaptureOutput;
-        }
-    }
+    // Cache the frame data size, as |copyPixels| packs it: yuvs is 2 bytes per pixel.
+    [self setFrameBufferPixelDataSize:(width*2*height)];
 
     if ([self lockFrame]) {
-        // Copy the buffer into |_framePixelBuffer|.
-        memcpy([self framePixelBuffer], baseAddress, bytesPerRow*height);
+        // Keep the frame, in place of the previous one; it's only copied if it's asked for.
+        // Holding one buffer of the capture pool doesn't starve it.
+        CFRetain(imageBuffer);
+        if ([self latestImageBuffer]) {
+            CFRelease([self latestImageBuffer]);
+        }
+        [self setLatestImageBuffer:imageBuffer];
         // Set |isFrameUpdated| so that the frame can be accessed.
         [self setIsFrameUpdated:1];
         [self unLockFrame];
     }
-
-    // This label is here so that when
-    // an error occurs, we can jump here,
-    // cleanup, and return quickly.
-    endCaptureOutput:
-
-    // Unlock the buffer.
-    CVPixelBufferUnlockBaseAddress(imageBuffer, 0);
-
-    // Release sampleBuffer and imageBuffer.
-    CFRelease(imageBuffer);
-    CFRelease(sampleBuffer);
 }
 
 @end
\ No newline at end of file
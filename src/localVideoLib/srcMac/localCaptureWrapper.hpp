@@ -157,13 +157,14 @@ OSErr           lcwStopGrabbing(LocalCaptureHandler lch);
 
 
 /**
- Returns a pointer to the current video frame from the capture device.
+ Copies the current video frame from the capture device. The frame must be locked with |lcwLockFrame|.
 
  @param lch The Local Capture Handler.
+ @param dst A pre-allocated buffer of at least |lcwGetPixelDataSize| bytes.
 
- @return pointer to the first byte data in the video frame.
+ @return Number of bytes copied; 0 if there is no frame.
  */
-unsigned char*  lcwGetPixels(LocalCaptureHandler lch);
+long            lcwCopyPixels(LocalCaptureHandler lch, unsigned char* dst);
 
 
 /**
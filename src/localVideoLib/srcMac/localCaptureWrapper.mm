@@ -124,10 +124,10 @@ OSErr lcwStopGrabbing(LocalCaptureHandler lch)
     return [((LocalCaptureData*)lch)->localCapture stopGrabbing];
 }
 
-unsigned char* lcwGetPixels(LocalCaptureHandler lch)
+long lcwCopyPixels(LocalCaptureHandler lch, unsigned char* dst)
 
 {
-    return [((LocalCaptureData*)lch)->localCapture getPixels];
+    return [((LocalCaptureData*)lch)->localCapture copyPixels:dst];
 }
 
 int lcwLockFrame(LocalCaptureHandler lch)
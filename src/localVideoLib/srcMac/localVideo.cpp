@@ -81,6 +81,12 @@ static int deviceResolutions[kMaxCameras][kMaxResolutions][2]={{{0}}};
 // Cached supported resolution pair
 static Dimensions dimensions;
 
+// Native capture, without the conversions lvlGetPixels may make
+extern "C" {
+SVLVL_API int  lvlGetNativePixelFormat();
+SVLVL_API BOOL lvlGetNativePixels(LocalVideoHandle h, int deviceID, unsigned char* pixels);
+}
+
 /***********************************************************/
 
 /*
@@ -669,6 +675,17 @@ SVLVL_API int lvlGetPixelFormat()
     //return PIX_FMT_RGB24;
 }
 
+SVLVL_API int lvlGetNativePixelFormat()
+{
+    // the server captures yuvs, which lvlGetPixels doesn't convert
+    return PIXEL_FORMAT_YUYV422;
+}
+
+SVLVL_API BOOL lvlGetNativePixels (LocalVideoHandle h, int deviceID, unsigned char* pixels)
+{
+    return lvlGetPixels(h, deviceID, pixels, FALSE, FALSE);
+}
+
 SVLVL_API BOOL lvlIsFrameNew(LocalVideoHandle h, int deviceID)
 {
     ((isFrameNewParamsT*)gMapAddr)->deviceID = deviceID;
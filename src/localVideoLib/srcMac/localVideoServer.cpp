@@ -258,10 +258,13 @@ BOOL LVS_getPixels (LocalVideoHandle lvlH, int deviceID, unsigned char* pixels,
                 continue;
             }
             if (isUpdated && lcwLockFrame(data->lch)) {
-                memcpy(pixels, lcwGetPixels(data->lch), lcwGetPixelDataSize(data->lch));
+                // straight from the capture buffer into the shared map
+                long copied = lcwCopyPixels(data->lch, pixels);
                 lcwUnSetIsFrameUpdated(data->lch);
                 lcwUnLockFrame(data->lch);
-                return TRUE;
+                if (copied > 0) {
+                    return TRUE;
+                }
             }
             else {
                 attempts += 1;
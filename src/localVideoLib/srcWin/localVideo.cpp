@@ -42,6 +42,16 @@
 // Cached supported resolution pair
 static Dimensions dimensions;
 
+#ifndef PIXEL_FORMAT_BGR24
+#define PIXEL_FORMAT_BGR24 3    // as in libavutil/pixfmt.h
+#endif
+
+// Native capture, without the conversions lvlGetPixels makes
+extern "C" {
+SVLVL_API int  lvlGetNativePixelFormat();
+SVLVL_API BOOL lvlGetNativePixels(LocalVideoHandle lvlH, int deviceID, unsigned char* pixels);
+}
+
 SVLVL_API LocalVideoHandle lvlNew(log_fn_t logFn, const char* unused)
 {
     videoInput* v = new videoInput(logFn);
@@ -125,6 +135,18 @@ SVLVL_API int lvlGetPixelFormat()
     return PIXEL_FORMAT_RGB24;
 }
 
+SVLVL_API int lvlGetNativePixelFormat()
+{
+    // what DirectShow delivers, before getPixels swaps red and blue
+    return PIXEL_FORMAT_BGR24;
+}
+
+SVLVL_API BOOL lvlGetNativePixels (LocalVideoHandle lvlH, int deviceID, unsigned char* pixels)
+{
+    videoInput* v = (videoInput*)lvlH;
+    return (BOOL)v->getNativePixels(deviceID, pixels);
+}
+
 SVLVL_API BOOL lvlIsFrameNew(LocalVideoHandle lvlH, int deviceID)
 {
     videoInput* v = (videoInput*)lvlH;
@@ -240,6 +240,10 @@ public:
 		bufferSetup 		= false;
 		newFrame			= false;
 		latestBufferLength 	= 0;
+		nativeOnly			= false;
+		target				= NULL;
+		targetFilled		= false;
+		rowBytes			= 0;
 
 		hEvent = CreateEvent(NULL, true, false, NULL);
 	}
@@ -293,12 +297,23 @@ public:
     	if(hr == S_OK){
 	    	latestBufferLength = pSample->GetActualDataLength();
 	      	if(latestBufferLength == numBytes){
+				bool filled = false;
 				EnterCriticalSection(&critSection);
-	      			memcpy(pixels, ptrBuffer, latestBufferLength);
-					newFrame	= true;
+					if(target != NULL){
+						//straight into the waiting consumer's buffer, as it goes
+						//downstream: top-down rows, no other conversion
+						copyRowsFlipped(target, ptrBuffer);
+						target			= NULL;
+						targetFilled	= true;
+						filled			= true;
+					}else if(!nativeOnly){
+		      			memcpy(pixels, ptrBuffer, latestBufferLength);
+						newFrame	= true;
+						filled		= true;
+					}
 					freezeCheck = 1;
 				LeaveCriticalSection(&critSection);
-				SetEvent(hEvent);
+				if(filled) SetEvent(hEvent);
 			}else{
 				log_err(logFn, "ERROR: SampleCB() - buffer sizes do not match\n");
 			}
@@ -313,8 +328,23 @@ public:
     	return E_NOTIMPL;
     }
 
+	//DIBs are bottom-up
+	void copyRowsFlipped(unsigned char * dst, const unsigned char * src){
+		int rows = rowBytes > 0 ? numBytes / rowBytes : 0;
+		for(int y = 0; y < rows; y++){
+			memcpy(dst + y * rowBytes, src + (rows - y - 1) * rowBytes, rowBytes);
+		}
+	}
+
 	int freezeCheck;
 
+	//native capture: the consumer's buffer for the next sample, if it's waiting
+	//for one, and whether frames nobody waits for need to be kept at all
+	bool nativeOnly;
+	unsigned char * target;
+	bool targetFilled;
+	int rowBytes;
+
 	int latestBufferLength;
 	int numBytes;
 	bool newFrame;
@@ -1207,6 +1237,57 @@ bool videoInput::getPixels(int id, unsigned char * dstBuffer, bool flipRedAndBlu
 }
 
 
+// ----------------------------------------------------------------------
+// Fills a supplied buffer with the next frame as the device delivers it,
+// BGR24 top-down, copying it once: callback samples go straight into the
+// buffer, and frames that arrive while nobody waits aren't copied at all.
+// ----------------------------------------------------------------------
+
+bool videoInput::getNativePixels(int id, unsigned char * dstBuffer, int timeoutMs){
+
+	if(!isDeviceSetup(id)) return false;
+
+	int width  = VDList[id]->width;
+	int height = VDList[id]->height;
+
+	if(bCallback){
+		SampleGrabberCallback * cb = VDList[id]->sgCallback;
+		bool success;
+
+		EnterCriticalSection(&cb->critSection);
+			//before the callback can see the buffer, and signal it's filled
+			ResetEvent(cb->hEvent);
+			cb->nativeOnly		= true;
+			cb->rowBytes		= width * 3;
+			cb->newFrame		= false;
+			cb->target			= dstBuffer;
+			cb->targetFilled	= false;
+		LeaveCriticalSection(&cb->critSection);
+
+		WaitForSingleObject(cb->hEvent, timeoutMs);
+
+		EnterCriticalSection(&cb->critSection);
+			success				= cb->targetFilled;
+			cb->target			= NULL;
+			cb->targetFilled	= false;
+		LeaveCriticalSection(&cb->critSection);
+		ResetEvent(cb->hEvent);
+
+		return success;
+	}
+
+	//regular capture method
+	long bufferSize = VDList[id]->videoSize;
+	HRESULT hr = VDList[id]->pGrabber->GetCurrentBuffer(&bufferSize, (long *)VDList[id]->pBuffer);
+	if(hr != S_OK || bufferSize != VDList[id]->videoSize){
+		log_warn(logFn, "ERROR: getNativePixels() - Unable to grab frame for device %i\n", id);
+		return false;
+	}
+	processPixels((unsigned char *)VDList[id]->pBuffer, dstBuffer, width, height, false, true);
+	return true;
+}
+
+
 // ----------------------------------------------------------------------
 // Returns a buffer
 // ----------------------------------------------------------------------
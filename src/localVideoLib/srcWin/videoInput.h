@@ -338,6 +338,10 @@ class videoInput{
 		//Or pass in a buffer for getPixels to fill returns true if successful.
 		bool getPixels(int id, unsigned char * pixels, bool flipRedAndBlue = true, bool flipImage = false);
 
+		//Waits for the next frame and fills the buffer with it as BGR, top-down - one copy,
+		//and none of the frames nobody asks for. Don't mix with getPixels on a device.
+		bool getNativePixels(int id, unsigned char * pixels, int timeoutMs = 1000);
+
 		//Launches a pop up settings window
 		//For some reason in GLUT you have to call it twice each time.
 		void showSettingsWindow(int deviceID);
@@ -32,9 +32,18 @@
  *****************************************************************************/
 
 #include "buffered_file.h"
+#include "sv_os.h"
+#include "sv_internal.h"
 #include <iostream>
+#include <cstdio>
 #include <cstring>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <thread>
 
 //------------------------------------------------------------------------------
 using std::vector;
@@ -51,6 +60,50 @@ using std::ofstream;
 
 #define BUFFERED_FILE_DEBUG 0
 
+// RAM all in-memory files may use between them, before they start spilling to disk
+#define BUFFERED_FILE_BUDGET_VAR "SV_BUFFERED_FILE_BUDGET_MB"
+static const int kDefaultBudgetMb = 512;
+// past this multiple of the budget, writers spill on their own rather than
+// waiting for the background spiller to catch up
+static const int kHardLimitFactor = 2;
+// background spiller stops once usage is back under this percentage of the budget
+static const int kSpillLowWaterPct = 90;
+
+class BufferedFile;
+
+//------------------------------------------------------------------------------
+// Chunks shared by all the in-memory files of the process. Chunks of closed
+// files are kept for the next ones, as long as the total stays within the
+// budget. When the budget is exceeded, the spiller thread moves the oldest data
+// of the largest file to disk.
+class ChunkPool
+{
+public:
+    static ChunkPool&           instance();
+
+    // returns nullptr if the chunk size doesn't match the pool's
+    char*                       acquire(int size, bool& overHardLimit);
+    void                        release(char* chunk, int size);
+
+    void                        registerFile(BufferedFile* file);
+    void                        unregisterFile(BufferedFile* file);
+
+private:
+    ChunkPool();
+    void                        _spillerThread();
+
+private:
+    std::mutex                  mMutex;
+    std::condition_variable     mCond;
+    std::list<BufferedFile*>    mFiles;
+    std::thread*                mSpiller;
+    vector<char*>               mFree;
+    int                         mChunkSize;
+    size_t                      mBudget;            // in chunks
+    size_t                      mInUse;             // in chunks
+    BufferedFile*               mSpilling;          // file the spiller is working on
+};
+
 //------------------------------------------------------------------------------
 class BufferedFile : public IBufferedFile
 {
@@ -80,6 +133,14 @@ public:
 
     // save the contents to stream
     bool                        save(std::ostream& os);
+
+    // number of chunks held in memory; called by the pool with its lock held,
+    // so it mustn't take ours: writers take the pool's lock with ours held
+    size_t                      residentChunks() const;
+
+    // moves the oldest chunk (other than the one being written) to disk;
+    // called by the pool. Returns false if there was nothing to move.
+    bool                        spillChunk();
 private:
     // save the current buffer and allocate a fresh one
     bool _allocBuffer();
@@ -87,20 +148,165 @@ private:
     // write to the current buffer, return number of bytes written
     int _writeToBuffer(char* ptr, int size);
 
+    bool _spillChunkLocked();
+    bool _openSpillFile();
+    bool _readSpilled(int chunk, char* dst, int size);
+    bool _writeSpilled(int chunk, int offset, const char* src, int size);
+    // size of the data in the chunk
+    int  _chunkSize(int chunk) const;
+    void _freeBuffers();
+    // move every chunk to disk, without writing anything
+    void _releaseResident();
+
 private:
     std::string                 mName;              // ID of the file object
 #if BUFFERED_FILE_DEBUG
     std::ostream&               mLog;
 #endif
+    std::mutex                  mMutex;             // spills happen on another thread
     int                         mBufferSize;        // size of each chunk
     int                         mMaxSize;           // maximum allocation size
     int                         mLastWrittenPos;    // size of file
     int                         mWritePos;          // current writing position
     bool                        mInvalidState;      // error flag
-    BufferContainer             mBuffers;           // actual buffers with data
+    BufferContainer             mBuffers;           // actual buffers with data; nullptr if spilled
+    std::atomic<size_t>         mResident;          // non-null entries of mBuffers; changed under mMutex
+    std::string                 mSpillName;
+    bool                        mSpillOwned;        // remove the spill file when done
+    FILE*                       mSpillFile;         // chunk N is at N*mBufferSize
     void*                       mOpaque;            // opaque value for the benefit of consumer
 };
 
+//------------------------------------------------------------------------------
+static bool _seekFile(FILE* f, int64_t pos)
+{
+#ifdef _WIN32
+    return _fseeki64(f, pos, SEEK_SET) == 0;
+#else
+    return fseeko(f, pos, SEEK_SET) == 0;
+#endif
+}
+
+//------------------------------------------------------------------------------
+ChunkPool& ChunkPool::instance()
+{
+    // never destroyed: the spiller may still be running when statics go away
+    static ChunkPool* gPool = new ChunkPool();
+    return *gPool;
+}
+
+//------------------------------------------------------------------------------
+ChunkPool::ChunkPool()
+    : mSpiller ( nullptr )
+    , mChunkSize ( 1024*1024 )
+    , mInUse ( 0 )
+    , mSpilling ( nullptr )
+{
+    mBudget = (size_t)max(1, sv_get_int_env_var(BUFFERED_FILE_BUDGET_VAR, kDefaultBudgetMb));
+}
+
+//------------------------------------------------------------------------------
+char* ChunkPool::acquire(int size, bool& overHardLimit)
+{
+    overHardLimit = false;
+    if ( size != mChunkSize ) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> guard(mMutex);
+    char* res;
+    if ( !mFree.empty() ) {
+        res = mFree.back();
+        mFree.pop_back();
+    } else {
+        res = new char[size];
+        sv_memory_charge(SV_MEMORY_FILES, 0, size);
+    }
+    mInUse++;
+    if ( mInUse > mBudget ) {
+        if ( mSpiller == nullptr ) {
+            mSpiller = new std::thread(&ChunkPool::_spillerThread, this);
+            mSpiller->detach();
+        }
+        mCond.notify_all();
+        overHardLimit = ( mInUse > mBudget*kHardLimitFactor );
+    }
+    return res;
+}
+
+//------------------------------------------------------------------------------
+void ChunkPool::release(char* chunk, int size)
+{
+    if ( size != mChunkSize ) {
+        delete [] chunk;
+        sv_memory_charge(SV_MEMORY_FILES, 0, -(int64_t)size);
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(mMutex);
+    mInUse--;
+    if ( mInUse + mFree.size() < mBudget &&
+         sv_memory_get_pressure() == SV_MEMORY_PRESSURE_NONE ) {
+        mFree.push_back(chunk);
+    } else {
+        delete [] chunk;
+        sv_memory_charge(SV_MEMORY_FILES, 0, -(int64_t)size);
+    }
+}
+
+//------------------------------------------------------------------------------
+void ChunkPool::registerFile(BufferedFile* file)
+{
+    std::lock_guard<std::mutex> guard(mMutex);
+    mFiles.push_back(file);
+}
+
+//------------------------------------------------------------------------------
+void ChunkPool::unregisterFile(BufferedFile* file)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    // can't go away while the spiller is using it
+    mCond.wait(lock, [&] { return mSpilling != file; });
+    mFiles.remove(file);
+}
+
+//------------------------------------------------------------------------------
+void ChunkPool::_spillerThread()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while ( true ) {
+        mCond.wait(lock, [&] { return mInUse > mBudget; });
+
+        while ( mInUse*100 > mBudget*kSpillLowWaterPct ) {
+            BufferedFile* victim = nullptr;
+            size_t        victimSize = 0;
+            for ( auto file : mFiles ) {
+                size_t resident = file->residentChunks();
+                if ( resident > victimSize ) {
+                    victim = file;
+                    victimSize = resident;
+                }
+            }
+            if ( victim == nullptr || victimSize <= 1 ) {
+                // each file is down to the chunk it's writing to
+                break;
+            }
+
+            // the victim is only called into without our lock: its writers
+            // come to us with theirs held
+            mSpilling = victim;
+            lock.unlock();
+            bool spilled = victim->spillChunk();
+            lock.lock();
+            mSpilling = nullptr;
+            mCond.notify_all();
+            if ( !spilled ) {
+                break;
+            }
+        }
+    }
+}
+
 SVCORE_API IBufferedFile* _CreateBufferedFile( const std::string& name,
                 int bufferSize,
                 int maxSize)
@@ -119,17 +325,51 @@ BufferedFile::BufferedFile(const std::string& name, int bufferSize, int maxSize
     , mLastWrittenPos ( 0 )
     , mWritePos ( 0 )
     , mInvalidState( false )
+    , mResident ( 0 )
+    , mSpillName ( name + ".spill" )
+    , mSpillOwned ( true )
+    , mSpillFile ( nullptr )
     , mOpaque ( nullptr )
 {
     _LOG ( "=====================" );
+    ChunkPool::instance().registerFile(this);
 }
 
 //------------------------------------------------------------------------------
 BufferedFile::~BufferedFile()
+{
+    ChunkPool::instance().unregisterFile(this);
+    _freeBuffers();
+    if ( mSpillFile != nullptr ) {
+        fclose(mSpillFile);
+        if ( mSpillOwned ) {
+            remove(mSpillName.c_str());
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+void BufferedFile::_freeBuffers()
 {
     for ( auto ptr : mBuffers ) {
-        delete [] ptr;
+        if ( ptr != nullptr ) {
+            ChunkPool::instance().release(ptr, mBufferSize);
+        }
+    }
+    mBuffers.clear();
+    mResident = 0;
+}
+
+//------------------------------------------------------------------------------
+void BufferedFile::_releaseResident()
+{
+    for ( auto& ptr : mBuffers ) {
+        if ( ptr != nullptr ) {
+            ChunkPool::instance().release(ptr, mBufferSize);
+            ptr = nullptr;
+        }
     }
+    mResident = 0;
 }
 
 //------------------------------------------------------------------------------
@@ -154,6 +394,7 @@ const std::string&          BufferedFile::getName() const
 // seek to a position in the file, but not beyond EOF
 int64_t                     BufferedFile::seek(int64_t relPos, int dir)
 {
+    std::lock_guard<std::mutex> guard(mMutex);
     _LOG ("Seeking to pos=" << relPos << " dir=" << dir );
     int64_t pos;
     switch (dir)
@@ -176,6 +417,7 @@ int64_t                     BufferedFile::seek(int64_t relPos, int dir)
 // write to the current position in the buffer
 bool                        BufferedFile::write(char* data, size_t size)
 {
+    std::lock_guard<std::mutex> guard(mMutex);
     _LOG( "Writing at pos=" << mWritePos << " size=" << size );
 
     // we should use buffers larger than any possible single write
@@ -206,9 +448,19 @@ bool BufferedFile::_allocBuffer()
     if ( mBufferSize*mBuffers.size() >= mMaxSize ) {
         return false;
     }
-    char* newBuffer = new char[mBufferSize];
+    bool  overHardLimit;
+    char* newBuffer = ChunkPool::instance().acquire(mBufferSize, overHardLimit);
+    if ( newBuffer == nullptr ) {
+        newBuffer = new char[mBufferSize];
+        sv_memory_charge(SV_MEMORY_FILES, 0, mBufferSize);
+    }
     if ( newBuffer != nullptr ) {
         mBuffers.push_back(newBuffer);
+        mResident++;
+        if ( overHardLimit ) {
+            // spiller can't keep up; do our share here
+            _spillChunkLocked();
+        }
         return true;
     }
     return false;
@@ -237,21 +489,137 @@ int BufferedFile::_writeToBuffer(char* ptr, int size)
     int written = 0;
     written = min(mBufferSize - offsetInBuffer, size);
     if ( written > 0 ) {
-        _LOG( "About to memcpy " << written << " at offset " << offsetInBuffer << " buffer " << (void*) buffer << " size " << mBufferSize );
-        memcpy(&buffer[offsetInBuffer], ptr, written);
+        if ( buffer == nullptr ) {
+            // muxer going back to fix up something that's already on disk
+            if ( !_writeSpilled(currentBuffer, offsetInBuffer, ptr, written) ) {
+                return 0;
+            }
+        } else {
+            _LOG( "About to memcpy " << written << " at offset " << offsetInBuffer << " buffer " << (void*) buffer << " size " << mBufferSize );
+            memcpy(&buffer[offsetInBuffer], ptr, written);
+        }
         mWritePos += written;
         mLastWrittenPos = max( mWritePos, mLastWrittenPos );
     }
     return written;
 }
 
+//------------------------------------------------------------------------------
+size_t BufferedFile::residentChunks() const
+{
+    return mResident.load(std::memory_order_relaxed);
+}
+
+//------------------------------------------------------------------------------
+bool BufferedFile::spillChunk()
+{
+    std::lock_guard<std::mutex> guard(mMutex);
+    return _spillChunkLocked();
+}
+
+//------------------------------------------------------------------------------
+bool BufferedFile::_spillChunkLocked()
+{
+    // the last chunk is still being written to
+    if ( mInvalidState || mResident <= 1 ) {
+        return false;
+    }
+
+    int chunk = 0;
+    while ( mBuffers[chunk] == nullptr ) {
+        chunk++;
+    }
+    if ( chunk >= (int)mBuffers.size()-1 ) {
+        return false;
+    }
+
+    if ( !_writeSpilled(chunk, 0, mBuffers[chunk], mBufferSize) ) {
+        // stay in memory; it's still a valid file
+        return false;
+    }
+    _LOG( "Spilled chunk " << chunk << " of " << mName );
+    ChunkPool::instance().release(mBuffers[chunk], mBufferSize);
+    mBuffers[chunk] = nullptr;
+    mResident--;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+bool BufferedFile::_openSpillFile()
+{
+    if ( mSpillFile == nullptr ) {
+        mSpillFile = sv_open_file(mSpillName.c_str(), "w+b");
+    }
+    return mSpillFile != nullptr;
+}
+
+//------------------------------------------------------------------------------
+bool BufferedFile::_writeSpilled(int chunk, int offset, const char* src, int size)
+{
+    return _openSpillFile() &&
+           _seekFile(mSpillFile, (int64_t)chunk*mBufferSize + offset) &&
+           fwrite(src, 1, size, mSpillFile) == (size_t)size;
+}
+
+//------------------------------------------------------------------------------
+bool BufferedFile::_readSpilled(int chunk, char* dst, int size)
+{
+    return mSpillFile != nullptr &&
+           _seekFile(mSpillFile, (int64_t)chunk*mBufferSize) &&
+           fread(dst, 1, size, mSpillFile) == (size_t)size;
+}
+
+//------------------------------------------------------------------------------
+int BufferedFile::_chunkSize(int chunk) const
+{
+    if ( chunk != (int)mBuffers.size()-1 ) {
+        return mBufferSize;
+    }
+    return mLastWrittenPos - chunk*mBufferSize;
+}
 
 //------------------------------------------------------------------------------
 bool BufferedFile::save(const char* sFilename)
 {
+    std::unique_lock<std::mutex> lock(mMutex);
     if ( mInvalidState ) {
         return false;
     }
+
+    if ( mSpillFile != nullptr ) {
+        // most of the file is already on disk; complete it there, and move it
+        bool ok = true;
+        for ( int nI=0; nI<(int)mBuffers.size() && ok; nI++ ) {
+            if ( mBuffers[nI] != nullptr ) {
+                ok = _writeSpilled(nI, 0, mBuffers[nI], _chunkSize(nI));
+            }
+        }
+        ok = ok && fflush(mSpillFile) == 0;
+        if ( ok ) {
+            fclose(mSpillFile);
+            mSpillFile = nullptr;
+            if ( sv_rename_file(mSpillName.c_str(), sFilename) == 0 ) {
+                // everything now lives in sFilename; should this be saved
+                // again, that's where the data comes from
+                _releaseResident();
+                mSpillName = sFilename;
+                mSpillOwned = false;
+                mSpillFile = sv_open_file(sFilename, "r+b");
+                if ( mSpillFile == nullptr ) {
+                    mInvalidState = true;
+                }
+                return true;
+            }
+            mSpillFile = sv_open_file(mSpillName.c_str(), "r+b");
+            if ( mSpillFile == nullptr ) {
+                mInvalidState = true;
+                return false;
+            }
+        }
+        // rename didn't work (e.g. across devices); copy it instead
+    }
+
+    lock.unlock();
     ofstream os(sFilename, ofstream::out|ofstream::binary);
     bool res = save( os );
     os.close();
@@ -261,10 +629,20 @@ bool BufferedFile::save(const char* sFilename)
 //------------------------------------------------------------------------------
 bool BufferedFile::save(ostream& os)
 {
+    std::lock_guard<std::mutex> guard(mMutex);
+    vector<char> spilled;
     auto size = mBuffers.size();
     for ( int nI=0; nI<size && os.good(); nI++ ) {
-        int nToWrite = (nI != size-1) ? mBufferSize : mLastWrittenPos%mBufferSize;
-        os.write( mBuffers[nI], nToWrite );
+        int nToWrite = _chunkSize(nI);
+        const char* data = mBuffers[nI];
+        if ( data == nullptr ) {
+            spilled.resize(mBufferSize);
+            if ( !_readSpilled(nI, &spilled[0], nToWrite) ) {
+                return false;
+            }
+            data = &spilled[0];
+        }
+        os.write( data, nToWrite );
     }
     return os.good();
 }
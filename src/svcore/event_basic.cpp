@@ -38,7 +38,37 @@
 #include "sv_os.h"
 #include "streamprv.h"
 #include "event_basic.h"
+#include "sv_internal.h"
 
+#include <atomic>
+#include <mutex>
+
+//-----------------------------------------------------------------------------
+// Events are recycled through a pool, and their properties are carved out of
+// storage inline with the event, so that creating one doesn't normally touch
+// the heap. Property names are interned into integer keys: looking up a
+// property compares ints, and callers on a hot path can resolve the key once
+// with basic_event_property_key. Once the key table is full, properties with
+// names it doesn't have are kept under key -1 and compared by name.
+static const size_t kInlinePropBytes = 512;
+static const int    kPoolSize = 64;
+static const int    kMaxKeys = 256;
+
+typedef struct basic_event_slot {
+    basic_event_obj event;          // must come first
+    int             keys[kMaxProps];
+    size_t          inlineUsed;
+    uint64_t        inlineProps[kInlinePropBytes/sizeof(uint64_t)];
+} basic_event_slot;
+
+// free list: a slot is claimed by swapping its pointer out, so there is no ABA
+static std::atomic<basic_event_slot*>   _gEventPool[kPoolSize];
+
+// interned property names; entries are never removed, and are published
+// by bumping the count
+static char                 _gKeyNames[kMaxKeys][kMaxNameSize];
+static std::atomic<int>     _gKeyCount(0);
+static std::mutex           _gKeyMutex;
 
 
 //-----------------------------------------------------------------------------
@@ -76,20 +106,119 @@ extern "C" stream_ev_api_t*      get_basic_event_api              ()
 
 
 
+//-----------------------------------------------------------------------------
+static int            _basic_event_find_key         (const CHAR_T* name)
+{
+    int count = _gKeyCount.load(std::memory_order_acquire);
+    for (int i=0; i<count; i++) {
+        if ( !_stricmp(name, _gKeyNames[i]) ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+// Returns the key for a property name, adding it if it's new; -1 if the name
+// is too long, or the table is full
+SVCORE_API int        basic_event_property_key      (const CHAR_T* name)
+{
+    int key = _basic_event_find_key(name);
+    if ( key >= 0 ) {
+        return key;
+    }
+    if ( strlen(name) >= kMaxNameSize ) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(_gKeyMutex);
+    // may have been added while we weren't looking
+    key = _basic_event_find_key(name);
+    if ( key < 0 ) {
+        key = _gKeyCount.load(std::memory_order_relaxed);
+        if ( key >= kMaxKeys ) {
+            return -1;
+        }
+        strcpy(_gKeyNames[key], name);
+        _gKeyCount.store(key+1, std::memory_order_release);
+    }
+    return key;
+}
+
+//-----------------------------------------------------------------------------
+static basic_event_slot* _basic_event_pool_get      ()
+{
+    for (int i=0; i<kPoolSize; i++) {
+        if ( _gEventPool[i].load(std::memory_order_relaxed) != NULL ) {
+            basic_event_slot* slot = _gEventPool[i].exchange(NULL, std::memory_order_acquire);
+            if ( slot != NULL ) {
+                return slot;
+            }
+        }
+    }
+    return (basic_event_slot*)malloc(sizeof(basic_event_slot));
+}
+
+//-----------------------------------------------------------------------------
+static void           _basic_event_pool_put         (basic_event_slot* slot)
+{
+    for (int i=0; i<kPoolSize; i++) {
+        basic_event_slot* expected = NULL;
+        if ( _gEventPool[i].load(std::memory_order_relaxed) == NULL &&
+             _gEventPool[i].compare_exchange_strong(expected, slot, std::memory_order_release) ) {
+            return;
+        }
+    }
+    free(slot);
+}
+
+//-----------------------------------------------------------------------------
+static void           _basic_event_free_prop        (basic_event_slot* slot, int i)
+{
+    basic_prop_t* prop = slot->event.properties[i];
+    if ( prop == NULL ) {
+        return;
+    }
+    uint8_t* begin = (uint8_t*)slot->inlineProps;
+    if ( (uint8_t*)prop < begin || (uint8_t*)prop >= begin + kInlinePropBytes ) {
+        free(prop);
+    }
+    // inline storage isn't reclaimed until the event is
+    slot->event.properties[i] = NULL;
+    slot->keys[i] = -1;
+}
+
+//-----------------------------------------------------------------------------
+static basic_prop_t*  _basic_event_alloc_prop       (basic_event_slot* slot, size_t size)
+{
+    // keep the properties aligned for whatever they hold
+    size_t needed = (sizeof(basic_prop)+size+sizeof(uint64_t)-1) & ~(sizeof(uint64_t)-1);
+    if ( slot->inlineUsed + needed <= kInlinePropBytes ) {
+        basic_prop_t* prop = (basic_prop_t*)((uint8_t*)slot->inlineProps + slot->inlineUsed);
+        slot->inlineUsed += needed;
+        return prop;
+    }
+    return (basic_prop_t*)malloc(sizeof(basic_prop)+size);
+}
+
 //-----------------------------------------------------------------------------
 static stream_ev_obj* basic_event_create            (const char* name)
 {
-    basic_event_obj* res = (basic_event_obj*)malloc(sizeof(basic_event_obj));
+    basic_event_slot* slot = _basic_event_pool_get();
+    basic_event_obj* res = &slot->event;
     res->magic = BASIC_EVENT_MAGIC;
     res->refcount = 0;
     res->api = get_basic_event_api();
     res->context = NULL;
     res->destructor = basic_event_destroy;
+    res->timestamp = 0;
     strncpy(res->name, name, kMaxNameSize);
     res->name[kMaxNameSize-1] = '\0';
     for (int i=0; i<kMaxProps; i++) {
         res->properties[i] = NULL;
+        slot->keys[i] = -1;
     }
+    slot->inlineUsed = 0;
     return (stream_ev_obj*)res;
 }
 
@@ -132,21 +261,15 @@ static int            basic_event_set_context       (stream_ev_obj* ev,
 }
 
 //-----------------------------------------------------------------------------
-static int            basic_event_get_property      (stream_ev_obj* ev,
-                                                    const CHAR_T* name,
-                                                    void* value,
-                                                    size_t* size)
+// Properties without a key (-1) are matched by name
+static int            _basic_event_find_prop        (basic_event_slot* slot,
+                                                    int key,
+                                                    const CHAR_T* name)
 {
-    DECLARE_EVENT(ev, event, -1);
     for (int i=0; i<kMaxProps; i++) {
-        basic_prop_t* prop = event->properties[i];
-        if ( prop!=NULL && !_stricmp(name, prop->name) ) {
-            if (*size < prop->size) {
-                *size = prop->size;
-                return -1;
-            }
-            *size = prop->size;
-            memcpy(value, prop->value, prop->size);
+        basic_prop_t* prop = slot->event.properties[i];
+        if ( prop!=NULL && slot->keys[i] == key &&
+             ( key >= 0 || !_stricmp(prop->name, name) ) ) {
             return i;
         }
     }
@@ -154,50 +277,111 @@ static int            basic_event_get_property      (stream_ev_obj* ev,
 }
 
 //-----------------------------------------------------------------------------
-static int            basic_event_set_property      (stream_ev_obj* ev,
+static int            _basic_event_get_prop         (stream_ev_obj* ev,
+                                                    int key,
                                                     const CHAR_T* name,
                                                     void* value,
-                                                    size_t size)
+                                                    size_t* size)
 {
     DECLARE_EVENT(ev, event, -1);
-    if (strlen(name)>kMaxNameSize) {
+    int i = _basic_event_find_prop((basic_event_slot*)event, key, name);
+    if ( i < 0 ) {
+        return -1;
+    }
+    basic_prop_t* prop = event->properties[i];
+    if (*size < prop->size) {
+        *size = prop->size;
         return -1;
     }
+    *size = prop->size;
+    memcpy(value, prop->value, prop->size);
+    return i;
+}
 
-    for (int i=0; i<kMaxProps; i++) {
-        basic_prop_t* prop = event->properties[i];
-        if ( prop!=NULL &&
-             !_stricmp(prop->name, prop->name) ) {
-            free(prop);
-            event->properties[i] = NULL;
-            break;
-        }
+//-----------------------------------------------------------------------------
+SVCORE_API int        basic_event_get_property_by_key(stream_ev_obj* ev,
+                                                    int key,
+                                                    void* value,
+                                                    size_t* size)
+{
+    if ( key < 0 || key >= _gKeyCount.load(std::memory_order_acquire) ) {
+        return -1;
+    }
+    return _basic_event_get_prop(ev, key, _gKeyNames[key], value, size);
+}
+
+
+//-----------------------------------------------------------------------------
+static int            basic_event_get_property      (stream_ev_obj* ev,
+                                                    const CHAR_T* name,
+                                                    void* value,
+                                                    size_t* size)
+{
+    return _basic_event_get_prop(ev, _basic_event_find_key(name), name, value, size);
+}
+
+//-----------------------------------------------------------------------------
+static int            _basic_event_set_prop         (stream_ev_obj* ev,
+                                                    int key,
+                                                    const CHAR_T* name,
+                                                    const void* value,
+                                                    size_t size)
+{
+    DECLARE_EVENT(ev, event, -1);
+    basic_event_slot* slot = (basic_event_slot*)event;
+
+    int i = _basic_event_find_prop(slot, key, name);
+    if ( i >= 0 ) {
+        _basic_event_free_prop(slot, i);
     }
 
     for (int j=0; j<kMaxProps; j++) {
         if ( event->properties[j]==NULL ) {
-            basic_prop_t* prop = (basic_prop_t*)malloc(sizeof(basic_prop)+size);
+            basic_prop_t* prop = _basic_event_alloc_prop(slot, size);
             strcpy(prop->name, name);
             memcpy(prop->value, value, size);
             prop->size = size;
             event->properties[j] = prop;
+            slot->keys[j] = key;
             return 0;
         }
     }
     return -2;
 }
 
+//-----------------------------------------------------------------------------
+SVCORE_API int        basic_event_set_property_by_key(stream_ev_obj* ev,
+                                                    int key,
+                                                    const void* value,
+                                                    size_t size)
+{
+    if ( key < 0 || key >= _gKeyCount.load(std::memory_order_acquire) ) {
+        return -1;
+    }
+    return _basic_event_set_prop(ev, key, _gKeyNames[key], value, size);
+}
+
+//-----------------------------------------------------------------------------
+static int            basic_event_set_property      (stream_ev_obj* ev,
+                                                    const CHAR_T* name,
+                                                    void* value,
+                                                    size_t size)
+{
+    if (strlen(name)>=kMaxNameSize) {
+        return -1;
+    }
+    return _basic_event_set_prop(ev, basic_event_property_key(name), name, value, size);
+}
+
 //-----------------------------------------------------------------------------
 static void           basic_event_destroy           (stream_ev_obj* ev)
 {
     DECLARE_EVENT_V(ev, event);
+    basic_event_slot* slot = (basic_event_slot*)event;
 
     for (int i=0; i<kMaxProps; i++) {
-        if ( event->properties[i]!=NULL ) {
-            free(event->properties[i]);
-            event->properties[i] = NULL;
-        }
+        _basic_event_free_prop(slot, i);
     }
 
-    free(event);
+    _basic_event_pool_put(slot);
 }
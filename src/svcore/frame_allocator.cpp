@@ -35,42 +35,76 @@
 #define SV_MODULE_NAME "frameallocator"
 
 #include "frame_allocator.h"
+#include "sv_internal.h"
 
 #include <set>
+#include <atomic>
+
+// see create_frame_allocator2 in sv_internal.h
+static const int kDefaultDesiredCount = 5;
+static const int kDefaultReductionTimeThreshold = 2000;
 
 //-----------------------------------------------------------------------------
+// Frames are handed out by the owner of the allocator (typically the thread
+// running the node the allocator belongs to), and returned from any thread
+// releasing the last reference. To keep the two sides from serializing on
+// one mutex, returned frames are pushed onto returnList without locking;
+// the getter side owns freeList, and adopts the whole returnList at once
+// whenever freeList runs dry. Only the getters take the mutex, and those are
+// rarely contended.
 typedef struct frame_allocator {
-    int               freed;
-    frame_pooled_t*   freeList;
-    int               freeListCount;
-    frame_pooled_t*   allocList;
-    int               allocListCount;
-
-    int64_t           lastAllocEvent;
-    int               reductionTimeThreshold;
-    int               desiredCount;
-    sv_mutex*         mutex;
-    char*             name;
+    // one reference held by the owner, and one by each outstanding frame;
+    // whoever drops the last one destroys the allocator
+    std::atomic<int>              refs;
+    frame_pooled_t*               freeList;
+    std::atomic<frame_pooled_t*>  returnList;
+    // frames in both freeList and returnList
+    std::atomic<int>              freeListCount;
+    std::atomic<int>              allocListCount;
+
+    std::atomic<int64_t>          lastAllocEvent;
+    int                           reductionTimeThreshold;
+    int                           desiredCount;
+
+    std::atomic<int64_t>          hits;
+    std::atomic<int64_t>          misses;
+    std::atomic<int64_t>          spills;
+
+    sv_mutex*                     mutex;
+    char*                         name;
 } frame_allocator;
 
 
+static void _frame_allocator_destroy(frame_allocator* fa, fn_stream_log logCb);
+
 //-----------------------------------------------------------------------------
-SVCORE_API frame_allocator* create_frame_allocator(const char* name)
+SVCORE_API frame_allocator* create_frame_allocator2(const char* name,
+                                                    int desiredCount,
+                                                    int reductionTimeThreshold)
 {
-    frame_allocator* res = (frame_allocator*)malloc(sizeof(frame_allocator));
+    frame_allocator* res = new frame_allocator;
     res->freeList = NULL;
+    res->returnList = NULL;
     res->freeListCount = 0;
-    res->allocList = NULL;
     res->allocListCount = 0;
-    res->freed = 0;
+    res->refs = 1;
     res->lastAllocEvent = 0;
-    res->desiredCount = 5; // TODO: arbitrary number ... needs to be a parameter to factory
-    res->reductionTimeThreshold = 2000; // TODO: probably needs to be parametrize as well
+    res->desiredCount = desiredCount >= 0 ? desiredCount : kDefaultDesiredCount;
+    res->reductionTimeThreshold = reductionTimeThreshold >= 0 ? reductionTimeThreshold : kDefaultReductionTimeThreshold;
+    res->hits = 0;
+    res->misses = 0;
+    res->spills = 0;
     res->mutex = sv_mutex_create();
     res->name = name ? strdup(name) : NULL;
     return res;
 }
 
+//-----------------------------------------------------------------------------
+SVCORE_API frame_allocator* create_frame_allocator(const char* name)
+{
+    return create_frame_allocator2(name, kDefaultDesiredCount, kDefaultReductionTimeThreshold);
+}
+
 
 //-----------------------------------------------------------------------------
 static frame_pooled_t* _frame_allocator_free(frame_allocator* fa, frame_pooled_t* f,
@@ -87,16 +121,35 @@ static frame_pooled_t* _frame_allocator_free(frame_allocator* fa, frame_pooled_t
     return next;
 }
 
+//-----------------------------------------------------------------------------
+// Returns true if the pool has more frames than desired, and hadn't needed
+// to allocate in a while. Count is checked first, so the clock is only
+// consulted when the pool is over its desired size.
+// Under memory pressure the pool doesn't wait to shrink to the desired size,
+// and once pressure is hard, it keeps no more than a single free frame.
+static bool _frame_allocator_should_reduce(frame_allocator* fa)
+{
+    if ( fa->freeListCount <= 0 ) {
+        return false;
+    }
+    int pressure = sv_memory_get_pressure();
+    if ( pressure == SV_MEMORY_PRESSURE_HARD ) {
+        return true;
+    }
+    return fa->freeListCount > fa->desiredCount &&
+           ( pressure != SV_MEMORY_PRESSURE_NONE ||
+             sv_time_get_elapsed_time(fa->lastAllocEvent) > fa->reductionTimeThreshold );
+}
 
 //-----------------------------------------------------------------------------
+// Must be called with fa->mutex held
 static int _frame_allocator_reduce_list(frame_allocator* fa)
 {
-    if ( fa->freeListCount > fa->desiredCount &&
-         sv_time_get_elapsed_time(fa->lastAllocEvent) > fa->reductionTimeThreshold &&
-         fa->freeList != NULL ) {
+    if ( fa->freeList != NULL && _frame_allocator_should_reduce(fa) ) {
         // destroy one extra to reduce the list ...
         fa->freeList = _frame_allocator_free(fa, fa->freeList, NULL);
         fa->freeListCount--;
+        fa->spills++;
         return 0;
     }
     return -1;
@@ -107,19 +160,30 @@ SVCORE_API frame_pooled_t* frame_allocator_get(frame_allocator* fa)
 {
     frame_pooled_t* res = NULL;
     sv_mutex_enter(fa->mutex);
+    if ( fa->freeList == NULL ) {
+        // adopt everything returned since we last looked
+        fa->freeList = fa->returnList.exchange(NULL, std::memory_order_acquire);
+    }
     if ( fa->freeList != NULL ) {
         res = fa->freeList;
         fa->freeList = res->next;
         fa->freeListCount--;
         fa->allocListCount++;
+        fa->refs++;
         res->next = NULL;
-        if ( res->resetter ) {
-            res->resetter((frame_obj*)res);
-        }
 
         _frame_allocator_reduce_list( fa );
     }
     sv_mutex_exit(fa->mutex);
+
+    if ( res ) {
+        fa->hits++;
+        if ( res->resetter ) {
+            res->resetter((frame_obj*)res);
+        }
+    } else {
+        fa->misses++;
+    }
     return res;
 }
 
@@ -129,6 +193,7 @@ SVCORE_API void frame_allocator_register_frame(frame_allocator* fa, frame_pooled
     newFrame->fa = fa;
     fa->lastAllocEvent = sv_time_get_current_epoch_time();
     fa->allocListCount++;
+    fa->refs++;
 }
 
 //-----------------------------------------------------------------------------
@@ -140,33 +205,61 @@ SVCORE_API const char* frame_allocator_get_name(frame_allocator* fa)
 //-----------------------------------------------------------------------------
 SVCORE_API void frame_allocator_get_stats(frame_allocator* fa, int* freect, int* allocct)
 {
-    sv_mutex_enter(fa->mutex);
     *freect = fa->freeListCount;
     *allocct = fa->allocListCount;
-    sv_mutex_exit(fa->mutex);
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API void frame_allocator_get_pool_stats(frame_allocator* fa,
+                                               int64_t* hits,
+                                               int64_t* misses,
+                                               int64_t* spills)
+{
+    if (hits) *hits = fa->hits;
+    if (misses) *misses = fa->misses;
+    if (spills) *spills = fa->spills;
 }
 
 //-----------------------------------------------------------------------------
 SVCORE_API void frame_allocator_return(frame_allocator* fa, frame_pooled_t* frame)
 {
-    bool freeAllocator = false;
-    sv_mutex_enter(fa->mutex);
-    if ( _frame_allocator_reduce_list(fa) >= 0 ) {
+    if ( _frame_allocator_should_reduce(fa) ) {
         // we have more frames in the allocator than we want to ... free this frame
         _frame_allocator_free(fa, frame, NULL);
+        fa->spills++;
     } else {
-        frame->next = fa->freeList;
         frame->refcount = 0; // someone may have called _unref without _ref first, hitting a negative #
-        fa->freeList = frame;
+        frame_pooled_t* head = fa->returnList.load(std::memory_order_relaxed);
+        do {
+            frame->next = head;
+        } while ( !fa->returnList.compare_exchange_weak(head, frame,
+                                                        std::memory_order_release,
+                                                        std::memory_order_relaxed) );
         fa->freeListCount++;
     }
+
     fa->allocListCount--;
-    freeAllocator = (fa->freed && fa->allocListCount == 0);
-    sv_mutex_exit(fa->mutex);
+    // fa may not be touched past this point, unless we've dropped the last reference
+    if ( fa->refs.fetch_sub(1) == 1 ) {
+        _frame_allocator_destroy(fa, NULL);
+    }
+}
 
-    if ( freeAllocator ) {
-        destroy_frame_allocator(&fa, NULL);
+//-----------------------------------------------------------------------------
+// Called once the allocator had been released by its owner, and no frames are outstanding
+static void _frame_allocator_destroy(frame_allocator* fa, fn_stream_log logCb)
+{
+    frame_pooled_t* current = fa->freeList;
+    while (current) {
+        current = _frame_allocator_free(fa, current, logCb);
+    }
+    current = fa->returnList.exchange(NULL);
+    while (current) {
+        current = _frame_allocator_free(fa, current, logCb);
     }
+    sv_mutex_destroy(&fa->mutex);
+    sv_freep(&fa->name);
+    delete fa;
 }
 
 //-----------------------------------------------------------------------------
@@ -174,33 +267,23 @@ SVCORE_API void destroy_frame_allocator(frame_allocator** pfa, fn_stream_log log
 {
     if ( pfa && *pfa ) {
         frame_allocator* fa = *pfa;
-        bool proceed = true;
-        sv_mutex_enter(fa->mutex);
-        if ( fa->allocListCount ) {
+        *pfa = NULL;
+
 #if DEBUG_FRAME_ALLOC>0
-            if ( logCb ) {
-                logCb(logError, _FMT("Attempt to free frame allocator " << fa->name <<
-                                    " with " << fa->allocListCount << " outstanding frames"));
+        int outstanding = fa->allocListCount;
+        if ( outstanding && logCb ) {
+            logCb(logError, _FMT("Attempt to free frame allocator " << fa->name <<
+                                " with " << outstanding << " outstanding frames" <<
+                                "; hits=" << fa->hits << " misses=" << fa->misses <<
+                                " spills=" << fa->spills));
 #if DEBUG_FRAME_ALLOC>2
-                print_allocated_frames( logCb );
+            print_allocated_frames( logCb );
 #endif
-            }
-#endif
-            proceed = false;
-            fa->freed = 1;
-        }
-        sv_mutex_exit(fa->mutex);
-
-        if (!proceed) {
-            return;
         }
-
-        frame_pooled_t* current = fa->freeList;
-        while (current) {
-            current = _frame_allocator_free(fa, current, logCb);
+#endif
+        // if frames are still outstanding, the last one returned will take care of it
+        if ( fa->refs.fetch_sub(1) == 1 ) {
+            _frame_allocator_destroy(fa, logCb);
         }
-        sv_mutex_destroy(&fa->mutex);
-        sv_freep(&fa->name);
-        sv_freep(pfa);
     }
 }
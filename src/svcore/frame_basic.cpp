@@ -38,8 +38,11 @@
 #include "sv_os.h"
 #include "streamprv.h"
 #include "frame_basic.h"
+#include "sv_internal.h"
 
 #include <set>
+#include <vector>
+#include <atomic>
 #include <cmath>
 #include <algorithm>
 
@@ -47,10 +50,170 @@
 static int _g_basicFramesAllocated = 0;
 static int _g_basicFramesPoolEnabled = 1;
 static int _g_basicFramesLeakDetection = 0;
+static int _g_basicFramesArenaEnabled = sv_get_int_env_var("SV_FRAME_ARENA", 0);
 
 static std::set<frame_obj*> allocatedFrames;
 
 
+//-----------------------------------------------------------------------------
+// Size-class arena for frame payloads.
+// Payload sizes vary wildly (NAL units and packets of all sizes from demux and
+// live555, raw frames from decoder and resize). Rather than churning the heap
+// with malloc/realloc for each, payloads are rounded up to one of the classes
+// below, and released blocks are kept on per-class free lists for reuse.
+// Classes are multiples of 64 bytes, and data is 64-byte aligned. The amount
+// of memory kept in free lists is bounded process-wide; neither oversized
+// payloads, nor blocks not fitting that budget are retained. Under memory
+// pressure, nothing is retained, and the free lists are emptied.
+//-----------------------------------------------------------------------------
+static const size_t kArenaAlignment = 64;
+static const size_t kArenaClasses[] = {
+    256,            // audio packets, small NALs
+    1024,
+    4*1024,
+    16*1024,        // P-frames of typical camera streams
+    64*1024,
+    128*1024,
+    256*1024,       // keyframes
+    320*1024,       // 426x240 RGB
+    512*1024,
+    1024*1024,      // 640x480 RGB
+    1536*1024,      // 1280x720 NV12
+    2*1024*1024,
+    3*1024*1024,    // 1280x720 RGB, 1920x1080 NV12
+    4*1024*1024,
+    6*1024*1024,    // 1920x1080 RGB
+    12*1024*1024,   // 3840x2160 NV12
+    24*1024*1024,   // 3840x2160 RGB
+};
+static const int kArenaClassCount = sizeof(kArenaClasses)/sizeof(kArenaClasses[0]);
+static const int kArenaDefaultBudgetMb = 256;
+static const int kOverallocateBy = 32;
+// AV_INPUT_BUFFER_PADDING_SIZE
+static const int kPacketPadding = 64;
+
+typedef struct frame_arena_class {
+    sv_mutex*               mutex;
+    std::vector<uint8_t*>   blocks;
+} frame_arena_class;
+
+typedef struct frame_arena {
+    frame_arena_class       classes[kArenaClassCount];
+    size_t                  budget;
+    // bytes held by the arena -- both handed out, and sitting in free lists
+    std::atomic<int64_t>    bytesReserved;
+    // bytes currently handed out to frames
+    std::atomic<int64_t>    bytesInUse;
+
+    frame_arena()
+    {
+        for (int nI=0; nI<kArenaClassCount; nI++) {
+            classes[nI].mutex = sv_mutex_create();
+        }
+        budget = (size_t)sv_get_int_env_var("SV_FRAME_ARENA_MB", kArenaDefaultBudgetMb)*1024*1024;
+        bytesReserved = 0;
+        bytesInUse = 0;
+    }
+} frame_arena;
+
+static frame_arena _g_frameArena;
+
+//-----------------------------------------------------------------------------
+static int      _frame_arena_class          (size_t size)
+{
+    for (int nI=0; nI<kArenaClassCount; nI++) {
+        if ( size <= kArenaClasses[nI] ) {
+            return nI;
+        }
+    }
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+static size_t   _frame_arena_block_size     (size_t size)
+{
+    int sizeClass = _frame_arena_class(size);
+    if ( sizeClass < 0 ) {
+        return (size + kArenaAlignment - 1) & ~(kArenaAlignment - 1);
+    }
+    return kArenaClasses[sizeClass];
+}
+
+//-----------------------------------------------------------------------------
+// Called when memory pressure changes
+static void     _frame_arena_trim           (void* ctx, int level)
+{
+    frame_arena* arena = (frame_arena*)ctx;
+    if ( level == SV_MEMORY_PRESSURE_NONE ) {
+        return;
+    }
+    for (int nI=0; nI<kArenaClassCount; nI++) {
+        frame_arena_class* fac = &arena->classes[nI];
+        std::vector<uint8_t*> blocks;
+        sv_mutex_enter(fac->mutex);
+        blocks.swap(fac->blocks);
+        sv_mutex_exit(fac->mutex);
+        for ( auto block : blocks ) {
+            free(block);
+        }
+        arena->bytesReserved -= (int64_t)(blocks.size()*kArenaClasses[nI]);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Returns raw block capable of holding the size specified, plus the alignment slack
+static uint8_t* _frame_arena_get            (size_t size)
+{
+    frame_arena* arena = &_g_frameArena;
+    static int   trimRegistered = sv_memory_add_pressure_cb(_frame_arena_trim, arena);
+    (void)trimRegistered;
+    int          sizeClass = _frame_arena_class(size);
+    size_t       blockSize = _frame_arena_block_size(size);
+    uint8_t*     res = NULL;
+
+    if ( sizeClass >= 0 ) {
+        frame_arena_class* fac = &arena->classes[sizeClass];
+        sv_mutex_enter(fac->mutex);
+        if ( !fac->blocks.empty() ) {
+            res = fac->blocks.back();
+            fac->blocks.pop_back();
+        }
+        sv_mutex_exit(fac->mutex);
+    }
+
+    if ( res == NULL ) {
+        res = (uint8_t*)malloc(blockSize + kArenaAlignment);
+        if ( res == NULL ) {
+            return NULL;
+        }
+        arena->bytesReserved += blockSize;
+    }
+    arena->bytesInUse += blockSize;
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+static void     _frame_arena_return         (uint8_t* block, size_t size)
+{
+    frame_arena* arena = &_g_frameArena;
+    int          sizeClass = _frame_arena_class(size);
+    size_t       blockSize = _frame_arena_block_size(size);
+
+    arena->bytesInUse -= blockSize;
+    if ( sizeClass >= 0 &&
+         arena->bytesReserved - arena->bytesInUse <= (int64_t)arena->budget &&
+         sv_memory_get_pressure() == SV_MEMORY_PRESSURE_NONE ) {
+        frame_arena_class* fac = &arena->classes[sizeClass];
+        sv_mutex_enter(fac->mutex);
+        fac->blocks.push_back(block);
+        sv_mutex_exit(fac->mutex);
+        return;
+    }
+    arena->bytesReserved -= blockSize;
+    free(block);
+}
+
+
 
 //-----------------------------------------------------------------------------
 // Frame API. To begin with, we only use it to access the data;
@@ -90,6 +253,9 @@ static int         basic_frame_deserialize         (frame_obj* frame, const char
 static void        basic_frame_destroy             (frame_obj* frame);
 static int         _alloc_basic_frame_mem          (basic_frame_obj* frame,
                                                     size_t desiredSize);
+static void        _free_basic_frame_mem           (uint8_t** mem,
+                                                    size_t allocSize,
+                                                    int ownerTag);
 
 
 //-----------------------------------------------------------------------------
@@ -327,6 +493,20 @@ void*              basic_frame_get_backing_obj     (frame_obj* frame,
         if ( !_stricmp(objType,"srcFrame")) {
             return basic_frame->srcFrame;
         }
+        if ( !_stricmp(objType,"paddedData")) {
+            // data, if it's followed by enough zeroed bytes for ffmpeg to take it as is
+            if ( basic_frame->data == NULL ||
+                 basic_frame->allocSize + kOverallocateBy < basic_frame->dataSize + kPacketPadding ) {
+                return NULL;
+            }
+            const uint8_t* pad = &basic_frame->data[basic_frame->dataSize];
+            for (int nI=0; nI<kPacketPadding; nI++) {
+                if ( pad[nI] != 0 ) {
+                    return NULL;
+                }
+            }
+            return basic_frame->data;
+        }
     }
     return NULL;
 }
@@ -458,7 +638,7 @@ static void  basic_frame_destroy          (frame_obj* frame)
 #if ENABLE_SERIALIZATION
         sv_freep(&basic_frame->serializationLocation);
 #endif
-        sv_freep(&basic_frame->mem);
+        _free_basic_frame_mem(&basic_frame->mem, basic_frame->allocSize, basic_frame->ownerTag);
         sv_freep(&basic_frame);
         _g_basicFramesAllocated--;
 #if DEBUG_FRAME_ALLOC<2
@@ -480,7 +660,6 @@ static void  basic_frame_destroy          (frame_obj* frame)
 }
 
 
-static const int kOverallocateBy = 32;
 
 //-----------------------------------------------------------------------------
 static void reset_basic_frame(frame_obj* frame)
@@ -526,6 +705,8 @@ SVCORE_API basic_frame_obj* alloc_basic_frame        (int ownerTag,
 {
     basic_frame_obj* ff = (basic_frame_obj*)get_basic_frame_api()->create();
     if ( ff ) {
+        // payload is accounted to the tag, so it has to be known first
+        ff->ownerTag = ownerTag;
         _alloc_basic_frame_mem(ff, desiredSize);
         ff->resetter = reset_basic_frame;
 #if DEBUG_FRAME_ALLOC>0
@@ -535,7 +716,6 @@ SVCORE_API basic_frame_obj* alloc_basic_frame        (int ownerTag,
             ff->dataSize = 0;
             ff->pts = INVALID_PTS;
             ff->dts = INVALID_PTS;
-            ff->ownerTag = ownerTag;
             ff->refcount = 1;
 #if DEBUG_FRAME_ALLOC<2
             if (_g_basicFramesAllocated>=20 && (_g_basicFramesAllocated%10)==0) {
@@ -575,6 +755,7 @@ SVCORE_API basic_frame_obj*  alloc_basic_frame2 (int ownerTag,
         res = alloc_basic_frame(ownerTag, desiredSize, logCb);
         if (res && pooled) {
             frame_allocator_register_frame(fa, res);
+            sv_memory_name_tag(ownerTag, frame_allocator_get_name(fa));
         }
     } else {
 #if DEBUG_FRAME_ALLOC>0
@@ -621,12 +802,26 @@ static int      _alloc_basic_frame_mem          (basic_frame_obj* frame,
     // we overallocate by FF_INPUT_BUFFER_PADDING_SIZE .. this should come handy, if input needs to be padded for ffmpeg
     // but even if not, there are cases where it'll help with off-by-one errors in ffmpeg
     // (for example, see https://trac.ffmpeg.org/ticket/5886)
+    if ( _g_basicFramesArenaEnabled ) {
+        size_t blockSize = _frame_arena_block_size(desiredSize+kOverallocateBy);
+        frame->mem = _frame_arena_get(desiredSize+kOverallocateBy);
+        if (!frame->mem)
+            return -1;
+        frame->data = (uint8_t*)(((uintptr_t)frame->mem+kArenaAlignment-1) & ~ (uintptr_t)(kArenaAlignment-1));
+        // whatever is left in the block is ours to grow into, without reallocating
+        frame->allocSize = blockSize - kOverallocateBy;
+        memset(&frame->data[frame->allocSize], 0, kOverallocateBy);
+        sv_memory_charge(SV_MEMORY_FRAMES, frame->ownerTag, (int64_t)blockSize);
+        return 0;
+    }
+
     frame->mem = (uint8_t*)malloc(desiredSize+kOverallocateBy+16);
     if (!frame->mem)
         return -1;
     frame->data = (uint8_t*)(((uintptr_t)frame->mem+15) & ~ (uintptr_t)0x0F);
     frame->allocSize = desiredSize;
     memset(&frame->data[desiredSize], 0, kOverallocateBy);
+    sv_memory_charge(SV_MEMORY_FRAMES, frame->ownerTag, (int64_t)(desiredSize+kOverallocateBy+16));
     return 0;
 }
 
@@ -641,9 +836,12 @@ SVCORE_API int               grow_basic_frame   (basic_frame_obj* frame,
     uint8_t* memBak = frame->mem;
     uint8_t* dataBak = frame->data;
     size_t   dataSizeBak = frame->dataSize;
+    size_t   allocSizeBak = frame->allocSize;
 
     if ( _alloc_basic_frame_mem( frame, desiredSize ) < 0 ) {
         frame->mem = memBak;
+        frame->data = dataBak;
+        frame->allocSize = allocSizeBak;
         return -1;
     }
     if ( keepData ) {
@@ -652,12 +850,29 @@ SVCORE_API int               grow_basic_frame   (basic_frame_obj* frame,
     } else {
         frame->dataSize = 0;
     }
-    if ( memBak ) {
-        free( memBak );
-    };
+    _free_basic_frame_mem( &memBak, allocSizeBak, frame->ownerTag );
     return 0;
 }
 
+//-----------------------------------------------------------------------------
+static void     _free_basic_frame_mem           (uint8_t** mem,
+                                                 size_t allocSize,
+                                                 int ownerTag)
+{
+    if ( *mem == NULL ) {
+        return;
+    }
+    if ( _g_basicFramesArenaEnabled ) {
+        sv_memory_charge(SV_MEMORY_FRAMES, ownerTag,
+                         -(int64_t)_frame_arena_block_size(allocSize+kOverallocateBy));
+        _frame_arena_return( *mem, allocSize+kOverallocateBy );
+        *mem = NULL;
+    } else {
+        sv_memory_charge(SV_MEMORY_FRAMES, ownerTag, -(int64_t)(allocSize+kOverallocateBy+16));
+        sv_freep( mem );
+    }
+}
+
 //-----------------------------------------------------------------------------
 SVCORE_API size_t    get_basic_frame_free_space    (basic_frame_obj* frame)
 {
@@ -708,6 +923,24 @@ SVCORE_API int  enable_basic_frame_alloc_pool           (int enable)
     return 0;
 }
 
+//-----------------------------------------------------------------------------
+SVCORE_API int  enable_basic_frame_arena                (int enable)
+{
+    // mode can't change while blocks allocated under the other one are outstanding
+    if ( _g_basicFramesAllocated > 0 )
+        return -1;
+    _g_basicFramesArenaEnabled = enable;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API void get_basic_frame_arena_stats             (int64_t* bytesReserved,
+                                                         int64_t* bytesInUse)
+{
+    if (bytesReserved) *bytesReserved = _g_frameArena.bytesReserved;
+    if (bytesInUse) *bytesInUse = _g_frameArena.bytesInUse;
+}
+
 //-----------------------------------------------------------------------------
 int               enable_frame_leak_detection             (int enable)
 {
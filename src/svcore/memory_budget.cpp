@@ -0,0 +1,348 @@
+/*****************************************************************************
+ *
+ * memory_budget.cpp
+ *   Process-wide accounting of memory held by frames and buffered files.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#undef SV_MODULE_NAME
+#define SV_MODULE_NAME "memorybudget"
+
+#include "sv_os.h"
+#include "sv_internal.h"
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <sstream>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+
+//-----------------------------------------------------------------------------
+// Queues, pools, jitter buffers and in-memory files each bound their own size,
+// but none of them knows about the others. Allocations report here instead,
+// by category and by the ownerTag of the frame they belong to, and the
+// structures holding on to memory they could let go of poll the pressure level
+// (or register for its changes) to give it up earlier:
+//  - lossy thread connector queues drop frames sooner
+//  - jitter buffers retain less history while paused
+//  - frame allocators and the frame arena trim their free lists
+// Budgets are in MB: SV_MEMORY_BUDGET_MB for the total, and
+// SV_MEMORY_BUDGET_<CATEGORY>_MB for each category. Pressure is soft past
+// kSoftPressurePct of any budget, and hard past the budget itself. With no
+// budget configured, memory is still accounted, but pressure stays off.
+//-----------------------------------------------------------------------------
+
+#define MEMORY_BUDGET_VAR "SV_MEMORY_BUDGET_MB"
+
+static const int kSoftPressurePct = 80;
+static const int kTagSlots = 128;
+static const int kNoTag = INT_MIN;
+static const int kTagNameSize = 32;
+
+typedef struct sv_memory_category_def {
+    const char*     name;
+    const char*     budgetVar;
+} sv_memory_category_def;
+
+static const sv_memory_category_def _kCategories[] = {
+    { "frames",     "SV_MEMORY_BUDGET_FRAMES_MB" },
+    { "files",      "SV_MEMORY_BUDGET_FILES_MB" },
+};
+static const int kCategoryCount = sizeof(_kCategories)/sizeof(_kCategories[0]);
+
+typedef struct sv_memory_counter {
+    std::atomic<int64_t>    bytes;
+    std::atomic<int64_t>    peak;
+    int64_t                 budget;         // 0 if unlimited
+} sv_memory_counter;
+
+typedef struct sv_memory_tag {
+    std::atomic<int>        tag;            // kNoTag while the slot is free
+    std::atomic<int>        named;          // 0 unnamed, 1 being named, 2 named
+    std::atomic<int64_t>    bytes;
+    std::atomic<int64_t>    peak;
+    char                    name[kTagNameSize];
+} sv_memory_tag;
+
+typedef struct sv_memory_listener {
+    sv_memory_pressure_cb   cb;
+    void*                   ctx;
+} sv_memory_listener;
+
+//-----------------------------------------------------------------------------
+// Only ever reached through _sv_memory_get(): allocations are made by static
+// initializers of other modules, so this has to exist before they run.
+typedef struct sv_memory_accountant {
+    sv_memory_counter       total;
+    sv_memory_counter       categories[kCategoryCount];
+    sv_memory_tag           tags[kTagSlots];
+    // untagged charges, and those of tags that didn't find a slot
+    std::atomic<int64_t>    untaggedBytes;
+    bool                    budgeted;
+    std::atomic<int>        level;
+
+    std::mutex              listenersMutex;
+    std::vector<sv_memory_listener> listeners;
+
+    sv_memory_accountant()
+    {
+        total.bytes = 0;
+        total.peak = 0;
+        total.budget = (int64_t)std::max(0, sv_get_int_env_var(MEMORY_BUDGET_VAR, 0))*1024*1024;
+        budgeted = total.budget > 0;
+        for (int nI=0; nI<kCategoryCount; nI++) {
+            sv_memory_counter* c = &categories[nI];
+            c->bytes = 0;
+            c->peak = 0;
+            c->budget = (int64_t)std::max(0, sv_get_int_env_var(_kCategories[nI].budgetVar, 0))*1024*1024;
+            budgeted = budgeted || c->budget > 0;
+        }
+        for (int nI=0; nI<kTagSlots; nI++) {
+            tags[nI].tag = kNoTag;
+            tags[nI].named = 0;
+            tags[nI].bytes = 0;
+            tags[nI].peak = 0;
+            tags[nI].name[0] = 0;
+        }
+        untaggedBytes = 0;
+        level = SV_MEMORY_PRESSURE_NONE;
+    }
+} sv_memory_accountant;
+
+//-----------------------------------------------------------------------------
+static sv_memory_accountant*    _sv_memory_get          ()
+{
+    // never destroyed: frames may still be released while statics go away
+    static sv_memory_accountant* gAccountant = new sv_memory_accountant();
+    return gAccountant;
+}
+
+//-----------------------------------------------------------------------------
+static void                     _sv_memory_update_peak  (std::atomic<int64_t>& peak,
+                                                         int64_t value)
+{
+    int64_t prev = peak.load(std::memory_order_relaxed);
+    while ( value > prev &&
+            !peak.compare_exchange_weak(prev, value, std::memory_order_relaxed) ) {
+    }
+}
+
+//-----------------------------------------------------------------------------
+static int                      _sv_memory_counter_level(sv_memory_counter* c)
+{
+    if ( c->budget <= 0 ) {
+        return SV_MEMORY_PRESSURE_NONE;
+    }
+    int64_t bytes = c->bytes.load(std::memory_order_relaxed);
+    if ( bytes > c->budget ) {
+        return SV_MEMORY_PRESSURE_HARD;
+    }
+    if ( bytes*100 > c->budget*kSoftPressurePct ) {
+        return SV_MEMORY_PRESSURE_SOFT;
+    }
+    return SV_MEMORY_PRESSURE_NONE;
+}
+
+//-----------------------------------------------------------------------------
+// Finds the slot of the tag, claiming a free one if it's the first time we see
+// it. Returns NULL for untagged (0) charges, and once the table is full.
+static sv_memory_tag*           _sv_memory_find_tag     (sv_memory_accountant* ma,
+                                                         int ownerTag)
+{
+    if ( ownerTag == kNoTag || ownerTag == 0 ) {
+        return NULL;
+    }
+    unsigned int slot = ((unsigned int)ownerTag * 2654435761u) % kTagSlots;
+    for (int nI=0; nI<kTagSlots; nI++) {
+        sv_memory_tag* t = &ma->tags[(slot+nI)%kTagSlots];
+        int            current = t->tag.load(std::memory_order_acquire);
+        if ( current == ownerTag ) {
+            return t;
+        }
+        if ( current == kNoTag ) {
+            if ( t->tag.compare_exchange_strong(current, ownerTag) ||
+                 current == ownerTag ) {
+                return t;
+            }
+        }
+    }
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+static void                     _sv_memory_update_level (sv_memory_accountant* ma)
+{
+    int level = _sv_memory_counter_level(&ma->total);
+    for (int nI=0; nI<kCategoryCount; nI++) {
+        level = std::max(level, _sv_memory_counter_level(&ma->categories[nI]));
+    }
+    if ( ma->level.load(std::memory_order_relaxed) == level ||
+         ma->level.exchange(level) == level ) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(ma->listenersMutex);
+    for ( auto& l : ma->listeners ) {
+        l.cb(l.ctx, level);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Records allocation (positive bytes) or release (negative) of memory
+SVCORE_API void sv_memory_charge            (int category, int ownerTag, int64_t bytes)
+{
+    if ( category < 0 || category >= kCategoryCount || bytes == 0 ) {
+        return;
+    }
+
+    sv_memory_accountant* ma = _sv_memory_get();
+    sv_memory_counter*    c = &ma->categories[category];
+    _sv_memory_update_peak(c->peak, c->bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+    _sv_memory_update_peak(ma->total.peak, ma->total.bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+
+    sv_memory_tag* t = _sv_memory_find_tag(ma, ownerTag);
+    if ( t ) {
+        _sv_memory_update_peak(t->peak, t->bytes.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+    } else {
+        ma->untaggedBytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    if ( ma->budgeted ) {
+        _sv_memory_update_level(ma);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Gives the tag a readable name in the breakdown -- the first one wins.
+// Allocator names are "<purpose>_<stream>"; only the purpose is kept.
+SVCORE_API void sv_memory_name_tag          (int ownerTag, const char* name)
+{
+    if ( name == NULL ) {
+        return;
+    }
+    sv_memory_tag* t = _sv_memory_find_tag(_sv_memory_get(), ownerTag);
+    int            expected = 0;
+    if ( t == NULL ||
+         t->named.load(std::memory_order_relaxed) != 0 ||
+         !t->named.compare_exchange_strong(expected, 1) ) {
+        return;
+    }
+    size_t len = strcspn(name, "_");
+    len = std::min(len, (size_t)kTagNameSize-1);
+    memcpy(t->name, name, len);
+    t->name[len] = 0;
+    t->named.store(2, std::memory_order_release);
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API int  sv_memory_get_pressure      ()
+{
+    return _sv_memory_get()->level.load(std::memory_order_relaxed);
+}
+
+//-----------------------------------------------------------------------------
+// Callbacks are made on the thread whose allocation or release changed the
+// level, and must neither allocate frames nor add or remove callbacks.
+// Once remove returns, the callback won't be called again.
+SVCORE_API int  sv_memory_add_pressure_cb   (sv_memory_pressure_cb cb, void* ctx)
+{
+    if ( cb == NULL ) {
+        return -1;
+    }
+    sv_memory_accountant* ma = _sv_memory_get();
+    std::lock_guard<std::mutex> guard(ma->listenersMutex);
+    sv_memory_listener l = { cb, ctx };
+    ma->listeners.push_back(l);
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API void sv_memory_remove_pressure_cb(sv_memory_pressure_cb cb, void* ctx)
+{
+    sv_memory_accountant* ma = _sv_memory_get();
+    std::lock_guard<std::mutex> guard(ma->listenersMutex);
+    for ( auto it = ma->listeners.begin(); it != ma->listeners.end(); it++ ) {
+        if ( it->cb == cb && it->ctx == ctx ) {
+            ma->listeners.erase(it);
+            break;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void                     _sv_memory_format_counter(std::ostringstream& str,
+                                                          const char* name,
+                                                          sv_memory_counter* c)
+{
+    str << name << ": bytes=" << c->bytes.load() <<
+            " peak=" << c->peak.load() <<
+            " budget=" << c->budget << "\n";
+}
+
+//-----------------------------------------------------------------------------
+// Copies the breakdown into buffer: a "pressure=<level>" line, one line per
+// category and the total, and one per ownerTag holding memory now or in the
+// past. Returns -1 and sets size to what's needed, if the buffer is too small.
+SVCORE_API int  sv_memory_get_breakdown     (char* buffer, size_t* size)
+{
+    sv_memory_accountant* ma = _sv_memory_get();
+    std::ostringstream    str;
+
+    str << "pressure=" << ma->level.load() << "\n";
+    _sv_memory_format_counter(str, "total", &ma->total);
+    for (int nI=0; nI<kCategoryCount; nI++) {
+        _sv_memory_format_counter(str, _kCategories[nI].name, &ma->categories[nI]);
+    }
+    for (int nI=0; nI<kTagSlots; nI++) {
+        sv_memory_tag* t = &ma->tags[nI];
+        int            tag = t->tag.load(std::memory_order_acquire);
+        if ( tag == kNoTag ) {
+            continue;
+        }
+        str << "tag=0x" << std::hex << tag << std::dec;
+        if ( t->named.load(std::memory_order_acquire) == 2 ) {
+            str << " name=" << t->name;
+        }
+        str << " bytes=" << t->bytes.load() << " peak=" << t->peak.load() << "\n";
+    }
+    if ( ma->untaggedBytes.load() != 0 ) {
+        str << "tag=other bytes=" << ma->untaggedBytes.load() << "\n";
+    }
+
+    std::string s = str.str();
+    if ( buffer == NULL || size == NULL || *size < s.length() + 1 ) {
+        if ( size ) *size = s.length() + 1;
+        return -1;
+    }
+    memcpy(buffer, s.c_str(), s.length() + 1);
+    *size = s.length() + 1;
+    return 0;
+}
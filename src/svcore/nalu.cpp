@@ -34,6 +34,28 @@
 #include "sv_os.h"
 #include "stream.h"
 #include "nalu.h"
+#include "sv_internal.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NALU_SCAN_SSE2 1
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if SV_MULTI_ISA
+// built regardless of the compiler's target, and only run where supported
+#define NALU_SCAN_AVX2 1
+#include <immintrin.h>
+#if defined(__GNUC__)
+#define NALU_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define NALU_TARGET_AVX2
+#endif
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define NALU_SCAN_NEON 1
+#include <arm_neon.h>
+#endif
 
 //extern "C" {
 //#include <libavutil/mem.h>
@@ -42,6 +64,160 @@
 ////////////////////////////////////////////////////////////////////////////////////////////////
 static char kAnnexBHeader[] = { 0,0,0,1 };
 static const size_t kAnnexBHeaderSize = sizeof(kAnnexBHeader);
+static const char kNALTypeMask = 0x1f;
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+// Checks for a start code at data, given data[0] and data[1] are both zero, and
+// there are more than 3 bytes left
+static inline int _nal_is_start_code(const uint8_t* data, int size, size_t* nalHdrSize)
+{
+    if ( !data[2] && size>4 && data[3]==1 ) {
+        *nalHdrSize = 4;
+        return 1;
+    }
+    if ( data[2] == 1 ) {
+        *nalHdrSize = 3;
+        return 1;
+    }
+    return 0;
+}
+
+#if NALU_SCAN_SSE2
+static inline int _nal_lowest_bit(unsigned int mask)
+{
+#if defined(_MSC_VER)
+    unsigned long res;
+    _BitScanForward(&res, mask);
+    return (int)res;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+/*
+    Start code scan kernels: each looks for pairs of zero bytes as many positions
+    at a time as it can, from *pos on. Slice data can't contain 00 00 0x (x<=3)
+    other than in a start code, so candidates are rare and are verified one by
+    one. Returns offset of the first start code, or -1 with *pos left where the
+    kernel stopped, for the rest to be scanned byte by byte.
+*/
+typedef int (*nal_scan_fn)(const uint8_t* data, int size, int* pos, size_t* nalHdrSize);
+
+static int _nal_scan_c(const uint8_t* data, int size, int* pos, size_t* nalHdrSize)
+{
+    return -1;
+}
+
+#if NALU_SCAN_AVX2
+NALU_TARGET_AVX2
+static int _nal_scan_avx2(const uint8_t* data, int size, int* posInOut, size_t* nalHdrSize)
+{
+    int pos = *posInOut;
+    const __m256i zero = _mm256_setzero_si256();
+    for ( ; pos + 33 <= size; pos += 32 ) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(data+pos));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(data+pos+1));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_or_si256(a, b), zero));
+        while ( mask ) {
+            int at = pos + _nal_lowest_bit(mask);
+            if ( size-at > 3 && _nal_is_start_code(data+at, size-at, nalHdrSize) ) {
+                return at;
+            }
+            mask &= mask-1;
+        }
+    }
+    *posInOut = pos;
+    return -1;
+}
+#endif
+
+#if NALU_SCAN_SSE2
+static int _nal_scan_sse2(const uint8_t* data, int size, int* posInOut, size_t* nalHdrSize)
+{
+    int pos = *posInOut;
+    const __m128i zero = _mm_setzero_si128();
+    for ( ; pos + 17 <= size; pos += 16 ) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(data+pos));
+        __m128i b = _mm_loadu_si128((const __m128i*)(data+pos+1));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(a, b), zero));
+        while ( mask ) {
+            int at = pos + _nal_lowest_bit(mask);
+            if ( size-at > 3 && _nal_is_start_code(data+at, size-at, nalHdrSize) ) {
+                return at;
+            }
+            mask &= mask-1;
+        }
+    }
+    *posInOut = pos;
+    return -1;
+}
+#endif
+
+#if NALU_SCAN_NEON
+static int _nal_scan_neon(const uint8_t* data, int size, int* posInOut, size_t* nalHdrSize)
+{
+    int pos = *posInOut;
+    const uint8x16_t zero = vdupq_n_u8(0);
+    for ( ; pos + 17 <= size; pos += 16 ) {
+        uint8x16_t  a = vld1q_u8(data+pos);
+        uint8x16_t  b = vld1q_u8(data+pos+1);
+        uint64x2_t  pairs = vreinterpretq_u64_u8(vceqq_u8(vorrq_u8(a, b), zero));
+        if ( (vgetq_lane_u64(pairs, 0) | vgetq_lane_u64(pairs, 1)) == 0 ) {
+            continue;
+        }
+        for (int at=pos; at<pos+16; at++) {
+            if ( !data[at] && !data[at+1] && size-at > 3 &&
+                 _nal_is_start_code(data+at, size-at, nalHdrSize) ) {
+                return at;
+            }
+        }
+    }
+    *posInOut = pos;
+    return -1;
+}
+#endif
+
+static const sv_cpu_kernel _kNalScanKernels[] = {
+#if NALU_SCAN_AVX2
+    { "avx2",   SV_CPU_AVX2,    (void*)_nal_scan_avx2 },
+#endif
+#if NALU_SCAN_SSE2
+    { "sse2",   SV_CPU_SSE2,    (void*)_nal_scan_sse2 },
+#elif NALU_SCAN_NEON
+    { "neon",   SV_CPU_NEON,    (void*)_nal_scan_neon },
+#endif
+    { "c",      0,              (void*)_nal_scan_c },
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+// Returns offset of the first start code in the buffer, or -1 if there isn't one.
+static int _nal_find_start_code(const uint8_t* data, int size, size_t* nalHdrSize)
+{
+    static const nal_scan_fn scan = (nal_scan_fn)sv_cpu_select_kernel("nal_scan",
+                    _kNalScanKernels, sizeof(_kNalScanKernels)/sizeof(_kNalScanKernels[0]));
+    int pos = 0;
+    int found = scan(data, size, &pos, nalHdrSize);
+    if ( found >= 0 ) {
+        return found;
+    }
+
+    // whatever is left (or everything, with the portable kernel): hop between zero bytes
+    while ( size-pos > 3 ) {
+        const uint8_t* zeroByte = (const uint8_t*)memchr(data+pos, 0, size-pos-3);
+        if ( zeroByte == NULL ) {
+            break;
+        }
+        pos = (int)(zeroByte - data);
+        if ( !data[pos+1] && _nal_is_start_code(data+pos, size-pos, nalHdrSize) ) {
+            return pos;
+        }
+        pos++;
+    }
+    return -1;
+}
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////
@@ -63,28 +239,14 @@ uint8_t* videolibapi_find_next_nal       ( uint8_t* data,
                                           uint8_t* nalType,
                                           fn_stream_log logCb )
 {
-    static const char mask = 0x1f;
-    int size = *sizeInOut;
-
-    while (size > 3) {
-        if ( !data[0] && !data[1] ) {
-            if ( !data[2] && size>4 && data[3]==1 ) {
-                *nalHdrSize = 4;
-                *nalType = data[4]&mask;
-                *sizeInOut = size;
-    //            logCb(logTrace, _FMT("Found NALU " << (int)*nalType ));
-                return data;
-            }
-            if ( data[2] == 1 ) {
-                *nalHdrSize = 3;
-                *nalType = data[3]&mask;
-                *sizeInOut = size;
-    //            logCb(logTrace, _FMT("Found NALU " << (int)*nalType ));
-                return data;
-            }
-        }
-        data++;
-        size--;
+    int pos = _nal_find_start_code(data, *sizeInOut, nalHdrSize);
+
+    if ( pos >= 0 ) {
+        data += pos;
+        *sizeInOut -= pos;
+        *nalType = data[*nalHdrSize]&kNALTypeMask;
+    //    logCb(logTrace, _FMT("Found NALU " << (int)*nalType ));
+        return data;
     }
 
 //    logCb(logTrace, _FMT("No more NALU!" ));
@@ -94,12 +256,59 @@ uint8_t* videolibapi_find_next_nal       ( uint8_t* data,
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////
+/*
+    Finds all NAL units in the buffer in one pass.
+    Parameters:
+    data            - buffer pointer
+    size            - size of the buffer
+    stopAtSlice     - stop after the first coded slice (IDR or not); everything
+                      that follows it belongs to the same picture
+    maxCount        - capacity of the output arrays
+    offsets         - offset of each NALU's header (start code) in the buffer
+    sizes           - size of each NALU, including the header
+    types           - type of each NALU
+    logCb           - log callback
+    Returns         - number of NALUs stored, at most maxCount
+*/
+extern "C"
+int     videolibapi_scan_nalus          ( uint8_t* data, size_t size,
+                                          int stopAtSlice,
+                                          int maxCount,
+                                          int* offsets,
+                                          int* sizes,
+                                          uint8_t* types,
+                                          fn_stream_log logCb )
+{
+    size_t  nalHdrSize = 0;
+    int     pos = 0;
+    int     count = 0;
+    int     found = _nal_find_start_code(data, (int)size, &nalHdrSize);
+
+    while ( found >= 0 && count < maxCount ) {
+        pos += found;
+        offsets[count] = pos;
+        types[count] = data[pos+nalHdrSize]&kNALTypeMask;
+
+        bool last = stopAtSlice && ( types[count] == kNALIFrame || types[count] == kNALCodedSlice );
+        pos += nalHdrSize;
+        found = last ? -1 : _nal_find_start_code(data+pos, (int)size-pos, &nalHdrSize);
+        sizes[count] = ( found >= 0 ? pos+found : (int)size ) - offsets[count];
+        count++;
+    }
+    return count;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+/*
+    Same as videolibapi_extract_nalu, but returns a pointer to the NALU in the
+    buffer rather than a copy of it, or NULL if there isn't one.
+*/
 extern "C"
-int videolibapi_extract_nalu(uint8_t* data, size_t size,
-                        uint8_t nalTypeWanted, uint8_t** mem,
-                        size_t* naluSize,
-                        size_t* remainingSize,
-                        fn_stream_log logCb)
+uint8_t* videolibapi_find_nalu          ( uint8_t* data, size_t size,
+                                          uint8_t nalTypeWanted,
+                                          size_t* naluSize,
+                                          size_t* remainingSize,
+                                          fn_stream_log logCb )
 {
     size_t      nalHdrSize = 0;
     uint8_t     nalType = 0;
@@ -120,21 +329,36 @@ int videolibapi_extract_nalu(uint8_t* data, size_t size,
                     *naluSize = remaining;
                     if ( remainingSize ) *remainingSize = 0;
                 }
-                *mem = (uint8_t*)malloc( *naluSize );
-                memcpy( *mem, nal, *naluSize );
-                return 1;
+                return nal;
             } if ( nalType == kNALIFrame || nalType == kNALCodedSlice ) {
                 // won't find anything after that
-                return 0;
+                return NULL;
             }
             data = nal + nalHdrSize;
             remaining -= nalHdrSize;
         } else {
-            return 0;
+            return NULL;
         }
     }
-    return 0;
+    return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+extern "C"
+int videolibapi_extract_nalu(uint8_t* data, size_t size,
+                        uint8_t nalTypeWanted, uint8_t** mem,
+                        size_t* naluSize,
+                        size_t* remainingSize,
+                        fn_stream_log logCb)
+{
+    uint8_t*    nal = videolibapi_find_nalu(data, size, nalTypeWanted, naluSize, remainingSize, logCb);
 
+    if ( nal == NULL ) {
+        return 0;
+    }
+    *mem = (uint8_t*)malloc( *naluSize );
+    memcpy( *mem, nal, *naluSize );
+    return 1;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////
@@ -176,6 +400,39 @@ int     videolibapi_contains_idr_frame   ( uint8_t* data, size_t size,
     return 0;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////
+/*
+    Determines if provided buffer contains a frame other frames may reference
+    Parameters:
+    data            - buffer
+    size            - buffer size
+    logCb           - log callback
+    Returns:        - 0 if the first coded slice has nal_ref_idc of 0, 1 otherwise
+                      (including the case when no coded slice could be found)
+
+*/
+extern "C"
+int     videolibapi_is_reference_frame   ( uint8_t* data, size_t size,
+                                            fn_stream_log logCb )
+{
+    size_t      nalHdrSize = 0;
+    uint8_t     nalType = 0;
+    int         remaining = size;
+    while ( remaining > 0 ) {
+        data = videolibapi_find_next_nal(data, &remaining, &nalHdrSize, &nalType, logCb);
+        if ( data == NULL || remaining <= (int)nalHdrSize ) {
+            return 1;
+        }
+        if ( nalType == kNALIFrame || nalType == kNALCodedSlice ) {
+            // all slices of a picture share nal_ref_idc, so the first one is enough
+            return ( data[nalHdrSize] & 0x60 ) != 0;
+        }
+        data += nalHdrSize;
+        remaining -= nalHdrSize;
+    }
+    return 1;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////
 extern "C"
 int     videolibapi_contained_nalu   ( uint8_t* data, size_t size,
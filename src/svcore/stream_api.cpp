@@ -33,8 +33,16 @@
 
 #include "sv_os.h"
 #include "streamprv.h"
+#include "sv_internal.h"
 #include "sv_ffmpeg.h"
 
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
 
 //-----------------------------------------------------------------------------
 FrameList*          frame_list_create()
@@ -128,7 +136,7 @@ SVCORE_API REF_T myclass##_ref                               (myclass##_obj* obj
     return res;\
 }
 
-#define UNREF_TEMPLATE(myclass) \
+#define UNREF_TEMPLATE(myclass, onRelease) \
 SVCORE_API REF_T myclass##_unref                             (myclass##_obj** obj)\
 {\
     if (obj==NULL) return 0;\
@@ -136,6 +144,7 @@ SVCORE_API REF_T myclass##_unref                             (myclass##_obj** ob
     if (base==NULL) return 0;\
     REF_T res = ATOMIC_DECREMENT(base->refcount);\
     if ( res <= 0 ) {\
+        onRelease;\
         base->destructor( *obj );\
     }\
     *obj = NULL;\
@@ -153,20 +162,30 @@ SVCORE_API void myclass##_set                               (myclass##_obj** dst
 }
 
 
+//-----------------------------------------------------------------------------
+// Called with every frame whose last reference is being released, before its
+// destructor runs (which, for pooled frames, returns it to the pool)
+static fn_frame_destroy g_FrameReleaseHook = NULL;
+
+SVCORE_API void     frame_set_release_hook                  (fn_frame_destroy hook)
+{
+    g_FrameReleaseHook = hook;
+}
+
 GET_API_TEMPLATE(frame);
 REF_TEMPLATE(frame);
-UNREF_TEMPLATE(frame);
+UNREF_TEMPLATE(frame, if (g_FrameReleaseHook) g_FrameReleaseHook(*obj));
 //SET_TEMPLATE(frame);
 
 
 GET_API_TEMPLATE(stream);
 REF_TEMPLATE(stream);
-UNREF_TEMPLATE(stream);
+UNREF_TEMPLATE(stream, );
 SET_TEMPLATE(stream);
 
 GET_API_TEMPLATE(stream_ev);
 REF_TEMPLATE(stream_ev);
-UNREF_TEMPLATE(stream_ev);
+UNREF_TEMPLATE(stream_ev, );
 SET_TEMPLATE(stream_ev);
 
 
@@ -197,12 +216,328 @@ void              stream_set_default_log_cb              (fn_stream_log log)
         return;
 
 
+//-----------------------------------------------------------------------------
+// Bumped whenever an element is inserted into, or removed from, any graph;
+// parameter handles re-resolve when it changes.
+static std::atomic<unsigned int>                    _gGraphGeneration(0);
+
+//-----------------------------------------------------------------------------
+// Per-node instrumentation. When enabled, the link from each node to its source
+// goes through _g_instrumented_stream_api, which forwards every call to the
+// source's own API, timing read_frame on the way. Time spent in upstream nodes
+// is tracked per thread, so that each node's self time can be told apart from
+// the time it spent waiting on its source.
+// The counters of a node are relaxed atomics, updated without any lock; the
+// reading thread finds them in a table of its own, and only goes to the shared
+// table, under its mutex, the first time it reads from a node.
+#define PIPELINE_STATS_PARAM "pipelineStats"
+
+typedef struct node_stats {
+    std::string                 name;
+    std::atomic<stream_obj*>    source;
+    std::atomic<INT64_T>        calls;
+    std::atomic<INT64_T>        framesOut;
+    std::atomic<INT64_T>        errors;
+    std::atomic<INT64_T>        bytesOut;
+    std::atomic<INT64_T>        totalTimeUs;    // including upstream
+    std::atomic<INT64_T>        selfTimeUs;
+    std::atomic<INT64_T>        maxSelfTimeUs;
+} node_stats;
+
+// what _pipeline_stats_get hands out
+typedef struct node_stats_snapshot {
+    std::string     name;
+    stream_obj*     source;
+    INT64_T         calls;
+    INT64_T         framesOut;
+    INT64_T         errors;
+    INT64_T         bytesOut;
+    INT64_T         avgTotalUs;
+    INT64_T         avgSelfUs;
+    INT64_T         maxSelfUs;
+} node_stats_snapshot;
+
+typedef std::unordered_map<const void*, std::shared_ptr<node_stats> > node_stats_map;
+
+// the per-thread table is dropped whenever a node is forgotten, as its
+// address may come back as another node's
+typedef struct node_stats_cache {
+    unsigned int    generation;
+    node_stats_map  nodes;
+} node_stats_cache;
+
+static std::mutex                                   _gNodeStatsMutex;
+static node_stats_map                               _gNodeStats;
+static std::atomic<unsigned int>                    _gNodeStatsGeneration(0);
+static thread_local node_stats_cache                _tNodeStats = { 0, node_stats_map() };
+static thread_local INT64_T                         _tUpstreamTimeUs = 0;
+static int                                          _gPipelineStatsEnabled = -1;
+
+static stream_api_t* _get_instrumented_stream_api();
+
+//-----------------------------------------------------------------------------
+static int          _pipeline_stats_enabled()
+{
+    if ( _gPipelineStatsEnabled < 0 ) {
+        _gPipelineStatsEnabled = sv_get_int_env_var("SV_PIPELINE_STATS", 1);
+    }
+    return _gPipelineStatsEnabled;
+}
+
+//-----------------------------------------------------------------------------
+static INT64_T      _pipeline_stats_now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//-----------------------------------------------------------------------------
+// API to be used for the link to source
+static stream_api_t* _pipeline_stats_source_api(stream_obj* source)
+{
+    if ( source == NULL ) {
+        return NULL;
+    }
+    return _pipeline_stats_enabled() ? _get_instrumented_stream_api() : stream_get_api(source);
+}
+
+//-----------------------------------------------------------------------------
+static void         _pipeline_stats_forget(stream_obj* stream)
+{
+    std::lock_guard<std::mutex> guard(_gNodeStatsMutex);
+    if ( _gNodeStats.erase(stream) ) {
+        _gNodeStatsGeneration.fetch_add(1, std::memory_order_release);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Counters of the node, created on the first read from it
+static node_stats*  _pipeline_stats_node(stream_obj* stream)
+{
+    unsigned int generation = _gNodeStatsGeneration.load(std::memory_order_acquire);
+    if ( _tNodeStats.generation != generation ) {
+        _tNodeStats.nodes.clear();
+        _tNodeStats.generation = generation;
+    }
+    auto it = _tNodeStats.nodes.find(stream);
+    if ( it != _tNodeStats.nodes.end() ) {
+        return it->second.get();
+    }
+
+    std::shared_ptr<node_stats> ns;
+    {
+        std::lock_guard<std::mutex> guard(_gNodeStatsMutex);
+        std::shared_ptr<node_stats>& entry = _gNodeStats[stream];
+        if ( !entry ) {
+            stream_base* base = (stream_base*)stream;
+            entry = std::make_shared<node_stats>();
+            entry->name = base->name ? base->name : "unnamed";
+            entry->source = base->source;
+            entry->calls = entry->framesOut = entry->errors = entry->bytesOut = 0;
+            entry->totalTimeUs = entry->selfTimeUs = entry->maxSelfTimeUs = 0;
+        }
+        ns = entry;
+    }
+    _tNodeStats.nodes.emplace(stream, ns);
+    return ns.get();
+}
+
+//-----------------------------------------------------------------------------
+static bool         _pipeline_stats_get(stream_obj* stream, node_stats_snapshot& out)
+{
+    std::shared_ptr<node_stats> ns;
+    {
+        std::lock_guard<std::mutex> guard(_gNodeStatsMutex);
+        auto it = _gNodeStats.find(stream);
+        if ( it == _gNodeStats.end() ) {
+            return false;
+        }
+        ns = it->second;
+    }
+    INT64_T calls = ns->calls.load(std::memory_order_relaxed);
+    out.name = ns->name;
+    out.source = ns->source.load(std::memory_order_relaxed);
+    out.calls = calls;
+    out.framesOut = ns->framesOut.load(std::memory_order_relaxed);
+    out.errors = ns->errors.load(std::memory_order_relaxed);
+    out.bytesOut = ns->bytesOut.load(std::memory_order_relaxed);
+    out.avgTotalUs = calls ? ns->totalTimeUs.load(std::memory_order_relaxed)/calls : 0;
+    out.avgSelfUs = calls ? ns->selfTimeUs.load(std::memory_order_relaxed)/calls : 0;
+    out.maxSelfUs = ns->maxSelfTimeUs.load(std::memory_order_relaxed);
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Formats the stats of stream and everything upstream from it, one node per line.
+// Returns the length of the result, which is truncated to fit the buffer.
+static size_t       _pipeline_stats_format(stream_obj* stream, char* buffer, size_t size)
+{
+    size_t      len = 0;
+    int         depth = 0;
+    node_stats_snapshot ns;
+
+    if ( size ) {
+        buffer[0] = '\0';
+    }
+    while ( stream != NULL && depth++ < 64 ) {
+        stream_base* base = (stream_base*)stream;
+        if ( !_pipeline_stats_get(stream, ns) ) {
+            stream = base->source;
+            continue;
+        }
+        node_stats_snapshot src;
+        INT64_T     framesIn = _pipeline_stats_get(ns.source, src) ? src.framesOut : -1;
+        char        line[512];
+        int         n = snprintf(line, sizeof(line),
+                            "%s: calls=%lld framesIn=%lld framesOut=%lld errors=%lld bytes=%lld "
+                            "avgSelfUs=%lld maxSelfUs=%lld avgUpstreamUs=%lld avgTotalUs=%lld\n",
+                            ns.name.c_str(),
+                            (long long)ns.calls,
+                            (long long)framesIn,
+                            (long long)ns.framesOut,
+                            (long long)ns.errors,
+                            (long long)ns.bytesOut,
+                            (long long)ns.avgSelfUs,
+                            (long long)ns.maxSelfUs,
+                            (long long)(ns.avgTotalUs-ns.avgSelfUs),
+                            (long long)ns.avgTotalUs);
+        if ( n > 0 ) {
+            if ( len + n < size ) {
+                memcpy(&buffer[len], line, n+1);
+            }
+            len += n;
+        }
+        stream = base->source;
+    }
+    return len;
+}
+
+//-----------------------------------------------------------------------------
+static int          _instrumented_read_frame(stream_obj* stream, frame_obj** frame)
+{
+    stream_base*    base = (stream_base*)stream;
+    INT64_T         outerUpstream = _tUpstreamTimeUs;
+
+    _tUpstreamTimeUs = 0;
+    INT64_T         start = _pipeline_stats_now_us();
+    int             res = base->api->read_frame(stream, frame);
+    INT64_T         total = _pipeline_stats_now_us() - start;
+    INT64_T         self = total - _tUpstreamTimeUs;
+    _tUpstreamTimeUs = outerUpstream + total;
+    if ( sv_trace_enabled() ) {
+        // same clock as sv_trace_now_us
+        sv_trace_span("read_frame", base->name ? base->name : "unnamed", start, start + total);
+    }
+
+    size_t          bytes = 0;
+    if ( res >= 0 && *frame != NULL ) {
+        bytes = frame_get_api(*frame)->get_data_size(*frame);
+    }
+
+    node_stats*     ns = _pipeline_stats_node(stream);
+    if ( self < 0 ) {
+        self = 0;
+    }
+    ns->source.store(base->source, std::memory_order_relaxed);
+    ns->calls.fetch_add(1, std::memory_order_relaxed);
+    if ( res < 0 ) {
+        ns->errors.fetch_add(1, std::memory_order_relaxed);
+    } else if ( *frame != NULL ) {
+        ns->framesOut.fetch_add(1, std::memory_order_relaxed);
+        ns->bytesOut.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    ns->totalTimeUs.fetch_add(total, std::memory_order_relaxed);
+    ns->selfTimeUs.fetch_add(self, std::memory_order_relaxed);
+    INT64_T maxSelf = ns->maxSelfTimeUs.load(std::memory_order_relaxed);
+    while ( self > maxSelf &&
+            !ns->maxSelfTimeUs.compare_exchange_weak(maxSelf, self, std::memory_order_relaxed) ) {
+    }
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+// Element insertion/removal resets the API pointer of the link it goes through
+// to the plain API of whatever ends up there; keep that link instrumented.
+static int          _instrumented_remove_element(stream_obj** pStream,
+                                            struct stream_api** pAPI,
+                                            const char* name,
+                                            stream_obj** removedStream)
+{
+    int res = stream_get_api(*pStream)->remove_element(pStream, pAPI, name, removedStream);
+    if ( pAPI && *pAPI != NULL ) {
+        *pAPI = _pipeline_stats_source_api(*pStream);
+    }
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+static int          _instrumented_insert_element(stream_obj** pStream,
+                                            struct stream_api** pAPI,
+                                            const char* insertBefore,
+                                            stream_obj* newElement,
+                                            INT64_T flags)
+{
+    int res = stream_get_api(*pStream)->insert_element(pStream, pAPI, insertBefore, newElement, flags);
+    if ( pAPI && *pAPI != NULL ) {
+        *pAPI = _pipeline_stats_source_api(*pStream);
+    }
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+#define INSTRUMENTED_FORWARD(rt, fn, args, ...)\
+static rt _instrumented_##fn(stream_obj* stream, ##__VA_ARGS__)\
+{\
+    return ((stream_base*)stream)->api->fn args;\
+}
+
+INSTRUMENTED_FORWARD(int,           set_source,         (stream, source, flags),    stream_obj* source, INT64_T flags)
+INSTRUMENTED_FORWARD(int,           set_log_cb,         (stream, log),              fn_stream_log log)
+INSTRUMENTED_FORWARD(const char*,   get_name,           (stream))
+INSTRUMENTED_FORWARD(stream_obj*,   find_element,       (stream, name),             const char* name)
+INSTRUMENTED_FORWARD(int,           set_param,          (stream, name, value),      const CHAR_T* name, const void* value)
+INSTRUMENTED_FORWARD(int,           get_param,          (stream, name, value, size),const CHAR_T* name, void* value, size_t* size)
+INSTRUMENTED_FORWARD(int,           open_in,            (stream))
+INSTRUMENTED_FORWARD(int,           seek,               (stream, offset, flags),    INT64_T offset, int flags)
+INSTRUMENTED_FORWARD(size_t,        get_width,          (stream))
+INSTRUMENTED_FORWARD(size_t,        get_height,         (stream))
+INSTRUMENTED_FORWARD(int,           get_pixel_format,   (stream))
+INSTRUMENTED_FORWARD(int,           print_pipeline,     (stream, buffer, size),     char* buffer, size_t size)
+INSTRUMENTED_FORWARD(int,           close,              (stream))
+
+static stream_api_t _g_instrumented_stream_api = {
+    NULL,       // create
+    _instrumented_set_source,
+    _instrumented_set_log_cb,
+    _instrumented_get_name,
+    _instrumented_find_element,
+    _instrumented_remove_element,
+    _instrumented_insert_element,
+    _instrumented_set_param,
+    _instrumented_get_param,
+    _instrumented_open_in,
+    _instrumented_seek,
+    _instrumented_get_width,
+    _instrumented_get_height,
+    _instrumented_get_pixel_format,
+    _instrumented_read_frame,
+    _instrumented_print_pipeline,
+    _instrumented_close
+};
+
+static stream_api_t* _get_instrumented_stream_api()
+{
+    return &_g_instrumented_stream_api;
+}
+
+
 //-----------------------------------------------------------------------------
 SVCORE_API void stream_destroy                          (stream_obj* stream)
 {
     DECLARE_BASE_V(stream, def);
     if (def) {
         get_default_stream_api()->close(stream);
+        _pipeline_stats_forget(stream);
         sv_freep(&def->name);
         free(def);
     }
@@ -258,7 +593,7 @@ int         defaultstream_set_source       (stream_obj* stream,
 #endif
     stream_set( &def->source, source );
     if ( def->source != NULL ) {
-        def->sourceApi = stream_get_api(def->source);
+        def->sourceApi = _pipeline_stats_source_api(def->source);
 #if GRAPH_DEBUG
         def->logCb(logDebug, _FMT("Setting source of " <<
                                 def->name << " to " <<
@@ -278,6 +613,8 @@ int         defaultstream_set_source       (stream_obj* stream,
                                 " initialized"));
 #endif
     }
+    // the element found under a path may be another one now
+    _gGraphGeneration++;
     return 0;
 }
 
@@ -333,6 +670,7 @@ int          defaultstream_remove_element       (stream_obj** pStream,
     def->logCb(logDebug, _FMT("Removing pipeline element " << name <<
                             " in pipeline starting with " << def->name ));
     if ( def->name != NULL && !strcmp(def->name,name) ) {
+        _gGraphGeneration++;
         // keep reference to our source
         stream_obj* oldSource = NULL;
         // make sure there's at least one reference to our source
@@ -382,6 +720,7 @@ int        defaultstream_insert_element   (stream_obj** pStream,
         *pStream = newElement;
         *pAPI = stream_get_api(*pStream);
         stream_ref(newElement);
+        _gGraphGeneration++;
         return 0;
     }
 
@@ -407,6 +746,7 @@ int        defaultstream_insert_element   (stream_obj** pStream,
         api->set_log_cb(newElement, def->logCb);
         api->set_source(newElement, *pStream, flags);
         stream_set(pStream, newElement);
+        _gGraphGeneration++;
         if (pAPI) {
             *pAPI = stream_get_api(*pStream);
         }
@@ -438,11 +778,20 @@ int         defaultstream_print_pipeline        (stream_obj* stream,
                                             size_t size)
 {
     DECLARE_BASE_I(stream, def);
-    static const char* sFilterFormat = "%s[%03d]->";
-    static const char* sDemuxFormat = "%s[%03d]";
-
+    static const char* sFilterFormat = "%s[%03d]%s->";
+    static const char* sDemuxFormat = "%s[%03d]%s";
+
+    // when instrumented, nodes also show frames produced and average self time
+    char        stats[64] = "";
+    node_stats_snapshot ns;
+    if ( _pipeline_stats_get(stream, ns) ) {
+        snprintf(stats, sizeof(stats), "{%lld,%lldus}",
+                    (long long)ns.framesOut,
+                    (long long)ns.avgSelfUs);
+    }
 
     int spaceNeeded = strlen(def->name)+
+                        strlen(stats)+
                         (def->source?2:1)+ // arrow or term zero
                         2+  // param brackets and commas
                         3;  // refcount
@@ -450,15 +799,14 @@ int         defaultstream_print_pipeline        (stream_obj* stream,
         return -1;
     }
 
-    sprintf(buffer, def->source?sFilterFormat:sDemuxFormat, def->name, def->refcount);
+    int written = sprintf(buffer, def->source?sFilterFormat:sDemuxFormat, def->name, def->refcount, stats);
 
     if ( def->source ) {
         return stream_get_api(def->source)->print_pipeline(def->source,
-                &buffer[spaceNeeded],
-                size-spaceNeeded);
+                &buffer[written],
+                size-written);
     }
 
-    buffer[spaceNeeded-1] = '\0';
     return 0;
 }
 
@@ -482,6 +830,17 @@ int         defaultstream_get_param             (stream_obj* stream,
                                             size_t* size)
 {
     DECLARE_BASE_I(stream, def);
+    if ( !_stricmp(name, PIPELINE_STATS_PARAM) ) {
+        // value is a char buffer of *size bytes; on failure, *size is set to
+        // the size required
+        size_t len = _pipeline_stats_format(stream, (char*)value, value ? *size : 0);
+        if ( value == NULL || len >= *size ) {
+            *size = len + 1;
+            return -1;
+        }
+        *size = len + 1;
+        return 0;
+    }
     if ( def->source ) {
         return def->sourceApi->get_param(def->source,
                                         name,
@@ -655,6 +1014,152 @@ SVCORE_API stream_api_t*     get_default_stream_api                  ()
 }
 
 
+//-----------------------------------------------------------------------------
+// Parameter handles. Resolving a scoped name ("a.subgraph.b.param") walks the
+// graph once, and leaves the handle pointing at the element the name is scoped
+// to, along with the name relative to it; reads and writes then go straight to
+// that element. Unscoped names resolve to the root itself. The walk is redone
+// if the graph has changed shape since, or the root variable points elsewhere.
+// Handles take no locks: use them under whatever lock guards the string API.
+struct stream_param_handle {
+    stream_obj* const*  root;
+    stream_obj*         rootResolved;
+    unsigned int        generation;
+    std::string         path;
+    stream_obj*         target;
+    stream_api_t*       targetApi;
+    std::string         name;
+};
+
+//-----------------------------------------------------------------------------
+static void         _stream_param_resolve(stream_param_handle* h)
+{
+    static const char   kSubgraph[] = "subgraph.";
+    const size_t        kSubgraphLen = sizeof(kSubgraph) - 1;
+
+    stream_unref(&h->target);
+    h->rootResolved = *h->root;
+    h->generation = _gGraphGeneration;
+    h->target = h->rootResolved;
+    h->name = h->path;
+    if ( h->target == NULL ) {
+        h->targetApi = NULL;
+        return;
+    }
+
+    size_t dot;
+    while ( (dot = h->name.find('.')) != std::string::npos ) {
+        std::string  elementName = h->name.substr(0, dot);
+        stream_obj*  element = stream_get_api(h->target)->find_element(h->target,
+                                                                       elementName.c_str());
+        if ( element == NULL ) {
+            break;
+        }
+        h->target = element;
+        h->name = h->name.substr(dot+1);
+
+        // cross into splitter subgraphs
+        stream_obj* subgraph = NULL;
+        size_t      size = sizeof(subgraph);
+        if ( !_strnicmp(h->name.c_str(), kSubgraph, kSubgraphLen) &&
+             stream_get_api(element)->get_param(element, "subgraph", &subgraph, &size) >= 0 &&
+             subgraph != NULL ) {
+            h->target = subgraph;
+            h->name = h->name.substr(kSubgraphLen);
+        }
+    }
+    stream_ref(h->target);
+    h->targetApi = stream_get_api(h->target);
+}
+
+//-----------------------------------------------------------------------------
+static stream_param_handle* _stream_param_refresh(stream_param_handle* h)
+{
+    if ( h == NULL ) {
+        return NULL;
+    }
+    if ( h->generation != _gGraphGeneration || h->rootResolved != *h->root ) {
+        _stream_param_resolve(h);
+    }
+    return ( h->target != NULL ) ? h : NULL;
+}
+
+extern "C" {
+
+//-----------------------------------------------------------------------------
+SVCORE_API void     stream_param_graph_changed       ()
+{
+    _gGraphGeneration++;
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API stream_param_handle* stream_param_resolve     (stream_obj* const* root,
+                                                          const char* name)
+{
+    stream_param_handle* h = new stream_param_handle;
+    h->root = root;
+    h->path = name;
+    h->target = NULL;
+    _stream_param_resolve(h);
+    return h;
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API int      stream_param_get                     (stream_param_handle* handle,
+                                                          void* value,
+                                                          size_t* size)
+{
+    stream_param_handle* h = _stream_param_refresh(handle);
+    if ( h == NULL ) {
+        return -1;
+    }
+    return h->targetApi->get_param(h->target, h->name.c_str(), value, size);
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API int      stream_param_set                     (stream_param_handle* handle,
+                                                          const void* value)
+{
+    stream_param_handle* h = _stream_param_refresh(handle);
+    if ( h == NULL ) {
+        return -1;
+    }
+    return h->targetApi->set_param(h->target, h->name.c_str(), value);
+}
+
+//-----------------------------------------------------------------------------
+#define PARAM_HANDLE_TYPED_GET(shorthand, type) \
+SVCORE_API int      stream_param_get_##shorthand         (stream_param_handle* handle, type* value)\
+{\
+    size_t size = sizeof(type);\
+    return stream_param_get(handle, value, &size);\
+}
+
+PARAM_HANDLE_TYPED_GET(int,     int)
+PARAM_HANDLE_TYPED_GET(int64,   INT64_T)
+PARAM_HANDLE_TYPED_GET(float,   float)
+PARAM_HANDLE_TYPED_GET(double,  double)
+PARAM_HANDLE_TYPED_GET(ptr,     void*)
+
+//-----------------------------------------------------------------------------
+SVCORE_API int      stream_param_set_int                 (stream_param_handle* handle, int value)
+{
+    return stream_param_set(handle, &value);
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API void     stream_param_release                 (stream_param_handle** handle)
+{
+    if ( handle && *handle ) {
+        stream_unref(&(*handle)->target);
+        delete *handle;
+        *handle = NULL;
+    }
+}
+
+} // extern "C"
+
+
 //-----------------------------------------------------------------------------
 #define STATS_IMPL(type,shorthand)\
 void stats_##shorthand##_init  (stats_item_##shorthand##_t* item)\
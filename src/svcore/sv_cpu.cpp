@@ -0,0 +1,268 @@
+/*****************************************************************************
+ *
+ * sv_cpu.cpp
+ *   CPU feature detection, and runtime selection of SIMD kernels.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#undef SV_MODULE_NAME
+#define SV_MODULE_NAME "svcpu"
+
+#include "sv_os.h"
+#include "sv_internal.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+//-----------------------------------------------------------------------------
+// Kernels with SIMD variants list them best first, each with the features it
+// needs, and pick one once through sv_cpu_select_kernel (keeping the function
+// pointer it returns). The features are detected once, and can be narrowed for
+// testing with SV_CPU_FEATURES: a comma-separated list of those allowed
+// (e.g. SV_CPU_FEATURES=sse2), or "none" for the portable C everywhere.
+// Variants above the baseline of the architecture (SSE2 on x86-64, NEON on
+// ARM64) are only built with SV_MULTI_ISA, see WITH_MULTI_ISA.
+// (SV_CPU_xxx and sv_cpu_kernel are in sv_internal.h)
+//-----------------------------------------------------------------------------
+#define CPU_FEATURES_VAR "SV_CPU_FEATURES"
+
+typedef struct sv_cpu_feature_def {
+    const char*     name;
+    unsigned        flag;
+} sv_cpu_feature_def;
+
+static const sv_cpu_feature_def _kFeatures[] = {
+    { "sse2",       SV_CPU_SSE2 },
+    { "ssse3",      SV_CPU_SSSE3 },
+    { "sse4.1",     SV_CPU_SSE41 },
+    { "avx2",       SV_CPU_AVX2 },
+    { "avx512bw",   SV_CPU_AVX512BW },
+    { "neon",       SV_CPU_NEON },
+};
+static const int kFeatureCount = sizeof(_kFeatures)/sizeof(_kFeatures[0]);
+
+//-----------------------------------------------------------------------------
+// Only ever reached through _sv_cpu_get(): kernels may well be selected by
+// static initializers of other modules.
+typedef struct sv_cpu_state {
+    unsigned                            detected;
+    unsigned                            allowed;
+    std::mutex                          mutex;
+    std::map<std::string, std::string>  kernels;    // name -> variant
+} sv_cpu_state;
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+//-----------------------------------------------------------------------------
+static void _sv_cpuid(unsigned leaf, unsigned sub, unsigned regs[4])
+{
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuidex(r, (int)leaf, (int)sub);
+    for (int nI=0; nI<4; nI++) {
+        regs[nI] = (unsigned)r[nI];
+    }
+#else
+    if ( !__get_cpuid_count(leaf, sub, &regs[0], &regs[1], &regs[2], &regs[3]) ) {
+        regs[0] = regs[1] = regs[2] = regs[3] = 0;
+    }
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Register state the OS saves on context switches (XCR0)
+static uint64_t _sv_xgetbv()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned lo, hi;
+    __asm__ volatile ( "xgetbv" : "=a"(lo), "=d"(hi) : "c"(0) );
+    return ((uint64_t)hi << 32) | lo;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+static unsigned _sv_cpu_detect()
+{
+    unsigned regs[4];
+    unsigned features = 0;
+
+    _sv_cpuid(0, 0, regs);
+    unsigned maxLeaf = regs[0];
+    _sv_cpuid(1, 0, regs);
+    if ( regs[3] & (1u<<26) ) features |= SV_CPU_SSE2;
+    if ( regs[2] & (1u<<9) )  features |= SV_CPU_SSSE3;
+    if ( regs[2] & (1u<<19) ) features |= SV_CPU_SSE41;
+
+    // the wider registers are only usable if the OS saves them
+    bool osxsave = (regs[2] & (1u<<27)) != 0;
+    uint64_t xcr0 = osxsave ? _sv_xgetbv() : 0;
+    bool ymm = (xcr0 & 0x06) == 0x06;
+    bool zmm = (xcr0 & 0xe6) == 0xe6;
+    if ( maxLeaf >= 7 ) {
+        _sv_cpuid(7, 0, regs);
+        if ( ymm && (regs[1] & (1u<<5)) ) {
+            features |= SV_CPU_AVX2;
+        }
+        // F and BW
+        if ( zmm && (regs[1] & (1u<<16)) && (regs[1] & (1u<<30)) ) {
+            features |= SV_CPU_AVX512BW;
+        }
+    }
+    return features;
+}
+#else
+//-----------------------------------------------------------------------------
+static unsigned _sv_cpu_detect()
+{
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+    return SV_CPU_NEON;
+#else
+    return 0;
+#endif
+}
+#endif
+
+//-----------------------------------------------------------------------------
+static unsigned _sv_cpu_parse_features(const char* spec)
+{
+    unsigned    features = 0;
+    std::string list(spec);
+    size_t      start = 0;
+
+    while ( start <= list.length() ) {
+        size_t      end = list.find(',', start);
+        std::string name = list.substr(start, end == std::string::npos ? std::string::npos : end-start);
+        for (int nI=0; nI<kFeatureCount; nI++) {
+            if ( !_stricmp(name.c_str(), _kFeatures[nI].name) ) {
+                features |= _kFeatures[nI].flag;
+            }
+        }
+        if ( end == std::string::npos ) {
+            break;
+        }
+        start = end + 1;
+    }
+    return features;
+}
+
+//-----------------------------------------------------------------------------
+static sv_cpu_state* _sv_cpu_get()
+{
+    static sv_cpu_state* state = []() {
+        sv_cpu_state* s = new sv_cpu_state;
+        char          spec[256];
+        size_t        size = sizeof(spec);
+        s->detected = _sv_cpu_detect();
+        s->allowed = s->detected;
+        if ( sv_get_env_var(CPU_FEATURES_VAR, spec, &size) == 0 ) {
+            s->allowed &= _sv_cpu_parse_features(spec);
+        }
+        return s;
+    }();
+    return state;
+}
+
+//-----------------------------------------------------------------------------
+static void _sv_cpu_format_features(std::ostringstream& str, unsigned features)
+{
+    bool first = true;
+    for (int nI=0; nI<kFeatureCount; nI++) {
+        if ( features & _kFeatures[nI].flag ) {
+            str << (first ? "" : ",") << _kFeatures[nI].name;
+            first = false;
+        }
+    }
+    if ( first ) {
+        str << "none";
+    }
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API unsigned sv_cpu_get_features     ()
+{
+    return _sv_cpu_get()->allowed;
+}
+
+//-----------------------------------------------------------------------------
+// Returns the first of the variants whose features are all there, or NULL if
+// none are; the portable variant, needing none, is expected to come last.
+SVCORE_API void*    sv_cpu_select_kernel    (const char* name,
+                                             const sv_cpu_kernel* variants,
+                                             int count)
+{
+    sv_cpu_state* s = _sv_cpu_get();
+    for (int nI=0; nI<count; nI++) {
+        if ( (variants[nI].features & s->allowed) == variants[nI].features ) {
+            std::lock_guard<std::mutex> lock(s->mutex);
+            s->kernels[name] = variants[nI].variant;
+            return variants[nI].fn;
+        }
+    }
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// "detected=<features>", "allowed=<features>", then "<kernel>=<variant>" for
+// each of the kernels selected so far.
+SVCORE_API int      sv_cpu_get_kernels      (char* buffer, size_t* size)
+{
+    sv_cpu_state*      s = _sv_cpu_get();
+    std::ostringstream str;
+
+    str << "detected=";
+    _sv_cpu_format_features(str, s->detected);
+    str << "\nallowed=";
+    _sv_cpu_format_features(str, s->allowed);
+    str << "\n";
+    {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        for ( const auto& it: s->kernels ) {
+            str << it.first << "=" << it.second << "\n";
+        }
+    }
+
+    std::string res = str.str();
+    if ( buffer == NULL || size == NULL || *size < res.length() + 1 ) {
+        if ( size ) *size = res.length() + 1;
+        return -1;
+    }
+    memcpy(buffer, res.c_str(), res.length() + 1);
+    *size = res.length() + 1;
+    return 0;
+}
@@ -0,0 +1,197 @@
+/*****************************************************************************
+ *
+ * sv_internal.h
+ *   svcore facilities shared with videolib, past the published headers.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+
+#ifndef SV_INTERNAL_H
+#define SV_INTERNAL_H
+
+#include "sv_os.h"
+#include "stream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//-----------------------------------------------------------------------------
+// Thread names, scheduling classes and CPU affinity (sv_os.cpp)
+//-----------------------------------------------------------------------------
+SVCORE_API sv_thread* sv_thread_create_ex         (sv_thread_func func, void* context,
+                                                  const char* name, const char* threadClass);
+SVCORE_API int        sv_thread_set_name          (const char* name);
+SVCORE_API int        sv_thread_set_class         (const char* threadClass);
+SVCORE_API int        sv_thread_set_class_affinity(const char* threadClass);
+SVCORE_API int        sv_thread_set_affinity      (const char* cpus);
+SVCORE_API int        sv_thread_get_affinity      (char* cpus, size_t size);
+
+//-----------------------------------------------------------------------------
+// Events that can be waited on with select/poll, or WaitForMultipleObjects
+// (sv_os.cpp)
+//-----------------------------------------------------------------------------
+typedef struct sv_pollable_event sv_pollable_event;
+SVCORE_API sv_pollable_event* sv_pollable_event_create     ();
+SVCORE_API void      sv_pollable_event_destroy    (sv_pollable_event** pEv);
+SVCORE_API void      sv_pollable_event_set        (sv_pollable_event* ev);
+SVCORE_API void      sv_pollable_event_reset      (sv_pollable_event* ev);
+SVCORE_API INT64_T   sv_pollable_event_get_handle (sv_pollable_event* ev);
+
+//-----------------------------------------------------------------------------
+// Read-only and attached mappings (sv_os.cpp)
+//-----------------------------------------------------------------------------
+#define SV_MMAP_ACCESS_NORMAL       0
+#define SV_MMAP_ACCESS_SEQUENTIAL   1
+#define SV_MMAP_ACCESS_RANDOM       2
+SVCORE_API sv_mmap*  sv_open_mmap_readonly        (const char* location, int access);
+SVCORE_API sv_mmap*  sv_attach_mmap               (const char* location);
+
+//-----------------------------------------------------------------------------
+// Memory accounting (memory_budget.cpp)
+//-----------------------------------------------------------------------------
+#define SV_MEMORY_PRESSURE_NONE     0
+#define SV_MEMORY_PRESSURE_SOFT     1
+#define SV_MEMORY_PRESSURE_HARD     2
+
+#define SV_MEMORY_FRAMES            0
+#define SV_MEMORY_FILES             1
+
+typedef void (*sv_memory_pressure_cb)(void* ctx, int level);
+
+SVCORE_API void sv_memory_charge            (int category, int ownerTag, int64_t bytes);
+SVCORE_API void sv_memory_name_tag          (int ownerTag, const char* name);
+SVCORE_API int  sv_memory_get_pressure      ();
+SVCORE_API int  sv_memory_add_pressure_cb   (sv_memory_pressure_cb cb, void* ctx);
+SVCORE_API void sv_memory_remove_pressure_cb(sv_memory_pressure_cb cb, void* ctx);
+SVCORE_API int  sv_memory_get_breakdown     (char* buffer, size_t* size);
+
+//-----------------------------------------------------------------------------
+// Timeline trace (sv_trace.cpp)
+//-----------------------------------------------------------------------------
+SVCORE_API int      sv_trace_enable             (int events);
+SVCORE_API int      sv_trace_enabled            ();
+SVCORE_API INT64_T  sv_trace_now_us             ();
+SVCORE_API void     sv_trace_span               (const char* category, const char* name,
+                                                 INT64_T startUs, INT64_T endUs);
+SVCORE_API void     sv_trace_set_thread_name    (const char* name);
+SVCORE_API int      sv_trace_dump               (const char* path);
+
+//-----------------------------------------------------------------------------
+// Frame pools (frame_allocator.cpp): a pool keeps up to desiredCount free
+// frames, and sheds the rest once it hadn't needed to allocate for
+// reductionTimeThreshold ms; -1 picks the default for either. Pool stats count
+// frames served from the pool, gets that found it empty, and frames freed
+// rather than kept.
+//-----------------------------------------------------------------------------
+typedef struct frame_allocator frame_allocator;
+SVCORE_API frame_allocator* create_frame_allocator2 (const char* name,
+                                                     int desiredCount,
+                                                     int reductionTimeThreshold);
+SVCORE_API void     frame_allocator_get_pool_stats   (frame_allocator* fa,
+                                                      int64_t* hits,
+                                                      int64_t* misses,
+                                                      int64_t* spills);
+
+//-----------------------------------------------------------------------------
+// Properties of basic events by pre-resolved key (event_basic.cpp); keys are
+// stable for the life of the process, -1 if the name couldn't be interned
+//-----------------------------------------------------------------------------
+SVCORE_API int      basic_event_property_key         (const CHAR_T* name);
+SVCORE_API int      basic_event_get_property_by_key  (stream_ev_obj* ev, int key,
+                                                      void* value, size_t* size);
+SVCORE_API int      basic_event_set_property_by_key  (stream_ev_obj* ev, int key,
+                                                      const void* value, size_t size);
+
+//-----------------------------------------------------------------------------
+// Pre-resolved parameter handles (stream_api.cpp)
+//-----------------------------------------------------------------------------
+typedef struct stream_param_handle stream_param_handle;
+SVCORE_API stream_param_handle* stream_param_resolve (stream_obj* const* root, const char* name);
+SVCORE_API int      stream_param_get                 (stream_param_handle* handle,
+                                                      void* value, size_t* size);
+SVCORE_API int      stream_param_set                 (stream_param_handle* handle,
+                                                      const void* value);
+SVCORE_API int      stream_param_get_int             (stream_param_handle* handle, int* value);
+SVCORE_API int      stream_param_get_int64           (stream_param_handle* handle, INT64_T* value);
+SVCORE_API int      stream_param_get_float           (stream_param_handle* handle, float* value);
+SVCORE_API int      stream_param_get_double          (stream_param_handle* handle, double* value);
+SVCORE_API int      stream_param_get_ptr             (stream_param_handle* handle, void** value);
+SVCORE_API int      stream_param_set_int             (stream_param_handle* handle, int value);
+SVCORE_API void     stream_param_release             (stream_param_handle** handle);
+// for nodes that rewire the graph behind them other than with set_source or
+// insert/remove_element (those already do): makes handles resolve again
+SVCORE_API void     stream_param_graph_changed       ();
+
+//-----------------------------------------------------------------------------
+// SIMD kernel dispatch (sv_cpu.cpp): kernels list their variants best first,
+// each with the SV_CPU_xxx features it needs, and pick one once
+//-----------------------------------------------------------------------------
+#define SV_CPU_SSE2         0x0001
+#define SV_CPU_SSSE3        0x0002
+#define SV_CPU_SSE41        0x0004
+#define SV_CPU_AVX2         0x0008
+#define SV_CPU_AVX512BW     0x0010
+#define SV_CPU_NEON         0x0100
+
+typedef struct sv_cpu_kernel {
+    const char*     variant;        // "avx2", "sse2", "c", ...
+    unsigned        features;       // SV_CPU_xxx needed; 0 for the portable one
+    void*           fn;
+} sv_cpu_kernel;
+
+SVCORE_API unsigned sv_cpu_get_features     ();
+SVCORE_API void*    sv_cpu_select_kernel    (const char* name,
+                                             const sv_cpu_kernel* variants,
+                                             int count);
+SVCORE_API int      sv_cpu_get_kernels      (char* buffer, size_t* size);
+
+//-----------------------------------------------------------------------------
+// NAL unit scanning (nalu.cpp)
+//-----------------------------------------------------------------------------
+int     videolibapi_scan_nalus          ( uint8_t* data, size_t size,
+                                          int stopAtSlice,
+                                          int maxCount,
+                                          int* offsets,
+                                          int* sizes,
+                                          uint8_t* types,
+                                          fn_stream_log logCb );
+// like videolibapi_extract_nalu, without the copy: points into data
+uint8_t* videolibapi_find_nalu          ( uint8_t* data, size_t size,
+                                          uint8_t nalTypeWanted,
+                                          size_t* naluSize,
+                                          size_t* remainingSize,
+                                          fn_stream_log logCb );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -32,6 +32,7 @@
  *****************************************************************************/
 
 #include "sv_os.h"
+#include "sv_internal.h"
 
 #ifdef WIN32
 #include <Shlwapi.h>
@@ -39,13 +40,27 @@
 #else
 #include <sys/time.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <libgen.h>
 #include <dlfcn.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+#ifdef __APPLE__
+#include <pthread/qos.h>
+#endif
 #endif
 #include <atomic>
+#include <mutex>
 #include <shared_mutex>
-
+#include <string>
+#include <vector>
 
 //-----------------------------------------------------------------------------
 #ifdef _WIN32
@@ -397,6 +412,7 @@ typedef struct sv_mmap   {
     char*           filename;
     size_t          size;
     uint8_t*        mmap;
+    bool            attached;       // mapped an existing file, rather than creating it
 #ifdef _WIN32
     HANDLE          handle;
     HANDLE          handleFile;
@@ -414,6 +430,7 @@ SVCORE_API sv_mmap*  sv_open_mmap(const char* location, size_t size)
     res->filename = &res->storage[0];
     res->handle = NULL;
     res->mmap = NULL;
+    res->attached = false;
     strcpy(res->filename, location);
 
 
@@ -494,6 +511,91 @@ SVCORE_API sv_mmap*  sv_open_mmap(const char* location, size_t size)
     return res;
 }
 
+//-----------------------------------------------------------------------------
+// Maps all of an existing file, as of the time of the call, leaving its
+// contents alone
+static sv_mmap*  _sv_map_existing_file(const char* location, bool writable, int access)
+{
+    sv_mmap* res = (sv_mmap*)malloc(sizeof(sv_mmap)+strlen(location)+1);
+    res->size = 0;
+    res->filename = &res->storage[0];
+    res->handle = NULL;
+    res->mmap = NULL;
+    // only the creator of a shared mapping clears it on close
+    res->attached = true;
+    strcpy(res->filename, location);
+
+#ifndef _WIN32
+    struct stat st;
+    res->handle = fopen(res->filename, writable ? "r+b" : "rb");
+    if ( res->handle && fstat(fileno(res->handle), &st) == 0 && st.st_size > 0 ) {
+        res->size = (size_t)st.st_size;
+        void* ptr = mmap(0, res->size,
+                         writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                         writable ? MAP_SHARED : MAP_PRIVATE,
+                         fileno(res->handle), 0);
+        if ( ptr != MAP_FAILED ) {
+            res->mmap = (uint8_t*)ptr;
+            int advice = MADV_NORMAL;
+            if ( access == SV_MMAP_ACCESS_SEQUENTIAL ) advice = MADV_SEQUENTIAL;
+            else if ( access == SV_MMAP_ACCESS_RANDOM ) advice = MADV_RANDOM;
+            madvise(res->mmap, res->size, advice);
+        }
+    }
+#else
+    // Windows has no equivalent of the access hints for mapped views
+    (void)access;
+    res->handleFile = NULL;
+    WCHAR filenameW[MAX_PATH] = { 0 };
+    if (MultiByteToWideChar(CP_UTF8, 0, res->filename, -1, filenameW, MAX_PATH)) {
+        res->handleFile = CreateFileW(filenameW,
+                writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                NULL,
+                OPEN_EXISTING,
+                FILE_ATTRIBUTE_NORMAL,
+                NULL);
+        if ( res->handleFile == INVALID_HANDLE_VALUE ) {
+            res->handleFile = NULL;
+        }
+    }
+
+    LARGE_INTEGER size;
+    if ( res->handleFile && GetFileSizeEx(res->handleFile, &size) && size.QuadPart > 0 ) {
+        res->size = (size_t)size.QuadPart;
+        res->handle = CreateFileMapping(res->handleFile, NULL,
+                writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+        if (res->handle) {
+            res->mmap = (uint8_t*)MapViewOfFile(res->handle,
+                writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+        }
+    }
+#endif // _WIN32
+
+    if (!res->handle || !res->mmap) {
+        sv_close_mmap(&res);
+    }
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+// Maps an existing file for reading, all of it, as of the time of the call.
+// access is one of SV_MMAP_ACCESS_*, passed on to the kernel as a hint of the
+// expected read pattern. Returns NULL if the file can't be opened or is empty;
+// close with sv_close_mmap.
+SVCORE_API sv_mmap*  sv_open_mmap_readonly(const char* location, int access)
+{
+    return _sv_map_existing_file(location, false, access);
+}
+
+//-----------------------------------------------------------------------------
+// Maps a file created by sv_open_mmap, most likely in another process, for
+// both to share, without clearing it first
+SVCORE_API sv_mmap*  sv_attach_mmap(const char* location)
+{
+    return _sv_map_existing_file(location, true, SV_MMAP_ACCESS_NORMAL);
+}
+
 //-----------------------------------------------------------------------------
 SVCORE_API void      sv_close_mmap(sv_mmap** pMap)
 {
@@ -502,7 +604,7 @@ SVCORE_API void      sv_close_mmap(sv_mmap** pMap)
     }
     sv_mmap* res = *pMap;
 
-    if (res->mmap) {
+    if (res->mmap && !res->attached) {
         // kinda silly, but the client side currently won't let go until
         // if gets what is perceived as invalid data ... and will fail to remove the file
         memset(res->mmap, 0, res->size);
@@ -633,6 +735,8 @@ typedef struct sv_thread  {
     bool            threadRunning;
     sv_thread_func  entry_point;
     void*           context;
+    std::string     name;           // applied by the thread itself, once started
+    std::string     threadClass;
 } sv_thread;
 typedef struct sv_rwlock  {
     bool                rwlock_inited;
@@ -795,9 +899,37 @@ SVCORE_API void      sv_mutex_destroy(sv_mutex** mutex)
         *mutex = NULL;
     }
 }
+//-----------------------------------------------------------------------------
+// With the timeline trace on, waits longer than SV_TRACE_MUTEX_US are recorded
+static void          _sv_mutex_enter_traced(sv_mutex* mutex)
+{
+    static const INT64_T kThresholdUs = sv_get_int_env_var("SV_TRACE_MUTEX_US", 1000);
+#ifdef _WIN32
+    if ( TryEnterCriticalSection(&mutex->cs) ) {
+        return;
+    }
+    INT64_T start = sv_trace_now_us();
+    EnterCriticalSection(&mutex->cs);
+#else
+    if ( pthread_mutex_trylock(&mutex->pt_mutex) == 0 ) {
+        return;
+    }
+    INT64_T start = sv_trace_now_us();
+    pthread_mutex_lock(&mutex->pt_mutex);
+#endif
+    INT64_T end = sv_trace_now_us();
+    if ( end - start >= kThresholdUs ) {
+        sv_trace_span("mutex", "mutex wait", start, end);
+    }
+}
+
 //-----------------------------------------------------------------------------
 SVCORE_API void      sv_mutex_enter(sv_mutex* mutex)
 {
+    if ( sv_trace_enabled() ) {
+        _sv_mutex_enter_traced(mutex);
+        return;
+    }
 #ifdef _WIN32
     EnterCriticalSection(&mutex->cs);
 #else
@@ -931,12 +1063,396 @@ SVCORE_API int       sv_event_wait(sv_event* ev, int timeoutMs)
     return result;
 }
 
+//-----------------------------------------------------------------------------
+// Manual-reset event backed by an OS handle, so a single thread can wait on
+// many of them with select/poll/epoll (an eventfd on Linux, the read end of a
+// non-blocking pipe elsewhere on POSIX) or WaitForMultipleObjects (an event
+// HANDLE). The handle is readable, or signaled, from set until reset; the
+// waiter shouldn't read from it. Setting an event which is already set, and
+// resetting one which isn't, don't make a system call.
+//-----------------------------------------------------------------------------
+typedef struct sv_pollable_event {
+    // keeps the flag in line with the handle's state
+    std::mutex      mutex;
+    bool            triggered;
+#ifdef _WIN32
+    HANDLE          hEvent;
+#else
+    int             fds[2];     // same descriptor twice for an eventfd
+#endif
+} sv_pollable_event;
+
+//-----------------------------------------------------------------------------
+SVCORE_API sv_pollable_event* sv_pollable_event_create()
+{
+    sv_pollable_event* res = new sv_pollable_event;
+    res->triggered = false;
+#ifdef _WIN32
+    res->hEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+    if ( res->hEvent == NULL ) {
+        delete res;
+        return NULL;
+    }
+#elif defined(__linux__)
+    res->fds[0] = res->fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ( res->fds[0] < 0 ) {
+        delete res;
+        return NULL;
+    }
+#else
+    if ( pipe(res->fds) != 0 ) {
+        delete res;
+        return NULL;
+    }
+    for (int nI=0; nI<2; nI++) {
+        fcntl(res->fds[nI], F_SETFL, fcntl(res->fds[nI], F_GETFL) | O_NONBLOCK);
+        fcntl(res->fds[nI], F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API void      sv_pollable_event_destroy(sv_pollable_event** pEv)
+{
+    if (pEv && *pEv) {
+        sv_pollable_event* ev = *pEv;
+#ifdef _WIN32
+        CloseHandle(ev->hEvent);
+#else
+        close(ev->fds[0]);
+        if ( ev->fds[1] != ev->fds[0] ) {
+            close(ev->fds[1]);
+        }
+#endif
+        delete ev;
+        *pEv = NULL;
+    }
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API void      sv_pollable_event_set(sv_pollable_event* ev)
+{
+    std::lock_guard<std::mutex> lock(ev->mutex);
+    if ( ev->triggered ) {
+        return;
+    }
+    ev->triggered = true;
+#ifdef _WIN32
+    SetEvent(ev->hEvent);
+#else
+    // a full pipe or counter is as readable as it gets
+    uint64_t one = 1;
+    ssize_t  res = write(ev->fds[1], &one, ev->fds[1] == ev->fds[0] ? sizeof(one) : 1);
+    (void)res;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API void      sv_pollable_event_reset(sv_pollable_event* ev)
+{
+    std::lock_guard<std::mutex> lock(ev->mutex);
+    if ( !ev->triggered ) {
+        return;
+    }
+    ev->triggered = false;
+#ifdef _WIN32
+    ResetEvent(ev->hEvent);
+#else
+    uint64_t buf[8];
+    while ( read(ev->fds[0], buf, sizeof(buf)) > 0 ) {
+        ;
+    }
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// File descriptor to poll for readability, or a HANDLE on Windows
+SVCORE_API INT64_T   sv_pollable_event_get_handle(sv_pollable_event* ev)
+{
+#ifdef _WIN32
+    return (INT64_T)(intptr_t)ev->hEvent;
+#else
+    return ev->fds[0];
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Thread names, scheduling classes and CPU affinity
+//
+// Classes, from the most favored down: "live" (capture: edge threads, live
+// decoders, recorders), "analytics" (feeding frames to analytics), "export"
+// (clip exports, thumbnails) and "background" (archive maintenance, which can
+// take as long as it needs to). Raising a thread above normal priority is likely
+// to need privileges; failing to do so leaves it at normal, and
+// SV_THREAD_PRIORITIES=0 leaves priorities alone altogether.
+// SV_THREAD_AFFINITY_<CLASS> (e.g. SV_THREAD_AFFINITY_EXPORT=8-15, or =node1
+// for the CPUs of a NUMA node) pins threads of a class. Threads started by a
+// configured thread -- ffmpeg's codec threads among them -- inherit both.
+//-----------------------------------------------------------------------------
+
+typedef struct sv_thread_class {
+    const char*     name;
+    int             level;          // +1 above normal, 0 normal, -1 below, -2 idle
+    const char*     affinityVar;
+} sv_thread_class;
+
+static const sv_thread_class _kThreadClasses[] = {
+    { "live",       1,  "SV_THREAD_AFFINITY_LIVE" },
+    { "analytics",  0,  "SV_THREAD_AFFINITY_ANALYTICS" },
+    { "export",     -1, "SV_THREAD_AFFINITY_EXPORT" },
+    { "background", -2, "SV_THREAD_AFFINITY_BACKGROUND" },
+};
+
+//-----------------------------------------------------------------------------
+static const sv_thread_class* _sv_thread_find_class(const char* threadClass)
+{
+    if ( threadClass == NULL ) {
+        return NULL;
+    }
+    for (size_t nI=0; nI<sizeof(_kThreadClasses)/sizeof(_kThreadClasses[0]); nI++) {
+        if ( !_stricmp(threadClass, _kThreadClasses[nI].name) ) {
+            return &_kThreadClasses[nI];
+        }
+    }
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// "0-3,8,10-11" -> cpus; "nodeN" takes the CPUs of NUMA node N
+static int _sv_thread_parse_cpus(const char* spec, std::vector<int>& cpus)
+{
+    char nodeList[1024];
+    int  node;
+    if ( sscanf(spec, "node%d", &node) == 1 ) {
+#ifdef __linux__
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* f = fopen(path, "r");
+        if ( f == NULL ) {
+            return -1;
+        }
+        size_t len = fread(nodeList, 1, sizeof(nodeList)-1, f);
+        fclose(f);
+        nodeList[len] = '\0';
+        spec = nodeList;
+#else
+        return -1;
+#endif
+    }
+
+    const char* p = spec;
+    while ( *p ) {
+        char* end;
+        long  first = strtol(p, &end, 10);
+        if ( end == p || first < 0 ) {
+            return -1;
+        }
+        long  last = first;
+        p = end;
+        if ( *p == '-' ) {
+            last = strtol(p+1, &end, 10);
+            if ( end == p+1 || last < first ) {
+                return -1;
+            }
+            p = end;
+        }
+        for (long cpu=first; cpu<=last; cpu++) {
+            cpus.push_back((int)cpu);
+        }
+        while ( *p == ',' || *p == ' ' || *p == '\n' ) {
+            p++;
+        }
+    }
+    return cpus.empty() ? -1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API int       sv_thread_set_name(const char* name)
+{
+    if ( name == NULL ) {
+        return -1;
+    }
+    // the timeline keeps the full name
+    sv_trace_set_thread_name(name);
+#ifdef _WIN32
+    // SetThreadDescription is only there on Windows 10 1607 and later
+    typedef HRESULT (WINAPI *set_thread_description_fn)(HANDLE, PCWSTR);
+    static set_thread_description_fn setDescription = (set_thread_description_fn)
+            GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "SetThreadDescription");
+    wchar_t wname[64];
+    if ( setDescription == NULL ||
+         MultiByteToWideChar(CP_UTF8, 0, name, -1, wname, 64) == 0 ) {
+        return -1;
+    }
+    return SUCCEEDED(setDescription(GetCurrentThread(), wname)) ? 0 : -1;
+#else
+    // names are limited to 15 characters
+    char shortName[16];
+    snprintf(shortName, sizeof(shortName), "%s", name);
+#ifdef __APPLE__
+    return pthread_setname_np(shortName) == 0 ? 0 : -1;
+#else
+    return pthread_setname_np(pthread_self(), shortName) == 0 ? 0 : -1;
+#endif
+#endif
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API int       sv_thread_set_affinity(const char* cpus)
+{
+    std::vector<int> list;
+    bool             all = ( cpus == NULL || *cpus == '\0' );
+    if ( !all && _sv_thread_parse_cpus(cpus, list) < 0 ) {
+        return -1;
+    }
+#ifdef _WIN32
+    DWORD_PTR mask = 0;
+    if ( all ) {
+        DWORD_PTR systemMask;
+        if ( !GetProcessAffinityMask(GetCurrentProcess(), &mask, &systemMask) ) {
+            return -1;
+        }
+    } else {
+        // the current processor group only
+        for (size_t nI=0; nI<list.size(); nI++) {
+            if ( list[nI] < (int)(sizeof(DWORD_PTR)*8) ) {
+                mask |= ((DWORD_PTR)1) << list[nI];
+            }
+        }
+    }
+    return ( mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0 ) ? 0 : -1;
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if ( all ) {
+        for (int cpu=0; cpu<CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, &set);
+        }
+    } else {
+        for (size_t nI=0; nI<list.size(); nI++) {
+            if ( list[nI] < CPU_SETSIZE ) {
+                CPU_SET(list[nI], &set);
+            }
+        }
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+#else
+    // macOS doesn't do hard affinity
+    return all ? 0 : -1;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+static int _sv_thread_set_level(int level)
+{
+#ifdef _WIN32
+    int priority = level > 0 ? THREAD_PRIORITY_ABOVE_NORMAL :
+                  (level < -1 ? THREAD_PRIORITY_LOWEST :
+                  (level < 0 ? THREAD_PRIORITY_BELOW_NORMAL : THREAD_PRIORITY_NORMAL));
+    return SetThreadPriority(GetCurrentThread(), priority) ? 0 : -1;
+#elif defined(__linux__)
+    // nice values are per thread on Linux
+    int niceValue = level > 0 ? -5 : (level < -1 ? 19 : (level < 0 ? 10 : 0));
+    return setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), niceValue) == 0 ? 0 : -1;
+#elif defined(__APPLE__)
+    qos_class_t qos = level > 0 ? QOS_CLASS_USER_INITIATED :
+                     (level < -1 ? QOS_CLASS_BACKGROUND :
+                     (level < 0 ? QOS_CLASS_UTILITY : QOS_CLASS_DEFAULT));
+    return pthread_set_qos_class_self_np(qos, 0) == 0 ? 0 : -1;
+#else
+    return -1;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API int       sv_thread_set_class_affinity(const char* threadClass)
+{
+    const sv_thread_class* cls = _sv_thread_find_class(threadClass);
+    if ( cls == NULL ) {
+        return -1;
+    }
+    char   cpus[256];
+    size_t size = sizeof(cpus);
+    if ( sv_get_env_var(cls->affinityVar, cpus, &size) < 0 ) {
+        // not pinned
+        return 0;
+    }
+    return sv_thread_set_affinity(cpus);
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API int       sv_thread_set_class(const char* threadClass)
+{
+    const sv_thread_class* cls = _sv_thread_find_class(threadClass);
+    if ( cls == NULL ) {
+        return -1;
+    }
+    int res = sv_thread_set_class_affinity(threadClass);
+    static int gPriorities = sv_get_int_env_var("SV_THREAD_PRIORITIES", 1);
+    if ( gPriorities && _sv_thread_set_level(cls->level) < 0 && cls->level > 0 ) {
+        // likely lacking the privileges; stay at normal
+        _sv_thread_set_level(0);
+    }
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API int       sv_thread_get_affinity(char* cpus, size_t size)
+{
+    std::string res;
+#ifdef _WIN32
+    // there's no GetThreadAffinityMask: setting one returns the previous
+    DWORD_PTR processMask, systemMask;
+    if ( !GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask) ) {
+        return -1;
+    }
+    DWORD_PTR mask = SetThreadAffinityMask(GetCurrentThread(), processMask);
+    if ( mask == 0 ) {
+        return -1;
+    }
+    SetThreadAffinityMask(GetCurrentThread(), mask);
+    for (int cpu=0; cpu<(int)(sizeof(DWORD_PTR)*8); cpu++) {
+        if ( mask & (((DWORD_PTR)1) << cpu) ) {
+            res += (res.empty() ? "" : ",") + std::to_string(cpu);
+        }
+    }
+#elif defined(__linux__)
+    cpu_set_t set;
+    if ( pthread_getaffinity_np(pthread_self(), sizeof(set), &set) != 0 ) {
+        return -1;
+    }
+    for (int cpu=0; cpu<CPU_SETSIZE; cpu++) {
+        if ( CPU_ISSET(cpu, &set) ) {
+            res += (res.empty() ? "" : ",") + std::to_string(cpu);
+        }
+    }
+#endif
+    if ( res.size() >= size ) {
+        return -1;
+    }
+    strcpy(cpus, res.c_str());
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void _sv_thread_apply_attributes(sv_thread* t)
+{
+    if ( !t->name.empty() ) {
+        sv_thread_set_name(t->name.c_str());
+    }
+    if ( !t->threadClass.empty() ) {
+        sv_thread_set_class(t->threadClass.c_str());
+    }
+}
+
 //-----------------------------------------------------------------------------
 #ifdef _WIN32
 static unsigned _sv_thread_entry_point(void* context)
 {
     sv_thread* t = (sv_thread*)context;
     CoInitialize(NULL);
+    _sv_thread_apply_attributes(t);
     t->entry_point(t->context);
     CoUninitialize();
     return 0;
@@ -947,6 +1463,7 @@ static void* _sv_thread_entry_point(void* context)
     int oldState;
     sv_thread* t = (sv_thread*)context;
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldState);
+    _sv_thread_apply_attributes(t);
     t->entry_point(t->context);
     pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &oldState);
     return NULL;
@@ -955,10 +1472,23 @@ static void* _sv_thread_entry_point(void* context)
 
 //-----------------------------------------------------------------------------
 SVCORE_API sv_thread* sv_thread_create(sv_thread_func func, void* context)
+{
+    return sv_thread_create_ex(func, context, NULL, NULL);
+}
+
+//-----------------------------------------------------------------------------
+// Same as sv_thread_create, with the thread named and put in a class (see
+// sv_thread_set_class) before func runs; either may be NULL
+SVCORE_API sv_thread* sv_thread_create_ex(sv_thread_func func,
+                                          void* context,
+                                          const char* name,
+                                          const char* threadClass)
 {
     sv_thread* res = new sv_thread;
     res->entry_point = func;
     res->context = context;
+    res->name = name ? name : "";
+    res->threadClass = threadClass ? threadClass : "";
 #ifndef _WIN32
     if (pthread_create(&res->pt_thread, NULL, _sv_thread_entry_point, (void*)res) != 0 ) {
 #else
@@ -0,0 +1,372 @@
+/*****************************************************************************
+ *
+ * sv_trace.cpp
+ *   Ring-buffered timeline of pipeline activity, dumped as Chrome trace JSON.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#undef SV_MODULE_NAME
+#define SV_MODULE_NAME "svtrace"
+
+#include "sv_os.h"
+#include "sv_internal.h"
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//-----------------------------------------------------------------------------
+// Aggregated stats don't explain an occasional stall; a timeline does. When
+// enabled, spans (read_frame of each node, decoder send/receive, recorder
+// writes, thread connector queue operations, long mutex waits) are recorded
+// into a fixed ring of the most recent events, which costs a relaxed atomic
+// increment and a few stores per span. While disabled, instrumented code only
+// checks sv_trace_enabled().
+// The ring is dumped as Chrome trace JSON (chrome://tracing, ui.perfetto.dev)
+// on demand, or by a background thread after a span took longer than
+// SV_TRACE_STALL_MS, at most once per kAutoDumpIntervalMs, into SV_TRACE_DIR.
+// SV_TRACE=<events> enables it at startup; sv_trace_enable does at runtime.
+//-----------------------------------------------------------------------------
+
+#define TRACE_VAR           "SV_TRACE"
+#define TRACE_STALL_VAR     "SV_TRACE_STALL_MS"
+#define TRACE_DIR_VAR       "SV_TRACE_DIR"
+
+static const int kMinEvents = 1024;
+static const int kDefaultStallMs = 250;
+static const int kAutoDumpIntervalMs = 60000;
+static const int kNameSize = 40;
+
+typedef struct sv_trace_record {
+    const char*             category;       // string literal
+    INT64_T                 startUs;
+    INT64_T                 durUs;
+    uint32_t                tid;
+    char                    name[kNameSize];
+} sv_trace_record;
+
+typedef struct sv_trace_event {
+    // index+1 of the event last written here; 0 while being written
+    std::atomic<uint64_t>   seq;
+    sv_trace_record         rec;
+} sv_trace_event;
+
+typedef struct sv_trace_ring {
+    sv_trace_event*         events;
+    uint64_t                capacity;
+    std::atomic<uint64_t>   next;
+} sv_trace_ring;
+
+//-----------------------------------------------------------------------------
+// Only ever reached through _sv_trace_get(); never destroyed, since threads
+// may still record while statics go away.
+typedef struct sv_trace_state {
+    std::atomic<int>            enabled;
+    std::atomic<sv_trace_ring*> ring;
+    INT64_T                     stallUs;
+    std::string                 dumpDir;
+
+    std::mutex                  mutex;
+    std::map<uint32_t, std::string> threadNames;
+
+    // auto-dump
+    std::condition_variable     cond;
+    std::thread*                dumper;
+    bool                        dumpRequested;
+    INT64_T                     lastDumpUs;
+
+    sv_trace_state()
+    {
+        enabled = 0;
+        ring = NULL;
+        stallUs = (INT64_T)sv_get_int_env_var(TRACE_STALL_VAR, kDefaultStallMs)*1000;
+        const char* dir = getenv(TRACE_DIR_VAR);
+        if ( dir == NULL ) dir = getenv("TMPDIR");
+        if ( dir == NULL ) dir = getenv("TEMP");
+        dumpDir = dir ? dir : ".";
+        dumper = NULL;
+        dumpRequested = false;
+        lastDumpUs = 0;
+    }
+} sv_trace_state;
+
+static int                  _sv_trace_enable_locked (sv_trace_state* ts, int events);
+
+//-----------------------------------------------------------------------------
+static sv_trace_state*      _sv_trace_get           ()
+{
+    static sv_trace_state* gState = []() {
+        sv_trace_state* ts = new sv_trace_state();
+        int events = sv_get_int_env_var(TRACE_VAR, 0);
+        if ( events > 0 ) {
+            _sv_trace_enable_locked(ts, events);
+        }
+        return ts;
+    }();
+    return gState;
+}
+
+//-----------------------------------------------------------------------------
+static uint32_t             _sv_trace_tid           ()
+{
+    static thread_local uint32_t tid = 0;
+    if ( tid == 0 ) {
+#if defined(_WIN32)
+        tid = (uint32_t)GetCurrentThreadId();
+#elif defined(__linux__)
+        tid = (uint32_t)syscall(SYS_gettid);
+#elif defined(__APPLE__)
+        uint64_t id = 0;
+        pthread_threadid_np(NULL, &id);
+        tid = (uint32_t)id;
+#else
+        tid = (uint32_t)std::hash<std::thread::id>()(std::this_thread::get_id());
+#endif
+    }
+    return tid;
+}
+
+//-----------------------------------------------------------------------------
+// Must be called with ts->mutex held (or before anyone else can see ts).
+// The ring is allocated once: writers may still be using it after tracing
+// is disabled, so the size of the first one enabled sticks.
+static int                  _sv_trace_enable_locked (sv_trace_state* ts, int events)
+{
+    if ( events <= 0 ) {
+        ts->enabled = 0;
+        return 0;
+    }
+    if ( ts->ring.load() == NULL ) {
+        sv_trace_ring* ring = new sv_trace_ring;
+        ring->capacity = (uint64_t)std::max(events, kMinEvents);
+        ring->events = new sv_trace_event[ring->capacity];
+        for (uint64_t nI=0; nI<ring->capacity; nI++) {
+            ring->events[nI].seq = 0;
+        }
+        ring->next = 0;
+        ts->ring = ring;
+    }
+    ts->enabled = 1;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// events is the size of the ring; 0 stops recording, but keeps what's there
+SVCORE_API int      sv_trace_enable             (int events)
+{
+    sv_trace_state* ts = _sv_trace_get();
+    std::lock_guard<std::mutex> guard(ts->mutex);
+    return _sv_trace_enable_locked(ts, events);
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API int      sv_trace_enabled            ()
+{
+    return _sv_trace_get()->enabled.load(std::memory_order_relaxed);
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API INT64_T  sv_trace_now_us             ()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//-----------------------------------------------------------------------------
+static void                 _sv_trace_dumper_thread (sv_trace_state* ts)
+{
+    std::unique_lock<std::mutex> lock(ts->mutex);
+    while ( true ) {
+        ts->cond.wait(lock, [&] { return ts->dumpRequested; });
+        ts->dumpRequested = false;
+        std::string path = ts->dumpDir + "/sv_trace_" +
+                    std::to_string(sv_time_get_current_epoch_time()) + ".json";
+        lock.unlock();
+        sv_trace_dump(path.c_str());
+        lock.lock();
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void                 _sv_trace_request_dump  (sv_trace_state* ts, INT64_T nowUs)
+{
+    std::lock_guard<std::mutex> guard(ts->mutex);
+    if ( ts->lastDumpUs != 0 &&
+         nowUs - ts->lastDumpUs < (INT64_T)kAutoDumpIntervalMs*1000 ) {
+        return;
+    }
+    ts->lastDumpUs = nowUs;
+    ts->dumpRequested = true;
+    if ( ts->dumper == NULL ) {
+        ts->dumper = new std::thread(_sv_trace_dumper_thread, ts);
+        ts->dumper->detach();
+    }
+    ts->cond.notify_all();
+}
+
+//-----------------------------------------------------------------------------
+// category must be a string literal; name is copied, and truncated
+SVCORE_API void     sv_trace_span               (const char* category, const char* name,
+                                                 INT64_T startUs, INT64_T endUs)
+{
+    sv_trace_state* ts = _sv_trace_get();
+    sv_trace_ring*  ring = ts->ring.load(std::memory_order_acquire);
+    if ( !ts->enabled.load(std::memory_order_relaxed) || ring == NULL ) {
+        return;
+    }
+
+    uint64_t        idx = ring->next.fetch_add(1, std::memory_order_relaxed);
+    sv_trace_event* e = &ring->events[idx % ring->capacity];
+    e->seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    e->rec.category = category;
+    e->rec.startUs = startUs;
+    e->rec.durUs = endUs - startUs;
+    e->rec.tid = _sv_trace_tid();
+    snprintf(e->rec.name, sizeof(e->rec.name), "%s", name ? name : "");
+    e->seq.store(idx + 1, std::memory_order_release);
+
+    if ( ts->stallUs > 0 && endUs - startUs >= ts->stallUs ) {
+        _sv_trace_request_dump(ts, endUs);
+    }
+}
+
+//-----------------------------------------------------------------------------
+SVCORE_API void     sv_trace_set_thread_name    (const char* name)
+{
+    if ( name == NULL ) {
+        return;
+    }
+    sv_trace_state* ts = _sv_trace_get();
+    std::lock_guard<std::mutex> guard(ts->mutex);
+    ts->threadNames[_sv_trace_tid()] = name;
+}
+
+//-----------------------------------------------------------------------------
+static void                 _sv_trace_write_string  (FILE* f, const char* s)
+{
+    fputc('"', f);
+    for ( ; *s; s++ ) {
+        unsigned char c = (unsigned char)*s;
+        if ( c == '"' || c == '\\' ) {
+            fputc('\\', f);
+            fputc(c, f);
+        } else if ( c < 0x20 ) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+//-----------------------------------------------------------------------------
+// Writes what's in the ring to path. Recording continues meanwhile; events
+// overwritten while being copied are left out.
+SVCORE_API int      sv_trace_dump               (const char* path)
+{
+    sv_trace_state* ts = _sv_trace_get();
+    sv_trace_ring*  ring = ts->ring.load(std::memory_order_acquire);
+    if ( path == NULL || ring == NULL ) {
+        return -1;
+    }
+
+    uint64_t        last = ring->next.load(std::memory_order_acquire);
+    uint64_t        first = last > ring->capacity ? last - ring->capacity : 0;
+    std::vector<sv_trace_record> copies;
+    copies.reserve((size_t)(last - first));
+    for (uint64_t idx=first; idx<last; idx++) {
+        sv_trace_event* e = &ring->events[idx % ring->capacity];
+        if ( e->seq.load(std::memory_order_acquire) != idx + 1 ) {
+            continue;
+        }
+        sv_trace_record c = e->rec;
+        c.name[kNameSize-1] = 0;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if ( e->seq.load(std::memory_order_relaxed) != idx + 1 ) {
+            continue;
+        }
+        copies.push_back(c);
+    }
+
+    std::map<uint32_t, std::string> threadNames;
+    {
+        std::lock_guard<std::mutex> guard(ts->mutex);
+        threadNames = ts->threadNames;
+    }
+
+    FILE* f = fopen(path, "w");
+    if ( f == NULL ) {
+        return -1;
+    }
+
+#ifdef _WIN32
+    int pid = _getpid();
+#else
+    int pid = getpid();
+#endif
+    bool comma = false;
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for ( auto& tn : threadNames ) {
+        fprintf(f, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":",
+                    comma ? ",\n" : "", pid, tn.first);
+        _sv_trace_write_string(f, tn.second.c_str());
+        fprintf(f, "}}");
+        comma = true;
+    }
+    for ( auto& c : copies ) {
+        fprintf(f, "%s{\"ph\":\"X\",\"name\":", comma ? ",\n" : "");
+        _sv_trace_write_string(f, c.name);
+        fprintf(f, ",\"cat\":\"%s\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%u}",
+                    c.category ? c.category : "",
+                    (long long)c.startUs, (long long)c.durUs, pid, c.tid);
+        comma = true;
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    return (int)copies.size();
+}
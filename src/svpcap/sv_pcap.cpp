@@ -44,6 +44,33 @@ extern "C" {
 }
 
 #include <algorithm>
+#include <list>
+#include <string>
+
+//-----------------------------------------------------------------------------
+// Capture settings; all can be overridden with environment variables
+#define PCAP_SNAPLEN_VAR        "SV_PCAP_SNAPLEN"       // bytes kept of each packet
+#define PCAP_BUFFER_MB_VAR      "SV_PCAP_BUFFER_MB"     // kernel capture buffer
+#define PCAP_ROTATE_MB_VAR      "SV_PCAP_ROTATE_MB"     // start a new file after this many MB ...
+#define PCAP_ROTATE_SEC_VAR     "SV_PCAP_ROTATE_SEC"    // ... or seconds
+#define PCAP_MAX_FILES_VAR      "SV_PCAP_MAX_FILES"     // rotated files kept, oldest removed first
+
+static const int    kDefaultSnaplen = 65535;
+static const int    kDefaultBufferMB = 16;
+static const int    kDefaultRotateMB = 256;
+static const int    kDefaultMaxFiles = 4;
+// packets are handed to the writer in blocks, and dropped if it can't keep up
+static const size_t kBlockSize = 1024*1024;
+static const size_t kMaxQueuedBlocks = 32;
+
+//-----------------------------------------------------------------------------
+// Packets captured, waiting to be written out: each record is a pcap_pkthdr
+// followed by caplen bytes of the packet
+typedef struct sv_pcap_block {
+    u_char*         data;
+    size_t          used;
+    size_t          packets;
+} sv_pcap_block;
 
 //-----------------------------------------------------------------------------
 typedef struct sv_pcap_dev {
@@ -62,6 +89,24 @@ typedef struct sv_pcap_dev {
     size_t          maxBytes;
     int             running;
     struct bpf_program  fp;      /* The compiled filter expression */
+
+    // the capture thread only fills blocks; the writer thread dumps them
+    sv_pcap_block*  block;
+    std::list<sv_pcap_block*>* queue;
+    sv_mutex*       queueMutex;
+    sv_event*       queueEvent;
+    sv_thread*      writer;
+    int             writerRunning;
+    size_t          blocksDropped;
+    size_t          packetsDropped;
+
+    // rotation
+    size_t          rotateBytes;
+    size_t          rotateMsec;
+    int             maxFiles;
+    int             fileIndex;
+    INT64_T         fileStart;
+    std::list<std::string>* files;
 } sv_pcap_dev;
 
 typedef struct sv_pcap {
@@ -163,68 +208,193 @@ static char* _sv_ip_from_uri(const char* _url,
 
 
 //-----------------------------------------------------------------------------
-// never got the callback working reliably
-#if 0
+static sv_pcap_block* _sv_block_create()
+{
+    sv_pcap_block* block = (sv_pcap_block*)malloc(sizeof(sv_pcap_block));
+    block->data = (u_char*)malloc(kBlockSize);
+    block->used = 0;
+    block->packets = 0;
+    return block;
+}
+
+//-----------------------------------------------------------------------------
+static void _sv_block_destroy(sv_pcap_block** pblock)
+{
+    if ( pblock && *pblock ) {
+        sv_freep(&(*pblock)->data);
+        sv_freep(pblock);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Hands the current block over to the writer
+static void _sv_block_submit(sv_pcap_dev* pcap)
+{
+    sv_pcap_block* block = pcap->block;
+    if ( block == NULL || block->packets == 0 ) {
+        return;
+    }
+    pcap->block = NULL;
+
+    sv_mutex_enter(pcap->queueMutex);
+    if ( pcap->queue->size() >= kMaxQueuedBlocks ) {
+        pcap->blocksDropped++;
+        pcap->packetsDropped += block->packets;
+        _sv_block_destroy(&block);
+    } else {
+        pcap->queue->push_back(block);
+        sv_event_set(pcap->queueEvent);
+    }
+    sv_mutex_exit(pcap->queueMutex);
+}
+
+//-----------------------------------------------------------------------------
+// Called by pcap_dispatch on the capture thread
 static void _sv_pcap_callback(u_char *arg,
                         const struct pcap_pkthdr* pcap_hdr,
                         const u_char* packet)
 {
-    //PCAP_DEBUG("_sv_pcap_callback -- in");
-    sv_pcap* pcap = (sv_pcap*)arg;
+    sv_pcap_dev* pcap = (sv_pcap_dev*)arg;
     size_t size = pcap_hdr->len;
 
-    if (!pcap->running ||
-        (sv_time_get_elapsed_time(pcap->captureStart) > pcap->maxMsec && pcap->maxMsec) ||
-        (size + pcap->captureSize > pcap->maxBytes && pcap->maxBytes) ) {
-        //PCAP_DEBUG("pcap_breakloop");
+    if ( (pcap->maxMsec && sv_time_get_elapsed_time(pcap->captureStart) > (INT64_T)pcap->maxMsec) ||
+         (pcap->maxBytes && size + pcap->captureSize > pcap->maxBytes) ) {
+        pcap->running = 0;
         pcap_breakloop(pcap->handle);
         return;
     }
 
-    // save the packet
-    //PCAP_DEBUG("pcap_dump");
-    pcap_dump((u_char *)pcap->dumper, pcap_hdr, packet);
-    pcap->packetsWritten++;
+    size_t recordSize = sizeof(struct pcap_pkthdr) + pcap_hdr->caplen;
+    if ( recordSize > kBlockSize ) {
+        // can't happen with any sane snaplen
+        pcap->packetsDropped++;
+        return;
+    }
+    if ( pcap->block != NULL && pcap->block->used + recordSize > kBlockSize ) {
+        _sv_block_submit(pcap);
+    }
+    if ( pcap->block == NULL ) {
+        pcap->block = _sv_block_create();
+    }
+
+    sv_pcap_block* block = pcap->block;
+    memcpy(block->data + block->used, pcap_hdr, sizeof(struct pcap_pkthdr));
+    memcpy(block->data + block->used + sizeof(struct pcap_pkthdr), packet, pcap_hdr->caplen);
+    block->used += recordSize;
+    block->packets++;
 
     pcap->captureSize += size;
-    //PCAP_DEBUG("_sv_pcap_callback -- out");
 }
-#endif
 
 //-----------------------------------------------------------------------------
-static void* _sv_pcap_thread(void* arg)
+static std::string _sv_pcap_file_path(sv_pcap_dev* pcap, int index)
+{
+    if ( index == 0 ) {
+        return pcap->path;
+    }
+    std::string path = pcap->path;
+    size_t ext = path.rfind(".pcap");
+    return path.substr(0, ext) + _STR("." << index) + path.substr(ext);
+}
+
+//-----------------------------------------------------------------------------
+// Closes the current file, and starts the next one, removing the oldest
+// file once there are too many
+static int _sv_pcap_rotate(sv_pcap_dev* pcap)
+{
+    pcap_dump_close(pcap->dumper);
+    pcap->dumper = NULL;
+
+    std::string path = _sv_pcap_file_path(pcap, ++pcap->fileIndex);
+    pcap->dumper = pcap_dump_open(pcap->handle, path.c_str());
+    if (pcap->dumper == NULL) {
+        pcap->logCb(pcap->logCtx, svpllError, _FMT("Failed to create dumper to " << path));
+        return -1;
+    }
+    pcap->fileStart = sv_time_get_current_epoch_time();
+    pcap->files->push_back(path);
+    while ( pcap->maxFiles > 0 && (int)pcap->files->size() > pcap->maxFiles ) {
+        pcap->logCb(pcap->logCtx, svpllDebug, _FMT("Removing " << pcap->files->front()));
+        remove(pcap->files->front().c_str());
+        pcap->files->pop_front();
+    }
+    pcap->logCb(pcap->logCtx, svpllDebug, _FMT("Rotated capture on " << pcap->device << " to " << path));
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void _sv_pcap_write_block(sv_pcap_dev* pcap, sv_pcap_block* block)
+{
+    size_t offset = 0;
+    while ( offset < block->used && pcap->dumper != NULL ) {
+        struct pcap_pkthdr* hdr = (struct pcap_pkthdr*)(block->data + offset);
+        pcap_dump((u_char *)pcap->dumper, hdr, block->data + offset + sizeof(struct pcap_pkthdr));
+        pcap->packetsWritten++;
+        offset += sizeof(struct pcap_pkthdr) + hdr->caplen;
+    }
+    if ( pcap->dumper == NULL ) {
+        return;
+    }
+    pcap_dump_flush(pcap->dumper);
+
+    if ( (pcap->rotateBytes && (size_t)pcap_dump_ftell(pcap->dumper) >= pcap->rotateBytes) ||
+         (pcap->rotateMsec && sv_time_get_elapsed_time(pcap->fileStart) >= (INT64_T)pcap->rotateMsec) ) {
+        _sv_pcap_rotate(pcap);
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void* _sv_pcap_writer_thread(void* arg)
 {
     sv_pcap_dev* pcap = (sv_pcap_dev*)arg;
-    pcap->logCb(pcap->logCtx, svpllDebug, _FMT("_sv_pcap_thread - dev=" << pcap->device << " in - " << (void*)arg));
-    while (pcap->running) {
-        struct pcap_pkthdr *pkt_header;
-        const u_char *pkt_data;
-        int res = pcap_next_ex(pcap->handle, &pkt_header, &pkt_data);
-        if ( res >= 0 ) {
-            size_t size = pkt_header->len;
-
-            if ( (sv_time_get_elapsed_time(pcap->captureStart) > pcap->maxMsec && pcap->maxMsec) ||
-                 (size + pcap->captureSize > pcap->maxBytes && pcap->maxBytes) ) {
+    while (true) {
+        sv_mutex_enter(pcap->queueMutex);
+        if ( pcap->queue->empty() ) {
+            if ( !pcap->writerRunning ) {
+                sv_mutex_exit(pcap->queueMutex);
                 break;
             }
+            sv_event_reset(pcap->queueEvent);
+            sv_mutex_exit(pcap->queueMutex);
+            sv_event_wait(pcap->queueEvent, 0);
+            continue;
+        }
+        sv_pcap_block* block = pcap->queue->front();
+        pcap->queue->pop_front();
+        sv_mutex_exit(pcap->queueMutex);
 
-            if ( res > 0 ) {
-                // save the packet
-                pcap->logCb(pcap->logCtx, svpllTrace, _FMT(pcap->device << "- pcap_dump: pkt_header->len=" << pkt_header->len <<
-                                         " pkt_header->caplen=" << pkt_header->caplen));
-                pcap_dump((u_char *)pcap->dumper, pkt_header, pkt_data);
-                pcap->packetsWritten++;
+        _sv_pcap_write_block(pcap, block);
+        _sv_block_destroy(&block);
+    }
+    return NULL;
+}
 
-                pcap->captureSize += size;
+//-----------------------------------------------------------------------------
+static void* _sv_pcap_thread(void* arg)
+{
+    sv_pcap_dev* pcap = (sv_pcap_dev*)arg;
+    pcap->logCb(pcap->logCtx, svpllDebug, _FMT("_sv_pcap_thread - dev=" << pcap->device << " in - " << (void*)arg));
+    while (pcap->running) {
+        // drains whatever the kernel buffered since the last call
+        int res = pcap_dispatch(pcap->handle, -1, _sv_pcap_callback, (u_char*)pcap);
+        if ( res < 0 ) {
+            if ( res != PCAP_ERROR_BREAK ) {
+                pcap->logCb(pcap->logCtx, svpllError, _FMT(pcap->device << " - pcap_dispatch failed: " << pcap_geterr(pcap->handle)));
             }
+            break;
+        }
+        if ( res == 0 || (pcap->block != NULL && pcap->block->used >= kBlockSize/2) ) {
+            // idle, or plenty to write -- don't hold on to the packets
+            _sv_block_submit(pcap);
         }
     }
+    _sv_block_submit(pcap);
+    _sv_block_destroy(&pcap->block);
 
     struct pcap_stat stat;
-    if ( pcap_stats(pcap->handle, &stat) ) {
-
-    }
-    pcap->logCb(pcap->logCtx, svpllInfo, _FMT("_sv_pcap_thread - out: dev=" << pcap->device << " rx=" << stat.ps_recv << " drop=" << stat.ps_drop << " if_drop=" << stat.ps_ifdrop << " written=" << pcap->packetsWritten));
+    memset(&stat, 0, sizeof(stat));
+    pcap_stats(pcap->handle, &stat);
+    pcap->logCb(pcap->logCtx, svpllInfo, _FMT("_sv_pcap_thread - out: dev=" << pcap->device << " rx=" << stat.ps_recv << " drop=" << stat.ps_drop << " if_drop=" << stat.ps_ifdrop << " queueDrop=" << pcap->packetsDropped));
     return NULL;
 }
 
@@ -270,7 +440,7 @@ static sv_pcap_dev* _sv_capture_traffic(const char* ipStr,
 {
     char                filter[256] = "\0";
     char*               filteredName = NULL;
-    sv_pcap_dev* res = (sv_pcap_dev*)malloc(sizeof(sv_pcap));
+    sv_pcap_dev* res = (sv_pcap_dev*)malloc(sizeof(sv_pcap_dev));
     memset(res, 0, sizeof(sv_pcap_dev));
     res->logCb = logCb;
     res->logCtx = logCtx;
@@ -285,16 +455,36 @@ static sv_pcap_dev* _sv_capture_traffic(const char* ipStr,
 
     res->device = strdup(device->name);
     res->maxBytes = maxCaptureSizeBytes;
-    res->maxBytes = maxCaptureMsec;
+    res->maxMsec = maxCaptureMsec;
     res->packetsWritten = 0;
     res->captureSize = 0;
-
-
-    res->handle = pcap_open_live(res->device, 65535, 0, 1000, res->errbuf);
+    res->rotateBytes = (size_t)sv_get_int_env_var(PCAP_ROTATE_MB_VAR, kDefaultRotateMB)*1024*1024;
+    res->rotateMsec = (size_t)sv_get_int_env_var(PCAP_ROTATE_SEC_VAR, 0)*1000;
+    res->maxFiles = sv_get_int_env_var(PCAP_MAX_FILES_VAR, kDefaultMaxFiles);
+    res->files = new std::list<std::string>;
+    res->queue = new std::list<sv_pcap_block*>;
+    res->queueMutex = sv_mutex_create();
+    res->queueEvent = sv_event_create(0, 0);
+
+    // not pcap_open_live: the buffer size has to be set before activation.
+    // Leaving immediate mode off lets the kernel batch the packets (TPACKET_V3
+    // on linux), for pcap_dispatch to hand over in bulk.
+    res->handle = pcap_create(res->device, res->errbuf);
     if (res->handle == NULL) {
         logCb( logCtx, svpllError, _STR("Failed to open live capture"));
         goto Error;
     }
+    pcap_set_snaplen(res->handle, sv_get_int_env_var(PCAP_SNAPLEN_VAR, kDefaultSnaplen));
+    pcap_set_promisc(res->handle, 0);
+    pcap_set_timeout(res->handle, 1000);
+    pcap_set_buffer_size(res->handle, sv_get_int_env_var(PCAP_BUFFER_MB_VAR, kDefaultBufferMB)*1024*1024);
+#ifndef _WIN32
+    pcap_set_immediate_mode(res->handle, 0);
+#endif
+    if (pcap_activate(res->handle) < 0) {
+        logCb( logCtx, svpllError, _STR("Failed to activate live capture: " << pcap_geterr(res->handle)));
+        goto Error;
+    }
 
     filteredName = _sv_capture_filter_name(device->name);
     res->path = strdup(_STR(saveTo<<"-"<<filteredName<<".pcap"));
@@ -305,6 +495,9 @@ static sv_pcap_dev* _sv_capture_traffic(const char* ipStr,
         logCb(logCtx, svpllError, _FMT("Failed to create dumper to " << res->path));
         goto Error;
     }
+    res->fileIndex = 0;
+    res->fileStart = sv_time_get_current_epoch_time();
+    res->files->push_back(res->path);
 
     if ( ipStr != NULL ) {
         bpf_u_int32         mask = (bpf_u_int32)inet_addr("255.255.255.0");      /* The netmask of our sniffing device */
@@ -321,6 +514,13 @@ static sv_pcap_dev* _sv_capture_traffic(const char* ipStr,
         }
     }
 
+    res->writerRunning = 1;
+    res->writer = sv_thread_create(_sv_pcap_writer_thread, res );
+    if ( !res->writer ) {
+        logCb( logCtx, svpllError, _STR("Failed to start the writer"));
+        goto Error;
+    }
+
     res->captureStart = sv_time_get_current_epoch_time();
     res->running = 1;
     res->thread = sv_thread_create(_sv_pcap_thread, res );
@@ -395,6 +595,31 @@ static void     _sv_stop_capture(sv_pcap_dev** ppcap)
         pcap_breakloop(pcap->handle);
         sv_thread_destroy(&pcap->thread);
     }
+    if ( pcap->writer ) {
+        // lets the writer finish what was captured
+        sv_mutex_enter(pcap->queueMutex);
+        pcap->writerRunning = 0;
+        sv_event_set(pcap->queueEvent);
+        sv_mutex_exit(pcap->queueMutex);
+        sv_thread_destroy(&pcap->writer);
+    }
+    if ( pcap->queue ) {
+        while ( !pcap->queue->empty() ) {
+            sv_pcap_block* block = pcap->queue->front();
+            pcap->queue->pop_front();
+            _sv_block_destroy(&block);
+        }
+        delete pcap->queue;
+    }
+    _sv_block_destroy(&pcap->block);
+    sv_mutex_destroy(&pcap->queueMutex);
+    sv_event_destroy(&pcap->queueEvent);
+    delete pcap->files;
+
+    if ( pcap->blocksDropped ) {
+        pcap->logCb(pcap->logCtx, svpllInfo, _FMT("Writer fell behind on " << pcap->device << ": dropped " <<
+                            pcap->packetsDropped << " packets in " << pcap->blocksDropped << " blocks"));
+    }
 
     if (pcap->packetsWritten == 0 &&
         pcap->path != NULL &&
@@ -0,0 +1,1036 @@
+/*****************************************************************************
+ *
+ * sv_pcap_replay.cpp
+ *   Serves a camera's traffic, as captured by sv_capture_traffic, back over
+ *   RTSP. Used for repeatable load tests of the live pipeline.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "sv_pcap.h"
+
+
+//-----------------------------------------------------------------------------
+extern "C" {
+#include <pcap/pcap.h>
+}
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+    typedef SOCKET          replay_socket_t;
+    #define REPLAY_INVALID_SOCKET   INVALID_SOCKET
+    #define replay_closesocket      closesocket
+    #define poll                    WSAPoll
+    #define strncasecmp             _strnicmp
+#else
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+    #include <arpa/inet.h>
+    #include <poll.h>
+    #include <unistd.h>
+    #include <errno.h>
+    typedef int             replay_socket_t;
+    #define REPLAY_INVALID_SOCKET   -1
+    #define replay_closesocket      close
+#endif
+#ifndef MSG_NOSIGNAL
+    #define MSG_NOSIGNAL 0
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+//-----------------------------------------------------------------------------
+typedef struct sv_pcap_replay sv_pcap_replay;
+
+extern "C" {
+SVPCAP_API sv_pcap_replay*  sv_replay_start     (const char* capturePath,
+                                                 int port,
+                                                 double speed,
+                                                 int loop,
+                                                 sv_pcap_log_cb_t logCb,
+                                                 void* logCtx);
+SVPCAP_API int              sv_replay_get_port  (sv_pcap_replay* replay);
+SVPCAP_API int              sv_replay_get_stats (sv_pcap_replay* replay,
+                                                 INT64_T* sessions,
+                                                 INT64_T* packets,
+                                                 INT64_T* bytes,
+                                                 INT64_T* maxLagUs);
+SVPCAP_API void             sv_replay_stop      (sv_pcap_replay** replay);
+}
+
+//-----------------------------------------------------------------------------
+// how often the threads check whether they should stop
+static const int        kPollMsec = 100;
+// pause between the end of the capture and its start, when looping
+static const INT64_T    kLoopGapUs = 40000;
+// at full speed, packets sent before the requests are looked at again
+static const int        kMaxBurst = 64;
+// assumed RTP clock step between the last frame and the first one, if the
+// capture doesn't show one
+static const uint32_t   kDefaultTsStep = 3000;
+
+//-----------------------------------------------------------------------------
+// An RTP packet of the capture
+typedef struct replay_packet {
+    INT64_T         tsUs;       // capture time, since the first packet
+    int             track;      // the SETUP it belongs to, in capture order
+    std::string     data;
+} replay_packet;
+
+//-----------------------------------------------------------------------------
+// A SETUP seen in the capture, and what it takes to loop its packets
+typedef struct replay_track {
+    int             interleaved;    // channel, if RTP went over RTSP, or -1
+    int             clientPort;     // client RTP port, if over UDP, or -1
+    int             packets;
+    uint16_t        firstSeq;
+    uint16_t        lastSeq;
+    uint32_t        firstTs;
+    uint32_t        lastTs;
+    uint32_t        tsStep;
+} replay_track;
+
+//-----------------------------------------------------------------------------
+typedef struct replay_capture {
+    std::string                 sdp;
+    std::vector<replay_track>   tracks;
+    std::vector<replay_packet>  packets;
+    INT64_T                     durationUs;
+} replay_capture;
+
+//-----------------------------------------------------------------------------
+// One direction of a TCP connection, reassembled
+typedef struct replay_tcp_flow {
+    bool            started;
+    uint32_t        nextSeq;
+    INT64_T         firstUs;
+    std::string     data;
+    // where in data each segment starts, and when it was captured
+    std::vector<std::pair<size_t, INT64_T> > times;
+} replay_tcp_flow;
+
+//-----------------------------------------------------------------------------
+// A UDP datagram that looks like RTP, until we know which track it's on
+typedef struct replay_udp {
+    INT64_T         tsUs;
+    int             dstPort;
+    std::string     data;
+} replay_udp;
+
+//-----------------------------------------------------------------------------
+// A client connection; each is a virtual camera, playing the capture from
+// its start
+typedef struct replay_session {
+    sv_pcap_replay* owner;
+    replay_socket_t sock;
+    sv_thread*      thread;
+    int             id;
+} replay_session;
+
+//-----------------------------------------------------------------------------
+struct sv_pcap_replay {
+    sv_pcap_log_cb_t            logCb;
+    void*                       logCtx;
+    replay_capture*             capture;
+    double                      speed;
+    int                         loop;
+    replay_socket_t             listenSock;
+    int                         port;
+    sv_thread*                  thread;
+    std::atomic<int>            running;
+    std::list<replay_session*>  sessions;
+    int                         nextSessionId;
+
+    std::atomic<INT64_T>        activeSessions;
+    std::atomic<INT64_T>        packetsSent;
+    std::atomic<INT64_T>        bytesSent;
+    std::atomic<INT64_T>        maxLagUs;
+};
+
+
+//-----------------------------------------------------------------------------
+static inline uint16_t _replay_rd16(const u_char* p)
+{
+    return (uint16_t)((p[0]<<8) | p[1]);
+}
+
+//-----------------------------------------------------------------------------
+static inline uint32_t _replay_rd32(const u_char* p)
+{
+    return ((uint32_t)p[0]<<24) | ((uint32_t)p[1]<<16) | ((uint32_t)p[2]<<8) | p[3];
+}
+
+//-----------------------------------------------------------------------------
+static inline void _replay_wr16(u_char* p, uint16_t v)
+{
+    p[0] = (u_char)(v>>8);
+    p[1] = (u_char)v;
+}
+
+//-----------------------------------------------------------------------------
+static inline void _replay_wr32(u_char* p, uint32_t v)
+{
+    p[0] = (u_char)(v>>24);
+    p[1] = (u_char)(v>>16);
+    p[2] = (u_char)(v>>8);
+    p[3] = (u_char)v;
+}
+
+//-----------------------------------------------------------------------------
+// The transport layer of a captured packet
+typedef struct replay_l4 {
+    int             proto;          // IPPROTO_TCP or IPPROTO_UDP
+    std::string     src;            // address and port, as raw bytes
+    std::string     dst;
+    int             srcPort;
+    int             dstPort;
+    uint32_t        seq;
+    bool            syn;
+    const u_char*   payload;
+    size_t          size;
+} replay_l4;
+
+//-----------------------------------------------------------------------------
+// Strips the link, IP and TCP/UDP headers. IP fragments and IPv6 extension
+// headers aren't dealt with; cameras rarely produce either.
+static bool _replay_parse_packet(int linkType, const u_char* data, size_t len, replay_l4& out)
+{
+    size_t offset;
+    switch (linkType) {
+    case DLT_EN10MB:
+        offset = 14;
+        if ( len >= 18 && _replay_rd16(data+12) == 0x8100 ) {
+            offset += 4;
+        }
+        break;
+    case DLT_LINUX_SLL:
+        offset = 16;
+        break;
+    case DLT_NULL:
+    case DLT_LOOP:
+        offset = 4;
+        break;
+    case DLT_RAW:
+        offset = 0;
+        break;
+    default:
+        return false;
+    }
+    if ( len < offset + 20 ) {
+        return false;
+    }
+
+    const u_char* ip = data + offset;
+    size_t  ipLen = len - offset;
+    size_t  hdrLen;
+    int     addrOffset, addrLen;
+    if ( (ip[0]>>4) == 4 ) {
+        hdrLen = (ip[0]&0x0f)*4;
+        if ( (_replay_rd16(ip+6) & 0x3fff) != 0 ) {
+            return false;   // a fragment
+        }
+        ipLen = std::min(ipLen, (size_t)_replay_rd16(ip+2));
+        out.proto = ip[9];
+        addrOffset = 12;
+        addrLen = 4;
+    } else if ( (ip[0]>>4) == 6 && ipLen >= 40 ) {
+        hdrLen = 40;
+        ipLen = std::min(ipLen, 40 + (size_t)_replay_rd16(ip+4));
+        out.proto = ip[6];
+        addrOffset = 8;
+        addrLen = 16;
+    } else {
+        return false;
+    }
+    if ( hdrLen < 20 || ipLen < hdrLen ) {
+        return false;
+    }
+
+    const u_char* l4 = ip + hdrLen;
+    size_t  l4Len = ipLen - hdrLen;
+    size_t  l4Hdr;
+    if ( out.proto == IPPROTO_TCP ) {
+        if ( l4Len < 20 ) {
+            return false;
+        }
+        l4Hdr = (l4[12]>>4)*4;
+        out.seq = _replay_rd32(l4+4);
+        out.syn = (l4[13] & 0x02) != 0;
+    } else if ( out.proto == IPPROTO_UDP ) {
+        l4Hdr = 8;
+    } else {
+        return false;
+    }
+    if ( l4Len < l4Hdr ) {
+        return false;
+    }
+
+    out.srcPort = _replay_rd16(l4);
+    out.dstPort = _replay_rd16(l4+2);
+    out.src.assign((const char*)ip+addrOffset, addrLen);
+    out.src.append((const char*)l4, 2);
+    out.dst.assign((const char*)ip+addrOffset+addrLen, addrLen);
+    out.dst.append((const char*)l4+2, 2);
+    out.payload = l4 + l4Hdr;
+    out.size = l4Len - l4Hdr;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+static void _replay_add_segment(replay_tcp_flow& flow, const replay_l4& l4, INT64_T tsUs)
+{
+    if ( l4.syn ) {
+        flow.started = true;
+        flow.nextSeq = l4.seq + 1;
+        flow.firstUs = tsUs;
+        return;
+    }
+    if ( l4.size == 0 ) {
+        return;
+    }
+    if ( !flow.started ) {
+        // the capture began mid-connection
+        flow.started = true;
+        flow.nextSeq = l4.seq;
+        flow.firstUs = tsUs;
+    }
+
+    const u_char* payload = l4.payload;
+    size_t  size = l4.size;
+    int32_t diff = (int32_t)(l4.seq - flow.nextSeq);
+    if ( diff < 0 ) {
+        // a retransmission; keep whatever is new in it
+        if ( (size_t)(-diff) >= size ) {
+            return;
+        }
+        payload += -diff;
+        size -= -diff;
+    }
+    // a gap (diff > 0) means the capture missed data; the parser resyncs
+    flow.times.push_back(std::make_pair(flow.data.size(), tsUs));
+    flow.data.append((const char*)payload, size);
+    flow.nextSeq = l4.seq + (uint32_t)l4.size;
+}
+
+//-----------------------------------------------------------------------------
+static INT64_T _replay_flow_time(const replay_tcp_flow& flow, size_t offset)
+{
+    auto it = std::upper_bound(flow.times.begin(), flow.times.end(),
+                               std::make_pair(offset, (INT64_T)INT64_MAX));
+    if ( it == flow.times.begin() ) {
+        return flow.firstUs;
+    }
+    return (it-1)->second;
+}
+
+//-----------------------------------------------------------------------------
+// Returns the value of an RTSP header, or an empty string
+static std::string _replay_header(const std::string& headers, const char* name)
+{
+    size_t  nameLen = strlen(name);
+    size_t  pos = 0;
+    while ( pos < headers.size() ) {
+        size_t eol = headers.find("\r\n", pos);
+        if ( eol == std::string::npos ) {
+            eol = headers.size();
+        }
+        if ( eol - pos > nameLen &&
+             headers[pos+nameLen] == ':' &&
+             strncasecmp(headers.c_str()+pos, name, nameLen) == 0 ) {
+            size_t start = headers.find_first_not_of(" \t", pos+nameLen+1);
+            if ( start == std::string::npos || start >= eol ) {
+                return "";
+            }
+            return headers.substr(start, eol-start);
+        }
+        pos = eol + 2;
+    }
+    return "";
+}
+
+//-----------------------------------------------------------------------------
+// Returns the first number of a "name=a-b" transport parameter, or -1
+static int _replay_transport_param(const std::string& transport, const char* name)
+{
+    size_t pos = transport.find(name);
+    if ( pos == std::string::npos ) {
+        return -1;
+    }
+    return atoi(transport.c_str() + pos + strlen(name));
+}
+
+//-----------------------------------------------------------------------------
+// Finds the DESCRIBE and SETUP responses in what the server sent, and the
+// RTP packets interleaved with them
+static void _replay_parse_server(replay_capture* capture,
+                                 const replay_tcp_flow& flow,
+                                 std::map<int, int>& channels)
+{
+    const std::string& data = flow.data;
+    size_t pos = 0;
+    while ( pos < data.size() ) {
+        if ( data[pos] == '$' ) {
+            if ( pos + 4 > data.size() ) {
+                break;
+            }
+            int     channel = (u_char)data[pos+1];
+            size_t  size = _replay_rd16((const u_char*)data.c_str()+pos+2);
+            if ( pos + 4 + size > data.size() ) {
+                break;
+            }
+            auto it = channels.find(channel);
+            if ( it != channels.end() && size >= 12 ) {
+                replay_packet packet;
+                packet.tsUs = _replay_flow_time(flow, pos);
+                packet.track = it->second;
+                packet.data = data.substr(pos+4, size);
+                capture->packets.push_back(packet);
+            }
+            pos += 4 + size;
+            continue;
+        }
+
+        if ( data.compare(pos, 9, "RTSP/1.0 ") == 0 ) {
+            size_t end = data.find("\r\n\r\n", pos);
+            if ( end == std::string::npos ) {
+                break;
+            }
+            std::string headers = data.substr(pos, end+2-pos);
+            size_t  bodySize = atoi(_replay_header(headers, "Content-Length").c_str());
+            size_t  bodyStart = end + 4;
+            if ( bodyStart + bodySize > data.size() ) {
+                break;
+            }
+            std::string transport = _replay_header(headers, "Transport");
+            if ( !transport.empty() ) {
+                replay_track track;
+                memset(&track, 0, sizeof(track));
+                track.interleaved = _replay_transport_param(transport, "interleaved=");
+                track.clientPort = _replay_transport_param(transport, "client_port=");
+                if ( track.interleaved >= 0 ) {
+                    channels[track.interleaved] = (int)capture->tracks.size();
+                }
+                capture->tracks.push_back(track);
+            } else if ( capture->sdp.empty() && bodySize > 0 &&
+                        _replay_header(headers, "Content-Type").find("application/sdp") != std::string::npos ) {
+                capture->sdp = data.substr(bodyStart, bodySize);
+            }
+            pos = bodyStart + bodySize;
+            continue;
+        }
+
+        // lost sync, after a gap in the capture
+        size_t nextFrame = data.find('$', pos+1);
+        size_t nextResponse = data.find("RTSP/1.0 ", pos+1);
+        pos = std::min(nextFrame, nextResponse);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// What it takes to play each track's packets again, right after the last
+static void _replay_prepare_tracks(replay_capture* capture)
+{
+    std::vector<uint32_t> prevTs(capture->tracks.size());
+    for (const replay_packet& packet : capture->packets) {
+        replay_track&   track = capture->tracks[packet.track];
+        const u_char*   rtp = (const u_char*)packet.data.c_str();
+        uint16_t        seq = _replay_rd16(rtp+2);
+        uint32_t        ts = _replay_rd32(rtp+4);
+        if ( track.packets++ == 0 ) {
+            track.firstSeq = seq;
+            track.firstTs = ts;
+            track.tsStep = kDefaultTsStep;
+        } else if ( ts != track.lastTs ) {
+            track.tsStep = ts - track.lastTs;
+        }
+        track.lastSeq = seq;
+        track.lastTs = ts;
+    }
+}
+
+//-----------------------------------------------------------------------------
+static replay_capture* _replay_load(const char* path, sv_pcap_log_cb_t logCb, void* logCtx)
+{
+    char    errbuf[PCAP_ERRBUF_SIZE];
+    pcap_t* handle = pcap_open_offline(path, errbuf);
+    if ( handle == NULL ) {
+        logCb(logCtx, svpllError, _FMT("Failed to open capture " << path << ": " << errbuf));
+        return NULL;
+    }
+
+    int     linkType = pcap_datalink(handle);
+    std::map<std::string, replay_tcp_flow>  flows;
+    std::vector<replay_udp>                 datagrams;
+    struct pcap_pkthdr* hdr;
+    const u_char*       data;
+    INT64_T             firstUs = -1;
+    replay_l4           l4;
+
+    while ( pcap_next_ex(handle, &hdr, &data) == 1 ) {
+        INT64_T tsUs = (INT64_T)hdr->ts.tv_sec*1000000 + hdr->ts.tv_usec;
+        if ( firstUs < 0 ) {
+            firstUs = tsUs;
+        }
+        tsUs -= firstUs;
+        if ( !_replay_parse_packet(linkType, data, hdr->caplen, l4) ) {
+            continue;
+        }
+        if ( l4.proto == IPPROTO_TCP ) {
+            replay_tcp_flow& flow = flows[l4.src + l4.dst];
+            _replay_add_segment(flow, l4, tsUs);
+        } else if ( l4.size >= 12 && (l4.payload[0]>>6) == 2 ) {
+            replay_udp datagram;
+            datagram.tsUs = tsUs;
+            datagram.dstPort = l4.dstPort;
+            datagram.data.assign((const char*)l4.payload, l4.size);
+            datagrams.push_back(datagram);
+        }
+    }
+    pcap_close(handle);
+
+    // the RTSP server is whoever spoke first with a response
+    const replay_tcp_flow* server = NULL;
+    for (auto& it : flows) {
+        const replay_tcp_flow& flow = it.second;
+        if ( flow.data.compare(0, 9, "RTSP/1.0 ") == 0 &&
+             (server == NULL || flow.firstUs < server->firstUs) ) {
+            server = &flow;
+        }
+    }
+    if ( server == NULL ) {
+        logCb(logCtx, svpllError, _FMT("No RTSP session found in " << path));
+        return NULL;
+    }
+
+    replay_capture* capture = new replay_capture();
+    std::map<int, int> channels;
+    _replay_parse_server(capture, *server, channels);
+
+    std::map<int, int> ports;
+    for (size_t nI=0; nI<capture->tracks.size(); nI++) {
+        if ( capture->tracks[nI].clientPort > 0 ) {
+            ports[capture->tracks[nI].clientPort] = (int)nI;
+        }
+    }
+    for (replay_udp& datagram : datagrams) {
+        auto it = ports.find(datagram.dstPort);
+        if ( it != ports.end() ) {
+            replay_packet packet;
+            packet.tsUs = datagram.tsUs;
+            packet.track = it->second;
+            packet.data.swap(datagram.data);
+            capture->packets.push_back(packet);
+        }
+    }
+
+    if ( capture->sdp.empty() || capture->packets.empty() ) {
+        logCb(logCtx, svpllError, _FMT("Capture " << path << " has " << (capture->sdp.empty() ? "no SDP" : "no RTP packets")));
+        delete capture;
+        return NULL;
+    }
+
+    std::stable_sort(capture->packets.begin(), capture->packets.end(),
+                     [](const replay_packet& a, const replay_packet& b) { return a.tsUs < b.tsUs; });
+    INT64_T startUs = capture->packets.front().tsUs;
+    for (replay_packet& packet : capture->packets) {
+        packet.tsUs -= startUs;
+    }
+    capture->durationUs = capture->packets.back().tsUs;
+    _replay_prepare_tracks(capture);
+
+    logCb(logCtx, svpllInfo, _FMT("Loaded " << capture->packets.size() << " RTP packets on " << capture->tracks.size() <<
+                            " tracks, " << capture->durationUs/1000 << "ms, from " << path));
+    return capture;
+}
+
+
+//-----------------------------------------------------------------------------
+// Blocks until everything is sent, the connection fails, or we're stopping
+static bool _replay_send(replay_session* session, const char* data, size_t size)
+{
+    while ( size > 0 ) {
+        int res = send(session->sock, data, (int)size, MSG_NOSIGNAL);
+        if ( res < 0 ) {
+#ifdef _WIN32
+            bool timedOut = WSAGetLastError() == WSAETIMEDOUT || WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+            bool timedOut = errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+            if ( timedOut && session->owner->running ) {
+                continue;
+            }
+            return false;
+        }
+        data += res;
+        size -= res;
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// The state of a session's conversation with its client
+typedef struct replay_play_state {
+    std::vector<int>        channels;   // per track, or -1 if not set up
+    int                     setups;
+    bool                    playing;
+    INT64_T                 startUs;    // wall clock time of the capture's start
+    size_t                  next;
+    std::vector<uint16_t>   seqOffset;
+    std::vector<uint32_t>   tsOffset;
+    bool                    teardown;
+} replay_play_state;
+
+//-----------------------------------------------------------------------------
+static INT64_T _replay_now_us()
+{
+    return (INT64_T)sv_time_get_current_epoch_time()*1000;
+}
+
+//-----------------------------------------------------------------------------
+static bool _replay_respond(replay_session* session,
+                            replay_play_state& state,
+                            const std::string& request)
+{
+    replay_capture* capture = session->owner->capture;
+    size_t  lineEnd = request.find("\r\n");
+    std::string line = request.substr(0, lineEnd);
+    std::string method = line.substr(0, line.find(' '));
+    size_t  urlStart = line.find(' ');
+    std::string url = ( urlStart == std::string::npos ) ? "" :
+                        line.substr(urlStart+1, line.find(' ', urlStart+1)-urlStart-1);
+    std::string cseq = _replay_header(request, "CSeq");
+    std::string status = "200 OK";
+    std::string extra;
+    std::string body;
+    std::string sessionId = _STR(std::hex << 0x5e550000+session->id);
+
+    if ( method == "OPTIONS" ) {
+        extra = "Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, GET_PARAMETER, SET_PARAMETER\r\n";
+    } else if ( method == "DESCRIBE" ) {
+        std::string base = url;
+        if ( !base.empty() && base.back() != '/' ) {
+            base += '/';
+        }
+        extra = "Content-Base: " + base + "\r\nContent-Type: application/sdp\r\n";
+        body = capture->sdp;
+    } else if ( method == "SETUP" ) {
+        // the client sets up the tracks in the order the captured one did
+        int channel = _replay_transport_param(_replay_header(request, "Transport"), "interleaved=");
+        if ( state.setups >= (int)capture->tracks.size() ) {
+            status = "404 Not Found";
+        } else if ( channel < 0 ) {
+            // only RTP over RTSP; served over loopback, UDP buys nothing
+            status = "461 Unsupported Transport";
+        } else {
+            state.channels[state.setups++] = channel;
+            extra = _STR("Transport: RTP/AVP/TCP;unicast;interleaved=" << channel << "-" << channel+1 << "\r\n" <<
+                         "Session: " << sessionId << ";timeout=60\r\n");
+        }
+    } else if ( method == "PLAY" ) {
+        if ( !state.playing ) {
+            state.playing = true;
+            state.startUs = _replay_now_us();
+            state.next = 0;
+        }
+        extra = "Session: " + sessionId + "\r\nRange: npt=0.000-\r\n";
+    } else if ( method == "PAUSE" ) {
+        state.playing = false;
+        extra = "Session: " + sessionId + "\r\n";
+    } else if ( method == "TEARDOWN" ) {
+        state.teardown = true;
+        extra = "Session: " + sessionId + "\r\n";
+    } else if ( method == "GET_PARAMETER" || method == "SET_PARAMETER" ) {
+        extra = "Session: " + sessionId + "\r\n";
+    } else {
+        status = "501 Not Implemented";
+    }
+
+    session->owner->logCb(session->owner->logCtx, svpllTrace, _FMT("Replay session " << session->id << ": " << line << " - " << status));
+
+    std::string response = "RTSP/1.0 " + status + "\r\nCSeq: " + cseq + "\r\n" + extra;
+    if ( !body.empty() ) {
+        response += _STR("Content-Length: " << body.size() << "\r\n");
+    }
+    response += "\r\n" + body;
+    return _replay_send(session, response.c_str(), response.size());
+}
+
+//-----------------------------------------------------------------------------
+// Handles the complete requests in the buffer, leaving any partial one
+static bool _replay_handle_input(replay_session* session,
+                                 replay_play_state& state,
+                                 std::string& input)
+{
+    while ( !input.empty() ) {
+        if ( input[0] == '$' ) {
+            // the client's RTCP; nothing to do with it
+            if ( input.size() < 4 ) {
+                break;
+            }
+            size_t size = 4 + _replay_rd16((const u_char*)input.c_str()+2);
+            if ( input.size() < size ) {
+                break;
+            }
+            input.erase(0, size);
+            continue;
+        }
+        size_t end = input.find("\r\n\r\n");
+        if ( end == std::string::npos ) {
+            break;
+        }
+        std::string request = input.substr(0, end+2);
+        size_t size = end + 4 + atoi(_replay_header(request, "Content-Length").c_str());
+        if ( input.size() < size ) {
+            break;
+        }
+        input.erase(0, size);
+        if ( !_replay_respond(session, state, request) || state.teardown ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Sends the packets that are due. Returns how long until the next one is, in
+// milliseconds, or -1 if the connection failed
+static int _replay_send_due(replay_session* session, replay_play_state& state)
+{
+    sv_pcap_replay* replay = session->owner;
+    replay_capture* capture = replay->capture;
+    std::string     frame;
+    int             sent = 0;
+
+    while ( state.playing ) {
+        if ( state.next >= capture->packets.size() ) {
+            if ( !replay->loop ) {
+                return kPollMsec;
+            }
+            // carry on from where the capture ended, as far as the client
+            // can tell
+            for (size_t nI=0; nI<capture->tracks.size(); nI++) {
+                const replay_track& track = capture->tracks[nI];
+                state.seqOffset[nI] += (uint16_t)(track.lastSeq - track.firstSeq + 1);
+                state.tsOffset[nI] += track.lastTs - track.firstTs + track.tsStep;
+            }
+            INT64_T loopUs = capture->durationUs + kLoopGapUs;
+            state.startUs += ( replay->speed > 0 ) ? (INT64_T)(loopUs/replay->speed) : 0;
+            state.next = 0;
+        }
+
+        const replay_packet& packet = capture->packets[state.next];
+        INT64_T now = _replay_now_us();
+        INT64_T due = state.startUs + (( replay->speed > 0 ) ? (INT64_T)(packet.tsUs/replay->speed) : 0);
+        if ( replay->speed > 0 && due > now ) {
+            return (int)std::min<INT64_T>((due - now + 999)/1000, kPollMsec);
+        }
+        if ( replay->speed <= 0 && sent >= kMaxBurst ) {
+            return 0;
+        }
+        if ( replay->speed > 0 && now - due > replay->maxLagUs ) {
+            replay->maxLagUs = now - due;
+        }
+        state.next++;
+
+        int channel = state.channels[packet.track];
+        if ( channel < 0 ) {
+            continue;
+        }
+        frame.resize(4 + packet.data.size());
+        u_char* out = (u_char*)&frame[0];
+        out[0] = '$';
+        out[1] = (u_char)channel;
+        _replay_wr16(out+2, (uint16_t)packet.data.size());
+        memcpy(out+4, packet.data.c_str(), packet.data.size());
+        _replay_wr16(out+6, _replay_rd16(out+6) + state.seqOffset[packet.track]);
+        _replay_wr32(out+8, _replay_rd32(out+8) + state.tsOffset[packet.track]);
+        if ( !_replay_send(session, frame.c_str(), frame.size()) ) {
+            return -1;
+        }
+        replay->packetsSent++;
+        replay->bytesSent += frame.size();
+        sent++;
+    }
+    return kPollMsec;
+}
+
+//-----------------------------------------------------------------------------
+static void* _replay_session_thread(void* arg)
+{
+    replay_session* session = (replay_session*)arg;
+    sv_pcap_replay* replay = session->owner;
+    size_t          tracks = replay->capture->tracks.size();
+    replay_play_state state;
+    std::string     input;
+    char            buffer[4096];
+
+    state.channels.assign(tracks, -1);
+    state.seqOffset.assign(tracks, 0);
+    state.tsOffset.assign(tracks, 0);
+    state.setups = 0;
+    state.playing = false;
+    state.startUs = 0;
+    state.next = 0;
+    state.teardown = false;
+
+    replay->activeSessions++;
+    replay->logCb(replay->logCtx, svpllDebug, _FMT("Replay session " << session->id << " started"));
+
+    int waitMs = kPollMsec;
+    while ( replay->running ) {
+        struct pollfd pfd;
+        pfd.fd = session->sock;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        int res = poll(&pfd, 1, waitMs);
+        if ( res < 0 ) {
+            break;
+        }
+        if ( res > 0 ) {
+            int size = recv(session->sock, buffer, sizeof(buffer), 0);
+            if ( size <= 0 ) {
+                break;
+            }
+            input.append(buffer, size);
+            if ( !_replay_handle_input(session, state, input) ) {
+                break;
+            }
+        }
+        waitMs = _replay_send_due(session, state);
+        if ( waitMs < 0 ) {
+            break;
+        }
+    }
+
+    replay->activeSessions--;
+    replay->logCb(replay->logCtx, svpllDebug, _FMT("Replay session " << session->id << " ended"));
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+static void _replay_session_destroy(replay_session** psession)
+{
+    replay_session* session = *psession;
+    sv_thread_destroy(&session->thread);
+    replay_closesocket(session->sock);
+    delete session;
+    *psession = NULL;
+}
+
+//-----------------------------------------------------------------------------
+static void _replay_start_session(sv_pcap_replay* replay, replay_socket_t sock)
+{
+#ifdef _WIN32
+    DWORD timeout = kPollMsec;
+#else
+    struct timeval timeout = { 0, kPollMsec*1000 };
+#endif
+    // so a client that stops reading can't keep us from stopping
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+#ifdef __APPLE__
+    int noSigPipe = 1;
+    setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+#endif
+
+    replay_session* session = new replay_session();
+    session->owner = replay;
+    session->sock = sock;
+    session->id = replay->nextSessionId++;
+    session->thread = sv_thread_create(_replay_session_thread, session);
+    if ( !session->thread ) {
+        replay->logCb(replay->logCtx, svpllError, _STR("Failed to start a replay session"));
+        _replay_session_destroy(&session);
+        return;
+    }
+    replay->sessions.push_back(session);
+}
+
+//-----------------------------------------------------------------------------
+static void* _replay_accept_thread(void* arg)
+{
+    sv_pcap_replay* replay = (sv_pcap_replay*)arg;
+    while ( replay->running ) {
+        struct pollfd pfd;
+        pfd.fd = replay->listenSock;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if ( poll(&pfd, 1, kPollMsec) > 0 ) {
+            replay_socket_t sock = accept(replay->listenSock, NULL, NULL);
+            if ( sock != REPLAY_INVALID_SOCKET ) {
+                _replay_start_session(replay, sock);
+            }
+        }
+
+        // reap the sessions whose clients went away
+        for (auto it = replay->sessions.begin(); it != replay->sessions.end(); ) {
+            if ( !sv_thread_is_running((*it)->thread) ) {
+                _replay_session_destroy(&*it);
+                it = replay->sessions.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+static int _replay_listen(sv_pcap_replay* replay, int port)
+{
+#ifdef _WIN32
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+    replay->listenSock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if ( replay->listenSock == REPLAY_INVALID_SOCKET ) {
+        return -1;
+    }
+    int reuse = 1;
+    setsockopt(replay->listenSock, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+    // loopback only: this is for benchmarks, not for serving cameras
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)port);
+    if ( bind(replay->listenSock, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+         listen(replay->listenSock, 64) != 0 ) {
+        return -1;
+    }
+    socklen_t addrLen = sizeof(addr);
+    if ( getsockname(replay->listenSock, (struct sockaddr*)&addr, &addrLen) != 0 ) {
+        return -1;
+    }
+    replay->port = ntohs(addr.sin_port);
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Starts an RTSP server on localhost, playing the camera in the capture to
+// every client that connects, whatever the URL's path: N clients make N
+// virtual cameras. speed scales the capture's timing (2 plays twice as fast;
+// 0 as fast as the clients take it), and loop has it start over at the end.
+// Port 0 picks a free one; see sv_replay_get_port.
+SVPCAP_API sv_pcap_replay*  sv_replay_start(const char* capturePath,
+                                            int port,
+                                            double speed,
+                                            int loop,
+                                            sv_pcap_log_cb_t logCb,
+                                            void* logCtx)
+{
+    replay_capture* capture = _replay_load(capturePath, logCb, logCtx);
+    if ( capture == NULL ) {
+        return NULL;
+    }
+
+    sv_pcap_replay* res = new sv_pcap_replay();
+    res->logCb = logCb;
+    res->logCtx = logCtx;
+    res->capture = capture;
+    res->speed = speed;
+    res->loop = loop;
+    res->listenSock = REPLAY_INVALID_SOCKET;
+    res->thread = NULL;
+    res->nextSessionId = 0;
+    res->activeSessions = 0;
+    res->packetsSent = 0;
+    res->bytesSent = 0;
+    res->maxLagUs = 0;
+
+    if ( _replay_listen(res, port) < 0 ) {
+        logCb(logCtx, svpllError, _FMT("Failed to listen on port " << port));
+        sv_replay_stop(&res);
+        return NULL;
+    }
+
+    res->running = 1;
+    res->thread = sv_thread_create(_replay_accept_thread, res);
+    if ( !res->thread ) {
+        logCb(logCtx, svpllError, _STR("Failed to start the replay server"));
+        sv_replay_stop(&res);
+        return NULL;
+    }
+
+    logCb(logCtx, svpllInfo, _FMT("Replaying " << capturePath << " on rtsp://127.0.0.1:" << res->port << "/ at speed " << speed));
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+SVPCAP_API int              sv_replay_get_port(sv_pcap_replay* replay)
+{
+    return replay ? replay->port : -1;
+}
+
+//-----------------------------------------------------------------------------
+// Any of the outputs may be NULL. maxLagUs is how late the most delayed
+// packet was sent, a sign the replay itself couldn't keep up.
+SVPCAP_API int              sv_replay_get_stats(sv_pcap_replay* replay,
+                                                INT64_T* sessions,
+                                                INT64_T* packets,
+                                                INT64_T* bytes,
+                                                INT64_T* maxLagUs)
+{
+    if ( !replay ) {
+        return -1;
+    }
+    if ( sessions ) *sessions = replay->activeSessions;
+    if ( packets ) *packets = replay->packetsSent;
+    if ( bytes ) *bytes = replay->bytesSent;
+    if ( maxLagUs ) *maxLagUs = replay->maxLagUs;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+SVPCAP_API void             sv_replay_stop(sv_pcap_replay** preplay)
+{
+    if ( !preplay || !*preplay )
+        return;
+    sv_pcap_replay* replay = *preplay;
+
+    replay->running = 0;
+    sv_thread_destroy(&replay->thread);
+    while ( !replay->sessions.empty() ) {
+        _replay_session_destroy(&replay->sessions.front());
+        replay->sessions.pop_front();
+    }
+    if ( replay->listenSock != REPLAY_INVALID_SOCKET ) {
+        replay_closesocket(replay->listenSock);
+    }
+    replay->logCb(replay->logCtx, svpllInfo, _FMT("Stopped replay after " << replay->packetsSent << " packets, max lag " <<
+                            replay->maxLagUs/1000 << "ms"));
+    delete replay->capture;
+    delete replay;
+    *preplay = NULL;
+}
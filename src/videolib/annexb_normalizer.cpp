@@ -0,0 +1,171 @@
+/*****************************************************************************
+ *
+ * annexb_normalizer.cpp
+ *   H.264 packets made self-contained once, right out of the demux.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+
+#include "annexb_normalizer.h"
+#include "nalu.h"
+#include "sv_internal.h"
+
+#include <vector>
+
+// parameter sets and the first slice are all we look at in a packet
+static const int     kMaxScannedNALUs = 16;
+static const uint8_t kStartCode[] = { 0, 0, 0, 1 };
+
+struct annexb_normalizer {
+    fn_stream_log           logCb;
+    // with their start codes
+    std::vector<uint8_t>    sps;
+    std::vector<uint8_t>    pps;
+    int                     headerSize;
+    int64_t                 packets;
+    int64_t                 idrs;
+    int64_t                 headersInserted;
+};
+
+//-----------------------------------------------------------------------------
+static void _annexb_set(std::vector<uint8_t>& dst, const uint8_t* nal, size_t size)
+{
+    dst.clear();
+    if ( nal == NULL || size == 0 ) {
+        return;
+    }
+    if ( !(size > 3 && nal[0] == 0 && nal[1] == 0 &&
+           (nal[2] == 1 || (nal[2] == 0 && size > 4 && nal[3] == 1))) ) {
+        dst.assign(kStartCode, kStartCode + sizeof(kStartCode));
+    }
+    dst.insert(dst.end(), nal, nal + size);
+}
+
+//-----------------------------------------------------------------------------
+annexb_normalizer*  annexb_normalizer_create       (fn_stream_log logCb)
+{
+    annexb_normalizer* n = new annexb_normalizer();
+    n->logCb = logCb;
+    n->headerSize = 0;
+    n->packets = 0;
+    n->idrs = 0;
+    n->headersInserted = 0;
+    return n;
+}
+
+//-----------------------------------------------------------------------------
+void                annexb_normalizer_destroy      (annexb_normalizer** n)
+{
+    if ( n && *n ) {
+        delete *n;
+        *n = NULL;
+    }
+}
+
+//-----------------------------------------------------------------------------
+void                annexb_normalizer_set_headers  (annexb_normalizer* n,
+                                                    const uint8_t* sps, size_t spsSize,
+                                                    const uint8_t* pps, size_t ppsSize)
+{
+    _annexb_set(n->sps, sps, spsSize);
+    _annexb_set(n->pps, pps, ppsSize);
+}
+
+//-----------------------------------------------------------------------------
+int                 annexb_normalizer_scan         (annexb_normalizer* n,
+                                                    const uint8_t* data, size_t size,
+                                                    annexb_packet_info* info)
+{
+    int      offsets[kMaxScannedNALUs];
+    int      sizes[kMaxScannedNALUs];
+    uint8_t  types[kMaxScannedNALUs];
+    int      count = videolibapi_scan_nalus((uint8_t*)data, size, 1, kMaxScannedNALUs,
+                                            offsets, sizes, types, n->logCb);
+    bool     hasSPS = false, hasPPS = false;
+
+    info->nalu = 0;
+    info->idr = 0;
+    info->headerSize = 0;
+    n->headerSize = 0;
+    if ( count <= 0 || offsets[0] != 0 ) {
+        return -1;
+    }
+
+    for (int nI=0; nI<count; nI++) {
+        if ( types[nI] == 0 ) {
+            continue;
+        }
+        info->nalu |= 1 << (types[nI]-1);
+        if ( types[nI] == kNALSPS ) {
+            hasSPS = true;
+            n->sps.assign(&data[offsets[nI]], &data[offsets[nI]] + sizes[nI]);
+        } else if ( types[nI] == kNALPPS ) {
+            hasPPS = true;
+            n->pps.assign(&data[offsets[nI]], &data[offsets[nI]] + sizes[nI]);
+        } else if ( types[nI] == kNALIFrame ) {
+            info->idr = 1;
+        }
+    }
+
+    n->packets++;
+    if ( info->idr ) {
+        n->idrs++;
+        // both go in front, even if one of them is there: a PPS can't be
+        // parsed ahead of its SPS
+        if ( (!hasSPS || !hasPPS) && !n->sps.empty() && !n->pps.empty() ) {
+            n->headerSize = (int)(n->sps.size() + n->pps.size());
+            info->headerSize = n->headerSize;
+        }
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+void                annexb_normalizer_write_headers(annexb_normalizer* n,
+                                                    uint8_t* dst)
+{
+    if ( n->headerSize == 0 ) {
+        return;
+    }
+    memcpy(dst, n->sps.data(), n->sps.size());
+    memcpy(dst + n->sps.size(), n->pps.data(), n->pps.size());
+    n->headersInserted++;
+}
+
+//-----------------------------------------------------------------------------
+void                annexb_normalizer_get_stats    (annexb_normalizer* n,
+                                                    int64_t* packets,
+                                                    int64_t* idrs,
+                                                    int64_t* headersInserted)
+{
+    if (packets) *packets = n->packets;
+    if (idrs) *idrs = n->idrs;
+    if (headersInserted) *headersInserted = n->headersInserted;
+}
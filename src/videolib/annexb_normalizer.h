@@ -0,0 +1,85 @@
+/*****************************************************************************
+ *
+ * annexb_normalizer.h
+ *   H.264 packets made self-contained once, right out of the demux.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+#ifndef ANNEXB_NORMALIZER_H
+#define ANNEXB_NORMALIZER_H
+
+#include "streamprv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//-----------------------------------------------------------------------------
+// Scans each Annex-B H.264 packet of a camera once, as the demux reads it, so
+// that nothing downstream has to: the demux sets an exact keyframe flag from
+// the result, and puts the current SPS/PPS in front of IDR packets that come
+// without them. Recorders and HLS writers fed from such a demux can trust the
+// keyframe flag, and don't need to re-insert parameter sets themselves; the
+// demux says so by reporting "annexbNormalized".
+typedef struct annexb_normalizer annexb_normalizer;
+
+typedef struct annexb_packet_info {
+    int                 nalu;           // bit (type-1) for each NALU type seen
+    int                 idr;
+    int                 headerSize;     // SPS/PPS bytes the packet needs in front
+} annexb_packet_info;
+
+annexb_normalizer*  annexb_normalizer_create       (fn_stream_log logCb);
+void                annexb_normalizer_destroy      (annexb_normalizer** n);
+
+// Parameter sets out of band (extradata, SDP), with or without start codes.
+// In-band ones replace them as they come.
+void                annexb_normalizer_set_headers  (annexb_normalizer* n,
+                                                    const uint8_t* sps, size_t spsSize,
+                                                    const uint8_t* pps, size_t ppsSize);
+// Looks at the packet up to its first slice. Returns 0, or -1 if the packet
+// doesn't start with a start code.
+int                 annexb_normalizer_scan         (annexb_normalizer* n,
+                                                    const uint8_t* data, size_t size,
+                                                    annexb_packet_info* info);
+// Writes the info->headerSize bytes of SPS/PPS of the last scan to dst
+void                annexb_normalizer_write_headers(annexb_normalizer* n,
+                                                    uint8_t* dst);
+
+void                annexb_normalizer_get_stats    (annexb_normalizer* n,
+                                                    int64_t* packets,
+                                                    int64_t* idrs,
+                                                    int64_t* headersInserted);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -32,17 +32,10 @@
  *
  *****************************************************************************/
 
-//-----------------------------------------------------------------------------
+#include "box_metadata.h"
+
+#include <vector>
 
-typedef struct  box {
-    INT64_T     timestamp;
-    uint8_t     color[3];
-    int         thickness;
-    rect_t      r;
-    int         procH;
-    int         procW;
-    int         uid;
-} box_t;
 
 inline ostream& operator<<(ostream& os, const rect_t& r)
 {
@@ -56,8 +49,66 @@ inline ostream& operator<<(ostream& os, const box_t& b)
     return os;
 }
 
-typedef std::list<box_t> BoxList;
+// Contiguous, and reused from one metadata frame to the next: clearing keeps
+// the storage, so once warmed up parsing and interpolation don't allocate
+typedef std::vector<box_t> BoxList;
 typedef BoxList::iterator BoxListIter;
+static const size_t kBoxListReserve = 64;
+
+
+//-----------------------------------------------------------------------------
+// Area a box covers in the frame, as [left,right)x[top,bottom)
+typedef struct box_span {
+    int                 left;
+    int                 top;
+    int                 right;
+    int                 bottom;
+} box_span;
+
+//-----------------------------------------------------------------------------
+// Maps bands of bandHeight rows to the boxes intersecting them, so a frame can
+// be processed band by band while only looking at the boxes that matter there.
+// Boxes of band n are boxes[bandStart[n]] .. boxes[bandStart[n+1]-1], in the
+// order they were listed.
+typedef struct box_row_index {
+    int                 bandHeight;
+    int                 bandCount;
+    std::vector<int>    bandStart;
+    std::vector<int>    boxes;
+    std::vector<int>    fill;       // scratch space used while building
+} box_row_index;
+
+//-----------------------------------------------------------------------------
+static void        _box_row_index_build        (box_row_index& index,
+                                                const std::vector<box_span>& spans,
+                                                int height)
+{
+    int bh = index.bandHeight;
+
+    index.bandCount = (height + bh - 1) / bh;
+    index.bandStart.assign(index.bandCount+1, 0);
+
+    // count boxes per band, turn counts into offsets, then fill in
+    for (const box_span& s : spans) {
+        if ( s.top >= s.bottom || s.left >= s.right ) continue;
+        for (int band = s.top/bh; band <= (s.bottom-1)/bh; band++) {
+            index.bandStart[band+1]++;
+        }
+    }
+    for (int band = 0; band < index.bandCount; band++) {
+        index.bandStart[band+1] += index.bandStart[band];
+    }
+    index.boxes.resize(index.bandStart[index.bandCount]);
+
+    index.fill.assign(index.bandStart.begin(), index.bandStart.end()-1);
+    for (size_t nI=0; nI<spans.size(); nI++) {
+        const box_span& s = spans[nI];
+        if ( s.top >= s.bottom || s.left >= s.right ) continue;
+        for (int band = s.top/bh; band <= (s.bottom-1)/bh; band++) {
+            index.boxes[index.fill[band]++] = (int)nI;
+        }
+    }
+}
 
 
 //-----------------------------------------------------------------------------
@@ -97,12 +148,15 @@ static void    _ff_filter_activate_future_meta(ff_filter_base_obj* fffilter)
 static int        _ff_filter_init             (ff_filter_base_obj* fffilter)
 {
     fffilter->currentMetadata.boxes = new BoxList;
+    fffilter->currentMetadata.boxes->reserve(kBoxListReserve);
     fffilter->currentMetadata.timestamp = INVALID_PTS;
     fffilter->currentMetadata.duration = 0;
     fffilter->futureMetadata.boxes = new BoxList;
+    fffilter->futureMetadata.boxes->reserve(kBoxListReserve);
     fffilter->futureMetadata.timestamp = INVALID_PTS;
     fffilter->futureMetadata.duration = 0;
     fffilter->interpolatedMetadata = new BoxList;
+    fffilter->interpolatedMetadata->reserve(kBoxListReserve);
     fffilter->allowInterpolation = false;
     fffilter->staticMetadata = false;
     return 0;
@@ -128,6 +182,45 @@ static int        _ff_filter_destroy          (ff_filter_base_obj* fffilter)
     return 0;
 }
 
+//-----------------------------------------------------------------------------
+// Binary metadata: boxes are copied over as they are
+static int        _ff_filter_load_metadata     (ff_filter_base_obj* fffilter,
+                                                const char* filterType,
+                                                const box_metadata_header* hdr,
+                                                INT64_T pts,
+                                                parsed_metadata& pm)
+{
+    bool filterMatched = false;
+    const char* str = hdr->types;
+    const char* end = hdr->types + sizeof(hdr->types);
+    while ( str < end && *str ) {
+        const char* cur = str;
+        while ( cur < end && *cur && *cur != ';' ) cur++;
+        if ( cur == end || *cur != ';' ) {
+            break;
+        }
+        if ( !_strnicmp(filterType, str, cur - str) ) {
+            filterMatched = true;
+        }
+        str = cur + 1;
+    }
+
+    if ( !filterMatched ) {
+        TRACE(_FMT("No matching filters found ... filter type is " << filterType ));
+        return -1;
+    }
+
+    const box_t* boxes = box_metadata_boxes(hdr);
+    pm.duration = hdr->duration;
+    pm.boxes->assign(boxes, boxes + hdr->count);
+    for (box_t& b : *pm.boxes) {
+        b.timestamp = pts;
+    }
+    pm.timestamp = pts;
+    TRACE(_FMT("Loaded " << hdr->count << " bounding boxes for " << pts));
+    return 0;
+}
+
 //-----------------------------------------------------------------------------
 static int        _ff_filter_parse_metadata    (ff_filter_base_obj* fffilter,
                                                 const char* filterType,
@@ -142,6 +235,11 @@ static int        _ff_filter_parse_metadata    (ff_filter_base_obj* fffilter,
         return 0;
     }
 
+    if ( box_metadata_is_binary(str) ) {
+        return _ff_filter_load_metadata(fffilter, filterType,
+                                        (const box_metadata_header*)str, pts, pm);
+    }
+
     bool filterMatched = false;
     while (*str) {
         if ( _strnicmp("type=", str, 5) ) {
@@ -198,29 +296,7 @@ static int        _ff_filter_parse_metadata    (ff_filter_base_obj* fffilter,
             return -1;
         }
 
-        b.color[0] = 0; b.color[1] = 0; b.color[2] = 0;
-        if ( !_stricmp(color,"yellow") ) {
-            b.color[0] = 255; b.color[1] = 255;
-        } else
-        if ( !_stricmp(color,"green") ) {
-            b.color[1] = 255;
-        } else
-        if ( !_stricmp(color,"blue") ) {
-            b.color[2] = 255;
-        } else
-        if ( !_stricmp(color,"orange") ) {
-            b.color[0] = 255; b.color[1] = 165;
-        } else
-        if ( !_stricmp(color,"pink") ) {
-            b.color[0] = 128; b.color[2] = 128;
-        } else
-        if ( !_stricmp(color,"red") ) {
-            b.color[0] = 255;
-        } else {
-            b.color[2] = 255;
-        }
-
-
+        box_metadata_set_color(&b, color);
         b.timestamp = pts;
         pm.boxes->push_back(b);
         str += count;
@@ -244,23 +320,23 @@ static int        _ff_filter_parse_metadata    (ff_filter_base_obj* fffilter,
 
 
 //-----------------------------------------------------------------------------
-static box_t      _ff_filter_merge_box( ff_filter_base_obj* fffilter, box_t& b1,
-                                        box_t& b2, INT64_T ts, int uid)
+static void       _ff_filter_merge_box( ff_filter_base_obj* fffilter, const box_t& b1,
+                                        const box_t& b2, INT64_T ts, box_t& result)
 {
     int distance = b2.timestamp - b1.timestamp,
         d1 = ts - b1.timestamp,
         d2 = b2.timestamp - ts;
+    result = b1;
     if ( distance == 0 ) {
-        return b1;
+        return;
     }
     float w1 = d1 / (float) distance,
           w2 = d2 / (float) distance;
 
-    box_t result = b1;
     result.timestamp = (INT64_T)(b1.timestamp + distance*w1);
     rect_t& rres = result.r;
-    rect_t& b1r = b1.r;
-    rect_t& b2r = b2.r;
+    const rect_t& b1r = b1.r;
+    const rect_t& b2r = b2.r;
     rres.x = (int)(b1r.x*w2 + b2r.x*w1);
     rres.y = (int)(b1r.y*w2 + b2r.y*w1);
     rres.h = (int)(b1r.h*w2 + b2r.h*w1);
@@ -268,7 +344,6 @@ static box_t      _ff_filter_merge_box( ff_filter_base_obj* fffilter, box_t& b1,
 
 
     TRACE(_FMT("Interpolated " << b1 << " and " << b2 << " to " << result ));
-    return result;
 }
 
 //-----------------------------------------------------------------------------
@@ -298,17 +373,33 @@ static BoxList*   _ff_filter_interpolate_metadata( ff_filter_base_obj* fffilter,
         return cur.boxes;
 
     // interpolate
-    fffilter->interpolatedMetadata->clear();
+    BoxList& res = *fffilter->interpolatedMetadata;
+    const BoxList& curBoxes = *cur.boxes;
+    const BoxList& futBoxes = *fut.boxes;
+    size_t   count = 0;
+    res.resize(curBoxes.size());
     // find all the boxes that exist in both lists, and create weighted interpolation,
-    // based on the distance from the metadata
-    for ( BoxListIter currIt = cur.boxes->begin(); currIt != cur.boxes->end(); currIt++ ) {
-        for ( BoxListIter futIt = fut.boxes->begin(); futIt != fut.boxes->end(); futIt++ ) {
-            if ( futIt->uid == currIt->uid ) {
-                fffilter->interpolatedMetadata->push_back(_ff_filter_merge_box(fffilter, *currIt, *futIt, ts, futIt->uid));
-                break;
+    // based on the distance from the metadata. Objects tend to be listed in the
+    // same order from one metadata frame to the next, so look at the same
+    // position first.
+    for ( size_t nI=0; nI<curBoxes.size(); nI++ ) {
+        int    uid = curBoxes[nI].uid;
+        size_t match = futBoxes.size();
+        if ( nI < futBoxes.size() && futBoxes[nI].uid == uid ) {
+            match = nI;
+        } else {
+            for ( size_t nJ=0; nJ<futBoxes.size(); nJ++ ) {
+                if ( futBoxes[nJ].uid == uid ) {
+                    match = nJ;
+                    break;
+                }
             }
         }
+        if ( match < futBoxes.size() ) {
+            _ff_filter_merge_box(fffilter, curBoxes[nI], futBoxes[match], ts, res[count++]);
+        }
     }
+    res.resize(count);
     return fffilter->interpolatedMetadata;
 }
 
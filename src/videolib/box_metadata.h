@@ -0,0 +1,123 @@
+/*****************************************************************************
+ *
+ * box_metadata.h
+ *   Binary form of the bounding box metadata consumed by box drawing filters.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+#ifndef BOX_METADATA_H
+#define BOX_METADATA_H
+
+#include "streamprv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//-----------------------------------------------------------------------------
+typedef struct  box {
+    INT64_T     timestamp;
+    uint8_t     color[3];
+    int         thickness;
+    rect_t      r;
+    int         procH;
+    int         procW;
+    int         uid;
+} box_t;
+
+//-----------------------------------------------------------------------------
+// Metadata carries boxes in one of two forms:
+//  - text: "type=<filter>;...duration=<ms>;x:y:w:h:procW:procH:t:uid:color;..."
+//    set as "<injector>.metadata.<pts>", or "<filter>.metadata" for static boxes
+//  - binary: a box_metadata_header followed by count box_t, set as
+//    "<injector>.boxes.<pts>", or "<filter>.boxes" for static boxes.
+//    The value points at the whole buffer, which is copied.
+// Filters tell the two apart by the leading magic.
+#define BOX_METADATA_MAGIC      "SVBX"
+#define BOX_METADATA_MAGIC_SIZE 4
+
+typedef struct box_metadata_header {
+    char        magic[BOX_METADATA_MAGIC_SIZE];
+    int         duration;
+    int         count;
+    // filter types the boxes are meant for, each followed by ';' -- same as
+    // the "type=" entries of the text form, i.e. "boundingbox;bboxid;"
+    char        types[52];
+} box_metadata_header;
+
+//-----------------------------------------------------------------------------
+static inline size_t  box_metadata_size         (int count)
+{
+    return sizeof(box_metadata_header) + count*sizeof(box_t);
+}
+
+//-----------------------------------------------------------------------------
+static inline int     box_metadata_is_binary    (const void* data)
+{
+    return data != NULL && !memcmp(data, BOX_METADATA_MAGIC, BOX_METADATA_MAGIC_SIZE);
+}
+
+//-----------------------------------------------------------------------------
+static inline box_t*  box_metadata_boxes        (const box_metadata_header* hdr)
+{
+    return (box_t*)(hdr + 1);
+}
+
+//-----------------------------------------------------------------------------
+static inline void    box_metadata_set_color    (box_t* b, const char* color)
+{
+    b->color[0] = 0; b->color[1] = 0; b->color[2] = 0;
+    if ( !_stricmp(color,"yellow") ) {
+        b->color[0] = 255; b->color[1] = 255;
+    } else
+    if ( !_stricmp(color,"green") ) {
+        b->color[1] = 255;
+    } else
+    if ( !_stricmp(color,"blue") ) {
+        b->color[2] = 255;
+    } else
+    if ( !_stricmp(color,"orange") ) {
+        b->color[0] = 255; b->color[1] = 165;
+    } else
+    if ( !_stricmp(color,"pink") ) {
+        b->color[0] = 128; b->color[2] = 128;
+    } else
+    if ( !_stricmp(color,"red") ) {
+        b->color[0] = 255;
+    } else {
+        b->color[2] = 255;
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,414 @@
+/*****************************************************************************
+ *
+ * clip_cache.cpp
+ *   Cache of scanned clip properties and idle clip streams, for scrubbing.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+#include "clip_cache.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+static const int      kDefaultMaxEntries = 16;
+static const int      kDefaultMaxMb = 256;
+// parked streams keep their file open
+static const UINT64_T kMaxIdleStreamMs = 10000;
+
+enum {
+    cceMsList,
+    cceDuration,
+    cceStream
+};
+
+typedef struct clip_cache_stamp {
+    int64_t             size;
+    int64_t             mtime;
+} clip_cache_stamp;
+
+typedef struct clip_cache_entry {
+    int                 kind;
+    std::string         filename;
+    clip_cache_stamp    stamp;
+    size_t              cost;
+    std::vector<int64_t> msList;
+    int64_t             duration;
+    std::string         config;
+    void*               stream;
+    clip_cache_free_fn  freeFn;
+    UINT64_T            parkedAt;
+} clip_cache_entry;
+
+typedef struct clip_cache_stream_info {
+    std::string         filename;
+    std::string         config;
+    std::string         state;
+    clip_cache_stamp    stamp;
+    size_t              cost;
+} clip_cache_stream_info;
+
+typedef std::list<clip_cache_entry> ClipCacheList;
+
+static std::mutex                               _gCacheMutex;
+static ClipCacheList                            _gCache;
+static size_t                                   _gCacheBytes = 0;
+static std::map<void*, clip_cache_stream_info>  _gStreams;
+static int                                      _gMaxEntries = -1;
+static size_t                                   _gMaxBytes = 0;
+
+//-----------------------------------------------------------------------------
+static bool     _clip_cache_get_stamp   (const char* filename, clip_cache_stamp* stamp)
+{
+#ifdef _WIN32
+    struct _stat64 st;
+    if ( _stat64(filename, &st) != 0 ) {
+        return false;
+    }
+#else
+    struct stat st;
+    if ( stat(filename, &st) != 0 ) {
+        return false;
+    }
+#endif
+    stamp->size = (int64_t)st.st_size;
+    stamp->mtime = (int64_t)st.st_mtime;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+static bool     _clip_cache_enabled     ()
+{
+    if ( _gMaxEntries < 0 ) {
+        _gMaxEntries = std::max(0, sv_get_int_env_var("SV_CLIP_CACHE_ENTRIES", kDefaultMaxEntries));
+        _gMaxBytes = (size_t)std::max(0, sv_get_int_env_var("SV_CLIP_CACHE_MB", kDefaultMaxMb))*1024*1024;
+    }
+    return _gMaxEntries > 0;
+}
+
+//-----------------------------------------------------------------------------
+// Called with the lock held; parked streams are moved to evicted, to be freed
+// once the lock is released
+static void     _clip_cache_remove      (ClipCacheList::iterator it,
+                                         ClipCacheList& evicted)
+{
+    _gCacheBytes -= it->cost;
+    if ( it->kind == cceStream ) {
+        evicted.splice(evicted.end(), _gCache, it);
+    } else {
+        _gCache.erase(it);
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void     _clip_cache_trim        (ClipCacheList& evicted)
+{
+    UINT64_T now = sv_time_get_current_epoch_time();
+
+    ClipCacheList::iterator it = _gCache.begin();
+    while ( it != _gCache.end() ) {
+        ClipCacheList::iterator cur = it++;
+        if ( cur->kind == cceStream && now - cur->parkedAt > kMaxIdleStreamMs ) {
+            _clip_cache_remove(cur, evicted);
+        }
+    }
+    while ( !_gCache.empty() &&
+            ( _gCache.size() > (size_t)_gMaxEntries || _gCacheBytes > _gMaxBytes ) ) {
+        _clip_cache_remove(--_gCache.end(), evicted);
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void     _clip_cache_free        (ClipCacheList& evicted)
+{
+    for (clip_cache_entry& e : evicted) {
+        e.freeFn(e.stream);
+    }
+    evicted.clear();
+}
+
+//-----------------------------------------------------------------------------
+// Finds the entry, moving it to the front; stale entries for the file are dropped
+static ClipCacheList::iterator _clip_cache_find(int kind,
+                                         const char* filename,
+                                         const char* config,
+                                         ClipCacheList& evicted)
+{
+    clip_cache_stamp stamp;
+    bool             haveStamp = _clip_cache_get_stamp(filename, &stamp);
+
+    ClipCacheList::iterator it = _gCache.begin();
+    while ( it != _gCache.end() ) {
+        ClipCacheList::iterator cur = it++;
+        if ( cur->filename != filename ) {
+            continue;
+        }
+        if ( !haveStamp ||
+             cur->stamp.size != stamp.size ||
+             cur->stamp.mtime != stamp.mtime ) {
+            _clip_cache_remove(cur, evicted);
+            continue;
+        }
+        if ( cur->kind == kind && ( config == NULL || cur->config == config ) ) {
+            _gCache.splice(_gCache.begin(), _gCache, cur);
+            return _gCache.begin();
+        }
+    }
+    return _gCache.end();
+}
+
+//-----------------------------------------------------------------------------
+static void     _clip_cache_put         (clip_cache_entry& e)
+{
+    ClipCacheList evicted;
+    {
+        std::lock_guard<std::mutex> guard(_gCacheMutex);
+        ClipCacheList::iterator it = _clip_cache_find(e.kind, e.filename.c_str(), NULL, evicted);
+        if ( it != _gCache.end() ) {
+            _clip_cache_remove(it, evicted);
+        }
+        _gCacheBytes += e.cost;
+        _gCache.push_front(e);
+        _clip_cache_trim(evicted);
+    }
+    _clip_cache_free(evicted);
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      clip_cache_get_ms_list     (const char* filename,
+                                                int64_t** msList)
+{
+    if ( !_clip_cache_enabled() ) {
+        return -1;
+    }
+
+    ClipCacheList evicted;
+    int           res = -1;
+    {
+        std::lock_guard<std::mutex> guard(_gCacheMutex);
+        ClipCacheList::iterator it = _clip_cache_find(cceMsList, filename, NULL, evicted);
+        if ( it != _gCache.end() ) {
+            size_t size = it->msList.size()*sizeof(int64_t);
+            *msList = (int64_t*)malloc(size);
+            memcpy(*msList, &it->msList[0], size);
+            res = 0;
+        }
+    }
+    _clip_cache_free(evicted);
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     clip_cache_put_ms_list     (const char* filename,
+                                                const int64_t* msList)
+{
+    clip_cache_entry e;
+    if ( !_clip_cache_enabled() ||
+         msList == NULL ||
+         !_clip_cache_get_stamp(filename, &e.stamp) ) {
+        return;
+    }
+    e.kind = cceMsList;
+    e.filename = filename;
+    e.msList.assign(msList, msList + msList[0] + 1);
+    e.cost = e.msList.size()*sizeof(int64_t);
+    e.duration = -1;
+    e.stream = NULL;
+    e.freeFn = NULL;
+    e.parkedAt = 0;
+    _clip_cache_put(e);
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      clip_cache_get_duration    (const char* filename,
+                                                int64_t* duration)
+{
+    if ( !_clip_cache_enabled() ) {
+        return -1;
+    }
+
+    ClipCacheList evicted;
+    int           res = -1;
+    {
+        std::lock_guard<std::mutex> guard(_gCacheMutex);
+        ClipCacheList::iterator it = _clip_cache_find(cceDuration, filename, NULL, evicted);
+        if ( it != _gCache.end() ) {
+            *duration = it->duration;
+            res = 0;
+        }
+    }
+    _clip_cache_free(evicted);
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     clip_cache_put_duration    (const char* filename,
+                                                int64_t duration)
+{
+    clip_cache_entry e;
+    if ( !_clip_cache_enabled() ||
+         duration < 0 ||
+         !_clip_cache_get_stamp(filename, &e.stamp) ) {
+        return;
+    }
+    e.kind = cceDuration;
+    e.filename = filename;
+    e.cost = sizeof(e);
+    e.duration = duration;
+    e.stream = NULL;
+    e.freeFn = NULL;
+    e.parkedAt = 0;
+    _clip_cache_put(e);
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     clip_cache_register_stream (void* stream,
+                                                const char* filename,
+                                                const char* config,
+                                                const char* state,
+                                                size_t cost)
+{
+    clip_cache_stream_info info;
+    if ( !_clip_cache_enabled() ||
+         !_clip_cache_get_stamp(filename, &info.stamp) ) {
+        return;
+    }
+    info.filename = filename;
+    info.config = config;
+    info.state = state;
+    info.cost = cost;
+
+    std::lock_guard<std::mutex> guard(_gCacheMutex);
+    _gStreams[stream] = info;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     clip_cache_unregister_stream(void* stream)
+{
+    std::lock_guard<std::mutex> guard(_gCacheMutex);
+    _gStreams.erase(stream);
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      clip_cache_park_stream     (void* stream,
+                                                const char* state,
+                                                clip_cache_free_fn freeFn)
+{
+    clip_cache_entry e;
+    {
+        std::lock_guard<std::mutex> guard(_gCacheMutex);
+        std::map<void*, clip_cache_stream_info>::iterator it = _gStreams.find(stream);
+        if ( it == _gStreams.end() ) {
+            return 0;
+        }
+        clip_cache_stream_info info = it->second;
+        _gStreams.erase(it);
+
+        // whatever had been changed on the stream since it was opened would
+        // have to be undone before it could be handed out again
+        clip_cache_stamp stamp;
+        if ( info.state != state ||
+             info.cost > _gMaxBytes ||
+             !_clip_cache_get_stamp(info.filename.c_str(), &stamp) ||
+             stamp.size != info.stamp.size ||
+             stamp.mtime != info.stamp.mtime ) {
+            return 0;
+        }
+        e.kind = cceStream;
+        e.filename = info.filename;
+        e.stamp = info.stamp;
+        e.cost = info.cost;
+        e.duration = -1;
+        e.config = info.config;
+        e.stream = stream;
+        e.freeFn = freeFn;
+        e.parkedAt = sv_time_get_current_epoch_time();
+
+        // keep the registration around for when it's taken back
+        _gStreams[stream] = info;
+    }
+
+    ClipCacheList evicted;
+    {
+        std::lock_guard<std::mutex> guard(_gCacheMutex);
+        _gCacheBytes += e.cost;
+        _gCache.push_front(e);
+        _clip_cache_trim(evicted);
+    }
+    _clip_cache_free(evicted);
+    return 1;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void*    clip_cache_take_stream     (const char* filename,
+                                                const char* config)
+{
+    if ( !_clip_cache_enabled() ) {
+        return NULL;
+    }
+
+    ClipCacheList evicted;
+    void*         res = NULL;
+    {
+        std::lock_guard<std::mutex> guard(_gCacheMutex);
+        _clip_cache_trim(evicted);
+        ClipCacheList::iterator it = _clip_cache_find(cceStream, filename, config, evicted);
+        if ( it != _gCache.end() ) {
+            res = it->stream;
+            _gCacheBytes -= it->cost;
+            _gCache.erase(it);
+        }
+    }
+    _clip_cache_free(evicted);
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     clip_cache_flush           (const char* filename)
+{
+    ClipCacheList evicted;
+    {
+        std::lock_guard<std::mutex> guard(_gCacheMutex);
+        ClipCacheList::iterator it = _gCache.begin();
+        while ( it != _gCache.end() ) {
+            ClipCacheList::iterator cur = it++;
+            if ( filename == NULL || cur->filename == filename ) {
+                _clip_cache_remove(cur, evicted);
+            }
+        }
+    }
+    _clip_cache_free(evicted);
+}
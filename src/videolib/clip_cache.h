@@ -0,0 +1,92 @@
+/*****************************************************************************
+ *
+ * clip_cache.h
+ *   Cache of scanned clip properties and idle clip streams, for scrubbing.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+#ifndef CLIP_CACHE_H
+#define CLIP_CACHE_H
+
+#include "streamprv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//-----------------------------------------------------------------------------
+// Everything cached is keyed by the file it came from, and is dropped as soon
+// as that file's size or modification time changes. The cache as a whole is
+// bounded by SV_CLIP_CACHE_ENTRIES entries (0 disables it) and SV_CLIP_CACHE_MB
+// megabytes; idle streams also expire after a few seconds, so the files they
+// hold open can be moved or deleted.
+
+//-----------------------------------------------------------------------------
+// Results of scanning a clip without a frame index. ms lists are in the
+// get_ms_list2 format (count first); the getters return 0 and a malloc'ed
+// copy on a hit, and -1 on a miss.
+int                 clip_cache_get_ms_list     (const char* filename,
+                                                int64_t** msList);
+void                clip_cache_put_ms_list     (const char* filename,
+                                                const int64_t* msList);
+int                 clip_cache_get_duration    (const char* filename,
+                                                int64_t* duration);
+void                clip_cache_put_duration    (const char* filename,
+                                                int64_t duration);
+
+//-----------------------------------------------------------------------------
+// Idle clip streams. A stream registered once it's open can be parked instead
+// of being destroyed, as long as its state still matches what it had been
+// registered with; taking it back requires the same configuration. Parked
+// streams are freed with freeFn when evicted.
+typedef void (*clip_cache_free_fn)(void* stream);
+
+void                clip_cache_register_stream (void* stream,
+                                                const char* filename,
+                                                const char* config,
+                                                const char* state,
+                                                size_t cost);
+void                clip_cache_unregister_stream(void* stream);
+// Returns 1 if the stream had been parked, and 0 if the caller should free it
+int                 clip_cache_park_stream     (void* stream,
+                                                const char* state,
+                                                clip_cache_free_fn freeFn);
+void*               clip_cache_take_stream     (const char* filename,
+                                                const char* config);
+
+//-----------------------------------------------------------------------------
+// Drops everything cached for the file, or everything at all if it's NULL
+void                clip_cache_flush           (const char* filename);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
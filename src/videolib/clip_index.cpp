@@ -0,0 +1,491 @@
+/*****************************************************************************
+ *
+ * clip_index.cpp
+ *   Sidecar frame index, written next to recorded clips.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "clip_index.h"
+#include "sv_ffmpeg.h"
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//-----------------------------------------------------------------------------
+// On-disk layout, all little-endian:
+//   header: "SVIX", version(u32), count(u32), reserved(u32),
+//           duration in ms(i64), size of the media file(i64)
+//   count x entry: pts in ms(i64), offset(i64), flags(u8)
+// and, from version 2 on, the video stream's parameters:
+//   codec id(u32), width(u32), height(u32),
+//   sps size(u32), sps, pps size(u32), pps
+static const char     kIndexMagic[] = { 'S', 'V', 'I', 'X' };
+static const uint32_t kIndexVersion = 2;
+static const uint32_t kIndexMinVersion = 1;
+static const size_t   kHeaderSize = 32;
+static const size_t   kEntrySize = 17;
+static const uint8_t  kFlagKeyframe = 0x01;
+// scrubbing tends to revisit the same few clips
+static const size_t   kMaxCachedIndices = 8;
+
+typedef struct clip_index_entry {
+    int64_t     pts;
+    int64_t     offset;
+    uint8_t     flags;
+} clip_index_entry;
+
+typedef struct clip_index_codec {
+    int                             codecId;
+    int                             width;
+    int                             height;
+    std::vector<uint8_t>            sps;
+    std::vector<uint8_t>            pps;
+} clip_index_codec;
+
+typedef struct clip_index_data {
+    std::string                     filename;
+    int64_t                         mediaSize;
+    int64_t                         duration;
+    std::vector<clip_index_entry>   entries;
+    clip_index_codec                codec;
+} clip_index_data;
+
+typedef std::shared_ptr<const clip_index_data> clip_index_data_ptr;
+
+struct clip_index_writer {
+    std::vector<clip_index_entry>   entries;
+    clip_index_codec                codec;
+};
+
+struct clip_index {
+    clip_index_data_ptr data;
+};
+
+static std::mutex                       _gCacheMutex;
+static std::list<clip_index_data_ptr>   _gCache;
+
+//-----------------------------------------------------------------------------
+static int64_t  _read_le(const uint8_t* p, int bytes)
+{
+    uint64_t res = 0;
+    for (int nI=bytes-1; nI>=0; nI--) {
+        res = (res << 8) | p[nI];
+    }
+    return (int64_t)res;
+}
+
+//-----------------------------------------------------------------------------
+static int64_t  _get_file_size(const char* filename)
+{
+    FILE* f = sv_open_file(filename, "rb");
+    if ( f == NULL ) {
+        return -1;
+    }
+    int64_t res = -1;
+    if ( fseek(f, 0, SEEK_END) == 0 ) {
+        res = ftell(f);
+    }
+    fclose(f);
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+static void     _init_codec(clip_index_codec& codec)
+{
+    codec.codecId = streamUnknown;
+    codec.width = 0;
+    codec.height = 0;
+    codec.sps.clear();
+    codec.pps.clear();
+}
+
+//-----------------------------------------------------------------------------
+extern "C" clip_index_writer*  clip_index_writer_create   ()
+{
+    clip_index_writer* res = new clip_index_writer;
+    _init_codec(res->codec);
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     clip_index_writer_set_codec(clip_index_writer* w,
+                                                int codecId,
+                                                int width,
+                                                int height,
+                                                const uint8_t* sps,
+                                                size_t spsSize,
+                                                const uint8_t* pps,
+                                                size_t ppsSize)
+{
+    w->codec.codecId = codecId;
+    w->codec.width = width;
+    w->codec.height = height;
+    w->codec.sps.assign(sps, sps ? sps+spsSize : sps);
+    w->codec.pps.assign(pps, pps ? pps+ppsSize : pps);
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     clip_index_writer_add      (clip_index_writer* w,
+                                                int64_t pts,
+                                                int64_t offset,
+                                                int keyframe)
+{
+    clip_index_entry e;
+    e.pts = pts;
+    e.offset = offset;
+    e.flags = keyframe ? kFlagKeyframe : 0;
+    w->entries.push_back(e);
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      clip_index_writer_save     (clip_index_writer* w,
+                                                const char* mediaFilename,
+                                                int64_t durationMs,
+                                                int64_t mediaSize,
+                                                int inRAM,
+                                                fn_stream_log logCb)
+{
+    std::string     filename = std::string(mediaFilename) + CLIP_INDEX_EXT;
+    AVIOContext*    pb = NULL;
+    int             res;
+
+    if ( inRAM ) {
+        // will be moved along with the media file by ffmpeg_flush_buffered_io
+        pb = ffmpeg_create_buffered_io(filename.c_str());
+        res = pb ? 0 : -1;
+    } else {
+        res = avio_open(&pb, filename.c_str(), AVIO_FLAG_WRITE);
+    }
+    if ( res < 0 ) {
+        logCb(logError, _FMT("Failed to create frame index " << filename));
+        return -1;
+    }
+
+    avio_write(pb, (const unsigned char*)kIndexMagic, sizeof(kIndexMagic));
+    avio_wl32(pb, kIndexVersion);
+    avio_wl32(pb, (unsigned int)w->entries.size());
+    avio_wl32(pb, 0);
+    avio_wl64(pb, durationMs);
+    avio_wl64(pb, mediaSize);
+    for (const clip_index_entry& e : w->entries) {
+        avio_wl64(pb, e.pts);
+        avio_wl64(pb, e.offset);
+        avio_w8(pb, e.flags);
+    }
+    avio_wl32(pb, (unsigned int)w->codec.codecId);
+    avio_wl32(pb, (unsigned int)w->codec.width);
+    avio_wl32(pb, (unsigned int)w->codec.height);
+    avio_wl32(pb, (unsigned int)w->codec.sps.size());
+    if ( !w->codec.sps.empty() ) {
+        avio_write(pb, &w->codec.sps[0], (int)w->codec.sps.size());
+    }
+    avio_wl32(pb, (unsigned int)w->codec.pps.size());
+    if ( !w->codec.pps.empty() ) {
+        avio_write(pb, &w->codec.pps[0], (int)w->codec.pps.size());
+    }
+    avio_flush(pb);
+    res = pb->error;
+
+    if ( inRAM ) {
+        ffmpeg_close_buffered_io(pb);
+    } else {
+        avio_closep(&pb);
+    }
+
+    logCb(res < 0 ? logError : logDebug, _FMT("Wrote frame index " << filename <<
+                                            ": frames=" << w->entries.size() <<
+                                            " duration=" << durationMs <<
+                                            " mediaSize=" << mediaSize <<
+                                            " res=" << res));
+    return res < 0 ? -1 : 0;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" clip_index*  clip_index_writer_to_index (clip_index_writer* w,
+                                                int64_t durationMs)
+{
+    std::shared_ptr<clip_index_data> data = std::make_shared<clip_index_data>();
+    data->mediaSize = -1;
+    data->duration = durationMs;
+    data->entries = w->entries;
+    data->codec = w->codec;
+
+    // not cached -- there's no file to validate it against
+    clip_index* res = new clip_index;
+    res->data = data;
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     clip_index_writer_destroy  (clip_index_writer** w)
+{
+    if ( w && *w ) {
+        delete *w;
+        *w = NULL;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Parses the codec block following the entries; false unless it ends the file
+static bool     _read_codec(const std::vector<uint8_t>& buf,
+                            size_t pos,
+                            clip_index_codec& codec)
+{
+    if ( buf.size() < pos + 16 ) {
+        return false;
+    }
+    codec.codecId = (int)_read_le(&buf[pos], 4);
+    codec.width = (int)_read_le(&buf[pos+4], 4);
+    codec.height = (int)_read_le(&buf[pos+8], 4);
+    pos += 12;
+
+    std::vector<uint8_t>* sets[] = { &codec.sps, &codec.pps };
+    for (std::vector<uint8_t>* set : sets) {
+        if ( buf.size() < pos + 4 ) {
+            return false;
+        }
+        size_t size = (size_t)_read_le(&buf[pos], 4);
+        pos += 4;
+        if ( buf.size() - pos < size ) {
+            return false;
+        }
+        set->assign(buf.begin()+pos, buf.begin()+pos+size);
+        pos += size;
+    }
+    return pos == buf.size();
+}
+
+//-----------------------------------------------------------------------------
+static clip_index_data_ptr _clip_index_load(const char* mediaFilename,
+                                            int64_t mediaSize,
+                                            fn_stream_log logCb)
+{
+    std::string filename = std::string(mediaFilename) + CLIP_INDEX_EXT;
+    FILE*       f = sv_open_file(filename.c_str(), "rb");
+    if ( f == NULL ) {
+        return nullptr;
+    }
+
+    std::vector<uint8_t> buf;
+    uint8_t              chunk[16384];
+    size_t               read;
+    while ( (read = fread(chunk, 1, sizeof(chunk), f)) > 0 ) {
+        buf.insert(buf.end(), chunk, chunk+read);
+    }
+    fclose(f);
+
+    int64_t version = buf.size() < kHeaderSize ? 0 : _read_le(&buf[4], 4);
+    if ( buf.size() < kHeaderSize ||
+         memcmp(&buf[0], kIndexMagic, sizeof(kIndexMagic)) ||
+         version < kIndexMinVersion ||
+         version > kIndexVersion ) {
+        logCb(logWarning, _FMT("Ignoring frame index " << filename << ": unrecognized format"));
+        return nullptr;
+    }
+
+    size_t  count = (size_t)_read_le(&buf[8], 4);
+    int64_t storedSize = _read_le(&buf[24], 8);
+    size_t  entriesEnd = kHeaderSize + count*kEntrySize;
+    clip_index_codec codec;
+    _init_codec(codec);
+    if ( version == 1 ? buf.size() != entriesEnd
+                      : !_read_codec(buf, entriesEnd, codec) ) {
+        logCb(logWarning, _FMT("Ignoring frame index " << filename << ": truncated"));
+        return nullptr;
+    }
+    if ( storedSize > 0 && storedSize != mediaSize ) {
+        logCb(logWarning, _FMT("Ignoring frame index " << filename << ": made for a file of " <<
+                                storedSize << " bytes, not " << mediaSize));
+        return nullptr;
+    }
+
+    std::shared_ptr<clip_index_data> res = std::make_shared<clip_index_data>();
+    res->filename = mediaFilename;
+    res->mediaSize = mediaSize;
+    res->duration = _read_le(&buf[16], 8);
+    res->entries.resize(count);
+    const uint8_t* p = &buf[kHeaderSize];
+    for (size_t nI=0; nI<count; nI++, p+=kEntrySize) {
+        res->entries[nI].pts = _read_le(p, 8);
+        res->entries[nI].offset = _read_le(p+8, 8);
+        res->entries[nI].flags = p[16];
+    }
+    res->codec = codec;
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" clip_index*  clip_index_open        (const char* mediaFilename,
+                                                fn_stream_log logCb)
+{
+    int64_t mediaSize = _get_file_size(mediaFilename);
+    if ( mediaSize < 0 ) {
+        return NULL;
+    }
+
+    clip_index_data_ptr data;
+    {
+        std::lock_guard<std::mutex> guard(_gCacheMutex);
+        for (auto it = _gCache.begin(); it != _gCache.end(); it++) {
+            if ( (*it)->filename == mediaFilename ) {
+                if ( (*it)->mediaSize == mediaSize ) {
+                    data = *it;
+                }
+                _gCache.erase(it);
+                break;
+            }
+        }
+    }
+
+    if ( !data ) {
+        data = _clip_index_load(mediaFilename, mediaSize, logCb);
+        if ( !data ) {
+            return NULL;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(_gCacheMutex);
+        _gCache.push_front(data);
+        while ( _gCache.size() > kMaxCachedIndices ) {
+            _gCache.pop_back();
+        }
+    }
+
+    clip_index* res = new clip_index;
+    res->data = data;
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      clip_index_get_count       (clip_index* index)
+{
+    return (int)index->data->entries.size();
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int64_t  clip_index_get_pts         (clip_index* index, int pos)
+{
+    return index->data->entries[pos].pts;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int64_t  clip_index_get_duration    (clip_index* index)
+{
+    return index->data->duration;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      clip_index_get_codec       (clip_index* index,
+                                                int* codecId,
+                                                int* width,
+                                                int* height)
+{
+    const clip_index_codec& codec = index->data->codec;
+    if ( codec.codecId == streamUnknown ) {
+        return -1;
+    }
+    *codecId = codec.codecId;
+    *width = codec.width;
+    *height = codec.height;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" const uint8_t* clip_index_get_param_set(clip_index* index,
+                                                int pps,
+                                                size_t* size)
+{
+    const std::vector<uint8_t>& set = pps ? index->data->codec.pps
+                                          : index->data->codec.sps;
+    *size = set.size();
+    return set.empty() ? NULL : &set[0];
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      clip_index_find            (clip_index* index,
+                                                int64_t ms,
+                                                int keyframeOnly)
+{
+    // entries are in decode order; with no B-frames that's also pts order,
+    // but don't rely on it
+    const std::vector<clip_index_entry>& entries = index->data->entries;
+    int res = -1;
+    for (size_t nI=0; nI<entries.size(); nI++) {
+        const clip_index_entry& e = entries[nI];
+        if ( e.pts > ms || ( keyframeOnly && (e.flags & kFlagKeyframe) == 0 ) ) {
+            continue;
+        }
+        if ( res < 0 || e.pts > entries[res].pts ) {
+            res = (int)nI;
+        }
+    }
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      clip_index_find_next_keyframe(clip_index* index, int64_t ms)
+{
+    const std::vector<clip_index_entry>& entries = index->data->entries;
+    int res = -1;
+    for (size_t nI=0; nI<entries.size(); nI++) {
+        const clip_index_entry& e = entries[nI];
+        if ( e.pts <= ms || (e.flags & kFlagKeyframe) == 0 ) {
+            continue;
+        }
+        if ( res < 0 || e.pts < entries[res].pts ) {
+            res = (int)nI;
+        }
+    }
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      clip_index_get_keyframe    (clip_index* index, int pos)
+{
+    const std::vector<clip_index_entry>& entries = index->data->entries;
+    for (int nI=pos; nI>=0; nI--) {
+        if ( entries[nI].flags & kFlagKeyframe ) {
+            return nI;
+        }
+    }
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     clip_index_close           (clip_index** index)
+{
+    if ( index && *index ) {
+        delete *index;
+        *index = NULL;
+    }
+}
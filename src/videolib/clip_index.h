@@ -0,0 +1,113 @@
+/*****************************************************************************
+ *
+ * clip_index.h
+ *   Sidecar frame index, written next to recorded clips.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef CLIP_INDEX_H
+#define CLIP_INDEX_H
+
+#include "streamprv.h"
+
+// Index of clip.mp4 lives in clip.mp4.idx
+#define CLIP_INDEX_EXT ".idx"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct clip_index_writer clip_index_writer;
+typedef struct clip_index clip_index;
+
+//-----------------------------------------------------------------------------
+// Writer side, used by the recorder. pts values are in ms, as the demuxer will
+// report them when the clip is read back; offset is the position of the
+// packet's data in the media file.
+clip_index_writer*  clip_index_writer_create   ();
+void                clip_index_writer_add      (clip_index_writer* w,
+                                                int64_t pts,
+                                                int64_t offset,
+                                                int keyframe);
+// Video stream the entries describe; codecId is one of stream* codec ids
+void                clip_index_writer_set_codec(clip_index_writer* w,
+                                                int codecId,
+                                                int width,
+                                                int height,
+                                                const uint8_t* sps,
+                                                size_t spsSize,
+                                                const uint8_t* pps,
+                                                size_t ppsSize);
+int                 clip_index_writer_save     (clip_index_writer* w,
+                                                const char* mediaFilename,
+                                                int64_t durationMs,
+                                                int64_t mediaSize,
+                                                int inRAM,
+                                                fn_stream_log logCb);
+// Turns what had been collected into a reader-side index (e.g. one built from
+// the container's own index, rather than loaded from disk)
+clip_index*         clip_index_writer_to_index (clip_index_writer* w,
+                                                int64_t durationMs);
+void                clip_index_writer_destroy  (clip_index_writer** w);
+
+//-----------------------------------------------------------------------------
+// Reader side. clip_index_open returns NULL if there is no index for the file,
+// or if the one that's there doesn't describe it -- callers are expected to
+// fall back to scanning the file in that case.
+clip_index*         clip_index_open            (const char* mediaFilename,
+                                                fn_stream_log logCb);
+int                 clip_index_get_count       (clip_index* index);
+int64_t             clip_index_get_pts         (clip_index* index, int pos);
+int64_t             clip_index_get_duration    (clip_index* index);
+// Video stream parameters; -1 if the index was written without them
+int                 clip_index_get_codec       (clip_index* index,
+                                                int* codecId,
+                                                int* width,
+                                                int* height);
+// The stream's sps (or pps, if set); NULL if the index doesn't carry it
+const uint8_t*      clip_index_get_param_set   (clip_index* index,
+                                                int pps,
+                                                size_t* size);
+// Returns position of the last frame with pts at or before ms, only considering
+// keyframes if keyframeOnly is set; -1 if there isn't one.
+int                 clip_index_find            (clip_index* index,
+                                                int64_t ms,
+                                                int keyframeOnly);
+// Returns position of the first keyframe with pts after ms; -1 if there isn't one.
+int                 clip_index_find_next_keyframe(clip_index* index, int64_t ms);
+// Returns position of the keyframe decoding of the frame at pos has to start
+// at; -1 if there isn't one.
+int                 clip_index_get_keyframe    (clip_index* index, int pos);
+void                clip_index_close           (clip_index** index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
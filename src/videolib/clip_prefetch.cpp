@@ -0,0 +1,307 @@
+/*****************************************************************************
+ *
+ * clip_prefetch.cpp
+ *   Decode-ahead of clip frames, for smooth forward playback.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+#include "clip_prefetch.h"
+#include "sv_internal.h"
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+
+enum {
+    cpsRunning,
+    cpsPaused,
+    cpsStopping
+};
+
+struct clip_prefetch {
+    void*                   owner;
+    clip_prefetch_read_fn   readFn;
+    void*                   ctx;
+    int                     maxFrames;
+    size_t                  maxBytes;
+    fn_stream_log           logCb;
+    sv_thread*              thread;
+
+    std::mutex              mutex;
+    std::condition_variable cond;
+    std::deque<frame_obj*>  queue;
+    size_t                  queuedBytes;
+    int                     state;
+    bool                    reading;    // the worker is in readFn
+    bool                    ended;      // readFn is out of frames, until the next resume
+    bool                    warm;       // a frame was taken since the last resume
+    bool                    exited;
+
+    int64_t                 taken;
+    int64_t                 starved;
+    int64_t                 dropped;
+    size_t                  maxQueuedBytes;
+};
+
+static std::mutex                           _gPrefetchMutex;
+static std::map<void*, clip_prefetch*>      _gPrefetch;
+
+//-----------------------------------------------------------------------------
+static bool         _clip_prefetch_is_full  (clip_prefetch* p)
+{
+    return (int)p->queue.size() >= p->maxFrames ||
+           (!p->queue.empty() && p->queuedBytes >= p->maxBytes);
+}
+
+//-----------------------------------------------------------------------------
+static void*        _clip_prefetch_thread_func(void* param)
+{
+    clip_prefetch* p = (clip_prefetch*)param;
+
+    std::unique_lock<std::mutex> lock(p->mutex);
+    while ( p->state != cpsStopping ) {
+        if ( p->state == cpsPaused || p->ended || _clip_prefetch_is_full(p) ) {
+            p->cond.wait(lock);
+            continue;
+        }
+
+        p->reading = true;
+        lock.unlock();
+        frame_obj* frame = p->readFn(p->ctx);
+        lock.lock();
+        p->reading = false;
+
+        if ( frame == NULL ) {
+            p->ended = true;
+        } else {
+            // even if paused in the meantime: pausing drops the queue, and
+            // counts what was dropped
+            p->queue.push_back(frame);
+            p->queuedBytes += frame_get_api(frame)->get_data_size(frame);
+            if ( p->queuedBytes > p->maxQueuedBytes ) {
+                p->maxQueuedBytes = p->queuedBytes;
+            }
+        }
+        p->cond.notify_all();
+    }
+    p->exited = true;
+    p->cond.notify_all();
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Must be called with the lock held, and the worker out of readFn
+static void         _clip_prefetch_drain    (clip_prefetch* p,
+                                             std::deque<frame_obj*>& frames)
+{
+    frames.swap(p->queue);
+    p->queuedBytes = 0;
+    p->dropped += frames.size();
+}
+
+//-----------------------------------------------------------------------------
+static void         _clip_prefetch_unref_all(std::deque<frame_obj*>& frames)
+{
+    for (size_t nI=0; nI<frames.size(); nI++) {
+        frame_unref(&frames[nI]);
+    }
+    frames.clear();
+}
+
+//-----------------------------------------------------------------------------
+extern "C" clip_prefetch* clip_prefetch_start        (void* owner,
+                                                      clip_prefetch_read_fn readFn,
+                                                      void* ctx,
+                                                      int maxFrames,
+                                                      size_t maxBytes,
+                                                      fn_stream_log logCb)
+{
+    if ( owner == NULL || readFn == NULL || maxFrames <= 0 ) {
+        return NULL;
+    }
+
+    std::lock_guard<std::mutex> lock(_gPrefetchMutex);
+    if ( _gPrefetch.find(owner) != _gPrefetch.end() ) {
+        return NULL;
+    }
+
+    clip_prefetch* p = new clip_prefetch;
+    p->owner = owner;
+    p->readFn = readFn;
+    p->ctx = ctx;
+    p->maxFrames = maxFrames;
+    p->maxBytes = maxBytes;
+    p->logCb = logCb;
+    p->queuedBytes = 0;
+    p->state = cpsPaused;
+    p->reading = false;
+    p->ended = false;
+    p->warm = false;
+    p->exited = false;
+    p->taken = 0;
+    p->starved = 0;
+    p->dropped = 0;
+    p->maxQueuedBytes = 0;
+    // same class as the edge thread clips otherwise get
+    p->thread = sv_thread_create_ex(_clip_prefetch_thread_func, p, "clip-prefetch", "analytics");
+    if ( p->thread == NULL ) {
+        logCb(logError, "Failed to start clip decode-ahead thread");
+        delete p;
+        return NULL;
+    }
+    _gPrefetch[owner] = p;
+    logCb(logDebug, _FMT("Started clip decode-ahead of " << maxFrames << " frames, " << maxBytes/1024 << "KB"));
+    return p;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" clip_prefetch* clip_prefetch_get          (void* owner)
+{
+    std::lock_guard<std::mutex> lock(_gPrefetchMutex);
+    std::map<void*, clip_prefetch*>::iterator it = _gPrefetch.find(owner);
+    return ( it == _gPrefetch.end() ) ? NULL : it->second;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void           clip_prefetch_stop         (void* owner)
+{
+    clip_prefetch* p = NULL;
+    {
+        std::lock_guard<std::mutex> lock(_gPrefetchMutex);
+        std::map<void*, clip_prefetch*>::iterator it = _gPrefetch.find(owner);
+        if ( it == _gPrefetch.end() ) {
+            return;
+        }
+        p = it->second;
+        _gPrefetch.erase(it);
+    }
+
+    std::deque<frame_obj*> frames;
+    {
+        std::unique_lock<std::mutex> lock(p->mutex);
+        p->state = cpsStopping;
+        p->cond.notify_all();
+        // the worker shouldn't be canceled in the middle of a read
+        while ( !p->exited ) {
+            p->cond.wait(lock);
+        }
+        _clip_prefetch_drain(p, frames);
+    }
+    sv_thread_destroy(&p->thread);
+    _clip_prefetch_unref_all(frames);
+
+    p->logCb(logInfo, _FMT("Clip decode-ahead stopped: taken=" << p->taken <<
+                            " starved=" << p->starved <<
+                            " dropped=" << p->dropped <<
+                            " maxQueuedKB=" << p->maxQueuedBytes/1024));
+    delete p;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" frame_obj*     clip_prefetch_take         (clip_prefetch* p)
+{
+    std::unique_lock<std::mutex> lock(p->mutex);
+    if ( p->state != cpsRunning ) {
+        return NULL;
+    }
+    if ( p->queue.empty() && !p->ended ) {
+        // right after a resume, the queue can't be anything but empty
+        if ( p->warm ) {
+            p->starved++;
+        }
+        while ( p->queue.empty() && !p->ended ) {
+            p->cond.wait(lock);
+        }
+    }
+    if ( p->queue.empty() ) {
+        return NULL;
+    }
+
+    frame_obj* frame = p->queue.front();
+    p->queue.pop_front();
+    p->queuedBytes -= frame_get_api(frame)->get_data_size(frame);
+    p->taken++;
+    p->warm = true;
+    // there's room for one more
+    p->cond.notify_all();
+    return frame;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int            clip_prefetch_pause        (clip_prefetch* p)
+{
+    std::deque<frame_obj*> frames;
+    {
+        std::unique_lock<std::mutex> lock(p->mutex);
+        p->state = cpsPaused;
+        while ( p->reading ) {
+            p->cond.wait(lock);
+        }
+        _clip_prefetch_drain(p, frames);
+        p->ended = false;
+    }
+    int dropped = (int)frames.size();
+    _clip_prefetch_unref_all(frames);
+    return dropped;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void           clip_prefetch_resume       (clip_prefetch* p)
+{
+    std::lock_guard<std::mutex> lock(p->mutex);
+    if ( p->state == cpsPaused ) {
+        p->state = cpsRunning;
+        p->ended = false;
+        p->warm = false;
+        p->cond.notify_all();
+    }
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int            clip_prefetch_is_paused    (clip_prefetch* p)
+{
+    std::lock_guard<std::mutex> lock(p->mutex);
+    return p->state == cpsPaused;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void           clip_prefetch_get_stats    (clip_prefetch* p,
+                                                      int64_t* taken,
+                                                      int64_t* starved,
+                                                      int* queued,
+                                                      size_t* queuedBytes)
+{
+    std::lock_guard<std::mutex> lock(p->mutex);
+    if ( taken ) *taken = p->taken;
+    if ( starved ) *starved = p->starved;
+    if ( queued ) *queued = (int)p->queue.size();
+    if ( queuedBytes ) *queuedBytes = p->queuedBytes;
+}
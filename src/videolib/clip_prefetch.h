@@ -0,0 +1,86 @@
+/*****************************************************************************
+ *
+ * clip_prefetch.h
+ *   Decode-ahead of clip frames, for smooth forward playback.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+#ifndef CLIP_PREFETCH_H
+#define CLIP_PREFETCH_H
+
+#include "streamprv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//-----------------------------------------------------------------------------
+// A worker thread reads frames from the stream of an owner with readFn, and
+// keeps up to maxFrames of them, and up to maxBytes (although at least one),
+// queued ahead of the playhead. readFn returns a referenced frame, or NULL once
+// there's nothing left to read; it's never called while the worker is paused,
+// so the owner is free to seek or reconfigure the stream in the meantime. The
+// worker starts out paused. Decode-ahead is looked up by its owner, and there
+// can be one per owner.
+typedef struct clip_prefetch clip_prefetch;
+typedef frame_obj* (*clip_prefetch_read_fn)(void* ctx);
+
+clip_prefetch*      clip_prefetch_start        (void* owner,
+                                                clip_prefetch_read_fn readFn,
+                                                void* ctx,
+                                                int maxFrames,
+                                                size_t maxBytes,
+                                                fn_stream_log logCb);
+clip_prefetch*      clip_prefetch_get          (void* owner);
+void                clip_prefetch_stop         (void* owner);
+
+// Takes the next frame off the queue, waiting for the worker if it's empty.
+// Returns NULL once the worker is out of frames, or while it's paused.
+frame_obj*          clip_prefetch_take         (clip_prefetch* p);
+// Stops the worker once it's done with the frame it's reading, and drops
+// everything queued. Returns the number of frames dropped, that is how far
+// ahead of the playhead the stream is.
+int                 clip_prefetch_pause        (clip_prefetch* p);
+void                clip_prefetch_resume       (clip_prefetch* p);
+int                 clip_prefetch_is_paused    (clip_prefetch* p);
+
+// taken counts frames handed out; starved those the caller had to wait for,
+// other than the first one after a resume
+void                clip_prefetch_get_stats    (clip_prefetch* p,
+                                                int64_t* taken,
+                                                int64_t* starved,
+                                                int* queued,
+                                                size_t* queuedBytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,55 @@
+/*****************************************************************************
+ *
+ * decode_demand.h
+ *   Decode rate and quality asked of a camera's decoder by its consumers.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+
+#ifndef DECODE_DEMAND_H
+#define DECODE_DEMAND_H
+
+#include "videolib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//-----------------------------------------------------------------------------
+// Tells the decoder the highest frame rate any consumer attached to the graph
+// needs, and whether anyone looks at its frames at full size. Must be called
+// whenever a consumer of decoded frames comes or goes (videolib.c).
+void                videolib_update_decode_demand  (StreamData* data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,280 @@
+/*****************************************************************************
+ *
+ * export_scheduler.cpp
+ *   Admission of concurrent clip exports, within a CPU budget.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+
+#include "export_scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <string>
+
+// threads held by live decoders (stream_ffmpeg_decoder.cpp)
+extern "C" int videolib_get_live_decoder_threads();
+
+static const int kWaitPollMs = 100;
+
+struct export_ticket {
+    int                     kind;
+    int                     wantThreads;
+    int                     threads;
+    bool                    admitted;
+    std::string             name;
+    fn_stream_log           logCb;
+    std::chrono::steady_clock::time_point queuedAt;
+};
+
+typedef struct ExportScheduler {
+    std::mutex                  mutex;
+    std::condition_variable     cond;
+    std::list<export_ticket*>   queue;
+    int                         maxJobs;
+    int                         maxReencodeJobs;
+    int                         threadBudget;
+    int                         reservedCores;
+    int                         runningJobs;
+    int                         runningReencodes;
+    int                         threadsInUse;
+
+    ExportScheduler() : maxJobs(0), maxReencodeJobs(0), threadBudget(0), reservedCores(-1),
+                        runningJobs(0), runningReencodes(0), threadsInUse(0) {}
+} ExportScheduler;
+
+static ExportScheduler g_exportScheduler;
+
+//-----------------------------------------------------------------------------
+// Must be called with the lock held
+static void _export_scheduler_init_locked()
+{
+    ExportScheduler& s = g_exportScheduler;
+    if ( s.reservedCores >= 0 ) {
+        return;
+    }
+    if ( s.maxJobs <= 0 ) {
+        s.maxJobs = std::max(1, sv_get_int_env_var("SV_EXPORT_MAX_JOBS", 2));
+    }
+    if ( s.maxReencodeJobs <= 0 ) {
+        s.maxReencodeJobs = std::max(1, sv_get_int_env_var("SV_EXPORT_MAX_REENCODES", 1));
+    }
+    if ( s.threadBudget <= 0 ) {
+        s.threadBudget = std::max(1, sv_get_int_env_var("SV_EXPORT_THREAD_BUDGET",
+                                                        sv_get_cpu_count()));
+    }
+    s.reservedCores = std::max(0, sv_get_int_env_var("SV_EXPORT_RESERVED_CORES", 1));
+}
+
+//-----------------------------------------------------------------------------
+// The configured budget, less the cores live pipelines need: those are never
+// given to exports, however the budget was set
+static int _export_scheduler_budget_locked()
+{
+    ExportScheduler& s = g_exportScheduler;
+    int reserved = std::max(s.reservedCores, videolib_get_live_decoder_threads());
+    return std::max(1, std::min(s.threadBudget, sv_get_cpu_count() - reserved));
+}
+
+//-----------------------------------------------------------------------------
+// Starts whatever can start, remuxes first. Must be called with the lock held.
+static void _export_scheduler_admit_locked()
+{
+    ExportScheduler& s = g_exportScheduler;
+    int  budget = _export_scheduler_budget_locked();
+    bool admitted = false;
+
+    for (int kind=exportJobRemux; kind<=exportJobReencode; kind++) {
+        for ( export_ticket* t: s.queue ) {
+            if ( t->admitted || t->kind != kind ) {
+                continue;
+            }
+            if ( s.runningJobs >= s.maxJobs ) {
+                goto done;
+            }
+            if ( kind == exportJobReencode && s.runningReencodes >= s.maxReencodeJobs ) {
+                break;
+            }
+            int available = budget - s.threadsInUse;
+            // there's always room for one export
+            if ( available < 1 && s.runningJobs > 0 ) {
+                break;
+            }
+            t->threads = std::max(1, std::min(t->wantThreads, available));
+            t->admitted = true;
+            s.runningJobs++;
+            s.runningReencodes += (kind == exportJobReencode);
+            s.threadsInUse += t->threads;
+            admitted = true;
+        }
+    }
+done:
+    if ( admitted ) {
+        s.queue.remove_if([](export_ticket* t) { return t->admitted; });
+        s.cond.notify_all();
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Must be called with the lock held
+static void _export_scheduler_release_locked(export_ticket* t)
+{
+    ExportScheduler& s = g_exportScheduler;
+    s.runningJobs--;
+    s.runningReencodes -= (t->kind == exportJobReencode);
+    s.threadsInUse -= t->threads;
+    _export_scheduler_admit_locked();
+}
+
+//-----------------------------------------------------------------------------
+extern "C" export_ticket* export_scheduler_enter     (int kind,
+                                                      int wantThreads,
+                                                      const char* name,
+                                                      export_wait_fn waitCb,
+                                                      fn_stream_log logCb)
+{
+    ExportScheduler& s = g_exportScheduler;
+    export_ticket*   t = new export_ticket;
+    t->kind = (kind == exportJobRemux) ? exportJobRemux : exportJobReencode;
+    t->wantThreads = std::max(1, wantThreads);
+    t->threads = 0;
+    t->admitted = false;
+    t->name = name ? name : "";
+    t->logCb = logCb;
+    t->queuedAt = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> lock(s.mutex);
+    _export_scheduler_init_locked();
+    s.queue.push_back(t);
+    _export_scheduler_admit_locked();
+    if ( !t->admitted ) {
+        logCb(logInfo, _FMT("Export of " << t->name << " queued behind " << s.runningJobs <<
+                            " running and " << s.queue.size()-1 << " queued exports"));
+    }
+
+    while ( !t->admitted ) {
+        if ( waitCb != NULL ) {
+            lock.unlock();
+            int res = waitCb(0);
+            lock.lock();
+            if ( res < 0 ) {
+                if ( t->admitted ) {
+                    _export_scheduler_release_locked(t);
+                } else {
+                    s.queue.remove(t);
+                    // the queue head may have been holding back the rest
+                    _export_scheduler_admit_locked();
+                }
+                lock.unlock();
+                logCb(logInfo, _FMT("Export of " << t->name << " canceled while queued"));
+                delete t;
+                return NULL;
+            }
+            if ( t->admitted ) {
+                break;
+            }
+        }
+        s.cond.wait_for(lock, std::chrono::milliseconds(kWaitPollMs));
+        // live pipelines come and go, and with them the budget
+        _export_scheduler_admit_locked();
+    }
+    int64_t waitedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - t->queuedAt).count();
+    int     budget = _export_scheduler_budget_locked();
+    int     inUse = s.threadsInUse;
+    lock.unlock();
+
+    logCb(logDebug, _FMT("Export of " << t->name << " (" <<
+                            (t->kind == exportJobRemux ? "remux" : "re-encode") <<
+                            ") started after " << waitedMs << "ms with " << t->threads <<
+                            " threads; in use " << inUse << "/" << budget));
+    return t;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int            export_ticket_get_threads  (export_ticket* ticket)
+{
+    return ticket ? ticket->threads : 1;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void           export_scheduler_leave     (export_ticket** ticket)
+{
+    if ( ticket == NULL || *ticket == NULL ) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_exportScheduler.mutex);
+        _export_scheduler_release_locked(*ticket);
+    }
+    delete *ticket;
+    *ticket = NULL;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void           export_scheduler_set_limits(int maxJobs,
+                                                      int maxReencodeJobs,
+                                                      int threadBudget)
+{
+    ExportScheduler& s = g_exportScheduler;
+    std::lock_guard<std::mutex> lock(s.mutex);
+    if ( maxJobs > 0 ) {
+        s.maxJobs = maxJobs;
+    }
+    if ( maxReencodeJobs > 0 ) {
+        s.maxReencodeJobs = maxReencodeJobs;
+    }
+    if ( threadBudget > 0 ) {
+        s.threadBudget = threadBudget;
+    }
+    _export_scheduler_init_locked();
+    // raising a limit may let queued exports start
+    _export_scheduler_admit_locked();
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void           export_scheduler_get_state (int* runningJobs,
+                                                      int* runningReencodes,
+                                                      int* queuedJobs,
+                                                      int* threadsInUse,
+                                                      int* threadBudget)
+{
+    ExportScheduler& s = g_exportScheduler;
+    std::lock_guard<std::mutex> lock(s.mutex);
+    _export_scheduler_init_locked();
+    if ( runningJobs ) *runningJobs = s.runningJobs;
+    if ( runningReencodes ) *runningReencodes = s.runningReencodes;
+    if ( queuedJobs ) *queuedJobs = (int)s.queue.size();
+    if ( threadsInUse ) *threadsInUse = s.threadsInUse;
+    if ( threadBudget ) *threadBudget = _export_scheduler_budget_locked();
+}
@@ -0,0 +1,87 @@
+/*****************************************************************************
+ *
+ * export_scheduler.h
+ *   Admission of concurrent clip exports, within a CPU budget.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+
+#ifndef EXPORT_SCHEDULER_H
+#define EXPORT_SCHEDULER_H
+
+#include "streamprv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//-----------------------------------------------------------------------------
+// Exports still run on their callers' threads; what the scheduler decides is
+// when each of them may start, and with how many threads. Remuxes are cheap
+// and go ahead of re-encodes, fewer re-encodes than exports may run at once,
+// and the threads granted are taken from a budget that leaves the cores of
+// the live pipelines alone. Jobs of the same kind start in the order they
+// were queued.
+enum {
+    exportJobRemux      = 0,
+    exportJobReencode   = 1,
+};
+
+typedef struct export_ticket export_ticket;
+// Called every 100ms or so while an export is queued, with 0; a negative
+// return takes the export off the queue. Same as the progress callback of
+// create_clip.
+typedef int (*export_wait_fn)(int pct);
+
+// Waits until the export may start. Returns NULL if waitCb canceled it.
+export_ticket*      export_scheduler_enter     (int kind,
+                                                int wantThreads,
+                                                const char* name,
+                                                export_wait_fn waitCb,
+                                                fn_stream_log logCb);
+// Threads the export may use, at least 1 and at most wantThreads
+int                 export_ticket_get_threads  (export_ticket* ticket);
+void                export_scheduler_leave     (export_ticket** ticket);
+
+// Any of the limits can be left as it is with a value <= 0
+void                export_scheduler_set_limits(int maxJobs,
+                                                int maxReencodeJobs,
+                                                int threadBudget);
+void                export_scheduler_get_state (int* runningJobs,
+                                                int* runningReencodes,
+                                                int* queuedJobs,
+                                                int* threadsInUse,
+                                                int* threadBudget);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
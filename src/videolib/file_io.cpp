@@ -0,0 +1,445 @@
+/*****************************************************************************
+ *
+ * file_io.cpp
+ *   Large-buffer AVIO backend for writing recorded files.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "file_io.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// offsets, sizes and addresses of uncached writes all have to be multiples of this
+static const size_t   kDirectAlign = 4096;
+static const int      kMinBufferKb = 64;
+
+typedef struct file_io {
+    std::string     name;
+#ifdef _WIN32
+    HANDLE          handle;
+#else
+    int             fd;
+#endif
+    // uncached writes need to be aligned; unaligned data waits in staging
+    // until the rest of the block arrives
+    bool            aligned;
+    uint8_t*        staging;
+    size_t          stagingCap;
+    size_t          stagingLen;
+    int64_t         stagingPos;
+
+    int64_t         pos;
+    int64_t         end;
+    int64_t         preallocated;
+    int64_t         writes;
+    bool            failed;
+    fn_stream_log   logCb;
+} file_io;
+
+//-----------------------------------------------------------------------------
+// Platform bits
+//-----------------------------------------------------------------------------
+
+#ifdef _WIN32
+static std::wstring _fio_wide_name(const char* name)
+{
+    int len = MultiByteToWideChar(CP_UTF8, 0, name, -1, NULL, 0);
+    std::wstring res(len > 0 ? len : 1, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, name, -1, &res[0], len);
+    return res;
+}
+#endif
+
+//-----------------------------------------------------------------------------
+static uint8_t* _fio_aligned_alloc(size_t size)
+{
+#ifdef _WIN32
+    return (uint8_t*)_aligned_malloc(size, kDirectAlign);
+#else
+    void* res = NULL;
+    return posix_memalign(&res, kDirectAlign, size) == 0 ? (uint8_t*)res : NULL;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+static void _fio_aligned_free(uint8_t* ptr)
+{
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+//-----------------------------------------------------------------------------
+static bool _fio_open(file_io* fio, bool direct, bool truncate)
+{
+#ifdef _WIN32
+    DWORD flags = FILE_ATTRIBUTE_NORMAL | (direct ? FILE_FLAG_NO_BUFFERING : 0);
+    fio->handle = CreateFileW(_fio_wide_name(fio->name.c_str()).c_str(),
+                              GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                              truncate ? CREATE_ALWAYS : OPEN_EXISTING,
+                              flags, NULL);
+    if ( fio->handle == INVALID_HANDLE_VALUE ) {
+        return false;
+    }
+    fio->aligned = direct;
+#else
+    int flags = O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0);
+#ifdef __linux__
+    if ( direct ) {
+        fio->fd = open(fio->name.c_str(), flags | O_DIRECT, 0644);
+        if ( fio->fd >= 0 ) {
+            fio->aligned = true;
+            return true;
+        }
+        // some file systems (tmpfs, some network mounts) don't do O_DIRECT
+        fio->logCb(logDebug, _FMT("O_DIRECT is not available for " << fio->name <<
+                                ": errno=" << errno));
+    }
+#endif
+    fio->fd = open(fio->name.c_str(), flags, 0644);
+    if ( fio->fd < 0 ) {
+        return false;
+    }
+    fio->aligned = false;
+#ifdef __APPLE__
+    if ( direct ) {
+        // no alignment requirements here, just keeps the data out of the cache
+        fcntl(fio->fd, F_NOCACHE, 1);
+    }
+#endif
+#endif
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+static void _fio_close_handle(file_io* fio)
+{
+#ifdef _WIN32
+    if ( fio->handle != INVALID_HANDLE_VALUE ) {
+        CloseHandle(fio->handle);
+        fio->handle = INVALID_HANDLE_VALUE;
+    }
+#else
+    if ( fio->fd >= 0 ) {
+        close(fio->fd);
+        fio->fd = -1;
+    }
+#endif
+}
+
+//-----------------------------------------------------------------------------
+static bool _fio_write_at(file_io* fio, const uint8_t* buf, size_t size, int64_t offset)
+{
+    while ( size > 0 ) {
+        fio->writes++;
+#ifdef _WIN32
+        LARGE_INTEGER li;
+        DWORD         written = 0;
+        li.QuadPart = offset;
+        if ( !SetFilePointerEx(fio->handle, li, NULL, FILE_BEGIN) ||
+             !WriteFile(fio->handle, buf, (DWORD)size, &written, NULL) ||
+             written == 0 ) {
+            return false;
+        }
+#else
+        ssize_t written = pwrite(fio->fd, buf, size, offset);
+        if ( written < 0 && errno == EINTR ) {
+            continue;
+        }
+        if ( written <= 0 ) {
+            return false;
+        }
+#endif
+        buf += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+static void _fio_preallocate(file_io* fio, int64_t size)
+{
+    bool ok;
+#ifdef _WIN32
+    FILE_ALLOCATION_INFO info;
+    info.AllocationSize.QuadPart = size;
+    ok = SetFileInformationByHandle(fio->handle, FileAllocationInfo, &info, sizeof(info)) != 0;
+#elif defined __linux__
+    // reserve the blocks, but leave the size alone, so readers of a file that's
+    // still being written don't see a tail of zeroes
+    ok = fallocate(fio->fd, FALLOC_FL_KEEP_SIZE, 0, size) == 0;
+#elif defined __APPLE__
+    fstore_t store = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, size, 0 };
+    ok = fcntl(fio->fd, F_PREALLOCATE, &store) != -1;
+    if ( !ok ) {
+        store.fst_flags = F_ALLOCATEALL;
+        ok = fcntl(fio->fd, F_PREALLOCATE, &store) != -1;
+    }
+#else
+    ok = false;
+#endif
+    if ( ok ) {
+        fio->preallocated = size;
+    } else {
+        fio->logCb(logDebug, _FMT("Couldn't preallocate " << size << " bytes for " << fio->name));
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void _fio_truncate(file_io* fio, int64_t size)
+{
+#ifdef _WIN32
+    LARGE_INTEGER li;
+    li.QuadPart = size;
+    if ( SetFilePointerEx(fio->handle, li, NULL, FILE_BEGIN) ) {
+        SetEndOfFile(fio->handle);
+    }
+#else
+    if ( ftruncate(fio->fd, size) != 0 ) {
+        fio->logCb(logDebug, _FMT("Couldn't trim " << fio->name << " to " << size << " bytes"));
+    }
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Switches to cached writes for the rest of the file, writing out whatever is
+// still in staging
+static bool _fio_stop_direct(file_io* fio)
+{
+    if ( !fio->aligned ) {
+        return true;
+    }
+
+#ifdef _WIN32
+    // there's no turning FILE_FLAG_NO_BUFFERING off on an open handle
+    _fio_close_handle(fio);
+    if ( !_fio_open(fio, false, false) ) {
+        fio->logCb(logError, _FMT("Couldn't reopen " << fio->name));
+        return false;
+    }
+#else
+    int flags = fcntl(fio->fd, F_GETFL);
+    fcntl(fio->fd, F_SETFL, flags & ~O_DIRECT);
+#endif
+    fio->aligned = false;
+
+    bool res = true;
+    if ( fio->stagingLen > 0 ) {
+        res = _fio_write_at(fio, fio->staging, fio->stagingLen, fio->stagingPos);
+        fio->stagingLen = 0;
+    }
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+// AVIO callbacks
+//-----------------------------------------------------------------------------
+
+static int _fio_write_packet(void* opaque, uint8_t* buf, int size)
+{
+    file_io* fio = (file_io*)opaque;
+    bool     ok = true;
+
+    if ( fio->aligned ) {
+        if ( fio->stagingLen == 0 ) {
+            fio->stagingPos = fio->pos;
+        }
+        if ( fio->stagingPos + (int64_t)fio->stagingLen != fio->pos ||
+             fio->stagingPos % kDirectAlign != 0 ||
+             fio->stagingLen + size > fio->stagingCap ) {
+            // muxer went back to patch something up; not worth staying aligned for
+            ok = _fio_stop_direct(fio);
+        }
+    }
+
+    if ( !ok ) {
+        // reported below
+    } else if ( fio->aligned ) {
+        memcpy(fio->staging + fio->stagingLen, buf, size);
+        fio->stagingLen += size;
+        size_t blocks = fio->stagingLen & ~(kDirectAlign-1);
+        if ( blocks > 0 ) {
+            ok = _fio_write_at(fio, fio->staging, blocks, fio->stagingPos);
+            fio->stagingLen -= blocks;
+            fio->stagingPos += blocks;
+            memmove(fio->staging, fio->staging + blocks, fio->stagingLen);
+        }
+    } else {
+        ok = _fio_write_at(fio, buf, size, fio->pos);
+    }
+
+    if ( !ok ) {
+        if ( !fio->failed ) {
+            fio->logCb(logError, _FMT("Failed to write " << size << " bytes at " <<
+                                    fio->pos << " to " << fio->name));
+        }
+        fio->failed = true;
+        return AVERROR(EIO);
+    }
+
+    fio->pos += size;
+    if ( fio->pos > fio->end ) {
+        fio->end = fio->pos;
+    }
+    return size;
+}
+
+//-----------------------------------------------------------------------------
+static int64_t _fio_seek(void* opaque, int64_t offset, int whence)
+{
+    file_io* fio = (file_io*)opaque;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:   return fio->end;
+    case SEEK_SET:      break;
+    case SEEK_CUR:      offset += fio->pos; break;
+    case SEEK_END:      offset += fio->end; break;
+    default:            return AVERROR(EINVAL);
+    }
+    if ( offset < 0 ) {
+        return AVERROR(EINVAL);
+    }
+    fio->pos = offset;
+    return offset;
+}
+
+//-----------------------------------------------------------------------------
+// API
+//-----------------------------------------------------------------------------
+
+extern "C" AVIOContext*     file_io_create     (const char* filename,
+                                                int bufferKb,
+                                                int64_t preallocateBytes,
+                                                int directIO,
+                                                fn_stream_log logCb)
+{
+    file_io* fio = new file_io;
+    fio->name = filename;
+#ifdef _WIN32
+    fio->handle = INVALID_HANDLE_VALUE;
+#else
+    fio->fd = -1;
+#endif
+    fio->aligned = false;
+    fio->staging = NULL;
+    fio->stagingCap = 0;
+    fio->stagingLen = 0;
+    fio->stagingPos = 0;
+    fio->pos = 0;
+    fio->end = 0;
+    fio->preallocated = 0;
+    fio->writes = 0;
+    fio->failed = false;
+    fio->logCb = logCb;
+
+    if ( bufferKb < kMinBufferKb ) {
+        bufferKb = kMinBufferKb;
+    }
+    int      bufferSize = bufferKb*1024;
+    uint8_t* buffer = (uint8_t*)av_malloc(bufferSize);
+
+    if ( buffer == NULL || !_fio_open(fio, directIO != 0, true) ) {
+        logCb(logError, _FMT("Couldn't create " << filename));
+        av_free(buffer);
+        delete fio;
+        return NULL;
+    }
+
+    if ( fio->aligned ) {
+        // one full buffer, plus the unaligned tail of the previous one
+        fio->stagingCap = bufferSize + kDirectAlign;
+        fio->staging = _fio_aligned_alloc(fio->stagingCap);
+        if ( fio->staging == NULL ) {
+            _fio_stop_direct(fio);
+        }
+    }
+
+    if ( preallocateBytes > 0 ) {
+        _fio_preallocate(fio, preallocateBytes);
+    }
+
+    AVIOContext* ctx = avio_alloc_context(buffer, bufferSize, 1, fio, NULL, _fio_write_packet, _fio_seek);
+    if ( ctx == NULL ) {
+        _fio_close_handle(fio);
+        av_free(buffer);
+        _fio_aligned_free(fio->staging);
+        delete fio;
+        return NULL;
+    }
+
+    logCb(logDebug, _FMT("Opened " << filename << ": buffer=" << bufferKb << "KB" <<
+                        " preallocated=" << fio->preallocated <<
+                        " direct=" << fio->aligned));
+    return ctx;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      file_io_close              (AVIOContext** pctx)
+{
+    if ( pctx == NULL || *pctx == NULL ) {
+        return 0;
+    }
+
+    AVIOContext* ctx = *pctx;
+    file_io*     fio = (file_io*)ctx->opaque;
+
+    avio_flush(ctx);
+    if ( !_fio_stop_direct(fio) ) {
+        fio->failed = true;
+    }
+    if ( fio->preallocated > fio->end ) {
+        // give back what was reserved, but not used
+        _fio_truncate(fio, fio->end);
+    }
+    _fio_close_handle(fio);
+
+    fio->logCb(logDebug, _FMT("Closed " << fio->name << ": size=" << fio->end <<
+                            " writes=" << fio->writes <<
+                            " preallocated=" << fio->preallocated));
+
+    int res = fio->failed || ctx->error < 0 ? -1 : 0;
+    av_freep(&ctx->buffer);
+    avio_context_free(pctx);
+    _fio_aligned_free(fio->staging);
+    delete fio;
+    return res;
+}
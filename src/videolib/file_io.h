@@ -0,0 +1,65 @@
+/*****************************************************************************
+ *
+ * file_io.h
+ *   Large-buffer AVIO backend for writing recorded files.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef FILE_IO_H
+#define FILE_IO_H
+
+#include "streamprv.h"
+#include "sv_ffmpeg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//-----------------------------------------------------------------------------
+// Write-only AVIOContext for local files. Muxer output is collected in a
+// bufferKb buffer and written out in large chunks at explicit offsets.
+// preallocateBytes reserves disk space up front (without changing the size of
+// the file, which is trimmed to what had been written on close). directIO
+// bypasses the page cache where the platform allows, falling back to cached
+// writes for the unaligned bits -- in practice, the header rewrite and the
+// tail of the file. Returns NULL if the file can't be created.
+AVIOContext*        file_io_create             (const char* filename,
+                                                int bufferKb,
+                                                int64_t preallocateBytes,
+                                                int directIO,
+                                                fn_stream_log logCb);
+// Flushes and closes the file, and frees the context. Returns -1 if any of
+// the writes had failed.
+int                 file_io_close              (AVIOContext** ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,76 @@
+/*****************************************************************************
+ *
+ * frame_avbuffer.cpp
+ *   Lets ffmpeg reference frame payloads without copying them.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "frame_avbuffer.h"
+
+//-----------------------------------------------------------------------------
+static void     _frame_avbuffer_free(void* opaque, uint8_t* data)
+{
+    frame_obj* frame = (frame_obj*)opaque;
+    frame_unref(&frame);
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      frame_avbuffer_wrap        (frame_obj* frame,
+                                                AVPacket* pkt)
+{
+    frame_api_t*    api = frame_get_api(frame);
+    uint8_t*        data = (uint8_t*)api->get_data(frame);
+    size_t          size = api->get_data_size(frame);
+
+    pkt->data = data;
+    pkt->size = (int)size;
+    if ( data == NULL || size == 0 || api->get_backing_obj == NULL ) {
+        return -1;
+    }
+
+    // already refcounted by ffmpeg; make sure it's still the same payload,
+    // clones are free to replace it
+    AVPacket* src = (AVPacket*)api->get_backing_obj(frame, "avpacket");
+    if ( src != NULL && src->buf != NULL && src->data == data && src->size == pkt->size ) {
+        pkt->buf = av_buffer_ref(src->buf);
+        return pkt->buf ? 0 : -1;
+    }
+
+    if ( api->get_backing_obj(frame, "paddedData") != data ) {
+        return -1;
+    }
+    frame_ref(frame);
+    pkt->buf = av_buffer_create(data, size + AV_INPUT_BUFFER_PADDING_SIZE,
+                                _frame_avbuffer_free, frame, AV_BUFFER_FLAG_READONLY);
+    if ( pkt->buf == NULL ) {
+        frame_unref(&frame);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,58 @@
+/*****************************************************************************
+ *
+ * frame_avbuffer.h
+ *   Lets ffmpeg reference frame payloads without copying them.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef FRAME_AVBUFFER_H
+#define FRAME_AVBUFFER_H
+
+#include "sv_ffmpeg.h"
+#include "streamprv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//-----------------------------------------------------------------------------
+// Points pkt at the frame's payload. Where the memory can be shared -- packets
+// coming from the ffmpeg demuxer, or basic frames with zeroed padding past the
+// data, as the live555 demuxer produces them -- pkt gets a buffer referencing
+// the frame, and ffmpeg won't copy it. Returns -1 when that isn't possible: pkt
+// still points at the data, but isn't refcounted, which was always the case.
+// Either way the caller owns pkt and has to av_packet_unref it.
+int                 frame_avbuffer_wrap        (frame_obj* frame,
+                                                AVPacket* pkt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -36,12 +36,12 @@
 #include "streamprv.h"
 #include "frame_allocator.h"
 #include "videolibUtils.h"
-
-#define FRAME_CLONE_MAGIC 0x9002
+#include "frame_props.h"
 
 //-----------------------------------------------------------------------------
 // Frame object assisting with frame duplication. Keeps reference to the original
-// frame, but lets override its PTS.
+// frame, but lets override its PTS. The original's properties are cached when
+// it's attached, so reading them doesn't take a second trip through its API.
 //-----------------------------------------------------------------------------
 
 typedef struct cloned_frame : public frame_pooled  {
@@ -49,6 +49,7 @@ typedef struct cloned_frame : public frame_pooled  {
     frame_api_t*        sourceApi;
     INT64_T             pts;
     INT64_T             dts;
+    frame_props         props;      // source's, with pts/dts overrides applied
     AVPacket            packet;
 } cloned_frame_obj;
 
@@ -88,6 +89,9 @@ static void        cl_frame_destroy             (frame_obj* frame);
 // Frame API. To begin with, we only use it to access the data;
 // however can be extended to access/provide metadata about the frame
 //-----------------------------------------------------------------------------
+// frame_basic.h, through frame_props.h, has its own
+#undef DECLARE_FRAME
+#undef DECLARE_FRAME_V
 #define DECLARE_FRAME(param, name, errval) \
     DECLARE_OBJ(cloned_frame_obj, name,  param, FRAME_CLONE_MAGIC, errval)
 #define DECLARE_FRAME_V(param, name) \
@@ -136,6 +140,7 @@ static frame_obj*   cl_frame_create              ()
     res->sourceApi = NULL;
     res->pts = INVALID_PTS;
     res->dts = INVALID_PTS;
+    memset(&res->props, 0, sizeof(res->props));
     return (frame_obj*)res;
 }
 
@@ -143,25 +148,21 @@ static frame_obj*   cl_frame_create              ()
 static size_t      cl_frame_get_size           (frame_obj* frame)
 {
     DECLARE_FRAME(frame, cl_frame, -1);
-    return cl_frame->sourceApi->get_data_size(cl_frame->source);
+    return cl_frame->props.dataSize;
 }
 
 //-----------------------------------------------------------------------------
 static INT64_T     cl_frame_get_pts          (frame_obj* frame)
 {
     DECLARE_FRAME(frame, cl_frame, -1);
-    if ( cl_frame->pts != INVALID_PTS )
-        return cl_frame->pts;
-    return cl_frame->sourceApi->get_pts(cl_frame->source);
+    return cl_frame->props.pts;
 }
 
 //-----------------------------------------------------------------------------
 static INT64_T     cl_frame_get_dts          (frame_obj* frame)
 {
     DECLARE_FRAME(frame, cl_frame, -1);
-    if ( cl_frame->dts != INVALID_PTS )
-        return cl_frame->dts;
-    return cl_frame->sourceApi->get_pts(cl_frame->source);
+    return cl_frame->props.dts;
 }
 
 //-----------------------------------------------------------------------------
@@ -169,6 +170,9 @@ static int         cl_frame_set_pts          (frame_obj* frame, INT64_T pts)
 {
     DECLARE_FRAME(frame, cl_frame, -1);
     cl_frame->pts = pts;
+    if ( cl_frame->source ) {
+        cl_frame->props.pts = ( pts != INVALID_PTS ) ? pts : frame_props_pts(cl_frame->source);
+    }
     return 0;
 }
 
@@ -177,6 +181,9 @@ static int         cl_frame_set_dts          (frame_obj* frame, INT64_T dts)
 {
     DECLARE_FRAME(frame, cl_frame, -1);
     cl_frame->dts = dts;
+    if ( cl_frame->source ) {
+        cl_frame->props.dts = ( dts != INVALID_PTS ) ? dts : frame_props_pts(cl_frame->source);
+    }
     return 0;
 }
 
@@ -184,7 +191,7 @@ static int         cl_frame_set_dts          (frame_obj* frame, INT64_T dts)
 static size_t      cl_frame_get_width           (frame_obj* frame)
 {
     DECLARE_FRAME(frame, cl_frame, -1);
-    return cl_frame->sourceApi->get_width(cl_frame->source);
+    return cl_frame->props.width;
 }
 
 //-----------------------------------------------------------------------------
@@ -197,7 +204,7 @@ static int         cl_frame_set_width           (frame_obj* frame, size_t size)
 static size_t      cl_frame_get_height          (frame_obj* frame)
 {
     DECLARE_FRAME(frame, cl_frame, -1);
-    return cl_frame->sourceApi->get_height(cl_frame->source);
+    return cl_frame->props.height;
 }
 
 //-----------------------------------------------------------------------------
@@ -210,7 +217,7 @@ static int         cl_frame_set_height          (frame_obj* frame, size_t height
 static int         cl_frame_get_pixel_format    (frame_obj* frame)
 {
     DECLARE_FRAME(frame, cl_frame, -1);
-    return cl_frame->sourceApi->get_pixel_format(cl_frame->source);
+    return cl_frame->props.pixelFormat;
 }
 
 //-----------------------------------------------------------------------------
@@ -223,7 +230,7 @@ static int         cl_frame_set_pixel_format    (frame_obj* frame, int pixfmt)
 static int         cl_frame_get_keyframe_flag   (frame_obj* frame)
 {
     DECLARE_FRAME(frame, cl_frame, -1);
-    return cl_frame->sourceApi->get_keyframe_flag(cl_frame->source);
+    return cl_frame->props.keyframe;
 }
 
 //-----------------------------------------------------------------------------
@@ -237,7 +244,7 @@ static int         cl_frame_set_keyframe_flag   (frame_obj* frame, int flag)
 static int         cl_frame_get_media_type    (frame_obj* frame)
 {
     DECLARE_FRAME(frame, cl_frame, -1);
-    return cl_frame->sourceApi->get_media_type(cl_frame->source);
+    return cl_frame->props.mediaType;
 }
 
 //-----------------------------------------------------------------------------
@@ -250,7 +257,7 @@ static int         cl_frame_set_media_type    (frame_obj* frame, int type)
 static const void* cl_frame_get_data           (frame_obj* frame)
 {
     DECLARE_FRAME(frame, cl_frame, NULL);
-    return cl_frame->sourceApi->get_data(cl_frame->source);
+    return cl_frame->props.data;
 }
 
 //-----------------------------------------------------------------------------
@@ -283,6 +290,9 @@ static void*       cl_frame_get_backing_obj     (frame_obj* frame,
         if ( !_stricmp(objType,"cloneParent")) {
             return cl_frame->source;
         }
+        if ( !_stricmp(objType,FRAME_PROPS_OBJ)) {
+            return &cl_frame->props;
+        }
     }
     if ( cl_frame ){
         return cl_frame->sourceApi->get_backing_obj(cl_frame->source, objType);
@@ -303,6 +313,13 @@ static int         cl_frame_set_backing_obj     (frame_obj* frame,
             cl_frame->source = (frame_obj*)obj;
             frame_ref(cl_frame->source);
             cl_frame->sourceApi = frame_get_api(cl_frame->source);
+            frame_props_load(cl_frame->source, &cl_frame->props);
+            // without an override, dts is the source's pts
+            INT64_T sourcePts = cl_frame->props.pts;
+            if ( cl_frame->pts != INVALID_PTS ) {
+                cl_frame->props.pts = cl_frame->pts;
+            }
+            cl_frame->props.dts = ( cl_frame->dts != INVALID_PTS ) ? cl_frame->dts : sourcePts;
         }
     }
     if ( cl_frame ){
@@ -327,6 +344,7 @@ static void  cl_frame_reset                     (frame_obj* frame)
     cl_frame->sourceApi = NULL;
     cl_frame->pts = INVALID_PTS;
     cl_frame->dts = INVALID_PTS;
+    memset(&cl_frame->props, 0, sizeof(cl_frame->props));
 }
 
 //-----------------------------------------------------------------------------
@@ -54,6 +54,7 @@ typedef struct ffmpeg_frame : public frame_pooled  {
     int                 needRefill; // need to re-prepare frame again
     int                 needReexport; // need to re-export data into our buffer
     frame_obj*          srcFrame; // source frame from which this frame was derived
+    AVFrame*            swframe;  // system memory copy of a hardware-backed avframe
     sv_mutex*           mutex;
     fn_stream_log       logCb;
 } ffmpeg_frame_obj;
@@ -150,21 +151,72 @@ static frame_obj*   ff_frame_create              ()
     res->needReexport = 1;
     res->logCb = NULL;
     res->srcFrame = NULL;
+    res->swframe = NULL;
     res->mutex = sv_mutex_create();
     return (frame_obj*)res;
 }
 
+//-----------------------------------------------------------------------------
+// Hardware-backed frames (hw_frames_ctx set) are kept on the device, and are
+// only downloaded when someone asks for the data or for a software avframe.
+// Size and pixel format are always reported in terms of the software layout.
+static bool        _ff_frame_is_hw             (ffmpeg_frame_obj* ff_frame)
+{
+    return ff_frame->mediaType == mediaVideo &&
+           ff_frame->avframe != NULL &&
+           ff_frame->avframe->hw_frames_ctx != NULL;
+}
+
+//-----------------------------------------------------------------------------
+static enum AVPixelFormat _ff_frame_sw_format  (ffmpeg_frame_obj* ff_frame)
+{
+    if ( _ff_frame_is_hw(ff_frame) ) {
+        AVHWFramesContext* hwctx = (AVHWFramesContext*)ff_frame->avframe->hw_frames_ctx->data;
+        return hwctx->sw_format;
+    }
+    return (enum AVPixelFormat)ff_frame->avframe->format;
+}
+
+//-----------------------------------------------------------------------------
+// Must be called with the frame's mutex held
+static AVFrame*    _ff_frame_download          (ffmpeg_frame_obj* ff_frame)
+{
+    if ( ff_frame->swframe != NULL && ff_frame->swframe->buf[0] != NULL ) {
+        return ff_frame->swframe;
+    }
+    if ( ff_frame->swframe == NULL ) {
+        ff_frame->swframe = av_frame_alloc();
+        if ( ff_frame->swframe == NULL ) {
+            return NULL;
+        }
+    }
+    ff_frame->swframe->format = _ff_frame_sw_format(ff_frame);
+    int res = av_hwframe_transfer_data(ff_frame->swframe, ff_frame->avframe, 0);
+    if ( res >= 0 ) {
+        res = av_frame_copy_props(ff_frame->swframe, ff_frame->avframe);
+    }
+    if ( res < 0 ) {
+        if ( ff_frame->logCb != NULL ) {
+            ff_frame->logCb( logError, _FMT("Failed to download hardware frame: " << av_err2str(res)));
+        }
+        av_frame_unref(ff_frame->swframe);
+        return NULL;
+    }
+    return ff_frame->swframe;
+}
+
 //-----------------------------------------------------------------------------
 static void        _ff_frame_get_size         (ffmpeg_frame_obj* ff_frame,
                                                 int* alloc,
                                                 int* actual)
 {
     if ( ff_frame->mediaType == mediaVideo ) {
-        *actual = av_image_get_buffer_size((enum AVPixelFormat)ff_frame->avframe->format,
+        enum AVPixelFormat format = _ff_frame_sw_format(ff_frame);
+        *actual = av_image_get_buffer_size(format,
                                ff_frame->avframe->width,
                                ff_frame->avframe->height,
                                _kDefAlign);
-        *alloc = av_image_get_buffer_size((enum AVPixelFormat)ff_frame->avframe->format,
+        *alloc = av_image_get_buffer_size(format,
                                ff_frame->avframe->width,
                                ff_frame->avframe->height+1,
                                _kDefAlign); //see scaleBug
@@ -273,7 +325,7 @@ static int         ff_frame_get_pixel_format    (frame_obj* frame)
 {
     DECLARE_FRAME(frame, ff_frame, -1);
     if ( ff_frame->mediaType == mediaVideo)
-        return ffpfmt_to_svpfmt((enum AVPixelFormat)ff_frame->avframe->format,
+        return ffpfmt_to_svpfmt(_ff_frame_sw_format(ff_frame),
                                 ff_frame->avframe->color_range);
     if ( ff_frame->mediaType == mediaAudio) {
         int sampleSize, interleaved;
@@ -388,13 +440,15 @@ static const void* ff_frame_get_data           (frame_obj* frame)
     if ( ff_frame->needReexport ) {
         int res = 0;
         if ( ff_frame->mediaType == mediaVideo ) {
-            res = av_image_copy_to_buffer ( (unsigned char*)ff_frame->frameBuffer,
+            AVFrame* src = _ff_frame_is_hw(ff_frame) ? _ff_frame_download(ff_frame) : ff_frame->avframe;
+            res = ( src == NULL ) ? -1 :
+                  av_image_copy_to_buffer ( (unsigned char*)ff_frame->frameBuffer,
                                         ff_frame->bufferSize,
-                                        ff_frame->avframe->data,
-                                        ff_frame->avframe->linesize,
-                                        (enum AVPixelFormat)ff_frame->avframe->format,
-                                        ff_frame->avframe->width,
-                                        ff_frame->avframe->height,
+                                        src->data,
+                                        src->linesize,
+                                        (enum AVPixelFormat)src->format,
+                                        src->width,
+                                        src->height,
                                         _kDefAlign);
         } else
         if ( ff_frame->mediaType == mediaAudio ) {
@@ -502,7 +556,17 @@ static void*       ff_frame_get_backing_obj     (frame_obj* frame,
     if ( objType ) {
         if ( !_stricmp(objType,"avframe")) {
             ff_frame->needReexport = 1;
+            if ( _ff_frame_is_hw(ff_frame) ) {
+                // consumers asking for avframe expect the data in system memory
+                sv_mutex_enter(ff_frame->mutex);
+                AVFrame* res = _ff_frame_download(ff_frame);
+                sv_mutex_exit(ff_frame->mutex);
+                return res;
+            }
             return ff_frame->avframe;
+        } else if ( !_stricmp(objType,"hwframe")) {
+            // device-resident frame, or NULL if this frame lives in system memory
+            return _ff_frame_is_hw(ff_frame) ? ff_frame->avframe : NULL;
         } else if ( !_stricmp(objType,"srcFrame")) {
             return ff_frame->srcFrame;
         }
@@ -528,6 +592,9 @@ static int         ff_frame_set_backing_obj     (frame_obj* frame,
             av_frame_unref( ff_frame->avframe );
             av_frame_free( &ff_frame->avframe );
             ff_frame->avframe = (AVFrame*)obj;
+            if ( ff_frame->swframe ) {
+                av_frame_unref( ff_frame->swframe );
+            }
 
             return 0;
         } else if ( !_stricmp(objType, "log")) {
@@ -557,6 +624,7 @@ static void  ff_frame_destroy                  (frame_obj* frame)
         LOG_ERROR(ff_frame, _FMT("Destroying f=" << ff_frame << " ; pts=" << ff_frame_get_pts(frame)));
         av_frame_unref( ff_frame->avframe );
         av_frame_free( &ff_frame->avframe );
+        av_frame_free( &ff_frame->swframe );
         av_freep( &ff_frame->frameBuffer );
         sv_mutex_destroy(&ff_frame->mutex);
         sv_freep( &ff_frame );
@@ -570,6 +638,9 @@ static void  ff_frame_reset                     (frame_obj* frame)
     LOG_ERROR(ff_frame, _FMT("Resetting f=" << ff_frame << " ; pts=" << ff_frame_get_pts(frame)));
 
     av_frame_unref( ff_frame->avframe );
+    if ( ff_frame->swframe ) {
+        av_frame_unref( ff_frame->swframe );
+    }
 
     ff_frame->needRecalc = 1;
     ff_frame->needRefill = 1;
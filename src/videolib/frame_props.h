@@ -0,0 +1,164 @@
+/*****************************************************************************
+ *
+ * frame_props.h
+ *   Inline access to the properties of a frame the pipeline looks at the
+ *   most, without going through frame_api when the frame type allows.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+#ifndef FRAME_PROPS_H
+#define FRAME_PROPS_H
+
+#include "streamprv.h"
+#include "frame_basic.h"
+
+// Clones cache their source's properties, and hand them out as this
+// backing object (frame_cloned.cpp)
+#define FRAME_PROPS_OBJ     "frameProps"
+#define FRAME_CLONE_MAGIC   0x9002
+
+//-----------------------------------------------------------------------------
+typedef struct frame_props {
+    int                 mediaType;
+    INT64_T             pts;
+    INT64_T             dts;
+    size_t              width;
+    size_t              height;
+    int                 pixelFormat;
+    int                 keyframe;
+    const void*         data;
+    size_t              dataSize;
+} frame_props;
+
+//-----------------------------------------------------------------------------
+// Basic frames, which most of the graph is made of, are read in place. Other
+// frame types go through their API; clones answer from their cache, rather
+// than forwarding to their source.
+#define FRAME_PROPS_BASIC(frame) \
+    ( ((frame_base*)(frame))->magic == BASIC_STREAM_MAGIC ? \
+        (const basic_frame_obj*)(frame) : (const basic_frame_obj*)NULL )
+
+static inline int         frame_props_media_type   (frame_obj* frame)
+{
+    const basic_frame_obj* b = FRAME_PROPS_BASIC(frame);
+    return b ? b->mediaType : frame_get_api(frame)->get_media_type(frame);
+}
+
+static inline INT64_T     frame_props_pts          (frame_obj* frame)
+{
+    const basic_frame_obj* b = FRAME_PROPS_BASIC(frame);
+    return b ? b->pts : frame_get_api(frame)->get_pts(frame);
+}
+
+static inline INT64_T     frame_props_dts          (frame_obj* frame)
+{
+    const basic_frame_obj* b = FRAME_PROPS_BASIC(frame);
+    return b ? b->dts : frame_get_api(frame)->get_dts(frame);
+}
+
+static inline size_t      frame_props_width        (frame_obj* frame)
+{
+    const basic_frame_obj* b = FRAME_PROPS_BASIC(frame);
+    return b ? b->width : frame_get_api(frame)->get_width(frame);
+}
+
+static inline size_t      frame_props_height       (frame_obj* frame)
+{
+    const basic_frame_obj* b = FRAME_PROPS_BASIC(frame);
+    return b ? b->height : frame_get_api(frame)->get_height(frame);
+}
+
+static inline int         frame_props_pixel_format (frame_obj* frame)
+{
+    const basic_frame_obj* b = FRAME_PROPS_BASIC(frame);
+    return b ? b->pixelFormat : frame_get_api(frame)->get_pixel_format(frame);
+}
+
+static inline int         frame_props_keyframe     (frame_obj* frame)
+{
+    const basic_frame_obj* b = FRAME_PROPS_BASIC(frame);
+    return b ? b->keyframe : frame_get_api(frame)->get_keyframe_flag(frame);
+}
+
+static inline const void* frame_props_data         (frame_obj* frame)
+{
+    const basic_frame_obj* b = FRAME_PROPS_BASIC(frame);
+    return b ? b->data : frame_get_api(frame)->get_data(frame);
+}
+
+static inline size_t      frame_props_data_size    (frame_obj* frame)
+{
+    const basic_frame_obj* b = FRAME_PROPS_BASIC(frame);
+    return b ? b->dataSize : frame_get_api(frame)->get_data_size(frame);
+}
+
+//-----------------------------------------------------------------------------
+// Fills props with all of the above at once, for the places needing most of
+// them: in place for basic frames, in one call for clones. Frame types
+// lacking some of the getters (packets have no dimensions) report 0 or
+// pfmtUndefined for those.
+static inline const frame_props* frame_props_load  (frame_obj* frame,
+                                                    frame_props* props)
+{
+    const basic_frame_obj* b = FRAME_PROPS_BASIC(frame);
+    if ( b ) {
+        props->mediaType = b->mediaType;
+        props->pts = b->pts;
+        props->dts = b->dts;
+        props->width = b->width;
+        props->height = b->height;
+        props->pixelFormat = b->pixelFormat;
+        props->keyframe = b->keyframe;
+        props->data = b->data;
+        props->dataSize = b->dataSize;
+        return props;
+    }
+
+    frame_api_t* api = frame_get_api(frame);
+    if ( ((frame_base*)frame)->magic == FRAME_CLONE_MAGIC ) {
+        const frame_props* cached = (const frame_props*)api->get_backing_obj(frame, FRAME_PROPS_OBJ);
+        if ( cached ) {
+            *props = *cached;
+            return props;
+        }
+    }
+    props->mediaType = api->get_media_type(frame);
+    props->pts = api->get_pts(frame);
+    props->dts = api->get_dts(frame);
+    props->width = api->get_width ? api->get_width(frame) : 0;
+    props->height = api->get_height ? api->get_height(frame) : 0;
+    props->pixelFormat = api->get_pixel_format ? api->get_pixel_format(frame) : pfmtUndefined;
+    props->keyframe = api->get_keyframe_flag(frame);
+    props->data = api->get_data(frame);
+    props->dataSize = api->get_data_size(frame);
+    return props;
+}
+
+#endif
@@ -0,0 +1,317 @@
+/*****************************************************************************
+ *
+ * frame_trace.cpp
+ *   Per-frame latency tracing, from packet arrival to delivery.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+#include "frame_trace.h"
+#include "sv_os.h"
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+// declared in svcore
+extern "C" void frame_set_release_hook(fn_frame_destroy hook);
+
+//-----------------------------------------------------------------------------
+// Traces are kept out of the frames themselves, keyed by frame pointer, and
+// dropped when the frame is released. Every frame of every camera goes
+// through here a few times, so the table is sharded to keep the locks cold.
+static const int        kTraceShards = 16;
+// power of 2 buckets of microseconds: [0,1), [1,2), [2,4) ... up to ~35 minutes
+static const int        kHistogramBuckets = 32;
+// decoders hold on to a few frames at most; anything beyond is a dropped packet
+static const size_t     kMaxHeldTraces = 64;
+
+typedef struct frame_trace {
+    INT64_T     stamps[ftStageCount];
+} frame_trace;
+
+typedef struct frame_trace_shard {
+    std::mutex                                      mutex;
+    std::unordered_map<const void*, frame_trace>    traces;
+} frame_trace_shard;
+
+typedef struct frame_trace_histogram {
+    stats_item_int  stats;
+    INT64_T         buckets[kHistogramBuckets];
+} frame_trace_histogram;
+
+typedef struct frame_trace_owner {
+    frame_trace_histogram   stages[ftStageCount];
+} frame_trace_owner;
+
+struct frame_trace_queue {
+    std::deque< std::pair<INT64_T, frame_trace> >   held;
+};
+
+static frame_trace_shard                            _gShards[kTraceShards];
+static std::mutex                                   _gOwnersMutex;
+static std::map<const void*, frame_trace_owner>     _gOwners;
+static int                                          _gEnabled = -1;
+
+//-----------------------------------------------------------------------------
+static frame_trace_shard&   _frame_trace_shard(const void* frame)
+{
+    // frames are allocated with at least 16 byte alignment
+    return _gShards[((uintptr_t)frame >> 4) % kTraceShards];
+}
+
+//-----------------------------------------------------------------------------
+static void     _frame_trace_on_release(frame_obj* frame)
+{
+    frame_trace_shard& shard = _frame_trace_shard(frame);
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    if ( !shard.traces.empty() ) {
+        shard.traces.erase(frame);
+    }
+}
+
+//-----------------------------------------------------------------------------
+static bool     _frame_trace_get(frame_obj* frame, frame_trace& trace)
+{
+    frame_trace_shard& shard = _frame_trace_shard(frame);
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    auto it = shard.traces.find(frame);
+    if ( it == shard.traces.end() ) {
+        return false;
+    }
+    trace = it->second;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+static void     _frame_trace_set(frame_obj* frame, const frame_trace& trace)
+{
+    frame_trace_shard& shard = _frame_trace_shard(frame);
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    shard.traces[frame] = trace;
+}
+
+//-----------------------------------------------------------------------------
+static void     _frame_trace_histogram_add(frame_trace_histogram& h, INT64_T us)
+{
+    int bucket = 0;
+    while ( bucket < kHistogramBuckets-1 && ((INT64_T)1 << bucket) <= us ) {
+        bucket++;
+    }
+    h.buckets[bucket]++;
+    stats_int_update(&h.stats, us);
+}
+
+//-----------------------------------------------------------------------------
+// Upper bound of the bucket the percentile falls into, clamped to the max seen
+static INT64_T  _frame_trace_histogram_percentile(const frame_trace_histogram& h, int pct)
+{
+    INT64_T target = (h.stats.sampleCount * pct + 99) / 100;
+    INT64_T seen = 0;
+    for (int nI=0; nI<kHistogramBuckets; nI++) {
+        seen += h.buckets[nI];
+        if ( seen >= target ) {
+            INT64_T bound = (INT64_T)1 << nI;
+            return bound < h.stats.max ? bound : h.stats.max;
+        }
+    }
+    return h.stats.max;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      frame_trace_enabled        ()
+{
+    if ( _gEnabled < 0 ) {
+        static std::once_flag once;
+        std::call_once(once, [] () {
+            int enabled = sv_get_int_env_var(FRAME_TRACE_VAR, 1);
+            if ( enabled ) {
+                frame_set_release_hook(_frame_trace_on_release);
+            }
+            _gEnabled = enabled;
+        });
+    }
+    return _gEnabled;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" INT64_T  frame_trace_now_us         ()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     frame_trace_begin          (frame_obj* frame, INT64_T arrivalUs)
+{
+    if ( !frame_trace_enabled() || frame == NULL ) {
+        return;
+    }
+    frame_trace trace;
+    memset(&trace, 0, sizeof(trace));
+    trace.stamps[ftArrival] = arrivalUs ? arrivalUs : frame_trace_now_us();
+    _frame_trace_set(frame, trace);
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     frame_trace_stamp          (frame_obj* frame, int stage)
+{
+    if ( !frame_trace_enabled() || frame == NULL ) {
+        return;
+    }
+    INT64_T now = frame_trace_now_us();
+    frame_trace_shard& shard = _frame_trace_shard(frame);
+    std::lock_guard<std::mutex> guard(shard.mutex);
+    auto it = shard.traces.find(frame);
+    if ( it != shard.traces.end() ) {
+        it->second.stamps[stage] = now;
+    }
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     frame_trace_forward        (frame_obj* src, frame_obj* dst, int stage)
+{
+    frame_trace trace;
+    if ( !frame_trace_enabled() || src == NULL || dst == NULL ||
+         !_frame_trace_get(src, trace) ) {
+        return;
+    }
+    trace.stamps[stage] = frame_trace_now_us();
+    _frame_trace_set(dst, trace);
+}
+
+//-----------------------------------------------------------------------------
+extern "C" frame_trace_queue*  frame_trace_queue_create   ()
+{
+    return new frame_trace_queue;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     frame_trace_queue_push     (frame_trace_queue* q, frame_obj* src)
+{
+    frame_trace trace;
+    if ( !frame_trace_enabled() || q == NULL || src == NULL ||
+         !_frame_trace_get(src, trace) ) {
+        return;
+    }
+    q->held.push_back(std::make_pair(frame_get_api(src)->get_pts(src), trace));
+    while ( q->held.size() > kMaxHeldTraces ) {
+        q->held.pop_front();
+    }
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     frame_trace_queue_pop      (frame_trace_queue* q, frame_obj* dst, int stage)
+{
+    if ( !frame_trace_enabled() || q == NULL || dst == NULL ) {
+        return;
+    }
+    INT64_T pts = frame_get_api(dst)->get_pts(dst);
+    for (auto it = q->held.begin(); it != q->held.end(); it++) {
+        if ( it->first == pts ) {
+            frame_trace trace = it->second;
+            q->held.erase(it);
+            trace.stamps[stage] = frame_trace_now_us();
+            _frame_trace_set(dst, trace);
+            return;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     frame_trace_queue_destroy  (frame_trace_queue** q)
+{
+    if ( q && *q ) {
+        delete *q;
+        *q = NULL;
+    }
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     frame_trace_deliver        (const void* owner, frame_obj* frame)
+{
+    frame_trace trace;
+    if ( !frame_trace_enabled() || frame == NULL ||
+         !_frame_trace_get(frame, trace) ) {
+        return;
+    }
+    trace.stamps[ftDelivered] = frame_trace_now_us();
+
+    std::lock_guard<std::mutex> guard(_gOwnersMutex);
+    auto inserted = _gOwners.emplace(owner, frame_trace_owner());
+    frame_trace_owner& o = inserted.first->second;
+    if ( inserted.second ) {
+        memset(&o, 0, sizeof(o));
+    }
+
+    INT64_T prev = trace.stamps[ftArrival];
+    for (int stage=ftArrival+1; stage<ftStageCount; stage++) {
+        INT64_T stamp = trace.stamps[stage];
+        if ( stamp == 0 ) {
+            continue;
+        }
+        // stamps of the same frame may come from different threads
+        _frame_trace_histogram_add(o.stages[stage], stamp > prev ? stamp - prev : 0);
+        prev = stamp;
+    }
+    _frame_trace_histogram_add(o.stages[ftArrival], prev - trace.stamps[ftArrival]);
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      frame_trace_get_stats      (const void* owner,
+                                                int stage,
+                                                frame_trace_stats* stats)
+{
+    if ( stage < 0 || stage >= ftStageCount || stats == NULL ) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> guard(_gOwnersMutex);
+    auto it = _gOwners.find(owner);
+    if ( it == _gOwners.end() ) {
+        return -1;
+    }
+    frame_trace_histogram& h = it->second.stages[stage];
+    stats->count = h.stats.sampleCount;
+    stats->avgUs = stats_int_average(&h.stats);
+    stats->maxUs = h.stats.max;
+    stats->p50Us = _frame_trace_histogram_percentile(h, 50);
+    stats->p90Us = _frame_trace_histogram_percentile(h, 90);
+    stats->p99Us = _frame_trace_histogram_percentile(h, 99);
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     frame_trace_release        (const void* owner)
+{
+    std::lock_guard<std::mutex> guard(_gOwnersMutex);
+    _gOwners.erase(owner);
+}
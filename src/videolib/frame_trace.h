@@ -0,0 +1,106 @@
+/*****************************************************************************
+ *
+ * frame_trace.h
+ *   Per-frame latency tracing, from packet arrival to delivery.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+#ifndef FRAME_TRACE_H
+#define FRAME_TRACE_H
+
+#include "streamprv.h"
+
+// Set to 0 to disable frame tracing
+#define FRAME_TRACE_VAR "SV_FRAME_TRACE"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Points in the pipeline a frame is stamped at, in the order it reaches them
+enum {
+    ftArrival       = 0,    // packet read from the network or file
+    ftDecoded,              // decoder output
+    ftResized,              // resize/pixfmt conversion output
+    ftEnqueued,             // deposited into a thread connector
+    ftDequeued,             // taken out of a thread connector
+    ftDelivered,            // handed to the analytics (get_new_frame)
+    ftStageCount
+};
+
+typedef struct frame_trace_queue frame_trace_queue;
+
+typedef struct frame_trace_stats {
+    INT64_T     count;
+    INT64_T     avgUs;
+    INT64_T     maxUs;
+    INT64_T     p50Us;
+    INT64_T     p90Us;
+    INT64_T     p99Us;
+} frame_trace_stats;
+
+//-----------------------------------------------------------------------------
+// Stamping. All of these do nothing when tracing is disabled, or when the frame
+// isn't being traced (i.e. frame_trace_begin had never been called for it, or
+// it had since been released).
+int                 frame_trace_enabled        ();
+INT64_T             frame_trace_now_us         ();
+// Starts tracing the frame; arrivalUs of 0 means now
+void                frame_trace_begin          (frame_obj* frame, INT64_T arrivalUs);
+void                frame_trace_stamp          (frame_obj* frame, int stage);
+// Carries the trace of src over to dst (a frame produced from it), and stamps it
+void                frame_trace_forward        (frame_obj* src, frame_obj* dst, int stage);
+
+//-----------------------------------------------------------------------------
+// For nodes that don't produce their outputs in the order inputs arrive (i.e.
+// decoders): traces of inputs are held by pts, and resumed on the output with
+// the same pts.
+frame_trace_queue*  frame_trace_queue_create   ();
+void                frame_trace_queue_push     (frame_trace_queue* q, frame_obj* src);
+void                frame_trace_queue_pop      (frame_trace_queue* q, frame_obj* dst, int stage);
+void                frame_trace_queue_destroy  (frame_trace_queue** q);
+
+//-----------------------------------------------------------------------------
+// Delivery. Stamps ftDelivered and folds the frame's trace into the histograms
+// of the owner (a StreamData).
+void                frame_trace_deliver        (const void* owner, frame_obj* frame);
+// Returns -1 if nothing had been delivered for owner. Stats of a stage cover
+// the time since the previous stage the frame was stamped at; for ftArrival,
+// the time from arrival to delivery.
+int                 frame_trace_get_stats      (const void* owner,
+                                                int stage,
+                                                frame_trace_stats* stats);
+void                frame_trace_release        (const void* owner);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
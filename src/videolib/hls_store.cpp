@@ -0,0 +1,234 @@
+/*****************************************************************************
+ *
+ * hls_store.cpp
+ *   In-memory store of live HLS playlists and segments.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+#include "hls_store.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+static const int    kIOBufferSize = 64*1024;
+
+typedef std::shared_ptr<const std::vector<uint8_t> > hls_store_data;
+
+typedef struct hls_store_entry {
+    hls_store_data      data;
+    hls_store_owner*    owner;
+} hls_store_entry;
+
+struct hls_store_owner {
+    int                 unused;
+};
+
+struct hls_store_buffer {
+    hls_store_data      data;
+};
+
+// a file being written through hls_store_io_open
+typedef struct hls_store_file {
+    hls_store_owner*        owner;
+    std::string             path;
+    std::vector<uint8_t>    data;
+    bool                    deleting;
+} hls_store_file;
+
+static std::mutex                               _gStoreMutex;
+static std::map<std::string, hls_store_entry>   _gStore;
+
+//-----------------------------------------------------------------------------
+static void     _hls_store_publish(hls_store_owner* owner,
+                                   const std::string& path,
+                                   const hls_store_data& data)
+{
+    hls_store_data replaced;
+    {
+        std::lock_guard<std::mutex> guard(_gStoreMutex);
+        hls_store_entry& e = _gStore[path];
+        // the old contents go once the last reader is done with them -- and
+        // not while the lock is held
+        replaced.swap(e.data);
+        e.data = data;
+        e.owner = owner;
+    }
+}
+
+//-----------------------------------------------------------------------------
+extern "C" hls_store_owner* hls_store_owner_create ()
+{
+    hls_store_owner* owner = new hls_store_owner;
+    owner->unused = 0;
+    return owner;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     hls_store_owner_destroy    (hls_store_owner** pOwner)
+{
+    if ( pOwner == NULL || *pOwner == NULL ) {
+        return;
+    }
+    std::vector<hls_store_data> dropped;
+    {
+        std::lock_guard<std::mutex> guard(_gStoreMutex);
+        std::map<std::string, hls_store_entry>::iterator it = _gStore.begin();
+        while ( it != _gStore.end() ) {
+            if ( it->second.owner == *pOwner ) {
+                dropped.push_back(it->second.data);
+                _gStore.erase(it++);
+            } else {
+                it++;
+            }
+        }
+    }
+    delete *pOwner;
+    *pOwner = NULL;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      hls_store_put              (hls_store_owner* owner,
+                                                const char* path,
+                                                const uint8_t* data,
+                                                size_t size)
+{
+    _hls_store_publish(owner, path, std::make_shared<const std::vector<uint8_t> >(data, data+size));
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     hls_store_remove           (const char* path)
+{
+    hls_store_data removed;
+    std::lock_guard<std::mutex> guard(_gStoreMutex);
+    std::map<std::string, hls_store_entry>::iterator it = _gStore.find(path);
+    if ( it != _gStore.end() ) {
+        removed.swap(it->second.data);
+        _gStore.erase(it);
+    }
+}
+
+//-----------------------------------------------------------------------------
+static int      _hls_store_write_packet(void* opaque, uint8_t* buf, int size)
+{
+    hls_store_file* f = (hls_store_file*)opaque;
+    f->data.insert(f->data.end(), buf, buf+size);
+    return size;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      hls_store_io_open          (AVFormatContext* s,
+                                                AVIOContext** pb,
+                                                const char* url,
+                                                int flags,
+                                                AVDictionary** options)
+{
+    if ( (flags & AVIO_FLAG_WRITE) == 0 ) {
+        // the hls muxer only reads back what it appends to, which we don't do
+        return AVERROR(ENOSYS);
+    }
+
+    AVDictionaryEntry* method = options ? av_dict_get(*options, "method", NULL, 0) : NULL;
+    hls_store_file* f = new hls_store_file;
+    f->owner = (hls_store_owner*)s->opaque;
+    f->path = url;
+    f->deleting = ( method != NULL && !_stricmp(method->value, "DELETE") );
+
+    uint8_t* buffer = (uint8_t*)av_malloc(kIOBufferSize);
+    *pb = buffer ? avio_alloc_context(buffer, kIOBufferSize, 1, f, NULL, _hls_store_write_packet, NULL) : NULL;
+    if ( *pb == NULL ) {
+        av_free(buffer);
+        delete f;
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      hls_store_io_close2        (AVFormatContext* s,
+                                                AVIOContext* pb)
+{
+    if ( pb == NULL ) {
+        return 0;
+    }
+    avio_flush(pb);
+    hls_store_file* f = (hls_store_file*)pb->opaque;
+    if ( f->deleting ) {
+        hls_store_remove(f->path.c_str());
+    } else {
+        std::shared_ptr<std::vector<uint8_t> > data = std::make_shared<std::vector<uint8_t> >();
+        data->swap(f->data);
+        _hls_store_publish(f->owner, f->path, data);
+    }
+    delete f;
+    av_freep(&pb->buffer);
+    avio_context_free(&pb);
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     hls_store_io_close         (AVFormatContext* s,
+                                                AVIOContext* pb)
+{
+    hls_store_io_close2(s, pb);
+}
+
+//-----------------------------------------------------------------------------
+extern "C" hls_store_buffer* hls_store_get     (const char* path,
+                                                const uint8_t** data,
+                                                size_t* size)
+{
+    hls_store_buffer* buffer = NULL;
+    {
+        std::lock_guard<std::mutex> guard(_gStoreMutex);
+        std::map<std::string, hls_store_entry>::iterator it = _gStore.find(path);
+        if ( it == _gStore.end() ) {
+            return NULL;
+        }
+        buffer = new hls_store_buffer;
+        buffer->data = it->second.data;
+    }
+    *data = buffer->data->empty() ? NULL : &(*buffer->data)[0];
+    *size = buffer->data->size();
+    return buffer;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     hls_store_release          (hls_store_buffer** buffer)
+{
+    if ( buffer == NULL || *buffer == NULL ) {
+        return;
+    }
+    delete *buffer;
+    *buffer = NULL;
+}
@@ -0,0 +1,89 @@
+/*****************************************************************************
+ *
+ * hls_store.h
+ *   In-memory store of live HLS playlists and segments.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+
+#ifndef HLS_STORE_H
+#define HLS_STORE_H
+
+#include "sv_ffmpeg.h"
+#include "streamprv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct hls_store_owner hls_store_owner;
+typedef struct hls_store_buffer hls_store_buffer;
+
+//-----------------------------------------------------------------------------
+// Files live in the store under the path they'd have been written to on disk.
+// Every file belongs to the owner that had last written it; destroying the
+// owner drops whatever of its files nobody else had replaced since.
+hls_store_owner*    hls_store_owner_create     ();
+void                hls_store_owner_destroy    (hls_store_owner** owner);
+
+// Publishes (a copy of) data as the file at path, replacing what was there
+int                 hls_store_put              (hls_store_owner* owner,
+                                                const char* path,
+                                                const uint8_t* data,
+                                                size_t size);
+void                hls_store_remove           (const char* path);
+
+// AVFormatContext.io_open/io_close(2) for muxers doing their own I/O (hls),
+// with the owner as the context's opaque. A file is published when it's
+// closed; opening one with the DELETE method removes it.
+int                 hls_store_io_open          (AVFormatContext* s,
+                                                AVIOContext** pb,
+                                                const char* url,
+                                                int flags,
+                                                AVDictionary** options);
+int                 hls_store_io_close2        (AVFormatContext* s,
+                                                AVIOContext* pb);
+void                hls_store_io_close         (AVFormatContext* s,
+                                                AVIOContext* pb);
+
+//-----------------------------------------------------------------------------
+// Reader side. Returns a reference to the current contents of the file, or
+// NULL if there's no such file; the data stays valid (and unchanged) until the
+// reference is released, even if the file is replaced or removed.
+hls_store_buffer*   hls_store_get              (const char* path,
+                                                const uint8_t** data,
+                                                size_t* size);
+void                hls_store_release          (hls_store_buffer** buffer);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
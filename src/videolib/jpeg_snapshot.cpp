@@ -0,0 +1,314 @@
+/*****************************************************************************
+ *
+ * jpeg_snapshot.cpp
+ *   Cached JPEG encoder for snapshots of the newest live frame.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "jpeg_snapshot.h"
+#include "sv_ffmpeg.h"
+#include "sv_pixfmt.h"
+#include "videolibUtils.h"
+
+#include <map>
+#include <mutex>
+#include <vector>
+
+//-----------------------------------------------------------------------------
+struct jpeg_snapshot {
+    std::mutex              mutex;
+    fn_stream_log           logCb;
+
+    // what the encoder is set up for
+    int                     inputWidth;
+    int                     inputHeight;
+    int                     inputPixFmt;
+    int                     width;
+    int                     height;
+
+    struct SwsContext*      swsCtx;
+    AVFrame*                resizedFrame;
+    AVCodecContext*         codecCtx;
+    int64_t                 framesEncoded;
+
+    // what had been encoded last
+    const frame_obj*        lastFrame;
+    INT64_T                 lastPts;
+    std::vector<uint8_t>    lastJpeg;
+};
+
+static std::mutex                                   _gSnapshotsMutex;
+static std::map<const void*, jpeg_snapshot*>        _gSnapshots;
+
+//-----------------------------------------------------------------------------
+static void     _jpeg_snapshot_reset(jpeg_snapshot* js)
+{
+    sws_freeContext(js->swsCtx);
+    js->swsCtx = NULL;
+    av_frame_free(&js->resizedFrame);
+    if (js->codecCtx) {
+        avcodec_close(js->codecCtx);
+        avcodec_free_context(&js->codecCtx);
+    }
+    js->inputWidth = js->inputHeight = js->inputPixFmt = -1;
+    js->width = js->height = -1;
+    js->framesEncoded = 0;
+    js->lastFrame = NULL;
+    js->lastPts = INVALID_PTS;
+    js->lastJpeg.clear();
+}
+
+//-----------------------------------------------------------------------------
+static int      _jpeg_snapshot_setup(jpeg_snapshot* js,
+                                    int inputWidth,
+                                    int inputHeight,
+                                    int inputPixFmt,
+                                    int width,
+                                    int height)
+{
+    int err;
+
+    _jpeg_snapshot_reset(js);
+
+    js->swsCtx = sws_getCachedContext(NULL,
+        inputWidth, inputHeight, svpfmt_to_ffpfmt(inputPixFmt, NULL),
+        width, height, AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR,
+        0, NULL, NULL);
+        // NOTE: AV_PIX_FMT_YUV420P instead of AV_PIX_FMT_YUVJ420P, as below, to avoid
+        //       warnings saying "deprecated pixel format used, make sure you
+        //       did set range correctly" flooding the log for no good reason
+    if (!js->swsCtx) {
+        js->logCb(logError, "cannot get scaling context");
+        return -1;
+    }
+
+    js->resizedFrame = av_frame_alloc();
+    if (!js->resizedFrame) {
+        js->logCb(logError, "cannot allocate frame");
+        return -1;
+    }
+    js->resizedFrame->width = width;
+    js->resizedFrame->height = height;
+    js->resizedFrame->format = AV_PIX_FMT_YUV420P;
+    err = av_frame_get_buffer(js->resizedFrame, _kDefAlign);
+    if (err < 0) {
+        js->logCb(logError, _FMT("cannot allocate resized frame buffer: " << av_err2str(err)));
+        return -1;
+    }
+
+    // do the JPEG compression by leveraging FFmpeg's MJPEG codec
+    const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+    if (!codec) {
+        js->logCb(logError, "cannot find encoder");
+        return -1;
+    }
+    AVCodecContext* codecCtx = js->codecCtx = avcodec_alloc_context3(codec);
+    if (!codecCtx) {
+        js->logCb(logError, "cannot allocated codec context");
+        return -1;
+    }
+    codecCtx->bit_rate = 100*1000*1000; // dummy
+    codecCtx->width = width;
+    codecCtx->height = height;
+    codecCtx->pix_fmt = AV_PIX_FMT_YUVJ420P;
+    codecCtx->codec_id = AV_CODEC_ID_MJPEG;
+    codecCtx->codec_type = AVMEDIA_TYPE_VIDEO;
+    codecCtx->time_base.num = 1; // dummy
+    codecCtx->time_base.den = 1; // dummy
+    codecCtx->mb_lmin = codecCtx->qmin * FF_QP2LAMBDA;
+    codecCtx->mb_lmax = codecCtx->qmax * FF_QP2LAMBDA;
+    codecCtx->flags = AV_CODEC_FLAG_QSCALE;
+    codecCtx->global_quality = codecCtx->qmin * FF_QP2LAMBDA;
+    // TODO: don't let all of this quality setting fool you, as it turns out it
+    //       does not change a thing - at this moment the FFMPEG MJPEG codec
+    //       always uses the same quality (there seems to be a lossless option,
+    //       but we don't use it) - ideally we'd use a more flexible encoder
+    //       (e.g. libjepg) to support different quality settings and thus
+    //       better adaption in different bandwidth scenarios...
+    err = avcodec_open2(codecCtx, codec, NULL);
+    if (err) {
+        js->logCb(logError, _FMT("cannot open codec (" << err << ")"));
+        return -1;
+    }
+    js->resizedFrame->quality = codecCtx->global_quality;
+
+    js->inputWidth = inputWidth;
+    js->inputHeight = inputHeight;
+    js->inputPixFmt = inputPixFmt;
+    js->width = width;
+    js->height = height;
+    js->logCb(logDebug, _FMT("Snapshot encoder set up for " << inputWidth << "x" << inputHeight <<
+                            " fmt=" << inputPixFmt << " -> " << width << "x" << height));
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" jpeg_snapshot*  jpeg_snapshot_get   (const void* owner,
+                                                fn_stream_log logCb)
+{
+    std::lock_guard<std::mutex> guard(_gSnapshotsMutex);
+    std::map<const void*, jpeg_snapshot*>::iterator it = _gSnapshots.find(owner);
+    if ( it != _gSnapshots.end() ) {
+        return it->second;
+    }
+
+    jpeg_snapshot* js = new jpeg_snapshot;
+    js->logCb = logCb;
+    js->swsCtx = NULL;
+    js->resizedFrame = NULL;
+    js->codecCtx = NULL;
+    _jpeg_snapshot_reset(js);
+    _gSnapshots[owner] = js;
+    return js;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     jpeg_snapshot_release      (const void* owner)
+{
+    jpeg_snapshot* js = NULL;
+    {
+        std::lock_guard<std::mutex> guard(_gSnapshotsMutex);
+        std::map<const void*, jpeg_snapshot*>::iterator it = _gSnapshots.find(owner);
+        if ( it == _gSnapshots.end() ) {
+            return;
+        }
+        js = it->second;
+        _gSnapshots.erase(it);
+    }
+
+    {
+        // wait out whoever may still be encoding
+        std::lock_guard<std::mutex> guard(js->mutex);
+        _jpeg_snapshot_reset(js);
+    }
+    delete js;
+}
+
+//-----------------------------------------------------------------------------
+static void*    _jpeg_snapshot_copy_last(jpeg_snapshot* js, int* size)
+{
+    void* result = av_malloc(js->lastJpeg.size());
+    if (result) {
+        memcpy(result, js->lastJpeg.data(), js->lastJpeg.size());
+        *size = (int)js->lastJpeg.size();
+    }
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void*    jpeg_snapshot_encode       (jpeg_snapshot* js,
+                                                frame_obj* frame,
+                                                int width,
+                                                int height,
+                                                int* size)
+{
+    std::lock_guard<std::mutex> guard(js->mutex);
+
+    frame_api_t*    frameApi = frame_get_api(frame);
+    int             inputPixFmt = frameApi->get_pixel_format(frame);
+    int             inputWidth  = frameApi->get_width(frame);
+    int             inputHeight = frameApi->get_height(frame);
+    INT64_T         pts = frameApi->get_pts(frame);
+    int             err;
+
+    // resize the frame to the final size needed, and avoid ever scaling up;
+    // also force a minimum size of 16x16 because at the time we got a crash in
+    // sws_getCachedContext() on very small sizes (e.g. 3x2)
+    width = width < 16 ? 16 : width;
+    width = width > inputWidth ? inputWidth : width;
+    height = height < 16 ? 16 : height;
+    height = height > inputHeight ? inputHeight : height;
+    videolibapi_preserve_aspect_ratio( inputWidth, inputHeight, &width, &height, 1);
+
+    if ( inputWidth != js->inputWidth ||
+         inputHeight != js->inputHeight ||
+         inputPixFmt != js->inputPixFmt ||
+         width != js->width ||
+         height != js->height ) {
+        if ( _jpeg_snapshot_setup(js, inputWidth, inputHeight, inputPixFmt, width, height) < 0 ) {
+            _jpeg_snapshot_reset(js);
+            return NULL;
+        }
+    } else if ( frame == js->lastFrame && pts == js->lastPts && !js->lastJpeg.empty() ) {
+        // polled again before a new frame came in
+        return _jpeg_snapshot_copy_last(js, size);
+    }
+
+    uint8_t*    srcData[4];
+    int         srcLinesize[4];
+    err = av_image_fill_arrays(srcData,
+                    srcLinesize,
+                    (const uint8_t*)frameApi->get_data(frame),
+                    svpfmt_to_ffpfmt(inputPixFmt, NULL),
+                    inputWidth,
+                    inputHeight,
+                    _kDefAlign);
+    if (err < 0) {
+        js->logCb(logError, _FMT("cannot map frame data fmt=" << inputPixFmt <<
+                                " w=" << inputWidth << " h=" << inputHeight <<
+                                " err=" << av_err2str(err)));
+        return NULL;
+    }
+
+    err = av_frame_make_writable(js->resizedFrame);
+    if (err < 0) {
+        js->logCb(logError, _FMT("cannot reuse resized frame buffer: " << av_err2str(err)));
+        return NULL;
+    }
+    sws_scale(js->swsCtx,
+        (const uint8_t* const*)srcData,
+        srcLinesize,
+        0,
+        inputHeight,
+        js->resizedFrame->data,
+        js->resizedFrame->linesize);
+    js->resizedFrame->pts = ++js->framesEncoded;
+
+    AVPacket    packet;
+    void*       result = NULL;
+    av_init_packet(&packet);
+    packet.data = NULL;
+    packet.size = 0;
+    err = avcodec_send_frame(js->codecCtx, js->resizedFrame);
+    if (!err) {
+        err = avcodec_receive_packet(js->codecCtx, &packet);
+    }
+    if (err) {
+        js->logCb(logError, _FMT("failed to encode snapshot: " << av_err2str(err)));
+        // don't trust the encoder state after a failure
+        _jpeg_snapshot_reset(js);
+    } else {
+        js->lastJpeg.assign(packet.data, packet.data + packet.size);
+        js->lastFrame = frame;
+        js->lastPts = pts;
+        result = _jpeg_snapshot_copy_last(js, size);
+    }
+    av_packet_unref(&packet);
+    return result;
+}
@@ -0,0 +1,64 @@
+/*****************************************************************************
+ *
+ * jpeg_snapshot.h
+ *   Cached JPEG encoder for snapshots of the newest live frame.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef JPEG_SNAPSHOT_H
+#define JPEG_SNAPSHOT_H
+
+#include "streamprv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct jpeg_snapshot jpeg_snapshot;
+
+//-----------------------------------------------------------------------------
+// Snapshot encoders are kept per owner (a StreamData), and reused for as long
+// as input size, pixel format and output size stay the same.
+jpeg_snapshot*      jpeg_snapshot_get          (const void* owner,
+                                                fn_stream_log logCb);
+void                jpeg_snapshot_release      (const void* owner);
+
+// Returns an av_malloc'ed JPEG of the frame, or NULL on error. Re-requesting
+// the same frame at the same size returns the previously encoded bytes.
+void*               jpeg_snapshot_encode       (jpeg_snapshot* js,
+                                                frame_obj* frame,
+                                                int width,
+                                                int height,
+                                                int* size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,470 @@
+/*****************************************************************************
+ *
+ * llhls_writer.cpp
+ *   Low-latency HLS output: fMP4 parts, segments and their playlist.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#include "llhls_writer.h"
+#include "hls_store.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+static const int    kIOBufferSize = 64*1024;
+// playlists only carry parts of the most recent segments
+static const size_t kSegmentsWithParts = 2;
+static const int    kMaxRenameRetries = 5;
+
+typedef struct llhls_part {
+    int64_t     duration;
+    bool        independent;
+} llhls_part;
+
+typedef struct llhls_segment {
+    int64_t                 msn;
+    int64_t                 duration;
+    std::vector<llhls_part> parts;
+} llhls_segment;
+
+// what a blocking reload waits on; outlives the writer, if need be
+typedef struct llhls_state {
+    std::mutex              mutex;
+    std::condition_variable cond;
+    int64_t                 msn;        // segment in progress
+    int                     parts;      // parts of it already listed
+    bool                    finished;
+} llhls_state;
+
+struct llhls_writer {
+    std::string                 path;
+    std::string                 dir;    // with the trailing separator, if any
+    std::string                 name;
+    int                         partTarget;
+    int                         segmentTarget;
+    int                         listSize;
+    fn_stream_log               logCb;
+    hls_store_owner*            store;  // files go to the in-memory store, rather than to disk
+
+    AVIOContext*                io;
+    std::vector<uint8_t>        pending;        // written since the last part ended
+    std::vector<uint8_t>        segmentData;    // parts of the current segment
+    std::deque<llhls_segment>   segments;       // complete ones, in the playlist
+    llhls_segment               current;
+    int64_t                     maxSegmentDuration;
+
+    int64_t                     partStartPts;
+    int64_t                     segmentStartPts;
+    int64_t                     prevPts;
+    int64_t                     frameInterval;
+    int64_t                     cutPts;
+    bool                        partIndependent;
+    bool                        cutIndependent;
+    bool                        finished;
+
+    std::shared_ptr<llhls_state> state;
+};
+
+static std::mutex                                           _gWritersMutex;
+static std::map<std::string, std::shared_ptr<llhls_state> > _gWriters;
+
+//-----------------------------------------------------------------------------
+static int      _llhls_write_packet(void* opaque, uint8_t* buf, int size)
+{
+    llhls_writer* w = (llhls_writer*)opaque;
+    if ( !w->finished ) {
+        w->pending.insert(w->pending.end(), buf, buf+size);
+    }
+    return size;
+}
+
+//-----------------------------------------------------------------------------
+static std::string _llhls_part_name(llhls_writer* w, int64_t msn, size_t part)
+{
+    return _STR(w->name << msn << "." << part << ".m4s");
+}
+
+//-----------------------------------------------------------------------------
+static std::string _llhls_segment_name(llhls_writer* w, int64_t msn)
+{
+    return _STR(w->name << msn << ".m4s");
+}
+
+//-----------------------------------------------------------------------------
+static bool     _llhls_write_file(llhls_writer* w,
+                                  const std::string& filename,
+                                  const std::vector<uint8_t>& data)
+{
+    std::string path = w->dir + filename;
+    if ( w->store != NULL ) {
+        return hls_store_put(w->store, path.c_str(), data.empty() ? NULL : &data[0], data.size()) == 0;
+    }
+    FILE*       f = sv_open_file(path.c_str(), "wb");
+    if ( f == NULL ) {
+        w->logCb(logError, _FMT("Failed to create " << path));
+        return false;
+    }
+    bool ok = data.empty() || fwrite(&data[0], 1, data.size(), f) == data.size();
+    if ( fclose(f) != 0 || !ok ) {
+        w->logCb(logError, _FMT("Failed to write " << path));
+        return false;
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+static void     _llhls_remove_file(llhls_writer* w, const std::string& filename)
+{
+    std::string path = w->dir + filename;
+    if ( w->store != NULL ) {
+        hls_store_remove(path.c_str());
+    } else {
+        remove(path.c_str());
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void     _llhls_printf(std::string& out, const char* fmt, ...)
+{
+    char    line[1024];
+    va_list args;
+    va_start(args, fmt);
+    int     len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if ( len > 0 ) {
+        out.append(line, std::min<size_t>(len, sizeof(line)-1));
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void     _llhls_print_parts(llhls_writer* w, std::string& out, const llhls_segment& s)
+{
+    for (size_t nI=0; nI<s.parts.size(); nI++) {
+        _llhls_printf(out, "#EXT-X-PART:DURATION=%.3f,URI=\"%s\"%s\n",
+                    s.parts[nI].duration/1000.0,
+                    _llhls_part_name(w, s.msn, nI).c_str(),
+                    s.parts[nI].independent ? ",INDEPENDENT=YES" : "");
+    }
+}
+
+//-----------------------------------------------------------------------------
+static int      _llhls_write_playlist(llhls_writer* w)
+{
+    std::string out;
+
+    // target duration is a rounded maximum, and isn't supposed to change on the way
+    int64_t targetDuration = std::max<int64_t>( (w->segmentTarget + 500)/1000,
+                                                (w->maxSegmentDuration + 500)/1000 );
+    _llhls_printf(out, "#EXTM3U\n");
+    _llhls_printf(out, "#EXT-X-VERSION:6\n");
+    _llhls_printf(out, "#EXT-X-TARGETDURATION:" I64FMT "\n", targetDuration);
+    _llhls_printf(out, "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=%.3f\n", 3*w->partTarget/1000.0);
+    _llhls_printf(out, "#EXT-X-PART-INF:PART-TARGET=%.3f\n", w->partTarget/1000.0);
+    _llhls_printf(out, "#EXT-X-MEDIA-SEQUENCE:" I64FMT "\n", w->segments.empty() ? w->current.msn : w->segments.front().msn);
+    _llhls_printf(out, "#EXT-X-INDEPENDENT-SEGMENTS\n");
+    _llhls_printf(out, "#EXT-X-MAP:URI=\"%s-init.mp4\"\n", w->name.c_str());
+    for (size_t nI=0; nI<w->segments.size(); nI++) {
+        const llhls_segment& s = w->segments[nI];
+        if ( nI + kSegmentsWithParts >= w->segments.size() ) {
+            _llhls_print_parts(w, out, s);
+        }
+        _llhls_printf(out, "#EXTINF:%.3f,\n", s.duration/1000.0);
+        _llhls_printf(out, "%s\n", _llhls_segment_name(w, s.msn).c_str());
+    }
+    _llhls_print_parts(w, out, w->current);
+    if ( w->finished ) {
+        _llhls_printf(out, "#EXT-X-ENDLIST\n");
+    } else {
+        _llhls_printf(out, "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"%s\"\n",
+                    _llhls_part_name(w, w->current.msn, w->current.parts.size()).c_str());
+    }
+
+    if ( w->store != NULL ) {
+        return hls_store_put(w->store, w->path.c_str(), (const uint8_t*)out.data(), out.size());
+    }
+
+    std::string tmppath = _STR(w->path << "-" << sv_time_get_current_epoch_time() << ".tmp");
+    FILE*       file = sv_open_file(tmppath.c_str(), "w+");
+    if ( file == NULL ) {
+        w->logCb(logError, _FMT("Failed to create HLS playlist at " << tmppath));
+        return -1;
+    }
+    bool ok = fwrite(out.data(), 1, out.size(), file) == out.size();
+    if ( fclose(file) != 0 || !ok ) {
+        w->logCb(logError, _FMT("Failed to write HLS playlist at " << tmppath));
+        remove(tmppath.c_str());
+        return -1;
+    }
+
+    for (int nRetries=1; nRetries<=kMaxRenameRetries; nRetries++) {
+        if ( sv_rename_file(tmppath.c_str(), w->path.c_str()) == 0 ) {
+            return 0;
+        }
+        sv_sleep(10*nRetries);
+    }
+    w->logCb(logError, _FMT("Failed to move HLS playlist from " << tmppath << " to " << w->path));
+    remove(tmppath.c_str());
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+static void     _llhls_remove_segment(llhls_writer* w, const llhls_segment& s)
+{
+    _llhls_remove_file(w, _llhls_segment_name(w, s.msn));
+    for (size_t nI=0; nI<s.parts.size(); nI++) {
+        _llhls_remove_file(w, _llhls_part_name(w, s.msn, nI));
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void     _llhls_publish(llhls_writer* w)
+{
+    _llhls_write_playlist(w);
+
+    std::lock_guard<std::mutex> guard(w->state->mutex);
+    w->state->msn = w->current.msn;
+    w->state->parts = (int)w->current.parts.size();
+    w->state->finished = w->finished;
+    w->state->cond.notify_all();
+}
+
+//-----------------------------------------------------------------------------
+extern "C" llhls_writer*   llhls_writer_create (const char* playlistPath,
+                                                int partTargetMs,
+                                                int segmentTargetMs,
+                                                int listSize,
+                                                int64_t startIndex,
+                                                int inMemory,
+                                                fn_stream_log logCb)
+{
+    llhls_writer* w = new llhls_writer;
+    w->path = playlistPath;
+    size_t sep = w->path.find_last_of("\\/");
+    w->dir = (sep == std::string::npos) ? "" : w->path.substr(0, sep+1);
+    w->name = (sep == std::string::npos) ? w->path : w->path.substr(sep+1);
+    size_t dot = w->name.find_last_of(".");
+    if ( dot != std::string::npos ) {
+        w->name = w->name.substr(0, dot);
+    }
+    w->partTarget = partTargetMs;
+    w->segmentTarget = segmentTargetMs;
+    w->listSize = std::max(listSize, 1);
+    w->logCb = logCb;
+    w->store = inMemory ? hls_store_owner_create() : NULL;
+    w->current.msn = startIndex;
+    w->current.duration = 0;
+    w->maxSegmentDuration = 0;
+    w->partStartPts = INVALID_PTS;
+    w->segmentStartPts = INVALID_PTS;
+    w->prevPts = INVALID_PTS;
+    w->frameInterval = 0;
+    w->cutPts = INVALID_PTS;
+    w->partIndependent = false;
+    w->cutIndependent = false;
+    w->finished = false;
+    w->state = std::make_shared<llhls_state>();
+    w->state->msn = startIndex;
+    w->state->parts = 0;
+    w->state->finished = false;
+
+    uint8_t* buffer = (uint8_t*)av_malloc(kIOBufferSize);
+    w->io = buffer ? avio_alloc_context(buffer, kIOBufferSize, 1, w, NULL, _llhls_write_packet, NULL) : NULL;
+    if ( w->io == NULL ) {
+        logCb(logError, _FMT("Failed to allocate I/O for " << playlistPath));
+        av_free(buffer);
+        hls_store_owner_destroy(&w->store);
+        delete w;
+        return NULL;
+    }
+
+    std::lock_guard<std::mutex> guard(_gWritersMutex);
+    _gWriters[w->path] = w->state;
+    return w;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" AVIOContext*    llhls_writer_get_io (llhls_writer* w)
+{
+    return w->io;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      llhls_writer_end_init      (llhls_writer* w)
+{
+    avio_flush(w->io);
+    bool ok = _llhls_write_file(w, w->name + "-init.mp4", w->pending);
+    w->pending.clear();
+    return ok ? 0 : -1;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      llhls_writer_check_cut     (llhls_writer* w,
+                                                int64_t pts,
+                                                int keyframe)
+{
+    if ( w->partStartPts == INVALID_PTS ) {
+        w->partStartPts = w->segmentStartPts = w->prevPts = pts;
+        w->partIndependent = (keyframe != 0);
+        return llhlsCutNone;
+    }
+
+    if ( pts > w->prevPts ) {
+        w->frameInterval = pts - w->prevPts;
+        w->prevPts = pts;
+    }
+
+    int res = llhlsCutNone;
+    if ( keyframe && pts - w->segmentStartPts >= w->segmentTarget ) {
+        res = llhlsCutSegment;
+    } else if ( pts > w->partStartPts &&
+                pts - w->partStartPts + w->frameInterval > w->partTarget ) {
+        // one more frame would take the part over its target
+        res = llhlsCutPart;
+    }
+    if ( res != llhlsCutNone ) {
+        w->cutPts = pts;
+        w->cutIndependent = (keyframe != 0);
+    }
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      llhls_writer_end_part      (llhls_writer* w,
+                                                int cut)
+{
+    avio_flush(w->io);
+
+    llhls_part part;
+    part.duration = std::max<int64_t>(w->cutPts - w->partStartPts, 1);
+    part.independent = w->partIndependent;
+    bool ok = _llhls_write_file(w, _llhls_part_name(w, w->current.msn, w->current.parts.size()), w->pending);
+    w->segmentData.insert(w->segmentData.end(), w->pending.begin(), w->pending.end());
+    w->pending.clear();
+    w->current.parts.push_back(part);
+    w->current.duration += part.duration;
+    w->partStartPts = w->cutPts;
+    w->partIndependent = w->cutIndependent;
+
+    if ( cut == llhlsCutSegment ) {
+        ok = _llhls_write_file(w, _llhls_segment_name(w, w->current.msn), w->segmentData) && ok;
+        w->segmentData.clear();
+        w->maxSegmentDuration = std::max(w->maxSegmentDuration, w->current.duration);
+        w->segments.push_back(w->current);
+        w->current.msn++;
+        w->current.duration = 0;
+        w->current.parts.clear();
+        w->segmentStartPts = w->cutPts;
+        while ( (int)w->segments.size() > w->listSize ) {
+            _llhls_remove_segment(w, w->segments.front());
+            w->segments.pop_front();
+        }
+    }
+
+    _llhls_publish(w);
+    return ok ? 0 : -1;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      llhls_writer_finish        (llhls_writer* w)
+{
+    if ( w->finished ) {
+        return 0;
+    }
+    int res = 0;
+    avio_flush(w->io);
+    if ( !w->pending.empty() && w->partStartPts != INVALID_PTS ) {
+        w->cutPts = w->prevPts + w->frameInterval;
+        w->cutIndependent = false;
+        res = llhls_writer_end_part(w, llhlsCutSegment);
+    }
+    w->finished = true;
+    _llhls_publish(w);
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     llhls_writer_destroy       (llhls_writer** pw)
+{
+    if ( pw == NULL || *pw == NULL ) {
+        return;
+    }
+    llhls_writer* w = *pw;
+    {
+        std::lock_guard<std::mutex> guard(w->state->mutex);
+        w->state->finished = true;
+        w->state->cond.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> guard(_gWritersMutex);
+        auto it = _gWriters.find(w->path);
+        if ( it != _gWriters.end() && it->second == w->state ) {
+            _gWriters.erase(it);
+        }
+    }
+    av_freep(&w->io->buffer);
+    avio_context_free(&w->io);
+    // nobody is going to serve the files from memory anymore
+    hls_store_owner_destroy(&w->store);
+    delete w;
+    *pw = NULL;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      llhls_wait                 (const char* playlistPath,
+                                                int64_t msn,
+                                                int part,
+                                                int timeoutMs)
+{
+    std::shared_ptr<llhls_state> state;
+    {
+        std::lock_guard<std::mutex> guard(_gWritersMutex);
+        auto it = _gWriters.find(playlistPath);
+        if ( it == _gWriters.end() ) {
+            return -2;
+        }
+        state = it->second;
+    }
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    auto listed = [&]() {
+        return msn < state->msn ||
+               ( msn == state->msn && part >= 0 && part < state->parts );
+    };
+    state->cond.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&]() {
+        return state->finished || listed();
+    });
+    return listed() ? 0 : -1;
+}
@@ -0,0 +1,95 @@
+/*****************************************************************************
+ *
+ * llhls_writer.h
+ *   Low-latency HLS output: fMP4 parts, segments and their playlist.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef LLHLS_WRITER_H
+#define LLHLS_WRITER_H
+
+#include "sv_ffmpeg.h"
+#include "streamprv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct llhls_writer llhls_writer;
+
+// What llhls_writer_check_cut wants done before the next packet goes in
+enum {
+    llhlsCutNone = 0,
+    llhlsCutPart,                   // end the current part
+    llhlsCutSegment,                // end the current part, and the segment with it
+};
+
+//-----------------------------------------------------------------------------
+// Writer side, used by the recorder. The mp4 muxer is set up for custom
+// fragmentation and writes into the writer's AVIOContext; every fragment it
+// flushes becomes a part, and parts up to a keyframe make up a segment.
+// Files go next to the playlist: <name>-init.mp4, <name><msn>.m4s, and
+// <name><msn>.<part>.m4s for the parts. With inMemory, they go under the same
+// paths into the in-memory store (hls_store.h) instead, until the writer goes.
+llhls_writer*       llhls_writer_create        (const char* playlistPath,
+                                                int partTargetMs,
+                                                int segmentTargetMs,
+                                                int listSize,
+                                                int64_t startIndex,
+                                                int inMemory,
+                                                fn_stream_log logCb);
+AVIOContext*        llhls_writer_get_io        (llhls_writer* w);
+// Call after avformat_write_header; whatever the muxer wrote is the init segment
+int                 llhls_writer_end_init      (llhls_writer* w);
+// Call before writing each packet, pts in ms. If the result isn't llhlsCutNone,
+// the caller is to flush the fragment and call llhls_writer_end_part.
+int                 llhls_writer_check_cut     (llhls_writer* w,
+                                                int64_t pts,
+                                                int keyframe);
+int                 llhls_writer_end_part      (llhls_writer* w,
+                                                int cut);
+// Publishes whatever is pending as the last segment, and ends the playlist.
+// Anything written into the io afterwards (e.g. the trailer) is dropped.
+int                 llhls_writer_finish        (llhls_writer* w);
+void                llhls_writer_destroy       (llhls_writer** w);
+
+//-----------------------------------------------------------------------------
+// Blocking playlist reload: waits until the playlist at playlistPath lists part
+// `part` of segment `msn` (or all of the segment, if part is negative).
+// Returns 0 once it does, -1 on timeout, -2 if nothing is writing that playlist.
+int                 llhls_wait                 (const char* playlistPath,
+                                                int64_t msn,
+                                                int part,
+                                                int timeoutMs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,83 @@
+/*****************************************************************************
+ *
+ * packet_ring.h
+ *   Per-camera ring of recent compressed packets, shared by its consumers.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef PACKET_RING_H
+#define PACKET_RING_H
+
+#include "streamprv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct packet_ring packet_ring;
+typedef struct packet_ring_cursor packet_ring_cursor;
+
+//-----------------------------------------------------------------------------
+// The ring keeps copies of the packets in one contiguous block of budgetBytes.
+// It always starts at a video keyframe: when it runs out of space, the oldest
+// GOP goes as a whole. It's filled by the "packetRing" node, which hands it out
+// through its "ring" param; consumers take their own reference.
+packet_ring*        packet_ring_create         (size_t budgetBytes,
+                                                fn_stream_log logCb);
+void                packet_ring_ref            (packet_ring* ring);
+void                packet_ring_unref          (packet_ring** ring);
+// Copies the packet in. Returns -1 if it can't be stored (e.g. larger than
+// half the budget, or video data before the first keyframe).
+int                 packet_ring_append         (packet_ring* ring,
+                                                frame_obj* frame);
+// pts of the newest packet; INVALID_PTS if there is none
+INT64_T             packet_ring_get_last_pts   (packet_ring* ring);
+void                packet_ring_get_stats      (packet_ring* ring,
+                                                size_t* bytes,
+                                                size_t* packets,
+                                                INT64_T* firstPts,
+                                                INT64_T* lastPts);
+
+//-----------------------------------------------------------------------------
+// Cursors start at the last keyframe at or before pts (or at the oldest one, if
+// pts is older than anything in the ring), and advance on each read. A cursor
+// that falls behind the eviction skips ahead to the oldest keyframe.
+packet_ring_cursor* packet_ring_cursor_create  (packet_ring* ring,
+                                                INT64_T pts);
+// Returns 0 and a new frame holding a copy of the packet; -1 if the cursor had
+// caught up with the ring.
+int                 packet_ring_cursor_read    (packet_ring_cursor* cursor,
+                                                frame_obj** frame);
+void                packet_ring_cursor_destroy (packet_ring_cursor** cursor);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
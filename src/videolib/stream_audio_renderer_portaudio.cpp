@@ -45,6 +45,8 @@
 
 
 #include <list>
+#include <atomic>
+#include <algorithm>
 
 
 #define AU_DEMUX_MAGIC 0x1533
@@ -54,7 +56,24 @@
 static int gInitialized = 0;
 static const int gPrebuffer = 2;
 static bool gFailedInitialization = false;
+// callback mode: how much audio the ring holds, and how much of it is
+// buffered before playback (re)starts
+static const int kAuRingMs = 1000;
+static const int kAuPrebufferMs = 100;
 
+//-----------------------------------------------------------------------------
+// Single-producer/single-consumer byte ring between the graph thread, which
+// queues the samples, and the PortAudio callback, which plays them out.
+// The callback never takes a lock; it only advances head.
+typedef struct au_ring {
+    uint8_t*                data;
+    size_t                  capacity;
+    size_t                  mask;
+    // next byte to be played; only advanced by the callback
+    std::atomic<size_t>     head;
+    // next byte to be written; only advanced by the producer
+    std::atomic<size_t>     tail;
+} au_ring_t;
 
 typedef struct au_stream  : public stream_base  {
     std::list<frame_obj*>*   bufferQueue;
@@ -68,6 +87,18 @@ typedef struct au_stream  : public stream_base  {
     int         initializationPending;
     int         muted;
 
+    // callback mode: PortAudio pulls the samples from the ring, rather than
+    // a thread of ours blocking in Pa_WriteStream
+    int         callbackMode;
+    au_ring_t*  ring;
+    int         callbackStarted;
+    std::atomic<int64_t> underruns;
+    int64_t     overruns;
+    // for the A/V drift estimate
+    INT64_T     lastAudioPts;       // end of the last queued audio frame
+    INT64_T     lastVideoPts;
+    int         outputLatencyMs;
+
     sv_mutex*   mutex;
     sv_event*   event;
     sv_thread*  thread;
@@ -84,6 +115,10 @@ static stream_obj* au_stream_create             (const char* name);
 static int         au_stream_set_param          (stream_obj* stream,
                                                 const CHAR_T* name,
                                                 const void* value);
+static int         au_stream_get_param          (stream_obj* stream,
+                                                const CHAR_T* name,
+                                                void* value,
+                                                size_t* size);
 static int         au_stream_open_in            (stream_obj* stream);
 static int         au_stream_seek               (stream_obj* stream,
                                                 INT64_T offset,
@@ -93,6 +128,7 @@ static int         au_stream_close              (stream_obj* stream);
 static void        au_stream_destroy            (stream_obj* stream);
 
 static void       _au_flush_queue               (au_stream_obj* aur);
+static void       _au_callback_stop             (au_stream_obj* aur);
 
 //-----------------------------------------------------------------------------
 static stream_api_t _g_aup_stream_provider = {
@@ -104,7 +140,7 @@ static stream_api_t _g_aup_stream_provider = {
     get_default_stream_api()->remove_element,
     get_default_stream_api()->insert_element,
     au_stream_set_param,
-    get_default_stream_api()->get_param,
+    au_stream_get_param,
     au_stream_open_in,
     au_stream_seek,
     get_default_stream_api()->get_width,
@@ -171,6 +207,15 @@ static stream_obj*   au_stream_create                (const char* name)
     res->initializationPending = 0;
     res->muted = 0;
 
+    res->callbackMode = 0;
+    res->ring = NULL;
+    res->callbackStarted = 0;
+    res->underruns = 0;
+    res->overruns = 0;
+    res->lastAudioPts = INVALID_PTS;
+    res->lastVideoPts = INVALID_PTS;
+    res->outputLatencyMs = 0;
+
     return (stream_obj*)res;
 }
 
@@ -187,15 +232,195 @@ static int         au_stream_set_param             (stream_obj* stream,
         int muted = *(int*)value;
         if ( muted && (aur->muted ^ muted) ) {
             _au_flush_queue(aur);
+            _au_callback_stop(aur);
             aur->buffersPlayed = 0;
+            // the playback thread stops the device, rather than having it play silence
+            sv_event_set(aur->event);
         }
         aur->muted = muted;
         sv_mutex_exit(aur->mutex);
         return 0;
     }
+    SET_PARAM_IF(stream, name, "callbackMode", int, aur->callbackMode);
     return default_set_param(stream, name, value);
 }
 
+//-----------------------------------------------------------------------------
+static int         _au_bytes_per_second      (au_stream_obj* aur)
+{
+    return aur->sampleRate*aur->sampleSize*aur->channels;
+}
+
+//-----------------------------------------------------------------------------
+// How far the audio being heard trails the video last passed on: positive
+// values mean the audio is late
+static int         _au_drift_ms              (au_stream_obj* aur)
+{
+    if ( aur->lastAudioPts == INVALID_PTS ||
+         aur->lastVideoPts == INVALID_PTS ||
+         aur->sampleRate <= 0 ) {
+        return 0;
+    }
+    size_t queued = aur->ring ? aur->ring->tail.load(std::memory_order_acquire) -
+                                aur->ring->head.load(std::memory_order_acquire)
+                              : aur->bytesAvailable;
+    INT64_T playingPts = aur->lastAudioPts -
+                         (INT64_T)queued*1000/_au_bytes_per_second(aur) -
+                         aur->outputLatencyMs;
+    return (int)(aur->lastVideoPts - playingPts);
+}
+
+//-----------------------------------------------------------------------------
+static int         au_stream_get_param             (stream_obj* stream,
+                                            const CHAR_T* name,
+                                            void* value,
+                                            size_t* size)
+{
+    DECLARE_STREAM_AU(stream, aur);
+
+    name = stream_param_name_apply_scope(stream, name);
+
+    COPY_PARAM_IF(aur, name, "underruns", INT64_T, aur->underruns.load());
+    COPY_PARAM_IF_SAFE(aur, name, "overruns", INT64_T, aur->overruns, aur->mutex);
+    COPY_PARAM_IF_SAFE(aur, name, "driftMs", int, _au_drift_ms(aur), aur->mutex);
+
+    return default_get_param(stream, name, value, size);
+}
+
+//-----------------------------------------------------------------------------
+static au_ring_t*  _au_ring_create           (size_t desired)
+{
+    size_t capacity = 4096;
+    while ( capacity < desired ) {
+        capacity <<= 1;
+    }
+
+    au_ring_t* ring = new au_ring_t;
+    ring->data = (uint8_t*)malloc(capacity);
+    ring->capacity = capacity;
+    ring->mask = capacity - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    return ring;
+}
+
+//-----------------------------------------------------------------------------
+static void        _au_ring_destroy          (au_ring_t** pRing)
+{
+    if ( pRing && *pRing ) {
+        free((*pRing)->data);
+        delete *pRing;
+        *pRing = NULL;
+    }
+}
+
+//-----------------------------------------------------------------------------
+static size_t      _au_ring_size             (au_ring_t* ring)
+{
+    return ring->tail.load(std::memory_order_acquire) -
+           ring->head.load(std::memory_order_acquire);
+}
+
+//-----------------------------------------------------------------------------
+// Producer side only; all or nothing
+static bool        _au_ring_write            (au_ring_t* ring,
+                                              const uint8_t* data,
+                                              size_t size)
+{
+    size_t tail = ring->tail.load(std::memory_order_relaxed);
+    if ( ring->capacity - (tail - ring->head.load(std::memory_order_acquire)) < size ) {
+        return false;
+    }
+    size_t offset = tail & ring->mask;
+    size_t first = std::min(size, ring->capacity - offset);
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, data + first, size - first);
+    ring->tail.store(tail + size, std::memory_order_release);
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Consumer side only; returns the number of bytes read
+static size_t      _au_ring_read             (au_ring_t* ring,
+                                              uint8_t* data,
+                                              size_t size)
+{
+    size_t head = ring->head.load(std::memory_order_relaxed);
+    size_t available = ring->tail.load(std::memory_order_acquire) - head;
+    size = std::min(size, available);
+    size_t offset = head & ring->mask;
+    size_t first = std::min(size, ring->capacity - offset);
+    memcpy(data, ring->data + offset, first);
+    memcpy(data + first, ring->data, size - first);
+    ring->head.store(head + size, std::memory_order_release);
+    return size;
+}
+
+//-----------------------------------------------------------------------------
+// Runs on PortAudio's thread: must not block
+static int        _au_callback_func          (const void* input,
+                                              void* output,
+                                              unsigned long frameCount,
+                                              const PaStreamCallbackTimeInfo* timeInfo,
+                                              PaStreamCallbackFlags statusFlags,
+                                              void* userData)
+{
+    au_stream_obj*  aur = (au_stream_obj*)userData;
+    size_t          wanted = frameCount*aur->sampleSize*aur->channels;
+    size_t          got = _au_ring_read(aur->ring, (uint8_t*)output, wanted);
+    if ( got < wanted ) {
+        // play silence for whatever hasn't arrived in time
+        memset((uint8_t*)output + got, 0, wanted - got);
+        aur->underruns++;
+    }
+    return paContinue;
+}
+
+//-----------------------------------------------------------------------------
+// Queues the samples for the callback, starting the playback once enough
+// had been buffered. Called with the mutex held.
+static void       _au_callback_queue         (au_stream_obj* aur,
+                                              frame_obj* frame)
+{
+    frame_api_t* api = frame_get_api(frame);
+    size_t       size = api->get_data_size(frame);
+
+    if ( !_au_ring_write(aur->ring, (const uint8_t*)api->get_data(frame), size) ) {
+        // the device isn't keeping up (or isn't playing) -- drop the frame
+        aur->overruns++;
+        TRACE(_FMT("Audio ring is full, dropping " << size << " bytes"));
+        return;
+    }
+    aur->lastAudioPts = api->get_pts(frame) + (INT64_T)size*1000/_au_bytes_per_second(aur);
+
+    if ( !aur->callbackStarted &&
+         _au_ring_size(aur->ring) >= (size_t)_au_bytes_per_second(aur)*kAuPrebufferMs/1000 ) {
+        TRACE(_FMT("Starting audio playback"));
+        PaError err = Pa_StartStream( aur->pa_stream );
+        if ( err != paNoError ) {
+            aur->logCb(logError, _FMT("Error starting audio stream: " << Pa_GetErrorText(err)));
+            return;
+        }
+        aur->callbackStarted = 1;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Stops the playback and drops whatever is queued. Called with the mutex held.
+static void       _au_callback_stop          (au_stream_obj* aur)
+{
+    if ( aur->ring == NULL ) {
+        return;
+    }
+    if ( aur->callbackStarted ) {
+        TRACE(_FMT("Stopping audio playback"));
+        Pa_AbortStream( aur->pa_stream );
+        aur->callbackStarted = 0;
+    }
+    // the callback isn't running, so it's safe to move head from here
+    aur->ring->head.store(aur->ring->tail.load());
+}
+
 //-----------------------------------------------------------------------------
 static void*      _au_thread_func               (void* param)
 {
@@ -268,6 +493,9 @@ static void*      _au_thread_func               (void* param)
             if ( err != paNoError ) {
                 aur->logCb((err==paOutputUnderflow?logDebug:logError),
                             _FMT("Error writing samples: " << Pa_GetErrorText(err)));
+                if ( err == paOutputUnderflow ) {
+                    aur->underruns++;
+                }
             }
             wroteSinceStart += numSamples;
             timeInWrite += opTimer.stop();
@@ -363,8 +591,8 @@ static int         _au_attempt_init                 (au_stream_obj* aur,
                 sampleRate,
                 paFramesPerBufferUnspecified,
                 paClipOff,      /* we won't output out of range samples so don't bother clipping them */
-                NULL,
-                NULL );
+                aur->callbackMode ? _au_callback_func : NULL,
+                aur->callbackMode ? aur : NULL );
     if ( paError != paNoError ) {
         err << "Failed to create audio device for sample rate " << sampleRate << " sampleFormat=" << sampleFormat << " channels=" << channels << " err=" << paError;
         goto UnrecoverableError;
@@ -375,14 +603,24 @@ static int         _au_attempt_init                 (au_stream_obj* aur,
     aur->sampleSize = sampleSize;
     aur->initializationPending = 0;
     aur->channels = channels;
-    aur->thread = sv_thread_create(_au_thread_func, aur);
-    if (!aur->thread) {
-        err << "Error creating audio playback thread";
-        goto UnrecoverableError;
+    {
+        const PaStreamInfo* info = Pa_GetStreamInfo( aur->pa_stream );
+        aur->outputLatencyMs = info ? (int)(info->outputLatency*1000) : 0;
+    }
+    if ( aur->callbackMode ) {
+        aur->threadRunning = 0;
+        aur->ring = _au_ring_create((size_t)_au_bytes_per_second(aur)*kAuRingMs/1000);
+    } else {
+        aur->thread = sv_thread_create(_au_thread_func, aur);
+        if (!aur->thread) {
+            err << "Error creating audio playback thread";
+            goto UnrecoverableError;
+        }
     }
 
     aur->passthrough = 0;
-    TRACE(_FMT("Initialization completed: sampleRate="<<sampleRate<<" sampleSize="<<sampleSize<< " channels=" << channels));
+    TRACE(_FMT("Initialization completed: sampleRate="<<sampleRate<<" sampleSize="<<sampleSize<< " channels=" << channels <<
+                " callbackMode=" << aur->callbackMode << " latency=" << aur->outputLatencyMs << "ms"));
     return 0;
 
 UnrecoverableError:
@@ -442,7 +680,10 @@ static int         au_stream_seek               (stream_obj* stream,
     int res;
     sv_mutex_enter(aur->mutex);
     _au_flush_queue(aur);
+    _au_callback_stop(aur);
     aur->buffersPlayed = 0;
+    aur->lastAudioPts = INVALID_PTS;
+    aur->lastVideoPts = INVALID_PTS;
     res = default_seek(stream, offset, flags);
     sv_mutex_exit(aur->mutex);
 
@@ -461,6 +702,9 @@ static int         au_stream_read_frame         (stream_obj* stream, frame_obj**
     }
 
     frame_api_t* tmpFrameAPI = frame_get_api(*frame);
+    if ( tmpFrameAPI->get_media_type(*frame) == mediaVideo ) {
+        aur->lastVideoPts = tmpFrameAPI->get_pts(*frame);
+    } else
     if ( tmpFrameAPI->get_media_type(*frame) == mediaAudio ) {
         if ( aur->initializationPending ) {
             _au_attempt_init(aur, true);
@@ -473,7 +717,10 @@ static int         au_stream_read_frame         (stream_obj* stream, frame_obj**
 
 
         sv_mutex_enter(aur->mutex);
-        if ( !aur->muted ) {
+        if ( !aur->muted && aur->ring != NULL ) {
+            _au_callback_queue(aur, *frame);
+        } else if ( !aur->muted ) {
+            aur->lastAudioPts = tmpFrameAPI->get_pts(*frame) + (INT64_T)size*1000/_au_bytes_per_second(aur);
             frame_ref(*frame);
             aur->bufferQueue->push_back(*frame);
             aur->bytesAvailable += frame_get_api(*frame)->get_data_size(*frame);
@@ -520,7 +767,13 @@ static int         au_stream_close              (stream_obj* stream)
         // Pa_AbortStream( aur->pa_stream );
     }
     sv_event_set(aur->event);
-    sv_thread_destroy(&aur->thread);
+    if ( aur->thread != NULL ) {
+        sv_thread_destroy(&aur->thread);
+    }
+
+    sv_mutex_enter(aur->mutex);
+    _au_callback_stop(aur);
+    sv_mutex_exit(aur->mutex);
 
     if ( aur->bufferQueue ) {
         _au_flush_queue( aur );
@@ -536,6 +789,7 @@ static int         au_stream_close              (stream_obj* stream)
         }
     }
 
+    _au_ring_destroy(&aur->ring);
     sv_event_destroy(&aur->event);
     sv_mutex_destroy(&aur->mutex);
     return 0;
@@ -37,14 +37,25 @@
 #include "sv_module_def.hpp"
 
 #include "streamprv.h"
+#include "sv_internal.h"
 #include "sv_ffmpeg.h"
 
 #include "videolibUtils.h"
 #include "frame_basic.h"
+#include "frame_trace.h"
+#include "frame_avbuffer.h"
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <map>
 #include <mutex>
+#include <thread>
 #include <vector>
 #include <memory>
 
@@ -52,8 +63,19 @@
 #define MAX_PARAM 10
 #define FORCE_INTERLEAVED_AUDIO 1
 static const int kMaxPacketsWithNoFrames = 120;
+// Surfaces added to the decoder's pool when frames are handed downstream
+// without a download, and may sit in queues for a while
+static const int kDefaultHwExtraFrames = 32;
+// Decoded frames are held downstream (thread connector queues, encoders) for
+// a while, so the pool keeps more than the default, and holds on to them
+// through a longer stall before freeing what it has too many of
+static const int kDefaultPoolFrames = 8;
+static const int kPoolReductionTimeMs = 5000;
 
 typedef struct ffdec_stream ffdec_stream_obj;
+
+extern "C" int videolibapi_is_reference_frame(uint8_t* data, size_t size, fn_stream_log logCb);
+
 typedef int
 (*export_frame)                          (ffdec_stream_obj* decoder, AVFrame* f, frame_obj* svf);
 
@@ -114,32 +136,194 @@ typedef struct DeviceEntry {
 } DeviceEntry;
 
 //-----------------------------------------------------------------------------
-typedef struct DeviceEntryComparator
-{
-    bool operator() (const DeviceEntry& d1, const DeviceEntry& d2) const
-    {
-        return (d1.priority < d2.priority || d1.name < d2.name);
-    }
-} DeviceEntryComparator;
-
+// Hardware devices are probed lazily: opening a device context may take
+// hundreds of milliseconds (loading drivers, or timing out), and used to delay
+// the first frame of the first camera. The device wanted first -- the one set
+// with videolib_set_hw_device, or the first one by priority -- is probed by
+// whoever needs it, and the rest are probed in parallel on background threads
+// at that time. Outcomes are saved to SV_HW_PROBE_CACHE (in the temp directory
+// by default), and devices which failed to open aren't probed again until
+// kHwProbeCacheMaxAgeSec passed, or the ffmpeg build changed.
 //-----------------------------------------------------------------------------
-typedef std::map<DeviceEntry, std::shared_ptr<AVBufferRef>, DeviceEntryComparator> DevicesDict;
+enum {
+    hwProbePending,
+    hwProbeRunning,
+    hwProbeDone,
+};
+
+typedef struct HwDeviceProbe {
+    DeviceEntry                     entry;
+    int                             state;
+    bool                            cached;     // failure is known from a previous run
+    INT64_T                         probedAt;   // seconds since epoch
+    std::shared_ptr<AVBufferRef>    ctx;        // set if the device could be opened
+} HwDeviceProbe;
+
+static const INT64_T kHwProbeCacheMaxAgeSec = 7*24*3600;
+
 std::once_flag kStaticInitFlag;
-static DevicesDict g_hwDevices;
+// by priority; never resized after ffmpeg_init_hw
+static std::vector<HwDeviceProbe> g_hwProbes;
+static std::mutex g_hwMutex;
+static std::condition_variable g_hwCond;
+static bool g_hwBackgroundStarted = false;
 static std::string g_preferredDevice;
 static void ffmpeg_init_hw();
 
+//-----------------------------------------------------------------------------
+static std::string _ffmpeg_hw_cache_path()
+{
+    char   buf[1024];
+    size_t size = sizeof(buf)-1;
+    if ( sv_get_env_var("SV_HW_PROBE_CACHE", buf, &size) == 0 ) {
+        return buf;
+    }
+    const char* dir = getenv("TMPDIR");
+    if ( dir == NULL ) dir = getenv("TEMP");
+    if ( dir == NULL ) dir = "/tmp";
+    return std::string(dir) + "/sv_hw_probe.cache";
+}
 
-extern "C" int videolib_get_hw_devices(const char** ptrStr, int nSize)
+//-----------------------------------------------------------------------------
+// "version <avutil version>" followed by "<device> <0|1> <probed at>" lines
+static void _ffmpeg_hw_load_cache()
+{
+    FILE* f = fopen(_ffmpeg_hw_cache_path().c_str(), "r");
+    if ( f == NULL ) {
+        return;
+    }
+    unsigned int version = 0;
+    if ( fscanf(f, "version %u\n", &version) == 1 && version == LIBAVUTIL_VERSION_INT ) {
+        char      name[64];
+        int       ok;
+        long long probedAt;
+        INT64_T   now = sv_time_get_current_epoch_time()/1000;
+        while ( fscanf(f, "%63s %d %lld\n", name, &ok, &probedAt) == 3 ) {
+            if ( ok || now - probedAt > kHwProbeCacheMaxAgeSec ) {
+                continue;
+            }
+            for (auto& probe: g_hwProbes) {
+                if ( probe.entry.name == name ) {
+                    probe.state = hwProbeDone;
+                    probe.cached = true;
+                    probe.probedAt = probedAt;
+                }
+            }
+        }
+    }
+    fclose(f);
+}
+
+//-----------------------------------------------------------------------------
+// Must be called with g_hwMutex held
+static void _ffmpeg_hw_save_cache()
+{
+    FILE* f = fopen(_ffmpeg_hw_cache_path().c_str(), "w");
+    if ( f == NULL ) {
+        return;
+    }
+    fprintf(f, "version %u\n", (unsigned int)LIBAVUTIL_VERSION_INT);
+    for (const auto& probe: g_hwProbes) {
+        if ( probe.state == hwProbeDone ) {
+            fprintf(f, "%s %d %lld\n", probe.entry.name.c_str(), probe.ctx ? 1 : 0,
+                        (long long)probe.probedAt);
+        }
+    }
+    fclose(f);
+}
+
+//-----------------------------------------------------------------------------
+// Called by whoever moved the probe to hwProbeRunning
+static void _ffmpeg_hw_probe(HwDeviceProbe* probe)
+{
+    AVBufferRef *hw_device_ctx = nullptr;
+    enum AVHWDeviceType type = av_hwdevice_find_type_by_name(probe->entry.name.c_str());
+    if ( av_hwdevice_ctx_create(&hw_device_ctx, type, NULL, NULL, 0) != 0 ) {
+        hw_device_ctx = nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(g_hwMutex);
+    if ( hw_device_ctx != nullptr ) {
+        probe->ctx.reset(hw_device_ctx, [](AVBufferRef* p){av_buffer_unref(&p);});
+    }
+    probe->probedAt = sv_time_get_current_epoch_time()/1000;
+    probe->state = hwProbeDone;
+    _ffmpeg_hw_save_cache();
+    g_hwCond.notify_all();
+}
+
+//-----------------------------------------------------------------------------
+// Starts probing everything but the device at index 'except' in the background
+static void _ffmpeg_hw_start_background(size_t except)
+{
+    std::lock_guard<std::mutex> lock(g_hwMutex);
+    if ( g_hwBackgroundStarted ) {
+        return;
+    }
+    g_hwBackgroundStarted = true;
+    for (size_t nI=0; nI<g_hwProbes.size(); nI++) {
+        HwDeviceProbe* probe = &g_hwProbes[nI];
+        if ( nI == except || probe->state != hwProbePending ) {
+            continue;
+        }
+        probe->state = hwProbeRunning;
+        std::thread([probe]() {
+            sv_thread_set_name(("hwprobe:" + probe->entry.name).c_str());
+            _ffmpeg_hw_probe(probe);
+        }).detach();
+    }
+}
+
+//-----------------------------------------------------------------------------
+static size_t _ffmpeg_hw_count()
 {
     std::call_once( kStaticInitFlag, ffmpeg_init_hw );
+    return g_hwProbes.size();
+}
+
+//-----------------------------------------------------------------------------
+// Index of the device by name, or -1
+static int _ffmpeg_hw_find(const std::string& name)
+{
+    for (size_t nI=0; nI<_ffmpeg_hw_count(); nI++) {
+        if ( g_hwProbes[nI].entry.name == name ) {
+            return (int)nI;
+        }
+    }
+    return -1;
+}
 
+//-----------------------------------------------------------------------------
+// Device context at index, probing it first if needed; NULL if it can't be opened
+static AVBufferRef* _ffmpeg_hw_get(size_t index)
+{
+    if ( index >= _ffmpeg_hw_count() ) {
+        return NULL;
+    }
+    _ffmpeg_hw_start_background(index);
+
+    HwDeviceProbe*               probe = &g_hwProbes[index];
+    std::unique_lock<std::mutex> lock(g_hwMutex);
+    if ( probe->state == hwProbePending ) {
+        probe->state = hwProbeRunning;
+        lock.unlock();
+        _ffmpeg_hw_probe(probe);
+        lock.lock();
+    }
+    g_hwCond.wait(lock, [&] { return probe->state == hwProbeDone; });
+    return probe->ctx.get();
+}
+
+
+extern "C" int videolib_get_hw_devices(const char** ptrStr, int nSize)
+{
+    // listing them takes every probe to complete
     int nCount = 0;
-    DevicesDict::iterator it = g_hwDevices.begin();
-    for (int nI=0; nI<nSize-1 && it!=g_hwDevices.end(); nI++ ) {
-        ptrStr[nCount] = it->first.name.c_str();
-        nCount++;
-        it++;
+    for (size_t nI=0; nCount<nSize-1 && nI<_ffmpeg_hw_count(); nI++ ) {
+        if ( _ffmpeg_hw_get(nI) != NULL ) {
+            ptrStr[nCount] = g_hwProbes[nI].entry.name.c_str();
+            nCount++;
+        }
     }
     ptrStr[nCount] = NULL;
     return nCount;
@@ -149,22 +333,161 @@ extern "C" int videolib_set_hw_device(const char* dev)
 {
     g_preferredDevice = "";
     if ( dev ) {
-        int found = 0;
         if ( !_stricmp(dev, "none") ) {
             g_preferredDevice = dev;
             return 0;
         }
-        for (auto& entry: g_hwDevices) {
-            if ( entry.first.name == dev ) {
-                g_preferredDevice = dev;
-                return 0;
-            }
+        int index = _ffmpeg_hw_find(dev);
+        if ( index >= 0 && _ffmpeg_hw_get(index) != NULL ) {
+            g_preferredDevice = dev;
+            return 0;
         }
         return -1;
     }
     return 0;
 }
 
+//-----------------------------------------------------------------------------
+// Device contexts decoders use, in the order they'd try them, for the encoders
+// to open on: frames decoded on a device can then be encoded without leaving it.
+// The device stays owned by the list; NULL past its end.
+extern "C" AVBufferRef* videolib_get_hw_device_ctx(int index, const char** name)
+{
+    if ( g_preferredDevice == "none" ) {
+        return NULL;
+    }
+    for (size_t nI=0; nI<_ffmpeg_hw_count(); nI++) {
+        const std::string& devName = g_hwProbes[nI].entry.name;
+        if ( !g_preferredDevice.empty() && devName != g_preferredDevice ) {
+            continue;
+        }
+        AVBufferRef* ctx = _ffmpeg_hw_get(nI);
+        if ( ctx == NULL ) {
+            continue;
+        }
+        if ( index-- == 0 ) {
+            if ( name ) {
+                *name = devName.c_str();
+            }
+            return ctx;
+        }
+    }
+    return NULL;
+}
+
+
+//-----------------------------------------------------------------------------
+// Process-wide decode thread budget.
+// FFmpeg owns the worker threads of each codec context, so contexts can't be
+// run on a shared pool. Instead, software decoders register here: live decoders
+// (single threaded, to avoid frame-threading latency) and decoders with an
+// explicit thread count are charged their fixed cost, and the remainder of the
+// budget is split between the rest proportionally to their priority. A codec
+// context can't change its thread count once open, so a joining decoder gets
+// its share only out of the threads nobody holds yet; others are not taken
+// back until their decoders leave. Total decoder threads are thus bounded by
+// the budget, except that each decoder runs at least one (and live, or
+// explicitly sized, ones what they asked for).
+//-----------------------------------------------------------------------------
+enum {
+    decodePriorityBackground  = 0,   // export, indexing
+    decodePriorityNormal      = 1,   // analytics
+    decodePriorityInteractive = 2,   // someone is watching
+};
+
+typedef struct DecodeSchedulerEntry {
+    int         weight;
+    int         fixedThreads;   // 0, if thread count is assigned by the scheduler
+    int         live;
+    int         threads;        // held, whether fixed or assigned
+} DecodeSchedulerEntry;
+
+typedef struct DecodeScheduler {
+    std::mutex                                      mutex;
+    std::map<const void*, DecodeSchedulerEntry>     members;
+    int                                             threadBudget;
+
+    DecodeScheduler() : threadBudget(0) {}
+} DecodeScheduler;
+
+static DecodeScheduler g_decodeScheduler;
+
+//-----------------------------------------------------------------------------
+static int _ffdec_scheduler_join        (const void* decoder, int priority, int fixedThreads, int live)
+{
+    std::lock_guard<std::mutex> lock(g_decodeScheduler.mutex);
+
+    if ( g_decodeScheduler.threadBudget <= 0 ) {
+        g_decodeScheduler.threadBudget = sv_get_int_env_var("SIO_DECODER_THREAD_BUDGET",
+                                                            sv_get_cpu_count());
+    }
+
+    DecodeSchedulerEntry entry;
+    entry.weight = 1 + std::max((int)decodePriorityBackground,
+                                std::min(priority, (int)decodePriorityInteractive));
+    entry.fixedThreads = fixedThreads;
+    entry.live = live;
+    entry.threads = fixedThreads;
+
+    if ( fixedThreads <= 0 ) {
+        int reserved = 0;
+        int held = 0;
+        int totalWeight = entry.weight;
+        for ( const auto& it: g_decodeScheduler.members ) {
+            if ( it.first == decoder ) {
+                continue;
+            }
+            held += it.second.threads;
+            if ( it.second.fixedThreads > 0 ) {
+                reserved += it.second.fixedThreads;
+            } else {
+                totalWeight += it.second.weight;
+            }
+        }
+        int available = g_decodeScheduler.threadBudget - reserved;
+        int share = available * entry.weight / totalWeight;
+        int unheld = g_decodeScheduler.threadBudget - held;
+        entry.threads = std::max(1, std::min(share, unheld));
+    }
+
+    g_decodeScheduler.members[decoder] = entry;
+    return entry.threads;
+}
+
+//-----------------------------------------------------------------------------
+static void _ffdec_scheduler_leave       (const void* decoder)
+{
+    std::lock_guard<std::mutex> lock(g_decodeScheduler.mutex);
+    g_decodeScheduler.members.erase(decoder);
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int videolib_get_decoder_thread_usage(int* activeDecoders, int* threadBudget)
+{
+    std::lock_guard<std::mutex> lock(g_decodeScheduler.mutex);
+    if ( activeDecoders ) {
+        *activeDecoders = (int)g_decodeScheduler.members.size();
+    }
+    if ( threadBudget ) {
+        *threadBudget = g_decodeScheduler.threadBudget;
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Threads of the live decoders, which exports leave alone (export_scheduler.cpp)
+extern "C" int videolib_get_live_decoder_threads()
+{
+    std::lock_guard<std::mutex> lock(g_decodeScheduler.mutex);
+    int threads = 0;
+    for ( const auto& it: g_decodeScheduler.members ) {
+        if ( it.second.live ) {
+            threads += it.second.threads;
+        }
+    }
+    return threads;
+}
+
 
 static void ffmpeg_init_hw()
 {
@@ -197,14 +520,181 @@ static void ffmpeg_init_hw()
                                             };
     ffmpeg_init();
 
+    // probing is left to _ffmpeg_hw_get
     for ( const auto& dev: allDevices ) {
-        AVBufferRef *hw_device_ctx = nullptr;
-        enum AVHWDeviceType type = av_hwdevice_find_type_by_name(dev.name.c_str());
-        if ( av_hwdevice_ctx_create(&hw_device_ctx, type, NULL, NULL, 0) == 0 && hw_device_ctx != nullptr ) {
-            std::shared_ptr<AVBufferRef> ptr(hw_device_ctx, [](AVBufferRef* p){av_buffer_unref(&p);});
-            g_hwDevices[dev] = ptr;
+        HwDeviceProbe probe;
+        probe.entry = dev;
+        probe.state = hwProbePending;
+        probe.cached = false;
+        probe.probedAt = 0;
+        g_hwProbes.push_back(probe);
+    }
+    std::stable_sort(g_hwProbes.begin(), g_hwProbes.end(),
+                     [](const HwDeviceProbe& p1, const HwDeviceProbe& p2) {
+                        return p1.entry.priority < p2.entry.priority;
+                     });
+    _ffmpeg_hw_load_cache();
+}
+
+
+//-----------------------------------------------------------------------------
+// Picture buffers
+//-----------------------------------------------------------------------------
+// Software decoders (and pictures downloaded from the device) take their
+// buffers from a pool of the decoder's, instead of libavcodec's allocator; a
+// buffer goes back to the pool as soon as the last frame referencing it is
+// unref'ed downstream. Each buffer holds all the planes of one picture, and
+// only buffers of the size the stream's pictures currently take are kept. The
+// pool outlives the decoder, for as long as frames do.
+//-----------------------------------------------------------------------------
+static const int    kPoolAlign = 64;            // of planes and lines
+static const size_t kMaxFreePoolBuffers = 16;
+// buffers outstanding at once that get a warning, and again each time it doubles
+static const int    kPoolWarnBuffers = 64;
+
+typedef struct ffdec_buffer_pool {
+    std::mutex              mutex;
+    std::vector<uint8_t*>   free;
+    size_t                  bufferSize;
+    int                     outstanding;    // held by the codec, or downstream
+    int                     maxOutstanding;
+    int                     warnAt;
+    bool                    closed;         // decoder is gone
+} ffdec_buffer_pool;
+
+enum {
+    bpsOutstanding,
+    bpsFree,
+    bpsMaxOutstanding
+};
+
+//-----------------------------------------------------------------------------
+static ffdec_buffer_pool* _ffdec_pool_create     ()
+{
+    ffdec_buffer_pool* pool = new ffdec_buffer_pool;
+    pool->bufferSize = 0;
+    pool->outstanding = 0;
+    pool->maxOutstanding = 0;
+    pool->warnAt = kPoolWarnBuffers;
+    pool->closed = false;
+    return pool;
+}
+
+//-----------------------------------------------------------------------------
+// Must be called with the lock held
+static void      _ffdec_pool_flush           (ffdec_buffer_pool* pool)
+{
+    for (size_t nI=0; nI<pool->free.size(); nI++) {
+        av_free(pool->free[nI]);
+    }
+    pool->free.clear();
+}
+
+//-----------------------------------------------------------------------------
+static void      _ffdec_pool_close           (ffdec_buffer_pool** pPool)
+{
+    ffdec_buffer_pool* pool = *pPool;
+    if ( pool == NULL ) {
+        return;
+    }
+    bool last;
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        _ffdec_pool_flush(pool);
+        pool->closed = true;
+        last = pool->outstanding == 0;
+    }
+    if ( last ) {
+        delete pool;
+    }
+    *pPool = NULL;
+}
+
+//-----------------------------------------------------------------------------
+static int       _ffdec_pool_stat            (ffdec_buffer_pool* pool, int stat)
+{
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    switch (stat) {
+    case bpsOutstanding:    return pool->outstanding;
+    case bpsFree:           return (int)pool->free.size();
+    case bpsMaxOutstanding: return pool->maxOutstanding;
+    }
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+// Buffers are preceded by kPoolAlign bytes holding their size
+static void      _ffdec_pool_release         (void* opaque, uint8_t* data)
+{
+    ffdec_buffer_pool*  pool = (ffdec_buffer_pool*)opaque;
+    uint8_t*            block = data - kPoolAlign;
+    bool                keep = false;
+    bool                freePool = false;
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->outstanding--;
+        if ( pool->closed ) {
+            freePool = pool->outstanding == 0;
+        } else if ( *(size_t*)block == pool->bufferSize &&
+                    pool->free.size() < kMaxFreePoolBuffers ) {
+            pool->free.push_back(block);
+            keep = true;
+        }
+    }
+    if ( !keep ) {
+        av_free(block);
+    }
+    if ( freePool ) {
+        delete pool;
+    }
+}
+
+//-----------------------------------------------------------------------------
+static AVBufferRef* _ffdec_pool_get          (ffdec_buffer_pool* pool,
+                                             size_t size,
+                                             fn_stream_log logCb)
+{
+    uint8_t* block = NULL;
+    int      warn = 0;
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        if ( size != pool->bufferSize ) {
+            // pictures changed size; what's free is of no use anymore
+            _ffdec_pool_flush(pool);
+            pool->bufferSize = size;
+        }
+        if ( !pool->free.empty() ) {
+            block = pool->free.back();
+            pool->free.pop_back();
+        }
+        pool->outstanding++;
+        pool->maxOutstanding = std::max(pool->maxOutstanding, pool->outstanding);
+        if ( pool->outstanding >= pool->warnAt ) {
+            warn = pool->warnAt;
+            pool->warnAt *= 2;
+        }
+    }
+
+    if ( block == NULL ) {
+        block = (uint8_t*)av_malloc(size + kPoolAlign);
+        if ( block == NULL ) {
+            std::lock_guard<std::mutex> lock(pool->mutex);
+            pool->outstanding--;
+            return NULL;
         }
+        *(size_t*)block = size;
+    }
+
+    AVBufferRef* buf = av_buffer_create(block + kPoolAlign, size, _ffdec_pool_release, pool, 0);
+    if ( buf == NULL ) {
+        _ffdec_pool_release(pool, block + kPoolAlign);
+        return NULL;
     }
+    if ( warn > 0 ) {
+        logCb(logWarning, _FMT("Decoder has " << warn << " pictures out at once; "
+                                "frames may be held downstream for too long"));
+    }
+    return buf;
 }
 
 
@@ -236,6 +726,13 @@ typedef struct ffdec_stream  : public stream_base {
     int                 errorOccurred;
     int                 threadCount;
     int                 prevPacketSubmitted;
+    int                 decodePriority;
+    int                 decodeThreads;   // threads actually assigned to the codec context
+    INT64_T             decodeTimeUs;    // time spent in the codec, submitting and receiving
+    float               maxFps;          // highest rate any consumer needs; 0 when everything is needed
+    fps_limiter*        inputFps;        // measures the rate packets are arriving at
+    ssize_t             framesDiscarded; // packets the codec was told to skip
+    frame_trace_queue*  traces;          // latency traces of packets inside the codec
 
     uint8_t*            sps;
     uint8_t*            pps;
@@ -255,13 +752,24 @@ typedef struct ffdec_stream  : public stream_base {
     frame_obj*          nextFrameToReturn;
 
     int                 hardwareErrorEncountered;
-    DevicesDict::iterator   hardwareDevices;
+    size_t              hardwareDeviceIndex; // next of g_hwProbes to try
     enum AVPixelFormat  hardwarePixFmt;
     enum AVPixelFormat  hardwareXferPixFmt;
     AVFrame*            hardwareFrame;
     char*               hardwareDevice;
+    // where the codec's threads run, see sv_thread_set_class; those are started
+    // by avcodec_open2 and take the affinity of the thread opening the decoder
+    char*               threadClass;
+    int                 hwFramesOutput;  // emit device-resident frames, rather than downloading each one
+    int                 hwExtraFrames;
+    int                 fastDecode;      // trade picture quality for decoding speed (analytics, thumbnails)
+    int                 fastDecodeApplied; // what the codec context is currently set up for
+    int                 lowresWidth;     // smallest size the consumer needs; lets the codec
+    int                 lowresHeight;    // decode at a fraction of the resolution, if it can
 
     frame_allocator*    fa;
+    int                 pooledBuffers;   // pictures are allocated from bufferPool
+    ffdec_buffer_pool*  bufferPool;
 
     export_frame        _ffdec_export_frame;
 } ffdec_stream_obj;
@@ -299,6 +807,7 @@ static int         ffdec_stream_close              (stream_obj* stream);
 static void        ffdec_stream_destroy            (stream_obj* stream);
 
 static void        _ffdec_configure_demux          (stream_obj* stream);
+static bool        _ffdec_hw_frames_output         (ffdec_stream_obj* decoder);
 
 extern "C" frame_api_t*     get_ffframe_frame_api   ( );
 extern frame_obj*           alloc_avframe_frame     (int ownerTag, frame_allocator* fa,
@@ -372,6 +881,14 @@ static stream_obj*   ffdec_stream_create                (const char* name)
     res->errorOccurred = 0;
     res->threadCount = 0;
     res->prevPacketSubmitted = 1;
+    res->decodePriority = decodePriorityNormal;
+    res->decodeThreads = 0;
+    res->decodeTimeUs = 0;
+    res->maxFps = 0;
+    res->inputFps = fps_limiter_create(30, 0);
+    res->traces = frame_trace_queue_create();
+    fps_limiter_use_wall_clock(res->inputFps, 0);
+    res->framesDiscarded = 0;
 
     res->height = -1;
     res->width = -1;
@@ -390,16 +907,27 @@ static stream_obj*   ffdec_stream_create                (const char* name)
     res->prevSeekFrame = NULL;
     res->nextFrameToReturn = NULL;
 
-    res->fa = create_frame_allocator(name);
+    res->fa = create_frame_allocator2(name,
+                                      sv_get_int_env_var("SIO_DECODER_POOL_FRAMES", kDefaultPoolFrames),
+                                      kPoolReductionTimeMs);
+    res->pooledBuffers = sv_get_int_env_var("SIO_DECODER_POOLED_BUFFERS", 1);
+    res->bufferPool = _ffdec_pool_create();
 
     res->_ffdec_export_frame = NULL;
 
     res->hardwareErrorEncountered = 0;
-    res->hardwareDevices = g_hwDevices.begin();
+    res->hardwareDeviceIndex = 0;
     res->hardwarePixFmt = AV_PIX_FMT_NONE;
     res->hardwareXferPixFmt = AV_PIX_FMT_NONE;
     res->hardwareFrame = NULL;
     res->hardwareDevice = NULL;
+    res->threadClass = NULL;
+    res->hwFramesOutput = 0;
+    res->hwExtraFrames = kDefaultHwExtraFrames;
+    res->fastDecode = 0;
+    res->fastDecodeApplied = 0;
+    res->lowresWidth = 0;
+    res->lowresHeight = 0;
 
     return (stream_obj*)res;
 }
@@ -414,6 +942,8 @@ static int         ffdec_stream_set_param             (stream_obj* stream,
     name = stream_param_name_apply_scope(stream, name);
 
     SET_PARAM_IF(stream, name, "threadCount", int, decoder->threadCount);
+    SET_PARAM_IF(stream, name, "decodePriority", int, decoder->decodePriority);
+    SET_PARAM_IF(stream, name, "maxFps", float, decoder->maxFps);
     if ( !_stricmp(name, "liveStream")) {
         decoder->liveStream = *(int*)value;
         // pass it on, if we can
@@ -430,6 +960,13 @@ static int         ffdec_stream_set_param             (stream_obj* stream,
         return -1;
     }
     SET_STR_PARAM_IF(stream, name, "hardwareDevice", decoder->hardwareDevice);
+    SET_STR_PARAM_IF(stream, name, "threadClass", decoder->threadClass);
+    SET_PARAM_IF(stream, name, "hwFramesOutput", int, decoder->hwFramesOutput);
+    SET_PARAM_IF(stream, name, "hwExtraFrames", int, decoder->hwExtraFrames);
+    SET_PARAM_IF(stream, name, "fastDecode", int, decoder->fastDecode);
+    SET_PARAM_IF(stream, name, "lowresWidth", int, decoder->lowresWidth);
+    SET_PARAM_IF(stream, name, "lowresHeight", int, decoder->lowresHeight);
+    SET_PARAM_IF(stream, name, "pooledBuffers", int, decoder->pooledBuffers);
 
     // pass it on, if we can
     return default_set_param(stream, name, value);
@@ -466,12 +1003,35 @@ static int         ffdec_stream_get_param             (stream_obj* stream,
     }
     COPY_PARAM_IF(decoder, name, "framesProcessed", int, decoder->framesProcessed);
     COPY_PARAM_IF(decoder, name, "framesDropped", int, decoder->framesIgnored);
+    COPY_PARAM_IF(decoder, name, "decodeTimeUs", INT64_T, decoder->decodeTimeUs);
+    COPY_PARAM_IF(decoder, name, "decodeThreads", int, decoder->decodeThreads);
+    COPY_PARAM_IF(decoder, name, "framesDiscarded", int, decoder->framesDiscarded);
+    // estimated from the average cost of the frames we did decode
+    COPY_PARAM_IF(decoder, name, "decodeTimeSavedUs", INT64_T, decoder->framesProcessed > 0 ?
+                                                    decoder->framesDiscarded * decoder->decodeTimeUs / decoder->framesProcessed : 0);
+    // pictures held by the codec or downstream, kept for reuse, and the most held at once
+    COPY_PARAM_IF(decoder, name, "bufferPoolOutstanding", int, _ffdec_pool_stat(decoder->bufferPool, bpsOutstanding));
+    COPY_PARAM_IF(decoder, name, "bufferPoolFree", int, _ffdec_pool_stat(decoder->bufferPool, bpsFree));
+    COPY_PARAM_IF(decoder, name, "bufferPoolMaxOutstanding", int, _ffdec_pool_stat(decoder->bufferPool, bpsMaxOutstanding));
+    // non-NULL only when device-resident frames are being emitted
+    COPY_PARAM_IF(decoder, name, "hwFramesContext", AVBufferRef*, _ffdec_hw_frames_output(decoder) ?
+                                                    decoder->codecContext->hw_frames_ctx : NULL);
 
 
     // pass it on, if we can
     return default_get_param(stream, name, value, size);
 }
 
+//-----------------------------------------------------------------------------
+static bool _ffdec_hw_frames_output          (ffdec_stream_obj* decoder)
+{
+    return decoder->hwFramesOutput &&
+           decoder->mediaType == mediaVideo &&
+           decoder->codecContext != NULL &&
+           decoder->codecContext->hw_device_ctx != NULL &&
+           decoder->codecContext->hw_frames_ctx != NULL;
+}
+
 //-----------------------------------------------------------------------------
 static void _ffdec_configure_demux           (stream_obj* stream)
 {
@@ -522,6 +1082,144 @@ static enum AVPixelFormat _ffdec_get_hw_format(AVCodecContext *ctx,
 }
 
 
+//-----------------------------------------------------------------------------
+// Switches the software codec between the quality tiers. All of these are read
+// by the codec frame by frame (and handed to frame threads along with each
+// packet), so they may change while the stream is being decoded.
+// The codec's idct is only skipped on frames nothing references, so its errors
+// don't propagate -- skipping it on keyframes would drop the residual altogether.
+static void      _ffdec_apply_fast_decode    (ffdec_stream* decoder)
+{
+    AVCodecContext* ctx = decoder->codecContext;
+    if ( decoder->fastDecode == decoder->fastDecodeApplied ||
+         ctx == NULL ||
+         ctx->hw_device_ctx != NULL ) {
+        return;
+    }
+
+    if ( decoder->fastDecode ) {
+        ctx->skip_loop_filter = AVDISCARD_ALL;
+        ctx->skip_idct = AVDISCARD_NONREF;
+        ctx->flags2 |= AV_CODEC_FLAG2_FAST;
+    } else {
+        ctx->skip_loop_filter = AVDISCARD_DEFAULT;
+        ctx->skip_idct = AVDISCARD_DEFAULT;
+        ctx->flags2 &= ~AV_CODEC_FLAG2_FAST;
+    }
+    decoder->logCb(logInfo, _FMT("Decoding at " << (decoder->fastDecode ? "fast" : "full") << " quality"));
+    decoder->fastDecodeApplied = decoder->fastDecode;
+}
+
+//-----------------------------------------------------------------------------
+// Picks the largest downscale the codec can decode at, that still leaves the
+// frames at least as large as the consumer wants them (few codecs support it,
+// H.264 isn't one of them)
+static void      _ffdec_apply_lowres         (stream_obj* stream,
+                                             const AVCodec* codec)
+{
+    DECLARE_STREAM_FF_V(stream, decoder);
+
+    int    width = 0, height = 0;
+    size_t size = sizeof(int);
+    if ( codec->max_lowres <= 0 ||
+         (decoder->lowresWidth <= 0 && decoder->lowresHeight <= 0) ||
+         default_get_param(stream, "width", &width, &size) < 0 ||
+         default_get_param(stream, "height", &height, &size) < 0 ||
+         width <= 0 || height <= 0 ) {
+        return;
+    }
+
+    int lowres = 0;
+    while ( lowres < codec->max_lowres &&
+            (width >> (lowres+1)) >= decoder->lowresWidth &&
+            (height >> (lowres+1)) >= decoder->lowresHeight ) {
+        lowres++;
+    }
+    if ( lowres > 0 ) {
+        decoder->codecContext->lowres = lowres;
+        decoder->logCb(logInfo, _FMT("Decoding " << width << "x" << height << " at 1/" << (1<<lowres) <<
+                                     " of the resolution"));
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Points frame's planes into a pooled buffer, for a picture of its format, and
+// of width x height (padded as the codec needs it). Returns -1 if the format
+// can't be pooled, or the buffer can't be had.
+static int       _ffdec_pool_get_picture     (ffdec_stream* decoder,
+                                             AVFrame* frame,
+                                             int width,
+                                             int height)
+{
+    enum AVPixelFormat        fmt = (enum AVPixelFormat)frame->format;
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(fmt);
+    uint64_t                  unpooled = AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL;
+#ifdef AV_PIX_FMT_FLAG_PSEUDOPAL
+    // older libavutil wants a palette with these, too
+    unpooled |= AV_PIX_FMT_FLAG_PSEUDOPAL;
+#endif
+    if ( desc == NULL || (desc->flags & unpooled) ) {
+        return -1;
+    }
+
+    // widen the picture until every line is aligned, as libavcodec does
+    int linesize[4];
+    int unaligned;
+    do {
+        if ( av_image_fill_linesizes(linesize, fmt, width) < 0 ) {
+            return -1;
+        }
+        unaligned = 0;
+        for (int nI=0; nI<4; nI++) {
+            unaligned |= linesize[nI] % kPoolAlign;
+        }
+        width += width & ~(width-1);
+    } while ( unaligned );
+
+    int    planes = av_pix_fmt_count_planes(fmt);
+    size_t offsets[4];
+    size_t size = 0;
+    for (int nI=0; nI<planes; nI++) {
+        int h = (nI == 1 || nI == 2) ? AV_CEIL_RSHIFT(height, desc->log2_chroma_h) : height;
+        offsets[nI] = size;
+        // codecs may read a little past the end of a plane
+        size += FFALIGN((size_t)linesize[nI]*h + 16 + kPoolAlign - 1, kPoolAlign);
+    }
+
+    AVBufferRef* buf = _ffdec_pool_get(decoder->bufferPool, size, decoder->logCb);
+    if ( buf == NULL ) {
+        return -1;
+    }
+    frame->buf[0] = buf;
+    for (int nI=0; nI<planes; nI++) {
+        frame->data[nI] = buf->data + offsets[nI];
+        frame->linesize[nI] = linesize[nI];
+    }
+    frame->extended_data = frame->data;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static int       _ffdec_get_buffer2          (AVCodecContext* ctx,
+                                             AVFrame* frame,
+                                             int flags)
+{
+    ffdec_stream* decoder = (ffdec_stream*)ctx->opaque;
+
+    // codecs without DR1 have to use the default allocator
+    if ( (ctx->codec->capabilities & AV_CODEC_CAP_DR1) &&
+         frame->width > 0 && frame->height > 0 ) {
+        int width = frame->width;
+        int height = frame->height;
+        int linesizeAlign[AV_NUM_DATA_POINTERS];
+        avcodec_align_dimensions2(ctx, &width, &height, linesizeAlign);
+        if ( _ffdec_pool_get_picture(decoder, frame, width, height) == 0 ) {
+            return 0;
+        }
+    }
+    return avcodec_default_get_buffer2(ctx, frame, flags);
+}
+
 //-----------------------------------------------------------------------------
 static int       _ffdec_prepare_video_decoder (stream_obj* stream)
 {
@@ -550,26 +1248,27 @@ Retry:
 
     if ( !hwDevName.empty() ) {
         if ( hwDevName != "none" && !decoder->hardwareErrorEncountered ) {
-            auto it = g_hwDevices.begin();
-            while ( it != g_hwDevices.end() ) {
-                if ( it->first.name == hwDevName ) {
-                    hwDev = it->second.get();
-                    break;
-                }
-                it++;
+            int index = _ffmpeg_hw_find(hwDevName);
+            if ( index >= 0 ) {
+                hwDev = _ffmpeg_hw_get(index);
             }
             if ( hwDev == NULL ) {
                 decoder->logCb(logError, _FMT("Device " << hwDevName << " not found"));
                 hwDevName = "";
             }
         }
-    } else if ( decoder->hardwareDevices != g_hwDevices.end() ) {
-        hwDevName = decoder->hardwareDevices->first.name;
-        hwDev = decoder->hardwareDevices->second.get();
-        decoder->hardwareDevices++;
-        // new device, reset this
-        decoder->hardwareErrorEncountered = 0;
-        decoder->logCb(logDebug, _FMT("Attempting to use decoder device " << hwDevName));
+    } else {
+        // skip the devices which couldn't be opened
+        while ( hwDev == NULL && decoder->hardwareDeviceIndex < _ffmpeg_hw_count() ) {
+            size_t index = decoder->hardwareDeviceIndex++;
+            hwDev = _ffmpeg_hw_get(index);
+            if ( hwDev != NULL ) {
+                hwDevName = g_hwProbes[index].entry.name;
+                // new device, reset this
+                decoder->hardwareErrorEncountered = 0;
+                decoder->logCb(logDebug, _FMT("Attempting to use decoder device " << hwDevName));
+            }
+        }
     }
 
 
@@ -671,6 +1370,11 @@ Retry:
         decoder->codecContext->opaque = (void*)decoder;
         decoder->codecContext->get_format  = _ffdec_get_hw_format;
         decoder->codecContext->hw_device_ctx = av_buffer_ref(hwDev);
+        if ( decoder->hwFramesOutput ) {
+            // frames will be held by the downstream for longer than decoder expects
+            decoder->codecContext->extra_hw_frames = decoder->hwExtraFrames;
+        }
+        av_frame_free(&decoder->hardwareFrame);
         decoder->hardwareFrame = av_frame_alloc();
         if (!decoder->hardwareFrame) {
             decoder->logCb(logError, _FMT("Failed to allocate frame object"));
@@ -705,13 +1409,16 @@ Retry:
 
         decoder->logCb(logInfo, _FMT("Using device '" << hwDevName << "' for decoding"));
     } else {
-        decoder->logCb(logInfo, _FMT("Using software decoder"));
-        if (!decoder->liveStream) {
-            decoder->codecContext->thread_count = sv_get_cpu_count();
-        }
+        int fixedThreads = 0;
         if ( decoder->threadCount > 0 ) {
-            decoder->codecContext->thread_count = decoder->threadCount;
+            fixedThreads = decoder->threadCount;
+        } else if ( decoder->liveStream ) {
+            fixedThreads = 1;
         }
+        decoder->decodeThreads = _ffdec_scheduler_join(decoder, decoder->decodePriority, fixedThreads,
+                                                        decoder->liveStream);
+        decoder->codecContext->thread_count = decoder->decodeThreads;
+        decoder->logCb(logInfo, _FMT("Using software decoder, threads=" << decoder->decodeThreads));
 
         // This does NOT work with hardware decoder
         if (codec->capabilities & AV_CODEC_CAP_TRUNCATED) {
@@ -719,6 +1426,18 @@ Retry:
         }
         decoder->codecContext->flags2 |= AV_CODEC_FLAG2_CHUNKS;
 
+        decoder->fastDecodeApplied = 0;
+        _ffdec_apply_fast_decode(decoder);
+        _ffdec_apply_lowres(stream, codec);
+
+        if ( decoder->pooledBuffers ) {
+            decoder->codecContext->opaque = (void*)decoder;
+            decoder->codecContext->get_buffer2 = _ffdec_get_buffer2;
+#if FF_API_THREAD_SAFE_CALLBACKS
+            // frame threads would otherwise wait on the main one to allocate
+            decoder->codecContext->thread_safe_callbacks = 1;
+#endif
+        }
     }
 
     decoder->_ffdec_export_frame = _ffdec_export_video_frame;
@@ -805,7 +1524,17 @@ static int         _ffdec_prepare_decoder              (stream_obj* stream)
     }
 
 
-    if ( (res=avcodec_open2(decoder->codecContext, decoder->codecContext->codec, NULL)) < 0 ) {
+    // Codec threads inherit the opener's affinity; borrow the class's for the
+    // duration. Priorities aren't borrowed: a lowered one can't always be undone.
+    char    prevAffinity[4096];
+    bool    restoreAffinity = decoder->threadClass != NULL &&
+                              sv_thread_get_affinity(prevAffinity, sizeof(prevAffinity)) >= 0 &&
+                              sv_thread_set_class_affinity(decoder->threadClass) >= 0;
+    res = avcodec_open2(decoder->codecContext, decoder->codecContext->codec, NULL);
+    if ( restoreAffinity ) {
+        sv_thread_set_affinity(prevAffinity);
+    }
+    if ( res < 0 ) {
         decoder->logCb(logError, _FMT("Failed to init codec context"));
         return res;
     }
@@ -971,7 +1700,12 @@ static int
 _ffdec_export_video_frame                (ffdec_stream* decoder, AVFrame* f,
                                         frame_obj* frameOut)
 {
-    int format = ffpfmt_to_svpfmt((enum AVPixelFormat)f->format, f->color_range);
+    enum AVPixelFormat ffFormat = (enum AVPixelFormat)f->format;
+    if ( f->hw_frames_ctx ) {
+        // device-resident frame -- downstream sees the format it'll be downloaded as
+        ffFormat = ((AVHWFramesContext*)f->hw_frames_ctx->data)->sw_format;
+    }
+    int format = ffpfmt_to_svpfmt(ffFormat, f->color_range);
     if ( f->width != decoder->width && decoder->width != -1 ) {
         decoder->logCb(logError, _FMT("Width had changed: " << decoder->width << "->" << f->width ));
         return -1;
@@ -981,7 +1715,7 @@ _ffdec_export_video_frame                (ffdec_stream* decoder, AVFrame* f,
         return -1;
     }
     if ( format != decoder->format && decoder->format != pfmtUndefined ) {
-        decoder->logCb(logError, _FMT("Pixfmt had changed to : " << av_get_pix_fmt_name((enum AVPixelFormat)decoder->format) << "->" << av_get_pix_fmt_name((enum AVPixelFormat)f->format) ));
+        decoder->logCb(logError, _FMT("Pixfmt had changed to : " << av_get_pix_fmt_name((enum AVPixelFormat)decoder->format) << "->" << av_get_pix_fmt_name(ffFormat) ));
         return -1;
     }
 
@@ -993,7 +1727,8 @@ _ffdec_export_video_frame                (ffdec_stream* decoder, AVFrame* f,
     }
 
     if ( decoder->format == sfmtUndefined ) {
-        decoder->logCb(logInfo, _FMT("Setting pixfmt to " << av_get_pix_fmt_name((enum AVPixelFormat)f->format)));
+        decoder->logCb(logInfo, _FMT("Setting pixfmt to " << av_get_pix_fmt_name(ffFormat) <<
+                                     (f->hw_frames_ctx ? " (device-resident)" : "")));
         decoder->format = api->get_pixel_format(frameOut);
         decoder->width = api->get_width(frameOut);
         decoder->height = api->get_height(frameOut);
@@ -1031,6 +1766,20 @@ _ffdec_export_audio_frame                (ffdec_stream* decoder, AVFrame* f,
     return 0;
 }
 
+//-----------------------------------------------------------------------------
+// steady_clock is what sv_trace_now_us uses
+static void _ffdec_trace_span              (ffdec_stream* decoder,
+                                            const char* category,
+                                            std::chrono::steady_clock::time_point start,
+                                            std::chrono::steady_clock::time_point end)
+{
+    if ( sv_trace_enabled() ) {
+        sv_trace_span(category, decoder->name,
+                      std::chrono::duration_cast<std::chrono::microseconds>(start.time_since_epoch()).count(),
+                      std::chrono::duration_cast<std::chrono::microseconds>(end.time_since_epoch()).count());
+    }
+}
+
 //-----------------------------------------------------------------------------
 static int  _ffdec_receive_frame           (ffdec_stream* decoder,
                                             frame_obj** frame)
@@ -1052,7 +1801,12 @@ TryAgain:
     }
 
     tmpFrame = (decoder->codecContext->hw_device_ctx ? decoder->hardwareFrame : decoder->ffFrame);
+    auto decodeStart = std::chrono::steady_clock::now();
     res = avcodec_receive_frame(decoder->codecContext, tmpFrame);
+    auto decodeEnd = std::chrono::steady_clock::now();
+    decoder->decodeTimeUs += std::chrono::duration_cast<std::chrono::microseconds>(
+                                decodeEnd - decodeStart).count();
+    _ffdec_trace_span(decoder, "decode_receive", decodeStart, decodeEnd);
     if ( res == AVERROR(EAGAIN) ) {
         return 0;
     }
@@ -1062,7 +1816,12 @@ TryAgain:
         return res;
     }
 
-    if ( decoder->codecContext->hw_device_ctx ) {
+    if ( decoder->codecContext->hw_device_ctx && decoder->hwFramesOutput ) {
+        // keep the surface on the device; it'll be downloaded (possibly after
+        // being scaled down on the device) only when the data is needed
+        av_frame_unref(decoder->ffFrame);
+        av_frame_move_ref(decoder->ffFrame, decoder->hardwareFrame);
+    } else if ( decoder->codecContext->hw_device_ctx ) {
         if ( decoder->hardwareXferPixFmt == AV_PIX_FMT_NONE ) {
             enum AVPixelFormat* formats;
             res = av_hwframe_transfer_get_formats(decoder->hardwareFrame->hw_frames_ctx, AV_HWFRAME_TRANSFER_DIRECTION_FROM, &formats, 0);
@@ -1079,7 +1838,14 @@ TryAgain:
         if ( !decoder->ffFrame->buf[0] ) {
             decoder->ffFrame->width = decoder->hardwareFrame->width;
             decoder->ffFrame->height = decoder->hardwareFrame->height;
-            res = av_frame_get_buffer(decoder->ffFrame, 0);
+            res = -1;
+            if ( decoder->pooledBuffers ) {
+                res = _ffdec_pool_get_picture(decoder, decoder->ffFrame,
+                                              decoder->ffFrame->width, decoder->ffFrame->height);
+            }
+            if ( res < 0 ) {
+                res = av_frame_get_buffer(decoder->ffFrame, 0);
+            }
             if ( res < 0 ) {
                 decoder->logCb(logError, _FMT("Failed to get frame buffer: " << res));
                 return res;
@@ -1112,6 +1878,7 @@ TryAgain:
         frame_unref(&frameOut);
         return -1;
     }
+    frame_trace_queue_pop(decoder->traces, frameOut, ftDecoded);
 
     // new ffmpeg frame object will need to be allocated later
     decoder->ffFrame = NULL;
@@ -1151,6 +1918,53 @@ TryAgain:
     return 0;
 }
 
+//-----------------------------------------------------------------------------
+// Picks the codec's discard level based on how many frames downstream consumers
+// actually want, and reports whether the codec is going to skip this packet.
+// Only applies to live H.264, once the first frame had been produced, and never
+// while seeking -- a seek needs every frame up to the target.
+static bool _ffdec_apply_discard                (ffdec_stream* decoder,
+                                                uint8_t* data,
+                                                int size,
+                                                bool key)
+{
+    enum AVDiscard wanted = AVDISCARD_DEFAULT;
+
+    if ( decoder->maxFps > 0 &&
+         decoder->liveStream &&
+         decoder->srcCodecId == streamH264 &&
+         decoder->firstFrameServed &&
+         decoder->seekingTo == INVALID_PTS ) {
+        float inputFps = fps_limiter_get_fps(decoder->inputFps);
+        if ( inputFps > 0 && decoder->maxFps < inputFps ) {
+            float keyFps = decoder->lastKeyFrameInterval > 0 ? inputFps / decoder->lastKeyFrameInterval : 0;
+            wanted = ( keyFps > 0 && decoder->maxFps <= keyFps ) ? AVDISCARD_NONKEY : AVDISCARD_NONREF;
+        }
+    }
+
+    if ( wanted != decoder->codecContext->skip_frame ) {
+        if ( decoder->codecContext->skip_frame == AVDISCARD_NONKEY && !key ) {
+            // references of this packet were never decoded; wait for the next keyframe
+            wanted = AVDISCARD_NONKEY;
+        } else {
+            decoder->logCb(logDebug, _FMT("Changing discard level " << decoder->codecContext->skip_frame <<
+                                            "->" << wanted << ": maxFps=" << decoder->maxFps <<
+                                            " inputFps=" << fps_limiter_get_fps(decoder->inputFps) <<
+                                            " keyFrameInterval=" << decoder->lastKeyFrameInterval));
+            decoder->codecContext->skip_frame = wanted;
+        }
+    }
+
+    switch (decoder->codecContext->skip_frame) {
+    case AVDISCARD_NONKEY:
+        return !key;
+    case AVDISCARD_NONREF:
+        return !videolibapi_is_reference_frame(data, size, decoder->logCb);
+    default:
+        return false;
+    }
+}
+
 //-----------------------------------------------------------------------------
 static int  _ffdec_submit_packet                (ffdec_stream* decoder,
                                                 frame_obj* sourceFrame,
@@ -1173,8 +1987,8 @@ Retry:
     av_init_packet(&packet);
     packet.pts  = fapi->get_pts(sourceFrame);
     packet.dts  = packet.pts;
-    packet.data = (uint8_t*)fapi->get_data(sourceFrame);
-    packet.size = fapi->get_data_size(sourceFrame);
+    // references the frame, rather than having ffmpeg copy it
+    frame_avbuffer_wrap(sourceFrame, &packet);
     packet.flags = 0;
     bool key = (fapi->get_keyframe_flag(sourceFrame) > 0);
     if (key) {
@@ -1185,7 +1999,20 @@ Retry:
         decoder->packetsSinceKeyframe ++;
     }
 
+    fps_limiter_report_frame(decoder->inputFps, NULL, packet.pts);
+    _ffdec_apply_fast_decode(decoder);
+    if ( _ffdec_apply_discard(decoder, packet.data, packet.size, key) ) {
+        // the codec won't produce a frame for this one; don't count it towards the timeout
+        decoder->prevPacketSubmitted = 0;
+        decoder->framesDiscarded++;
+    }
+
+    auto decodeStart = std::chrono::steady_clock::now();
     int res = avcodec_send_packet(decoder->codecContext, &packet);
+    auto decodeEnd = std::chrono::steady_clock::now();
+    decoder->decodeTimeUs += std::chrono::duration_cast<std::chrono::microseconds>(
+                                decodeEnd - decodeStart).count();
+    _ffdec_trace_span(decoder, "decode_send", decodeStart, decodeEnd);
     if ( res < 0 ) {
         if ( decoder->codecContext->hw_device_ctx != NULL && decoder->packetsProcessed == 0 ) {
             decoder->logCb(logInfo, _FMT("Attempting to reinit decoder"));
@@ -1193,6 +2020,7 @@ Retry:
             decoder->hardwareErrorEncountered = 1;
             res = _ffdec_prepare_decoder((stream_obj*)decoder);
             if ( res >= 0 ) {
+                av_packet_unref(&packet);
                 goto Retry;
             }
         } else {
@@ -1211,10 +2039,13 @@ Retry:
             }
             decoder->logCb(logError, _FMT("Data: " << buf));
         }
+        av_packet_unref(&packet);
         frame_unref(&sourceFrame);
         return -1;
     }
+    av_packet_unref(&packet);
 
+    frame_trace_queue_push(decoder->traces, sourceFrame);
     frame_unref(&sourceFrame);
     decoder->packetsProcessed++;
 
@@ -1350,12 +2181,15 @@ static int         ffdec_stream_close             (stream_obj* stream)
                     ": codec object " << (void*)decoder->codecContext));
         avcodec_free_context(&decoder->codecContext);
     }
+    _ffdec_scheduler_leave(decoder);
+    decoder->decodeThreads = 0;
     frame_unref(&decoder->firstFrame);
     frame_unref(&decoder->prevSeekFrame);
     frame_unref(&decoder->nextFrameToReturn);
     decoder->sourceApi->close(decoder->source);
     stream_unref(&decoder->source);
     sv_freep(&decoder->hardwareDevice);
+    sv_freep(&decoder->threadClass);
 
     decoder->prevCaptureTimeMs = 0;
     decoder->captureHasStabilized = 0;
@@ -1368,7 +2202,14 @@ static void ffdec_stream_destroy         (stream_obj* stream)
     DECLARE_STREAM_FF_V(stream, decoder);
     decoder->logCb(logTrace, _FMT("Destroying stream object " << (void*)stream));
     ffdec_stream_close(stream); // make sure all the internals had been freed
+    int maxOutstanding = _ffdec_pool_stat(decoder->bufferPool, bpsMaxOutstanding);
+    if ( maxOutstanding > 0 ) {
+        decoder->logCb(logInfo, _FMT("Decoder buffer pool: maxOutstanding=" << maxOutstanding));
+    }
+    _ffdec_pool_close(&decoder->bufferPool);
     destroy_frame_allocator(&decoder->fa, decoder->logCb);
+    fps_limiter_destroy(&decoder->inputFps);
+    frame_trace_queue_destroy(&decoder->traces);
     stream_destroy( stream );
 }
 
@@ -37,9 +37,17 @@
 #include "sv_module_def.hpp"
 
 #include "streamprv.h"
+#include "sv_internal.h"
 #include "sv_ffmpeg.h"
 
 #include "videolibUtils.h"
+#include "clip_index.h"
+#include "annexb_normalizer.h"
+#include "frame_trace.h"
+
+#include <map>
+#include <mutex>
+#include <string>
 
 #define FFMPEG_DEMUX_MAGIC 0x1218
 #define MAX_PARAM 10
@@ -54,6 +62,13 @@ static const int kMsecInSec = 1000;
 
 extern "C" frame_api_t*    get_ffpacket_frame_api();
 
+// memory-mapped input (sv_ffmpeg.cpp), with SV_MMAP_ACCESS_xxx
+extern "C" {
+SVVIDEOLIB_API AVIOContext* ffmpeg_create_mmap_io (const char* filename, int access);
+SVVIDEOLIB_API void         ffmpeg_close_mmap_io  (AVIOContext** pCtx);
+}
+#define DEMUX_MMAP_VAR "SV_DEMUX_MMAP"
+
 typedef struct stats_snapshot_demux: public stats_snapshot_base {
     size_t          framesProcessed;
     stats_item_int  frameSize;
@@ -124,16 +139,41 @@ typedef struct ffmpeg_stream  : public stream_base {
     int                 height;
     int                 pix_fmt;
     int                 keyframeOnly;
+    int                 discardAudio;       // nobody downstream wants the audio
 
     int                 statsIntervalSec;
     INT64_T             statsLastReportTime;
     INT64_T             startTime;
+
+    // local files are read through a mapping, unless this is "none";
+    // "sequential" or "random" tell the kernel what to expect
+    char*               mmapAccess;
+    AVIOContext*        mmapIo;
+
+    // live Annex-B H.264 is scanned here, once for everything downstream
+    annexb_normalizer*  normalizer;
 } ffmpeg_stream_obj;
 
 
 #define A_STREAM(demux) demux->streams[S_AUDIO]
 #define V_STREAM(demux) demux->streams[S_VIDEO]
 
+//-----------------------------------------------------------------------------
+// Video codec parameters of live streams, as of their last successful open.
+// Reconnecting to the same URL only probes long enough to see the stream is
+// still the same, and takes whatever the short probe didn't get to from here;
+// if extradata (SPS/PPS) had changed, a full probe is done after all.
+typedef struct ff_probe_cache_entry {
+    AVCodecParameters*  codecpar;
+    INT64_T             lastUsed;
+} ff_probe_cache_entry;
+
+static const int        kProbeCacheMaxEntries = 64;
+static const int        kCachedAnalyzeDurationMs = 500;
+
+static std::mutex                                   _gProbeCacheMutex;
+static std::map<std::string, ff_probe_cache_entry>  _gProbeCache;
+
 
 static int64_t    _ff_translate_timebase_to_ms (ffmpeg_stream_obj* demux,
                                                 int index,
@@ -141,6 +181,7 @@ static int64_t    _ff_translate_timebase_to_ms (ffmpeg_stream_obj* demux,
 static int64_t    _ff_translate_ms_to_timebase (ffmpeg_stream_obj* demux,
                                                 int index,
                                                 int64_t pts);
+static void       _ff_apply_audio_discard      (ffmpeg_stream_obj* demux);
 
 
 
@@ -238,11 +279,15 @@ static stream_obj*   ff_stream_create                (const char* name)
     res->pix_fmt = pfmtUndefined;
     res->startTime = sv_time_get_current_epoch_time();
     res->keyframeOnly = 0;
+    res->discardAudio = 0;
 
     res->streams[S_VIDEO].reset();
     res->streams[S_AUDIO].reset();
     res->statsIntervalSec = 0;
     res->statsLastReportTime = res->startTime;
+    res->mmapAccess = NULL;
+    res->mmapIo = NULL;
+    res->normalizer = NULL;
 
     return (stream_obj*)res;
 }
@@ -265,10 +310,29 @@ static int         ff_stream_set_param             (stream_obj* stream,
     SET_PARAM_IF(stream, name, "keyframeOnly", int, demux->keyframeOnly);
     SET_PARAM_IF(stream, name, "pixfmt", int, demux->pix_fmt);
     SET_PARAM_IF(stream, name, "statsIntervalSec", int, demux->statsIntervalSec);
+    SET_STR_PARAM_IF(stream, name, "mmapAccess", demux->mmapAccess);
+    if ( !_stricmp(name, "discardAudio") ) {
+        // may change while the stream is being read -- no need to reopen
+        demux->discardAudio = *(int*)value;
+        _ff_apply_audio_discard(demux);
+        return 0;
+    }
 
     return -1;
 }
 
+//-----------------------------------------------------------------------------
+// Lets the format skip reading (and parsing) the audio packets altogether
+static void       _ff_apply_audio_discard      (ffmpeg_stream_obj* demux)
+{
+    if ( demux->format == NULL || A_STREAM(demux).id < 0 ) {
+        return;
+    }
+    demux->format->streams[A_STREAM(demux).id]->discard =
+                        demux->discardAudio ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+    TRACE(_FMT("Audio " << (demux->discardAudio ? "discarded" : "enabled")));
+}
+
 //-----------------------------------------------------------------------------
 int _ff_stream_get_bitrate(ffmpeg_stream* demux, int isVideo)
 {
@@ -299,6 +363,46 @@ static int64_t         _ff_stream_get_duration             (ffmpeg_stream* demux
 
 }
 
+//-----------------------------------------------------------------------------
+// Frame table built from the container's own index (e.g. mp4 sample table).
+// Caller owns the result; NULL if the container doesn't index video frames.
+static clip_index*     _ff_stream_build_frame_index        (ffmpeg_stream* demux)
+{
+    int s_id = V_STREAM(demux).id;
+    if (demux->format == NULL ||
+        demux->liveStream ||
+        s_id == -1 ||
+        demux->format->streams[s_id] == NULL ) {
+        return NULL;
+    }
+    AVStream* s = demux->format->streams[s_id];
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+    int count = avformat_index_get_entries_count(s);
+#else
+    int count = s->nb_index_entries;
+#endif
+    if ( count <= 0 ) {
+        return NULL;
+    }
+
+    clip_index_writer* w = clip_index_writer_create();
+    for (int nI=0; nI<count; nI++) {
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+        const AVIndexEntry* e = avformat_index_get_entry(s, nI);
+#else
+        const AVIndexEntry* e = &s->index_entries[nI];
+#endif
+        clip_index_writer_add(w,
+                              _ff_translate_timebase_to_ms(demux, s_id, e->timestamp),
+                              e->pos,
+                              (e->flags & AVINDEX_KEYFRAME) != 0);
+    }
+    clip_index* res = clip_index_writer_to_index(w, _ff_stream_get_duration(demux));
+    clip_index_writer_destroy(&w);
+    TRACE(_FMT("Built frame index from container: entries=" << count));
+    return res;
+}
+
 //-----------------------------------------------------------------------------
 #define AVR2D(n) (n.den==0?0:(n.num/(double)n.den))
 
@@ -351,6 +455,7 @@ static int         ff_stream_get_param             (stream_obj* stream,
     COPY_PARAM_IF(demux, name, "sps",          char*, demux->sps);
     COPY_PARAM_IF(demux, name, "pps",          char*, demux->pps);
     COPY_PARAM_IF(demux, name, "rotation",     int,   demux->rotation);
+    COPY_PARAM_IF(demux, name, "annexbNormalized", int, demux->normalizer != NULL);
     COPY_PARAM_IF(demux, name, "width",        int,   ff_stream_get_width(stream));
     COPY_PARAM_IF(demux, name, "height",       int,   ff_stream_get_height(stream));
     COPY_PARAM_IF(demux, name, "videoBitrate",  int, _ff_stream_get_bitrate(demux, true));
@@ -374,6 +479,14 @@ static int         ff_stream_get_param             (stream_obj* stream,
         AVCodecParameters* c = demux->format->streams[V_STREAM(demux).id]->codecpar;
         COPY_PARAM_IF(demux, name, "ffmpegVideoCodecParameters", AVCodecParameters*, c );
     }
+    if ( !_stricmp(name, "containerFrameIndex") ) {
+        // built on demand; the caller owns the result
+        clip_index* index = _ff_stream_build_frame_index(demux);
+        if ( index == NULL ) {
+            return -1;
+        }
+        COPY_PARAM_IF(demux, name, "containerFrameIndex", clip_index*, index);
+    }
 
     demux->logCb(logDebug, _FMT("Unknown param " << name));
     return -1;
@@ -534,6 +647,178 @@ static void _ff_stream_save_sps_pps_annexb(ffmpeg_stream* demux)
     }
 }
 
+//-----------------------------------------------------------------------------
+// Live H.264 that comes in Annex-B (RTSP, for one) is scanned as it's read;
+// avcC streams are files, whose keyframe flags come from the index anyway.
+static void _ff_stream_init_normalizer(ffmpeg_stream* demux)
+{
+    AVCodecParameters* codecpar = _ff_get_video_codecpar(demux);
+    annexb_normalizer_destroy(&demux->normalizer);
+    if ( !demux->liveStream || !codecpar || codecpar->codec_id != AV_CODEC_ID_H264 ||
+         (codecpar->extradata_size > 0 && codecpar->extradata[0] == 1) ) {
+        return;
+    }
+    demux->normalizer = annexb_normalizer_create(demux->logCb);
+    annexb_normalizer_set_headers(demux->normalizer,
+                                  (const uint8_t*)demux->sps, demux->spsSize,
+                                  (const uint8_t*)demux->pps, demux->ppsSize);
+}
+
+//-----------------------------------------------------------------------------
+static void _ff_stream_normalize_packet(ffmpeg_stream* demux, AVPacket* packet)
+{
+    annexb_packet_info info;
+    if ( annexb_normalizer_scan(demux->normalizer, packet->data, packet->size, &info) < 0 ) {
+        return;
+    }
+    if ( info.idr ) {
+        packet->flags |= AV_PKT_FLAG_KEY;
+    } else {
+        packet->flags &= ~AV_PKT_FLAG_KEY;
+    }
+    if ( info.headerSize > 0 ) {
+        int size = packet->size;
+        if ( av_grow_packet(packet, info.headerSize) < 0 ) {
+            demux->logCb(logWarning, _FMT("Failed to grow the packet for SPS/PPS"));
+            return;
+        }
+        memmove(packet->data + info.headerSize, packet->data, size);
+        annexb_normalizer_write_headers(demux->normalizer, packet->data);
+    }
+}
+
+//-----------------------------------------------------------------------------
+static bool _ff_probe_cache_has(ffmpeg_stream* demux)
+{
+    std::lock_guard<std::mutex> guard(_gProbeCacheMutex);
+    return _gProbeCache.find(demux->descriptor) != _gProbeCache.end();
+}
+
+//-----------------------------------------------------------------------------
+// Fills in what the short probe didn't find out. Returns -1 if the stream
+// doesn't match the cached parameters.
+static int _ff_probe_cache_apply(ffmpeg_stream* demux)
+{
+    AVCodecParameters* codecpar = _ff_get_video_codecpar(demux);
+    if (!codecpar) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> guard(_gProbeCacheMutex);
+    std::map<std::string, ff_probe_cache_entry>::iterator it = _gProbeCache.find(demux->descriptor);
+    if ( it == _gProbeCache.end() ) {
+        return -1;
+    }
+    const AVCodecParameters* cached = it->second.codecpar;
+    if ( codecpar->codec_id != cached->codec_id ) {
+        return -1;
+    }
+    if ( codecpar->extradata_size > 0 &&
+         ( codecpar->extradata_size != cached->extradata_size ||
+           memcmp(codecpar->extradata, cached->extradata, cached->extradata_size) ) ) {
+        return -1;
+    }
+
+    if ( codecpar->extradata_size <= 0 && cached->extradata_size > 0 ) {
+        codecpar->extradata = (uint8_t*)av_mallocz(cached->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if ( codecpar->extradata == NULL ) {
+            return -1;
+        }
+        memcpy(codecpar->extradata, cached->extradata, cached->extradata_size);
+        codecpar->extradata_size = cached->extradata_size;
+    }
+    if ( codecpar->width <= 0 || codecpar->height <= 0 ) {
+        codecpar->width = cached->width;
+        codecpar->height = cached->height;
+    }
+    if ( codecpar->format < 0 ) {
+        codecpar->format = cached->format;
+    }
+    if ( codecpar->sample_aspect_ratio.num == 0 ) {
+        codecpar->sample_aspect_ratio = cached->sample_aspect_ratio;
+    }
+    it->second.lastUsed = sv_time_get_current_epoch_time();
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void _ff_probe_cache_put(ffmpeg_stream* demux)
+{
+    AVCodecParameters* codecpar = _ff_get_video_codecpar(demux);
+    if ( !codecpar || codecpar->width <= 0 || codecpar->height <= 0 || codecpar->format < 0 ) {
+        // not worth remembering, if the probe couldn't figure it out either
+        return;
+    }
+
+    AVCodecParameters* copy = avcodec_parameters_alloc();
+    if ( copy == NULL || avcodec_parameters_copy(copy, codecpar) < 0 ) {
+        avcodec_parameters_free(&copy);
+        return;
+    }
+
+    AVCodecParameters* evicted = NULL;
+    {
+        std::lock_guard<std::mutex> guard(_gProbeCacheMutex);
+        std::map<std::string, ff_probe_cache_entry>::iterator it = _gProbeCache.find(demux->descriptor);
+        if ( it != _gProbeCache.end() ) {
+            evicted = it->second.codecpar;
+        } else if ( (int)_gProbeCache.size() >= kProbeCacheMaxEntries ) {
+            std::map<std::string, ff_probe_cache_entry>::iterator oldest = _gProbeCache.begin();
+            for ( it = _gProbeCache.begin(); it != _gProbeCache.end(); it++ ) {
+                if ( it->second.lastUsed < oldest->second.lastUsed ) {
+                    oldest = it;
+                }
+            }
+            evicted = oldest->second.codecpar;
+            _gProbeCache.erase(oldest);
+        }
+        ff_probe_cache_entry& e = _gProbeCache[demux->descriptor];
+        e.codecpar = copy;
+        e.lastUsed = sv_time_get_current_epoch_time();
+    }
+    avcodec_parameters_free(&evicted);
+}
+
+//-----------------------------------------------------------------------------
+static void _ff_probe_cache_drop(ffmpeg_stream* demux)
+{
+    AVCodecParameters* evicted = NULL;
+    {
+        std::lock_guard<std::mutex> guard(_gProbeCacheMutex);
+        std::map<std::string, ff_probe_cache_entry>::iterator it = _gProbeCache.find(demux->descriptor);
+        if ( it == _gProbeCache.end() ) {
+            return;
+        }
+        evicted = it->second.codecpar;
+        _gProbeCache.erase(it);
+    }
+    avcodec_parameters_free(&evicted);
+}
+
+//-----------------------------------------------------------------------------
+// SV_MMAP_ACCESS_* to map the input with, or -1 to leave it to the ffmpeg protocols
+static int _ff_get_mmap_access(ffmpeg_stream_obj* demux)
+{
+    if ( demux->liveStream ||
+         strstr(demux->descriptor, "://") != NULL ||
+         sv_get_int_env_var(DEMUX_MMAP_VAR, 1) == 0 ) {
+        return -1;
+    }
+    if ( demux->mmapAccess == NULL ) {
+        return SV_MMAP_ACCESS_NORMAL;
+    }
+    if ( !_stricmp(demux->mmapAccess, "none") ) {
+        return -1;
+    }
+    if ( !_stricmp(demux->mmapAccess, "sequential") ) {
+        return SV_MMAP_ACCESS_SEQUENTIAL;
+    }
+    if ( !_stricmp(demux->mmapAccess, "random") ) {
+        return SV_MMAP_ACCESS_RANDOM;
+    }
+    return SV_MMAP_ACCESS_NORMAL;
+}
+
 //-----------------------------------------------------------------------------
 static int         ff_stream_open_in                (stream_obj* stream)
 {
@@ -545,6 +830,9 @@ static int         ff_stream_open_in                (stream_obj* stream)
     AVCodec*        codec;
     char            buf[256];
     int             analyzeduration = 5;
+    bool            shortProbe = false;
+    bool            fullProbe = false;
+    int             access;
 
 TryAgain:
     if (demux->descriptor == NULL) {
@@ -573,6 +861,18 @@ TryAgain:
         av_dict_set(&dict, "broken_sizes", "1", 0);
     }
 
+    access = _ff_get_mmap_access(demux);
+    if ( access >= 0 ) {
+        demux->mmapIo = ffmpeg_create_mmap_io(demux->descriptor, access);
+        if ( demux->mmapIo != NULL ) {
+            demux->format = avformat_alloc_context();
+            demux->format->pb = demux->mmapIo;
+            demux->format->flags |= AVFMT_FLAG_CUSTOM_IO;
+        } else {
+            demux->logCb(logDebug, _FMT("Failed to map " << SAFE_URL(demux, buf) << ", reading it as a file"));
+        }
+    }
+
     // Open the stream
     res = avformat_open_input(&demux->format,
                             demux->descriptor,
@@ -601,7 +901,9 @@ TryAgain:
 
     // Read a bit of the input and determine it's format.
     if ( demux->format->nb_streams == 0 ) {
-        av_opt_set_int(demux->format, "analyzeduration", analyzeduration*1000*1000, 0);
+        shortProbe = ( demux->liveStream && !fullProbe && _ff_probe_cache_has(demux) );
+        av_opt_set_int(demux->format, "analyzeduration",
+                       shortProbe ? kCachedAnalyzeDurationMs*1000 : analyzeduration*1000*1000, 0);
         res = avformat_find_stream_info(demux->format, NULL);
         if (res < 0) {
             demux->logCb(logError, _FMT("Failed to retrieve stream information for "
@@ -675,6 +977,14 @@ TryAgain:
             demux->logCb(logDebug, _FMT("Found unsupported stream type " << codecType));
         }
     }
+    if ( shortProbe && (V_STREAM(demux).id == -1 || _ff_probe_cache_apply(demux) < 0) ) {
+        demux->logCb(logInfo, _FMT("Stream parameters of " << SAFE_URL(demux, buf) <<
+                                    " had changed since the last connection; probing again"));
+        _ff_probe_cache_drop(demux);
+        ff_stream_close(stream);
+        fullProbe = true;
+        goto TryAgain;
+    }
     if (V_STREAM(demux).id == -1) {
         demux->logCb(logError, _FMT("Couldn't find video stream in " << SAFE_URL(demux, buf) ));
         res = -7;
@@ -717,10 +1027,18 @@ TryAgain:
     // Disable indexing to save memory
     demux->format->max_index_size = 0;
 
+    _ff_apply_audio_discard(demux);
+
     // attempt to access SPS/PPS on this stream
     _ff_stream_save_sps_pps_annexb(demux);
+    _ff_stream_init_normalizer(demux);
 
-    demux->logCb(logTrace, _FMT("Opened demux object " << (void*)stream));
+    if ( demux->liveStream ) {
+        _ff_probe_cache_put(demux);
+    }
+
+    demux->logCb(logTrace, _FMT("Opened demux object " << (void*)stream <<
+                                (shortProbe ? " using cached stream parameters" : "")));
     demux->startTime = sv_time_get_current_epoch_time();
     return 0;
 
@@ -888,15 +1206,23 @@ static int         ff_stream_read_frame        (stream_obj* stream, frame_obj**
         } else if (packet->stream_index == V_STREAM(demux).id) {
             // all is good, return this frame
             mediaType = mediaVideo;
+            if ( demux->normalizer ) {
+                _ff_stream_normalize_packet(demux, packet);
+            }
             if ( demux->keyframeOnly && (packet->flags & AV_PKT_FLAG_KEY) == 0 ) {
                 SKIP_PACKET(packet);
             } else {
                 lastPts = &V_STREAM(demux).lastPts;
             }
         } else if (packet->stream_index == A_STREAM(demux).id) {
-            // all is good, return this frame
-            mediaType = mediaAudio;
-            lastPts = &A_STREAM(demux).lastPts;
+            if ( demux->discardAudio ) {
+                // not every format honors AVDISCARD_ALL
+                SKIP_PACKET(packet);
+            } else {
+                // all is good, return this frame
+                mediaType = mediaAudio;
+                lastPts = &A_STREAM(demux).lastPts;
+            }
         } else {
             TRACE(_FMT("Unrecognized stream ID: stream=" << packet->stream_index << " videoStreamId=" << V_STREAM(demux).id));
             SKIP_PACKET(packet);
@@ -943,6 +1269,7 @@ static int         ff_stream_read_frame        (stream_obj* stream, frame_obj**
         s.lastFrameTime = sv_time_get_current_epoch_time();
 
         fapi->set_media_type(newFrame, mediaType);
+        frame_trace_begin(newFrame, 0);
         TRACE(_FMT("Read frame: keyframe="<< fapi->get_keyframe_flag(newFrame) <<
                                " timeToRead=" << acquisition <<
                                " pts=" << fapi->get_pts(newFrame) <<
@@ -1014,7 +1341,10 @@ static int         ff_stream_close             (stream_obj* stream)
         _ff_log_stats(demux, true);
         avformat_close_input(&demux->format);
     }
+    // not owned by the format context
+    ffmpeg_close_mmap_io(&demux->mmapIo);
     avcodec_free_context(&demux->videoCodec);
+    annexb_normalizer_destroy(&demux->normalizer);
     V_STREAM(demux).id = -1;
     A_STREAM(demux).id = -1;
     demux->eof = 0;
@@ -1037,6 +1367,7 @@ static void ff_stream_destroy         (stream_obj* stream)
     }
     sv_freep(&demux->sps);
     sv_freep(&demux->pps);
+    sv_freep(&demux->mmapAccess);
     stream_destroy( stream );
 }
 
@@ -9,11 +9,52 @@
 #include "videolibUtils.h"
 #include "frame_basic.h"
 
+#include <list>
+#include <mutex>
+#include <vector>
+
 #define FFENC_STREAM_MAGIC 0x1713
 #define MAX_PARAM 10
 #define FORCE_INTERLEAVED_AUDIO 1
 
+// Opened video encoders outlive the streams using them for this long, so the
+// next stream configured the same way can pick them up instead of opening one
+static const size_t  kEncoderPoolSize = 4;
+static const INT64_T kEncoderPoolIdleMs = 60000;
+
 extern "C" stream_api_t*     get_resize_factory_api                    ();
+extern "C" AVBufferRef*      videolib_get_hw_device_ctx                (int index, const char** name);
+
+//-----------------------------------------------------------------------------
+// Hardware H264 encoders, by the decoder device they run on. Some take frames
+// in system memory, some only frames on the device (uploaded, unless they've
+// been decoded there); frames decoded on the device go in as they are where
+// the encoder accepts them.
+typedef struct ffenc_hw_encoder {
+    const char*         device;
+    const char*         encoder;
+    enum AVPixelFormat  devicePixFmt;   // AV_PIX_FMT_NONE if frames can't go in on the device
+    bool                deviceFramesOnly;
+    bool                bindDevice;     // encodes on the device it's given, rather than picking one itself
+} ffenc_hw_encoder;
+
+static const ffenc_hw_encoder _kHwEncoders[] = {
+    { "cuda",           "h264_nvenc",           AV_PIX_FMT_CUDA,            false,  true  },
+    { "vaapi",          "h264_vaapi",           AV_PIX_FMT_VAAPI,           true,   true  },
+    { "qsv",            "h264_qsv",             AV_PIX_FMT_QSV,             false,  true  },
+    { "videotoolbox",   "h264_videotoolbox",    AV_PIX_FMT_VIDEOTOOLBOX,    false,  false },
+    { "d3d11va",        "h264_mf",              AV_PIX_FMT_NONE,            false,  false },
+    { "dxva2",          "h264_mf",              AV_PIX_FMT_NONE,            false,  false },
+};
+
+//-----------------------------------------------------------------------------
+// An encoder to try opening, in order: hardware ones first if asked for, software last
+typedef struct ffenc_candidate {
+    AVCodec*            codec;
+    AVBufferRef*        device;         // NULL for software
+    enum AVPixelFormat  hwPixFmt;       // frames go in on the device, AV_PIX_FMT_NONE if in system memory
+    bool                bindDevice;
+} ffenc_candidate;
 
 
 //-----------------------------------------------------------------------------
@@ -45,11 +86,32 @@ typedef struct ffenc_stream  : public stream_base {
 
     int                 h264profile;
     int                 h264level;
+    int                 h264profileSet; // outside of HLS, only applied when asked for
+    int                 inbandHeaders;  // SPS/PPS go with each keyframe, rather than in extradata
+    int                 hwEncoder;      // try hardware encoders before the software one
+    const char*         encoderName;    // of the encoder actually opened
+    int                 hwEncoding;
+    AVFrame*            hwFrame;        // device frame handed to the encoder
 
     frame_allocator*    fa;
     frame_obj*          nextFrame;
+
+    int                 pooled;         // take the encoder from, and return it to, the pool
+    std::string*        poolKey;        // configuration the encoder was opened with
+    int                 forceKeyframe;  // first frame into an encoder taken from the pool
 } ffenc_stream_obj;
 
+//-----------------------------------------------------------------------------
+typedef struct ffenc_pool_entry {
+    std::string         key;
+    AVCodecContext*     codecContext;
+    AVFrame*            encFrame;
+    INT64_T             idleSince;
+} ffenc_pool_entry;
+
+static std::mutex                       _gEncoderPoolMutex;
+static std::list<ffenc_pool_entry>      _gEncoderPool;
+
 
 //-----------------------------------------------------------------------------
 // Stream API
@@ -128,8 +190,17 @@ static stream_obj*   ffenc_stream_create                (const char* name)
     res->spsSize = res->ppsSize = 0;
     res->h264profile = h264Baseline;
     res->h264level = 31;
+    res->h264profileSet = 0;
+    res->inbandHeaders = 0;
+    res->hwEncoder = 0;
+    res->encoderName = NULL;
+    res->hwEncoding = 0;
+    res->hwFrame = NULL;
     res->fa = create_frame_allocator(_STR("encoder_"<<name));
     res->nextFrame = NULL;
+    res->pooled = 0;
+    res->poolKey = NULL;
+    res->forceKeyframe = 0;
 
     return (stream_obj*)res;
 }
@@ -153,8 +224,15 @@ static int         ffenc_stream_set_param             (stream_obj* stream,
     SET_PARAM_IF(stream, name, "canUpdatePixfmt", int, encoder->canUpdatePixfmt);
     SET_PARAM_IF(stream, name, "videoQualityPreset", int, encoder->videoQualityPreset);
     SET_PARAM_IF(stream, name, "hlsHibernating", int, encoder->hlsHibernating);
-    SET_PARAM_IF(encoder, name, "h264profile", int, encoder->h264profile);
+    if ( !_stricmp(name, "h264profile") ) {
+        encoder->h264profile = *(const int*)value;
+        encoder->h264profileSet = 1;
+        return 0;
+    }
     SET_PARAM_IF(encoder, name, "h264level", int, encoder->h264level);
+    SET_PARAM_IF(encoder, name, "inbandHeaders", int, encoder->inbandHeaders);
+    SET_PARAM_IF(encoder, name, "pooled", int, encoder->pooled);
+    SET_PARAM_IF(encoder, name, "hwEncoder", int, encoder->hwEncoder);
     SET_STR_PARAM_IF(stream, name, "preset", encoder->preset);
 
 
@@ -174,6 +252,8 @@ static int         ffenc_stream_get_param             (stream_obj* stream,
     if ( encoder->mediaType == mediaVideo ) {
         COPY_PARAM_IF(encoder, name, "videoCodecId", int, encoder->dstCodecId);
         COPY_PARAM_IF(encoder, name, "encoderDelay", int, encoder->encoderDelay);
+        COPY_PARAM_IF(encoder, name, "encoderName", const char*, encoder->encoderName);
+        COPY_PARAM_IF(encoder, name, "hwEncoding", int, encoder->hwEncoding);
         if ( !encoder->passthrough ) {
             COPY_PARAM_IF(encoder, name, "sps", void*, encoder->sps);
             COPY_PARAM_IF(encoder, name, "spsSize", int, encoder->spsSize);
@@ -222,69 +302,260 @@ static int        _ffenc_get_compatible_pixfmt      (ffenc_stream_obj* mux)
     return pfmtYUV420P;
 }
 
+//-----------------------------------------------------------------------------
+// Frees what the pool has held on to for too long, or to make room for one
+// more. Called with _gEncoderPoolMutex held; the caller frees the contexts
+// once it lets go of it, as closing one may mean joining its threads.
+static void       _ffenc_pool_evict_l               (size_t keep,
+                                                    std::vector<ffenc_pool_entry>& evicted)
+{
+    std::list<ffenc_pool_entry>::iterator it = _gEncoderPool.begin();
+    while ( it != _gEncoderPool.end() ) {
+        if ( sv_time_get_elapsed_time(it->idleSince) > kEncoderPoolIdleMs ) {
+            evicted.push_back(*it);
+            it = _gEncoderPool.erase(it);
+        } else {
+            it++;
+        }
+    }
+    // oldest entries are at the front
+    while ( _gEncoderPool.size() > keep ) {
+        evicted.push_back(_gEncoderPool.front());
+        _gEncoderPool.pop_front();
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void       _ffenc_pool_free                  (std::vector<ffenc_pool_entry>& evicted)
+{
+    for (size_t nI=0; nI<evicted.size(); nI++) {
+        avcodec_free_context(&evicted[nI].codecContext);
+        av_frame_free(&evicted[nI].encFrame);
+    }
+    if ( !evicted.empty() ) {
+        TRACE(_FMT("Freed " << evicted.size() << " pooled encoders"));
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Takes an encoder opened with the same configuration out of the pool
+static bool       _ffenc_pool_take                  (const std::string& key,
+                                                    AVCodecContext** codecContext,
+                                                    AVFrame** encFrame)
+{
+    std::vector<ffenc_pool_entry> evicted;
+    bool                          found = false;
+    {
+        std::lock_guard<std::mutex> guard(_gEncoderPoolMutex);
+        _ffenc_pool_evict_l(kEncoderPoolSize, evicted);
+        // most recently returned entries are at the back
+        for (std::list<ffenc_pool_entry>::reverse_iterator it = _gEncoderPool.rbegin(); it != _gEncoderPool.rend(); it++) {
+            if ( it->key == key ) {
+                *codecContext = it->codecContext;
+                *encFrame = it->encFrame;
+                _gEncoderPool.erase(std::next(it).base());
+                found = true;
+                break;
+            }
+        }
+    }
+    _ffenc_pool_free(evicted);
+    return found;
+}
+
+//-----------------------------------------------------------------------------
+// Hands the encoder of the stream over to the pool, if it can be reset for
+// another stream. Returns false if the caller is to free it.
+static bool       _ffenc_pool_return                (ffenc_stream_obj* encoder)
+{
+#ifdef AV_CODEC_CAP_ENCODER_FLUSH
+    if ( !encoder->pooled ||
+         encoder->poolKey == NULL ||
+         encoder->codecContext == NULL ||
+         encoder->encFrame == NULL ||
+         !(encoder->codecContext->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH) ) {
+        return false;
+    }
+
+    // drops the frames still in the encoder, and what it had learned from them
+    avcodec_flush_buffers(encoder->codecContext);
+
+    ffenc_pool_entry entry;
+    entry.key = *encoder->poolKey;
+    entry.codecContext = encoder->codecContext;
+    entry.encFrame = encoder->encFrame;
+    entry.idleSince = sv_time_get_current_epoch_time();
+    encoder->codecContext = NULL;
+    encoder->encFrame = NULL;
+
+    std::vector<ffenc_pool_entry> evicted;
+    {
+        std::lock_guard<std::mutex> guard(_gEncoderPoolMutex);
+        _ffenc_pool_evict_l(kEncoderPoolSize-1, evicted);
+        _gEncoderPool.push_back(entry);
+    }
+    _ffenc_pool_free(evicted);
+    TRACE(_FMT("Returned encoder of " << encoder->name << " to the pool"));
+    return true;
+#else
+    return false;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Everything an encoder was opened with, so that pooled encoders are only
+// reused where a newly opened one would produce the same stream
+static std::string _ffenc_pool_key                  (ffenc_stream_obj* encoder,
+                                                    AVCodecContext* codecContext,
+                                                    AVDictionary* dict)
+{
+    char*       sDict = NULL;
+    av_dict_get_string(dict, &sDict, '=', ',');
+    std::string key = _STR(codecContext->codec->name <<
+                        " " << codecContext->width << "x" << codecContext->height <<
+                        " pixfmt=" << codecContext->pix_fmt <<
+                        "/" << (codecContext->hw_frames_ctx ? ((AVHWFramesContext*)codecContext->hw_frames_ctx->data)->sw_format : AV_PIX_FMT_NONE) <<
+                        " device=" << (void*)(codecContext->hw_frames_ctx ? ((AVHWFramesContext*)codecContext->hw_frames_ctx->data)->device_ref->data :
+                                              codecContext->hw_device_ctx ? codecContext->hw_device_ctx->data : NULL) <<
+                        " range=" << codecContext->color_range <<
+                        " flags=" << codecContext->flags <<
+                        " gop=" << codecContext->gop_size <<
+                        " keyint_min=" << codecContext->keyint_min <<
+                        " bitrate=" << codecContext->bit_rate <<
+                        "/" << codecContext->rc_min_rate <<
+                        "/" << codecContext->rc_max_rate <<
+                        "/" << codecContext->rc_buffer_size <<
+                        " profile=" << codecContext->profile <<
+                        " level=" << codecContext->level <<
+                        " threads=" << codecContext->thread_count <<
+                        " vqp=" << encoder->videoQualityPreset <<
+                        " opts=" << (sDict ? sDict : ""));
+    av_freep(&sDict);
+    return key;
+}
+
 //-----------------------------------------------------------------------------
 static int        _ffsink_configure_h264_encoder   (ffenc_stream_obj* encoder,
                                                     AVCodecContext* codecContext,
                                                     AVDictionary*& dict );
 
-static int       _ffenc_prepare_video_encoder (ffenc_stream_obj* encoder)
+//-----------------------------------------------------------------------------
+static bool       _ffenc_codec_takes_pixfmt         (const AVCodec* codec,
+                                                    enum AVPixelFormat pixfmt)
 {
-    stream_obj* stream = (stream_obj*)encoder;
+    if ( codec->pix_fmts == NULL ) {
+        return true;
+    }
+    for (const enum AVPixelFormat* p = codec->pix_fmts; *p != AV_PIX_FMT_NONE; p++) {
+        if ( *p == pixfmt ) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    if ( encoder->srcCodecId != streamBitmap ) {
-        encoder->logCb(logError, _FMT("Can't proceed with recording: this filter will encode raw frames"));
-        return -1;
+//-----------------------------------------------------------------------------
+// Hardware encoders that could take frames of the pixel format: on the device
+// the frames come from, if they're still there, and on the decoder devices otherwise
+static void       _ffenc_add_hw_candidates          (ffenc_stream_obj* encoder,
+                                                    enum AVPixelFormat swPixFmt,
+                                                    std::vector<ffenc_candidate>& candidates)
+{
+    AVBufferRef*        upstreamFrames = NULL;
+    size_t              size = sizeof(upstreamFrames);
+    AVHWFramesContext*  upstream = NULL;
+
+    if ( default_get_param((stream_obj*)encoder, "hwFramesContext", &upstreamFrames, &size) >= 0 &&
+         upstreamFrames != NULL ) {
+        upstream = (AVHWFramesContext*)upstreamFrames->data;
     }
 
-    int pix_fmt = default_get_pixel_format(stream);
-    if ( !_ffenc_is_compatible_pixfmt(encoder, pix_fmt) ) {
-        int pixfmtSet = _ffenc_get_compatible_pixfmt(encoder);
-        if ( encoder->canUpdatePixfmt ) {
-            if ( default_set_param(stream, "updatePixfmt", &pixfmtSet) < 0 ) {
-                encoder->logCb(logError, _FMT("Failed to update a pixel format converter"));
-                return -1;
-            }
-        } else {
-            TRACE(_FMT("Auto-inserting pixfmt converter from " << pix_fmt << " to " << pfmtYUV420P ));
-            std::string elname(_STR(encoder->name<<".pixfmtconv"));
-            default_insert_element(&encoder->source, &encoder->sourceApi, NULL, get_resize_factory_api()->create(elname.c_str()), svFlagStreamInitialized);
-            if ( default_set_param(stream, _STR(elname<<".pixfmt"), &pixfmtSet) < 0 ||
-                 // initialize new element directly
-                 encoder->sourceApi->open_in(encoder->source) < 0 ) {
-                encoder->logCb(logError, _FMT("Failed to auto-insert a pixel format converter"));
-                return -1;
+    const char*     deviceName = NULL;
+    AVBufferRef*    device;
+    for (int nDev=-1; ; nDev++) {
+        if ( nDev < 0 ) {
+            // encoding where the frames are beats anything else
+            if ( upstream == NULL ) {
+                continue;
             }
+            device = upstream->device_ref;
+            deviceName = av_hwdevice_get_type_name(upstream->device_ctx->type);
+        } else if ( (device = videolib_get_hw_device_ctx(nDev, &deviceName)) == NULL ) {
+            break;
+        } else if ( upstream != NULL && device->data == upstream->device_ref->data ) {
+            continue;
         }
-        pix_fmt = pixfmtSet;
-    }
 
+        for (size_t nI=0; nI<sizeof(_kHwEncoders)/sizeof(_kHwEncoders[0]); nI++) {
+            const ffenc_hw_encoder& hw = _kHwEncoders[nI];
+            if ( _stricmp(hw.device, deviceName) ) {
+                continue;
+            }
+            AVCodec* codec = avcodec_find_encoder_by_name(hw.encoder);
+            if ( codec == NULL ) {
+                continue;
+            }
 
-    AVCodec*        codec;
-    enum AVCodecID  codec_id;
-    AVDictionary*   dict = NULL;
-    int             res = -1;
-
-    switch ( encoder->dstCodecId ) {
-    case streamGIF:     codec_id = AV_CODEC_ID_GIF; break;
-    case streamJPG:
-    case streamMJPEG:   codec_id = AV_CODEC_ID_MJPEG; break;
-    case streamH264:
-    default:            codec_id = AV_CODEC_ID_H264; break;
+            ffenc_candidate candidate;
+            candidate.codec = codec;
+            candidate.device = device;
+            candidate.bindDevice = hw.bindDevice;
+            candidate.hwPixFmt = AV_PIX_FMT_NONE;
+            if ( hw.deviceFramesOnly || (nDev < 0 && hw.devicePixFmt == upstream->format) ) {
+                candidate.hwPixFmt = hw.devicePixFmt;
+            } else if ( !_ffenc_codec_takes_pixfmt(codec, swPixFmt) ) {
+                TRACE(_FMT("Encoder " << hw.encoder << " doesn't take pixfmt " << av_get_pix_fmt_name(swPixFmt)));
+                continue;
+            }
+            candidates.push_back(candidate);
+        }
     }
+}
 
-    if ( codec_id == AV_CODEC_ID_H264 ) {
-        const char* encoderName = "libx264";
-        if ( pix_fmt == pfmtRGB24 || pix_fmt == pfmtBGR24 )
-            encoderName = "libx264rgb";
-        codec = avcodec_find_encoder_by_name(encoderName);
-    } else {
-        codec = avcodec_find_encoder(codec_id);
+//-----------------------------------------------------------------------------
+// Frames context of the encoder, for frames going in on the device
+static int        _ffenc_create_hw_frames           (ffenc_stream_obj* encoder,
+                                                    AVCodecContext* codecContext,
+                                                    const ffenc_candidate& candidate)
+{
+    AVBufferRef* frames = av_hwframe_ctx_alloc(candidate.device);
+    if ( frames == NULL ) {
+        encoder->logCb(logError, _FMT("Failed to allocate hardware frames context"));
+        return -1;
     }
-    if ( !codec ) {
-        encoder->logCb(logError, _FMT("Can't proceed with recording: codec was not found"));
+
+    AVHWFramesContext* framesCtx = (AVHWFramesContext*)frames->data;
+    framesCtx->format = candidate.hwPixFmt;
+    framesCtx->sw_format = codecContext->pix_fmt;
+    framesCtx->width = codecContext->width;
+    framesCtx->height = codecContext->height;
+    // surfaces to upload into, when frames don't come in on the device already
+    framesCtx->initial_pool_size = (framesCtx->device_ctx->type == AV_HWDEVICE_TYPE_QSV) ? 8 : 0;
+
+    int res = av_hwframe_ctx_init(frames);
+    if ( res < 0 ) {
+        encoder->logCb(logInfo, _FMT("Failed to create " << av_get_pix_fmt_name(candidate.hwPixFmt) <<
+                                    " frames of " << av_get_pix_fmt_name(framesCtx->sw_format) <<
+                                    ": " << av_err2str(res)));
+        av_buffer_unref(&frames);
         return -1;
     }
+    codecContext->hw_frames_ctx = frames;
+    codecContext->pix_fmt = candidate.hwPixFmt;
+    return 0;
+}
 
+//-----------------------------------------------------------------------------
+static int       _ffenc_open_video_encoder    (ffenc_stream_obj* encoder,
+                                               enum AVCodecID codec_id,
+                                               int pix_fmt,
+                                               const ffenc_candidate& candidate)
+{
+    stream_obj*         stream = (stream_obj*)encoder;
+    AVCodec*            codec = candidate.codec;
+    AVDictionary*       dict = NULL;
+    enum AVPixelFormat  swPixFmt;
+    int                 res = -1;
 
     AVCodecContext* codecContext = avcodec_alloc_context3(codec);
     if (!codecContext) {
@@ -303,6 +574,15 @@ static int       _ffenc_prepare_video_encoder (ffenc_stream_obj* encoder)
     codecContext->max_b_frames = 0;
     codecContext->time_base.num = 1;
     codecContext->time_base.den = 1000;
+    swPixFmt = codecContext->pix_fmt;
+
+    if ( candidate.hwPixFmt != AV_PIX_FMT_NONE ) {
+        if ( _ffenc_create_hw_frames(encoder, codecContext, candidate) < 0 ) {
+            goto Error;
+        }
+    } else if ( candidate.device != NULL && candidate.bindDevice ) {
+        codecContext->hw_device_ctx = av_buffer_ref(candidate.device);
+    }
 
     encoder->logCb(logDebug, _FMT("Opening codec " << codec->long_name <<
                             "(" << codec->id << ") hls=" << encoder->hls <<
@@ -315,7 +595,29 @@ static int       _ffenc_prepare_video_encoder (ffenc_stream_obj* encoder)
         av_opt_set(codecContext, "gifflags", "-offsetting-transdiff", AV_OPT_SEARCH_CHILDREN);
     }
 
-    codecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if ( !encoder->inbandHeaders ) {
+        codecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    }
+
+    if ( encoder->pooled ) {
+        AVCodecContext* pooledContext = NULL;
+        AVFrame*        pooledFrame = NULL;
+
+        delete encoder->poolKey;
+        encoder->poolKey = new std::string(_ffenc_pool_key(encoder, codecContext, dict));
+        if ( _ffenc_pool_take(*encoder->poolKey, &pooledContext, &pooledFrame) ) {
+            encoder->logCb(logDebug, _FMT("Reusing a pooled encoder: " << *encoder->poolKey));
+            av_dict_free(&dict);
+            avcodec_free_context(&codecContext);
+            codecContext = pooledContext;
+            av_frame_free( &encoder->encFrame );
+            encoder->encFrame = pooledFrame;
+            // the stream had better start where a consumer can pick it up
+            encoder->forceKeyframe = 1;
+            res = 0;
+            goto Opened;
+        }
+    }
 
 
     av_frame_free( &encoder->encFrame );
@@ -326,16 +628,18 @@ static int       _ffenc_prepare_video_encoder (ffenc_stream_obj* encoder)
     }
     encoder->encFrame->width = codecContext->width;
     encoder->encFrame->height = codecContext->height;
-    encoder->encFrame->format = codecContext->pix_fmt;
+    encoder->encFrame->format = swPixFmt;
 
     res = avcodec_open2(codecContext, codec, &dict);
     av_dict_free(&dict);
 
     if ( res < 0 ) {
-        encoder->logCb(logError, _FMT("Failed to open H264 encoder:" << av_err2str(res)));
+        encoder->logCb(candidate.device ? logInfo : logError,
+                        _FMT("Failed to open " << codec->name << " encoder:" << av_err2str(res)));
         goto Error;
     }
 
+Opened:
     if ( codecContext->extradata_size != 0 ) {
         videolibapi_extradata_to_spspps( codecContext->extradata,
                                         codecContext->extradata_size,
@@ -343,8 +647,11 @@ static int       _ffenc_prepare_video_encoder (ffenc_stream_obj* encoder)
                                         &encoder->pps, &encoder->ppsSize );
     }
 
+    encoder->encoderName = codec->name;
+    encoder->hwEncoding = (candidate.device != NULL);
     res = 0;
 Error:
+    av_dict_free(&dict);
     if ( res != 0 ) {
         avcodec_free_context(&codecContext);
     } else {
@@ -354,39 +661,151 @@ Error:
     return res;
 }
 
+//-----------------------------------------------------------------------------
+static int       _ffenc_prepare_video_encoder (ffenc_stream_obj* encoder)
+{
+    stream_obj* stream = (stream_obj*)encoder;
+
+    if ( encoder->srcCodecId != streamBitmap ) {
+        encoder->logCb(logError, _FMT("Can't proceed with recording: this filter will encode raw frames"));
+        return -1;
+    }
+
+    int pix_fmt = default_get_pixel_format(stream);
+    if ( !_ffenc_is_compatible_pixfmt(encoder, pix_fmt) ) {
+        int pixfmtSet = _ffenc_get_compatible_pixfmt(encoder);
+        if ( encoder->canUpdatePixfmt ) {
+            if ( default_set_param(stream, "updatePixfmt", &pixfmtSet) < 0 ) {
+                encoder->logCb(logError, _FMT("Failed to update a pixel format converter"));
+                return -1;
+            }
+        } else {
+            TRACE(_FMT("Auto-inserting pixfmt converter from " << pix_fmt << " to " << pfmtYUV420P ));
+            std::string elname(_STR(encoder->name<<".pixfmtconv"));
+            default_insert_element(&encoder->source, &encoder->sourceApi, NULL, get_resize_factory_api()->create(elname.c_str()), svFlagStreamInitialized);
+            if ( default_set_param(stream, _STR(elname<<".pixfmt"), &pixfmtSet) < 0 ||
+                 // initialize new element directly
+                 encoder->sourceApi->open_in(encoder->source) < 0 ) {
+                encoder->logCb(logError, _FMT("Failed to auto-insert a pixel format converter"));
+                return -1;
+            }
+        }
+        pix_fmt = pixfmtSet;
+    }
+
+
+    AVCodec*        codec;
+    enum AVCodecID  codec_id;
+    int             res = -1;
+
+    switch ( encoder->dstCodecId ) {
+    case streamGIF:     codec_id = AV_CODEC_ID_GIF; break;
+    case streamJPG:
+    case streamMJPEG:   codec_id = AV_CODEC_ID_MJPEG; break;
+    case streamH264:
+    default:            codec_id = AV_CODEC_ID_H264; break;
+    }
+
+    std::vector<ffenc_candidate> candidates;
+    if ( codec_id == AV_CODEC_ID_H264 && encoder->hwEncoder ) {
+        enum AVColorRange range;
+        _ffenc_add_hw_candidates(encoder,
+                                 svpfmt_to_ffpfmt_ext(pix_fmt, &range, encoder->dstCodecId),
+                                 candidates);
+    }
+
+    if ( codec_id == AV_CODEC_ID_H264 ) {
+        const char* encoderName = "libx264";
+        if ( pix_fmt == pfmtRGB24 || pix_fmt == pfmtBGR24 )
+            encoderName = "libx264rgb";
+        codec = avcodec_find_encoder_by_name(encoderName);
+    } else {
+        codec = avcodec_find_encoder(codec_id);
+    }
+    if ( codec ) {
+        ffenc_candidate software = { codec, NULL, AV_PIX_FMT_NONE, false };
+        candidates.push_back(software);
+    } else if ( candidates.empty() ) {
+        encoder->logCb(logError, _FMT("Can't proceed with recording: codec was not found"));
+        return -1;
+    }
+
+    for (size_t nI=0; nI<candidates.size() && res < 0; nI++) {
+        res = _ffenc_open_video_encoder(encoder, codec_id, pix_fmt, candidates[nI]);
+        if ( res < 0 && nI+1 < candidates.size() ) {
+            encoder->logCb(logInfo, _FMT("Falling back from " << candidates[nI].codec->name <<
+                                        " to " << candidates[nI+1].codec->name));
+        }
+    }
+    if ( res == 0 ) {
+        encoder->logCb(candidates.size() > 1 ? logInfo : logDebug,
+                        _FMT("Encoding with " << encoder->encoderName <<
+                            (encoder->codecContext->hw_frames_ctx ? " (device frames)" : "")));
+    }
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+static void       _ffsink_apply_h264_profile       (ffenc_stream_obj* encoder,
+                                                    AVCodecContext* codecContext,
+                                                    AVDictionary*& dict,
+                                                    bool software )
+{
+    const char* sProfile;
+    char        sLevel[16];
+
+    switch (encoder->h264profile) {
+    case h264Baseline:    sProfile = "baseline"; break;
+    case h264Main:        sProfile = "main"; break;
+    case h264High:        sProfile = "high"; break;
+    case h264Extended:    sProfile = "extended"; break;
+    default:              sProfile = "baseline"; break;
+    };
+    sprintf(sLevel, "%d.%d", encoder->h264level/10, encoder->h264level%10 );
+
+    if ( software ) {
+        av_dict_set(&dict, "profile", sProfile, 0);
+        av_dict_set(&dict, "level", sLevel, 0);
+    } else {
+        // option names and values differ between hardware encoders, these don't
+        switch (encoder->h264profile) {
+        case h264Main:        codecContext->profile = FF_PROFILE_H264_MAIN; break;
+        case h264High:        codecContext->profile = FF_PROFILE_H264_HIGH; break;
+        case h264Extended:    codecContext->profile = FF_PROFILE_H264_EXTENDED; break;
+        default:              codecContext->profile = FF_PROFILE_H264_CONSTRAINED_BASELINE; break;
+        };
+        codecContext->level = encoder->h264level;
+    }
+}
+
 //-----------------------------------------------------------------------------
 static int        _ffsink_configure_h264_encoder   (ffenc_stream_obj* encoder,
                                                     AVCodecContext* codecContext,
                                                     AVDictionary*& dict )
 {
     int             bitrate = 0;
+    bool            software = !strncmp(codecContext->codec->name, "libx264", 7);
     if ( encoder->hls ) {
-        const char* sProfile;
-        char        sLevel[16];
-
-        switch (encoder->h264profile) {
-        case h264Baseline:    sProfile = "baseline"; break;
-        case h264Main:        sProfile = "main"; break;
-        case h264High:        sProfile = "high"; break;
-        case h264Extended:    sProfile = "extended"; break;
-        default:              sProfile = "baseline"; break;
-        };
-
         if ( (encoder->h264level < 30 || encoder->h264level > 32) &&
              (encoder->h264level < 40 || encoder->h264level > 42) ) {
             // TODO: Should determine the bitrate
             encoder->h264level = 31;
         }
-        sprintf(sLevel, "%d.%d", encoder->h264level/10, encoder->h264level%10 );
 
         bitrate = encoder->max_bitrate > 0 ? encoder->max_bitrate : 256000;
         codecContext->gop_size = 10;
         codecContext->keyint_min = 1;
-        av_dict_set(&dict, "preset",  "ultrafast", 0);
-        av_dict_set(&dict, "profile", sProfile, 0);
-        av_dict_set(&dict, "level", sLevel, 0);
+        if ( software ) {
+            av_dict_set(&dict, "preset",  "ultrafast", 0);
+        }
+        _ffsink_apply_h264_profile(encoder, codecContext, dict, software);
         av_dict_set(&dict, "forced-idr", "1", 0);
     } else {
+        if ( encoder->h264profileSet && encoder->h264level > 0 ) {
+            // e.g. to match GOPs stream-copied next to ours
+            _ffsink_apply_h264_profile(encoder, codecContext, dict, software);
+        }
+
         size_t size = sizeof (int);
         if ( default_get_param((stream_obj*)encoder, "bitrate", &bitrate, &size) < 0 ) {
             bitrate = 0;
@@ -402,13 +821,13 @@ static int        _ffsink_configure_h264_encoder   (ffenc_stream_obj* encoder,
         codecContext->gop_size = encoder->gop_size ? encoder->gop_size : 42;
         codecContext->keyint_min = encoder->keyint_min ? encoder->keyint_min : 10;
 
-        if ( encoder->preset ) {
+        if ( encoder->preset && software ) {
             av_dict_set(&dict, "preset", encoder->preset, 0);
         }
     }
 
     int vqp = encoder->videoQualityPreset;
-    if ( vqp != svvpNotSpecified ) {
+    if ( vqp != svvpNotSpecified && software ) {
         int crf;
         if ( vqp <= svvpHighest )
             crf = 18;
@@ -593,6 +1012,57 @@ static int        _ffenc_receive_frame              (ffenc_stream_obj* encoder,
     return ret;
 }
 
+//-----------------------------------------------------------------------------
+// Points encFrame at the data of the frame, downloading it if it's on a device
+static void       _ffenc_fill_frame                (ffenc_stream_obj* encoder,
+                                                    frame_api_t* srcApi,
+                                                    frame_obj* srcFrame)
+{
+    av_image_fill_arrays(encoder->encFrame->data,
+                    encoder->encFrame->linesize,
+                    (const uint8_t*)srcApi->get_data(srcFrame),
+                    (enum AVPixelFormat)encoder->encFrame->format,
+                    encoder->codecContext->width,
+                    encoder->codecContext->height,
+                    _kDefAlign);
+}
+
+//-----------------------------------------------------------------------------
+// Gets hwFrame ready for an encoder taking frames on the device: frames which
+// are on it already go in as they are, anything else is uploaded
+static int        _ffenc_prepare_hw_frame          (ffenc_stream_obj* encoder,
+                                                    frame_api_t* srcApi,
+                                                    frame_obj* srcFrame)
+{
+    AVHWFramesContext*  framesCtx = (AVHWFramesContext*)encoder->codecContext->hw_frames_ctx->data;
+    AVFrame*            deviceFrame = (AVFrame*)srcApi->get_backing_obj(srcFrame, "hwframe");
+    int                 res;
+
+    if ( encoder->hwFrame == NULL &&
+         (encoder->hwFrame = av_frame_alloc()) == NULL ) {
+        return AVERROR(ENOMEM);
+    }
+    av_frame_unref(encoder->hwFrame);
+
+    if ( deviceFrame != NULL &&
+         deviceFrame->format == framesCtx->format &&
+         deviceFrame->width == encoder->codecContext->width &&
+         deviceFrame->height == encoder->codecContext->height &&
+         ((AVHWFramesContext*)deviceFrame->hw_frames_ctx->data)->device_ref->data == framesCtx->device_ref->data ) {
+        return av_frame_ref(encoder->hwFrame, deviceFrame);
+    }
+
+    _ffenc_fill_frame(encoder, srcApi, srcFrame);
+    res = av_hwframe_get_buffer(encoder->codecContext->hw_frames_ctx, encoder->hwFrame, 0);
+    if ( res >= 0 ) {
+        res = av_hwframe_transfer_data(encoder->hwFrame, encoder->encFrame, 0);
+    }
+    if ( res < 0 ) {
+        encoder->logCb(logError, _FMT("Failed to upload a frame to the encoder: " << av_err2str(res)));
+    }
+    return res;
+}
+
 //-----------------------------------------------------------------------------
 static int        _ffenc_encode_frame              (ffenc_stream_obj* encoder,
                                                     frame_api_t* srcApi,
@@ -602,19 +1072,23 @@ static int        _ffenc_encode_frame              (ffenc_stream_obj* encoder,
 
     if ( srcFrame ) {
         if ( encoder->mediaType == mediaVideo ) {
-            av_image_fill_arrays(encoder->encFrame->data,
-                            encoder->encFrame->linesize,
-                            (const uint8_t*)srcApi->get_data(srcFrame),
-                            encoder->codecContext->pix_fmt,
-                            encoder->codecContext->width,
-                            encoder->codecContext->height,
-                            _kDefAlign);
-            if ( encoder->hls && encoder->hlsHibernating ) {
-                encoder->encFrame->pict_type = AV_PICTURE_TYPE_I;
-                encoder->encFrame->key_frame = 1;
+            src = encoder->encFrame;
+            if ( encoder->codecContext->hw_frames_ctx ) {
+                int res = _ffenc_prepare_hw_frame(encoder, srcApi, srcFrame);
+                if ( res < 0 ) {
+                    return res;
+                }
+                src = encoder->hwFrame;
+            } else {
+                _ffenc_fill_frame(encoder, srcApi, srcFrame);
+            }
+            if ( (encoder->hls && encoder->hlsHibernating) || encoder->forceKeyframe ) {
+                src->pict_type = AV_PICTURE_TYPE_I;
+                src->key_frame = 1;
+                encoder->forceKeyframe = 0;
             } else {
-                encoder->encFrame->pict_type = AV_PICTURE_TYPE_NONE;
-                encoder->encFrame->key_frame = 0;
+                src->pict_type = AV_PICTURE_TYPE_NONE;
+                src->key_frame = 0;
             }
         } else {
             avcodec_fill_audio_frame(encoder->encFrame,
@@ -623,9 +1097,9 @@ static int        _ffenc_encode_frame              (ffenc_stream_obj* encoder,
                                     (const uint8_t*)srcApi->get_data(srcFrame),
                                     srcApi->get_data_size(srcFrame),
                                     _kDefAlign);
+            src = encoder->encFrame;
         }
-        src = encoder->encFrame;
-        encoder->lastInputPts = encoder->encFrame->pts = srcApi->get_pts(srcFrame);
+        encoder->lastInputPts = encoder->encFrame->pts = src->pts = srcApi->get_pts(srcFrame);
     }
 
     return avcodec_send_frame(encoder->codecContext, src);
@@ -691,8 +1165,11 @@ Error:
 static int         ffenc_stream_close             (stream_obj* stream)
 {
     DECLARE_STREAM_FF(stream, encoder);
-    avcodec_free_context(&encoder->codecContext);
-    av_frame_free( &encoder->encFrame );
+    if ( !_ffenc_pool_return(encoder) ) {
+        avcodec_free_context(&encoder->codecContext);
+        av_frame_free( &encoder->encFrame );
+    }
+    av_frame_free( &encoder->hwFrame );
     return 0;
 }
 
@@ -707,6 +1184,8 @@ static void ffenc_stream_destroy         (stream_obj* stream)
     sv_freep(&encoder->preset);
     sv_freep(&encoder->sps);
     sv_freep(&encoder->pps);
+    delete encoder->poolKey;
+    encoder->poolKey = NULL;
     stream_destroy( stream );
 }
 
@@ -38,6 +38,7 @@
 #include "sv_module_def.hpp"
 
 #include "streamprv.h"
+#include "sv_internal.h"
 #include "sv_ffmpeg.h"
 
 
@@ -45,10 +46,37 @@
 
 #include "videolibUtils.h"
 #include "event_basic.h"
+#include "clip_index.h"
+#include "file_io.h"
+#include "frame_avbuffer.h"
+#include "frame_props.h"
+#include "llhls_writer.h"
+#include "hls_store.h"
 
 #define FFSINK_STREAM_MAGIC 0x1515
 
 static const int kDefaultMaxFileDuration = 2*60*1000; // 2 min
+// bytes the async writer may fall behind by, before the overflow policy kicks in
+static const int kDefaultAsyncBudgetKb = 16*1024;
+// how often a blocked producer rechecks whether the writer is still there
+static const int kAsyncBlockWaitMs = 100;
+// size of the AVIO buffer files are written through; 0 to use ffmpeg's own file I/O
+static const int kDefaultIOBufferKb = 1024;
+// preallocation leaves room for bitrate spikes
+static const int kPreallocateSlackPct = 10;
+// live HLS
+static const int _kHLSSegmentTime = 2;
+static const int _kHLSSegmentListSize = 4;
+// parts of low-latency HLS segments
+static const int kDefaultHLSPartMs = 333;
+
+// What async output does, when the writer falls behind by more than the budget
+enum {
+    ffsinkOverflowBlock = 0,        // wait for the writer
+    ffsinkOverflowDropToKeyframe,   // drop packets until the next keyframe that fits
+};
+// parameter sets and the first slice are all we look at in a packet
+static const int kMaxScannedNALUs = 16;
 
 int _mux_packets_total(int *values)
 {
@@ -58,6 +86,27 @@ int _mux_packets_total(int *values)
     return res;
 }
 
+//-----------------------------------------------------------------------------
+// A file on its way out: what it takes to write the trailer and close it,
+// detached from the recorder, which can carry on with the next file
+typedef struct ffsink_output {
+    AVFormatContext*    formatCtx;
+    AVStream*           videoStream;
+    AVBSFContext*       h264bsfc;
+    llhls_writer*       llhls;
+    hls_store_owner*    hlsStore;
+    clip_index_writer*  indexWriter;
+    char*               uri;
+    int                 ioCustom;
+    int                 recordInRAM;
+    int                 videoCodecId;
+    INT64_T             firstPts;
+    INT64_T             lastVideoPts;
+    INT64_T             duration;
+    int                 packetsWritten[mediaTotal];
+    int                 packetsError[mediaTotal];
+} ffsink_output;
+
 //-----------------------------------------------------------------------------
 typedef struct ffsink_stream  : public stream_base  {
     char*               uri;
@@ -81,8 +130,21 @@ typedef struct ffsink_stream  : public stream_base  {
     int                 keyint_min;
     int                 videoQualityPreset;
     int64_t             hlsStartIndex;
+    int                 hlsLowLatency;      // fMP4 parts and our own playlist, rather than the hls muxer
+    int                 fragmented;         // mp4 recordings are written as a fragment per GOP
+    int                 hlsPartMs;
+    int                 hlsInMemory;        // live playlists and segments go to hls_store, not to disk
+    llhls_writer*       llhls;
+    hls_store_owner*    hlsStore;           // owns what the hls muxer wrote to the store
     const char*         preset;
     int                 recordInRAM;
+    int                 frameIndex;         // write a sidecar frame index next to each file
+    int                 ioBufferKb;
+    int                 ioPreallocate;      // reserve disk space for maxFileDurationMs worth of data
+    int                 ioBitrateKbps;      // expected bitrate, for preallocation; 0 to guess
+    int                 ioDirect;           // bypass the page cache
+    int                 ioCustom;           // formatCtx->pb is ours (file_io)
+    int64_t             observedBitrate;    // of the last file written, bits/sec
 
     // video params
     int                 videoCodecId;
@@ -106,6 +168,9 @@ typedef struct ffsink_stream  : public stream_base  {
     AVStream*           subtitleStream;
     int                 applyBitstreamFilter;
     AVBSFContext*       h264bsfc;
+    // the demux flags IDRs exactly, and puts SPS/PPS in front of them
+    // (annexb_normalizer.h); -1 until asked
+    int                 sourceNormalized;
     int                 videoStreamIndex;
     int                 audioStreamIndex;
     int                 subtitleStreamIndex;
@@ -122,12 +187,45 @@ typedef struct ffsink_stream  : public stream_base  {
     bool                outputInitialized;
 
     std::list<frame_obj*>*   savedFrames;
+    clip_index_writer*  indexWriter;
 
     int                 packetsWritten[mediaTotal];
     int                 packetsWrittenKeyframes;
     int                 packetsError[mediaTotal];
     int                 packetsLeadIn;
     int                 packetsRead;
+
+    // asynchronous output: frames are queued for a writer thread, rather than
+    // written by whoever drives the recorder
+    int                 asyncOutput;
+    int                 asyncBudgetKb;
+    int                 asyncOverflowPolicy;
+    sv_thread*          writer;
+    sv_mutex*           queueMutex;         // guards everything below
+    sv_event*           queueEvent;         // set when frames are queued, or the writer is to exit
+    sv_event*           spaceEvent;         // set when the writer frees up some budget
+    std::list< std::pair<frame_obj*, INT64_T> >* queue; // with the time frame was queued
+    size_t              queuedBytes;
+    bool                writerExiting;
+    bool                dropUntilKeyframe;
+    int                 packetsDropped;
+    stats_item_int      queueBytes;         // sampled as frames are queued
+    stats_item_int      writeLatency;       // ms from being queued to being written
+
+    // asynchronous rotation: files being rotated out are finished by a closer
+    // thread, while the next file is already being written
+    int                 asyncRotation;
+    sv_thread*          closer;
+    sv_mutex*           closeMutex;         // guards everything below
+    sv_event*           closeEvent;         // set when outputs are queued, or the closer is to exit
+    sv_event*           closedEvent;        // set when an output is done with
+    std::list<ffsink_output*>* closeQueue;
+    int                 closesPending;      // queued, or being finished
+    bool                closerExiting;
+    char*               pendingNewFile;     // announced once the files before it are closed
+    INT64_T             pendingNewFilePts;
+    // scheduling class of the writer and closer threads, see sv_thread_set_class
+    char*               threadClass;
 } ffsink_stream_obj;
 
 
@@ -159,9 +257,17 @@ static void        _ffsink_free_saved_frames        (ffsink_stream_obj* mux, boo
 static int         _ffsink_can_start_new_file       (ffsink_stream_obj* mux,
                                                     frame_obj* frame );
 static void        _ffsink_notify_new_file          (ffsink_stream_obj* mux,
+                                                    const char* uri,
                                                     int64_t firstPts);
 static void        _ffsink_notify_close_file       (ffsink_stream_obj* mux,
+                                                    const char* uri,
+                                                    int64_t firstPts,
                                                     int64_t lastPts);
+static int         _ffsink_process_frame           (ffsink_stream_obj* mux,
+                                                    frame_obj* frame);
+static void        _ffsink_stop_writer             (ffsink_stream_obj* mux);
+static void        _ffsink_stop_closer             (ffsink_stream_obj* mux);
+static void        _ffsink_wait_for_closer         (ffsink_stream_obj* mux);
 
 
 //-----------------------------------------------------------------------------
@@ -220,7 +326,20 @@ static stream_obj*   ffsink_stream_create                (const char* name)
     res->videoQualityPreset = svvpNotSpecified;
     res->preset = strdup("ultrafast");
     res->recordInRAM = 0;
+    res->frameIndex = 1;
+    res->ioBufferKb = kDefaultIOBufferKb;
+    res->ioPreallocate = 0;
+    res->ioBitrateKbps = 0;
+    res->ioDirect = 0;
+    res->ioCustom = 0;
+    res->observedBitrate = 0;
     res->hlsStartIndex = 0;
+    res->hlsLowLatency = 0;
+    res->fragmented = 0;
+    res->hlsPartMs = kDefaultHLSPartMs;
+    res->hlsInMemory = 0;
+    res->llhls = NULL;
+    res->hlsStore = NULL;
 
     res->nextURI = NULL;
     res->formatCtx = NULL;
@@ -248,6 +367,7 @@ static stream_obj*   ffsink_stream_create                (const char* name)
 
     res->applyBitstreamFilter = 0;
     res->h264bsfc = NULL;
+    res->sourceNormalized = -1;
 
     memset( res->packetsError, 0, sizeof(int)*mediaTotal );
     res->packetsLeadIn = 0;
@@ -258,9 +378,37 @@ static stream_obj*   ffsink_stream_create                (const char* name)
     res->dst_pix_fmt = pfmtUndefined;
     res->outputInitialized = false;
     res->savedFrames = new std::list<frame_obj*>;
+    res->indexWriter = NULL;
 
     res->mutex = sv_mutex_create();
 
+    res->asyncOutput = 0;
+    res->asyncBudgetKb = kDefaultAsyncBudgetKb;
+    res->asyncOverflowPolicy = ffsinkOverflowDropToKeyframe;
+    res->writer = NULL;
+    res->queueMutex = sv_mutex_create();
+    res->queueEvent = sv_event_create(0, 0);
+    res->spaceEvent = sv_event_create(0, 0);
+    res->queue = new std::list< std::pair<frame_obj*, INT64_T> >;
+    res->queuedBytes = 0;
+    res->writerExiting = false;
+    res->dropUntilKeyframe = false;
+    res->packetsDropped = 0;
+    stats_int_init(&res->queueBytes);
+    stats_int_init(&res->writeLatency);
+
+    res->asyncRotation = 0;
+    res->threadClass = NULL;
+    res->closer = NULL;
+    res->closeMutex = sv_mutex_create();
+    res->closeEvent = sv_event_create(0, 0);
+    res->closedEvent = sv_event_create(0, 0);
+    res->closeQueue = new std::list<ffsink_output*>;
+    res->closesPending = 0;
+    res->closerExiting = false;
+    res->pendingNewFile = NULL;
+    res->pendingNewFilePts = 0;
+
     return (stream_obj*)res;
 }
 
@@ -307,6 +455,10 @@ static int         ffsink_stream_set_param             (stream_obj* stream,
     SET_PARAM_IF(stream, name, "pixfmt", int, mux->src_pix_fmt);
     SET_PARAM_IF(stream, name, "hls", int, mux->hls);
     SET_PARAM_IF(stream, name, "hlsStartIndex", int64_t, mux->hlsStartIndex);
+    SET_PARAM_IF(stream, name, "hlsLowLatency", int, mux->hlsLowLatency);
+    SET_PARAM_IF(stream, name, "fragmented", int, mux->fragmented);
+    SET_PARAM_IF(stream, name, "hlsPartDurationMs", int, mux->hlsPartMs);
+    SET_PARAM_IF(stream, name, "hlsInMemory", int, mux->hlsInMemory);
     SET_PARAM_IF(stream, name, "bitrate_mutiplier", float, mux->bit_rate_multiplier);
     SET_PARAM_IF(stream, name, "max_bitrate", int, mux->max_bit_rate);
     SET_PARAM_IF(stream, name, "gop_size", int, mux->gop_size);
@@ -317,6 +469,16 @@ static int         ffsink_stream_set_param             (stream_obj* stream,
     SET_PARAM_IF(stream, name, "subtitleDuration", int, mux->subtitleDuration);
     SET_PARAM_IF(stream, name, "audioOn", int, mux->audioOn);
     SET_PARAM_IF(stream, name, "recordInRAM", int, mux->recordInRAM);
+    SET_PARAM_IF(stream, name, "frameIndex", int, mux->frameIndex);
+    SET_PARAM_IF(stream, name, "ioBufferKb", int, mux->ioBufferKb);
+    SET_PARAM_IF(stream, name, "ioPreallocate", int, mux->ioPreallocate);
+    SET_PARAM_IF(stream, name, "ioBitrateKbps", int, mux->ioBitrateKbps);
+    SET_PARAM_IF(stream, name, "ioDirect", int, mux->ioDirect);
+    SET_PARAM_IF(stream, name, "asyncOutput", int, mux->asyncOutput);
+    SET_PARAM_IF(stream, name, "asyncBudgetKb", int, mux->asyncBudgetKb);
+    SET_PARAM_IF(stream, name, "asyncOverflowPolicy", int, mux->asyncOverflowPolicy);
+    SET_PARAM_IF(stream, name, "asyncRotation", int, mux->asyncRotation);
+    SET_STR_PARAM_IF(stream, name, "threadClass", mux->threadClass);
 
 
     // pass it on, if we can
@@ -335,10 +497,22 @@ static int         ffsink_stream_get_param             (stream_obj* stream,
 
     COPY_PARAM_IF(mux, name, "firstMs", INT64_T, mux->firstPts);
     COPY_PARAM_IF(mux, name, "packetsLeadIn", int , mux->packetsLeadIn);
-    COPY_PARAM_IF(mux, name, "packetsSkipped", int, 0);
+    COPY_PARAM_IF(mux, name, "packetsSkipped", int, mux->packetsDropped);
     COPY_PARAM_IF(mux, name, "packetsWritten", int, _mux_packets_total(mux->packetsWritten) );
     COPY_PARAM_IF(mux, name, "packetsError", int, _mux_packets_total(mux->packetsError) );
     COPY_PARAM_IF(mux, name, "packetsRead", int, mux->packetsRead);
+    if ( mux->asyncOutput && mux->queueMutex != NULL && !_strnicmp(name, "async", 5) ) {
+        sv_mutex_enter(mux->queueMutex);
+        INT64_T queued = mux->queuedBytes;
+        INT64_T maxQueued = mux->queueBytes.max;
+        INT64_T latency = stats_int_average(&mux->writeLatency);
+        INT64_T maxLatency = mux->writeLatency.max;
+        sv_mutex_exit(mux->queueMutex);
+        COPY_PARAM_IF(mux, name, "asyncQueueBytes", INT64_T, queued);
+        COPY_PARAM_IF(mux, name, "asyncQueueMaxBytes", INT64_T, maxQueued);
+        COPY_PARAM_IF(mux, name, "asyncWriteLatencyMs", INT64_T, latency);
+        COPY_PARAM_IF(mux, name, "asyncWriteLatencyMaxMs", INT64_T, maxLatency);
+    }
 
     // pass it on, if we can
     return default_get_param(stream, name, value, size);
@@ -667,7 +841,7 @@ static int        _ffsink_add_audio_stream              (ffsink_stream_obj* mux)
 static int         _ffsink_set_opt                      (ffsink_stream_obj* mux, const char* name, const char* value)
 {
     if (av_opt_set(mux->formatCtx, name, value, AV_OPT_SEARCH_CHILDREN) < 0) {
-        mux->logCb(logError, _FMT( "Failed to set hls parameter " << name << " to " << value << "; url=" << mux->uri) );
+        mux->logCb(logError, _FMT( "Failed to set muxer parameter " << name << " to " << value << "; url=" << mux->uri) );
         return -1;
     }
     return 0;
@@ -705,7 +879,7 @@ static const char* _ffsink_get_rec_format_name          (ffsink_stream_obj* mux)
 {
     if (!mux->formatName) {
         if (mux->hls)
-            mux->formatName = "hls";
+            mux->formatName = mux->hlsLowLatency ? "mp4" : "hls";
         else if (mux->outputFormat == NULL)
             mux->formatName = "mp4";
         else if (!_stricmp(mux->outputFormat,"hls")) {
@@ -721,6 +895,19 @@ static const char* _ffsink_get_rec_format_name          (ffsink_stream_obj* mux)
     return mux->formatName;
 }
 
+//-----------------------------------------------------------------------------
+static int         _ffsink_source_normalized            (ffsink_stream_obj* mux)
+{
+    if ( mux->sourceNormalized < 0 ) {
+        size_t size = sizeof(mux->sourceNormalized);
+        if ( mux->sourceApi->get_param(mux->source, "annexbNormalized",
+                                       &mux->sourceNormalized, &size) < 0 ) {
+            mux->sourceNormalized = 0;
+        }
+    }
+    return mux->sourceNormalized;
+}
+
 //-----------------------------------------------------------------------------
 static int         _ffsink_create_output_context        (ffsink_stream_obj* mux)
 {
@@ -751,25 +938,53 @@ static int         _ffsink_create_output_context        (ffsink_stream_obj* mux)
     }
 
     if ( mux->hls ) {
-        static const int _kHLSSegmentTime = 2;
-        static const int _kHLSSegmentListSize = 4;
-
         int live = (mux->hls == 1);
 
+        if ( mux->hlsLowLatency ) {
+            // every fragment we flush becomes a part; see llhls_writer.h
+            if ( _ffsink_set_opt(mux, "movflags", "+frag_custom+empty_moov+default_base_moof") < 0 ) {
+                return -1;
+            }
+        } else
         if ( _ffsink_set_opt(mux, "hls_time", live?_STR(_kHLSSegmentTime):"5") < 0
             || _ffsink_set_opt(mux, "hls_list_size", live?_STR(_kHLSSegmentListSize):"5000") < 0
             || _ffsink_set_opt(mux, "start_number", _STR(mux->hlsStartIndex)) < 0
             || _ffsink_set_opt(mux, "hls_flags", _STR((live?"+":"-")<<"delete_segments")) < 0
             ) {
             return -1;
+        } else
+        if ( live && mux->hlsInMemory ) {
+            // the muxer opens every file it writes through io_open, and with a
+            // method set, deletes expired segments through it too
+            if ( _ffsink_set_opt(mux, "method", "PUT") < 0 ) {
+                return -1;
+            }
+            mux->hlsStore = hls_store_owner_create();
+            mux->formatCtx->opaque = mux->hlsStore;
+            mux->formatCtx->io_open = hls_store_io_open;
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(59, 16, 100)
+            mux->formatCtx->io_close2 = hls_store_io_close2;
+#else
+            mux->formatCtx->io_close = hls_store_io_close;
+#endif
+        }
+    } else
+    if ( mux->fragmented && !strcmp(formatName, "mp4") ) {
+        // the moov goes out up front, and each GOP as a fragment once complete:
+        // the file can be read while it is being written, and the trailer has
+        // no index left to write
+        if ( _ffsink_set_opt(mux, "movflags", "+frag_keyframe+empty_moov+default_base_moof") < 0 ) {
+            return -1;
         }
     }
 
     const char* bsf_name;
-    if ( mux->hls || !strcmp(mux->formatName,"mpegts")) {
+    if ( ((mux->hls && !mux->hlsLowLatency) || !strcmp(mux->formatName,"mpegts")) &&
+         !_ffsink_source_normalized(mux) ) {
         mux->applyBitstreamFilter = 1;
         // mpegtsenc.c autoinserts h264_mp4toannexb bitstream filters, but it could be
         // beneficial to dump SPS/PPS along with keyframes ... dump_extra filter does that
+        // (a normalized source has them there already)
         bsf_name = "dump_extra";
     } else {
         // There isn't a scenario or condition in the current code flow, where it is required.
@@ -833,23 +1048,31 @@ static int         _ffsink_stream_get_sps_pps            (ffsink_stream_obj* mux
         }
     }
     if (!mux->pps || !mux->sps) {
-        frame_api_t* api = frame_get_api(frame);
-        uint8_t* data = (uint8_t*)api->get_data(frame);
-        size_t   size = api->get_data_size(frame);
-
-        if (mux->sps == NULL &&
-            videolibapi_extract_nalu(data, size, kNALSPS, &mux->sps, &mux->spsSize, NULL, mux->logCb) ) {
-            TRACE((_FMT("Found SPS in the incoming frame!")));
-            mux->ownSPS = true;
-        }
-        if (mux->pps == NULL &&
-            videolibapi_extract_nalu(data, size, kNALPPS, &mux->pps, &mux->ppsSize, NULL, mux->logCb) ) {
-            TRACE((_FMT("Found PPS in the incoming frame!")));
-            mux->ownPPS = true;
-        }
-        if (videolibapi_contains_idr_frame(data, size, mux->logCb)) {
-            // only save frames going back to the last i-frame
-            _ffsink_free_saved_frames(mux, false);
+        uint8_t* data = (uint8_t*)frame_props_data(frame);
+        size_t   size = frame_props_data_size(frame);
+        int      offsets[kMaxScannedNALUs];
+        int      sizes[kMaxScannedNALUs];
+        uint8_t  types[kMaxScannedNALUs];
+        int      count = videolibapi_scan_nalus(data, size, 1, kMaxScannedNALUs,
+                                                offsets, sizes, types, mux->logCb);
+
+        for (int nI=0; nI<count; nI++) {
+            if (types[nI] == kNALSPS && mux->sps == NULL) {
+                mux->spsSize = sizes[nI];
+                mux->sps = (uint8_t*)malloc(sizes[nI]);
+                memcpy(mux->sps, &data[offsets[nI]], sizes[nI]);
+                TRACE((_FMT("Found SPS in the incoming frame!")));
+                mux->ownSPS = true;
+            } else if (types[nI] == kNALPPS && mux->pps == NULL) {
+                mux->ppsSize = sizes[nI];
+                mux->pps = (uint8_t*)malloc(sizes[nI]);
+                memcpy(mux->pps, &data[offsets[nI]], sizes[nI]);
+                TRACE((_FMT("Found PPS in the incoming frame!")));
+                mux->ownPPS = true;
+            } else if (types[nI] == kNALIFrame) {
+                // only save frames going back to the last i-frame
+                _ffsink_free_saved_frames(mux, false);
+            }
         }
     }
 
@@ -866,8 +1089,32 @@ static int64_t     _ffsink_get_next_ts                   (ffsink_stream_obj* mux
     } else {
         firstFrame = frame;
     }
-    frame_api_t* api = frame_get_api(firstFrame);
-    return api->get_pts(firstFrame);
+    return frame_props_pts(firstFrame);
+}
+
+//-----------------------------------------------------------------------------
+// How much disk space to reserve for the file about to be opened; 0 for none
+static int64_t     _ffsink_get_preallocation_size ( ffsink_stream_obj* mux )
+{
+    // only files that get split by duration have a predictable size
+    if ( !mux->ioPreallocate || mux->outputLocation == NULL ) {
+        return 0;
+    }
+
+    int64_t bitrate = (int64_t)mux->ioBitrateKbps*1000;
+    if ( bitrate <= 0 ) {
+        bitrate = mux->observedBitrate;
+    }
+    if ( bitrate <= 0 && mux->videoStream != NULL ) {
+        bitrate = mux->videoStream->codecpar->bit_rate;
+        if ( mux->audioStream != NULL ) {
+            bitrate += mux->audioStream->codecpar->bit_rate;
+        }
+    }
+    if ( bitrate <= 0 ) {
+        return 0;
+    }
+    return bitrate/8 * mux->maxFileDurationMs/1000 * (100+kPreallocateSlackPct)/100;
 }
 
 //-----------------------------------------------------------------------------
@@ -1001,9 +1248,27 @@ static int         _ffsink_stream_open_out               (ffsink_stream_obj* mux
         av_dump_format(mux->formatCtx, 0, mux->uri, 1);
         if ( !(mux->formatCtx->oformat->flags & AVFMT_NOFILE) ) {
             TRACE(_FMT("Opening file at " << mux->uri));
-            if ( mux->recordInRAM ) {
+            if ( mux->hls && mux->hlsLowLatency ) {
+                mux->llhls = llhls_writer_create(mux->uri,
+                                                 mux->hlsPartMs,
+                                                 _kHLSSegmentTime*1000,
+                                                 _kHLSSegmentListSize,
+                                                 mux->hlsStartIndex,
+                                                 mux->hls == 1 && mux->hlsInMemory,
+                                                 mux->logCb);
+                mux->formatCtx->pb = mux->llhls ? llhls_writer_get_io(mux->llhls) : NULL;
+                res = mux->llhls != NULL ? 0 : -1;
+            } else if ( mux->recordInRAM ) {
                 mux->formatCtx->pb = ffmpeg_create_buffered_io(mux->uri);
                 res = mux->formatCtx->pb != NULL ? 0 : -1;
+            } else if ( mux->ioBufferKb > 0 && strstr(mux->uri, "://") == NULL ) {
+                mux->formatCtx->pb = file_io_create(mux->uri,
+                                                    mux->ioBufferKb,
+                                                    _ffsink_get_preallocation_size(mux),
+                                                    mux->ioDirect,
+                                                    mux->logCb);
+                mux->ioCustom = (mux->formatCtx->pb != NULL);
+                res = mux->ioCustom ? 0 : -1;
             } else {
                 res = avio_open(&mux->formatCtx->pb, mux->uri, AVIO_FLAG_WRITE);
             }
@@ -1020,6 +1285,20 @@ static int         _ffsink_stream_open_out               (ffsink_stream_obj* mux
             mux->logCb(logError, _FMT( "Couldn't write header for " << mux->uri << ": " << av_err2str(res)));
         } else {
             mux->logCb(logDebug, _FMT( "Opened output stream for " << mux->uri) );
+            if ( mux->llhls != NULL ) {
+                llhls_writer_end_init(mux->llhls);
+            }
+            if ( mux->frameIndex && !mux->hls && mux->formatCtx->pb != NULL ) {
+                mux->indexWriter = clip_index_writer_create();
+                clip_index_writer_set_codec(mux->indexWriter,
+                                            mux->videoCodecId,
+                                            mux->width,
+                                            mux->height,
+                                            mux->sps,
+                                            mux->spsSize,
+                                            mux->pps,
+                                            mux->ppsSize);
+            }
             res = 0;
         }
     }
@@ -1079,61 +1358,257 @@ static void    _ffsink_free_saved_frames    (ffsink_stream_obj* mux, bool bWrite
 }
 
 //-----------------------------------------------------------------------------
-static int         _ffsink_stream_close       (stream_obj* stream,
-                                               bool bCloseAll)
+// Takes the current file away from the recorder
+static ffsink_output* _ffsink_detach_output     (ffsink_stream_obj* mux)
+{
+    ffsink_output* out = new ffsink_output;
+    out->formatCtx = mux->formatCtx;
+    out->videoStream = mux->videoStream;
+    out->h264bsfc = mux->h264bsfc;
+    out->llhls = mux->llhls;
+    out->hlsStore = mux->hlsStore;
+    out->indexWriter = mux->indexWriter;
+    out->uri = mux->uri ? strdup(mux->uri) : strdup("");
+    out->ioCustom = mux->ioCustom;
+    out->recordInRAM = mux->recordInRAM;
+    out->videoCodecId = mux->videoCodecId;
+    out->firstPts = mux->firstPts;
+    out->lastVideoPts = mux->lastVideoPts;
+    out->duration = mux->duration;
+    memcpy( out->packetsWritten, mux->packetsWritten, sizeof(int)*mediaTotal );
+    memcpy( out->packetsError, mux->packetsError, sizeof(int)*mediaTotal );
+
+    mux->formatCtx = NULL;
+    mux->h264bsfc = NULL;
+    mux->llhls = NULL;
+    mux->hlsStore = NULL;
+    mux->indexWriter = NULL;
+    mux->ioCustom = 0;
+    mux->audioStream = NULL;
+    mux->videoStream = NULL;
+    mux->subtitleStream = NULL;
+    mux->audioStreamIndex = -1;
+    mux->videoStreamIndex = -1;
+    mux->subtitleStreamIndex = -1;
+    return out;
+}
+
+//-----------------------------------------------------------------------------
+// Writes the trailer and the frame index, announces, and closes the file
+static void        _ffsink_finish_output      (ffsink_stream_obj* mux,
+                                               ffsink_output* out)
 {
-    DECLARE_MUX_FF(stream, mux);
     int res;
 
-    if (mux->formatCtx) {
-        TRACE(_FMT("Closing mux object " << (void*)stream <<
-                    ": format object " << (void*)mux->formatCtx));
-        if ( _mux_packets_total(mux->packetsWritten) > 0 &&
-             mux->videoCodecId == streamH264 ) {
-            mux->videoStream->duration = mux->duration;
-            res=av_write_trailer( mux->formatCtx );
-            int logLevel = ( mux->packetsError[mediaAudio] > 0 ||
-                             mux->packetsError[mediaVideo] > 0 ) ? logWarning : logDebug;
-            mux->logCb(logLevel, _FMT("Wrote trailer: res=" << res <<
-                    " file=" << mux->uri <<
-                    " duration=" << mux->videoStream->duration <<
-                    " timebase=" << mux->videoStream->time_base.num <<
-                    "/" << mux->videoStream->time_base.den <<
-                    " firstPts=" << mux->firstPts <<
-                    " lastPts=" << mux->lastVideoPts <<
-                    " bitrate=" << mux->videoStream->codecpar->bit_rate <<
-                    " writtenAudio=" << mux->packetsWritten[mediaAudio] <<
-                    " writtenVideo=" << mux->packetsWritten[mediaVideo] <<
-                    " errorAudio=" << mux->packetsError[mediaAudio] <<
-                    " errorVideo=" << mux->packetsError[mediaVideo] ));
-            if ( res < 0 ) {
-                mux->logCb(logError, _FMT("Failed to write a trailer: err=" << res << "(" <<
-                                av_err2str(res) << ")"));
+    if ( _mux_packets_total(out->packetsWritten) > 0 &&
+         out->videoCodecId == streamH264 ) {
+        out->videoStream->duration = out->duration;
+        if ( out->llhls != NULL ) {
+            // the last part goes out before the trailer, which isn't needed
+            av_write_frame(out->formatCtx, NULL);
+            llhls_writer_finish(out->llhls);
+        }
+        res=av_write_trailer( out->formatCtx );
+        int logLevel = ( out->packetsError[mediaAudio] > 0 ||
+                         out->packetsError[mediaVideo] > 0 ) ? logWarning : logDebug;
+        mux->logCb(logLevel, _FMT("Wrote trailer: res=" << res <<
+                " file=" << out->uri <<
+                " duration=" << out->videoStream->duration <<
+                " timebase=" << out->videoStream->time_base.num <<
+                "/" << out->videoStream->time_base.den <<
+                " firstPts=" << out->firstPts <<
+                " lastPts=" << out->lastVideoPts <<
+                " bitrate=" << out->videoStream->codecpar->bit_rate <<
+                " writtenAudio=" << out->packetsWritten[mediaAudio] <<
+                " writtenVideo=" << out->packetsWritten[mediaVideo] <<
+                " errorAudio=" << out->packetsError[mediaAudio] <<
+                " errorVideo=" << out->packetsError[mediaVideo] ));
+        if ( res < 0 ) {
+            mux->logCb(logError, _FMT("Failed to write a trailer: err=" << res << "(" <<
+                            av_err2str(res) << ")"));
+        } else if ( out->indexWriter != NULL ) {
+            // must be in place before anyone is told the file is complete
+            avio_flush(out->formatCtx->pb);
+            clip_index_writer_save(out->indexWriter,
+                                   out->uri,
+                                   out->lastVideoPts - out->firstPts,
+                                   avio_tell(out->formatCtx->pb),
+                                   out->recordInRAM,
+                                   mux->logCb);
+        }
+        _ffsink_notify_close_file(mux, out->uri, out->firstPts, out->lastVideoPts);
+
+        int64_t durationMs = out->lastVideoPts - out->firstPts;
+        if ( out->formatCtx->pb && durationMs >= 1000 ) {
+            mux->observedBitrate = avio_tell(out->formatCtx->pb)*8*1000/durationMs;
+        }
+    }
+
+    av_bsf_free (&out->h264bsfc);
+    clip_index_writer_destroy(&out->indexWriter);
+
+    if ( out->formatCtx->pb &&
+         !( out->formatCtx->oformat->flags & AVFMT_NOFILE ) ) {
+        if ( out->llhls != NULL ) {
+            llhls_writer_destroy(&out->llhls);
+        } else if ( out->recordInRAM ) {
+            ffmpeg_close_buffered_io(out->formatCtx->pb);
+        } else if ( out->ioCustom ) {
+            if ( file_io_close(&out->formatCtx->pb) < 0 ) {
+                mux->logCb(logError, _FMT("Failed to write " << out->uri));
             }
-            _ffsink_notify_close_file(mux, mux->lastVideoPts);
+        } else {
+            avio_close(out->formatCtx->pb);
         }
+        out->formatCtx->pb = NULL;
+    }
+    // the file is as complete as it gets; with nobody serving it, it goes
+    hls_store_owner_destroy(&out->hlsStore);
 
-        av_bsf_free (&mux->h264bsfc);
+    avformat_free_context(out->formatCtx);
+    free(out->uri);
+    delete out;
+}
 
-        if ( mux->formatCtx->pb &&
-             !( mux->formatCtx->oformat->flags & AVFMT_NOFILE ) ) {
-            if ( mux->recordInRAM ) {
-                ffmpeg_close_buffered_io(mux->formatCtx->pb);
-            } else {
-                avio_close(mux->formatCtx->pb);
+//-----------------------------------------------------------------------------
+static void*       _ffsink_closer_thread_func     (void* param)
+{
+    ffsink_stream_obj* mux = (ffsink_stream_obj*)param;
+    TRACE(_FMT("Starting closer thread " << (void*)mux));
+
+    while (true) {
+        sv_mutex_enter(mux->closeMutex);
+        if ( mux->closeQueue->empty() ) {
+            if ( mux->closerExiting ) {
+                sv_mutex_exit(mux->closeMutex);
+                break;
             }
-            mux->formatCtx->pb = NULL;
+            sv_event_reset(mux->closeEvent);
+            sv_mutex_exit(mux->closeMutex);
+            sv_event_wait(mux->closeEvent, 0);
+            continue;
+        }
+        ffsink_output* out = mux->closeQueue->front();
+        mux->closeQueue->pop_front();
+        sv_mutex_exit(mux->closeMutex);
+
+        INT64_T start = sv_time_get_current_epoch_time();
+        _ffsink_finish_output(mux, out);
+        TRACE(_FMT("Closed rotated out file in " << sv_time_get_elapsed_time(start) << "ms"));
+
+        char*   newFile = NULL;
+        INT64_T newFilePts = 0;
+        sv_mutex_enter(mux->closeMutex);
+        if ( --mux->closesPending == 0 ) {
+            newFile = mux->pendingNewFile;
+            newFilePts = mux->pendingNewFilePts;
+            mux->pendingNewFile = NULL;
         }
+        sv_mutex_exit(mux->closeMutex);
+
+        if ( newFile != NULL ) {
+            _ffsink_notify_new_file(mux, newFile, newFilePts);
+            free(newFile);
+        }
+        sv_event_set(mux->closedEvent);
+    }
+
+    TRACE(_FMT("Exiting closer thread " << (void*)mux));
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Hands the file over to the closer thread
+static void        _ffsink_queue_close            ( ffsink_stream_obj* mux,
+                                                    ffsink_output* out)
+{
+    sv_mutex_enter(mux->closeMutex);
+    if ( mux->closer == NULL ) {
+        mux->closerExiting = false;
+        mux->closer = sv_thread_create_ex(_ffsink_closer_thread_func, mux,
+                                          _STR("close:" << mux->name), mux->threadClass);
+    }
+    mux->closeQueue->push_back(out);
+    mux->closesPending++;
+    sv_event_set(mux->closeEvent);
+    sv_mutex_exit(mux->closeMutex);
+}
+
+//-----------------------------------------------------------------------------
+// Announces the new file -- unless files before it are still being closed,
+// in which case the closer does it once they are
+static void        _ffsink_announce_new_file      ( ffsink_stream_obj* mux,
+                                                    int64_t firstPts)
+{
+    if ( mux->closeMutex != NULL ) {
+        sv_mutex_enter(mux->closeMutex);
+        if ( mux->closesPending > 0 ) {
+            free(mux->pendingNewFile);
+            mux->pendingNewFile = strdup(mux->uri);
+            mux->pendingNewFilePts = firstPts;
+            sv_mutex_exit(mux->closeMutex);
+            return;
+        }
+        sv_mutex_exit(mux->closeMutex);
+    }
+    _ffsink_notify_new_file(mux, mux->uri, firstPts);
+}
+
+//-----------------------------------------------------------------------------
+// Waits for the files handed over to the closer to be done with
+static void        _ffsink_wait_for_closer        ( ffsink_stream_obj* mux)
+{
+    if ( mux->closeMutex == NULL ) {
+        return;
+    }
+    sv_mutex_enter(mux->closeMutex);
+    while ( mux->closesPending > 0 ) {
+        sv_event_reset(mux->closedEvent);
+        sv_mutex_exit(mux->closeMutex);
+        sv_event_wait(mux->closedEvent, kAsyncBlockWaitMs);
+        sv_mutex_enter(mux->closeMutex);
+    }
+    sv_mutex_exit(mux->closeMutex);
+}
+
+//-----------------------------------------------------------------------------
+// Lets the closer thread finish the files it has, and waits for it to exit
+static void        _ffsink_stop_closer            ( ffsink_stream_obj* mux)
+{
+    if ( mux->closeMutex == NULL ) {
+        return;
+    }
+    sv_mutex_enter(mux->closeMutex);
+    sv_thread* closer = mux->closer;
+    mux->closer = NULL;
+    mux->closerExiting = true;
+    sv_event_set(mux->closeEvent);
+    sv_mutex_exit(mux->closeMutex);
 
-        avformat_free_context(mux->formatCtx);
-        mux->audioStream = NULL;
-        mux->videoStream = NULL;
-        mux->subtitleStream = NULL;
+    if ( closer != NULL ) {
+        sv_thread_destroy(&closer);
+    }
+    sv_freep(&mux->pendingNewFile);
+}
 
-        mux->formatCtx = NULL;
-        mux->audioStreamIndex = -1;
-        mux->videoStreamIndex = -1;
-        mux->subtitleStreamIndex = -1;
+//-----------------------------------------------------------------------------
+static int         _ffsink_stream_close       (stream_obj* stream,
+                                               bool bCloseAll)
+{
+    DECLARE_MUX_FF(stream, mux);
+
+    if ( bCloseAll ) {
+        // whatever is still queued goes into the file before it is closed
+        _ffsink_stop_writer(mux);
+        _ffsink_stop_closer(mux);
+    }
+
+    if (mux->formatCtx) {
+        TRACE(_FMT("Closing mux object " << (void*)stream <<
+                    ": format object " << (void*)mux->formatCtx));
+        // files rotated out earlier must be closed (and announced) first
+        _ffsink_wait_for_closer(mux);
+        _ffsink_finish_output(mux, _ffsink_detach_output(mux));
     }
 
     if ( mux->ownPPS ) {
@@ -1179,6 +1654,16 @@ static int         _ffsink_stream_close       (stream_obj* stream,
         sv_freep(&mux->outputLocation);
         sv_freep(&mux->outputFormat);
         sv_mutex_destroy(&mux->mutex);
+        sv_mutex_destroy(&mux->queueMutex);
+        sv_event_destroy(&mux->queueEvent);
+        sv_event_destroy(&mux->spaceEvent);
+        delete mux->queue;
+        mux->queue = NULL;
+        sv_mutex_destroy(&mux->closeMutex);
+        sv_event_destroy(&mux->closeEvent);
+        sv_event_destroy(&mux->closedEvent);
+        delete mux->closeQueue;
+        mux->closeQueue = NULL;
     }
 
     memset( mux->packetsWritten, 0, sizeof(int)*mediaTotal );
@@ -1192,26 +1677,27 @@ static int         _ffsink_stream_close       (stream_obj* stream,
 static int         _ffsink_can_start_new_file     ( ffsink_stream_obj* mux,
                                                     frame_obj* frame )
 {
-    frame_api_t* api = frame_get_api(frame);
-    bool isVideo = (api->get_media_type(frame)==mediaVideo);
+    bool isVideo = (frame_props_media_type(frame)==mediaVideo);
     if (!isVideo) {
         return false;
     }
-    return  api->get_keyframe_flag(frame)>0 ||
-            videolibapi_contains_idr_frame((uint8_t*)api->get_data(frame),
-                                  api->get_data_size(frame),
+    if ( _ffsink_source_normalized(mux) ) {
+        return frame_props_keyframe(frame)>0;
+    }
+    return  frame_props_keyframe(frame)>0 ||
+            videolibapi_contains_idr_frame((uint8_t*)frame_props_data(frame),
+                                  frame_props_data_size(frame),
                                   mux->logCb);
 }
 
 //-----------------------------------------------------------------------------
-static int         ffsink_stream_read_frame       ( stream_obj* stream,
-                                                    frame_obj** frame)
+// Handles pending stop/restart requests, (re)opens the output as needed, and
+// writes the frame. Called with mux->mutex held, from whichever thread does
+// the writing. Returns -1 if the output can't be opened, and won't ever be.
+static int         _ffsink_process_frame          ( ffsink_stream_obj* mux,
+                                                    frame_obj* frame)
 {
-    int res = -1;
-
-    DECLARE_MUX_FF(stream, mux);
-
-    sv_mutex_enter(mux->mutex);
+    stream_obj* stream = (stream_obj*)mux;
 
     if ( mux->nextURI ) {
         // request had been made to stop or restart the recording
@@ -1231,87 +1717,248 @@ static int         ffsink_stream_read_frame       ( stream_obj* stream,
         free((void*)nextURIValue);
     }
 
+    if (!mux->outputInitialized) {
+        TRACE(_FMT("Attempting to complete initialization of the output sink"));
+        _ffsink_stream_open_out(mux, frame);
+        if (!mux->outputInitialized) {
+            return mux->criticalError ? -1 : 0;
+        }
+    } else {
+        int64_t msSinceStart = 0;
+        // need to reopen when we're past max specified duration of the file
+        bool bPeriodicReopen = (mux->outputLocation != NULL &&
+                        _mux_packets_total(mux->packetsWritten) > 0);
+        if ( bPeriodicReopen ) {
+            msSinceStart = _ffsink_get_next_ts(mux, frame) - mux->firstPts;
+            bPeriodicReopen &= (mux->maxFileDurationMs < msSinceStart);
+        }
+
+        // need to reopen file at the first keyframe when requested so by the upper layer
+        bool bRequestedReopen = (mux->newFileRequested &&
+                        _mux_packets_total(mux->packetsWritten) > 0);
 
-    res = default_read_frame(stream, frame);
 
-    if ( res>=0 && *frame != NULL ) {
-        mux->packetsRead++;
-        if (!mux->outputInitialized) {
-            TRACE(_FMT("Attempting to complete initialization of the output sink"));
-            _ffsink_stream_open_out(mux, *frame);
-            if (!mux->outputInitialized) {
-                if ( mux->criticalError ) {
-                    frame_unref(frame);
-                    res = -1;
+        if ( bPeriodicReopen||bRequestedReopen ) {
+            if (_ffsink_can_start_new_file(mux, frame)) {
+                TRACE(_FMT("Closing current file and opening a new one due to " <<
+                      (bRequestedReopen?"app request":"app settings") <<
+                      "; msSinceStart=" << msSinceStart ));
+                if ( mux->asyncRotation && !mux->hls ) {
+                    // the trailer and close happen on the closer thread
+                    _ffsink_queue_close(mux, _ffsink_detach_output(mux));
                 }
-                goto Exit;
+                _ffsink_stream_close((stream_obj*)mux, false);
+                TRACE(_FMT("Completing initialization of the output sink"));
+                _ffsink_stream_open_out(mux, frame);
+                if (!mux->outputInitialized) {
+                    return 0;
+                }
+            } else {
+                TRACE(_FMT("Waiting for a keyframe to reopen file output due to " <<
+                      (bRequestedReopen?"app request":"app settings") <<
+                      "; msSinceStart=" << msSinceStart ));
             }
-        } else {
-            int64_t msSinceStart = 0;
-            // need to reopen when we're past max specified duration of the file
-            bool bPeriodicReopen = (mux->outputLocation != NULL &&
-                            _mux_packets_total(mux->packetsWritten) > 0);
-            if ( bPeriodicReopen ) {
-                msSinceStart = _ffsink_get_next_ts(mux, *frame) - mux->firstPts;
-                bPeriodicReopen &= (mux->maxFileDurationMs < msSinceStart);
+        }
+    }
+    int written;
+    /*res = */_ffsink_stream_write_frame(mux, frame, written);
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void*       _ffsink_writer_thread_func     (void* param)
+{
+    ffsink_stream_obj* mux = (ffsink_stream_obj*)param;
+    TRACE(_FMT("Starting writer thread " << (void*)mux));
+
+    while (true) {
+        sv_mutex_enter(mux->queueMutex);
+        if ( mux->queue->empty() ) {
+            if ( mux->writerExiting ) {
+                sv_mutex_exit(mux->queueMutex);
+                break;
             }
+            sv_event_reset(mux->queueEvent);
+            sv_mutex_exit(mux->queueMutex);
+            sv_event_wait(mux->queueEvent, 0);
+            continue;
+        }
+        std::pair<frame_obj*, INT64_T> item = mux->queue->front();
+        mux->queue->pop_front();
+        sv_mutex_exit(mux->queueMutex);
 
-            // need to reopen file at the first keyframe when requested so by the upper layer
-            bool bRequestedReopen = (mux->newFileRequested &&
-                            _mux_packets_total(mux->packetsWritten) > 0);
-
-
-            if ( bPeriodicReopen||bRequestedReopen ) {
-                if (_ffsink_can_start_new_file(mux, *frame)) {
-                    TRACE(_FMT("Closing current file and opening a new one due to " <<
-                          (bRequestedReopen?"app request":"app settings") <<
-                          "; msSinceStart=" << msSinceStart ));
-                    _ffsink_stream_close((stream_obj*)mux, false);
-                    TRACE(_FMT("Completing initialization of the output sink"));
-                    _ffsink_stream_open_out(mux, *frame);
-                    if (!mux->outputInitialized) {
-                        goto Exit;
-                    }
-                } else {
-                    TRACE(_FMT("Waiting for a keyframe to reopen file output due to " <<
-                          (bRequestedReopen?"app request":"app settings") <<
-                          "; msSinceStart=" << msSinceStart ));
-                }
+        frame_obj* frame = item.first;
+        size_t     size = frame_get_api(frame)->get_data_size(frame);
+
+        sv_mutex_enter(mux->mutex);
+        if ( _ffsink_process_frame(mux, frame) < 0 ) {
+            // the producer will find out on its next read
+            mux->criticalError = true;
+        }
+        sv_mutex_exit(mux->mutex);
+        frame_unref(&frame);
+
+        sv_mutex_enter(mux->queueMutex);
+        mux->queuedBytes -= size;
+        stats_int_update(&mux->writeLatency, sv_time_get_elapsed_time(item.second));
+        sv_event_set(mux->spaceEvent);
+        sv_mutex_exit(mux->queueMutex);
+    }
+
+    TRACE(_FMT("Exiting writer thread " << (void*)mux));
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Hands the frame over to the writer thread, applying the overflow policy if
+// the writer is too far behind. The caller's reference is left alone.
+static void        _ffsink_queue_frame            ( ffsink_stream_obj* mux,
+                                                    frame_obj* frame)
+{
+    size_t       size = frame_props_data_size(frame);
+    size_t       budget = (size_t)mux->asyncBudgetKb*1024;
+    int          warned = 0;
+
+    sv_mutex_enter(mux->queueMutex);
+    if ( mux->writer == NULL ) {
+        mux->writerExiting = false;
+        mux->writer = sv_thread_create_ex(_ffsink_writer_thread_func, mux,
+                                          _STR("write:" << mux->name), mux->threadClass);
+    }
+
+    if ( mux->dropUntilKeyframe ) {
+        if ( _ffsink_can_start_new_file(mux, frame) && mux->queuedBytes + size <= budget ) {
+            mux->logCb(logInfo, _FMT("Recorder writer caught up; resuming at pts=" << frame_props_pts(frame) <<
+                                    " after dropping " << mux->packetsDropped << " packets so far"));
+            mux->dropUntilKeyframe = false;
+        } else {
+            mux->packetsDropped++;
+            sv_mutex_exit(mux->queueMutex);
+            return;
+        }
+    }
+
+    // at least one frame is always let through, however large
+    while ( !mux->queue->empty() && mux->queuedBytes + size > budget ) {
+        if ( mux->asyncOverflowPolicy == ffsinkOverflowDropToKeyframe ) {
+            mux->logCb(logWarning, _FMT("Recorder writer is " << mux->queuedBytes <<
+                                    " bytes behind; dropping packets until the next keyframe"));
+            mux->dropUntilKeyframe = true;
+            mux->packetsDropped++;
+            sv_mutex_exit(mux->queueMutex);
+            return;
+        }
+        if ( !warned++ ) {
+            mux->logCb(logWarning, _FMT("Recorder writer is " << mux->queuedBytes <<
+                                    " bytes behind; waiting for it"));
+        }
+        sv_event_reset(mux->spaceEvent);
+        sv_mutex_exit(mux->queueMutex);
+        sv_event_wait(mux->spaceEvent, kAsyncBlockWaitMs);
+        sv_mutex_enter(mux->queueMutex);
+    }
+
+    frame_ref(frame);
+    mux->queue->push_back(std::make_pair(frame, sv_time_get_current_epoch_time()));
+    mux->queuedBytes += size;
+    stats_int_update(&mux->queueBytes, mux->queuedBytes);
+    sv_event_set(mux->queueEvent);
+    sv_mutex_exit(mux->queueMutex);
+}
+
+//-----------------------------------------------------------------------------
+// Lets the writer thread drain the queue, and waits for it to exit
+static void        _ffsink_stop_writer            ( ffsink_stream_obj* mux)
+{
+    if ( mux->queueMutex == NULL ) {
+        return;
+    }
+    sv_mutex_enter(mux->queueMutex);
+    sv_thread* writer = mux->writer;
+    mux->writer = NULL;
+    mux->writerExiting = true;
+    sv_event_set(mux->queueEvent);
+    sv_mutex_exit(mux->queueMutex);
+
+    if ( writer != NULL ) {
+        sv_thread_destroy(&writer);
+        mux->logCb(logInfo, _FMT("Recorder writer stopped: " <<
+                                " dropped=" << mux->packetsDropped <<
+                                " maxQueuedBytes=" << mux->queueBytes.max <<
+                                " avgWriteLatencyMs=" << stats_int_average(&mux->writeLatency) <<
+                                " maxWriteLatencyMs=" << mux->writeLatency.max ));
+    }
+}
+
+//-----------------------------------------------------------------------------
+static int         ffsink_stream_read_frame       ( stream_obj* stream,
+                                                    frame_obj** frame)
+{
+    int res = -1;
+
+    DECLARE_MUX_FF(stream, mux);
+
+    if ( mux->asyncOutput ) {
+        // the writer holds mux->mutex while it's busy with the file; don't wait for it
+        res = default_read_frame(stream, frame);
+        if ( res>=0 && *frame != NULL ) {
+            mux->packetsRead++;
+            if ( mux->criticalError ) {
+                frame_unref(frame);
+                res = -1;
+            } else {
+                _ffsink_queue_frame(mux, *frame);
             }
         }
-        int written;
-        /*res = */_ffsink_stream_write_frame(mux, *frame, written);
+        return res;
+    }
+
+    sv_mutex_enter(mux->mutex);
+
+    res = default_read_frame(stream, frame);
+
+    if ( res>=0 && *frame != NULL ) {
+        mux->packetsRead++;
+        if ( _ffsink_process_frame(mux, *frame) < 0 ) {
+            frame_unref(frame);
+            res = -1;
+        }
     }
 
-Exit:
     sv_mutex_exit(mux->mutex);
     return res;
 }
 
 //-----------------------------------------------------------------------------
 static void        _ffsink_notify_new_file        (ffsink_stream_obj* mux,
+                                              const char* uri,
                                               int64_t firstPts)
 {
     int res;
-    TRACE_C(0, _FMT("New file notification: uri=" << mux->uri <<
+    TRACE_C(0, _FMT("New file notification: uri=" << uri <<
                                 " cb=" << (void*)mux->eventCallback <<
                                 " firstPts=" << firstPts));
 
     if ( mux->eventCallback == NULL ) {
         if ( mux->outputLocation != NULL ) {
-            mux->logCb(logError, _FMT("Dropping new file event: " << mux->uri << "!"));
+            mux->logCb(logError, _FMT("Dropping new file event: " << uri << "!"));
         }
         return;
     }
 
+    static const int filenameKey = basic_event_property_key("filename");
     stream_ev_api* api = get_basic_event_api();
     stream_ev_obj* ev = api->create("recorder.newFile");
     stream_ev_ref(ev);
     api->set_ts(ev, firstPts);
     api->set_context(ev, mux->eventCallbackContext);
-    res = api->set_property(ev, "filename", mux->uri, strlen(mux->uri)+1);
+    if ( filenameKey >= 0 ) {
+        res = basic_event_set_property_by_key(ev, filenameKey, uri, strlen(uri)+1);
+    } else {
+        res = api->set_property(ev, "filename", (void*)uri, strlen(uri)+1);
+    }
     if ( res < 0 ) {
-        mux->logCb(logError, _FMT("Failed to set event property 'filename' to " << mux->uri << "; res=" << res));
+        mux->logCb(logError, _FMT("Failed to set event property 'filename' to " << uri << "; res=" << res));
     } else {
         mux->eventCallback((stream_obj*)mux, ev );
     }
@@ -1320,13 +1967,15 @@ static void        _ffsink_notify_new_file        (ffsink_stream_obj* mux,
 
 //-----------------------------------------------------------------------------
 static void        _ffsink_notify_close_file       (ffsink_stream_obj* mux,
+                                              const char* uri,
+                                              int64_t firstPts,
                                               int64_t lastPts)
 {
-    TRACE_C(0, _FMT("Close file notification: uri=" << mux->uri <<
+    TRACE_C(0, _FMT("Close file notification: uri=" << uri <<
                                 " cb=" << (void*)mux->eventCallback <<
-                                " firstPts=" << mux->firstPts <<
+                                " firstPts=" << firstPts <<
                                 " lastPts=" << lastPts <<
-                                " duration=" << lastPts - mux->firstPts ));
+                                " duration=" << lastPts - firstPts ));
 
     if ( mux->eventCallback == NULL ) {
         return;
@@ -1358,6 +2007,19 @@ static void        _adjust_time_field(AVStream* activeStream,
     }
 }
 
+//-----------------------------------------------------------------------------
+static int         _ffsink_write_packet           (ffsink_stream_obj* mux,
+                                                   AVPacket* packet)
+{
+    if ( !sv_trace_enabled() ) {
+        return av_write_frame(mux->formatCtx, packet);
+    }
+    INT64_T start = sv_trace_now_us();
+    int     res = av_write_frame(mux->formatCtx, packet);
+    sv_trace_span("av_write_frame", mux->name, start, sv_trace_now_us());
+    return res;
+}
+
 //-----------------------------------------------------------------------------
 static int         _ffsink_stream_write_frame     (ffsink_stream_obj* mux,
                                               frame_obj* frame,
@@ -1371,11 +2033,11 @@ static int         _ffsink_stream_write_frame     (ffsink_stream_obj* mux,
     assert( api != NULL );
 
 
-    INT64_T         pts = api->get_pts(frame),
-                    dts = api->get_dts(frame);
-    int             mediaType = api->get_media_type(frame);
-    uint8_t*        data = (uint8_t*)api->get_data(frame);
-    size_t          size = api->get_data_size(frame);
+    INT64_T         pts = frame_props_pts(frame),
+                    dts = frame_props_dts(frame);
+    int             mediaType = frame_props_media_type(frame);
+    uint8_t*        data = (uint8_t*)frame_props_data(frame);
+    size_t          size = frame_props_data_size(frame);
     const char*     frameType;
     bool            isKeyframe = false;
     AVStream*       activeStream;
@@ -1392,9 +2054,10 @@ static int         _ffsink_stream_write_frame     (ffsink_stream_obj* mux,
     if ( mediaType == mediaVideo ) {
         if ( mux->videoCodecId == streamH264 ) {
             frameType="h264";
-            if ( api->get_keyframe_flag && api->get_keyframe_flag(frame) ) {
+            if ( api->get_keyframe_flag && frame_props_keyframe(frame) ) {
                 isKeyframe = true;
-            } else if ( videolibapi_contains_idr_frame( data, size, mux->logCb ) ) {
+            } else if ( !_ffsink_source_normalized(mux) &&
+                        videolibapi_contains_idr_frame( data, size, mux->logCb ) ) {
                 isKeyframe = true;
             }
         } else {
@@ -1454,7 +2117,9 @@ static int         _ffsink_stream_write_frame     (ffsink_stream_obj* mux,
     packet.pos = -1;
     packet.duration = 0;
 
-    _adjust_time_field( activeStream, packet.pts, pts, mux->firstPts, mediaType, mux->hls );
+    // low-latency HLS starts each (fragmented mp4) output at 0, as mp4 recordings do
+    int absoluteTime = mux->hls && !mux->hlsLowLatency;
+    _adjust_time_field( activeStream, packet.pts, pts, mux->firstPts, mediaType, absoluteTime );
     if ( dts == INVALID_PTS ) {
         // TODO: This is wrong -- doesn't take into account codec delay, or
         //       reordering caused by B-frames.
@@ -1463,11 +2128,12 @@ static int         _ffsink_stream_write_frame     (ffsink_stream_obj* mux,
         //       both PTS and DTS assigned by the encoder.
         dts = pts;
     }
-    _adjust_time_field( activeStream, packet.dts, dts, mux->firstPts, mediaType, mux->hls );
+    _adjust_time_field( activeStream, packet.dts, dts, mux->firstPts, mediaType, absoluteTime );
 
-    packet.data = data;
-    packet.size = size;
+    // references the frame, rather than having ffmpeg copy it
+    frame_avbuffer_wrap(frame, &packet);
     packet.flags |= (isKeyframe||mediaType!=mediaVideo)?AV_PKT_FLAG_KEY:0;
+    int64_t offset = mux->formatCtx->pb ? avio_tell(mux->formatCtx->pb) : -1;
     packet.stream_index = streamIndex;
     if ( mediaType == mediaVideo ) {
         mux->duration = packet.pts;
@@ -1495,12 +2161,20 @@ static int         _ffsink_stream_write_frame     (ffsink_stream_obj* mux,
                 break;
             }
             lastPts = pktToWrite.pts;
-            res = av_write_frame(mux->formatCtx, &pktToWrite);
+            res = _ffsink_write_packet(mux, &pktToWrite);
             av_packet_unref(&pktToWrite);
         }
     } else {
+        if ( mux->llhls != NULL && mediaType == mediaVideo ) {
+            int cut = llhls_writer_check_cut(mux->llhls, pts - mux->firstPts, isKeyframe);
+            if ( cut != llhlsCutNone ) {
+                // flushes the fragment, so the part ends right before this packet
+                av_write_frame(mux->formatCtx, NULL);
+                llhls_writer_end_part(mux->llhls, cut);
+            }
+        }
         lastPts = packet.pts;
-        res = av_write_frame(mux->formatCtx, &packet);
+        res = _ffsink_write_packet(mux, &packet);
     }
 
 
@@ -1513,9 +2187,13 @@ static int         _ffsink_stream_write_frame     (ffsink_stream_obj* mux,
     } else {
         written = 1;
         if ( mediaType == mediaVideo ) {
+            if ( mux->indexWriter != NULL ) {
+                // the file's timeline starts at the first keyframe
+                clip_index_writer_add(mux->indexWriter, pts - mux->firstPts, offset, isKeyframe);
+            }
             if ( mux->packetsWritten[mediaVideo] == 1 ) {
                 // we just generated the first packet, send out the notification
-                _ffsink_notify_new_file(mux, pts);
+                _ffsink_announce_new_file(mux, pts);
             }
             if (isKeyframe)
                 mux->packetsWrittenKeyframes++;
@@ -1544,6 +2222,7 @@ static int         _ffsink_stream_write_frame     (ffsink_stream_obj* mux,
                         " flags=" << packet.flags <<
                         " index=" << packet.stream_index ));
 
+    av_packet_unref(&packet);
     return res;
 }
 
@@ -1554,6 +2233,7 @@ static void ffsink_stream_destroy         (stream_obj* stream)
     mux->logCb(logTrace, _FMT("Destroying stream object " << (void*)stream));
     _ffsink_stream_close(stream, true); // make sure all the internals had been freed
     free((void*)mux->preset);
+    sv_freep(&mux->threadClass);
     stream_destroy( stream );
 }
 
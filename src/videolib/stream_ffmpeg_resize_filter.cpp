@@ -38,6 +38,7 @@
 
 #include "streamprv.h"
 #include "sv_ffmpeg.h"
+#include "sv_internal.h"
 
 
 #include "frame_basic.h"
@@ -46,15 +47,55 @@
 
 #include "stream_resize_base.hpp"
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
 #define RESIZE_FILTER_MAGIC 0x1225
 
+// Slice threading: the frame is cut into horizontal bands, each scaled by its
+// own context on a worker pool shared by all the resize filters in the process.
+static const int        kMaxSlices = 8;
+// with slices=-1, frames smaller than this are scaled on the calling thread
+static const int        kAutoSlicesMinPixels = 2560*1440;
+static const int        kAutoSlicesMinRows = 270;
+// Scaled frames are usually consumed by the next node and returned right
+// away, so a small pool serves; shrink to it quickly, since frames are big
+static const int        kPoolFrames = 3;
+static const int        kPoolReductionTimeMs = 1000;
+
 //-----------------------------------------------------------------------------
 typedef struct resize_filter  : public resize_base_obj  {
     struct SwsContext*  ctx;
     AVFrame*            srcFrame;
     frame_allocator*    fa;
+    struct SwsContext*  sliceCtx[kMaxSlices];
+    int                 sliceCount;
 } resize_filter_obj;
 
+//-----------------------------------------------------------------------------
+typedef struct resize_slice_batch {
+    std::mutex              mutex;
+    std::condition_variable done;
+    int                     pending;
+    int                     failed;
+} resize_slice_batch;
+
+typedef struct resize_slice_job {
+    struct SwsContext*      ctx;
+    const uint8_t*          src[4];
+    int                     srcStride[4];
+    int                     srcHeight;
+    uint8_t*                dst[4];
+    int                     dstStride[4];
+    resize_slice_batch*     batch;
+} resize_slice_job;
+
+static std::mutex                       _gSlicePoolMutex;
+static std::condition_variable          _gSlicePoolWake;
+static std::deque<resize_slice_job*>    _gSliceJobs;
+static int                              _gSliceWorkers = -1;
+
 //-----------------------------------------------------------------------------
 // Stream API
 //-----------------------------------------------------------------------------
@@ -124,10 +165,199 @@ static stream_obj*   resize_filter_create                (const char* name)
     resize_base_init(res);
     res->ctx = NULL;
     res->srcFrame = NULL;
-    res->fa = create_frame_allocator(name);
+    res->fa = create_frame_allocator2(name, kPoolFrames, kPoolReductionTimeMs);
+    memset(res->sliceCtx, 0, sizeof(res->sliceCtx));
+    res->sliceCount = 0;
     return (stream_obj*)res;
 }
 
+//-----------------------------------------------------------------------------
+static int         _resize_slice_run                (resize_slice_job* job)
+{
+    return sws_scale(job->ctx, job->src, job->srcStride, 0, job->srcHeight,
+                     job->dst, job->dstStride);
+}
+
+//-----------------------------------------------------------------------------
+static void*       _resize_slice_worker             (void* param)
+{
+    for (;;) {
+        resize_slice_job* job;
+        {
+            std::unique_lock<std::mutex> lock(_gSlicePoolMutex);
+            _gSlicePoolWake.wait(lock, [] { return !_gSliceJobs.empty(); });
+            job = _gSliceJobs.front();
+            _gSliceJobs.pop_front();
+        }
+
+        int res = _resize_slice_run(job);
+
+        resize_slice_batch* batch = job->batch;
+        std::lock_guard<std::mutex> guard(batch->mutex);
+        if ( res < 0 ) {
+            batch->failed = 1;
+        }
+        if ( --batch->pending == 0 ) {
+            batch->done.notify_one();
+        }
+    }
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Starts the pool on first use; workers stay around for the life of the process.
+// Returns the number of workers available.
+static int         _resize_slice_pool_get           (fn_stream_log logCb)
+{
+    std::lock_guard<std::mutex> guard(_gSlicePoolMutex);
+    if ( _gSliceWorkers < 0 ) {
+        int want = sv_get_cpu_count() - 1;
+        if ( want > kMaxSlices - 1 ) {
+            want = kMaxSlices - 1;
+        }
+        _gSliceWorkers = 0;
+        for (int nI=0; nI<want; nI++) {
+            if ( sv_thread_create(_resize_slice_worker, NULL) == NULL ) {
+                break;
+            }
+            _gSliceWorkers++;
+        }
+        logCb(logInfo, _FMT("Started " << _gSliceWorkers << " resize slice workers"));
+    }
+    return _gSliceWorkers;
+}
+
+//-----------------------------------------------------------------------------
+// Number of bands to cut the frame into. Every band gets the same number of
+// source and destination rows, even ones for the sake of subsampled chroma, so
+// all the bands scale by exactly the same factor.
+static int         _resize_filter_get_slice_count   (resize_filter_obj* rszfilter)
+{
+    int want = rszfilter->slices;
+    int srcH = (int)rszfilter->inputHeight;
+    int dstH = (int)rszfilter->dimActual.height;
+
+    if ( want < 0 ) {
+        want = ( rszfilter->inputWidth*rszfilter->inputHeight >= (size_t)kAutoSlicesMinPixels )
+             ? srcH / kAutoSlicesMinRows
+             : 0;
+    }
+    if ( want < 2 ) {
+        return 0;
+    }
+    int workers = _resize_slice_pool_get(rszfilter->logCb);
+    if ( want > workers + 1 ) {
+        want = workers + 1;
+    }
+    for (int n=want; n>1; n--) {
+        if ( srcH % (2*n) == 0 && dstH % (2*n) == 0 ) {
+            return n;
+        }
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static struct SwsContext* _resize_filter_create_ctx (resize_filter_obj* rszfilter,
+                                                    int srcHeight,
+                                                    int dstHeight)
+{
+    struct SwsContext* ctx = sws_getContext(rszfilter->inputWidth,
+                                  srcHeight,
+                                  svpfmt_to_ffpfmt(rszfilter->inputPixFmt,
+                                                  (enum AVColorRange*)&rszfilter->colorRange),
+                                  rszfilter->dimActual.width,
+                                  dstHeight,
+                                  svpfmt_to_ffpfmt(rszfilter->pixfmt, NULL),
+                                  SWS_FAST_BILINEAR,
+                                  NULL,
+                                  NULL,
+                                  NULL);
+    if (!ctx) {
+        rszfilter->logCb(logError, _FMT("Can't allocate resize filter"));
+        return NULL;
+    }
+
+    if (rszfilter->colorSpace >=0 && rszfilter->colorRange >=0) {
+        rszfilter->logCb(logDebug, _FMT("Resize filter '" <<
+                                        rszfilter->name <<
+                                        "' is setting the color options"));
+        // Set the color space options
+        if (resize_set_color_options((stream_obj*)rszfilter, ctx, rszfilter->colorSpace, rszfilter->colorRange ) == -1 ) {
+            rszfilter->logCb(logError, _FMT("Failed to set our colorspace options!"));
+            sws_freeContext(ctx);
+            return NULL;
+        }
+    }
+    return ctx;
+}
+
+//-----------------------------------------------------------------------------
+// Points the planes at the first row of the band starting at y
+static void        _resize_slice_planes             (int ffpfmt,
+                                                    uint8_t* const* data,
+                                                    const int* linesize,
+                                                    int y,
+                                                    uint8_t** res)
+{
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((enum AVPixelFormat)ffpfmt);
+    int planes = av_pix_fmt_count_planes((enum AVPixelFormat)ffpfmt);
+    for (int nI=0; nI<4; nI++) {
+        if ( nI >= planes ) {
+            res[nI] = NULL;
+            continue;
+        }
+        bool chroma = (nI == 1 || nI == 2);
+        int  rows = chroma ? (y >> desc->log2_chroma_h) : y;
+        res[nI] = data[nI] + rows*linesize[nI];
+    }
+}
+
+//-----------------------------------------------------------------------------
+static int         _resize_filter_scale_slices      (resize_filter_obj* rszfilter,
+                                                    AVFrame* srcFrame,
+                                                    AVFrame* dstFrame)
+{
+    resize_slice_job    jobs[kMaxSlices];
+    resize_slice_batch  batch;
+    int                 n = rszfilter->sliceCount;
+    int                 srcRows = (int)rszfilter->inputHeight / n;
+    int                 dstRows = (int)rszfilter->dimActual.height / n;
+    int                 srcFmt = svpfmt_to_ffpfmt(rszfilter->inputPixFmt, NULL);
+    int                 dstFmt = svpfmt_to_ffpfmt(rszfilter->pixfmt, NULL);
+
+    batch.pending = n - 1;
+    batch.failed = 0;
+    for (int nI=0; nI<n; nI++) {
+        resize_slice_job* job = &jobs[nI];
+        job->ctx = rszfilter->sliceCtx[nI];
+        job->srcHeight = srcRows;
+        job->batch = &batch;
+        _resize_slice_planes(srcFmt, srcFrame->data, srcFrame->linesize, nI*srcRows, (uint8_t**)job->src);
+        _resize_slice_planes(dstFmt, dstFrame->data, dstFrame->linesize, nI*dstRows, job->dst);
+        memcpy(job->srcStride, srcFrame->linesize, sizeof(job->srcStride));
+        memcpy(job->dstStride, dstFrame->linesize, sizeof(job->dstStride));
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(_gSlicePoolMutex);
+        for (int nI=1; nI<n; nI++) {
+            _gSliceJobs.push_back(&jobs[nI]);
+        }
+    }
+    _gSlicePoolWake.notify_all();
+
+    // the first band is ours
+    int res = _resize_slice_run(&jobs[0]);
+
+    std::unique_lock<std::mutex> lock(batch.mutex);
+    batch.done.wait(lock, [&batch] { return batch.pending == 0; });
+    if ( batch.failed ) {
+        res = -1;
+    }
+    return res < 0 ? res : (int)rszfilter->dimActual.height;
+}
+
 //-----------------------------------------------------------------------------
 static int         resize_filter_set_param             (stream_obj* stream,
                                             const CHAR_T* name,
@@ -166,29 +396,23 @@ static int         resize_filter_open_in                (stream_obj* stream)
         return -1;
     }
 
-    rszfilter->ctx = sws_getContext(rszfilter->inputWidth,
-                                  rszfilter->inputHeight,
-                                  svpfmt_to_ffpfmt(rszfilter->inputPixFmt,
-                                                  (enum AVColorRange*)&rszfilter->colorRange),
-                                  rszfilter->dimActual.width,
-                                  rszfilter->dimActual.height,
-                                  svpfmt_to_ffpfmt(rszfilter->pixfmt, NULL),
-                                  SWS_FAST_BILINEAR,
-                                  NULL,
-                                  NULL,
-                                  NULL);
-    if (!rszfilter->ctx) {
-        rszfilter->logCb(logError, _FMT("Can't allocate resize filter"));
-        return -1;
-    }
-
-    if (rszfilter->colorSpace >=0 && rszfilter->colorRange >=0) {
-        rszfilter->logCb(logDebug, _FMT("Resize filter '" <<
-                                        rszfilter->name <<
-                                        "' is setting the color options"));
-        // Set the color space options
-        if (resize_set_color_options(stream, rszfilter->ctx, rszfilter->colorSpace, rszfilter->colorRange ) == -1 ) {
-            rszfilter->logCb(logError, _FMT("Failed to set our colorspace options!"));
+    rszfilter->sliceCount = _resize_filter_get_slice_count(rszfilter);
+    if ( rszfilter->sliceCount > 1 ) {
+        for (int nI=0; nI<rszfilter->sliceCount; nI++) {
+            rszfilter->sliceCtx[nI] = _resize_filter_create_ctx(rszfilter,
+                                    rszfilter->inputHeight / rszfilter->sliceCount,
+                                    rszfilter->dimActual.height / rszfilter->sliceCount);
+            if ( rszfilter->sliceCtx[nI] == NULL ) {
+                return -1;
+            }
+        }
+        rszfilter->logCb(logDebug, _FMT("Resize filter '" << rszfilter->name <<
+                                        "' scaling in " << rszfilter->sliceCount << " slices"));
+    } else {
+        rszfilter->ctx = _resize_filter_create_ctx(rszfilter,
+                                    rszfilter->inputHeight,
+                                    rszfilter->dimActual.height);
+        if (!rszfilter->ctx) {
             return -1;
         }
     }
@@ -275,13 +499,17 @@ static int         resize_filter_read_frame        (stream_obj* stream,
 
 
 
-    res = sws_scale(rszfilter->ctx,
+    if ( rszfilter->sliceCount > 1 ) {
+        res = _resize_filter_scale_slices(rszfilter, srcFrame, dstFrame);
+    } else {
+        res = sws_scale(rszfilter->ctx,
               (const uint8_t* const*)srcFrame,
               srcFrame->linesize,
               0,
               rszfilter->inputHeight,
               dstFrame->data,
               dstFrame->linesize);
+    }
     if ( res < 0 ) {
         rszfilter->logCb(logError, _FMT( "Failed to resize the image: " <<
                             " res=" << res << "(" << av_err2str(res) << ")" <<
@@ -317,6 +545,9 @@ static int         resize_filter_read_frame        (stream_obj* stream,
         rszfilter->prevFramePts = pts;
     }
 
+    if ( res == 0 ) {
+        resize_base_share_result(rszfilter, tmp, *frame);
+    }
     frame_unref(&tmp);
     return res;
 }
@@ -329,6 +560,11 @@ static int         resize_filter_close             (stream_obj* stream)
     av_frame_free(&rszfilter->srcFrame);
     sws_freeContext(rszfilter->ctx);
     rszfilter->ctx = NULL;
+    for (int nI=0; nI<kMaxSlices; nI++) {
+        sws_freeContext(rszfilter->sliceCtx[nI]);
+        rszfilter->sliceCtx[nI] = NULL;
+    }
+    rszfilter->sliceCount = 0;
 
     return 0;
 }
@@ -121,6 +121,8 @@ static int         fi_stream_set_param             (stream_obj* stream,
 
 //-----------------------------------------------------------------------------
 extern "C" stream_api_t*     get_ff_filter_api                    ();
+extern "C" stream_api_t*     get_resize_factory_api               ();
+bool                         resize_factory_rotation_supports     (int pixfmt);
 
 //-----------------------------------------------------------------------------
 static int         fi_stream_open_in                (stream_obj* stream)
@@ -137,11 +139,24 @@ static int         fi_stream_open_in                (stream_obj* stream)
     if ( finj->sourceApi->get_param(finj->source, "rotation", &rotation, &size)>=0 &&
          rotation != 0 ) {
         finj->logCb(logInfo, _FMT("Detected rotation of " << rotation << " degrees"));
-        stream_api_t*   api=get_ff_filter_api();
-        stream_obj*     f=api->create("autoinserted_rotate");
-        stream_ref(f);
-        if ( api->set_param(f, "autoinserted_rotate.filterType", "rotate" ) < 0 ||
-             api->set_param(f, "autoinserted_rotate.rotation", &rotation ) < 0 ) {
+        // resize factory's blocked transpose, unless it can't handle the format;
+        // then it's the transpose avfilter
+        stream_api_t*   api;
+        stream_obj*     f;
+        int             configured;
+        if ( resize_factory_rotation_supports(finj->sourceApi->get_pixel_format(finj->source)) ) {
+            api=get_resize_factory_api();
+            f=api->create("autoinserted_rotate");
+            stream_ref(f);
+            configured = api->set_param(f, "autoinserted_rotate.rotation", &rotation );
+        } else {
+            api=get_ff_filter_api();
+            f=api->create("autoinserted_rotate");
+            stream_ref(f);
+            configured = ( api->set_param(f, "autoinserted_rotate.filterType", "rotate" ) >= 0 &&
+                           api->set_param(f, "autoinserted_rotate.rotation", &rotation ) >= 0 ) ? 0 : -1;
+        }
+        if ( configured < 0 ) {
             finj->logCb(logError, _FMT("Failed to configure rotation filter params"));
             stream_unref(&f);
             return -1;
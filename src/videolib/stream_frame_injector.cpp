@@ -2,7 +2,8 @@
  *
  * stream_frame_injector.cpp
  *   Source node providing the ability to inject frames into the graph using
- *   its set_param method. Not used in the context of SV.
+ *   its set_param method. In the context of SV, only the synthetic source
+ *   uses it, to encode its loop.
  *
  *****************************************************************************
  *
@@ -0,0 +1,553 @@
+/*****************************************************************************
+ *
+ * stream_fused_resize_filter.cpp
+ *   Single-pass YUV420P/NV12 to downscaled RGB/BGR conversion node
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#undef SV_MODULE_VAR
+#define SV_MODULE_VAR rszfilter
+#define SV_MODULE_ID "FUSEDRESIZE"
+#include "sv_module_def.hpp"
+
+#include "streamprv.h"
+#include "sv_ffmpeg.h"
+
+#include "frame_basic.h"
+
+#include "videolibUtils.h"
+
+#include "stream_resize_base.hpp"
+
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FUSED_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#define FUSEDRESIZE_FILTER_MAGIC 0x1229
+
+// Fixed point precision of the color matrix and of the sampling weights
+static const int kMatrixBits = 13;
+static const int kWeightBits = 8;
+
+//-----------------------------------------------------------------------------
+// Y/U/V -> R/G/B, in kMatrixBits fixed point, applied to Y-yOffset, U-128, V-128
+typedef struct yuv_matrix {
+    int16_t     yOffset;
+    int16_t     y;
+    int16_t     rv;
+    int16_t     gu;
+    int16_t     gv;
+    int16_t     bu;
+} yuv_matrix;
+
+#define _M(x) ((int16_t)((x)*(1<<kMatrixBits) + ((x)<0?-0.5:0.5)))
+static const yuv_matrix _kMatrix601Limited = { 16, _M(1.164), _M(1.596), _M(-0.392), _M(-0.813), _M(2.017) };
+static const yuv_matrix _kMatrix709Limited = { 16, _M(1.164), _M(1.793), _M(-0.213), _M(-0.533), _M(2.112) };
+static const yuv_matrix _kMatrix601Full    = { 0,  _M(1.0),   _M(1.402), _M(-0.344), _M(-0.714), _M(1.772) };
+static const yuv_matrix _kMatrix709Full    = { 0,  _M(1.0),   _M(1.575), _M(-0.187), _M(-0.468), _M(1.856) };
+#undef _M
+
+//-----------------------------------------------------------------------------
+// Where a destination column or row samples the source: between pos and pos+1
+typedef struct fused_tap {
+    int         pos;
+    int         weight;     // of pos+1, out of 1<<kWeightBits
+} fused_tap;
+
+//-----------------------------------------------------------------------------
+typedef struct fused_resize_filter  : public resize_base_obj  {
+    const yuv_matrix*       matrix;
+    std::vector<fused_tap>* lumaX;
+    std::vector<fused_tap>* lumaY;
+    std::vector<fused_tap>* chromaX;
+    std::vector<fused_tap>* chromaY;
+    int16_t*                rowBuf;     // Y, U, V rows of dst width, then R, G, B
+    AVFrame*                srcFrame;
+    frame_allocator*        fa;
+} fused_resize_filter_obj;
+
+//-----------------------------------------------------------------------------
+// Stream API
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+//  Forward declarations
+//-----------------------------------------------------------------------------
+static stream_obj* fused_resize_filter_create             (const char* name);
+static int         fused_resize_filter_set_param          (stream_obj* stream,
+                                                const CHAR_T* name,
+                                                const void* value);
+static int         fused_resize_filter_get_param          (stream_obj* stream,
+                                                const CHAR_T* name,
+                                                void* value,
+                                                size_t* size);
+static int         fused_resize_filter_open_in            (stream_obj* stream);
+static size_t      fused_resize_filter_get_width          (stream_obj* stream);
+static size_t      fused_resize_filter_get_height         (stream_obj* stream);
+static int         fused_resize_filter_get_pixel_format   (stream_obj* stream);
+static int         fused_resize_filter_read_frame         (stream_obj* stream, frame_obj** frame);
+static int         fused_resize_filter_close              (stream_obj* stream);
+static void        fused_resize_filter_destroy            (stream_obj* stream);
+
+//-----------------------------------------------------------------------------
+stream_api_t _g_fused_resize_filter_provider = {
+    fused_resize_filter_create,
+    get_default_stream_api()->set_source,
+    get_default_stream_api()->set_log_cb,
+    get_default_stream_api()->get_name,
+    get_default_stream_api()->find_element,
+    get_default_stream_api()->remove_element,
+    get_default_stream_api()->insert_element,
+    fused_resize_filter_set_param,
+    fused_resize_filter_get_param,
+    fused_resize_filter_open_in,
+    get_default_stream_api()->seek,
+    fused_resize_filter_get_width,
+    fused_resize_filter_get_height,
+    fused_resize_filter_get_pixel_format,
+    fused_resize_filter_read_frame,
+    get_default_stream_api()->print_pipeline,
+    fused_resize_filter_close,
+    _set_module_trace_level
+};
+
+
+//-----------------------------------------------------------------------------
+#define DECLARE_FUSED_RESIZE_FILTER(stream, name) \
+    DECLARE_OBJ(fused_resize_filter_obj, name,  stream, FUSEDRESIZE_FILTER_MAGIC, -1)
+
+#define DECLARE_FUSED_RESIZE_FILTER_V(stream, name) \
+    DECLARE_OBJ_V(fused_resize_filter_obj, name,  stream, FUSEDRESIZE_FILTER_MAGIC)
+
+static stream_obj*   fused_resize_filter_create                (const char* name)
+{
+    fused_resize_filter_obj* res = (fused_resize_filter_obj*)stream_init(sizeof(fused_resize_filter_obj),
+                FUSEDRESIZE_FILTER_MAGIC,
+                &_g_fused_resize_filter_provider,
+                name,
+                fused_resize_filter_destroy );
+
+    resize_base_init(res);
+    res->matrix = &_kMatrix601Limited;
+    res->lumaX = new std::vector<fused_tap>;
+    res->lumaY = new std::vector<fused_tap>;
+    res->chromaX = new std::vector<fused_tap>;
+    res->chromaY = new std::vector<fused_tap>;
+    res->rowBuf = NULL;
+    res->srcFrame = NULL;
+    res->fa = create_frame_allocator(_STR("fusedresize_"<<name));
+    return (stream_obj*)res;
+}
+
+//-----------------------------------------------------------------------------
+// Can the filter do this conversion in one pass?
+bool               fused_resize_filter_supports   (int srcPixfmt, int dstPixfmt,
+                                                   size_t srcWidth, size_t srcHeight,
+                                                   size_t dstWidth, size_t dstHeight)
+{
+    return ( srcPixfmt == pfmtYUV420P || srcPixfmt == pfmtYUVJ420P || srcPixfmt == pfmtNV12 ) &&
+           ( dstPixfmt == pfmtRGB24 || dstPixfmt == pfmtBGR24 ) &&
+           dstWidth > 0 && dstHeight > 0 &&
+           dstWidth <= srcWidth && dstHeight <= srcHeight;
+}
+
+//-----------------------------------------------------------------------------
+static int         fused_resize_filter_set_param             (stream_obj* stream,
+                                            const CHAR_T* name,
+                                            const void* value)
+{
+    DECLARE_FUSED_RESIZE_FILTER(stream, rszfilter);
+    if (resize_base_set_param(rszfilter, name, value) >= 0 ) {
+        return 0;
+    }
+    return default_set_param(stream, name, value);
+}
+
+//-----------------------------------------------------------------------------
+static int         fused_resize_filter_get_param          (stream_obj* stream,
+                                                const CHAR_T* name,
+                                                void* value,
+                                                size_t* size)
+{
+    DECLARE_FUSED_RESIZE_FILTER(stream, rszfilter);
+    if (resize_base_get_param(rszfilter, name, value, size) >= 0 ) {
+        return 0;
+    }
+    return default_get_param(stream, name, value, size);
+}
+
+//-----------------------------------------------------------------------------
+// Bilinear taps of dstSize points spread over srcSize, sampled at the centers
+// of the destination pixels
+static void        _fused_make_taps               (std::vector<fused_tap>& taps,
+                                                   int srcSize,
+                                                   int dstSize)
+{
+    taps.resize(dstSize);
+    for (int nI=0; nI<dstSize; nI++) {
+        double pos = (nI + 0.5) * srcSize / dstSize - 0.5;
+        if ( pos < 0 ) {
+            pos = 0;
+        }
+        int ipos = (int)pos;
+        int weight = (int)((pos - ipos) * (1<<kWeightBits) + 0.5);
+        if ( ipos >= srcSize - 1 ) {
+            ipos = srcSize - 1;
+            weight = 0;
+        }
+        taps[nI].pos = ipos;
+        taps[nI].weight = weight;
+    }
+}
+
+//-----------------------------------------------------------------------------
+static int         fused_resize_filter_open_in                (stream_obj* stream)
+{
+    DECLARE_FUSED_RESIZE_FILTER(stream, rszfilter);
+
+    // make sure we have cleaned up
+    fused_resize_filter_close(stream);
+
+    if ( resize_base_open_in(rszfilter) < 0 ) {
+        return -1;
+    }
+
+    if ( !fused_resize_filter_supports(rszfilter->inputPixFmt, rszfilter->pixfmt,
+                                       rszfilter->inputWidth, rszfilter->inputHeight,
+                                       rszfilter->dimActual.width, rszfilter->dimActual.height) ) {
+        rszfilter->logCb(logError, _FMT("Fused resize can't convert pfmt=" << rszfilter->inputPixFmt <<
+                                    " " << rszfilter->inputWidth << "x" << rszfilter->inputHeight <<
+                                    " to pfmt=" << rszfilter->pixfmt <<
+                                    " " << rszfilter->dimActual.width << "x" << rszfilter->dimActual.height));
+        return -1;
+    }
+
+    // same rules resize_set_color_options applies for swscale: explicit
+    // settings take effect only when both are given, range being 1 for full
+    bool full = ( rszfilter->inputPixFmt == pfmtYUVJ420P );
+    bool bt709 = false;
+    if ( rszfilter->colorSpace >= 0 && rszfilter->colorRange >= 0 ) {
+        full = ( rszfilter->colorRange != 0 );
+        bt709 = ( rszfilter->colorSpace == 709 );
+    }
+    rszfilter->matrix = bt709 ? ( full ? &_kMatrix709Full : &_kMatrix709Limited )
+                              : ( full ? &_kMatrix601Full : &_kMatrix601Limited );
+
+    int srcW = (int)rszfilter->inputWidth;
+    int srcH = (int)rszfilter->inputHeight;
+    int dstW = (int)rszfilter->dimActual.width;
+    int dstH = (int)rszfilter->dimActual.height;
+    _fused_make_taps(*rszfilter->lumaX, srcW, dstW);
+    _fused_make_taps(*rszfilter->lumaY, srcH, dstH);
+    _fused_make_taps(*rszfilter->chromaX, (srcW+1)/2, dstW);
+    _fused_make_taps(*rszfilter->chromaY, (srcH+1)/2, dstH);
+
+    // 6 rows, padded for the vector loop
+    rszfilter->rowBuf = (int16_t*)av_malloc(6*(dstW+8)*sizeof(int16_t));
+    rszfilter->srcFrame = av_frame_alloc();
+    if ( rszfilter->rowBuf == NULL || rszfilter->srcFrame == NULL ) {
+        rszfilter->logCb(logError, _FMT("Failed to allocate fused resize buffers"));
+        fused_resize_filter_close(stream);
+        return -1;
+    }
+
+    rszfilter->logCb(logDebug, _FMT("Fused resize filter '" << rszfilter->name << "': " <<
+                                    srcW << "x" << srcH << " pfmt=" << rszfilter->inputPixFmt << " -> " <<
+                                    dstW << "x" << dstH << " pfmt=" << rszfilter->pixfmt <<
+                                    " range=" << (full?"full":"limited") <<
+                                    " matrix=" << (bt709?709:601)));
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static size_t      fused_resize_filter_get_width          (stream_obj* stream)
+{
+    DECLARE_FUSED_RESIZE_FILTER(stream, rszfilter);
+    return resize_base_get_width(rszfilter);
+}
+
+//-----------------------------------------------------------------------------
+static size_t      fused_resize_filter_get_height         (stream_obj* stream)
+{
+    DECLARE_FUSED_RESIZE_FILTER(stream, rszfilter);
+    return resize_base_get_height(rszfilter);
+}
+
+//-----------------------------------------------------------------------------
+static int      fused_resize_filter_get_pixel_format   (stream_obj* stream)
+{
+    DECLARE_FUSED_RESIZE_FILTER(stream, rszfilter);
+    return resize_base_get_pixel_format(rszfilter);
+}
+
+//-----------------------------------------------------------------------------
+static inline int  _fused_lerp                    (int a, int b, int weight)
+{
+    return a + (((b - a) * weight) >> kWeightBits);
+}
+
+//-----------------------------------------------------------------------------
+// Samples one destination row of a plane; step is the distance between
+// samples of the plane (2 for NV12 chroma)
+static void        _fused_sample_row              (const uint8_t* row0,
+                                                   const uint8_t* row1,
+                                                   int rowWeight,
+                                                   int step,
+                                                   const fused_tap* taps,
+                                                   int count,
+                                                   int16_t bias,
+                                                   int16_t* dst)
+{
+    for (int nI=0; nI<count; nI++) {
+        const uint8_t* p0 = row0 + taps[nI].pos*step;
+        const uint8_t* p1 = row1 + taps[nI].pos*step;
+        int w = taps[nI].weight;
+        int top = _fused_lerp(p0[0], p0[step], w);
+        int bottom = _fused_lerp(p1[0], p1[step], w);
+        dst[nI] = (int16_t)(_fused_lerp(top, bottom, rowWeight) - bias);
+    }
+}
+
+//-----------------------------------------------------------------------------
+static inline uint8_t _fused_clip                 (int v)
+{
+    return (uint8_t)( v < 0 ? 0 : ( v > 255 ? 255 : v ) );
+}
+
+//-----------------------------------------------------------------------------
+// Turns the sampled Y/U/V rows into R/G/B rows
+static void        _fused_convert_row             (const yuv_matrix* m,
+                                                   const int16_t* y,
+                                                   const int16_t* u,
+                                                   const int16_t* v,
+                                                   uint8_t* r,
+                                                   uint8_t* g,
+                                                   uint8_t* b,
+                                                   int count)
+{
+    int nI = 0;
+#if FUSED_SSE2
+    const __m128i cRV   = _mm_setr_epi16(m->y, m->rv, m->y, m->rv, m->y, m->rv, m->y, m->rv);
+    const __m128i cGU   = _mm_setr_epi16(m->y, m->gu, m->y, m->gu, m->y, m->gu, m->y, m->gu);
+    const __m128i cGV   = _mm_setr_epi16(m->gv, 0, m->gv, 0, m->gv, 0, m->gv, 0);
+    const __m128i cBU   = _mm_setr_epi16(m->y, m->bu, m->y, m->bu, m->y, m->bu, m->y, m->bu);
+    const __m128i round = _mm_set1_epi32(1<<(kMatrixBits-1));
+    const __m128i zero  = _mm_setzero_si128();
+
+#define _FUSED_DOT(lo, hi, c, out) \
+    { \
+        __m128i l = _mm_srai_epi32(_mm_add_epi32(lo, round), kMatrixBits); \
+        __m128i h = _mm_srai_epi32(_mm_add_epi32(hi, round), kMatrixBits); \
+        __m128i p = _mm_packs_epi32(l, h); \
+        _mm_storel_epi64((__m128i*)(out), _mm_packus_epi16(p, p)); \
+    }
+
+    for (; nI+8<=count; nI+=8) {
+        __m128i vy = _mm_loadu_si128((const __m128i*)(y+nI));
+        __m128i vu = _mm_loadu_si128((const __m128i*)(u+nI));
+        __m128i vv = _mm_loadu_si128((const __m128i*)(v+nI));
+        __m128i yvLo = _mm_unpacklo_epi16(vy, vv), yvHi = _mm_unpackhi_epi16(vy, vv);
+        __m128i yuLo = _mm_unpacklo_epi16(vy, vu), yuHi = _mm_unpackhi_epi16(vy, vu);
+        __m128i v0Lo = _mm_unpacklo_epi16(vv, zero), v0Hi = _mm_unpackhi_epi16(vv, zero);
+
+        _FUSED_DOT(_mm_madd_epi16(yvLo, cRV), _mm_madd_epi16(yvHi, cRV), cRV, r+nI);
+        _FUSED_DOT(_mm_add_epi32(_mm_madd_epi16(yuLo, cGU), _mm_madd_epi16(v0Lo, cGV)),
+                   _mm_add_epi32(_mm_madd_epi16(yuHi, cGU), _mm_madd_epi16(v0Hi, cGV)), cGU, g+nI);
+        _FUSED_DOT(_mm_madd_epi16(yuLo, cBU), _mm_madd_epi16(yuHi, cBU), cBU, b+nI);
+    }
+#undef _FUSED_DOT
+#endif
+    const int round1 = 1<<(kMatrixBits-1);
+    for (; nI<count; nI++) {
+        int yy = m->y * y[nI] + round1;
+        r[nI] = _fused_clip((yy + m->rv * v[nI]) >> kMatrixBits);
+        g[nI] = _fused_clip((yy + m->gu * u[nI] + m->gv * v[nI]) >> kMatrixBits);
+        b[nI] = _fused_clip((yy + m->bu * u[nI]) >> kMatrixBits);
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void        _fused_resize                  (fused_resize_filter_obj* rszfilter,
+                                                   AVFrame* src,
+                                                   uint8_t* dst)
+{
+    const yuv_matrix*   m = rszfilter->matrix;
+    int                 dstW = (int)rszfilter->dimActual.width;
+    int                 dstH = (int)rszfilter->dimActual.height;
+    int                 stride = dstW + 8;
+    int16_t*            y = rszfilter->rowBuf;
+    int16_t*            u = y + stride;
+    int16_t*            v = u + stride;
+    uint8_t*            r = (uint8_t*)(v + stride);
+    uint8_t*            g = r + stride;
+    uint8_t*            b = g + stride;
+    bool                nv12 = ( rszfilter->inputPixFmt == pfmtNV12 );
+    bool                bgr = ( rszfilter->pixfmt == pfmtBGR24 );
+    int                 chromaH = ((int)rszfilter->inputHeight+1)/2;
+    int                 lumaH = (int)rszfilter->inputHeight;
+    const fused_tap*    lx = &(*rszfilter->lumaX)[0];
+    const fused_tap*    cx = &(*rszfilter->chromaX)[0];
+
+    for (int row=0; row<dstH; row++) {
+        const fused_tap& ly = (*rszfilter->lumaY)[row];
+        const fused_tap& cy = (*rszfilter->chromaY)[row];
+        int              ly1 = ly.pos+1 < lumaH ? ly.pos+1 : ly.pos;
+        int              cy1 = cy.pos+1 < chromaH ? cy.pos+1 : cy.pos;
+
+        _fused_sample_row(src->data[0] + ly.pos*src->linesize[0],
+                          src->data[0] + ly1*src->linesize[0],
+                          ly.weight, 1, lx, dstW, m->yOffset, y);
+        if ( nv12 ) {
+            const uint8_t* c0 = src->data[1] + cy.pos*src->linesize[1];
+            const uint8_t* c1 = src->data[1] + cy1*src->linesize[1];
+            _fused_sample_row(c0, c1, cy.weight, 2, cx, dstW, 128, u);
+            _fused_sample_row(c0+1, c1+1, cy.weight, 2, cx, dstW, 128, v);
+        } else {
+            _fused_sample_row(src->data[1] + cy.pos*src->linesize[1],
+                              src->data[1] + cy1*src->linesize[1],
+                              cy.weight, 1, cx, dstW, 128, u);
+            _fused_sample_row(src->data[2] + cy.pos*src->linesize[2],
+                              src->data[2] + cy1*src->linesize[2],
+                              cy.weight, 1, cx, dstW, 128, v);
+        }
+
+        _fused_convert_row(m, y, u, v, r, g, b, dstW);
+
+        uint8_t* out = dst + row*dstW*3;
+        const uint8_t* first = bgr ? b : r;
+        const uint8_t* last = bgr ? r : b;
+        for (int nI=0; nI<dstW; nI++, out+=3) {
+            out[0] = first[nI];
+            out[1] = g[nI];
+            out[2] = last[nI];
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+static int         fused_resize_filter_read_frame        (stream_obj* stream,
+                                                    frame_obj** frame)
+{
+    DECLARE_FUSED_RESIZE_FILTER(stream, rszfilter);
+    int res = -1;
+
+    frame_obj* tmp = resize_base_pre_process(rszfilter, frame, &res);
+    if ( tmp == NULL ) {
+        return res;
+    }
+
+    frame_api_t*    tmpFrameAPI = frame_get_api(tmp);
+    int srcPixfmt = tmpFrameAPI->get_pixel_format(tmp);
+    if ( srcPixfmt != rszfilter->inputPixFmt ) {
+        rszfilter->logCb(logError, _FMT("input frame pfmt=" << srcPixfmt << ", fused resize filter cannot continue"));
+        frame_unref(&tmp);
+        return -1;
+    }
+
+    AVFrame* srcFrame = (AVFrame*)tmpFrameAPI->get_backing_obj(tmp, "avframe");
+    if ( srcFrame == NULL ) {
+        srcFrame = rszfilter->srcFrame;
+        av_image_fill_arrays(srcFrame->data,
+                       srcFrame->linesize,
+                       (const uint8_t*)tmpFrameAPI->get_data(tmp),
+                       svpfmt_to_ffpfmt(rszfilter->inputPixFmt, NULL),
+                       rszfilter->inputWidth,
+                       rszfilter->inputHeight,
+                       _kDefAlign );
+    }
+
+    int             dataSize = rszfilter->dimActual.width*rszfilter->dimActual.height*3;
+    basic_frame_obj* newFrame = alloc_basic_frame2(FUSEDRESIZE_FILTER_MAGIC,
+                                dataSize,
+                                rszfilter->logCb,
+                                rszfilter->fa );
+    newFrame->pts = tmpFrameAPI->get_pts(tmp);
+    newFrame->dts = tmpFrameAPI->get_dts(tmp);
+    newFrame->keyframe = 1;
+    newFrame->width = rszfilter->dimActual.width;
+    newFrame->height = rszfilter->dimActual.height;
+    newFrame->pixelFormat = rszfilter->pixfmt;
+    newFrame->mediaType = mediaVideo;
+    newFrame->dataSize = dataSize;
+
+    _fused_resize(rszfilter, srcFrame, newFrame->data);
+
+    TRACE(_FMT("Generated frame: pts=" << newFrame->pts <<
+            " dstSize=" << newFrame->width << "x" << newFrame->height <<
+            " dstPixFmt=" << newFrame->pixelFormat <<
+            " srcSize=" << rszfilter->inputWidth << "x" << rszfilter->inputHeight <<
+            " srcPixFmt=" << srcPixfmt ) );
+
+    if ( rszfilter->retainSourceFrameInterval > 0 &&
+         ( rszfilter->prevFramePts == INVALID_PTS ||
+         newFrame->pts >= rszfilter->prevFramePts + rszfilter->retainSourceFrameInterval) ) {
+        if ( newFrame->api->set_backing_obj((frame_obj*)newFrame, "srcFrame", tmp) < 0 ) {
+            rszfilter->logCb(logError, _FMT("Failed to set source frame object!"));
+        }
+        // only need this variable when original frames are being retained
+        rszfilter->prevFramePts = newFrame->pts;
+    }
+
+    resize_base_share_result(rszfilter, tmp, (frame_obj*)newFrame);
+    frame_unref(&tmp);
+    *frame = (frame_obj*)newFrame;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static int         fused_resize_filter_close             (stream_obj* stream)
+{
+    DECLARE_FUSED_RESIZE_FILTER(stream, rszfilter);
+    av_freep(&rszfilter->rowBuf);
+    av_frame_free(&rszfilter->srcFrame);
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void fused_resize_filter_destroy         (stream_obj* stream)
+{
+    DECLARE_FUSED_RESIZE_FILTER_V(stream, rszfilter);
+    rszfilter->logCb(logTrace, _FMT("Destroying stream object " << (void*)stream));
+    fused_resize_filter_close(stream); // make sure all the internals had been freed
+    delete rszfilter->lumaX;
+    delete rszfilter->lumaY;
+    delete rszfilter->chromaX;
+    delete rszfilter->chromaY;
+    destroy_frame_allocator(&rszfilter->fa, rszfilter->logCb);
+    stream_destroy( stream );
+}
+
+//-----------------------------------------------------------------------------
+SVVIDEOLIB_API stream_api_t*     get_fused_resize_filter_api                    ()
+{
+    return &_g_fused_resize_filter_provider;
+}
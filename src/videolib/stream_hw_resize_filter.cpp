@@ -0,0 +1,464 @@
+/*****************************************************************************
+ *
+ * stream_hw_resize_filter.cpp
+ *   Resize node operating on device-resident (hw_frames_ctx) frames
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#undef SV_MODULE_VAR
+#define SV_MODULE_VAR hwrszfilter
+#define SV_MODULE_ID "HWRESIZE"
+#include "sv_module_def.hpp"
+
+#include "streamprv.h"
+#include "sv_ffmpeg.h"
+
+
+#include "frame_basic.h"
+
+#include "videolibUtils.h"
+#include "frame_trace.h"
+
+#include "stream_resize_base.hpp"
+
+#define HWRESIZE_FILTER_MAGIC 0x1226
+
+//-----------------------------------------------------------------------------
+// Scales hardware frames on the device they were decoded on, and downloads
+// the result into system memory. Output pixel format is the software format
+// of the source frames context (typically NV12); any further color conversion
+// is left to the next node.
+// With keepOnDevice, the scaled frames stay on the device instead (for a
+// hardware encoder to pick up), provided the device has a scaler.
+//-----------------------------------------------------------------------------
+typedef struct hw_resize_filter  : public resize_base_obj  {
+    AVFilterGraph*      graph;
+    AVFilterContext*    bufsrc;
+    AVFilterContext*    bufsink;
+    void*               graphFramesCtx; // frames context the graph had been built for
+    frame_allocator*    fa;
+} hw_resize_filter_obj;
+
+//-----------------------------------------------------------------------------
+// Stream API
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+//  Forward declarations
+//-----------------------------------------------------------------------------
+static stream_obj* hw_resize_filter_create             (const char* name);
+static int         hw_resize_filter_set_param          (stream_obj* stream,
+                                                const CHAR_T* name,
+                                                const void* value);
+static int         hw_resize_filter_get_param          (stream_obj* stream,
+                                                const CHAR_T* name,
+                                                void* value,
+                                                size_t* size);
+static int         hw_resize_filter_open_in            (stream_obj* stream);
+static size_t      hw_resize_filter_get_width          (stream_obj* stream);
+static size_t      hw_resize_filter_get_height         (stream_obj* stream);
+static int         hw_resize_filter_get_pixel_format   (stream_obj* stream);
+static int         hw_resize_filter_read_frame         (stream_obj* stream, frame_obj** frame);
+static int         hw_resize_filter_close              (stream_obj* stream);
+static void        hw_resize_filter_destroy            (stream_obj* stream);
+
+extern "C" frame_api_t*     get_ffframe_frame_api   ( );
+extern frame_obj*           alloc_avframe_frame     (int ownerTag, frame_allocator* fa,
+                                                    fn_stream_log logCb);
+
+//-----------------------------------------------------------------------------
+stream_api_t _g_hw_resize_filter_provider = {
+    hw_resize_filter_create,
+    get_default_stream_api()->set_source,
+    get_default_stream_api()->set_log_cb,
+    get_default_stream_api()->get_name,
+    get_default_stream_api()->find_element,
+    get_default_stream_api()->remove_element,
+    get_default_stream_api()->insert_element,
+    hw_resize_filter_set_param,
+    hw_resize_filter_get_param,
+    hw_resize_filter_open_in,
+    get_default_stream_api()->seek,
+    hw_resize_filter_get_width,
+    hw_resize_filter_get_height,
+    hw_resize_filter_get_pixel_format,
+    hw_resize_filter_read_frame,
+    get_default_stream_api()->print_pipeline,
+    hw_resize_filter_close,
+    _set_module_trace_level
+};
+
+
+//-----------------------------------------------------------------------------
+#define DECLARE_HWRESIZE_FILTER(stream, name) \
+    DECLARE_OBJ(hw_resize_filter_obj, name,  stream, HWRESIZE_FILTER_MAGIC, -1)
+
+#define DECLARE_HWRESIZE_FILTER_V(stream, name) \
+    DECLARE_OBJ_V(hw_resize_filter_obj, name,  stream, HWRESIZE_FILTER_MAGIC)
+
+static stream_obj*   hw_resize_filter_create                (const char* name)
+{
+    hw_resize_filter_obj* res = (hw_resize_filter_obj*)stream_init(sizeof(hw_resize_filter_obj),
+                HWRESIZE_FILTER_MAGIC,
+                &_g_hw_resize_filter_provider,
+                name,
+                hw_resize_filter_destroy );
+
+    resize_base_init(res);
+    res->graph = NULL;
+    res->bufsrc = NULL;
+    res->bufsink = NULL;
+    res->graphFramesCtx = NULL;
+    res->fa = create_frame_allocator(name);
+    return (stream_obj*)res;
+}
+
+//-----------------------------------------------------------------------------
+static int         hw_resize_filter_set_param             (stream_obj* stream,
+                                            const CHAR_T* name,
+                                            const void* value)
+{
+    DECLARE_HWRESIZE_FILTER(stream, hwrszfilter);
+    if (resize_base_set_param(hwrszfilter, name, value) >= 0 ) {
+        return 0;
+    }
+    return default_set_param(stream, name, value);
+}
+
+//-----------------------------------------------------------------------------
+static const char* _hw_resize_scaler_name          (enum AVHWDeviceType type)
+{
+    switch (type) {
+    case AV_HWDEVICE_TYPE_VAAPI:        return "scale_vaapi";
+    case AV_HWDEVICE_TYPE_CUDA:         return "scale_cuda";
+    case AV_HWDEVICE_TYPE_QSV:          return "scale_qsv";
+    case AV_HWDEVICE_TYPE_VIDEOTOOLBOX: return "scale_vt";
+    default:                            return NULL;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Whether frames of the frames context will come out of the filter still on the device
+static bool        _hw_resize_keeps_on_device      (hw_resize_filter_obj* hwrszfilter,
+                                                    AVHWFramesContext* framesCtx)
+{
+    if ( !hwrszfilter->keepOnDevice || framesCtx == NULL ) {
+        return false;
+    }
+    const char* scaler = _hw_resize_scaler_name(framesCtx->device_ctx->type);
+    return scaler != NULL && avfilter_get_by_name(scaler) != NULL;
+}
+
+//-----------------------------------------------------------------------------
+static int         hw_resize_filter_get_param          (stream_obj* stream,
+                                                const CHAR_T* name,
+                                                void* value,
+                                                size_t* size)
+{
+    DECLARE_HWRESIZE_FILTER(stream, hwrszfilter);
+    if (resize_base_get_param(hwrszfilter, name, value, size) >= 0 ) {
+        return 0;
+    }
+    const CHAR_T* scopedName = stream_param_name_apply_scope(stream, name);
+    if ( !_stricmp(scopedName, "hwFramesContext") ) {
+        // downstream only gets device frames if we keep them there
+        AVBufferRef* framesCtx = NULL;
+        size_t       szFramesCtx = sizeof(framesCtx);
+        if ( default_get_param(stream, name, &framesCtx, &szFramesCtx) < 0 ||
+             framesCtx == NULL ||
+             !_hw_resize_keeps_on_device(hwrszfilter, (AVHWFramesContext*)framesCtx->data) ) {
+            framesCtx = NULL;
+        }
+        COPY_PARAM_IF(hwrszfilter, scopedName, "hwFramesContext", AVBufferRef*, framesCtx);
+    }
+    return default_get_param(stream, name, value, size);
+}
+
+//-----------------------------------------------------------------------------
+static void        _hw_resize_free_graph           (hw_resize_filter_obj* hwrszfilter)
+{
+    avfilter_graph_free(&hwrszfilter->graph);
+    hwrszfilter->bufsrc = NULL;
+    hwrszfilter->bufsink = NULL;
+    hwrszfilter->graphFramesCtx = NULL;
+}
+
+//-----------------------------------------------------------------------------
+static int         _hw_resize_build_graph          (hw_resize_filter_obj* hwrszfilter,
+                                                    AVFrame* hwFrame)
+{
+    AVHWFramesContext*      framesCtx = (AVHWFramesContext*)hwFrame->hw_frames_ctx->data;
+    AVBufferSrcParameters*  srcParams = NULL;
+    AVFilterInOut*          inputs = NULL;
+    AVFilterInOut*          outputs = NULL;
+    const char*             scaler = _hw_resize_scaler_name(framesCtx->device_ctx->type);
+    const char*             swFormatName = av_get_pix_fmt_name(framesCtx->sw_format);
+    char                    args[512];
+    int                     res = -1;
+
+    _hw_resize_free_graph(hwrszfilter);
+
+    hwrszfilter->graph = avfilter_graph_alloc();
+    if (!hwrszfilter->graph) {
+        hwrszfilter->logCb(logError, "Couldn't allocate the graph");
+        goto Error;
+    }
+
+    snprintf(args, sizeof(args),
+            "video_size=%dx%d:pix_fmt=%d:time_base=1/1000:pixel_aspect=1/1",
+            hwFrame->width,
+            hwFrame->height,
+            hwFrame->format);
+    if (avfilter_graph_create_filter(&hwrszfilter->bufsrc, avfilter_get_by_name("buffer"),
+                "in", args, NULL, hwrszfilter->graph) < 0 ||
+        avfilter_graph_create_filter(&hwrszfilter->bufsink, avfilter_get_by_name("buffersink"),
+                "out", NULL, NULL, hwrszfilter->graph) < 0) {
+        hwrszfilter->logCb(logError, _FMT("Couldn't create the filter input/output"));
+        goto Error;
+    }
+
+    // buffer source needs to know which device frames are coming from
+    srcParams = av_buffersrc_parameters_alloc();
+    if (!srcParams) {
+        goto Error;
+    }
+    srcParams->hw_frames_ctx = hwFrame->hw_frames_ctx;
+    res = av_buffersrc_parameters_set(hwrszfilter->bufsrc, srcParams);
+    av_freep(&srcParams);
+    if ( res < 0 ) {
+        hwrszfilter->logCb(logError, _FMT("Couldn't set hardware frames context on the filter input"));
+        goto Error;
+    }
+    res = -1;
+
+    if ( _hw_resize_keeps_on_device(hwrszfilter, framesCtx) ) {
+        snprintf(args, sizeof(args), "%s=w=%d:h=%d",
+                scaler,
+                (int)hwrszfilter->dimActual.width,
+                (int)hwrszfilter->dimActual.height);
+    } else if ( scaler != NULL && avfilter_get_by_name(scaler) != NULL ) {
+        snprintf(args, sizeof(args), "%s=w=%d:h=%d,hwdownload,format=pix_fmts=%s",
+                scaler,
+                (int)hwrszfilter->dimActual.width,
+                (int)hwrszfilter->dimActual.height,
+                swFormatName);
+    } else {
+        // no scaler on this device -- still correct, but the download is full-sized
+        hwrszfilter->logCb(logInfo, _FMT("No device scaler for '" << av_hwdevice_get_type_name(framesCtx->device_ctx->type) <<
+                                        "'; scaling after download"));
+        snprintf(args, sizeof(args), "hwdownload,format=pix_fmts=%s,scale=w=%d:h=%d:flags=fast_bilinear",
+                swFormatName,
+                (int)hwrszfilter->dimActual.width,
+                (int)hwrszfilter->dimActual.height);
+    }
+
+    outputs = avfilter_inout_alloc();
+    inputs = avfilter_inout_alloc();
+    if (!outputs || !inputs) {
+        goto Error;
+    }
+    outputs->name = av_strdup("in");
+    outputs->filter_ctx = hwrszfilter->bufsrc;
+    outputs->pad_idx = 0;
+    outputs->next = NULL;
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = hwrszfilter->bufsink;
+    inputs->pad_idx = 0;
+    inputs->next = NULL;
+
+    TRACE(_FMT("Filter: config=" << args));
+
+    if (avfilter_graph_parse_ptr(hwrszfilter->graph, args, &inputs, &outputs, NULL) < 0) {
+        hwrszfilter->logCb(logError, _FMT("Couldn't parse the filter description: " << args));
+        goto Error;
+    }
+
+    if (avfilter_graph_config(hwrszfilter->graph, NULL) < 0) {
+        hwrszfilter->logCb(logError, _FMT("Couldn't configure the filter graph: " << args));
+        goto Error;
+    }
+
+    hwrszfilter->graphFramesCtx = hwFrame->hw_frames_ctx->data;
+    hwrszfilter->logCb(logDebug, _FMT("Resize filter '" << hwrszfilter->name << "' configured as: " << args));
+    res = 0;
+
+Error:
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    if ( res != 0 ) {
+        _hw_resize_free_graph(hwrszfilter);
+    }
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+static int         hw_resize_filter_open_in                (stream_obj* stream)
+{
+    DECLARE_HWRESIZE_FILTER(stream, hwrszfilter);
+
+    // make sure we have cleaned up
+    hw_resize_filter_close(stream);
+
+    if (resize_base_open_in(hwrszfilter) < 0) {
+        return -1;
+    }
+
+    // the graph is built once the first frame (and its frames context) is seen
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static size_t      hw_resize_filter_get_width          (stream_obj* stream)
+{
+    DECLARE_HWRESIZE_FILTER(stream, hwrszfilter);
+    return resize_base_get_width(hwrszfilter);
+}
+
+//-----------------------------------------------------------------------------
+static size_t      hw_resize_filter_get_height         (stream_obj* stream)
+{
+    DECLARE_HWRESIZE_FILTER(stream, hwrszfilter);
+    return resize_base_get_height(hwrszfilter);
+}
+
+//-----------------------------------------------------------------------------
+static int      hw_resize_filter_get_pixel_format   (stream_obj* stream)
+{
+    DECLARE_HWRESIZE_FILTER(stream, hwrszfilter);
+    return resize_base_get_pixel_format(hwrszfilter);
+}
+
+//-----------------------------------------------------------------------------
+static int         hw_resize_filter_read_frame        (stream_obj* stream,
+                                                    frame_obj** frame)
+{
+    DECLARE_HWRESIZE_FILTER(stream, hwrszfilter);
+    int res = -1;
+
+    frame_obj* tmp = resize_base_pre_process(hwrszfilter, frame, &res);
+    if ( tmp == NULL ) {
+        return res;
+    }
+
+    frame_api_t*    fapi = get_ffframe_frame_api();
+    frame_api_t*    tmpFrameAPI = frame_get_api(tmp);
+    frame_obj*      outputFrame = NULL;
+    INT64_T         pts = tmpFrameAPI->get_pts(tmp);
+    AVFrame*        dstFrame = NULL;
+    AVFrame*        hwFrame = (AVFrame*)tmpFrameAPI->get_backing_obj(tmp, "hwframe");
+
+    res = -1;
+    if ( hwFrame == NULL ) {
+        hwrszfilter->logCb(logError, _FMT("Frame with pts=" << pts << " isn't device-resident"));
+        goto Error;
+    }
+
+    if ( hwrszfilter->graph == NULL ||
+         hwrszfilter->graphFramesCtx != hwFrame->hw_frames_ctx->data ) {
+        if ( _hw_resize_build_graph(hwrszfilter, hwFrame) < 0 ) {
+            goto Error;
+        }
+    }
+
+    dstFrame = av_frame_alloc();
+    if ( dstFrame == NULL ) {
+        goto Error;
+    }
+
+    if ((res = av_buffersrc_add_frame_flags(hwrszfilter->bufsrc, hwFrame,
+                                            AV_BUFFERSRC_FLAG_KEEP_REF)) < 0) {
+        hwrszfilter->logCb(logError, _FMT("filter failed to accept a frame " << res));
+        goto Error;
+    }
+    if ((res = av_buffersink_get_frame(hwrszfilter->bufsink, dstFrame)) < 0) {
+        hwrszfilter->logCb(logError, _FMT("filter failed to process frame " << res));
+        goto Error;
+    }
+    av_frame_copy_props(dstFrame, hwFrame);
+    res = -1;
+
+    outputFrame = alloc_avframe_frame(HWRESIZE_FILTER_MAGIC, hwrszfilter->fa,
+                                      hwrszfilter->logCb);
+    fapi->set_media_type(outputFrame, mediaVideo);
+    if ( fapi->set_backing_obj(outputFrame, "avframe", dstFrame) < 0 ) {
+        hwrszfilter->logCb(logError, _FMT("Couldn't initialize output frame"));
+        goto Error;
+    }
+    dstFrame = NULL;
+
+    TRACE(_FMT("Generated frame: pts=" << pts <<
+            " dstSize=" << hwrszfilter->dimActual.width << "x" << hwrszfilter->dimActual.height <<
+            " dstPixFmt=" << fapi->get_pixel_format(outputFrame) <<
+            " srcSize=" << hwrszfilter->inputWidth << "x" << hwrszfilter->inputHeight ));
+
+    if ( hwrszfilter->retainSourceFrameInterval > 0 &&
+         ( hwrszfilter->prevFramePts == INVALID_PTS ||
+         pts >= hwrszfilter->prevFramePts + hwrszfilter->retainSourceFrameInterval) ) {
+        if ( fapi->set_backing_obj(outputFrame, "srcFrame", tmp) < 0 ) {
+            hwrszfilter->logCb(logError, _FMT("Failed to set source frame object!"));
+        }
+        hwrszfilter->prevFramePts = pts;
+    }
+
+    frame_trace_forward(tmp, outputFrame, ftResized);
+    *frame = outputFrame;
+    outputFrame = NULL;
+    res = 0;
+
+Error:
+    av_frame_free(&dstFrame);
+    frame_unref(&outputFrame);
+    frame_unref(&tmp);
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+static int         hw_resize_filter_close             (stream_obj* stream)
+{
+    DECLARE_HWRESIZE_FILTER(stream, hwrszfilter);
+    _hw_resize_free_graph(hwrszfilter);
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void hw_resize_filter_destroy         (stream_obj* stream)
+{
+    DECLARE_HWRESIZE_FILTER_V(stream, hwrszfilter);
+    hwrszfilter->logCb(logTrace, _FMT("Destroying stream object " << (void*)stream));
+    hw_resize_filter_close(stream); // make sure all the internals had been freed
+    destroy_frame_allocator(&hwrszfilter->fa, hwrszfilter->logCb);
+    stream_destroy( stream );
+}
+
+//-----------------------------------------------------------------------------
+SVVIDEOLIB_API stream_api_t*     get_hw_resize_filter_api                  ()
+{
+    ffmpeg_init();
+    return &_g_hw_resize_filter_provider;
+}
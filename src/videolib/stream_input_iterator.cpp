@@ -41,9 +41,15 @@
 
 #include "videolibUtils.h"
 
+#include <list>
+
 #define LIST_DEMUX_MAGIC 0x1301
 #define MAX_PARAM 10
 
+// upper bound on frames read ahead from a prefetched input, should its
+// first GOP be unusually long
+static const size_t _kMaxPrefetchFrames = 256;
+
 //-----------------------------------------------------------------------------
 typedef struct list_param_set_obj_ {
     char*               paramName;
@@ -58,6 +64,18 @@ typedef struct stream_state {
     uint64_t            lastFramePts;
 } stream_state;
 
+//-----------------------------------------------------------------------------
+// Input opened ahead of time, with the frames of its first GOP already read
+typedef struct list_prefetch {
+    size_t              urlIndex;
+    stream_obj*         source;
+    FrameList*          frames;
+    int                 result;
+    bool                ready;
+} list_prefetch;
+
+typedef std::list<list_prefetch*> PrefetchList;
+
 typedef struct list_stream  : public stream_base  {
     size_t              urlCount;
     size_t              currentURL;
@@ -76,6 +94,21 @@ typedef struct list_stream  : public stream_base  {
     // but to accomplish that set_param API needs to change to include
     // the size of the parameter being set.
     int                 liveStream;
+
+    // background prefetch of the following inputs
+    int                 prefetchCount;      // max inputs opened ahead; 0 - disabled
+    size_t              prefetchFrom;       // first input worth prefetching
+    PrefetchList*       prefetched;
+    FrameList*          pendingFrames;      // read ahead from the current input
+    stream_api_t*       prefetchApi;        // used to create the prefetched inputs
+    char                prefetchName[128];  // ... and the name they'll be found by
+    sv_thread*          prefetchThread;
+    sv_mutex*           prefetchMutex;
+    sv_event*           prefetchEvent;      // wakes up the prefetch thread
+    sv_event*           prefetchReadyEvent; // an input is done prefetching
+    bool                prefetchExiting;
+    int                 prefetchHits;
+    int                 prefetchMisses;
 } list_stream_obj;
 
 //-----------------------------------------------------------------------------
@@ -214,6 +247,20 @@ static stream_obj*   list_stream_create                (const char* name)
     res->paramsToSetCount = 0;
     res->paramsToSetAlloc = 0;
 
+    res->prefetchCount = 0;
+    res->prefetchFrom = 0;
+    res->prefetched = new PrefetchList();
+    res->pendingFrames = frame_list_create();
+    res->prefetchApi = NULL;
+    res->prefetchName[0] = '\0';
+    res->prefetchThread = NULL;
+    res->prefetchMutex = sv_mutex_create();
+    res->prefetchEvent = sv_event_create(1, 0);
+    res->prefetchReadyEvent = sv_event_create(1, 0);
+    res->prefetchExiting = false;
+    res->prefetchHits = 0;
+    res->prefetchMisses = 0;
+
     return (stream_obj*)res;
 }
 
@@ -228,6 +275,7 @@ static int         list_stream_set_param             (stream_obj* stream,
 
     SET_PARAM_IF(stream, name, "count", int, strlist->urlCount);
     SET_PARAM_IF(stream, name, "liveStream", int, strlist->liveStream);
+    SET_PARAM_IF(stream, name, "prefetch", int, strlist->prefetchCount);
 
     if ( !_stricmp(name, "offsets" ) ) {
         if (strlist->urlCount<=0) {
@@ -267,6 +315,199 @@ static int         list_stream_get_param             (stream_obj* stream,
 }
 
 
+//-----------------------------------------------------------------------------
+static void        _list_prefetch_discard             (list_prefetch* pf)
+{
+    if ( pf->source ) {
+        stream_get_api(pf->source)->close(pf->source);
+        stream_unref(&pf->source);
+    }
+    frame_list_destroy(&pf->frames);
+    delete pf;
+}
+
+//-----------------------------------------------------------------------------
+// Opens the input, and reads its first GOP -- all off the playback thread
+static void        _list_prefetch_open                (list_stream_obj* strlist,
+                                                       list_prefetch* pf,
+                                                       const char* sourceName,
+                                                       stream_api_t* api)
+{
+    const char* url = strlist->urlList[pf->urlIndex];
+
+    pf->source = api->create(sourceName);
+    stream_ref(pf->source);
+    api->set_log_cb(pf->source, strlist->logCb);
+    api->set_param(pf->source, "url", url );
+    api->set_param(pf->source, "liveStream", &strlist->liveStream);
+    pf->result = api->open_in(pf->source);
+    if ( pf->result < 0 ) {
+        TRACE(_FMT("Failed to prefetch input #" << pf->urlIndex));
+        return;
+    }
+
+    int keyframes = 0;
+    while ( pf->frames->size() < _kMaxPrefetchFrames && !strlist->prefetchExiting ) {
+        frame_obj* frame = NULL;
+        if ( api->read_frame(pf->source, &frame) < 0 || frame == NULL ) {
+            break;
+        }
+        pf->frames->push_back(frame);
+
+        frame_api_t* fapi = frame_get_api(frame);
+        if ( fapi->get_media_type(frame) == mediaVideo &&
+             fapi->get_keyframe_flag(frame) &&
+             ++keyframes > 1 ) {
+            // the next GOP is starting
+            break;
+        }
+    }
+    TRACE(_FMT("Prefetched input #" << pf->urlIndex << ": frames=" << pf->frames->size()));
+}
+
+//-----------------------------------------------------------------------------
+static void*       _list_prefetch_thread_func         (void* param)
+{
+    list_stream_obj* strlist = (list_stream_obj*)param;
+
+    sv_mutex_enter(strlist->prefetchMutex);
+    while ( !strlist->prefetchExiting ) {
+        list_prefetch* pf = NULL;
+        size_t last = std::min(strlist->prefetchFrom + strlist->prefetchCount, strlist->urlCount);
+        for (size_t nI=strlist->prefetchFrom; nI<last && !pf; nI++) {
+            bool found = false;
+            for (PrefetchList::iterator it=strlist->prefetched->begin();
+                 it!=strlist->prefetched->end() && !found;
+                 it++) {
+                found = ((*it)->urlIndex == nI);
+            }
+            if ( !found ) {
+                pf = new list_prefetch;
+                pf->urlIndex = nI;
+                pf->source = NULL;
+                pf->frames = frame_list_create();
+                pf->result = -1;
+                pf->ready = false;
+                strlist->prefetched->push_back(pf);
+            }
+        }
+
+        if ( !pf ) {
+            sv_mutex_exit(strlist->prefetchMutex);
+            sv_event_wait(strlist->prefetchEvent, 100);
+            sv_mutex_enter(strlist->prefetchMutex);
+            continue;
+        }
+
+        sv_mutex_exit(strlist->prefetchMutex);
+        _list_prefetch_open(strlist, pf, strlist->prefetchName, strlist->prefetchApi);
+        sv_mutex_enter(strlist->prefetchMutex);
+        pf->ready = true;
+        sv_event_set(strlist->prefetchReadyEvent);
+    }
+    sv_mutex_exit(strlist->prefetchMutex);
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+static void        _list_prefetch_stop                (list_stream_obj* strlist)
+{
+    sv_mutex_enter(strlist->prefetchMutex);
+    sv_thread* thread = strlist->prefetchThread;
+    strlist->prefetchThread = NULL;
+    strlist->prefetchExiting = true;
+    sv_event_set(strlist->prefetchEvent);
+    sv_mutex_exit(strlist->prefetchMutex);
+
+    if ( thread != NULL ) {
+        sv_thread_destroy(&thread);
+        strlist->logCb(logInfo, _FMT("Input prefetch stopped: hits=" <<
+                                    strlist->prefetchHits << " misses=" <<
+                                    strlist->prefetchMisses));
+    }
+
+    while ( !strlist->prefetched->empty() ) {
+        _list_prefetch_discard(strlist->prefetched->front());
+        strlist->prefetched->pop_front();
+    }
+    frame_list_clear(strlist->pendingFrames);
+    strlist->prefetchExiting = false;
+}
+
+//-----------------------------------------------------------------------------
+// Makes the prefetched copy of the current input (if there's one) the source
+static bool        _list_use_prefetched               (list_stream_obj* strlist)
+{
+    list_prefetch* pf = NULL;
+    PrefetchList   stale;
+
+    sv_mutex_enter(strlist->prefetchMutex);
+    while ( true ) {
+        pf = NULL;
+        for (PrefetchList::iterator it=strlist->prefetched->begin();
+             it!=strlist->prefetched->end();
+             it++) {
+            if ( (*it)->urlIndex == strlist->currentURL ) {
+                pf = *it;
+                break;
+            }
+        }
+        if ( pf == NULL || pf->ready ) {
+            break;
+        }
+        // it's already being opened: waiting for it beats opening it twice
+        sv_mutex_exit(strlist->prefetchMutex);
+        sv_event_wait(strlist->prefetchReadyEvent, 100);
+        sv_mutex_enter(strlist->prefetchMutex);
+    }
+    if ( pf ) {
+        strlist->prefetched->remove(pf);
+    }
+
+    // drop whatever is out of the window now
+    strlist->prefetchFrom = strlist->currentURL + 1;
+    PrefetchList::iterator it=strlist->prefetched->begin();
+    while ( it!=strlist->prefetched->end() ) {
+        list_prefetch* other = *it;
+        if ( other->ready &&
+             ( other->urlIndex < strlist->prefetchFrom ||
+               other->urlIndex >= strlist->prefetchFrom + strlist->prefetchCount ) ) {
+            stale.push_back(other);
+            it = strlist->prefetched->erase(it);
+        } else {
+            it++;
+        }
+    }
+    sv_event_set(strlist->prefetchEvent);
+    sv_mutex_exit(strlist->prefetchMutex);
+
+    while ( !stale.empty() ) {
+        _list_prefetch_discard(stale.front());
+        stale.pop_front();
+    }
+
+    if ( pf == NULL || pf->result < 0 ) {
+        strlist->prefetchMisses++;
+        if ( pf ) {
+            _list_prefetch_discard(pf);
+        }
+        return false;
+    }
+
+    TRACE(_FMT("Switching to prefetched input #" << pf->urlIndex));
+    strlist->prefetchHits++;
+    strlist->sourceApi->close(strlist->source);
+    get_default_stream_api()->set_source((stream_obj*)strlist, pf->source, svFlagStreamInitialized);
+    frame_list_clear(strlist->pendingFrames);
+    while ( !pf->frames->empty() ) {
+        strlist->pendingFrames->push_back(pf->frames->front());
+        pf->frames->pop_front();
+    }
+    // the source now holds its own reference
+    _list_prefetch_discard(pf);
+    return true;
+}
+
 //-----------------------------------------------------------------------------
 static int         _list_open_source                  (list_stream_obj* strlist)
 {
@@ -289,6 +530,14 @@ static int         _list_open_source                  (list_stream_obj* strlist)
         return -1;
     }
 
+    frame_list_clear(strlist->pendingFrames);
+    if ( strlist->prefetchThread != NULL &&
+         _list_use_prefetched(strlist) ) {
+        strlist->aState.packetsProcessedInFile=0;
+        strlist->vState.packetsProcessedInFile=0;
+        return 0;
+    }
+
     const char* url = strlist->urlList[strlist->currentURL];
 
     strlist->sourceApi->close(strlist->source);
@@ -312,7 +561,19 @@ static int         list_stream_open_in                (stream_obj* stream)
 {
     DECLARE_STREAM_LIST(stream, strlist);
     strlist->currentURL = 0;
-    return _list_open_source(strlist);
+    int res = _list_open_source(strlist);
+    if ( res == 0 &&
+         strlist->prefetchCount > 0 &&
+         strlist->urlCount > 1 &&
+         strlist->prefetchThread == NULL ) {
+        // prefetched inputs replace the current one, and must be found by the same name
+        strlist->prefetchApi = stream_get_api(strlist->source);
+        snprintf(strlist->prefetchName, sizeof(strlist->prefetchName), "%s",
+                strlist->prefetchApi->get_name(strlist->source));
+        strlist->prefetchFrom = 1;
+        strlist->prefetchThread = sv_thread_create(_list_prefetch_thread_func, strlist);
+    }
+    return res;
 }
 
 //-----------------------------------------------------------------------------
@@ -353,6 +614,8 @@ static int         list_stream_seek               (stream_obj* stream,
                   " at offset " << offsetInFile <<
                   " file offset " << strlist->offsets[strlist->currentURL] <<
                   " requested offset " << offset ));
+        // frames read ahead are of no use past this point
+        frame_list_clear(strlist->pendingFrames);
         res = default_seek(stream, offsetInFile, flags);
     }
     return res;
@@ -375,7 +638,13 @@ static int         list_stream_read_frame        (stream_obj* stream, frame_obj*
     int retry;
     do {
         retry = 0;
-        res = strlist->sourceApi->read_frame(strlist->source, frame);
+        if ( !strlist->pendingFrames->empty() ) {
+            *frame = strlist->pendingFrames->front();
+            strlist->pendingFrames->pop_front();
+            res = 0;
+        } else {
+            res = strlist->sourceApi->read_frame(strlist->source, frame);
+        }
         if ( res < 0 ) {
             int eof = 0;
             size_t size = sizeof(eof);
@@ -428,7 +697,11 @@ static int         list_stream_read_frame        (stream_obj* stream, frame_obj*
 static int         list_stream_close             (stream_obj* stream)
 {
     DECLARE_STREAM_LIST(stream, strlist);
-    strlist->sourceApi->close(strlist->source);
+    // the prefetch thread uses the list of URLs, and must be gone first
+    _list_prefetch_stop(strlist);
+    if ( strlist->source ) {
+        strlist->sourceApi->close(strlist->source);
+    }
     stream_unref(&strlist->source);
 
     if (strlist->urlList) {
@@ -451,6 +724,11 @@ static void list_stream_destroy         (stream_obj* stream)
     DECLARE_STREAM_LIST_V(stream, strlist);
     strlist->logCb(logTrace, _FMT("Destroying stream object " << (void*)stream));
     list_stream_close(stream); // make sure all the internals had been freed
+    delete strlist->prefetched;
+    frame_list_destroy(&strlist->pendingFrames);
+    sv_event_destroy(&strlist->prefetchEvent);
+    sv_event_destroy(&strlist->prefetchReadyEvent);
+    sv_mutex_destroy(&strlist->prefetchMutex);
     stream_destroy( stream );
 }
 
@@ -288,6 +288,9 @@ static int         ipp_cc_filter_read_frame        (stream_obj* stream,
         status = ippStsNullPtrErr;
     }
 
+    if (status >= 0) {
+        resize_base_share_result(ccfilt, tmp, (frame_obj*)newFrame);
+    }
     frame_unref(&tmp);
     if (status < 0) {
         ccfilt->logCb(logError, _FMT("Failed to convert image color format: " << ippGetStatusString(status)));
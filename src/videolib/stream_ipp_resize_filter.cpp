@@ -321,6 +321,7 @@ static int         ipp_resize_filter_read_frame        (stream_obj* stream,
         rszfilter->prevFramePts = newFrame->pts;
     }
 
+    resize_base_share_result(rszfilter, tmp, (frame_obj*)newFrame);
     frame_unref(&tmp);
     *frame = (frame_obj*)newFrame;
     return 0;
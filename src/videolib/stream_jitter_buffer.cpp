@@ -40,10 +40,12 @@
 #include "sv_module_def.hpp"
 
 #include "streamprv.h"
+#include "sv_internal.h"
 #include "sv_ffmpeg.h"
 
 #include "videolibUtils.h"
 #include "frame_basic.h"
+#include "packet_ring.h"
 
 #include <algorithm>
 
@@ -64,8 +66,20 @@ typedef struct jitbuf_stream  : public stream_base {
     int64_t     prebufferEndPts;        // pts of the last frame in buffer when pause state ended
     bool        determinedEncoderDelay;
     int         paused;                 // in paused mode, we retain a larger queue, and never return packets
+    packet_ring* ring;                  // when set, paused mode retains nothing, and the
+                                        // queue is refilled from the ring when unpaused
 
     int         framesRead;             // frames we've read from backend
+
+    // adaptive mode: bufferTime follows the measured jitter, within the bounds
+    int         adaptive;
+    int         bufferTimeMin;
+    int         bufferTimeMax;
+    int         encoderDelay;           // floor for bufferTime, once known
+    double      jitter;                 // smoothed inter-arrival jitter, ms (RFC 3550)
+    INT64_T     lastTransit;            // arrival time minus pts of the last video frame
+    INT64_T     minTransit;             // fastest transit seen; lateness is measured against it
+    int         underruns;              // frames arriving later than bufferTime allowed for
 } jitbuf_stream_obj;
 
 
@@ -80,11 +94,22 @@ static stream_obj* jitbuf_stream_create             (const char* name);
 static int         jitbuf_stream_set_param          (stream_obj* stream,
                                                     const CHAR_T* name,
                                                     const void* value);
+static int         jitbuf_stream_get_param          (stream_obj* stream,
+                                                    const CHAR_T* name,
+                                                    void* value,
+                                                    size_t* size);
 static int         jitbuf_stream_read_frame         (stream_obj* stream, frame_obj** frame);
 static int         jitbuf_stream_close              (stream_obj* stream);
 static void        jitbuf_stream_destroy            (stream_obj* stream);
+static void        _jitbuf_refill_from_ring         (jitbuf_stream_obj* impl);
 
 static const int kDefaultBufferDuration = 300;
+static const int kDefaultAdaptiveMin = 100;
+static const int kDefaultAdaptiveMax = 3000;
+// headroom over the smoothed jitter the target settles at
+static const int kJitterMultiplier = 4;
+// the target grows at once on an underrun, but takes this many frames to shrink
+static const int kShrinkFrames = 256;
 
 //-----------------------------------------------------------------------------
 stream_api_t _g_jitbuf_stream_provider = {
@@ -96,7 +121,7 @@ stream_api_t _g_jitbuf_stream_provider = {
     get_default_stream_api()->remove_element,
     get_default_stream_api()->insert_element,
     jitbuf_stream_set_param,
-    get_default_stream_api()->get_param,
+    jitbuf_stream_get_param,
     get_default_stream_api()->open_in,
     get_default_stream_api()->seek,
     get_default_stream_api()->get_width,
@@ -136,6 +161,15 @@ static stream_obj*   jitbuf_stream_create                (const char* name)
     res->lastVideoServedFramePts = 0;
     res->prebufferEndPts = 0;
     res->framesRead = 0;
+    res->ring = NULL;
+    res->adaptive = 0;
+    res->bufferTimeMin = kDefaultAdaptiveMin;
+    res->bufferTimeMax = kDefaultAdaptiveMax;
+    res->encoderDelay = 0;
+    res->jitter = 0;
+    res->lastTransit = INVALID_PTS;
+    res->minTransit = INVALID_PTS;
+    res->underruns = 0;
     return (stream_obj*)res;
 }
 
@@ -151,14 +185,92 @@ static int         jitbuf_stream_set_param             (stream_obj* stream,
     SET_PARAM_IF(stream, name, "jumpstartWithPastFrames", int, impl->jumpstartWithPastFrames);
     SET_PARAM_IF(stream, name, "jumpstartFps", int, impl->jumpstartFps);
     SET_PARAM_IF(stream, name, "targetFps", int, impl->targetFps);
-    SET_PARAM_IF(stream, name, "paused", int, impl->paused);
+    SET_PARAM_IF(stream, name, "adaptive", int, impl->adaptive);
+    SET_PARAM_IF(stream, name, "bufferDurationMin", int, impl->bufferTimeMin);
+    SET_PARAM_IF(stream, name, "bufferDurationMax", int, impl->bufferTimeMax);
+    if ( !_stricmp(name, "paused") ) {
+        int paused = *(const int*)value;
+        if ( impl->paused && !paused && impl->ring != NULL ) {
+            _jitbuf_refill_from_ring(impl);
+        }
+        impl->paused = paused;
+        return 0;
+    }
+    if ( !_stricmp(name, "ring") ) {
+        packet_ring_unref(&impl->ring);
+        impl->ring = (packet_ring*)value;
+        if ( impl->ring != NULL ) {
+            packet_ring_ref(impl->ring);
+        }
+        return 0;
+    }
     if ( !_stricmp(name, "reset") ) {
         impl->determinedEncoderDelay = false;
+        impl->lastTransit = INVALID_PTS;
+        impl->minTransit = INVALID_PTS;
         return 0;
     }
     return default_set_param(stream, name, value);
 }
 
+//-----------------------------------------------------------------------------
+static int         jitbuf_stream_get_param             (stream_obj* stream,
+                                            const CHAR_T* name,
+                                            void* value,
+                                            size_t* size)
+{
+    DECLARE_STREAM_FF(stream, impl);
+    name = stream_param_name_apply_scope(stream, name);
+    COPY_PARAM_IF(impl, name, "bufferDuration", int, impl->bufferTime);
+    COPY_PARAM_IF(impl, name, "underruns", int, impl->underruns);
+    COPY_PARAM_IF(impl, name, "jitterMs", int, (int)impl->jitter);
+    return default_get_param(stream, name, value, size);
+}
+
+//-----------------------------------------------------------------------------
+// In adaptive mode, estimates how late video frames arrive relative to the
+// fastest one seen, and moves bufferTime to cover it.
+static void         _jitbuf_measure         (jitbuf_stream_obj* impl, frame_obj* f)
+{
+    frame_api_t*    api = frame_get_api(f);
+    INT64_T         pts = api->get_pts(f);
+
+    if ( !impl->adaptive || api->get_media_type(f) != mediaVideo || pts == INVALID_PTS ) {
+        return;
+    }
+
+    INT64_T transit = sv_time_get_current_epoch_time() - pts;
+    if ( impl->lastTransit != INVALID_PTS ) {
+        INT64_T d = transit - impl->lastTransit;
+        impl->jitter += ((d < 0 ? -d : d) - impl->jitter)/16.0;
+    }
+    impl->lastTransit = transit;
+    if ( impl->minTransit == INVALID_PTS || transit < impl->minTransit ) {
+        impl->minTransit = transit;
+    } else if ( impl->framesRead % kShrinkFrames == 0 ) {
+        // let it creep up, so clock drift doesn't read as ever increasing lateness
+        impl->minTransit++;
+    }
+
+    int floor = std::max(impl->bufferTimeMin, impl->encoderDelay);
+    int ceiling = std::max(floor, impl->bufferTimeMax);
+    int desired = std::min(ceiling, std::max(floor, (int)(impl->jitter*kJitterMultiplier)));
+    INT64_T lateness = transit - impl->minTransit;
+
+    if ( lateness > impl->bufferTime && !impl->paused && impl->lastVideoServedFramePts != 0 ) {
+        impl->underruns++;
+        desired = std::min(ceiling, std::max(desired, (int)lateness + (int)impl->jitter));
+        TRACE(_FMT("Underrun: lateness=" << lateness << " jitter=" << impl->jitter <<
+                    " bufferTime=" << impl->bufferTime << "->" << desired <<
+                    " underruns=" << impl->underruns));
+        impl->bufferTime = desired;
+    } else if ( desired > impl->bufferTime ) {
+        impl->bufferTime = desired;
+    } else if ( desired < impl->bufferTime ) {
+        impl->bufferTime -= std::max(1, (impl->bufferTime - desired)/kShrinkFrames);
+    }
+}
+
 //-----------------------------------------------------------------------------
 static void         _jitbuf_append          (jitbuf_stream_obj* impl, frame_obj* f)
 {
@@ -185,15 +297,29 @@ static void         _jitbuf_append          (jitbuf_stream_obj* impl, frame_obj*
     impl->frameQueue->push_front(f);
 }
 
+//-----------------------------------------------------------------------------
+// Amount of data retained while paused, and in the history buffer. When
+// memory runs short, it's cut to a half under soft pressure, and to a quarter
+// under hard pressure; jumpstarting then has less to work with.
+static int          _jitbuf_retained_time  (jitbuf_stream_obj* impl)
+{
+    switch ( sv_memory_get_pressure() ) {
+    case SV_MEMORY_PRESSURE_HARD:   return impl->bufferTimeWhenPaused/4;
+    case SV_MEMORY_PRESSURE_SOFT:   return impl->bufferTimeWhenPaused/2;
+    default:                        return impl->bufferTimeWhenPaused;
+    }
+}
+
 //-----------------------------------------------------------------------------
 static void         _jitbuf_reduce         (jitbuf_stream_obj* impl, FrameList* q, INT64_T pts_tail)
 {
+     int          retainedTime = _jitbuf_retained_time(impl);
      while ( !q->empty() ) {
         frame_obj*   f_head = q->front();
         frame_api_t* api = frame_get_api(f_head);
         INT64_T      pts_head = api->get_pts(f_head);
 
-        if ( pts_tail - pts_head <= impl->bufferTimeWhenPaused ) {
+        if ( pts_tail - pts_head <= retainedTime ) {
             break;
         }
 
@@ -269,6 +395,12 @@ static int          _jitbuf_get             (jitbuf_stream_obj* impl, frame_obj*
         return -1;
     }
 
+    if ( impl->paused && impl->ring != NULL ) {
+        // everything we'd hold on to is in the ring already
+        frame_list_clear(impl->frameQueue);
+        return -1;
+    }
+
     if ( impl->paused ) {
         if ( !impl->pastFrameQueue->empty() ) {
             impl->frameQueue->splice( impl->frameQueue->begin(), *impl->pastFrameQueue);
@@ -304,7 +436,7 @@ static int          _jitbuf_get             (jitbuf_stream_obj* impl, frame_obj*
             // only remove the front frame and deposit it to history if it's
             // not a frame we created to compensate for low startup fps
             impl->frameQueue->pop_front();
-            if ( impl->jumpstartWithPastFrames ) {
+            if ( impl->jumpstartWithPastFrames && impl->ring == NULL ) {
                 if ( _jitbuf_save_frame_for_jumpstart(impl, *pf ) >= 0 ) {
                     _jitbuf_reduce( impl, impl->pastFrameQueue, pts_tail );
                 }
@@ -316,6 +448,30 @@ static int          _jitbuf_get             (jitbuf_stream_obj* impl, frame_obj*
     return -1;
 }
 
+//-----------------------------------------------------------------------------
+// Coming out of paused mode with a ring: what we'd otherwise have retained gets
+// replayed from it, starting at a keyframe.
+static void         _jitbuf_refill_from_ring(jitbuf_stream_obj* impl)
+{
+    INT64_T lastPts = packet_ring_get_last_pts(impl->ring);
+    frame_list_clear(impl->frameQueue);
+    if ( lastPts == INVALID_PTS ) {
+        return;
+    }
+
+    packet_ring_cursor* cursor = packet_ring_cursor_create(impl->ring,
+                                        lastPts - impl->bufferTimeWhenPaused);
+    frame_obj*          f;
+    while ( packet_ring_cursor_read(cursor, &f) >= 0 ) {
+        _jitbuf_append(impl, f);
+    }
+    packet_ring_cursor_destroy(&cursor);
+
+    impl->lastVideoPastFramePts = 0;
+    impl->lastVideoServedFramePts = 0;
+    TRACE(_FMT("Refilled the queue from the ring: len=" << impl->frameQueue->size()));
+}
+
 //-----------------------------------------------------------------------------
 static int         jitbuf_stream_read_frame        (stream_obj* stream, frame_obj** frame)
 {
@@ -350,11 +506,13 @@ static int         jitbuf_stream_read_frame        (stream_obj* stream, frame_ob
             } else {
                 // delay is the maximum of what encoder introduced and configured/hardcoded default
                 impl->bufferTime = std::max(delay, impl->bufferTime);
+                impl->encoderDelay = delay;
                 impl->determinedEncoderDelay = true;
                 TRACE(_FMT("Delay is set at " << impl->bufferTime));
             }
         }
 
+        _jitbuf_measure(impl, tmp);
         _jitbuf_append(impl, tmp);
     }
 
@@ -376,6 +534,7 @@ static void jitbuf_stream_destroy         (stream_obj* stream)
     jitbuf_stream_close(stream); // make sure all the internals had been freed
     frame_list_destroy(&impl->frameQueue);
     frame_list_destroy(&impl->pastFrameQueue);
+    packet_ring_unref(&impl->ring);
     stream_destroy( stream );
 }
 
@@ -51,6 +51,7 @@ extern "C" {
 }
 
 #include "frame_basic.h"
+#include "frame_props.h"
 
 #include "videolibUtils.h"
 
@@ -242,7 +243,6 @@ static int         limiter_filter_read_frame        (stream_obj* stream,
     int res = -1;
     static const int reportInterval = 10000;
     int64_t currentTime, timeDiff;
-    frame_api_t* frameApi;
 
     *frame = NULL;
     if ( limiter->mutex ) {
@@ -255,15 +255,14 @@ Retry:
     frame_obj* tmp = NULL;
     res = default_read_frame(stream, &tmp);
     if ( res < 0 || tmp == NULL ||
-         (frameApi = frame_get_api(tmp)) == NULL ||
-         frameApi->get_media_type(tmp) != mediaVideo ) {
+         frame_props_media_type(tmp) != mediaVideo ) {
         // we're only dealing with video frames
         *frame = tmp;
         goto Exit;
     }
 
 
-    res = fps_limiter_report_frame(limiter->limit, &limiter->currentFps, frameApi->get_pts(tmp));
+    res = fps_limiter_report_frame(limiter->limit, &limiter->currentFps, frame_props_pts(tmp));
     // report frame to the limiter measuring wall-clock fps of frame arrival
     fps_limiter_report_frame(limiter->measure, NULL, 0);
 
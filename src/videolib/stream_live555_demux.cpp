@@ -41,7 +41,10 @@
 
 #include <cmath>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
 
 using std::string;
 
@@ -61,7 +64,9 @@ static int _g_StreamID = 0;
 
 #include "streamprv.h"
 #include "frame_basic.h"
+#include "frame_trace.h"
 #include "nalu.h"
+#include "annexb_normalizer.h"
 
 #include <svlive555.h>
 
@@ -104,9 +109,17 @@ typedef struct live555_packet_producer  : public stream_base  {
     int                 poolFrames;
 
     basic_frame_obj*    firstFrame;
+    // H.264 is scanned here, once for everything downstream
+    annexb_normalizer*  normalizer;
 
     int                 initTimeout;
     int                 packetTimeout;
+
+    // loss accounting, reported every statsIntervalSec. The bridge doesn't
+    // hand out RTP sequence numbers, so network reordering isn't reported.
+    INT64_T             statsTime;
+    int                 statsFramesProcessed;
+    int                 statsFramesDropped;
 } live555_packet_producer_t;
 
 //-----------------------------------------------------------------------------
@@ -133,12 +146,17 @@ class FrameBufferImpl : public sio::live555::FrameBuffer
     fn_stream_log       mLogCb = nullptr;
     int                 mNALU = 0;
     int                 mChunks = 1;
+    INT64_T             mArrivalUs = 0;     // when the first chunk of the frame came in
 
 public:
     FrameBufferImpl( fn_stream_log cb, frame_allocator* fa, size_t frameSize )
         : mLogCb ( cb )
     {
-        mFrameObj = alloc_basic_frame2(LIVE555_DEMUX_MAGIC, frameSize, mLogCb, fa);
+        if ( frame_trace_enabled() ) {
+            mArrivalUs = frame_trace_now_us();
+        }
+        // reserve the padding up front, so the frame can go to ffmpeg without being copied
+        mFrameObj = alloc_basic_frame2(LIVE555_DEMUX_MAGIC, frameSize+FF_INPUT_BUFFER_PADDING_SIZE, mLogCb, fa);
         if ( mFrameObj == NULL ) {
             mLogCb(logError, _FMT("Failed to allocate new frame of " << frameSize << " bytes"));
             assert( false );
@@ -209,7 +227,15 @@ public:
     {
         static const int kReallocFactor = 10;
         if ( mFrameObj->allocSize > mFrameObj->dataSize*kReallocFactor ) {
-            basic_frame_obj* res = clone_basic_frame(mFrameObj, mLogCb, NULL);
+            basic_frame_obj* res = alloc_basic_frame2(LIVE555_DEMUX_MAGIC,
+                                        mFrameObj->dataSize+FF_INPUT_BUFFER_PADDING_SIZE,
+                                        mLogCb, NULL);
+            if ( res == NULL ) {
+                return;
+            }
+            append_basic_frame(res, mFrameObj->data, mFrameObj->dataSize);
+            res->pts = mFrameObj->pts;
+            res->dts = mFrameObj->dts;
             // This releases the frame into the pool ... it'll be ready for reuse when we need it
             frame_unref((frame_obj**)&mFrameObj);
             mFrameObj = res;
@@ -267,11 +293,37 @@ public:
     {
         return CONTAINS_TIMED_DATA(mNALU)!=0;
     }
+    // ParseNALU has seen what's in the frame; only frames carrying parameter
+    // sets or an IDR need a closer look
+    void                Normalize(annexb_normalizer* normalizer)
+    {
+        static const int mask = (1<<(kNALIFrame-1)) | (1<<(kNALSPS-1)) | (1<<(kNALPPS-1));
+        annexb_packet_info info;
+        if ( (mNALU & mask) == 0 ||
+             annexb_normalizer_scan(normalizer, ReadPtr(), DataSize(), &info) < 0 ||
+             info.headerSize == 0 ) {
+            return;
+        }
+        if ( !EnsureFreeSpace(info.headerSize + FF_INPUT_BUFFER_PADDING_SIZE) ) {
+            return;
+        }
+        memmove(&mFrameObj->data[info.headerSize], mFrameObj->data, mFrameObj->dataSize);
+        annexb_normalizer_write_headers(normalizer, mFrameObj->data);
+        mFrameObj->dataSize += info.headerSize;
+    }
 
 public:
-    basic_frame_obj*    GetFrameAndRelease()
+    basic_frame_obj*    GetFrameAndRelease(annexb_normalizer* normalizer)
     {
         basic_frame_obj* f = mFrameObj;
+        if ( normalizer && mCodec == sio::live555::Codec::h264 ) {
+            Normalize(normalizer);
+        }
+        // zeroed padding lets the recorder and decoder reference the frame (see frame_avbuffer.h);
+        // the room for it had been reserved, this won't normally reallocate
+        if ( ensure_basic_frame_free_space(f, FF_INPUT_BUFFER_PADDING_SIZE) >= 0 ) {
+            memset(&f->data[f->dataSize], 0, FF_INPUT_BUFFER_PADDING_SIZE);
+        }
         switch (GetMediaType()) {
         case sio::live555::MediaType::video:
             f->mediaType = mediaVideo;
@@ -286,6 +338,7 @@ public:
             break;
         }
         frame_ref((frame_obj*)f);
+        frame_trace_begin((frame_obj*)f, mArrivalUs);
         Release();
         return f;
     }
@@ -409,6 +462,7 @@ static stream_obj*   live555_stream_create                (const char* name)
     res->bufferSizeKb = kDefaultBufferSizeKb;
     res->socketBufferSizeKb = kDefaultSocketBufferSizeKb;
     res->firstFrame = NULL;
+    res->normalizer = NULL;
     res->width = 0;
     res->height = 0;
     res->pixfmt = pfmtUndefined;
@@ -417,6 +471,9 @@ static stream_obj*   live555_stream_create                (const char* name)
     res->poolFrames = 1;
     res->initTimeout = kDefaultInitTimeout;
     res->packetTimeout = kDefaultPacketTimeout;
+    res->statsTime = 0;
+    res->statsFramesProcessed = 0;
+    res->statsFramesDropped = 0;
 
     if (_gTraceLevel>15) res->statsIntervalSec = 1;
     else if (_gTraceLevel>10) res->statsIntervalSec = 5;
@@ -502,6 +559,7 @@ static int         live555_stream_get_param             (stream_obj* stream,
         COPY_PARAM_ERR_IF(demux, name, "audioChannels", int, demux->clientSession->GetAudioChannels(), 0);
         COPY_PARAM_ERR_IF(demux, name, "uptime", int64_t, demux->clientSession->GetUptime(), 0);
     }
+    COPY_PARAM_IF(demux, name, "annexbNormalized", int, demux->normalizer != NULL);
 
 
     TRACE_C(2, _FMT("Unknown param " << name));
@@ -530,6 +588,33 @@ static int         live555_stream_get_pixel_format   (stream_obj* stream)
     return demux->pixfmt;
 }
 
+//-----------------------------------------------------------------------------
+// Whether each camera had last been successfully connected to over TCP. A
+// reconnect starts with what worked, rather than sitting through the UDP
+// timeout all over again.
+static std::mutex                   _gTransportCacheMutex;
+static std::map<std::string, bool>  _gTransportCache;
+
+//-----------------------------------------------------------------------------
+// 1 for TCP, 0 for UDP, -1 if the camera hadn't been connected to yet
+static int         _live555_get_cached_transport      (const char* descriptor)
+{
+    std::lock_guard<std::mutex> guard(_gTransportCacheMutex);
+    std::map<std::string, bool>::iterator it = _gTransportCache.find(descriptor);
+    return ( it == _gTransportCache.end() ) ? -1 : (it->second ? 1 : 0);
+}
+
+//-----------------------------------------------------------------------------
+static void        _live555_set_cached_transport      (const char* descriptor, int transport)
+{
+    std::lock_guard<std::mutex> guard(_gTransportCacheMutex);
+    if ( transport < 0 ) {
+        _gTransportCache.erase(descriptor);
+    } else {
+        _gTransportCache[descriptor] = (transport != 0);
+    }
+}
+
 //-----------------------------------------------------------------------------
 static int         live555_stream_open_in                (stream_obj* stream)
 {
@@ -540,6 +625,7 @@ static int         live555_stream_open_in                (stream_obj* stream)
     bool                shouldTryTCP = false;
     bool                triedRemovingUP = false;
     bool                shouldTryRemovingUP = false;
+    int                 cachedTransport = -1;
     char                buffer[256+1];
     FrameBufferImpl*    fbi;
 
@@ -558,6 +644,11 @@ static int         live555_stream_open_in                (stream_obj* stream)
     shouldTryTCP = true;
     shouldTryRemovingUP = true;
 
+    cachedTransport = _live555_get_cached_transport(demux->descriptor);
+    if ( cachedTransport > 0 ) {
+        triedUDP = true;
+    }
+
 TryAgain:
     demux->logCb (logInfo, _FMT("Opening "<< sv_sanitize_uri(demux->descriptor, buffer, 256) <<
                                 " using " << (triedUDP?"TCP":"UDP") <<
@@ -605,10 +696,19 @@ TryAgain:
         result = -5;
         goto Error;
     }
-    demux->firstFrame = fbi->GetFrameAndRelease();
+    if ( demux->clientSession->GetVideoCodecId() == sio::live555::Codec::h264 ) {
+        demux->normalizer = annexb_normalizer_create(demux->logCb);
+        annexb_normalizer_set_headers(demux->normalizer,
+                                      (const uint8_t*)demux->clientSession->GetSPS(),
+                                      demux->clientSession->GetSPSSize(),
+                                      (const uint8_t*)demux->clientSession->GetPPS(),
+                                      demux->clientSession->GetPPSSize());
+    }
+    demux->firstFrame = fbi->GetFrameAndRelease(demux->normalizer);
     demux->width = demux->clientSession->GetWidth();
     demux->height = demux->clientSession->GetHeight();
     TRACE_C(2, _FMT("Demux stream opened: " << demux->width << "x" << demux->height));
+    _live555_set_cached_transport(demux->descriptor, triedUDP ? 1 : 0);
     return 0;
 
 Error:
@@ -630,12 +730,49 @@ Error:
         triedUDP = demux->forceTCP;
         goto TryAgain;
     }
+    if ( cachedTransport >= 0 ) {
+        // start from scratch next time
+        _live555_set_cached_transport(demux->descriptor, -1);
+    }
     frame_unref((frame_obj**)&demux->firstFrame);
     live555_stream_close(stream);
     return result;
 }
 
 
+//-----------------------------------------------------------------------------
+static void        _live555_update_stats            (live555_packet_producer_t* demux)
+{
+    if ( demux->statsIntervalSec <= 0 ) {
+        return;
+    }
+    if ( demux->statsTime == 0 ) {
+        demux->statsTime = sv_time_get_current_epoch_time();
+        return;
+    }
+    if ( sv_time_get_elapsed_time(demux->statsTime) < demux->statsIntervalSec*1000 ) {
+        return;
+    }
+
+    int processed = demux->clientSession->GetVideoFramesProcessed() +
+                    demux->clientSession->GetAudioFramesProcessed();
+    int dropped   = demux->clientSession->GetVideoFramesDropped() +
+                    demux->clientSession->GetAudioFramesDropped();
+    int processedDelta = processed - demux->statsFramesProcessed;
+    int droppedDelta   = dropped - demux->statsFramesDropped;
+    int total          = processedDelta + droppedDelta;
+    char buffer[256+1];
+    demux->logCb(droppedDelta ? logInfo : logDebug, _FMT("Receive stats for " <<
+                                sv_sanitize_uri(demux->descriptor, buffer, 256) <<
+                                ": frames=" << processedDelta <<
+                                " dropped=" << droppedDelta <<
+                                " (" << (total ? droppedDelta*100.0/total : 0) << "%)" <<
+                                " totalDropped=" << dropped));
+    demux->statsFramesProcessed = processed;
+    demux->statsFramesDropped = dropped;
+    demux->statsTime = sv_time_get_current_epoch_time();
+}
+
 //-----------------------------------------------------------------------------
 static int         live555_stream_read_frame        (stream_obj* stream,
                                                     frame_obj** frame)
@@ -658,7 +795,8 @@ static int         live555_stream_read_frame        (stream_obj* stream,
         return -1;
     }
 
-    basic_frame_obj* bfo = fbi->GetFrameAndRelease();
+    basic_frame_obj* bfo = fbi->GetFrameAndRelease(demux->normalizer);
+    _live555_update_stats(demux);
     *frame = (frame_obj*)bfo;
     return 0;
 }
@@ -668,10 +806,15 @@ static int         live555_stream_close             (stream_obj* stream)
 {
     DECLARE_DEMUX_LVL(stream, demux);
     frame_unref((frame_obj**)&demux->firstFrame);
+    annexb_normalizer_destroy(&demux->normalizer);
     if (demux->clientSession) {
         try {
             demux->clientSession->Close();
             demux->clientSession = NULL;
+            // the session's counters go with it
+            demux->statsTime = 0;
+            demux->statsFramesProcessed = 0;
+            demux->statsFramesDropped = 0;
         } catch(...) {
             demux->logCb(logError, _FMT("Exception while closing demux. Exiting."));
             exit(-1);
@@ -45,9 +45,19 @@ extern "C" {
 #include <libavformat/avformat.h>
 
 #include <localVideo.h>
+
+// Native capture (localVideoLib's localVideo.cpp): frames as the platform
+// delivers them, copied once, rather than converted to lvlGetPixelFormat
+SVLVL_API int  lvlGetNativePixelFormat();
+SVLVL_API BOOL lvlGetNativePixels(LocalVideoHandle h, int deviceID, unsigned char* pixels);
 }
 
+#ifndef PIXEL_FORMAT_BGR24
+#define PIXEL_FORMAT_BGR24 3    // as in libavutil/pixfmt.h
+#endif
+
 #define LVL_DEMUX_MAGIC 0x1313
+#define LOCAL_NATIVE_CAPTURE_VAR "SV_LOCAL_NATIVE_CAPTURE"
 
 #define URI_LOCAL_CAMERA "device:"
 #define NEW_DEVICE_ID_OFFSET 1000
@@ -68,6 +78,8 @@ typedef struct lvl_packet_producer  : public stream_base {
     int                 w;
     int                 h;
     int                 fmt;
+    int                 native;         // capture in lvlGetNativePixelFormat
+    frame_allocator*    fa;
 
     LocalVideoHandle    lvlHandle;      // handle to localVideoLib instance
     int                 localCamId;
@@ -234,6 +246,8 @@ static stream_obj*   lvl_stream_create                (const char* name)
     res->framesSkipped = 0;
     res->packetsRead = 0;
     res->prevPts = 0;
+    res->native = sv_get_int_env_var(LOCAL_NATIVE_CAPTURE_VAR, 1);
+    res->fa = create_frame_allocator(_STR("lvl_"<<name));
 
     return (stream_obj*)res;
 }
@@ -249,6 +263,7 @@ static int         lvl_stream_set_param             (stream_obj* stream,
     SET_STR_PARAM_IF(stream, name, "dir", demux->videoDir);
     SET_PARAM_IF(stream, name, "width", int, demux->width);
     SET_PARAM_IF(stream, name, "height", int, demux->height);
+    SET_PARAM_IF(stream, name, "nativeCapture", int, demux->native);
     return -1;
 }
 
@@ -280,8 +295,8 @@ static basic_frame_obj* _lvl_create_frame(lvl_packet_producer_t* demux)
     size_t allocSize = av_image_get_buffer_size(fmt, demux->w, demux->h+1, _kDefAlign); // see scale bug
     size_t dataSize = av_image_get_buffer_size(fmt, demux->w, demux->h, _kDefAlign);
 
-    // prevent this frame object from being freed by the client code
-    basic_frame_obj* f = alloc_basic_frame(LVL_DEMUX_MAGIC, allocSize, demux->logCb);
+    // frames come back to the pool once downstream is done with them
+    basic_frame_obj* f = alloc_basic_frame2(LVL_DEMUX_MAGIC, allocSize, demux->logCb, demux->fa);
     // set up export frame
     f->width = demux->w;
     f->height = demux->h;
@@ -354,9 +369,12 @@ static int         lvl_stream_open_in                (stream_obj* stream)
     demux->w = lvlGetWidth(demux->lvlHandle, demux->localCamId);
     demux->h = lvlGetHeight(demux->lvlHandle, demux->localCamId);
 
-    lvlFmt = lvlGetPixelFormat();
+    // natively, it's what the resize stage gets -- without the red/blue swap
+    // and the extra copy it takes to give it RGB24
+    lvlFmt = demux->native ? lvlGetNativePixelFormat() : lvlGetPixelFormat();
     switch  (lvlFmt) {
     case PIXEL_FORMAT_RGB24:        demux->fmt = pfmtRGB24; break;
+    case PIXEL_FORMAT_BGR24:        demux->fmt = pfmtBGR24; break;
     case PIXEL_FORMAT_YUYV422:      demux->fmt = pfmtYUYV422; break;
     default:
         demux->logCb(logWarning, _FMT("Unexpected pixfmt value from localVideoLib: " << lvlFmt));
@@ -416,11 +434,17 @@ static int         lvl_stream_read_frame        (stream_obj* stream, frame_obj**
 
 TryAgain:
     *frame = NULL;
-    res = lvlGetPixels(demux->lvlHandle,
-                        demux->localCamId,
-                        (unsigned char*)f->data,
-                        TRUE,
-                        TRUE);
+    if ( demux->native ) {
+        res = lvlGetNativePixels(demux->lvlHandle,
+                            demux->localCamId,
+                            (unsigned char*)f->data);
+    } else {
+        res = lvlGetPixels(demux->lvlHandle,
+                            demux->localCamId,
+                            (unsigned char*)f->data,
+                            TRUE,
+                            TRUE);
+    }
     elapsed = sv_time_get_elapsed_time(start);
     if (res != 0) {
         if ( demux->framesToSkip >= demux->framesSkipped ) {
@@ -475,6 +499,7 @@ static void lvl_stream_destroy         (stream_obj* stream)
 {
     DECLARE_DEMUX_LVL_V(stream, demux);
     lvl_stream_close(stream); // make sure all the internals had been freed
+    destroy_frame_allocator( &demux->fa, demux->logCb );
     stream_destroy( stream );
 }
 
@@ -46,6 +46,8 @@
 #include <propvarutil.h>
 #include <assert.h>
 #include <algorithm>
+#include <mutex>
+#include <vector>
 
 #include "streamprv.h"
 
@@ -164,6 +166,13 @@ typedef struct mfdec_stream  : public stream_base {
     bool                mfManagedBuffers;
     IMFMediaType*       outputType;
 
+    /* Zero-copy samples */
+    int                 zeroCopy;
+    struct mfdec_buffer_pool* bufferPool;
+    IMFSample*          inputSample;    // reused, unless the MFT holds on to it
+    basic_frame_obj*    outputFrame;    // what the output sample writes into
+    DWORD               outputAlignment;
+
     int                 channels;
 
 
@@ -255,9 +264,201 @@ stream_api_t _g_mfdec_stream_provider = {
 #define COM_RELEASE(obj)\
     if ( obj ) { obj->Release(); obj = NULL; }
 
+//-----------------------------------------------------------------------------
+// Zero-copy samples: rather than copying each packet into a buffer created
+// for it, and each decoded sample out of the MFT's buffer, the MFT is handed
+// IMFMediaBuffer objects over the memory of our own frames. A buffer holds a
+// reference to its frame for as long as anyone holds one to it; released
+// buffers go back to a pool, which lives until the last of them does, as the
+// MFT may hold on to an input sample past the decoder's end.
+//-----------------------------------------------------------------------------
+#define MFDEC_ZERO_COPY_VAR "SV_MF_ZERO_COPY"
+
+static const size_t kMaxPooledBuffers = 8;
+
+class mfdec_frame_buffer;
+
+typedef struct mfdec_buffer_pool {
+    std::mutex                          mutex;
+    std::vector<mfdec_frame_buffer*>    free;
+    int                                 outstanding;    // buffers in use
+    bool                                closed;         // decoder is gone
+} mfdec_buffer_pool;
+
+class mfdec_frame_buffer : public IMFMediaBuffer
+{
+public:
+    //-------------------------------------------------------------------------
+    // Returns a buffer over length bytes at data, which belong to frame
+    static mfdec_frame_buffer* wrap(mfdec_buffer_pool* pool,
+                                    frame_obj* frame,
+                                    BYTE* data,
+                                    DWORD maxLength,
+                                    DWORD length)
+    {
+        mfdec_frame_buffer* res = NULL;
+        {
+            std::lock_guard<std::mutex> lock(pool->mutex);
+            if ( !pool->free.empty() ) {
+                res = pool->free.back();
+                pool->free.pop_back();
+            }
+            pool->outstanding++;
+        }
+        if ( res == NULL ) {
+            res = new mfdec_frame_buffer(pool);
+        }
+        frame_ref(frame);
+        res->m_refs = 1;
+        res->m_frame = frame;
+        res->m_data = data;
+        res->m_maxLength = maxLength;
+        res->m_length = length;
+        return res;
+    }
+
+    //-------------------------------------------------------------------------
+    static void close_pool(mfdec_buffer_pool** pool)
+    {
+        bool last;
+        if ( *pool == NULL ) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock((*pool)->mutex);
+            for (mfdec_frame_buffer* buffer : (*pool)->free) {
+                delete buffer;
+            }
+            (*pool)->free.clear();
+            (*pool)->closed = true;
+            last = (*pool)->outstanding == 0;
+        }
+        if ( last ) {
+            delete *pool;
+        }
+        *pool = NULL;
+    }
+
+    // IUnknown
+    STDMETHODIMP QueryInterface(REFIID riid, void** ppv)
+    {
+        if ( ppv == NULL ) {
+            return E_POINTER;
+        }
+        if ( riid == IID_IUnknown || riid == IID_IMFMediaBuffer ) {
+            *ppv = static_cast<IMFMediaBuffer*>(this);
+            AddRef();
+            return S_OK;
+        }
+        *ppv = NULL;
+        return E_NOINTERFACE;
+    }
+    STDMETHODIMP_(ULONG) AddRef()
+    {
+        return InterlockedIncrement(&m_refs);
+    }
+    STDMETHODIMP_(ULONG) Release()
+    {
+        ULONG refs = InterlockedDecrement(&m_refs);
+        if ( refs == 0 ) {
+            _recycle();
+        }
+        return refs;
+    }
+
+    // IMFMediaBuffer
+    STDMETHODIMP Lock(BYTE** ppbBuffer, DWORD* pcbMaxLength, DWORD* pcbCurrentLength)
+    {
+        if ( ppbBuffer == NULL ) {
+            return E_POINTER;
+        }
+        *ppbBuffer = m_data;
+        if ( pcbMaxLength ) *pcbMaxLength = m_maxLength;
+        if ( pcbCurrentLength ) *pcbCurrentLength = m_length;
+        return S_OK;
+    }
+    STDMETHODIMP Unlock()
+    {
+        return S_OK;
+    }
+    STDMETHODIMP GetCurrentLength(DWORD* pcbCurrentLength)
+    {
+        if ( pcbCurrentLength == NULL ) {
+            return E_POINTER;
+        }
+        *pcbCurrentLength = m_length;
+        return S_OK;
+    }
+    STDMETHODIMP SetCurrentLength(DWORD cbCurrentLength)
+    {
+        if ( cbCurrentLength > m_maxLength ) {
+            return E_INVALIDARG;
+        }
+        m_length = cbCurrentLength;
+        return S_OK;
+    }
+    STDMETHODIMP GetMaxLength(DWORD* pcbMaxLength)
+    {
+        if ( pcbMaxLength == NULL ) {
+            return E_POINTER;
+        }
+        *pcbMaxLength = m_maxLength;
+        return S_OK;
+    }
+
+private:
+    mfdec_frame_buffer(mfdec_buffer_pool* pool)
+        : m_refs(0)
+        , m_pool(pool)
+        , m_frame(NULL)
+        , m_data(NULL)
+        , m_maxLength(0)
+        , m_length(0)
+    {
+    }
+    virtual ~mfdec_frame_buffer() {}
+
+    //-------------------------------------------------------------------------
+    void _recycle()
+    {
+        mfdec_buffer_pool*  pool = m_pool;
+        bool                freePool = false;
+        bool                freeThis = false;
+
+        frame_unref(&m_frame);
+        m_data = NULL;
+        {
+            std::lock_guard<std::mutex> lock(pool->mutex);
+            pool->outstanding--;
+            if ( pool->closed ) {
+                freeThis = true;
+                freePool = pool->outstanding == 0;
+            } else if ( pool->free.size() < kMaxPooledBuffers ) {
+                pool->free.push_back(this);
+            } else {
+                freeThis = true;
+            }
+        }
+        if ( freePool ) {
+            delete pool;
+        }
+        if ( freeThis ) {
+            delete this;
+        }
+    }
+
+    volatile LONG       m_refs;
+    mfdec_buffer_pool*  m_pool;
+    frame_obj*          m_frame;
+    BYTE*               m_data;
+    DWORD               m_maxLength;
+    DWORD               m_length;
+};
+
 
 //-----------------------------------------------------------------------------
-static bool _mfdec_get_output_size(mfdec_stream_obj* xcoder, size_t inputSize)
+// Returns the expected size of the output, or 0 to leave it to the MFT
+static int  _mfdec_get_output_size(mfdec_stream_obj* xcoder, size_t inputSize)
 {
     int factor;
 
@@ -266,10 +467,10 @@ static bool _mfdec_get_output_size(mfdec_stream_obj* xcoder, size_t inputSize)
     case streamPCMU:
     case streamPCMA: factor = 2; break;
     case streamAAC : factor = 10; break;
-    default        : return -1;
+    default        : return 0;
     }
 
-    return xcoder->isEncoder ? inputSize / factor : inputSize * factor;
+    return (int)(xcoder->isEncoder ? inputSize / factor : inputSize * factor);
 }
 
 //-----------------------------------------------------------------------------
@@ -322,6 +523,7 @@ static bool _mfdec_alloc_sample_out(mfdec_stream_obj* xcoder, size_t size)
     }
 
     COM_RELEASE( xcoder->outputSample );
+    frame_unref((frame_obj**)&xcoder->outputFrame);
 
     IMFMediaBuffer *pOutputMediaBuffer = NULL;
 
@@ -344,13 +546,19 @@ static bool _mfdec_alloc_sample_out(mfdec_stream_obj* xcoder, size_t size)
     if (SUCCEEDED(hr)) {
         DWORD allocationSize = std::max( outputInfo.cbSize, (DWORD)size );
         DWORD alignment = outputInfo.cbAlignment;
+        xcoder->outputBufferSize = allocationSize;
+        xcoder->outputAlignment = alignment;
+        if ( xcoder->zeroCopy ) {
+            // frames get attached to the sample as they're needed
+            TRACE(_FMT("Output frames of size " << allocationSize << " with alignment of " << alignment ));
+            return true;
+        }
         TRACE(_FMT("Creating buffer of size " << allocationSize << " with alignment of " << alignment ));
         if (alignment > 0)
             hr = xcoder->mfplatDll.fpMFCreateAlignedMemoryBuffer(allocationSize, alignment - 1,
                                          &pOutputMediaBuffer);
         else
             hr = xcoder->mfplatDll.fpMFCreateMemoryBuffer(allocationSize, &pOutputMediaBuffer);
-        xcoder->outputBufferSize = allocationSize;
     }
 
     if (SUCCEEDED(hr)) {
@@ -367,6 +575,112 @@ static bool _mfdec_alloc_sample_out(mfdec_stream_obj* xcoder, size_t size)
     return false;
 }
 
+//-----------------------------------------------------------------------------
+// Puts the packet's own memory in the (reused) input sample; false if the
+// MFT's buffer requirements rule that out, and the packet has to be copied
+static bool _mfdec_wrap_sample_in(mfdec_stream_obj* xcoder, frame_obj* frameIn,
+            DWORD size, IMFSample** out)
+{
+    HRESULT hr;
+    MFT_INPUT_STREAM_INFO inputInfo;
+    BYTE* data = (BYTE*)frame_get_api(frameIn)->get_data(frameIn);
+
+    hr = xcoder->mft->GetInputStreamInfo(xcoder->inputStreamId, &inputInfo);
+    if ( FAILED(hr) || data == NULL || inputInfo.cbSize > size ||
+         ( inputInfo.cbAlignment > 1 && ((uintptr_t)data % inputInfo.cbAlignment) != 0 ) ) {
+        return false;
+    }
+
+    if ( xcoder->inputSample != NULL ) {
+        // the MFT may still be holding on to the previous packet
+        xcoder->inputSample->AddRef();
+        if ( xcoder->inputSample->Release() > 1 ) {
+            COM_RELEASE( xcoder->inputSample );
+        }
+    }
+    if ( xcoder->inputSample == NULL ) {
+        hr = xcoder->mfplatDll.fpMFCreateSample(&xcoder->inputSample);
+    } else {
+        hr = xcoder->inputSample->RemoveAllBuffers();
+    }
+
+    if (SUCCEEDED(hr)) {
+        mfdec_frame_buffer* buffer = mfdec_frame_buffer::wrap(xcoder->bufferPool,
+                                                            frameIn,
+                                                            data,
+                                                            size,
+                                                            size);
+        hr = xcoder->inputSample->AddBuffer(buffer);
+        buffer->Release();
+    }
+
+    if (SUCCEEDED(hr)) {
+        xcoder->inputSample->AddRef();
+        *out = xcoder->inputSample;
+        return true;
+    }
+
+    COM_RELEASE( xcoder->inputSample );
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+static basic_frame_obj* _mfdec_alloc_frame         (mfdec_stream_obj* xcoder,
+                                                    int nRequiredSize);
+
+//-----------------------------------------------------------------------------
+// Points the output sample at a frame for the MFT to write into; false if
+// the frame's memory won't do
+static bool _mfdec_attach_output_frame(mfdec_stream_obj* xcoder)
+{
+    HRESULT hr;
+
+    if ( xcoder->outputFrame != NULL ) {
+        // nothing was written into it yet
+        return true;
+    }
+
+    basic_frame_obj* frame = _mfdec_alloc_frame(xcoder, xcoder->outputBufferSize);
+    if ( frame == NULL ) {
+        return false;
+    }
+    if ( xcoder->outputAlignment > 1 &&
+         ((uintptr_t)frame->data % xcoder->outputAlignment) != 0 ) {
+        xcoder->logCb(logDebug, _FMT("Frames don't meet output alignment of " << xcoder->outputAlignment));
+        frame_unref((frame_obj**)&frame);
+        return false;
+    }
+
+    mfdec_frame_buffer* buffer = mfdec_frame_buffer::wrap(xcoder->bufferPool,
+                                                        (frame_obj*)frame,
+                                                        frame->data,
+                                                        xcoder->outputBufferSize,
+                                                        0);
+    hr = xcoder->outputSample->RemoveAllBuffers();
+    if (SUCCEEDED(hr)) {
+        hr = xcoder->outputSample->AddBuffer(buffer);
+    }
+    buffer->Release();
+    if (FAILED(hr)) {
+        frame_unref((frame_obj**)&frame);
+        return false;
+    }
+    xcoder->outputFrame = frame;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Goes back to copying samples out of a buffer of the MFT's own
+static bool _mfdec_disable_zero_copy(mfdec_stream_obj* xcoder, size_t size)
+{
+    xcoder->logCb(logInfo, _FMT("Copying output samples of the " << xcoder->modeName));
+    xcoder->zeroCopy = 0;
+    COM_RELEASE( xcoder->outputSample );
+    frame_unref((frame_obj**)&xcoder->outputFrame);
+    xcoder->outputBufferSize = 0;
+    return _mfdec_alloc_sample_out(xcoder, size);
+}
+
 
 //-----------------------------------------------------------------------------
 #define DECLARE_STREAM_FF(stream, name) \
@@ -421,6 +735,14 @@ static stream_obj*   mfdec_stream_create                (const char* name)
     res->outputBufferSize = 0;
     res->outputType = NULL;
 
+    res->zeroCopy = sv_get_int_env_var(MFDEC_ZERO_COPY_VAR, 1);
+    res->bufferPool = new mfdec_buffer_pool();
+    res->bufferPool->outstanding = 0;
+    res->bufferPool->closed = false;
+    res->inputSample = NULL;
+    res->outputFrame = NULL;
+    res->outputAlignment = 0;
+
     res->channels = -1;
     res->srcSampleRate = -1;
 
@@ -444,6 +766,7 @@ static int         mfdec_stream_set_param             (stream_obj* stream,
     SET_PARAM_IF(stream, name, "decoderType", int, xcoder->mediaType);
     SET_PARAM_IF(stream, name, "encoderType", int, xcoder->mediaType);
     SET_PARAM_IF(stream, name, "dstCodecId", int, xcoder->dstCodecId);
+    SET_PARAM_IF(stream, name, "zeroCopy", int, xcoder->zeroCopy);
 
     // pass it on, if we can
     return default_set_param(stream, name, value);
@@ -1259,25 +1582,29 @@ Retry:
 #endif
         TRACE(_FMT("Read new audio frame, size=" << size << " ts=" << ts << " ptr=" << (void*)frameIn));
 
-        TRACE_C(100, _FMT("Alloc sample in: " << size));
-        if (!_mfdec_alloc_sample_in(xcoder, size, &inputSample)) {
-            xcoder->logCb(logError, _FMT("Failed to allocate input sample"));
-            goto Error;
-        }
+        if ( xcoder->zeroCopy && _mfdec_wrap_sample_in(xcoder, frameIn, size, &inputSample) ) {
+            TRACE_C(100, _FMT("Wrapped sample in: " << size));
+        } else {
+            TRACE_C(100, _FMT("Alloc sample in: " << size));
+            if (!_mfdec_alloc_sample_in(xcoder, size, &inputSample)) {
+                xcoder->logCb(logError, _FMT("Failed to allocate input sample"));
+                goto Error;
+            }
 
-        _CHECK( inputSample->GetBufferByIndex(0, &inputBuffer),
-                _FMT("Failed to obtain input buffer" ) );
+            _CHECK( inputSample->GetBufferByIndex(0, &inputBuffer),
+                    _FMT("Failed to obtain input buffer" ) );
 
-        _CHECK( inputBuffer->Lock(&bufferStart, NULL, NULL),
-                _FMT("Failed to lock input buffer" ) );
+            _CHECK( inputBuffer->Lock(&bufferStart, NULL, NULL),
+                    _FMT("Failed to lock input buffer" ) );
 
-        memcpy(bufferStart, fapi->get_data(frameIn), size);
+            memcpy(bufferStart, fapi->get_data(frameIn), size);
 
-        _CHECK( inputBuffer->Unlock(),
-                _FMT("Failed to unlock input buffer" ) );
+            _CHECK( inputBuffer->Unlock(),
+                    _FMT("Failed to unlock input buffer" ) );
 
-        _CHECK( inputBuffer->SetCurrentLength(size),
-                _FMT("Failed to set current buffer length" ) );
+            _CHECK( inputBuffer->SetCurrentLength(size),
+                    _FMT("Failed to set current buffer length" ) );
+        }
 
         // Convert from milliseconds to 100 nanoseconds unit.
         _CHECK( inputSample->SetSampleTime(ts * 10 * 1000),
@@ -1296,6 +1623,12 @@ Retry:
             xcoder->logCb(logError, _FMT("Failed to encode a buffer of " << sizeOut << " bytes"));
             goto Error;
         }
+        if ( xcoder->zeroCopy &&
+             !_mfdec_attach_output_frame(xcoder) &&
+             !_mfdec_disable_zero_copy(xcoder, sizeOut) ) {
+            xcoder->logCb(logError, _FMT("Failed to encode a buffer of " << sizeOut << " bytes"));
+            goto Error;
+        }
         outputBufferStruct = { xcoder->outputStreamId, xcoder->outputSample, 0, NULL };
     } else {
         outputBufferStruct = { xcoder->outputStreamId, NULL, 0, NULL };
@@ -1326,30 +1659,42 @@ Retry:
 
         TRACE(_FMT("Got output: length="<<sampleLength<<" buffers="<<bufferCount));
 
-        _CHECK( outputSample->GetBufferByIndex(0, &outputBuffer),
-                _FMT("Failed to obtain output buffer") );
+        if ( xcoder->zeroCopy && !xcoder->mfManagedBuffers ) {
+            // the MFT wrote into the frame it was given
+            frameOut = xcoder->outputFrame;
+            xcoder->outputFrame = NULL;
+            frameOut->dataSize = sampleLength;
+#if _DUMP_DEBUG
+            fwrite(frameOut->data, 1, sampleLength, xcoder->debugFileOut);
+#endif
+            _CHECK( outputSample->RemoveAllBuffers(),
+                    _FMT("Failed to detach the output frame") );
+        } else {
+            _CHECK( outputSample->GetBufferByIndex(0, &outputBuffer),
+                    _FMT("Failed to obtain output buffer") );
 
-        _CHECK( outputBuffer->Lock(&bufferStart, NULL, NULL),
-                _FMT("Failed to lock output buffer") );
+            _CHECK( outputBuffer->Lock(&bufferStart, NULL, NULL),
+                    _FMT("Failed to lock output buffer") );
 
-        if ( !frameOut || frameOut->allocSize < sampleLength ) {
-            frame_unref((frame_obj**)&frameOut);
-            frameOut = _mfdec_alloc_frame(xcoder, sampleLength);
-        }
-        memcpy(frameOut->data, bufferStart, sampleLength);
+            if ( !frameOut || frameOut->allocSize < sampleLength ) {
+                frame_unref((frame_obj**)&frameOut);
+                frameOut = _mfdec_alloc_frame(xcoder, sampleLength);
+            }
+            memcpy(frameOut->data, bufferStart, sampleLength);
 #if _DUMP_DEBUG
-        fwrite(bufferStart, 1, sampleLength, xcoder->debugFileOut);
+            fwrite(bufferStart, 1, sampleLength, xcoder->debugFileOut);
 #endif
-        frameOut->dataSize = sampleLength;
+            frameOut->dataSize = sampleLength;
 
 
-        _CHECK( outputBuffer->Unlock(),
-                _FMT("Failed to unlock output buffer") );
+            _CHECK( outputBuffer->Unlock(),
+                    _FMT("Failed to unlock output buffer") );
 
-        if ( !xcoder->mfManagedBuffers ) {
-            // Sample is not provided by the MFT: clear its content.
-            _CHECK( outputBuffer->SetCurrentLength(0),
-                    _FMT("Failed to reset the buffer") );
+            if ( !xcoder->mfManagedBuffers ) {
+                // Sample is not provided by the MFT: clear its content.
+                _CHECK( outputBuffer->SetCurrentLength(0),
+                        _FMT("Failed to reset the buffer") );
+            }
         }
         if ( xcoder->framesProcessed == 0 ) {
             xcoder->firstPts = sampleTime;
@@ -1391,6 +1736,7 @@ Error:
     COM_RELEASE( outputBufferStruct.pEvents );
     COM_RELEASE( inputSample );
     COM_RELEASE( inputBuffer );
+    COM_RELEASE( outputBuffer );
 
     if ( xcoder->mfManagedBuffers ) {
         COM_RELEASE(outputSample);
@@ -1424,6 +1770,10 @@ static void mfdec_stream_destroy         (stream_obj* stream)
     COM_RELEASE(xcoder->outputSample);
     COM_RELEASE(xcoder->inputType);
     COM_RELEASE(xcoder->mft);
+    COM_RELEASE(xcoder->inputSample);
+    frame_unref((frame_obj**)&xcoder->outputFrame);
+    // buffers the MFT still holds keep the pool alive
+    mfdec_frame_buffer::close_pool(&xcoder->bufferPool);
 #if _DUMP_DEBUG
     fclose(xcoder->debugFileIn);
     fclose(xcoder->debugFileOut);
@@ -48,16 +48,35 @@
 #include "streamprv.h"
 #include "frame_basic.h"
 #include "videolibUtils.h"
+#include "box_metadata.h"
 
 #include <list>
 #include <algorithm>
+#include <string>
+#include <vector>
 
 #define METAINJECT_FILTER_MAGIC 0x1256
 
+// default number of preloaded metadata frames held ready ahead of playback
+static const int _kDefaultMetadataWindow = 64;
+
+//-----------------------------------------------------------------------------
+// Preloaded metadata is kept in its compact form, and only turned into frames
+// as the playback approaches it
+typedef struct metainject_meta {
+    INT64_T             pts;
+    std::string         data;
+} metainject_meta_t;
+
+typedef std::vector<metainject_meta_t> MetadataStore;
+
 //-----------------------------------------------------------------------------
 typedef struct metainject_filter  : public stream_base  {
     int                 preloaded;
-    FrameList*          metadataFramesPreloaded;
+    MetadataStore*      metadataPreloaded;
+    size_t              metadataCursor;     // next preloaded entry to consider
+    INT64_T             metadataWindowStart;// preloaded entries before this are skipped
+    int                 metadataWindow;     // max frames materialized; 0 - unbounded
     FrameList*          metadataFramesAvailable;
     FrameList*          dataFramesAvailable;
     frame_allocator*    fa;
@@ -137,7 +156,10 @@ static stream_obj*   metainject_filter_create                (const char* name)
     res->isInitialized = false;
     res->dataFramesAvailable = frame_list_create();
     res->metadataFramesAvailable = frame_list_create();
-    res->metadataFramesPreloaded = frame_list_create();
+    res->metadataPreloaded = new MetadataStore();
+    res->metadataCursor = 0;
+    res->metadataWindowStart = 0;
+    res->metadataWindow = _kDefaultMetadataWindow;
     res->fa = create_frame_allocator(_STR("metainj_"<<name));
     res->mutex = sv_mutex_create();
     res->event = NULL;
@@ -155,6 +177,64 @@ static stream_obj*   metainject_filter_create                (const char* name)
     return (stream_obj*)res;
 }
 
+//-----------------------------------------------------------------------------
+static frame_obj*  _metainject_alloc_meta                  (metainject_filter_obj* sf,
+                                            INT64_T ts,
+                                            const void* data,
+                                            size_t datalen)
+{
+    static const size_t stdalloc = 1024;
+    size_t alloclen = std::max(datalen, stdalloc);
+
+    basic_frame_obj* bf = alloc_basic_frame2(METAINJECT_FILTER_MAGIC, alloclen, sf->logCb, sf->fa );
+    bf->pts = bf->dts = ts;
+    bf->width = 0;
+    bf->height = 0;
+    bf->mediaType = mediaMetadata;
+    bf->dataSize = datalen;
+    bf->pixelFormat = pfmtUndefined;
+    memcpy(bf->data, data, datalen);
+    return (frame_obj*)bf;
+}
+
+//-----------------------------------------------------------------------------
+static int         metainject_filter_add_meta              (metainject_filter_obj* sf,
+                                            const char* sTime,
+                                            const void* data,
+                                            size_t datalen)
+{
+    if ( sf->preloaded && sf->isInitialized) {
+        return -1;
+    }
+
+    sv_mutex_enter(sf->mutex);
+    INT64_T     ts;
+    sscanf(sTime, I64FMT, &ts);
+
+    TRACE(_FMT("Adding meta: pts=" << ts << " size=" << datalen ));
+    if (ts < sf->lastVideoPts) {
+        sf->metaIgnored++;
+        sf->logCb(logWarning, _FMT("Ignoring subtitle for " << ts << ": last video frame served " << sf->lastVideoPts <<
+            " metaWritten=" << sf->metaWritten << " metaIgnored=" << sf->metaIgnored));
+        sv_mutex_exit(sf->mutex);
+        return 0;
+    }
+
+    if (sf->preloaded) {
+        metainject_meta_t meta;
+        meta.pts = ts;
+        meta.data.assign((const char*)data, datalen);
+        sf->metadataPreloaded->push_back(meta);
+    } else {
+        sf->metadataFramesAvailable->push_back(_metainject_alloc_meta(sf, ts, data, datalen));
+    }
+    sv_mutex_exit(sf->mutex);
+    if ( sf->event ) {
+        sv_event_set(sf->event);
+    }
+    return 0;
+}
+
 //-----------------------------------------------------------------------------
 static int         metainject_filter_set_param             (stream_obj* stream,
                                             const CHAR_T* name,
@@ -163,46 +243,17 @@ static int         metainject_filter_set_param             (stream_obj* stream,
     DECLARE_METAINJECT_FILTER(stream, sf);
     name = stream_param_name_apply_scope(stream, name);
     if (!_strnicmp(name, "metadata.", 9)) {
-        if ( sf->preloaded && sf->isInitialized) {
-            return -1;
-        }
-
-        sv_mutex_enter(sf->mutex);
-        const char* sTime = &name[9];
         const char* sValue = (const char*)value;
-        static const size_t stdalloc = 1024;
-        size_t datalen = strlen(sValue)+1;
-        size_t alloclen = std::max(datalen, stdalloc);
-        INT64_T     ts;
-        sscanf(sTime, I64FMT, &ts);
-
-        TRACE(_FMT("Adding meta: " << name << "; pts=" << ts ));
-        if (ts < sf->lastVideoPts) {
-            sf->metaIgnored++;
-            sf->logCb(logWarning, _FMT("Ignoring subtitle for " << ts << ": last video frame served " << sf->lastVideoPts <<
-                " metaWritten=" << sf->metaWritten << " metaIgnored=" << sf->metaIgnored));
-            sv_mutex_exit(sf->mutex);
-            return 0;
-        }
-
-        basic_frame_obj* bf = alloc_basic_frame2(METAINJECT_FILTER_MAGIC, alloclen, sf->logCb, sf->fa );
-        bf->pts = bf->dts = ts;
-        bf->width = 0;
-        bf->height = 0;
-        bf->mediaType = mediaMetadata;
-        bf->dataSize = datalen;
-        bf->pixelFormat = pfmtUndefined;
-        strcpy((char*)bf->data, sValue);
-        if (sf->preloaded) {
-            sf->metadataFramesPreloaded->push_back((frame_obj*)bf);
-        } else {
-            sf->metadataFramesAvailable->push_back((frame_obj*)bf);
-        }
-        sv_mutex_exit(sf->mutex);
-        if ( sf->event ) {
-            sv_event_set(sf->event);
+        return metainject_filter_add_meta(sf, &name[9], sValue, strlen(sValue)+1);
+    }
+    if (!_strnicmp(name, "boxes.", 6)) {
+        // binary form, see box_metadata.h
+        const box_metadata_header* hdr = (const box_metadata_header*)value;
+        if ( !box_metadata_is_binary(hdr) ) {
+            sf->logCb(logError, _FMT("Invalid box metadata for " << name));
+            return -1;
         }
-        return 0;
+        return metainject_filter_add_meta(sf, &name[6], hdr, box_metadata_size(hdr->count));
     }
     if (!_stricmp(name, "blocking")) {
         sv_mutex_enter(sf->mutex);
@@ -215,6 +266,12 @@ static int         metainject_filter_set_param             (stream_obj* stream,
         sv_mutex_exit(sf->mutex);
         return 0;
     }
+    if (!_stricmp(name, "metadataWindow")) {
+        sv_mutex_enter(sf->mutex);
+        sf->metadataWindow = std::max(0, *(int*)value);
+        sv_mutex_exit(sf->mutex);
+        return 0;
+    }
     if (!_stricmp(name, "maxDelayFrames")) {
         int maxDelayFrames = *(int*)value;
         if ( maxDelayFrames < sf->minJitterBuffer ) {
@@ -249,6 +306,8 @@ static int        metainject_filter_get_param(stream_obj* stream,
 {
     DECLARE_METAINJECT_FILTER(stream, sf);
     name = stream_param_name_apply_scope(stream, name);
+    COPY_PARAM_IF(sf, name, "metadataWindow", int, sf->metadataWindow);
+    COPY_PARAM_IF(sf, name, "metadataPreloaded", int, (int)sf->metadataPreloaded->size());
     COPY_PARAM_IF(sf, name, "nextMetadata", frame_obj*,
                                 ( !sf->preloaded || sf->metadataFramesAvailable->empty() )
                                             ? NULL
@@ -258,29 +317,43 @@ static int        metainject_filter_get_param(stream_obj* stream,
 }
 
 //-----------------------------------------------------------------------------
-static void       _metainject_copy_preloaded            (metainject_filter_obj* sf,
-                                                        UINT64_T firstTs)
+// Tops up the available metadata from the preloaded store, up to the window size
+static void       _metainject_fill_window               (metainject_filter_obj* sf)
 {
-    frame_list_clear(sf->metadataFramesAvailable);
+    if ( !sf->preloaded || !sf->isInitialized ) {
+        return;
+    }
 
-    for (FrameList::iterator it=sf->metadataFramesPreloaded->begin();
-         it != sf->metadataFramesPreloaded->end();
-         it++ ) {
-        frame_obj* f = *it;
-        INT64_T pts = frame_get_api(f)->get_pts(f);
+    const MetadataStore& store = *sf->metadataPreloaded;
+    while ( sf->metadataCursor < store.size() &&
+            ( sf->metadataWindow == 0 ||
+              (int)sf->metadataFramesAvailable->size() < sf->metadataWindow ) ) {
+        const metainject_meta_t& meta = store[sf->metadataCursor++];
 
         // we may need an earlier metadata to apply to the data frame we return after seek
         // (this especially applies to reverse frame-by-frame playback)
         // make sure we include a reasonable amount of meta frames preceeding the relevant timestamp
         static const int _kMaxApplicableMetadataDistance = 50;
 
-        if ( pts + _kMaxApplicableMetadataDistance >= firstTs ) {
-            frame_ref(f);
-            sf->metadataFramesAvailable->push_back(f);
+        if ( meta.pts + _kMaxApplicableMetadataDistance >= sf->metadataWindowStart ) {
+            sf->metadataFramesAvailable->push_back(_metainject_alloc_meta(sf,
+                                                        meta.pts,
+                                                        meta.data.data(),
+                                                        meta.data.size()));
         }
     }
 }
 
+//-----------------------------------------------------------------------------
+static void       _metainject_reset_preloaded           (metainject_filter_obj* sf,
+                                                        INT64_T firstTs)
+{
+    frame_list_clear(sf->metadataFramesAvailable);
+    sf->metadataCursor = 0;
+    sf->metadataWindowStart = firstTs;
+    _metainject_fill_window(sf);
+}
+
 //-----------------------------------------------------------------------------
 static int         metainject_filter_open_in            (stream_obj* stream)
 {
@@ -291,7 +364,7 @@ static int         metainject_filter_open_in            (stream_obj* stream)
 
     if ( res == 0 ) {
         sf->isInitialized = true;
-        _metainject_copy_preloaded(sf, 0);
+        _metainject_reset_preloaded(sf, 0);
     }
 
     return res;
@@ -308,7 +381,7 @@ static int         metainject_filter_seek               (stream_obj* stream,
     int res = default_seek(stream, offset, flags);
     if ( res == 0 ) {
         frame_list_clear(sf->dataFramesAvailable);
-        _metainject_copy_preloaded(sf, offset);
+        _metainject_reset_preloaded(sf, offset);
         sf->lastVideoPts = 0;
         sf->lastMetaPts = 0;
         sf->eof = 0;
@@ -345,6 +418,7 @@ static frame_obj*  _metainject_get_frame    (metainject_filter_obj* sf)
         goto ReturnData;
     }
 
+    _metainject_fill_window(sf);
     metaSize = sf->metadataFramesAvailable->size();
     if ( metaSize == 0 ) {
         if ( sf->preloaded ) {
@@ -508,7 +582,7 @@ static void metainject_filter_destroy         (stream_obj* stream)
     default_close(stream); // make sure all the internals had been freed
     frame_list_destroy( &sf->dataFramesAvailable );
     frame_list_destroy( &sf->metadataFramesAvailable );
-    frame_list_destroy( &sf->metadataFramesPreloaded );
+    delete sf->metadataPreloaded;
     destroy_frame_allocator( &sf->fa, sf->logCb );
     sv_event_destroy(&sf->event);
     sv_mutex_destroy(&sf->mutex);
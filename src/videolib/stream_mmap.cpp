@@ -39,6 +39,9 @@
 
 #include "streamprv.h"
 #include "videolibUtils.h"
+#include "frame_props.h"
+
+#include <atomic>
 
 #define MMAPSINK_STREAM_MAGIC 0x4275
 
@@ -49,12 +52,69 @@ typedef struct mmapsink_stream  : public stream_base  {
     size_t      width;
     size_t      height;
     int         fpsErrorLogged;
+
+    int         layout;             // mmapLayoutV1 or mmapLayoutV2
+    int         slots;              // number of frame slots in v2 layout
+    size_t      slotSize;
+    int         framesSkipped;      // v2 frames not copied, since the reader wasn't keeping up
+    int64_t     lastPublishTime;
+
+    float       requestFps;
+    float       captureFps;
+    int64_t     lastFpsQueryTime;
 } mmapsink_stream_obj;
 
 
 // The header size of memory mapped files
 static const int kMMAPHeaderSize = 32;
 
+//-----------------------------------------------------------------------------
+// Layout v1 is a single frame following a 32-byte ASCII header
+// ("%9d%4d%4d%7.2f%7.2f\n": counter, width, height, requestFps, captureFps),
+// followed by a "%4d%4d\n" size marker.
+//
+// Layout v2 is a binary header followed by a number of rotating frame slots.
+// Each slot is guarded by a sequence counter, which is odd while the slot is
+// being written (seqlock): readers copy the slot indicated by latestSlot, and
+// retry if the sequence had changed, or was odd, while they were at it.
+// Readers store frameCounter of what they've consumed in readerAck; producer
+// doesn't bother copying new frames while the latest one is still unconsumed
+// (but not for longer than kMaxSkipMs, so an idle reader won't come back to
+// a stale frame). All fields are native endian; slot data is 64-byte aligned.
+enum {
+    mmapLayoutV1 = 1,
+    mmapLayoutV2 = 2,
+};
+
+typedef struct mmap_v2_header {
+    char                    magic[4];       // "SVM2"
+    uint32_t                version;        // 2
+    uint32_t                headerSize;     // offset of the first slot
+    uint32_t                slotCount;
+    uint32_t                slotSize;       // including the slot header
+    std::atomic<uint32_t>   latestSlot;
+    std::atomic<uint32_t>   frameCounter;   // of the frame in latestSlot; 0 if none yet
+    std::atomic<uint32_t>   readerAck;      // set by the reader
+    float                   requestFps;
+    float                   captureFps;
+} mmap_v2_header;
+
+typedef struct mmap_v2_slot {
+    std::atomic<uint32_t>   seq;
+    uint32_t                frameCounter;
+    int64_t                 pts;
+    uint32_t                width;
+    uint32_t                height;
+    int32_t                 pixfmt;
+    uint32_t                dataSize;
+} mmap_v2_slot;
+
+static const size_t  kMMAPv2HeaderSize = 64;
+static const size_t  kMMAPv2SlotHeaderSize = 64;
+static const int     kDefaultSlots = 3;
+static const int     kMaxSkipMs = 500;
+static const int     kFpsQueryIntervalMs = 1000;
+
 //-----------------------------------------------------------------------------
 // Stream API
 //-----------------------------------------------------------------------------
@@ -66,6 +126,10 @@ static stream_obj* mmapsink_stream_create             (const char* name);
 static int         mmapsink_stream_set_param          (stream_obj* stream,
                                                 const CHAR_T* name,
                                                 const void* value);
+static int         mmapsink_stream_get_param          (stream_obj* stream,
+                                                const CHAR_T* name,
+                                                void* value,
+                                                size_t* size);
 static int         mmapsink_open_in                   (stream_obj* stream);
 static int         mmapsink_stream_read_frame         (stream_obj* stream, frame_obj** frame);
 static int         mmapsink_stream_close              (stream_obj* stream);
@@ -82,7 +146,7 @@ stream_api_t _g_mmapsink_stream_provider = {
     get_default_stream_api()->remove_element,
     get_default_stream_api()->insert_element,
     mmapsink_stream_set_param,
-    get_default_stream_api()->get_param,
+    mmapsink_stream_get_param,
     mmapsink_open_in,
     get_default_stream_api()->seek,
     get_default_stream_api()->get_width,
@@ -114,6 +178,14 @@ static stream_obj*   mmapsink_stream_create                (const char* name)
     res->filename = NULL;
     res->frameCounter = 0;
     res->fpsErrorLogged = 0;
+    res->layout = mmapLayoutV1;
+    res->slots = kDefaultSlots;
+    res->slotSize = 0;
+    res->framesSkipped = 0;
+    res->lastPublishTime = 0;
+    res->requestFps = 0.0;
+    res->captureFps = 0.0;
+    res->lastFpsQueryTime = 0;
     return (stream_obj*)res;
 }
 
@@ -126,10 +198,35 @@ static int         mmapsink_stream_set_param             (stream_obj* stream,
 
     name = stream_param_name_apply_scope(stream, name);
     SET_STR_PARAM_IF(stream, name, "filename", mmapsink->filename);
+    if ( !_stricmp(name, "layout") ) {
+        int layout = *(int*)value;
+        if ( layout != mmapLayoutV1 && layout != mmapLayoutV2 ) {
+            mmapsink->logCb(logError, _FMT("Unsupported mmap layout " << layout));
+            return -1;
+        }
+        mmapsink->layout = layout;
+        return 0;
+    }
+    SET_PARAM_IF(stream, name, "slots", int, mmapsink->slots);
 
     return default_set_param(stream, name, value);
 }
 
+//-----------------------------------------------------------------------------
+static int         mmapsink_stream_get_param          (stream_obj* stream,
+                                                const CHAR_T* name,
+                                                void* value,
+                                                size_t* size)
+{
+    DECLARE_STREAM_MMAPSINK(stream, mmapsink);
+
+    name = stream_param_name_apply_scope(stream, name);
+    COPY_PARAM_IF(mmapsink, name, "layout", int, mmapsink->layout);
+    COPY_PARAM_IF(mmapsink, name, "framesSkipped", int, mmapsink->framesSkipped);
+
+    return default_get_param(stream, name, value, size);
+}
+
 //-----------------------------------------------------------------------------
 static int        _mmapsink_open                      (mmapsink_stream_obj* mmapsink)
 {
@@ -138,9 +235,18 @@ static int        _mmapsink_open                      (mmapsink_stream_obj* mmap
     int w = mmapsink->width = default_get_width((stream_obj*)mmapsink);
     int h = mmapsink->height = default_get_height((stream_obj*)mmapsink);
 
-    size_t size = kMMAPHeaderSize +
-                av_image_get_buffer_size(svpfmt_to_ffpfmt(pfmtRGB24, NULL), w, h, _kDefAlign) +
-                1024;
+    size_t frameSize = av_image_get_buffer_size(svpfmt_to_ffpfmt(pfmtRGB24, NULL), w, h, _kDefAlign);
+    size_t size;
+
+    if ( mmapsink->layout == mmapLayoutV2 ) {
+        if ( mmapsink->slots < 1 ) {
+            mmapsink->slots = 1;
+        }
+        mmapsink->slotSize = kMMAPv2SlotHeaderSize + ((frameSize + 63) & ~(size_t)63);
+        size = kMMAPv2HeaderSize + mmapsink->slots*mmapsink->slotSize;
+    } else {
+        size = kMMAPHeaderSize + frameSize + 1024;
+    }
 
     mmapsink->mmapobj =  sv_open_mmap(mmapsink->filename, size);
 
@@ -149,7 +255,24 @@ static int        _mmapsink_open                      (mmapsink_stream_obj* mmap
         return -1;
     }
 
-    TRACE(_FMT("Opened mmap at " << mmapsink->filename << " size=" << size));
+    if ( mmapsink->layout == mmapLayoutV2 ) {
+        uint8_t*        ptr = sv_mmap_get_ptr(mmapsink->mmapobj);
+        mmap_v2_header* hdr = (mmap_v2_header*)ptr;
+        // readers go by the magic, so it is written last
+        memset(ptr, 0, kMMAPv2HeaderSize);
+        hdr->version = mmapLayoutV2;
+        hdr->headerSize = (uint32_t)kMMAPv2HeaderSize;
+        hdr->slotCount = (uint32_t)mmapsink->slots;
+        hdr->slotSize = (uint32_t)mmapsink->slotSize;
+        for (int nI=0; nI<mmapsink->slots; nI++) {
+            memset(ptr + kMMAPv2HeaderSize + nI*mmapsink->slotSize, 0, kMMAPv2SlotHeaderSize);
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(hdr->magic, "SVM2", 4);
+        mmapsink->lastPublishTime = 0;
+    }
+
+    TRACE(_FMT("Opened mmap at " << mmapsink->filename << " size=" << size << " layout=" << mmapsink->layout));
     return 0;
 }
 
@@ -175,6 +298,62 @@ static int         mmapsink_open_in                    (stream_obj* stream)
     return _mmapsink_open(mmapsink);
 }
 
+//-----------------------------------------------------------------------------
+static void        _mmapsink_write_v2                (mmapsink_stream_obj* mmapsink,
+                                                    const frame_props* props,
+                                                    int64_t now)
+{
+    size_t          frameSize = props->dataSize;
+    uint8_t*        ptr = sv_mmap_get_ptr(mmapsink->mmapobj);
+    mmap_v2_header* hdr = (mmap_v2_header*)ptr;
+
+    if ( frameSize + kMMAPv2SlotHeaderSize > mmapsink->slotSize ) {
+        mmapsink->logCb(logError, _FMT("Cannot output mmap frame: slotSize="<<
+                                    mmapsink->slotSize << " actualSize=" << frameSize ));
+        return;
+    }
+
+    uint32_t published = hdr->frameCounter.load(std::memory_order_relaxed);
+    if ( published != 0 &&
+         hdr->readerAck.load(std::memory_order_acquire) != published &&
+         now - mmapsink->lastPublishTime < kMaxSkipMs ) {
+        mmapsink->framesSkipped++;
+        TRACE(_FMT("Reader hasn't consumed frame " << published << " yet; skipped=" << mmapsink->framesSkipped));
+        return;
+    }
+
+    uint32_t      slotIndex = ( published == 0 ) ? 0 :
+                        (hdr->latestSlot.load(std::memory_order_relaxed) + 1) % mmapsink->slots;
+    uint8_t*      slotPtr = ptr + kMMAPv2HeaderSize + slotIndex*mmapsink->slotSize;
+    mmap_v2_slot* slot = (mmap_v2_slot*)slotPtr;
+    // frame counter wraps around, skipping 0 ("nothing published")
+    uint32_t      counter = (uint32_t)(mmapsink->frameCounter % 0xFFFFFFFF) + 1;
+
+    uint32_t seq = slot->seq.load(std::memory_order_relaxed);
+    slot->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot->frameCounter = counter;
+    slot->pts = props->pts;
+    slot->width = (uint32_t)props->width;
+    slot->height = (uint32_t)props->height;
+    slot->pixfmt = props->pixelFormat;
+    slot->dataSize = (uint32_t)frameSize;
+    memcpy(slotPtr + kMMAPv2SlotHeaderSize, props->data, frameSize);
+
+    slot->seq.store(seq + 2, std::memory_order_release);
+
+    hdr->requestFps = mmapsink->requestFps;
+    hdr->captureFps = mmapsink->captureFps;
+    hdr->latestSlot.store(slotIndex, std::memory_order_relaxed);
+    hdr->frameCounter.store(counter, std::memory_order_release);
+
+    mmapsink->lastPublishTime = now;
+    mmapsink->frameCounter++;
+    TRACE(_FMT("Published frame " << counter << " of " << slot->width << "x" << slot->height <<
+                " to slot " << slotIndex));
+}
+
 //-----------------------------------------------------------------------------
 static int         mmapsink_stream_read_frame        (stream_obj* stream, frame_obj** frame)
 {
@@ -190,33 +369,39 @@ static int         mmapsink_stream_read_frame        (stream_obj* stream, frame_
         return res;
     }
 
-    frame_api_t* api = frame_get_api(*frame);
-    if ( api->get_media_type(*frame) != mediaVideo ) {
+    frame_props         props;
+    frame_props_load(*frame, &props);
+    if ( props.mediaType != mediaVideo ) {
         return res;
     }
-    size_t              frameSize = api->get_data_size(*frame);
-    size_t              frameH    = api->get_height(*frame);
-    size_t              frameW    = api->get_width(*frame);
-    int                 pixfmt    = api->get_pixel_format(*frame);
-
-    float  requestFps = 0.0;
-    float  captureFps = 0.0;
-    size_t size = sizeof(float);
-
-    if ( default_get_param(stream, "captureFps", &captureFps, &size) < 0 ) {
-        if ( (mmapsink->fpsErrorLogged & 0x0F) == 0 ) {
-            mmapsink->logCb(logError, _FMT("Cannot determine the current capture fps" ));
-            mmapsink->fpsErrorLogged |= 0x0F;
+    size_t              frameSize = props.dataSize;
+    size_t              frameH    = props.height;
+    size_t              frameW    = props.width;
+    int                 pixfmt    = props.pixelFormat;
+
+    // fps is informational, and doesn't move fast -- no need to query the
+    // graph for every frame
+    int64_t now = sv_time_get_current_epoch_time();
+    if ( now - mmapsink->lastFpsQueryTime >= kFpsQueryIntervalMs ) {
+        size_t size = sizeof(float);
+        mmapsink->lastFpsQueryTime = now;
+        if ( default_get_param(stream, "captureFps", &mmapsink->captureFps, &size) < 0 ) {
+            if ( (mmapsink->fpsErrorLogged & 0x0F) == 0 ) {
+                mmapsink->logCb(logError, _FMT("Cannot determine the current capture fps" ));
+                mmapsink->fpsErrorLogged |= 0x0F;
+            }
+            mmapsink->captureFps = 0.0;
         }
-        captureFps = 0.0;
-    }
-    if ( default_get_param(stream, "requestFps", &requestFps, &size) < 0 ) {
-        if ( (mmapsink->fpsErrorLogged & 0xF0) == 0 ) {
-            mmapsink->logCb(logError, _FMT("Cannot determine the current request fps" ));
-            mmapsink->fpsErrorLogged |= 0x0F;
+        if ( default_get_param(stream, "requestFps", &mmapsink->requestFps, &size) < 0 ) {
+            if ( (mmapsink->fpsErrorLogged & 0xF0) == 0 ) {
+                mmapsink->logCb(logError, _FMT("Cannot determine the current request fps" ));
+                mmapsink->fpsErrorLogged |= 0x0F;
+            }
+            mmapsink->requestFps = mmapsink->captureFps;
         }
-        requestFps = captureFps;
     }
+    float  requestFps = mmapsink->requestFps;
+    float  captureFps = mmapsink->captureFps;
 
     if ( frameH != mmapsink->height || frameW != mmapsink->width ) {
         mmapsink->logCb(logInfo, _FMT("Output size had changed from " << mmapsink->width << "x" <<
@@ -228,12 +413,14 @@ static int         mmapsink_stream_read_frame        (stream_obj* stream, frame_
         }
     }
 
-    if ( frameSize+kMMAPHeaderSize <= sv_mmap_get_size(mmapsink->mmapobj) ) {
+    if ( mmapsink->layout == mmapLayoutV2 ) {
+        _mmapsink_write_v2(mmapsink, &props, now);
+    } else if ( frameSize+kMMAPHeaderSize <= sv_mmap_get_size(mmapsink->mmapobj) ) {
         uint8_t* ptr = sv_mmap_get_ptr(mmapsink->mmapobj);
         TRACE(_FMT("Filled a buffer: size=" << frameW << "x" << frameH <<
               " bytesToCopy=" << frameSize));
         memcpy(ptr+kMMAPHeaderSize,
-               api->get_data(*frame),
+               props.data,
                frameSize );
         // If we wrote a new frame add the header.
 #ifdef _WIN32
@@ -0,0 +1,532 @@
+/*****************************************************************************
+ *
+ * stream_motion_gate.cpp
+ *   Node holding back frames of a scene that hasn't changed, so analytics don't
+ *   get to look at them: they go on as mediaVideoTime placeholders.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#undef SV_MODULE_VAR
+#define SV_MODULE_VAR motiongate
+#define SV_MODULE_ID "MOTIONGATE"
+#include "sv_module_def.hpp"
+
+#include "streamprv.h"
+
+#include "frame_basic.h"
+
+#include "videolibUtils.h"
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MOTIONGATE_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define MOTIONGATE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define MOTIONGATE_FILTER_MAGIC 0x1269
+
+// The scene is compared on a grid of samples this wide, in blocks of
+// kBlockSize x kBlockSize samples
+static const int kSignatureWidth = 64;
+static const int kBlockSize = 8;
+static const int kMaxSignatureHeight = 64;
+static const int kDefaultThreshold = 10;
+static const int kDefaultMinChangedBlocks = 1;
+static const int kDefaultHoldMs = 2000;
+static const int kDefaultKeepaliveMs = 1000;
+static const int kDefaultLearnShift = 5;
+static const int kReportInterval = 60000;
+
+//-----------------------------------------------------------------------------
+typedef struct motiongate_filter  : public stream_base  {
+    int                     enabled;
+    int                     threshold;          // mean sample difference of a changed block, 0-255
+    int                     minChangedBlocks;   // it takes this many for a frame to go through
+    int                     holdMs;             // frames keep going through this long after a change
+    int                     keepaliveMs;        // and one at least this often regardless; 0 for never
+    int                     learnShift;         // background follows the scene at 1/2^learnShift a frame
+
+    // what the background was built for
+    int                     width;
+    int                     height;
+    int                     pixfmt;
+    int                     supported;
+    int                     stride;
+    int                     sigWidth;
+    int                     sigHeight;
+    std::vector<int>*       sampleX;            // byte offsets of the samples within a row
+    std::vector<int>*       sampleY;            // rows of the samples
+    std::vector<uint8_t>*   signature;
+    std::vector<uint8_t>*   background;
+    std::vector<uint16_t>*  backgroundAcc;      // the same, in 8.8 fixed point
+    std::vector<uint32_t>*  blockSad;
+    int                     backgroundValid;
+
+    INT64_T                 lastChangePts;
+    INT64_T                 lastPassPts;
+    int                     framesPassed;
+    int                     framesGated;
+    int64_t                 lastLogTime;
+    frame_allocator*        fa;
+} motiongate_filter_obj;
+
+//-----------------------------------------------------------------------------
+// Stream API
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+//  Forward declarations
+//-----------------------------------------------------------------------------
+static stream_obj* motiongate_filter_create             (const char* name);
+static int         motiongate_filter_set_param          (stream_obj* stream,
+                                                const CHAR_T* name,
+                                                const void* value);
+static int         motiongate_filter_get_param          (stream_obj* stream,
+                                                const CHAR_T* name,
+                                                void* value,
+                                                size_t* size);
+static int         motiongate_filter_seek               (stream_obj* stream,
+                                                INT64_T offset,
+                                                int flags);
+static int         motiongate_filter_read_frame         (stream_obj* stream, frame_obj** frame);
+static int         motiongate_filter_close              (stream_obj* stream);
+static void        motiongate_filter_destroy            (stream_obj* stream);
+
+
+//-----------------------------------------------------------------------------
+stream_api_t _g_motiongate_filter_provider = {
+    motiongate_filter_create,
+    get_default_stream_api()->set_source,
+    get_default_stream_api()->set_log_cb,
+    get_default_stream_api()->get_name,
+    get_default_stream_api()->find_element,
+    get_default_stream_api()->remove_element,
+    get_default_stream_api()->insert_element,
+    motiongate_filter_set_param,
+    motiongate_filter_get_param,
+    get_default_stream_api()->open_in,
+    motiongate_filter_seek,
+    get_default_stream_api()->get_width,
+    get_default_stream_api()->get_height,
+    get_default_stream_api()->get_pixel_format,
+    motiongate_filter_read_frame,
+    get_default_stream_api()->print_pipeline,
+    motiongate_filter_close,
+    _set_module_trace_level
+};
+
+
+//-----------------------------------------------------------------------------
+#define DECLARE_MOTIONGATE_FILTER(stream, name) \
+    DECLARE_OBJ(motiongate_filter_obj, name,  stream, MOTIONGATE_FILTER_MAGIC, -1)
+
+#define DECLARE_MOTIONGATE_FILTER_V(stream, name) \
+    DECLARE_OBJ_V(motiongate_filter_obj, name,  stream, MOTIONGATE_FILTER_MAGIC)
+
+static stream_obj*   motiongate_filter_create                (const char* name)
+{
+    motiongate_filter_obj* res = (motiongate_filter_obj*)stream_init(sizeof(motiongate_filter_obj),
+                MOTIONGATE_FILTER_MAGIC,
+                &_g_motiongate_filter_provider,
+                name,
+                motiongate_filter_destroy );
+    res->enabled = 1;
+    res->threshold = kDefaultThreshold;
+    res->minChangedBlocks = kDefaultMinChangedBlocks;
+    res->holdMs = kDefaultHoldMs;
+    res->keepaliveMs = kDefaultKeepaliveMs;
+    res->learnShift = kDefaultLearnShift;
+    res->width = 0;
+    res->height = 0;
+    res->pixfmt = pfmtUndefined;
+    res->supported = 0;
+    res->stride = 0;
+    res->sigWidth = 0;
+    res->sigHeight = 0;
+    res->sampleX = new std::vector<int>;
+    res->sampleY = new std::vector<int>;
+    res->signature = new std::vector<uint8_t>;
+    res->background = new std::vector<uint8_t>;
+    res->backgroundAcc = new std::vector<uint16_t>;
+    res->blockSad = new std::vector<uint32_t>;
+    res->backgroundValid = 0;
+    res->lastChangePts = INVALID_PTS;
+    res->lastPassPts = INVALID_PTS;
+    res->framesPassed = 0;
+    res->framesGated = 0;
+    res->lastLogTime = sv_time_get_current_epoch_time();
+    res->fa = create_frame_allocator(_STR("motiongate_"<<name));
+    return (stream_obj*)res;
+}
+
+//-----------------------------------------------------------------------------
+static int         motiongate_filter_set_param             (stream_obj* stream,
+                                            const CHAR_T* name,
+                                            const void* value)
+{
+    DECLARE_MOTIONGATE_FILTER(stream, gate);
+    name = stream_param_name_apply_scope(stream, name);
+    SET_PARAM_IF(stream, name, "enabled", int, gate->enabled);
+    SET_PARAM_IF(stream, name, "threshold", int, gate->threshold);
+    SET_PARAM_IF(stream, name, "minChangedBlocks", int, gate->minChangedBlocks);
+    SET_PARAM_IF(stream, name, "holdMs", int, gate->holdMs);
+    SET_PARAM_IF(stream, name, "keepaliveMs", int, gate->keepaliveMs);
+    if ( !_stricmp(name, "learnShift") ) {
+        gate->learnShift = std::max(0, std::min(*(int*)value, 8));
+        return 0;
+    }
+    return default_set_param(stream, name, value);
+}
+
+//-----------------------------------------------------------------------------
+static int         motiongate_filter_get_param             (stream_obj* stream,
+                                            const CHAR_T* name,
+                                            void* value,
+                                            size_t* size)
+{
+    DECLARE_MOTIONGATE_FILTER(stream, gate);
+    name = stream_param_name_apply_scope(stream, name);
+    COPY_PARAM_IF(gate, name, "enabled", int, gate->enabled);
+    COPY_PARAM_IF(gate, name, "framesPassed", int, gate->framesPassed);
+    COPY_PARAM_IF(gate, name, "framesGated", int, gate->framesGated);
+    return default_get_param(stream, name, value, size);
+}
+
+//-----------------------------------------------------------------------------
+// Bytes per pixel, and the offset of the byte we sample: luma where there's
+// one, green (the bulk of it) otherwise
+static int         _motiongate_get_sample_layout      (int pixfmt, int* offset)
+{
+    switch (pixfmt) {
+    case pfmtRGB24:
+    case pfmtBGR24:     *offset = 1; return 3;
+    case pfmtRGBA:
+    case pfmtBGRA:      *offset = 1; return 4;
+    case pfmtARGB:      *offset = 2; return 4;
+    case pfmtYUYV422:   *offset = 0; return 2;
+    case pfmtYUV420P:
+    case pfmtYUVJ420P:
+    case pfmtYUV422P:
+    case pfmtYUVJ422P:
+    case pfmtYUV444P:
+    case pfmtYUVJ444P:
+    case pfmtNV12:
+    case pfmtNV16:
+    case pfmtNV21:      *offset = 0; return 1;
+    default:            *offset = 0; return 0;
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void        _motiongate_configure              (motiongate_filter_obj* gate,
+                                                       int width,
+                                                       int height,
+                                                       int pixfmt)
+{
+    int offset;
+    int bpp = _motiongate_get_sample_layout(pixfmt, &offset);
+
+    gate->width = width;
+    gate->height = height;
+    gate->pixfmt = pixfmt;
+    gate->backgroundValid = 0;
+    gate->supported = ( bpp > 0 && width >= kSignatureWidth && height >= kBlockSize );
+    if ( !gate->supported ) {
+        gate->logCb(logInfo, _FMT("Not gating frames of " << width << "x" << height <<
+                                  " pixfmt=" << pixfmt));
+        return;
+    }
+
+    // frames coming out of resize are tightly packed
+    gate->stride = width*bpp;
+    gate->sigWidth = kSignatureWidth;
+    gate->sigHeight = (kSignatureWidth*height/width)/kBlockSize*kBlockSize;
+    gate->sigHeight = std::max(kBlockSize, std::min(gate->sigHeight, kMaxSignatureHeight));
+
+    gate->sampleX->resize(gate->sigWidth);
+    for (int nI=0; nI<gate->sigWidth; nI++) {
+        int x = (2*nI+1)*width/(2*gate->sigWidth);
+        (*gate->sampleX)[nI] = x*bpp + offset;
+    }
+    gate->sampleY->resize(gate->sigHeight);
+    for (int nI=0; nI<gate->sigHeight; nI++) {
+        (*gate->sampleY)[nI] = (2*nI+1)*height/(2*gate->sigHeight);
+    }
+    size_t samples = gate->sigWidth*gate->sigHeight;
+    gate->signature->resize(samples);
+    gate->background->resize(samples);
+    gate->backgroundAcc->resize(samples);
+    gate->blockSad->resize(samples/(kBlockSize*kBlockSize));
+    TRACE(_FMT("Gating frames of " << width << "x" << height << " pixfmt=" << pixfmt <<
+               " on a " << gate->sigWidth << "x" << gate->sigHeight << " grid"));
+}
+
+//-----------------------------------------------------------------------------
+static void        _motiongate_sample                 (motiongate_filter_obj* gate,
+                                                       const uint8_t* data)
+{
+    const int*  xs = &(*gate->sampleX)[0];
+    uint8_t*    dst = &(*gate->signature)[0];
+    for (int y=0; y<gate->sigHeight; y++) {
+        const uint8_t* row = data + (size_t)(*gate->sampleY)[y]*gate->stride;
+        for (int x=0; x<gate->sigWidth; x++) {
+            *dst++ = row[xs[x]];
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Sum of absolute differences between the signature and the background, for
+// each kBlockSize x kBlockSize block
+static void        _motiongate_block_sad              (motiongate_filter_obj* gate)
+{
+    const int       w = gate->sigWidth;
+    const uint8_t*  cur = &(*gate->signature)[0];
+    const uint8_t*  bg = &(*gate->background)[0];
+    uint32_t*       sad = &(*gate->blockSad)[0];
+
+    for (int by=0; by<gate->sigHeight; by+=kBlockSize) {
+        for (int bx=0; bx<w; bx+=16) {
+            const uint8_t* a = cur + by*w + bx;
+            const uint8_t* b = bg + by*w + bx;
+#if MOTIONGATE_SSE2
+            // one psadbw covers a row of two blocks
+            __m128i acc = _mm_setzero_si128();
+            for (int r=0; r<kBlockSize; r++) {
+                __m128i va = _mm_loadu_si128((const __m128i*)(a + r*w));
+                __m128i vb = _mm_loadu_si128((const __m128i*)(b + r*w));
+                acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+            }
+            sad[0] = (uint32_t)_mm_cvtsi128_si32(acc);
+            sad[1] = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#elif MOTIONGATE_NEON
+            uint16x8_t acc = vdupq_n_u16(0);
+            for (int r=0; r<kBlockSize; r++) {
+                acc = vpadalq_u8(acc, vabdq_u8(vld1q_u8(a + r*w), vld1q_u8(b + r*w)));
+            }
+            uint64x2_t sums = vpaddlq_u32(vpaddlq_u16(acc));
+            sad[0] = (uint32_t)vgetq_lane_u64(sums, 0);
+            sad[1] = (uint32_t)vgetq_lane_u64(sums, 1);
+#else
+            sad[0] = sad[1] = 0;
+            for (int r=0; r<kBlockSize; r++) {
+                for (int c=0; c<16; c++) {
+                    int d = a[r*w+c] - b[r*w+c];
+                    sad[c/kBlockSize] += (d < 0) ? -d : d;
+                }
+            }
+#endif
+            sad += 2;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Lets the background follow the scene, so lighting drifts and things that
+// came to rest stop counting as changes
+static void        _motiongate_update_background      (motiongate_filter_obj* gate)
+{
+    const uint8_t*  cur = &(*gate->signature)[0];
+    uint8_t*        bg = &(*gate->background)[0];
+    uint16_t*       acc = &(*gate->backgroundAcc)[0];
+    size_t          samples = gate->signature->size();
+
+    if ( !gate->backgroundValid ) {
+        for (size_t nI=0; nI<samples; nI++) {
+            acc[nI] = (uint16_t)(cur[nI] << 8);
+            bg[nI] = cur[nI];
+        }
+        gate->backgroundValid = 1;
+        return;
+    }
+    for (size_t nI=0; nI<samples; nI++) {
+        int diff = ((int)cur[nI] << 8) - acc[nI];
+        acc[nI] = (uint16_t)(acc[nI] + diff/(1<<gate->learnShift));
+        bg[nI] = (uint8_t)(acc[nI] >> 8);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Returns true if the frame differs enough from the background to go through
+static bool        _motiongate_detect_change          (motiongate_filter_obj* gate,
+                                                       frame_obj* frame)
+{
+    frame_api_t*    api = frame_get_api(frame);
+    int             width = (int)api->get_width(frame);
+    int             height = (int)api->get_height(frame);
+    int             pixfmt = api->get_pixel_format(frame);
+
+    if ( width != gate->width || height != gate->height || pixfmt != gate->pixfmt ) {
+        _motiongate_configure(gate, width, height, pixfmt);
+    }
+    const uint8_t*  data = (const uint8_t*)api->get_data(frame);
+    if ( !gate->supported || data == NULL ||
+         api->get_data_size(frame) < (size_t)gate->stride*height ) {
+        return true;
+    }
+
+    _motiongate_sample(gate, data);
+    if ( !gate->backgroundValid ) {
+        _motiongate_update_background(gate);
+        return true;
+    }
+
+    _motiongate_block_sad(gate);
+    const uint32_t  blockThreshold = (uint32_t)(gate->threshold*kBlockSize*kBlockSize);
+    int             changed = 0;
+    for (size_t nI=0; nI<gate->blockSad->size(); nI++) {
+        if ( (*gate->blockSad)[nI] > blockThreshold ) {
+            changed++;
+        }
+    }
+    _motiongate_update_background(gate);
+    return changed >= gate->minChangedBlocks;
+}
+
+//-----------------------------------------------------------------------------
+static frame_obj*  _motiongate_make_placeholder       (motiongate_filter_obj* gate,
+                                                       frame_obj* frame)
+{
+    frame_api_t* api = frame_get_api(frame);
+    basic_frame_obj* newFrame = alloc_basic_frame2 (MOTIONGATE_FILTER_MAGIC,
+                                                    0,
+                                                    gate->logCb,
+                                                    gate->fa );
+    newFrame->pts = api->get_pts(frame);
+    newFrame->dts = api->get_dts(frame);
+    newFrame->width = api->get_width(frame);
+    newFrame->height = api->get_height(frame);
+    newFrame->pixelFormat = api->get_pixel_format(frame);
+    newFrame->mediaType = mediaVideoTime;
+    newFrame->dataSize = 0;
+    newFrame->data = NULL;
+    return (frame_obj*)newFrame;
+}
+
+//-----------------------------------------------------------------------------
+static int         motiongate_filter_seek             (stream_obj* stream,
+                                                       INT64_T offset,
+                                                       int flags)
+{
+    DECLARE_MOTIONGATE_FILTER(stream, gate);
+    gate->backgroundValid = 0;
+    gate->lastChangePts = INVALID_PTS;
+    gate->lastPassPts = INVALID_PTS;
+    return default_seek(stream, offset, flags);
+}
+
+//-----------------------------------------------------------------------------
+static int         motiongate_filter_read_frame        (stream_obj* stream,
+                                                    frame_obj** frame)
+{
+    DECLARE_MOTIONGATE_FILTER(stream, gate);
+    frame_obj*      tmp = NULL;
+    frame_api_t*    frameApi;
+
+    *frame = NULL;
+    int res = default_read_frame(stream, &tmp);
+    if ( res < 0 || tmp == NULL ||
+         (frameApi = frame_get_api(tmp)) == NULL ||
+         frameApi->get_media_type(tmp) != mediaVideo ||
+         !gate->enabled ) {
+        *frame = tmp;
+        return res;
+    }
+
+    INT64_T pts = frameApi->get_pts(tmp);
+    bool    pass = _motiongate_detect_change(gate, tmp);
+    if ( pass ||
+         pts == INVALID_PTS ||
+         gate->lastPassPts == INVALID_PTS ||
+         pts < gate->lastPassPts ) {
+        gate->lastChangePts = pts;
+        pass = true;
+    } else if ( pts - gate->lastChangePts < gate->holdMs ||
+                ( gate->keepaliveMs > 0 && pts - gate->lastPassPts >= gate->keepaliveMs ) ) {
+        pass = true;
+    }
+
+    if ( pass ) {
+        gate->lastPassPts = pts;
+        gate->framesPassed++;
+        *frame = tmp;
+    } else {
+        // the timestamp goes on, so whoever keeps time by frames stays in step
+        gate->framesGated++;
+        *frame = _motiongate_make_placeholder(gate, tmp);
+        frame_unref(&tmp);
+    }
+
+    int64_t now = sv_time_get_current_epoch_time();
+    if ( now - gate->lastLogTime > kReportInterval ) {
+        TRACE(_FMT("passed=" << gate->framesPassed << " gated=" << gate->framesGated));
+        gate->lastLogTime = now;
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static int         motiongate_filter_close             (stream_obj* stream)
+{
+    DECLARE_MOTIONGATE_FILTER(stream, gate);
+    gate->backgroundValid = 0;
+    gate->lastChangePts = INVALID_PTS;
+    gate->lastPassPts = INVALID_PTS;
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+static void motiongate_filter_destroy         (stream_obj* stream)
+{
+    DECLARE_MOTIONGATE_FILTER_V(stream, gate);
+    gate->logCb(logTrace, _FMT("Destroying stream object " << (void*)stream <<
+                               " passed=" << gate->framesPassed <<
+                               " gated=" << gate->framesGated));
+    motiongate_filter_close(stream); // make sure all the internals had been freed
+    delete gate->sampleX;
+    delete gate->sampleY;
+    delete gate->signature;
+    delete gate->background;
+    delete gate->backgroundAcc;
+    delete gate->blockSad;
+    destroy_frame_allocator( &gate->fa, gate->logCb );
+    stream_destroy( stream );
+}
+
+//-----------------------------------------------------------------------------
+SVVIDEOLIB_API stream_api_t*     get_motion_gate_api                    ()
+{
+    return &_g_motiongate_filter_provider;
+}
@@ -0,0 +1,448 @@
+/*****************************************************************************
+ *
+ * stream_packet_ring.cpp
+ *   Per-camera ring of recent compressed packets, and the node filling it.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#undef SV_MODULE_VAR
+#define SV_MODULE_VAR packetring
+#define SV_MODULE_ID "PACKETRING"
+#include "sv_module_def.hpp"
+
+#include "streamprv.h"
+#include "packet_ring.h"
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "videolibUtils.h"
+
+#define PACKETRING_FILTER_MAGIC 0x1228
+static const int kDefaultBudgetKb = 16*1024;
+
+//-----------------------------------------------------------------------------
+typedef struct ring_entry {
+    uint64_t                seq;
+    size_t                  offset;
+    size_t                  size;
+    INT64_T                 pts;
+    INT64_T                 dts;
+    int                     mediaType;
+    int                     keyframe;
+} ring_entry;
+
+struct packet_ring {
+    std::atomic<int>        refs;
+    std::mutex              mutex;
+    std::vector<uint8_t>    mem;
+    // in order of arrival; data of consecutive entries is laid out one after
+    // another, wrapping to the start of mem when it doesn't fit at the end
+    std::deque<ring_entry>  entries;
+    uint64_t                nextSeq;
+    size_t                  bytes;          // payload in the ring
+    int                     gopsEvicted;
+    int                     packetsRejected;
+    fn_stream_log           logCb;
+};
+
+struct packet_ring_cursor {
+    packet_ring*            ring;
+    uint64_t                nextSeq;
+    int                     packetsSkipped; // evicted before the cursor got to them
+};
+
+//-----------------------------------------------------------------------------
+static bool _ring_is_keyframe(const ring_entry& e)
+{
+    return e.mediaType == mediaVideo && e.keyframe;
+}
+
+//-----------------------------------------------------------------------------
+// Drops the oldest GOP, so the ring once again starts at a keyframe (or is empty)
+static void _ring_evict_gop(packet_ring* ring)
+{
+    do {
+        ring->bytes -= ring->entries.front().size;
+        ring->entries.pop_front();
+    } while ( !ring->entries.empty() && !_ring_is_keyframe(ring->entries.front()) );
+    ring->gopsEvicted++;
+}
+
+//-----------------------------------------------------------------------------
+// Finds room for size bytes after the newest packet; false if there's none
+static bool _ring_find_space(packet_ring* ring, size_t size, size_t& offset)
+{
+    if ( ring->entries.empty() ) {
+        offset = 0;
+        return true;
+    }
+
+    const ring_entry& head = ring->entries.front();
+    const ring_entry& tail = ring->entries.back();
+    size_t            end = tail.offset + tail.size;
+
+    if ( tail.offset >= head.offset ) {
+        // not wrapped: space at the end, or else at the start
+        if ( ring->mem.size() - end >= size ) {
+            offset = end;
+            return true;
+        }
+        if ( head.offset >= size ) {
+            offset = 0;
+            return true;
+        }
+        return false;
+    }
+    if ( head.offset - end >= size ) {
+        offset = end;
+        return true;
+    }
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" packet_ring*  packet_ring_create    (size_t budgetBytes,
+                                                fn_stream_log logCb)
+{
+    packet_ring* res = new packet_ring;
+    res->refs = 1;
+    res->mem.resize(budgetBytes);
+    res->nextSeq = 0;
+    res->bytes = 0;
+    res->gopsEvicted = 0;
+    res->packetsRejected = 0;
+    res->logCb = logCb;
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     packet_ring_ref            (packet_ring* ring)
+{
+    ring->refs++;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     packet_ring_unref          (packet_ring** ring)
+{
+    if ( ring && *ring ) {
+        if ( --(*ring)->refs == 0 ) {
+            delete *ring;
+        }
+        *ring = NULL;
+    }
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      packet_ring_append         (packet_ring* ring,
+                                                frame_obj* frame)
+{
+    frame_api_t* api = frame_get_api(frame);
+    ring_entry   e;
+
+    e.mediaType = api->get_media_type(frame);
+    e.size = api->get_data_size(frame);
+    if ( (e.mediaType != mediaVideo && e.mediaType != mediaAudio) || e.size == 0 ) {
+        return -1;
+    }
+    e.keyframe = api->get_keyframe_flag(frame) > 0;
+    e.pts = api->get_pts(frame);
+    e.dts = api->get_dts(frame);
+
+    std::lock_guard<std::mutex> guard(ring->mutex);
+
+    if ( ring->entries.empty() && !_ring_is_keyframe(e) ) {
+        // nothing before the first keyframe is of any use
+        return -1;
+    }
+    if ( e.size > ring->mem.size()/2 ) {
+        if ( ring->packetsRejected++ == 0 ) {
+            ring->logCb(logWarning, _FMT("Packet of " << e.size << " bytes doesn't fit into the ring of " <<
+                                    ring->mem.size() << " bytes"));
+        }
+        return -1;
+    }
+
+    while ( !_ring_find_space(ring, e.size, e.offset) ) {
+        _ring_evict_gop(ring);
+        if ( ring->entries.empty() && !_ring_is_keyframe(e) ) {
+            // this GOP was larger than the whole ring; start over at the next one
+            return -1;
+        }
+    }
+
+    memcpy(&ring->mem[e.offset], api->get_data(frame), e.size);
+    e.seq = ring->nextSeq++;
+    ring->entries.push_back(e);
+    ring->bytes += e.size;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" INT64_T  packet_ring_get_last_pts   (packet_ring* ring)
+{
+    std::lock_guard<std::mutex> guard(ring->mutex);
+    return ring->entries.empty() ? INVALID_PTS : ring->entries.back().pts;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     packet_ring_get_stats      (packet_ring* ring,
+                                                size_t* bytes,
+                                                size_t* packets,
+                                                INT64_T* firstPts,
+                                                INT64_T* lastPts)
+{
+    std::lock_guard<std::mutex> guard(ring->mutex);
+    *bytes = ring->bytes;
+    *packets = ring->entries.size();
+    *firstPts = ring->entries.empty() ? INVALID_PTS : ring->entries.front().pts;
+    *lastPts = ring->entries.empty() ? INVALID_PTS : ring->entries.back().pts;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" packet_ring_cursor* packet_ring_cursor_create(packet_ring* ring,
+                                                INT64_T pts)
+{
+    packet_ring_cursor* res = new packet_ring_cursor;
+    packet_ring_ref(ring);
+    res->ring = ring;
+    res->packetsSkipped = 0;
+
+    std::lock_guard<std::mutex> guard(ring->mutex);
+    res->nextSeq = ring->entries.empty() ? ring->nextSeq : ring->entries.front().seq;
+    for (const ring_entry& e : ring->entries) {
+        if ( e.pts > pts ) {
+            break;
+        }
+        if ( _ring_is_keyframe(e) ) {
+            res->nextSeq = e.seq;
+        }
+    }
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" int      packet_ring_cursor_read    (packet_ring_cursor* cursor,
+                                                frame_obj** frame)
+{
+    packet_ring* ring = cursor->ring;
+    *frame = NULL;
+
+    std::lock_guard<std::mutex> guard(ring->mutex);
+    if ( cursor->nextSeq >= ring->nextSeq || ring->entries.empty() ) {
+        return -1;
+    }
+
+    uint64_t firstSeq = ring->entries.front().seq;
+    if ( cursor->nextSeq < firstSeq ) {
+        cursor->packetsSkipped += (int)(firstSeq - cursor->nextSeq);
+        cursor->nextSeq = firstSeq;
+    }
+
+    const ring_entry& e = ring->entries[cursor->nextSeq - firstSeq];
+    basic_frame_obj*  res = alloc_basic_frame(PACKETRING_FILTER_MAGIC, e.size, ring->logCb);
+    if ( res == NULL ) {
+        return -1;
+    }
+    memcpy(res->data, &ring->mem[e.offset], e.size);
+    res->dataSize = e.size;
+    res->pts = e.pts;
+    res->dts = e.dts;
+    res->mediaType = e.mediaType;
+    res->keyframe = e.keyframe;
+    cursor->nextSeq++;
+
+    *frame = (frame_obj*)res;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+extern "C" void     packet_ring_cursor_destroy (packet_ring_cursor** cursor)
+{
+    if ( cursor && *cursor ) {
+        if ( (*cursor)->packetsSkipped > 0 ) {
+            (*cursor)->ring->logCb(logDebug, _FMT("Ring cursor fell behind by " <<
+                                    (*cursor)->packetsSkipped << " packets"));
+        }
+        packet_ring_unref(&(*cursor)->ring);
+        delete *cursor;
+        *cursor = NULL;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// The node: passes packets through, keeping a copy of each in the ring
+//-----------------------------------------------------------------------------
+
+typedef struct packetring_filter  : public stream_base  {
+    int                     budgetKb;
+    packet_ring*            ring;
+} packetring_filter_obj;
+
+//-----------------------------------------------------------------------------
+//  Forward declarations
+//-----------------------------------------------------------------------------
+static stream_obj* packetring_filter_create            (const char* name);
+static int         packetring_filter_set_param         (stream_obj* stream,
+                                                const CHAR_T* name,
+                                                const void* value);
+static int         packetring_filter_get_param         (stream_obj* stream,
+                                                const CHAR_T* name,
+                                                void* value,
+                                                size_t* size);
+static int         packetring_filter_read_frame        (stream_obj* stream, frame_obj** frame);
+static int         packetring_filter_close             (stream_obj* stream);
+static void        packetring_filter_destroy           (stream_obj* stream);
+
+
+//-----------------------------------------------------------------------------
+stream_api_t _g_packetring_filter_provider = {
+    packetring_filter_create,
+    get_default_stream_api()->set_source,
+    get_default_stream_api()->set_log_cb,
+    get_default_stream_api()->get_name,
+    get_default_stream_api()->find_element,
+    get_default_stream_api()->remove_element,
+    get_default_stream_api()->insert_element,
+    packetring_filter_set_param,
+    packetring_filter_get_param,
+    get_default_stream_api()->open_in,
+    get_default_stream_api()->seek,
+    get_default_stream_api()->get_width,
+    get_default_stream_api()->get_height,
+    get_default_stream_api()->get_pixel_format,
+    packetring_filter_read_frame,
+    get_default_stream_api()->print_pipeline,
+    packetring_filter_close,
+    _set_module_trace_level
+};
+
+
+//-----------------------------------------------------------------------------
+#define DECLARE_PACKETRING_FILTER(stream, name) \
+    DECLARE_OBJ(packetring_filter_obj, name,  stream, PACKETRING_FILTER_MAGIC, -1)
+
+#define DECLARE_PACKETRING_FILTER_V(stream, name) \
+    DECLARE_OBJ_V(packetring_filter_obj, name,  stream, PACKETRING_FILTER_MAGIC)
+
+static stream_obj*   packetring_filter_create               (const char* name)
+{
+    packetring_filter_obj* res = (packetring_filter_obj*)stream_init(sizeof(packetring_filter_obj),
+                PACKETRING_FILTER_MAGIC,
+                &_g_packetring_filter_provider,
+                name,
+                packetring_filter_destroy );
+    res->budgetKb = kDefaultBudgetKb;
+    res->ring = NULL;
+    return (stream_obj*)res;
+}
+
+//-----------------------------------------------------------------------------
+// Ring is created once someone asks for it, or the first packet comes in,
+// whichever happens first; budget can't be changed after that.
+static packet_ring*  _packetring_get_ring       (packetring_filter_obj* pr)
+{
+    if ( pr->ring == NULL ) {
+        pr->ring = packet_ring_create((size_t)pr->budgetKb*1024, pr->logCb);
+        TRACE(_FMT("Created packet ring of " << pr->budgetKb << "KB"));
+    }
+    return pr->ring;
+}
+
+//-----------------------------------------------------------------------------
+static int         packetring_filter_set_param          (stream_obj* stream,
+                                            const CHAR_T* name,
+                                            const void* value)
+{
+    DECLARE_PACKETRING_FILTER(stream, pr);
+    name = stream_param_name_apply_scope(stream, name);
+    SET_PARAM_IF(stream, name, "budgetKb", int, pr->budgetKb);
+    return default_set_param(stream, name, value);
+}
+
+//-----------------------------------------------------------------------------
+static int         packetring_filter_get_param          (stream_obj* stream,
+                                            const CHAR_T* name,
+                                            void* value,
+                                            size_t* size)
+{
+    DECLARE_PACKETRING_FILTER(stream, pr);
+    name = stream_param_name_apply_scope(stream, name);
+    COPY_PARAM_IF(pr, name, "ring", packet_ring*, _packetring_get_ring(pr));
+    if ( pr->ring != NULL && !_strnicmp(name, "ring", 4) ) {
+        size_t  bytes, packets;
+        INT64_T firstPts, lastPts;
+        packet_ring_get_stats(pr->ring, &bytes, &packets, &firstPts, &lastPts);
+        COPY_PARAM_IF(pr, name, "ringBytes", INT64_T, (INT64_T)bytes);
+        COPY_PARAM_IF(pr, name, "ringPackets", int, (int)packets);
+        COPY_PARAM_IF(pr, name, "ringDurationMs", INT64_T, packets ? lastPts - firstPts : 0);
+    }
+    return default_get_param(stream, name, value, size);
+}
+
+//-----------------------------------------------------------------------------
+static int         packetring_filter_read_frame        (stream_obj* stream, frame_obj** frame)
+{
+    DECLARE_PACKETRING_FILTER(stream, pr);
+    int res = default_read_frame(stream, frame);
+    if ( res >= 0 && *frame != NULL ) {
+        packet_ring_append(_packetring_get_ring(pr), *frame);
+    }
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+static int         packetring_filter_close             (stream_obj* stream)
+{
+    DECLARE_PACKETRING_FILTER(stream, pr);
+    if ( pr->ring != NULL ) {
+        TRACE(_FMT("Closing packet ring: gopsEvicted=" << pr->ring->gopsEvicted <<
+                    " packetsRejected=" << pr->ring->packetsRejected));
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void packetring_filter_destroy         (stream_obj* stream)
+{
+    DECLARE_PACKETRING_FILTER_V(stream, pr);
+    pr->logCb(logTrace, _FMT("Destroying stream object " << (void*)stream));
+    packetring_filter_close(stream); // make sure all the internals had been freed
+    // consumers may still hold on to it
+    packet_ring_unref(&pr->ring);
+    stream_destroy( stream );
+}
+
+//-----------------------------------------------------------------------------
+SVVIDEOLIB_API stream_api_t*     get_packet_ring_api                   ()
+{
+    return &_g_packetring_filter_provider;
+}
@@ -43,10 +43,29 @@
 #include "sv_pixfmt.h"
 
 #include "videolibUtils.h"
+#include "sv_internal.h"
 
 #include <algorithm>
 #include <list>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PIXELATE_SSE2 1
+#include <emmintrin.h>
+#if SV_MULTI_ISA
+// built regardless of the compiler's target, and only run where supported
+#define PIXELATE_AVX2 1
+#include <immintrin.h>
+#if defined(__GNUC__)
+#define PIXELATE_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define PIXELATE_TARGET_AVX2
+#endif
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PIXELATE_NEON 1
+#include <arm_neon.h>
+#endif
+
 #define FF_FILTER_MAGIC 0x1250
 static bool _gInitialized = false;
 
@@ -56,6 +75,18 @@ using namespace std;
 
 extern "C" stream_api_t*     get_resize_filter_api                    ();
 
+// boxes are applied to this many rows of the frame at a time
+static const int kBandHeight = 16;
+
+// How pixels are laid out. Planar frames are drawn on as they are: luma, and
+// either two chroma planes or interleaved chroma, each at half the resolution
+// both ways, all tightly packed.
+enum {
+    pixLayoutPacked = 0,
+    pixLayoutPlanar,        // YUV420P
+    pixLayoutSemiPlanar     // NV12
+};
+
 //-----------------------------------------------------------------------------
 typedef struct fs_filter ff_filter_obj;
 
@@ -64,6 +95,14 @@ typedef void       (*replace_pixel_proc)   (ff_filter_obj* fffilter,
                                                 uint8_t* dst,
                                                 int x,
                                                 int y);
+// Processes the whole [left,right)x[top,bottom) area at once
+typedef void       (*replace_rect_proc)    (ff_filter_obj* fffilter,
+                                                uint8_t* src,
+                                                uint8_t* dst,
+                                                int left,
+                                                int top,
+                                                int right,
+                                                int bottom);
 
 //-----------------------------------------------------------------------------
 typedef struct fs_filter  : public ff_filter_base_obj  {
@@ -71,15 +110,25 @@ typedef struct fs_filter  : public ff_filter_base_obj  {
     int                 height;
     int                 pixfmt;
 
-    int                 pixsize;
+    int                 pixsize;        // of luma, with planar layouts
+    int                 layout;
+    int                 fullRange;
+    uint8_t             white[3];       // in the frame's colorspace
     int                 radius;
     int                 thickness;
     replace_pixel_proc  replace_proc;
+    replace_rect_proc   rect_proc;      // NULL if replace_proc has to be called per pixel
     const char*         filterType;
     box_t*              currentBox;
     int                 modifyInPlace;
+    int                 sharingDisabled;    // told the resize we draw on not to share its output
     int                 markCenter;
 
+    // boxes of the current frame, scaled to its size; reused between frames
+    BoxList*                drawBoxes;
+    std::vector<box_span>*  drawSpans;
+    box_row_index*          rowIndex;
+
     frame_allocator*    fa;
 } ff_filter_obj;
 
@@ -149,13 +198,23 @@ static stream_obj*   ff_filter_create                (const char* name)
     _ff_filter_init(res);
 
     res->pixsize = 3;
+    res->layout = pixLayoutPacked;
+    res->fullRange = 0;
+    memset(res->white, 255, sizeof(res->white));
     res->radius = 30;
     res->thickness = 1;
     res->replace_proc = _sv_pixelate_replace_pixel_box;
+    res->rect_proc = NULL;
     res->filterType = "boundingbox";
     res->currentBox = NULL;
     res->modifyInPlace = 0;
+    res->sharingDisabled = 0;
     res->markCenter = 0;
+    res->drawBoxes = new BoxList;
+    res->drawSpans = new std::vector<box_span>;
+    res->rowIndex = new box_row_index;
+    res->rowIndex->bandHeight = kBandHeight;
+    res->rowIndex->bandCount = 0;
 
     res->fa = create_frame_allocator(_STR("fffilter_"<<name));
 
@@ -170,6 +229,77 @@ static uint8_t*   _sv_pixelate_get_pixel(ff_filter_obj* s,
     return &buf[(y*s->width+x)*s->pixsize];
 }
 
+//-----------------------------------------------------------------------------
+static int        _sv_pixelate_get_layout(int pixfmt)
+{
+    switch (pixfmt) {
+    case pfmtYUV420P:
+    case pfmtYUVJ420P:  return pixLayoutPlanar;
+    case pfmtNV12:      return pixLayoutSemiPlanar;
+    default:            return pixLayoutPacked;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// comp is 0 for U and 1 for V; cx and cy are in chroma samples
+static uint8_t*   _sv_pixelate_get_chroma(ff_filter_obj* s,
+                                                uint8_t* buf, int comp, int cx, int cy)
+{
+    int      cw = (s->width+1)/2;
+    uint8_t* base = &buf[s->width*s->height];
+    if ( s->layout == pixLayoutSemiPlanar ) {
+        return &base[(cy*cw+cx)*2+comp];
+    }
+    return &base[comp*cw*((s->height+1)/2) + cy*cw+cx];
+}
+
+//-----------------------------------------------------------------------------
+static size_t     _sv_pixelate_get_frame_size(ff_filter_obj* s)
+{
+    size_t size = (size_t)s->width*s->height*s->pixsize;
+    if ( s->layout != pixLayoutPacked ) {
+        size += (size_t)2*((s->width+1)/2)*((s->height+1)/2);
+    }
+    return size;
+}
+
+//-----------------------------------------------------------------------------
+// BT.601, which is what our decoders and encoders assume
+static void       _sv_pixelate_rgb_to_yuv(int fullRange,
+                                                const uint8_t* rgb, uint8_t* yuv)
+{
+    int r = rgb[0], g = rgb[1], b = rgb[2];
+    int y, u, v;
+    if ( fullRange ) {
+        y = (77*r + 150*g + 29*b + 128) >> 8;
+        u = ((-43*r - 85*g + 128*b + 128) >> 8) + 128;
+        v = ((128*r - 107*g - 21*b + 128) >> 8) + 128;
+    } else {
+        y = ((66*r + 129*g + 25*b + 128) >> 8) + 16;
+        u = ((-38*r - 74*g + 112*b + 128) >> 8) + 128;
+        v = ((112*r - 94*g - 18*b + 128) >> 8) + 128;
+    }
+    yuv[0] = (uint8_t)std::min(std::max(y, 0), 255);
+    yuv[1] = (uint8_t)std::min(std::max(u, 0), 255);
+    yuv[2] = (uint8_t)std::min(std::max(v, 0), 255);
+}
+
+//-----------------------------------------------------------------------------
+static void       _sv_pixelate_set_layout(ff_filter_obj* s, int pixfmt)
+{
+    static const uint8_t white[] = { 255, 255, 255 };
+
+    s->layout = _sv_pixelate_get_layout(pixfmt);
+    s->fullRange = ( pixfmt == pfmtYUVJ420P );
+    if ( s->layout == pixLayoutPacked ) {
+        s->pixsize = 3;
+        memcpy(s->white, white, sizeof(white));
+    } else {
+        s->pixsize = 1;
+        _sv_pixelate_rgb_to_yuv(s->fullRange, white, s->white);
+    }
+}
+
 //-----------------------------------------------------------------------------
 static void       _sv_pixelate_replace_pixel_blur  (ff_filter_obj* s,
                         uint8_t* src, uint8_t* dst, int x, int y)
@@ -217,11 +347,19 @@ static void       _sv_pixelate_replace_pixel_blur  (ff_filter_obj* s,
 }
 
 //-----------------------------------------------------------------------------
+// color is in the frame's colorspace
 static void       _sv_pixelate_replace_pixel_color (ff_filter_obj* s,
                         uint8_t* src, uint8_t* dst, int x, int y, uint8_t* color)
 {
     uint8_t* dstPix = _sv_pixelate_get_pixel(s,dst,x,y);
 
+    if ( s->layout != pixLayoutPacked ) {
+        dstPix[0] = color[0];
+        *_sv_pixelate_get_chroma(s, dst, 0, x/2, y/2) = color[1];
+        *_sv_pixelate_get_chroma(s, dst, 1, x/2, y/2) = color[2];
+        return;
+    }
+
     dstPix[0] = color[0];
     dstPix[1] = color[1];
     dstPix[2] = color[2];
@@ -279,10 +417,9 @@ static void       _sv_pixelate_replace_pixel_box  (ff_filter_obj* s,
         int centerX = r->x + r->w/2;
         int centerY = r->y + r->h/2;
         static const int centerMarkSize = 4;
-        static uint8_t white[] = { 255, 255, 255 };
         if ( ( x == centerX && abs(y-centerY) < centerMarkSize ) ||
              ( y == centerY && abs(x-centerX) < centerMarkSize ) ) {
-            _sv_pixelate_replace_pixel_color(s, src, dst, x, y, white);
+            _sv_pixelate_replace_pixel_color(s, src, dst, x, y, s->white);
         }
     }
 }
@@ -308,6 +445,338 @@ static void       _sv_pixelate_replace_pixel_pixelate  (ff_filter_obj* s,
             s->pixsize );
 }
 
+//-----------------------------------------------------------------------------
+// Block-wise kernels. Writing a run of identical pixels is done with vector
+// stores of a 48-byte pattern (a multiple of both 3- and 4-byte pixels), picked
+// once through sv_cpu_select_kernel; further rows of a block are copies of the
+// first one. The pattern is built twice over, so that AVX2 can store 96 bytes
+// at a time and any kernel can finish with a single memcpy.
+static const int    kPatternSize = 48;
+
+typedef void (*pixelate_fill_fn)(uint8_t* dst, const uint8_t* pattern, size_t total);
+
+#if PIXELATE_AVX2
+//-----------------------------------------------------------------------------
+PIXELATE_TARGET_AVX2
+static void       _sv_pixelate_fill_avx2   (uint8_t* dst,
+                        const uint8_t* pattern, size_t total)
+{
+    __m256i p0 = _mm256_loadu_si256((const __m256i*)&pattern[0]);
+    __m256i p1 = _mm256_loadu_si256((const __m256i*)&pattern[32]);
+    __m256i p2 = _mm256_loadu_si256((const __m256i*)&pattern[64]);
+    for ( ; total >= 2*kPatternSize; total -= 2*kPatternSize, dst += 2*kPatternSize ) {
+        _mm256_storeu_si256((__m256i*)&dst[0], p0);
+        _mm256_storeu_si256((__m256i*)&dst[32], p1);
+        _mm256_storeu_si256((__m256i*)&dst[64], p2);
+    }
+    memcpy(dst, pattern, total);
+}
+#endif
+
+#if PIXELATE_SSE2
+//-----------------------------------------------------------------------------
+static void       _sv_pixelate_fill_sse2   (uint8_t* dst,
+                        const uint8_t* pattern, size_t total)
+{
+    __m128i p0 = _mm_loadu_si128((const __m128i*)&pattern[0]);
+    __m128i p1 = _mm_loadu_si128((const __m128i*)&pattern[16]);
+    __m128i p2 = _mm_loadu_si128((const __m128i*)&pattern[32]);
+    for ( ; total >= kPatternSize; total -= kPatternSize, dst += kPatternSize ) {
+        _mm_storeu_si128((__m128i*)&dst[0], p0);
+        _mm_storeu_si128((__m128i*)&dst[16], p1);
+        _mm_storeu_si128((__m128i*)&dst[32], p2);
+    }
+    memcpy(dst, pattern, total);
+}
+#elif PIXELATE_NEON
+//-----------------------------------------------------------------------------
+static void       _sv_pixelate_fill_neon   (uint8_t* dst,
+                        const uint8_t* pattern, size_t total)
+{
+    uint8x16_t p0 = vld1q_u8(&pattern[0]);
+    uint8x16_t p1 = vld1q_u8(&pattern[16]);
+    uint8x16_t p2 = vld1q_u8(&pattern[32]);
+    for ( ; total >= kPatternSize; total -= kPatternSize, dst += kPatternSize ) {
+        vst1q_u8(&dst[0], p0);
+        vst1q_u8(&dst[16], p1);
+        vst1q_u8(&dst[32], p2);
+    }
+    memcpy(dst, pattern, total);
+}
+#endif
+
+//-----------------------------------------------------------------------------
+static void       _sv_pixelate_fill_c      (uint8_t* dst,
+                        const uint8_t* pattern, size_t total)
+{
+    for ( ; total >= kPatternSize; total -= kPatternSize, dst += kPatternSize ) {
+        memcpy(dst, pattern, kPatternSize);
+    }
+    memcpy(dst, pattern, total);
+}
+
+static const sv_cpu_kernel _kPixelateFillKernels[] = {
+#if PIXELATE_AVX2
+    { "avx2",   SV_CPU_AVX2,    (void*)_sv_pixelate_fill_avx2 },
+#endif
+#if PIXELATE_SSE2
+    { "sse2",   SV_CPU_SSE2,    (void*)_sv_pixelate_fill_sse2 },
+#elif PIXELATE_NEON
+    { "neon",   SV_CPU_NEON,    (void*)_sv_pixelate_fill_neon },
+#endif
+    { "c",      0,              (void*)_sv_pixelate_fill_c },
+};
+
+//-----------------------------------------------------------------------------
+static void       _sv_pixelate_fill_span   (uint8_t* dst,
+                        const uint8_t* pix, int pixsize, int count)
+{
+    static const pixelate_fill_fn fill = (pixelate_fill_fn)sv_cpu_select_kernel("pixelate_fill",
+                    _kPixelateFillKernels, sizeof(_kPixelateFillKernels)/sizeof(_kPixelateFillKernels[0]));
+    uint8_t pattern[2*kPatternSize];
+
+    for (int nI=0; nI<2*kPatternSize; nI++) {
+        pattern[nI] = pix[nI%pixsize];
+    }
+    fill(dst, pattern, (size_t)count*pixsize);
+}
+
+//-----------------------------------------------------------------------------
+// pix is Y, U and V; chroma samples the block touches at all are filled
+static void       _sv_pixelate_fill_block_yuv  (ff_filter_obj* s,
+                        uint8_t* dst, const uint8_t* pix,
+                        int left, int top, int right, int bottom)
+{
+    for (int y=top; y<bottom; y++) {
+        memset(_sv_pixelate_get_pixel(s, dst, left, y), pix[0], right-left);
+    }
+
+    int cLeft = left/2, cRight = (right+1)/2;
+    int cTop = top/2, cBottom = (bottom+1)/2;
+    int count = cRight-cLeft;
+    if ( s->layout == pixLayoutSemiPlanar ) {
+        uint8_t* row0 = _sv_pixelate_get_chroma(s, dst, 0, cLeft, cTop);
+        _sv_pixelate_fill_span(row0, &pix[1], 2, count);
+        for (int cy=cTop+1; cy<cBottom; cy++) {
+            memcpy(_sv_pixelate_get_chroma(s, dst, 0, cLeft, cy), row0, count*2);
+        }
+    } else {
+        for (int cy=cTop; cy<cBottom; cy++) {
+            memset(_sv_pixelate_get_chroma(s, dst, 0, cLeft, cy), pix[1], count);
+            memset(_sv_pixelate_get_chroma(s, dst, 1, cLeft, cy), pix[2], count);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void       _sv_pixelate_fill_block  (ff_filter_obj* s,
+                        uint8_t* dst, const uint8_t* pix,
+                        int left, int top, int right, int bottom)
+{
+    if ( left >= right || top >= bottom ) {
+        return;
+    }
+    if ( s->layout != pixLayoutPacked ) {
+        _sv_pixelate_fill_block_yuv(s, dst, pix, left, top, right, bottom);
+        return;
+    }
+    int      count = right-left;
+    uint8_t* row0 = _sv_pixelate_get_pixel(s, dst, left, top);
+    _sv_pixelate_fill_span(row0, pix, s->pixsize, count);
+    for (int y=top+1; y<bottom; y++) {
+        memcpy(_sv_pixelate_get_pixel(s, dst, left, y), row0, count*s->pixsize);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Same as what _sv_pixelate_replace_pixel_color writes
+static void       _sv_pixelate_color_pixel (const uint8_t* color, uint8_t* pix)
+{
+    pix[0] = color[0];
+    pix[1] = color[1];
+    pix[2] = color[2];
+    pix[3] = 0;
+}
+
+//-----------------------------------------------------------------------------
+// The pixel at (x,y), as the kernels write it
+static void       _sv_pixelate_sample_pixel (ff_filter_obj* s,
+                        uint8_t* src, int x, int y, uint8_t* pix)
+{
+    const uint8_t* srcPix = _sv_pixelate_get_pixel(s, src, x, y);
+    if ( s->layout != pixLayoutPacked ) {
+        pix[0] = srcPix[0];
+        pix[1] = *_sv_pixelate_get_chroma(s, src, 0, x/2, y/2);
+        pix[2] = *_sv_pixelate_get_chroma(s, src, 1, x/2, y/2);
+    } else {
+        memcpy(pix, srcPix, s->pixsize);
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void       _sv_pixelate_replace_rect_pixelate  (ff_filter_obj* s,
+                        uint8_t* src, uint8_t* dst,
+                        int left, int top, int right, int bottom)
+{
+    using std::min;
+    using std::max;
+
+    int radius = s->radius;
+
+    // cells are aligned to the radius grid, and take the color of their
+    // center pixel (as in _sv_pixelate_replace_pixel_pixelate)
+    for (int cellTop = top - top%radius; cellTop < bottom; cellTop += radius) {
+        int cellBottom = min(cellTop+radius, s->height-1);
+        int y0 = max(cellTop, top);
+        int y1 = min(cellTop+radius, bottom);
+        for (int cellLeft = left - left%radius; cellLeft < right; cellLeft += radius) {
+            int cellRight = min(cellLeft+radius, s->width-1);
+            int x0 = max(cellLeft, left);
+            int x1 = min(cellLeft+radius, right);
+            uint8_t pix[4];
+            _sv_pixelate_sample_pixel(s, src,
+                                        (cellLeft+cellRight)/2,
+                                        (cellTop+cellBottom)/2,
+                                        pix);
+            _sv_pixelate_fill_block(s, dst, pix, x0, y0, x1, y1);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void       _sv_pixelate_replace_rect_fill  (ff_filter_obj* s,
+                        uint8_t* src, uint8_t* dst,
+                        int left, int top, int right, int bottom)
+{
+    uint8_t pix[4];
+    _sv_pixelate_color_pixel(s->currentBox->color, pix);
+    _sv_pixelate_fill_block(s, dst, pix, left, top, right, bottom);
+}
+
+//-----------------------------------------------------------------------------
+static void       _sv_pixelate_replace_rect_box  (ff_filter_obj* s,
+                        uint8_t* src, uint8_t* dst,
+                        int left, int top, int right, int bottom)
+{
+    using std::min;
+    using std::max;
+
+    box_t*  box = s->currentBox;
+    rect_t* r = &box->r;
+    int     thick = box->thickness;
+    uint8_t pix[4];
+
+    _sv_pixelate_color_pixel(box->color, pix);
+
+    // inner edges of the outline (as in _sv_pixelate_replace_pixel_box)
+    int innerLeft = r->x+thick;
+    int innerRight = r->x+r->w-thick;
+    int innerTop = r->y+thick;
+    int innerBottom = r->y+r->h-thick;
+
+    if ( innerLeft >= innerRight || innerTop >= innerBottom ) {
+        _sv_pixelate_fill_block(s, dst, pix, left, top, right, bottom);
+        return;
+    }
+
+    int midTop = max(top, innerTop);
+    int midBottom = min(bottom, innerBottom);
+    _sv_pixelate_fill_block(s, dst, pix, left, top, right, min(bottom, midTop));
+    _sv_pixelate_fill_block(s, dst, pix, left, max(top, midBottom), right, bottom);
+    _sv_pixelate_fill_block(s, dst, pix, left, midTop, min(right, innerLeft), midBottom);
+    _sv_pixelate_fill_block(s, dst, pix, max(left, innerRight), midTop, right, midBottom);
+
+    if ( s->markCenter ) {
+        int centerX = r->x + r->w/2;
+        int centerY = r->y + r->h/2;
+        static const int centerMarkSize = 4;
+        for (int d=-(centerMarkSize-1); d<centerMarkSize; d++) {
+            int x = centerX + d;
+            int y = centerY + d;
+            if ( centerX >= max(left, innerLeft) && centerX < min(right, innerRight) &&
+                 y >= midTop && y < midBottom ) {
+                _sv_pixelate_replace_pixel_color(s, src, dst, centerX, y, s->white);
+            }
+            if ( centerY >= midTop && centerY < midBottom &&
+                 x >= max(left, innerLeft) && x < min(right, innerRight) ) {
+                _sv_pixelate_replace_pixel_color(s, src, dst, x, centerY, s->white);
+            }
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Averages each sample of [left,right)x[top,bottom) of one plane over the
+// "crosshair" around it (as _sv_pixelate_replace_pixel_blur does)
+static void       _sv_pixelate_blur_plane  (const uint8_t* src, uint8_t* dst,
+                        int step, int stride, int width, int height, int radius,
+                        int left, int top, int right, int bottom)
+{
+    using std::min;
+    using std::max;
+
+    for (int y=top; y<bottom; y++) {
+        int topLimit = max(y-radius, 0),
+            bottomLimit = min(y+radius, height-1);
+        for (int x=left; x<right; x++) {
+            int leftLimit = max(x-radius, 0),
+                rightLimit = min(x+radius, width-1);
+            int sum = 0;
+            for (int otherX=leftLimit; otherX<=rightLimit; otherX++) {
+                sum += src[y*stride+otherX*step];
+            }
+            for (int otherY=topLimit; otherY<=bottomLimit; otherY++) {
+                sum += src[otherY*stride+x*step];
+            }
+            dst[y*stride+x*step] = sum/(rightLimit-leftLimit+bottomLimit-topLimit+2);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void       _sv_pixelate_replace_rect_blur_yuv  (ff_filter_obj* s,
+                        uint8_t* src, uint8_t* dst,
+                        int left, int top, int right, int bottom)
+{
+    int cw = (s->width+1)/2, ch = (s->height+1)/2;
+    int step = ( s->layout == pixLayoutSemiPlanar ) ? 2 : 1;
+
+    _sv_pixelate_blur_plane(src, dst, 1, s->width, s->width, s->height, s->radius,
+                            left, top, right, bottom);
+    for (int comp=0; comp<2; comp++) {
+        uint8_t* srcPlane = _sv_pixelate_get_chroma(s, src, comp, 0, 0);
+        uint8_t* dstPlane = _sv_pixelate_get_chroma(s, dst, comp, 0, 0);
+        _sv_pixelate_blur_plane(srcPlane, dstPlane, step, cw*step, cw, ch,
+                                std::max(s->radius/2, 1),
+                                left/2, top/2, (right+1)/2, (bottom+1)/2);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Block-wise kernels only handle packed 3- or 4-byte pixels, and planar YUV;
+// anything else (and packed blur, which depends on the neighbors) goes pixel
+// by pixel. Planar frames have no per-pixel path.
+static void       _sv_pixelate_select_kernel (ff_filter_obj* s)
+{
+    s->rect_proc = NULL;
+    if ( s->layout != pixLayoutPacked ) {
+        if ( s->replace_proc == _sv_pixelate_replace_pixel_blur ) {
+            s->rect_proc = _sv_pixelate_replace_rect_blur_yuv;
+            return;
+        }
+    } else
+    if ( s->pixsize != 3 && s->pixsize != 4 ) {
+        return;
+    }
+    if ( s->replace_proc == _sv_pixelate_replace_pixel_pixelate ) {
+        s->rect_proc = _sv_pixelate_replace_rect_pixelate;
+    } else if ( s->replace_proc == _sv_pixelate_replace_pixel_fill ) {
+        s->rect_proc = _sv_pixelate_replace_rect_fill;
+    } else if ( s->replace_proc == _sv_pixelate_replace_pixel_box ) {
+        s->rect_proc = _sv_pixelate_replace_rect_box;
+    }
+}
+
 //-----------------------------------------------------------------------------
 static int         ff_filter_set_param             (stream_obj* stream,
                                             const CHAR_T* name,
@@ -321,6 +790,7 @@ static int         ff_filter_set_param             (stream_obj* stream,
     }
     if (!_stricmp(name, "useBlur")) {
         fffilter->replace_proc = _sv_pixelate_replace_pixel_blur;
+        _sv_pixelate_select_kernel(fffilter);
         fffilter->filterType = "blur";
         // can't modify in place when depeneding on the neighbors
         fffilter->modifyInPlace = 0;
@@ -328,21 +798,25 @@ static int         ff_filter_set_param             (stream_obj* stream,
     }
     if (!_stricmp(name, "useFill")) {
         fffilter->replace_proc = _sv_pixelate_replace_pixel_fill;
+        _sv_pixelate_select_kernel(fffilter);
         fffilter->filterType = "fill";
         return 0;
     }
     if (!_stricmp(name, "useBox")) {
         fffilter->replace_proc = _sv_pixelate_replace_pixel_box;
+        _sv_pixelate_select_kernel(fffilter);
         fffilter->filterType = "boundingbox";
         return 0;
     }
     if (!_stricmp(name, "useLine")) {
         fffilter->replace_proc = NULL; // not used
+        fffilter->rect_proc = NULL;
         fffilter->filterType = "drawline";
         return 0;
     }
     if (!_stricmp(name, "usePixelate")) {
         fffilter->replace_proc = _sv_pixelate_replace_pixel_pixelate;
+        _sv_pixelate_select_kernel(fffilter);
         fffilter->filterType = "pixelate";
         // can't modify in place when depeneding on the neighbors
         fffilter->modifyInPlace = 0;
@@ -371,6 +845,20 @@ static int         ff_filter_set_param             (stream_obj* stream,
         TRACE(_FMT("Parsing current meta: got " << fffilter->currentMetadata.boxes->size() ));
         return 0;
     } else
+    if (!_stricmp(name, "boxes")) {
+        if ( !box_metadata_is_binary(value) ) {
+            fffilter->logCb(logError, _FMT("Invalid box metadata"));
+            return -1;
+        }
+        _ff_filter_parse_metadata( fffilter,
+                        fffilter->filterType,
+                        (const char*)value,
+                        INVALID_PTS,
+                        fffilter->currentMetadata);
+        fffilter->staticMetadata = true;
+        TRACE(_FMT("Loading current meta: got " << fffilter->currentMetadata.boxes->size() ));
+        return 0;
+    } else
     if (!_stricmp(name, "filterType")) {
         // ignore (for now, but maybe key off this for compatibility with fffilter)
         return 0;
@@ -393,7 +881,10 @@ Retry:
         fffilter->pixfmt = default_get_pixel_format(stream);
         fffilter->width = default_get_width(stream);
         fffilter->height = default_get_height(stream);
-        if ( fffilter->pixfmt != pfmtRGB24 && fffilter->pixfmt != pfmtBGR24 && retryCount == 0 )  {
+        // planar YUV is drawn on natively: exports go from the decoder to the
+        // encoder without a round trip through RGB
+        if ( fffilter->pixfmt != pfmtRGB24 && fffilter->pixfmt != pfmtBGR24 &&
+             _sv_pixelate_get_layout(fffilter->pixfmt) == pixLayoutPacked && retryCount == 0 )  {
             int pixfmt = pfmtRGB24;
             retryCount ++;
             if ( fffilter->sourceApi->insert_element(&fffilter->source,
@@ -414,6 +905,13 @@ Retry:
             // radius is percentage of the image height
             fffilter->radius = (fffilter->height*abs(fffilter->radius))/100;
         }
+        if (fffilter->radius == 0) {
+            fffilter->radius = 1;
+        }
+        _sv_pixelate_set_layout(fffilter, fffilter->pixfmt);
+        _sv_pixelate_select_kernel(fffilter);
+        TRACE(_FMT("Using " << (fffilter->rect_proc ? "block-wise" : "per-pixel") <<
+                    " kernel for " << fffilter->filterType << ", pixfmt=" << fffilter->pixfmt));
     }
     return res;
 }
@@ -446,6 +944,13 @@ static int         ff_filter_read_frame        (stream_obj* stream,
     uint8_t*   dst;
     uint8_t*   src;
 
+    if ( fffilter->modifyInPlace && !fffilter->sharingDisabled ) {
+        // other branches mustn't be handed the frames we draw on
+        int allow = 0;
+        default_set_param(stream, "allowSharedResults", &allow);
+        fffilter->sharingDisabled = 1;
+    }
+
     res = _ff_filter_read_frame( fffilter, fffilter->filterType, &tmp, &boxes );
     if ( res <= 0 ) {
         *frame = tmp;
@@ -470,6 +975,14 @@ static int         ff_filter_read_frame        (stream_obj* stream,
         fffilter->height = tmpFrameAPI->get_height(tmp);
     }
 
+    if ( srcSize < _sv_pixelate_get_frame_size(fffilter) ) {
+        fffilter->logCb(logWarning, _FMT("Frame of " << srcSize << " bytes is too small for " <<
+                                        fffilter->width << "x" << fffilter->height <<
+                                        " pixfmt=" << fffilter->pixfmt));
+        *frame = tmp;
+        return res;
+    }
+
 
     src = (uint8_t*)tmpFrameAPI->get_data(tmp);
     if ( !fffilter->modifyInPlace ) {
@@ -499,12 +1012,23 @@ static int         ff_filter_read_frame        (stream_obj* stream,
     int         boxesAreLines = !_stricmp(fffilter->filterType, "drawline");
 
 
+    BoxList&               drawBoxes = *fffilter->drawBoxes;
+    std::vector<box_span>& spans = *fffilter->drawSpans;
+    size_t                 count = 0;
+
+    drawBoxes.resize(boxes->size());
+    spans.resize(boxes->size());
+
     for (BoxListIter it = boxes->begin();
                   it != boxes->end();
-                  it++) {
-        box_t   box;
+                  it++, count++) {
+        box_t&  box = drawBoxes[count];
 
         _ff_rescale_box( *it, box, w, h );
+        if ( fffilter->layout != pixLayoutPacked ) {
+            // once per box, rather than per pixel drawn
+            _sv_pixelate_rgb_to_yuv(fffilter->fullRange, box.color, box.color);
+        }
 
         left = max(box.r.x,0);
         top = max(box.r.y,0);
@@ -527,15 +1051,50 @@ static int         ff_filter_read_frame        (stream_obj* stream,
             bottom=h-1;
         }
 
-        fffilter->currentBox = &box;
-
         if ( boxesAreLines ) {
             rect_t& r = box.r;
+            fffilter->currentBox = &box;
             _sv_draw_line( fffilter, src, dst, box.color, r.x, r.y, r.w, r.h );
-        } else {
-            for (int x=left; x<right; x++) {
-                for (int y=top; y<bottom; y++ ) {
-                    fffilter->replace_proc(fffilter, src, dst, x, y);
+            left = right = top = bottom = 0;
+        }
+
+        box_span& span = spans[count];
+        span.left = left;
+        span.top = top;
+        span.right = right;
+        span.bottom = bottom;
+    }
+
+    if ( !boxesAreLines ) {
+        // Go over the frame a band at a time rather than a box at a time, to
+        // only bring each row into cache once with many boxes in the frame.
+        // The results are the same: every pixel is processed by the same
+        // boxes, in the same order, and they only ever read from src.
+        box_row_index& index = *fffilter->rowIndex;
+        _box_row_index_build(index, spans, h);
+
+        for (int band=0; band<index.bandCount; band++) {
+            int bandTop = band*index.bandHeight;
+            int bandBottom = min(bandTop+index.bandHeight, h);
+            for (int nI=index.bandStart[band]; nI<index.bandStart[band+1]; nI++) {
+                int             boxIndex = index.boxes[nI];
+                const box_span& span = spans[boxIndex];
+
+                left = span.left;
+                right = span.right;
+                top = max(span.top, bandTop);
+                bottom = min(span.bottom, bandBottom);
+
+                fffilter->currentBox = &drawBoxes[boxIndex];
+
+                if ( fffilter->rect_proc ) {
+                    fffilter->rect_proc(fffilter, src, dst, left, top, right, bottom);
+                } else {
+                    for (int x=left; x<right; x++) {
+                        for (int y=top; y<bottom; y++ ) {
+                            fffilter->replace_proc(fffilter, src, dst, x, y);
+                        }
+                    }
                 }
             }
         }
@@ -564,6 +1123,7 @@ static int         ff_filter_close             (stream_obj* stream)
 {
     DECLARE_FF_FILTER(stream, fffilter);
     _ff_filter_clear(fffilter);
+    fffilter->sharingDisabled = 0;
     return 0;
 }
 
@@ -574,6 +1134,9 @@ static void ff_filter_destroy         (stream_obj* stream)
     DECLARE_FF_FILTER_V(stream, fffilter);
     fffilter->logCb(logTrace, _FMT("Destroying stream object " << (void*)stream));
     _ff_filter_destroy(fffilter);
+    delete fffilter->drawBoxes;
+    delete fffilter->drawSpans;
+    delete fffilter->rowIndex;
     destroy_frame_allocator( &fffilter->fa, fffilter->logCb );
     stream_destroy( stream );
 }
@@ -39,11 +39,13 @@
 #include "sv_module_def.hpp"
 
 #include "streamprv.h"
+#include "sv_internal.h"
 
 #include <list>
 #include <string>
 
 #include "videolibUtils.h"
+#include "event_basic.h"
 
 #define RS_RECSYNC_MAGIC 0x1371
 #define MAX_PARAM 10
@@ -64,6 +66,7 @@ typedef struct recorder_sync_stream  : public stream_base  {
     int                     encoderDelay;
     INT64_T                 lastPtsInQueue;
     list<file_context>*     fileContexts;
+    int                     fileGeneration;     // bumped whenever "filename" changes
     FrameList*              frames;
     sv_mutex*               mutex;
 } recorder_sync_stream_obj;
@@ -148,14 +151,24 @@ static void        _rs_new_file                 (recorder_sync_stream_obj* rs, s
 
     char buffer[1024];
     size_t bufferSize = 1024;
+    int res;
 
-    if (api->get_property(ev, "filename", buffer, &bufferSize) >= 0) {
+    static const int filenameKey = basic_event_property_key("filename");
+    if ( filenameKey >= 0 && api == get_basic_event_api() ) {
+        res = basic_event_get_property_by_key(ev, filenameKey, buffer, &bufferSize);
+    } else {
+        res = api->get_property(ev, "filename", buffer, &bufferSize);
+    }
+    if (res >= 0) {
         if (!rs->fileContexts->empty() && rs->fileContexts->back().name == buffer) {
             rs->logCb(logWarning, _FMT("Multiple new file notifications for " << buffer));
         } else {
             fc.start = api->get_ts(ev);
             fc.end = (uint64_t)-1;
             fc.name = buffer;
+            if ( rs->fileContexts->empty() ) {
+                rs->fileGeneration++;
+            }
             rs->fileContexts->push_back(fc);
             TRACE(_FMT( "Set next file to " << buffer << " starting from " << fc.start));
         }
@@ -197,6 +210,7 @@ static stream_obj*   rs_stream_create                (const char* name)
     res->encoderDelay = -1;
     res->lastPtsInQueue = INVALID_PTS;
     res->fileContexts = new list<file_context>;
+    res->fileGeneration = 0;
     res->frames = frame_list_create();
     res->mutex = sv_mutex_create();
 
@@ -224,6 +238,7 @@ static int         rs_stream_get_param             (stream_obj* stream,
     DECLARE_STREAM_RS(stream, rs);
     name = stream_param_name_apply_scope(stream, name);
     COPY_PARAM_IF_SAFE(rs, name, "filename", const char*, rs->fileContexts->empty()?NULL:rs->fileContexts->front().name.c_str(), rs->mutex);
+    COPY_PARAM_IF_SAFE(rs, name, "fileGeneration", int, rs->fileGeneration, rs->mutex);
     return default_get_param(stream, name, value, size);
 }
 
@@ -285,6 +300,7 @@ static int       _rs_stream_get_frame_from_queue(recorder_sync_stream_obj* rs,
             // (and retry with the same frame)
             TRACE(_FMT("Frame pts=" << pts << " is outside of the range of [" << currentFileContext->start << "," << currentFileContext->end << "]"));
             rs->fileContexts->pop_front();
+            rs->fileGeneration++;
             f = NULL;
         } else if ( pts + rs->encoderDelay < rs->lastPtsInQueue ) {
             TRACE(_FMT("Returning frame pts=" << pts << " from frame queue" << " q=" << rs->frames->size() ));
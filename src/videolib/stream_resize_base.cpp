@@ -35,6 +35,137 @@
 
 #include "streamprv.h"
 #include "videolibUtils.h"
+#include "frame_trace.h"
+
+#include <chrono>
+#include <list>
+#include <mutex>
+
+//-----------------------------------------------------------------------------
+// Recently produced resize outputs, shared by the resize filters of one
+// pipeline (the graph the frames come from, as splitter gates are scoped).
+// Splitter hands the same frame object to every branch, so a source frame is
+// identified by its address and pts; the entry keeps a reference to it, so
+// that the address can't be reused by another frame while it's listed.
+typedef struct resize_shared_result {
+    const void*         pipeline;
+    frame_obj*          source;
+    INT64_T             sourcePts;
+    size_t              width;
+    size_t              height;
+    int                 pixfmt;
+    int                 colorSpace;
+    int                 colorRange;
+    int                 retainSourceFrameInterval;
+    frame_obj*          result;
+    int64_t             time;
+} resize_shared_result;
+
+static const size_t     kMaxSharedResults = 8;
+static const int        kMaxSharedResultAgeMs = 1000;
+
+static std::mutex                           _gSharedResultsMutex;
+static std::list<resize_shared_result>      _gSharedResults;
+
+//-----------------------------------------------------------------------------
+static bool _resize_base_result_matches(const resize_shared_result& e,
+                                        const resize_base_obj* r,
+                                        const frame_obj* src,
+                                        INT64_T pts)
+{
+    return e.pipeline == r->pipeline &&
+           e.source == src &&
+           e.sourcePts == pts &&
+           e.width == r->dimActual.width &&
+           e.height == r->dimActual.height &&
+           e.pixfmt == r->pixfmt &&
+           e.colorSpace == r->colorSpace &&
+           e.colorRange == r->colorRange &&
+           e.retainSourceFrameInterval == r->retainSourceFrameInterval;
+}
+
+//-----------------------------------------------------------------------------
+// Called with the mutex held
+static void _resize_base_expire_results(int64_t now)
+{
+    while ( !_gSharedResults.empty() &&
+            ( _gSharedResults.size() > kMaxSharedResults ||
+              now - _gSharedResults.back().time > kMaxSharedResultAgeMs ) ) {
+        frame_unref(&_gSharedResults.back().result);
+        frame_unref(&_gSharedResults.back().source);
+        _gSharedResults.pop_back();
+    }
+}
+
+//-----------------------------------------------------------------------------
+static frame_obj* _resize_base_find_result(resize_base_obj* r,
+                                           frame_obj* src)
+{
+    INT64_T     pts = frame_get_api(src)->get_pts(src);
+    frame_obj*  res = NULL;
+
+    std::lock_guard<std::mutex> guard(_gSharedResultsMutex);
+    _resize_base_expire_results(sv_time_get_current_epoch_time());
+    for (std::list<resize_shared_result>::iterator it = _gSharedResults.begin(); it != _gSharedResults.end(); it++) {
+        if ( _resize_base_result_matches(*it, r, src, pts) ) {
+            res = it->result;
+            frame_ref(res);
+            break;
+        }
+    }
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+INT64_T     resize_base_get_time_us    ()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//-----------------------------------------------------------------------------
+void        resize_base_share_result   (resize_base_obj* r,
+                                        const frame_obj* src,
+                                        frame_obj* result)
+{
+    if ( result == NULL ) {
+        return;
+    }
+
+    if ( r->processStart != INVALID_PTS ) {
+        r->processTime += resize_base_get_time_us() - r->processStart;
+        r->framesProcessed++;
+        r->processStart = INVALID_PTS;
+    }
+
+    frame_trace_forward((frame_obj*)src, result, ftResized);
+
+    // what a filter downstream modifies in place isn't ours to hand out
+    if ( !r->allowSharedResults ) {
+        return;
+    }
+
+    resize_shared_result e;
+    e.pipeline = r->pipeline;
+    e.source = (frame_obj*)src;
+    e.sourcePts = frame_get_api((frame_obj*)src)->get_pts((frame_obj*)src);
+    e.width = r->dimActual.width;
+    e.height = r->dimActual.height;
+    e.pixfmt = r->pixfmt;
+    e.colorSpace = r->colorSpace;
+    e.colorRange = r->colorRange;
+    e.retainSourceFrameInterval = r->retainSourceFrameInterval;
+    e.result = result;
+    e.time = sv_time_get_current_epoch_time();
+    frame_ref(result);
+    frame_ref(e.source);
+
+    r->shareResults = 1;
+
+    std::lock_guard<std::mutex> guard(_gSharedResultsMutex);
+    _gSharedResults.push_front(e);
+    _resize_base_expire_results(e.time);
+}
 
 
 //-----------------------------------------------------------------------------
@@ -56,6 +187,15 @@ void resize_base_init(resize_base_obj* res)
     res->inputPixFmt = pfmtUndefined;
     res->retainSourceFrameInterval = 0;
     res->prevFramePts = INVALID_PTS;
+    res->shareResults = 0;
+    res->allowSharedResults = 1;
+    res->pipeline = NULL;
+    res->framesShared = 0;
+    res->slices = sv_get_int_env_var("SV_RESIZE_SLICES", 0);
+    res->keepOnDevice = 0;
+    res->processStart = INVALID_PTS;
+    res->processTime = 0;
+    res->framesProcessed = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -85,6 +225,9 @@ int  resize_base_set_param      (resize_base_obj* rszfilter,
     SET_PARAM_IF(rszfilter, name, "retainSourceFrameInterval", int, rszfilter->retainSourceFrameInterval);
     SET_PARAM_IF(rszfilter, name, "minHeight", int, rszfilter->minHeight);
     SET_PARAM_IF(rszfilter, name, "allowUpsize", int, rszfilter->allowUpsize);
+    SET_PARAM_IF(rszfilter, name, "slices", int, rszfilter->slices);
+    SET_PARAM_IF(rszfilter, name, "keepOnDevice", int, rszfilter->keepOnDevice);
+    SET_PARAM_IF(rszfilter, name, "allowSharedResults", int, rszfilter->allowSharedResults);
     if ( !_stricmp(name, "updateSize") ) {
         int* arr = (int*)value;
         int width = arr[0], height = arr[1];
@@ -112,6 +255,10 @@ void        resize_base_proxy_params   (const resize_base_obj* r,
     other->retainSourceFrameInterval = r->retainSourceFrameInterval;
     other->minHeight = r->minHeight;
     other->allowUpsize = r->allowUpsize;
+    other->slices = r->slices;
+    other->keepOnDevice = r->keepOnDevice;
+    other->allowSharedResults = r->allowSharedResults;
+    other->pipeline = r->pipeline;
 
     other->source = r->source;
     other->sourceApi = r->sourceApi;
@@ -131,6 +278,9 @@ int  resize_base_get_param      (resize_base_obj* rszfilter,
     COPY_PARAM_IF(rszfilter, name, "width", int,   rszfilter->dimActual.width);
     COPY_PARAM_IF(rszfilter, name, "height", int,   rszfilter->dimActual.height);
     COPY_PARAM_IF(rszfilter, name, "passthrough", int,   rszfilter->passthrough);
+    COPY_PARAM_IF(rszfilter, name, "framesShared", int,   rszfilter->framesShared);
+    COPY_PARAM_IF(rszfilter, name, "processTimeUs", INT64_T, rszfilter->processTime);
+    COPY_PARAM_IF(rszfilter, name, "framesProcessed", int, rszfilter->framesProcessed);
     return -1;
 }
 
@@ -161,6 +311,24 @@ int  resize_base_open_in       (resize_base_obj* rszfilter)
         return -1;
     }
 
+    // head of the graph, see resize_shared_result
+    stream_obj* head = rszfilter->source;
+    while ( head != NULL ) {
+        stream_obj* parent = stream_get_api(head)->find_element(head, NULL);
+        if ( parent == NULL ) {
+            break;
+        }
+        head = parent;
+    }
+    rszfilter->pipeline = head;
+
+    resize_base_compute_dims(rszfilter);
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+void        resize_base_compute_dims   (resize_base_obj* rszfilter)
+{
     if (!rszfilter->allowUpsize) {
         if ( rszfilter->dimSetting.width > rszfilter->inputWidth ) {
             rszfilter->logCb(logTrace, _FMT("Constraining to input width:" << rszfilter->dimSetting.width << ">" << rszfilter->inputWidth));
@@ -218,7 +386,7 @@ int  resize_base_open_in       (resize_base_obj* rszfilter)
                                         rszfilter->name <<
                                         "' will be operating as a passthrough"));
         rszfilter->passthrough = 1;
-        return 0;
+        return;
     }
 
     if ( rszfilter->dimActual.keepAspectRatio ) {
@@ -243,7 +411,6 @@ int  resize_base_open_in       (resize_base_obj* rszfilter)
                                     " dstColorRange=" << rszfilter->colorRange <<
                                     " dstColorSpace=" << rszfilter->colorSpace ));
     rszfilter->passthrough = 0;
-    return 0;
 }
 
 
@@ -301,7 +468,19 @@ frame_obj*  resize_base_pre_process               (resize_base_obj* rszfilter, f
         return NULL;
     }
 
+    if ( rszfilter->shareResults && rszfilter->allowSharedResults ) {
+        frame_obj* shared = _resize_base_find_result(rszfilter, tmp);
+        if ( shared != NULL ) {
+            // another branch had already converted this frame the way we would
+            rszfilter->framesShared++;
+            frame_unref(&tmp);
+            *frame = shared;
+            return NULL;
+        }
+    }
+
     // The caller should go on processing the frame
+    rszfilter->processStart = resize_base_get_time_us();
     return tmp;
 }
 
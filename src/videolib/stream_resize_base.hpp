@@ -56,9 +56,22 @@ typedef struct resize_base  : public stream_base  {
     int                 inputPixFmt;
     int                 retainSourceFrameInterval;
     INT64_T             prevFramePts;
+    int                 shareResults;       // set by implementations calling resize_base_share_result
+    int                 allowSharedResults; // 0 once a filter downstream modifies our output in place
+    const void*         pipeline;           // head of the graph, scoping shared results
+    int                 framesShared;       // outputs taken from another branch, rather than produced
+    int                 slices;             // bands to scale in parallel; 0 for none, -1 to decide by size
+    int                 keepOnDevice;       // device-resident input stays on the device, if it can be scaled there
+    INT64_T             processStart;       // when pre_process handed over the frame being worked on, in us
+    INT64_T             processTime;        // total time spent producing outputs, in us
+    int                 framesProcessed;    // outputs produced
 } resize_base_obj;
 
 
+//-----------------------------------------------------------------------------
+// Monotonic clock in us, for timing the work resize filters do
+INT64_T     resize_base_get_time_us    ();
+
 //-----------------------------------------------------------------------------
 void        resize_base_init           (resize_base_obj* r);
 void        resize_base_flag_for_reopen(resize_base_obj* r);
@@ -72,7 +85,20 @@ int         resize_base_get_param      (resize_base_obj* r,
                                         void* value,
                                         size_t* size);
 int         resize_base_open_in        (resize_base_obj* r);
+// Works out dimActual (and passthrough) out of the settings and the input
+// parameters; open_in does this, but those overriding the settings may redo it
+void        resize_base_compute_dims   (resize_base_obj* r);
 size_t      resize_base_get_width      (resize_base_obj* r);
 size_t      resize_base_get_height     (resize_base_obj* r);
 int         resize_base_get_pixel_format(resize_base_obj* r);
 frame_obj*  resize_base_pre_process    (resize_base_obj* r, frame_obj** frame, int* res);
+// Makes the output available to other resize filters converting the same
+// source frame to the same size/pixfmt/colorspace (e.g. mmap and analytics
+// branches behind a splitter of the same pipeline); pre_process hands it out
+// instead of the source. Filters drawing on frames in place turn this off for
+// the resize filter they read from, with allowSharedResults=0.
+// Also carries the source's latency trace over to the result, and accounts
+// for the time spent producing it (see processTime).
+void        resize_base_share_result   (resize_base_obj* r,
+                                        const frame_obj* src,
+                                        frame_obj* result);
@@ -39,8 +39,10 @@
 #include "sv_module_def.hpp"
 
 #include "streamprv.h"
+#include "sv_ffmpeg.h"
 
 #include "frame_basic.h"
+#include "frame_trace.h"
 
 #include "videolibUtils.h"
 
@@ -48,6 +50,54 @@
 
 #include "stream_resize_base.hpp"
 
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RESIZEFACTORY_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define RESIZEFACTORY_NEON 1
+#include <arm_neon.h>
+#endif
+
+extern "C" stream_api_t*     get_hw_resize_filter_api ( );
+extern "C" stream_api_t*     get_fused_resize_filter_api ( );
+bool                         fused_resize_filter_supports (int srcPixfmt, int dstPixfmt,
+                                                           size_t srcWidth, size_t srcHeight,
+                                                           size_t dstWidth, size_t dstHeight);
+
+//-----------------------------------------------------------------------------
+// Software backends the factory can choose from, in the order static rules
+// prefer them. When more than one can handle a conversion, each gets to convert
+// kCalibrationFrames frames, and the fastest is used from then on -- by this
+// filter, and by any other converting between the same sizes and formats.
+// SV_RESIZE_CALIBRATE=0 disables calibration, leaving the static rules.
+// SV_RESIZE_FUSED=0 takes the single-pass YUV->RGB downscaler out of the running.
+//
+// "rotation" (clockwise degrees, a multiple of 90), or "autoRotate" to take
+// it from the source, has the output rotated -- after the resize, at the
+// output size. Once rotated, frames are reported as needing no rotation.
+enum {
+    rbFused = 0,
+    rbIpp,
+    rbFFmpeg2Step,
+    rbFFmpeg,
+    rbCount
+};
+static const char*      _kBackendNames[rbCount] = { "fused", "ipp", "ffmpeg2Step", "ffmpeg" };
+static const int        kCalibrationFrames = 20;
+
+typedef struct resize_calibration {
+    int             backend;
+    INT64_T         timeUs[rbCount];    // per frame, -1 if not tried
+} resize_calibration;
+
+static std::mutex                                   _gCalibrationMutex;
+static std::map<std::string, resize_calibration>    _gCalibrations;
+
 //-----------------------------------------------------------------------------
 typedef struct resize_factory  : public resize_base_obj  {
     stream_obj*     impl;
@@ -57,8 +107,25 @@ typedef struct resize_factory  : public resize_base_obj  {
     // The only reason we need to keep a reference to it (rather than let impl manage it),
     // is whenever source is replaced, it needs to be replaced directly on impl2
     stream_obj*     impl2;
+    const char*     configuration;
+    // calibration in progress: backend being tried, or -1
+    int             trialBackend;
+    bool            trialViable[rbCount];
+    INT64_T         trialTimeUs[rbCount];
+    INT64_T         trialBaseTime;
+    int             trialBaseFrames;
+    int             rotation;
+    int             autoRotate;
+    int             rotationActive;     // applied since open_in: 0, 90, 180 or 270
+    frame_allocator* fa;                // rotated frames
 } resize_factory_obj;
 
+//-----------------------------------------------------------------------------
+static int         _resize_factory_normalize_rotation(int degrees)
+{
+    return ((degrees % 360) + 360) % 360;
+}
+
 //-----------------------------------------------------------------------------
 // Stream API
 //-----------------------------------------------------------------------------
@@ -137,6 +204,18 @@ static stream_obj*   resize_factory_create                (const char* name)
     resize_base_init(res);
     res->impl = NULL;
     res->impl2 = NULL;
+    res->configuration = "undefined";
+    res->trialBackend = -1;
+    for (int nI=0; nI<rbCount; nI++) {
+        res->trialViable[nI] = false;
+        res->trialTimeUs[nI] = -1;
+    }
+    res->trialBaseTime = 0;
+    res->trialBaseFrames = 0;
+    res->rotation = 0;
+    res->autoRotate = 0;
+    res->rotationActive = 0;
+    res->fa = create_frame_allocator(_STR("rotate_"<<name));
     return (stream_obj*)res;
 }
 
@@ -171,7 +250,19 @@ static int         resize_factory_set_param             (stream_obj* stream,
                                             const void* value)
 {
     DECLARE_RESIZEFACTORY_FILTER(stream, rszfactory);
+    const CHAR_T* scopedName = stream_param_name_apply_scope(stream, name);
+    SET_PARAM_IF(rszfactory, scopedName, "rotation", int, rszfactory->rotation);
+    SET_PARAM_IF(rszfactory, scopedName, "autoRotate", int, rszfactory->autoRotate);
     if (resize_base_set_param(rszfactory, name, value) >= 0 ) {
+        // the implementations produce (and share) the results
+        if ( !_stricmp(scopedName, "allowSharedResults") ) {
+            if ( rszfactory->impl ) {
+                ((resize_base_obj*)rszfactory->impl)->allowSharedResults = rszfactory->allowSharedResults;
+            }
+            if ( rszfactory->impl2 ) {
+                ((resize_base_obj*)rszfactory->impl2)->allowSharedResults = rszfactory->allowSharedResults;
+            }
+        }
         return 0;
     }
     return default_set_param(stream, name, value);
@@ -208,6 +299,135 @@ static int         resize_factory_remove_element     (stream_obj** pStream,
     return res;
 }
 
+//-----------------------------------------------------------------------------
+// Time spent and frames produced by the implementation(s) since they were opened
+static void        _resize_factory_get_work         (resize_factory_obj* rszfactory,
+                                                    INT64_T* time,
+                                                    int* frames)
+{
+    *time = 0;
+    *frames = 0;
+    if ( rszfactory->impl ) {
+        resize_base_obj* r1 = (resize_base_obj*)rszfactory->impl;
+        *time += r1->processTime;
+        *frames = r1->framesProcessed;
+    }
+    if ( rszfactory->impl2 ) {
+        *time += ((resize_base_obj*)rszfactory->impl2)->processTime;
+    }
+}
+
+//-----------------------------------------------------------------------------
+static std::string _resize_factory_calibration_key  (resize_factory_obj* rszfactory)
+{
+    char key[128];
+    snprintf(key, sizeof(key), "%dx%d/%d->%dx%d/%d",
+                    (int)rszfactory->inputWidth, (int)rszfactory->inputHeight, rszfactory->inputPixFmt,
+                    (int)rszfactory->dimActual.width, (int)rszfactory->dimActual.height, rszfactory->pixfmt);
+    return key;
+}
+
+//-----------------------------------------------------------------------------
+// Picks the backend to open with, out of the viable ones
+static int         _resize_factory_pick_backend     (resize_factory_obj* rszfactory,
+                                                    const bool* viable)
+{
+    int viableCount = 0, first = -1;
+    for (int nI=0; nI<rbCount; nI++) {
+        if ( viable[nI] ) {
+            viableCount++;
+            if ( first < 0 ) first = nI;
+        }
+    }
+
+    if ( rszfactory->trialBackend >= 0 ) {
+        return rszfactory->trialBackend;
+    }
+    if ( viableCount < 2 ) {
+        return first;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(_gCalibrationMutex);
+        std::map<std::string, resize_calibration>::iterator it =
+                _gCalibrations.find(_resize_factory_calibration_key(rszfactory));
+        if ( it != _gCalibrations.end() && viable[it->second.backend] ) {
+            return it->second.backend;
+        }
+    }
+
+    if ( !sv_get_int_env_var("SV_RESIZE_CALIBRATE", 1) ) {
+        return first;
+    }
+
+    rszfactory->logCb(logDebug, _FMT("Calibrating " << viableCount << " resize backends for " <<
+                                        _resize_factory_calibration_key(rszfactory)));
+    for (int nI=0; nI<rbCount; nI++) {
+        rszfactory->trialViable[nI] = viable[nI];
+        rszfactory->trialTimeUs[nI] = -1;
+    }
+    rszfactory->trialBackend = first;
+    return first;
+}
+
+//-----------------------------------------------------------------------------
+// Called after each frame produced while calibrating; moves on to the next
+// backend once the current one had converted enough frames.
+static void        _resize_factory_calibrate        (resize_factory_obj* rszfactory)
+{
+    INT64_T time;
+    int     frames;
+    _resize_factory_get_work(rszfactory, &time, &frames);
+
+    if ( frames == 1 ) {
+        // the first frame pays for initialization
+        rszfactory->trialBaseTime = time;
+        rszfactory->trialBaseFrames = frames;
+        return;
+    }
+    if ( frames - rszfactory->trialBaseFrames < kCalibrationFrames ) {
+        return;
+    }
+
+    int current = rszfactory->trialBackend;
+    rszfactory->trialTimeUs[current] = (time - rszfactory->trialBaseTime) /
+                                       (frames - rszfactory->trialBaseFrames);
+
+    int next = -1;
+    for (int nI=current+1; nI<rbCount && next < 0; nI++) {
+        if ( rszfactory->trialViable[nI] ) {
+            next = nI;
+        }
+    }
+
+    if ( next < 0 ) {
+        resize_calibration cal;
+        cal.backend = -1;
+        for (int nI=0; nI<rbCount; nI++) {
+            cal.timeUs[nI] = rszfactory->trialTimeUs[nI];
+            if ( cal.timeUs[nI] >= 0 &&
+                 ( cal.backend < 0 || cal.timeUs[nI] < cal.timeUs[cal.backend] ) ) {
+                cal.backend = nI;
+            }
+        }
+        std::string key = _resize_factory_calibration_key(rszfactory);
+        rszfactory->logCb(logInfo, _FMT("Resize calibration for " << key << ": using " <<
+                                        _kBackendNames[cal.backend] << ", " <<
+                                        cal.timeUs[cal.backend] << "us/frame"));
+        {
+            std::lock_guard<std::mutex> guard(_gCalibrationMutex);
+            _gCalibrations[key] = cal;
+        }
+        rszfactory->trialBackend = -1;
+        if ( cal.backend == current ) {
+            return;
+        }
+    } else {
+        rszfactory->trialBackend = next;
+    }
+    resize_base_flag_for_reopen(rszfactory);
+}
+
 //-----------------------------------------------------------------------------
 static int         resize_factory_get_param          (stream_obj* stream,
                                                 const CHAR_T* name,
@@ -215,6 +435,53 @@ static int         resize_factory_get_param          (stream_obj* stream,
                                                 size_t* size)
 {
     DECLARE_RESIZEFACTORY_FILTER(stream, rszfactory);
+    const CHAR_T* scopedName = stream_param_name_apply_scope(stream, name);
+    if ( rszfactory->impl != NULL &&
+         !_stricmp(scopedName, "framesShared") ) {
+        // it's the implementation that gets to share
+        return rszfactory->implApi->get_param(rszfactory->impl, "framesShared", value, size);
+    }
+    if ( !_stricmp(scopedName, "processTimeUs") ||
+         !_stricmp(scopedName, "framesProcessed") ) {
+        INT64_T time;
+        int     frames;
+        _resize_factory_get_work(rszfactory, &time, &frames);
+        COPY_PARAM_IF(rszfactory, scopedName, "processTimeUs", INT64_T, time);
+        COPY_PARAM_IF(rszfactory, scopedName, "framesProcessed", int, frames);
+    }
+    if ( !_stricmp(scopedName, "hwFramesContext") && !rszfactory->passthrough ) {
+        if ( rszfactory->impl != NULL && rszfactory->impl2 == NULL &&
+             rszfactory->implApi == get_hw_resize_filter_api() ) {
+            // a lone device scaler knows whether its frames stay on the device
+            return rszfactory->implApi->get_param(rszfactory->impl, "hwFramesContext", value, size);
+        }
+        // anything else hands out frames in system memory
+        COPY_PARAM_IF(rszfactory, scopedName, "hwFramesContext", void*, NULL);
+    }
+    if ( rszfactory->rotationActive ) {
+        if ( !_stricmp(scopedName, "rotation") ) {
+            // whatever the source wants, less what we did
+            int upstream = 0;
+            size_t szUpstream = sizeof(upstream);
+            if ( default_get_param(stream, "rotation", &upstream, &szUpstream) < 0 ) {
+                upstream = 0;
+            }
+            int remaining = _resize_factory_normalize_rotation(upstream - rszfactory->rotationActive);
+            COPY_PARAM_IF(rszfactory, scopedName, "rotation", int, remaining > 180 ? remaining - 360 : remaining);
+        }
+        if ( rszfactory->rotationActive != 180 ) {
+            COPY_PARAM_IF(rszfactory, scopedName, "width", int, rszfactory->dimActual.height);
+            COPY_PARAM_IF(rszfactory, scopedName, "height", int, rszfactory->dimActual.width);
+        }
+        COPY_PARAM_IF(rszfactory, scopedName, "passthrough", int, 0);
+    }
+    COPY_PARAM_IF(rszfactory, scopedName, "backend", const char*, rszfactory->configuration);
+    COPY_PARAM_IF(rszfactory, scopedName, "calibrating", int, rszfactory->trialBackend >= 0 ? 1 : 0);
+    for (int nI=0; nI<rbCount; nI++) {
+        // how long each backend took per frame when it was tried, e.g. ffmpegTimeUs
+        std::string calName = std::string(_kBackendNames[nI]) + "TimeUs";
+        COPY_PARAM_IF(rszfactory, scopedName, calName.c_str(), INT64_T, rszfactory->trialTimeUs[nI]);
+    }
     if (resize_base_get_param(rszfactory, name, value, size) >= 0 ) {
         return 0;
     }
@@ -243,6 +510,421 @@ static bool        _ipp_supported_cc(int srcCC, int dstCC)
 }
 
 
+//-----------------------------------------------------------------------------
+// Rotation
+//
+// Rotating (by a quarter turn, mostly) is done here, after the resize, so only
+// the small output gets moved around. Planes are walked in kRotateBlock squares,
+// so the source rows being read from and destination rows being written to stay
+// in cache; within those, 8x8 tiles (4x4 for 4-byte pixels) are transposed in
+// registers.
+//-----------------------------------------------------------------------------
+static const int        kRotateBlock = 64;
+
+//-----------------------------------------------------------------------------
+// Planes a pixel format can be rotated by; returns the number of planes, or 0
+// for formats we can't (or can't by a quarter turn) rotate
+static int         _resize_factory_rotation_layout(int pixfmt,
+                                                   int* elemSize,
+                                                   int* chromaShift)
+{
+    switch (pixfmt)
+    {
+    case pfmtYUV420P:
+    case pfmtYUVJ420P:
+        elemSize[0] = elemSize[1] = elemSize[2] = 1;
+        *chromaShift = 1;
+        return 3;
+    case pfmtYUV444P:
+    case pfmtYUVJ444P:
+        elemSize[0] = elemSize[1] = elemSize[2] = 1;
+        *chromaShift = 0;
+        return 3;
+    case pfmtNV12:
+    case pfmtNV21:
+        elemSize[0] = 1;
+        elemSize[1] = 2;
+        *chromaShift = 1;
+        return 2;
+    case pfmtRGB8:
+        elemSize[0] = 1;
+        *chromaShift = 0;
+        return 1;
+    case pfmtRGB24:
+    case pfmtBGR24:
+        elemSize[0] = 3;
+        *chromaShift = 0;
+        return 1;
+    case pfmtRGBA:
+    case pfmtARGB:
+        elemSize[0] = 4;
+        *chromaShift = 0;
+        return 1;
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+bool               resize_factory_rotation_supports(int pixfmt)
+{
+    int elemSize[3], chromaShift;
+    return _resize_factory_rotation_layout(pixfmt, elemSize, &chromaShift) > 0;
+}
+
+//-----------------------------------------------------------------------------
+// Transposes an n x n tile: row k of the tile starts at src + k*srcStep, with
+// its n elements in consecutive memory; column m of the tile goes to dst + m*dstStep.
+// Steps may be negative, which is how the direction of the rotation is chosen.
+template <int E>
+static inline void _rotate_tile_c(const uint8_t* src, ptrdiff_t srcStep,
+                                  uint8_t* dst, ptrdiff_t dstStep, int n)
+{
+    for (int m=0; m<n; m++) {
+        uint8_t* out = dst + m*dstStep;
+        for (int k=0; k<n; k++) {
+            memcpy(out + k*E, src + k*srcStep + m*E, E);
+        }
+    }
+}
+
+#if RESIZEFACTORY_SSE2
+//-----------------------------------------------------------------------------
+static inline void _rotate_tile8_u8(const uint8_t* src, ptrdiff_t srcStep,
+                                    uint8_t* dst, ptrdiff_t dstStep)
+{
+    __m128i a0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src)),
+                                   _mm_loadl_epi64((const __m128i*)(src+srcStep)));
+    __m128i a1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src+2*srcStep)),
+                                   _mm_loadl_epi64((const __m128i*)(src+3*srcStep)));
+    __m128i a2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src+4*srcStep)),
+                                   _mm_loadl_epi64((const __m128i*)(src+5*srcStep)));
+    __m128i a3 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src+6*srcStep)),
+                                   _mm_loadl_epi64((const __m128i*)(src+7*srcStep)));
+    __m128i b0 = _mm_unpacklo_epi16(a0, a1);
+    __m128i b1 = _mm_unpackhi_epi16(a0, a1);
+    __m128i b2 = _mm_unpacklo_epi16(a2, a3);
+    __m128i b3 = _mm_unpackhi_epi16(a2, a3);
+    // each holds two columns of the tile
+    __m128i c[4] = { _mm_unpacklo_epi32(b0, b2), _mm_unpackhi_epi32(b0, b2),
+                     _mm_unpacklo_epi32(b1, b3), _mm_unpackhi_epi32(b1, b3) };
+    for (int nI=0; nI<4; nI++) {
+        _mm_storel_epi64((__m128i*)(dst + (2*nI)*dstStep), c[nI]);
+        _mm_storel_epi64((__m128i*)(dst + (2*nI+1)*dstStep), _mm_srli_si128(c[nI], 8));
+    }
+}
+
+//-----------------------------------------------------------------------------
+static inline void _rotate_tile8_u16(const uint8_t* src, ptrdiff_t srcStep,
+                                     uint8_t* dst, ptrdiff_t dstStep)
+{
+    __m128i a[8];
+    for (int nI=0; nI<4; nI++) {
+        __m128i r0 = _mm_loadu_si128((const __m128i*)(src + (2*nI)*srcStep));
+        __m128i r1 = _mm_loadu_si128((const __m128i*)(src + (2*nI+1)*srcStep));
+        a[2*nI] = _mm_unpacklo_epi16(r0, r1);
+        a[2*nI+1] = _mm_unpackhi_epi16(r0, r1);
+    }
+    // rows 0-3 and 4-7, columns 0-1, 2-3, 4-5 and 6-7
+    __m128i b0 = _mm_unpacklo_epi32(a[0], a[2]);
+    __m128i b1 = _mm_unpackhi_epi32(a[0], a[2]);
+    __m128i b2 = _mm_unpacklo_epi32(a[4], a[6]);
+    __m128i b3 = _mm_unpackhi_epi32(a[4], a[6]);
+    __m128i b4 = _mm_unpacklo_epi32(a[1], a[3]);
+    __m128i b5 = _mm_unpackhi_epi32(a[1], a[3]);
+    __m128i b6 = _mm_unpacklo_epi32(a[5], a[7]);
+    __m128i b7 = _mm_unpackhi_epi32(a[5], a[7]);
+    _mm_storeu_si128((__m128i*)(dst), _mm_unpacklo_epi64(b0, b2));
+    _mm_storeu_si128((__m128i*)(dst + dstStep), _mm_unpackhi_epi64(b0, b2));
+    _mm_storeu_si128((__m128i*)(dst + 2*dstStep), _mm_unpacklo_epi64(b1, b3));
+    _mm_storeu_si128((__m128i*)(dst + 3*dstStep), _mm_unpackhi_epi64(b1, b3));
+    _mm_storeu_si128((__m128i*)(dst + 4*dstStep), _mm_unpacklo_epi64(b4, b6));
+    _mm_storeu_si128((__m128i*)(dst + 5*dstStep), _mm_unpackhi_epi64(b4, b6));
+    _mm_storeu_si128((__m128i*)(dst + 6*dstStep), _mm_unpacklo_epi64(b5, b7));
+    _mm_storeu_si128((__m128i*)(dst + 7*dstStep), _mm_unpackhi_epi64(b5, b7));
+}
+
+//-----------------------------------------------------------------------------
+static inline void _rotate_tile4_u32(const uint8_t* src, ptrdiff_t srcStep,
+                                     uint8_t* dst, ptrdiff_t dstStep)
+{
+    __m128i r0 = _mm_loadu_si128((const __m128i*)(src));
+    __m128i r1 = _mm_loadu_si128((const __m128i*)(src + srcStep));
+    __m128i r2 = _mm_loadu_si128((const __m128i*)(src + 2*srcStep));
+    __m128i r3 = _mm_loadu_si128((const __m128i*)(src + 3*srcStep));
+    __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+    __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+    __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+    __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+    _mm_storeu_si128((__m128i*)(dst), _mm_unpacklo_epi64(t0, t1));
+    _mm_storeu_si128((__m128i*)(dst + dstStep), _mm_unpackhi_epi64(t0, t1));
+    _mm_storeu_si128((__m128i*)(dst + 2*dstStep), _mm_unpacklo_epi64(t2, t3));
+    _mm_storeu_si128((__m128i*)(dst + 3*dstStep), _mm_unpackhi_epi64(t2, t3));
+}
+#elif RESIZEFACTORY_NEON
+//-----------------------------------------------------------------------------
+static inline void _rotate_tile8_u8(const uint8_t* src, ptrdiff_t srcStep,
+                                    uint8_t* dst, ptrdiff_t dstStep)
+{
+    uint8x8x2_t a0 = vtrn_u8(vld1_u8(src), vld1_u8(src+srcStep));
+    uint8x8x2_t a1 = vtrn_u8(vld1_u8(src+2*srcStep), vld1_u8(src+3*srcStep));
+    uint8x8x2_t a2 = vtrn_u8(vld1_u8(src+4*srcStep), vld1_u8(src+5*srcStep));
+    uint8x8x2_t a3 = vtrn_u8(vld1_u8(src+6*srcStep), vld1_u8(src+7*srcStep));
+    uint16x4x2_t b0 = vtrn_u16(vreinterpret_u16_u8(a0.val[0]), vreinterpret_u16_u8(a1.val[0]));
+    uint16x4x2_t b1 = vtrn_u16(vreinterpret_u16_u8(a0.val[1]), vreinterpret_u16_u8(a1.val[1]));
+    uint16x4x2_t b2 = vtrn_u16(vreinterpret_u16_u8(a2.val[0]), vreinterpret_u16_u8(a3.val[0]));
+    uint16x4x2_t b3 = vtrn_u16(vreinterpret_u16_u8(a2.val[1]), vreinterpret_u16_u8(a3.val[1]));
+    // columns 0/4, 1/5, 2/6 and 3/7
+    uint32x2x2_t c0 = vtrn_u32(vreinterpret_u32_u16(b0.val[0]), vreinterpret_u32_u16(b2.val[0]));
+    uint32x2x2_t c1 = vtrn_u32(vreinterpret_u32_u16(b1.val[0]), vreinterpret_u32_u16(b3.val[0]));
+    uint32x2x2_t c2 = vtrn_u32(vreinterpret_u32_u16(b0.val[1]), vreinterpret_u32_u16(b2.val[1]));
+    uint32x2x2_t c3 = vtrn_u32(vreinterpret_u32_u16(b1.val[1]), vreinterpret_u32_u16(b3.val[1]));
+    vst1_u8(dst,           vreinterpret_u8_u32(c0.val[0]));
+    vst1_u8(dst+dstStep,   vreinterpret_u8_u32(c1.val[0]));
+    vst1_u8(dst+2*dstStep, vreinterpret_u8_u32(c2.val[0]));
+    vst1_u8(dst+3*dstStep, vreinterpret_u8_u32(c3.val[0]));
+    vst1_u8(dst+4*dstStep, vreinterpret_u8_u32(c0.val[1]));
+    vst1_u8(dst+5*dstStep, vreinterpret_u8_u32(c1.val[1]));
+    vst1_u8(dst+6*dstStep, vreinterpret_u8_u32(c2.val[1]));
+    vst1_u8(dst+7*dstStep, vreinterpret_u8_u32(c3.val[1]));
+}
+#endif
+
+//-----------------------------------------------------------------------------
+template <int E>
+static inline int  _rotate_tile_size()
+{
+#if RESIZEFACTORY_SSE2
+    return (E == 4) ? 4 : 8;
+#else
+    return 8;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+template <int E>
+static inline void _rotate_tile(const uint8_t* src, ptrdiff_t srcStep,
+                                uint8_t* dst, ptrdiff_t dstStep)
+{
+#if RESIZEFACTORY_SSE2
+    if ( E == 1 ) { _rotate_tile8_u8(src, srcStep, dst, dstStep); return; }
+    if ( E == 2 ) { _rotate_tile8_u16(src, srcStep, dst, dstStep); return; }
+    if ( E == 4 ) { _rotate_tile4_u32(src, srcStep, dst, dstStep); return; }
+#elif RESIZEFACTORY_NEON
+    if ( E == 1 ) { _rotate_tile8_u8(src, srcStep, dst, dstStep); return; }
+#endif
+    _rotate_tile_c<E>(src, srcStep, dst, dstStep, _rotate_tile_size<E>());
+}
+
+//-----------------------------------------------------------------------------
+// Rotates a w x h plane of E-byte elements by a quarter turn: clockwise, the
+// output pixel at (x,y) comes from the source's (y, h-1-x); counterclockwise
+// from (w-1-y, x).  The output is h x w.
+template <int E>
+static void        _rotate_plane_quarter(const uint8_t* src, int srcStride,
+                                         int w, int h,
+                                         uint8_t* dst, int dstStride,
+                                         bool clockwise)
+{
+    const int       n = _rotate_tile_size<E>();
+    const int       dstW = h, dstH = w;
+
+    for (int by=0; by<dstH; by+=kRotateBlock) {
+        const int byEnd = std::min(by+kRotateBlock, dstH);
+        for (int bx=0; bx<dstW; bx+=kRotateBlock) {
+            const int bxEnd = std::min(bx+kRotateBlock, dstW);
+            for (int y=by; y<byEnd; y+=n) {
+                for (int x=bx; x<bxEnd; x+=n) {
+                    if ( y+n > byEnd || x+n > bxEnd ) {
+                        // partial tile at the edge of the plane
+                        for (int ty=y; ty<std::min(y+n, byEnd); ty++) {
+                            uint8_t* out = dst + (ptrdiff_t)ty*dstStride;
+                            for (int tx=x; tx<std::min(x+n, bxEnd); tx++) {
+                                const uint8_t* in = clockwise ?
+                                        src + (ptrdiff_t)(h-1-tx)*srcStride + ty*E :
+                                        src + (ptrdiff_t)tx*srcStride + (w-1-ty)*E;
+                                memcpy(out + tx*E, in, E);
+                            }
+                        }
+                        continue;
+                    }
+                    // tile row k is the source row feeding output column x+k
+                    if ( clockwise ) {
+                        _rotate_tile<E>(src + (ptrdiff_t)(h-1-x)*srcStride + y*E, -srcStride,
+                                        dst + (ptrdiff_t)y*dstStride + x*E, dstStride);
+                    } else {
+                        _rotate_tile<E>(src + (ptrdiff_t)x*srcStride + (w-n-y)*E, srcStride,
+                                        dst + (ptrdiff_t)(y+n-1)*dstStride + x*E, -dstStride);
+                    }
+                }
+            }
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+template <int E>
+static void        _rotate_plane_half(const uint8_t* src, int srcStride,
+                                      int w, int h,
+                                      uint8_t* dst, int dstStride)
+{
+    for (int y=0; y<h; y++) {
+        const uint8_t* in = src + (ptrdiff_t)(h-1-y)*srcStride + (w-1)*E;
+        uint8_t* out = dst + (ptrdiff_t)y*dstStride;
+        for (int x=0; x<w; x++, in-=E, out+=E) {
+            memcpy(out, in, E);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+template <int E>
+static void        _rotate_plane_e   (const uint8_t* src, int srcStride,
+                                      int w, int h,
+                                      uint8_t* dst, int dstStride,
+                                      int rotation)
+{
+    if ( rotation == 180 ) {
+        _rotate_plane_half<E>(src, srcStride, w, h, dst, dstStride);
+    } else {
+        _rotate_plane_quarter<E>(src, srcStride, w, h, dst, dstStride, rotation == 90);
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void        _rotate_plane     (const uint8_t* src, int srcStride,
+                                      int w, int h,
+                                      uint8_t* dst, int dstStride,
+                                      int elemSize, int rotation)
+{
+    switch (elemSize)
+    {
+    case 1: _rotate_plane_e<1>(src, srcStride, w, h, dst, dstStride, rotation); break;
+    case 2: _rotate_plane_e<2>(src, srcStride, w, h, dst, dstStride, rotation); break;
+    case 3: _rotate_plane_e<3>(src, srcStride, w, h, dst, dstStride, rotation); break;
+    case 4: _rotate_plane_e<4>(src, srcStride, w, h, dst, dstStride, rotation); break;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Replaces the frame with its rotated copy. Frames we can't rotate -- placeholders,
+// those still on the device, or in formats rotation doesn't handle -- go as they are.
+static void        _resize_factory_rotate           (resize_factory_obj* rszfactory,
+                                                    frame_obj** frame)
+{
+    frame_obj*      src = *frame;
+    frame_api_t*    api;
+    if ( src == NULL ||
+         (api = frame_get_api(src)) == NULL ||
+         api->get_media_type(src) != mediaVideo ) {
+        return;
+    }
+
+    int width = (int)api->get_width(src);
+    int height = (int)api->get_height(src);
+    int pixfmt = api->get_pixel_format(src);
+    int elemSize[3], chromaShift;
+    int planes = _resize_factory_rotation_layout(pixfmt, elemSize, &chromaShift);
+    AVFrame* avframe = (AVFrame*)api->get_backing_obj(src, "avframe");
+    const uint8_t* data = (const uint8_t*)api->get_data(src);
+    if ( planes == 0 || width <= 0 || height <= 0 ||
+         (avframe == NULL && data == NULL) ||
+         (avframe != NULL && avframe->hw_frames_ctx != NULL) ) {
+        return;
+    }
+
+    enum AVPixelFormat ffpfmt = svpfmt_to_ffpfmt(pixfmt, NULL);
+    uint8_t*    srcPlanes[4];
+    int         srcLinesizes[4];
+    if ( avframe != NULL ) {
+        for (int nI=0; nI<planes; nI++) {
+            srcPlanes[nI] = avframe->data[nI];
+            srcLinesizes[nI] = avframe->linesize[nI];
+        }
+    } else {
+        av_image_fill_arrays(srcPlanes, srcLinesizes, data, ffpfmt, width, height, _kDefAlign);
+    }
+
+    const int   rotation = rszfactory->rotationActive;
+    const bool  quarter = (rotation != 180);
+    const int   dstW = quarter ? height : width;
+    const int   dstH = quarter ? width : height;
+    int size = av_image_get_buffer_size(ffpfmt, dstW, dstH, _kDefAlign);
+    basic_frame_obj* newFrame = alloc_basic_frame2(RESIZEFACTORY_FILTER_MAGIC,
+                                size,
+                                rszfactory->logCb,
+                                rszfactory->fa );
+    newFrame->pts = api->get_pts(src);
+    newFrame->dts = api->get_dts(src);
+    newFrame->keyframe = api->get_keyframe_flag(src);
+    newFrame->width = dstW;
+    newFrame->height = dstH;
+    newFrame->pixelFormat = pixfmt;
+    newFrame->mediaType = mediaVideo;
+    newFrame->dataSize = size;
+
+    uint8_t*    dstPlanes[4];
+    int         dstLinesizes[4];
+    av_image_fill_arrays(dstPlanes, dstLinesizes, newFrame->data, ffpfmt, dstW, dstH, _kDefAlign);
+    for (int nI=0; nI<planes; nI++) {
+        int shift = (nI == 0) ? 0 : chromaShift;
+        _rotate_plane(srcPlanes[nI], srcLinesizes[nI],
+                      (width + (1<<shift) - 1) >> shift, (height + (1<<shift) - 1) >> shift,
+                      dstPlanes[nI], dstLinesizes[nI],
+                      elemSize[nI], rotation);
+    }
+
+    frame_obj* retained = (frame_obj*)api->get_backing_obj(src, "srcFrame");
+    if ( retained != NULL ) {
+        newFrame->api->set_backing_obj((frame_obj*)newFrame, "srcFrame", retained);
+    }
+    frame_trace_forward(src, (frame_obj*)newFrame, ftResized);
+    frame_unref(frame);
+    *frame = (frame_obj*)newFrame;
+}
+
+//-----------------------------------------------------------------------------
+// Rotation to apply from here on: the one set, or with autoRotate, the one
+// the source reports
+static int         _resize_factory_pick_rotation    (resize_factory_obj* rszfactory)
+{
+    int rotation = rszfactory->rotation;
+    if ( rszfactory->autoRotate ) {
+        size_t size = sizeof(int);
+        if ( default_get_param((stream_obj*)rszfactory, "rotation", &rotation, &size) < 0 ) {
+            rotation = 0;
+        }
+    }
+    rotation = _resize_factory_normalize_rotation(rotation);
+    if ( rotation == 0 ) {
+        return 0;
+    }
+    if ( rotation % 90 != 0 ) {
+        rszfactory->logCb(logError, _FMT("Invalid rotation value: " << rotation));
+        return 0;
+    }
+    if ( !resize_factory_rotation_supports(rszfactory->pixfmt) ) {
+        rszfactory->logCb(logError, _FMT("Rotating pixfmt=" << rszfactory->pixfmt << " isn't supported, frames will not be rotated"));
+        return 0;
+    }
+    void*  hwFramesCtx = NULL;
+    size_t szHwFramesCtx = sizeof(hwFramesCtx);
+    if ( rszfactory->keepOnDevice &&
+         default_get_param((stream_obj*)rszfactory, "hwFramesContext", &hwFramesCtx, &szHwFramesCtx) >= 0 &&
+         hwFramesCtx != NULL ) {
+        rszfactory->logCb(logError, _FMT("Frames kept on the device cannot be rotated"));
+        return 0;
+    }
+    return rotation;
+}
+
+//-----------------------------------------------------------------------------
+static void        _resize_factory_swap_dims        (resize_dims* dims)
+{
+    size_t tmp = dims->width;
+    dims->width = dims->height;
+    dims->height = tmp;
+}
+
 //-----------------------------------------------------------------------------
 static int         resize_factory_open_in                (stream_obj* stream)
 {
@@ -257,6 +939,18 @@ static int         resize_factory_open_in                (stream_obj* stream)
         return -1;
     }
 
+    rszfactory->rotationActive = _resize_factory_pick_rotation(rszfactory);
+    const bool quarterTurn = ( rszfactory->rotationActive == 90 || rszfactory->rotationActive == 270 );
+    if ( quarterTurn ) {
+        // resize to what, once rotated, will have the size asked for
+        _resize_factory_swap_dims(&rszfactory->dimSetting);
+        resize_base_compute_dims(rszfactory);
+        _resize_factory_swap_dims(&rszfactory->dimSetting);
+    }
+    if ( rszfactory->rotationActive ) {
+        rszfactory->logCb(logInfo, _FMT("Rotating output by " << rszfactory->rotationActive << " degrees"));
+    }
+
     if ( rszfactory->passthrough ) {
         return 0;
     }
@@ -268,73 +962,130 @@ static int         resize_factory_open_in                (stream_obj* stream)
     int intermediatePifxmt = pfmtUndefined;
     int intermediateResize = 0;
     const char* configuration = "undefined";
-#ifdef WITH_IPP
-    int localSource = 1;
-    size_t szLocalSource = sizeof(int);
-    if ( default_get_param(stream, "isLocalSource", &localSource, &szLocalSource) < 0 ) {
-        // by default we'll allow IPP, but we do not want to use it with localVideoLib, which implements 'isLocalSource'
-        localSource = 0;
-    }
-    if (!localSource && _ipp_supported_cc(rszfactory->inputPixFmt, rszfactory->pixfmt)) {
-        if (rszfactory->dimSetting.width > 0 ||
-            rszfactory->dimSetting.height > 0 ||
-            rszfactory->dimSetting.resizeFactor > 0 ) {
-
-            if ( rszfactory->inputPixFmt == rszfactory->pixfmt && rszfactory->pixfmt != pfmtRGB24 ) {
-                // The client didn't specify a pixfmt to convert to, but in order to succeed with resize
-                // we'd have to go to RGB24
-                rszfactory->logCb(logDebug, _FMT("Forcing conversion to RGB24, as resize alone cannot handle pixfmt=" << rszfactory->inputPixFmt ));
-                rszfactory->pixfmt = pfmtRGB24;
-            }
 
-            pass2api = get_ipp_resize_filter_api();
-            pass2name = "ippResize";
-            configuration = "ipp resize";
+    // Device-resident frames coming from the decoder: scale on the device, and
+    // only download the scaled frame. Pixfmt conversion, if needed, follows on CPU.
+    void*  hwFramesCtx = NULL;
+    size_t szHwFramesCtx = sizeof(hwFramesCtx);
+    if ( default_get_param(stream, "hwFramesContext", &hwFramesCtx, &szHwFramesCtx) >= 0 &&
+         hwFramesCtx != NULL ) {
+        if ( rszfactory->keepOnDevice &&
+             (rszfactory->pixfmt == pfmtUndefined || rszfactory->pixfmt == rszfactory->inputPixFmt) ) {
+            // no conversion needed: scaled frames may stay where they are
+            pass2api = get_hw_resize_filter_api();
+            pass2name = "hwResize";
+            configuration = "hw resize";
+        } else {
+            pass1api = get_hw_resize_filter_api();
+            pass1name = "hwResize";
+            // decoder reports the format frames will be downloaded as
+            intermediatePifxmt = rszfactory->inputPixFmt;
+            intermediateResize = 1;
+            pass2api = get_resize_filter_api();
+            pass2name = "ffmpeg";
+            configuration = "hw resize+ffmpeg cc";
         }
-        if (rszfactory->inputPixFmt != rszfactory->pixfmt) {
-            pass1api = get_ipp_cc_filter_api();
-            pass1name = "ippcc";
-            intermediatePifxmt = rszfactory->pixfmt;
-            configuration = "ipp cc";
+    }
+    if ( pass2api == NULL ) {
+        bool viable[rbCount] = { false, false, false, true };
+        viable[rbFused] = sv_get_int_env_var("SV_RESIZE_FUSED", 1) &&
+             fused_resize_filter_supports(rszfactory->inputPixFmt, rszfactory->pixfmt,
+                                          rszfactory->inputWidth, rszfactory->inputHeight,
+                                          rszfactory->dimActual.width, rszfactory->dimActual.height);
+#ifdef WITH_IPP
+        int localSource = 1;
+        size_t szLocalSource = sizeof(int);
+        if ( default_get_param(stream, "isLocalSource", &localSource, &szLocalSource) < 0 ) {
+            // by default we'll allow IPP, but we do not want to use it with localVideoLib, which implements 'isLocalSource'
+            localSource = 0;
         }
-        if ( pass1api && pass2api ) {
-            configuration = "ipp cc+resize";
-        } else if ( pass1api && !pass2api ) {
-            pass2api = pass1api;
-            pass2name = pass1name;
-            pass1api = NULL;
-            pass1name = NULL;
+        viable[rbIpp] = !localSource && _ipp_supported_cc(rszfactory->inputPixFmt, rszfactory->pixfmt);
+#endif
+        // FFmpeg's NV12 <-> YUV420P <-> RGB is usually faster than NV12 <-> RGB direct conversion
+        viable[rbFFmpeg2Step] =
+             (rszfactory->inputPixFmt == pfmtNV12 && rszfactory->pixfmt != pfmtYUV420P && rszfactory->pixfmt != pfmtNV12 ) ||
+             (rszfactory->pixfmt == pfmtNV12 && rszfactory->inputPixFmt != pfmtYUV420P && rszfactory->inputPixFmt != pfmtNV12 );
+
+        int backend = _resize_factory_pick_backend(rszfactory, viable);
+#ifdef WITH_IPP
+        if ( backend == rbIpp ) {
+            if (rszfactory->dimSetting.width > 0 ||
+                rszfactory->dimSetting.height > 0 ||
+                rszfactory->dimSetting.resizeFactor > 0 ) {
+
+                if ( rszfactory->inputPixFmt == rszfactory->pixfmt && rszfactory->pixfmt != pfmtRGB24 ) {
+                    // The client didn't specify a pixfmt to convert to, but in order to succeed with resize
+                    // we'd have to go to RGB24
+                    rszfactory->logCb(logDebug, _FMT("Forcing conversion to RGB24, as resize alone cannot handle pixfmt=" << rszfactory->inputPixFmt ));
+                    rszfactory->pixfmt = pfmtRGB24;
+                }
+
+                pass2api = get_ipp_resize_filter_api();
+                pass2name = "ippResize";
+                configuration = "ipp resize";
+            }
+            if (rszfactory->inputPixFmt != rszfactory->pixfmt) {
+                pass1api = get_ipp_cc_filter_api();
+                pass1name = "ippcc";
+                intermediatePifxmt = rszfactory->pixfmt;
+                configuration = "ipp cc";
+            }
+            if ( pass1api && pass2api ) {
+                configuration = "ipp cc+resize";
+            } else if ( pass1api && !pass2api ) {
+                pass2api = pass1api;
+                pass2name = pass1name;
+                pass1api = NULL;
+                pass1name = NULL;
+            }
         }
-    }
 #endif
-    if ( pass1api == NULL && pass2api == NULL ) {
-        // FFmpeg's NV12 <-> YUV420P <-> RGB is faster than NV12 <-> RGB direct conversion
-        if ( (rszfactory->inputPixFmt == pfmtNV12 && rszfactory->pixfmt != pfmtYUV420P && rszfactory->pixfmt != pfmtNV12 ) ||
-             (rszfactory->pixfmt == pfmtNV12 && rszfactory->inputPixFmt != pfmtYUV420P && rszfactory->inputPixFmt != pfmtNV12 ) ) {
-            pass1api = get_resize_filter_api();
-            pass1name = "ffmpegNV12";
-            intermediatePifxmt = pfmtYUV420P;
-            configuration = "ffmpeg 2-step cc";
-        } else {
-            configuration = "ffmpeg cc+resize";
+        if ( backend == rbFused ) {
+            pass2api = get_fused_resize_filter_api();
+            pass2name = "fused";
+            configuration = "fused cc+resize";
+        }
+        if ( pass1api == NULL && pass2api == NULL ) {
+            if ( backend == rbFFmpeg2Step ) {
+                pass1api = get_resize_filter_api();
+                pass1name = "ffmpegNV12";
+                intermediatePifxmt = pfmtYUV420P;
+                configuration = "ffmpeg 2-step cc";
+            } else {
+                configuration = "ffmpeg cc+resize";
+            }
+            pass2api = get_resize_filter_api();
+            pass2name = "ffmpeg";
         }
-        pass2api = get_resize_filter_api();
-        pass2name = "ffmpeg";
     }
     rszfactory->impl = pass2api->create(_STR(rszfactory->name<<"."<<pass2name));
     rszfactory->implApi = pass2api;
     // apply all the relevant params
     resize_base_obj* r1 = (resize_base_obj*)rszfactory->impl;
     resize_base_proxy_params(rszfactory, r1);
+    if ( quarterTurn ) {
+        _resize_factory_swap_dims(&r1->dimSetting);
+    }
     if ( pass1api ) {
         rszfactory->impl2 = pass1api->create(_STR(rszfactory->name<<"."<<pass1name));
 
         // Apply all the relevant params, pixfmt and resize will be changed manually
         resize_base_obj* r2 = (resize_base_obj*)rszfactory->impl2;
         resize_base_proxy_params(rszfactory, r2);
-        // The first pass only does pixfmt conversion
+        if ( quarterTurn ) {
+            _resize_factory_swap_dims(&r2->dimSetting);
+        }
         r2->pixfmt = intermediatePifxmt;
-        memset((void*)&r2->dimSetting, 0, sizeof(r2->dimSetting));
+        if ( intermediateResize ) {
+            // The first pass does the resize, second only does pixfmt conversion.
+            // Retaining full-sized frames would mean downloading them, so we don't.
+            memset((void*)&r1->dimSetting, 0, sizeof(r1->dimSetting));
+            r1->retainSourceFrameInterval = 0;
+            r2->retainSourceFrameInterval = 0;
+        } else {
+            // The first pass only does pixfmt conversion
+            memset((void*)&r2->dimSetting, 0, sizeof(r2->dimSetting));
+        }
 
         // finally, we need to change the source on the front pass
         r1->source = rszfactory->impl2;
@@ -348,6 +1099,7 @@ static int         resize_factory_open_in                (stream_obj* stream)
         rszfactory->logCb(logError, _FMT("Failed to initialize resize implementation, config="<<configuration));
         return -1;
     }
+    rszfactory->configuration = configuration;
     rszfactory->logCb(logDebug, _FMT("Initialized configuration "<<configuration));
     return 0;
 }
@@ -356,6 +1108,9 @@ static int         resize_factory_open_in                (stream_obj* stream)
 static size_t      resize_factory_get_width          (stream_obj* stream)
 {
     DECLARE_RESIZEFACTORY_FILTER(stream, rszfactory);
+    if ( rszfactory->rotationActive == 90 || rszfactory->rotationActive == 270 ) {
+        return resize_base_get_height(rszfactory);
+    }
     return resize_base_get_width(rszfactory);
 }
 
@@ -363,6 +1118,9 @@ static size_t      resize_factory_get_width          (stream_obj* stream)
 static size_t      resize_factory_get_height         (stream_obj* stream)
 {
     DECLARE_RESIZEFACTORY_FILTER(stream, rszfactory);
+    if ( rszfactory->rotationActive == 90 || rszfactory->rotationActive == 270 ) {
+        return resize_base_get_width(rszfactory);
+    }
     return resize_base_get_height(rszfactory);
 }
 
@@ -388,11 +1146,19 @@ static int         resize_factory_read_frame        (stream_obj* stream,
         }
     }
 
+    int res;
     if ( rszfactory->passthrough ) {
-        return default_read_frame(stream, frame);
+        res = default_read_frame(stream, frame);
+    } else {
+        res = rszfactory->implApi->read_frame(rszfactory->impl, frame);
+        if ( res >= 0 && rszfactory->trialBackend >= 0 ) {
+            _resize_factory_calibrate(rszfactory);
+        }
     }
-
-    return rszfactory->implApi->read_frame(rszfactory->impl, frame);
+    if ( res >= 0 && rszfactory->rotationActive ) {
+        _resize_factory_rotate(rszfactory, frame);
+    }
+    return res;
 }
 
 //-----------------------------------------------------------------------------
@@ -414,6 +1180,7 @@ static void resize_factory_destroy         (stream_obj* stream)
 {
     DECLARE_RESIZEFACTORY_FILTER_V(stream, rszfactory);
     rszfactory->logCb(logTrace, _FMT("Destroying stream object " << (void*)stream));
+    destroy_frame_allocator( &rszfactory->fa, rszfactory->logCb );
     stream_destroy( stream );
 }
 
@@ -48,6 +48,7 @@
 
 #define FF_FILTER_MAGIC 0x1270
 static bool _gInitialized = false;
+static const int kDefaultMaxCacheSizeMb = 128;
 
 using namespace std;
 
@@ -55,6 +56,17 @@ using namespace std;
 typedef std::list<frame_obj*> FrameList;
 typedef FrameList::iterator FrameIter;
 
+//-----------------------------------------------------------------------------
+// One decoded GOP: frames from the keyframe at firstPts, up to (but not
+// including) endPts, in decode order
+typedef struct rev_gop {
+    INT64_T     firstPts;
+    INT64_T     endPts;
+    FrameList   frames;
+    size_t      size;
+} rev_gop;
+typedef std::list<rev_gop*> GopList;    // most recently used first
+
 
 //-----------------------------------------------------------------------------
 typedef struct fs_filter  : public stream_base  {
@@ -64,6 +76,13 @@ typedef struct fs_filter  : public stream_base  {
     INT64_T        firstPts;
     INT64_T        duration;
     int            eof;
+
+    frame_allocator* fa;
+    GopList*       gops;
+    size_t         gopsSize;
+    int            maxCacheSizeMb;
+    int            cacheHits;
+    int            cacheMisses;
 } ff_filter_obj;
 
 //-----------------------------------------------------------------------------
@@ -82,6 +101,9 @@ static int         ff_stream_get_param          (stream_obj* stream,
                                                 void* value,
                                                 size_t* size);
 static int         ff_filter_open_in            (stream_obj* stream);
+static int         ff_filter_seek               (stream_obj* stream,
+                                                INT64_T offset,
+                                                int flags);
 static int         ff_filter_read_frame         (stream_obj* stream, frame_obj** frame);
 static int         ff_filter_close              (stream_obj* stream);
 static void        ff_filter_destroy            (stream_obj* stream);
@@ -101,7 +123,7 @@ stream_api_t _g_rev_reader_filter_provider = {
     ff_filter_set_param,
     ff_stream_get_param,
     ff_filter_open_in,
-    get_default_stream_api()->seek,
+    ff_filter_seek,
     get_default_stream_api()->get_width,
     get_default_stream_api()->get_height,
     get_default_stream_api()->get_pixel_format,
@@ -132,9 +154,116 @@ static stream_obj*   ff_filter_create                (const char* name)
     res->eof = 0;
     res->duration = 0;
     res->firstPtsInList = 0;
+    res->fa = create_frame_allocator(_STR("revreader_"<<name));
+    res->gops = new GopList;
+    res->gopsSize = 0;
+    res->maxCacheSizeMb = kDefaultMaxCacheSizeMb;
+    res->cacheHits = 0;
+    res->cacheMisses = 0;
     return (stream_obj*)res;
 }
 
+//-----------------------------------------------------------------------------
+static void        _rev_free_frames             (FrameList* frames)
+{
+    while (frames->size()) {
+        frame_obj* f = frames->front();
+        frames->pop_front();
+        frame_unref(&f);
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void        _rev_clear_cache             (ff_filter_obj* fffilter)
+{
+    while (fffilter->gops->size()) {
+        rev_gop* gop = fffilter->gops->front();
+        fffilter->gops->pop_front();
+        _rev_free_frames(&gop->frames);
+        delete gop;
+    }
+    fffilter->gopsSize = 0;
+}
+
+//-----------------------------------------------------------------------------
+// Decoded frames are copied into frames from our own pool, so that holding
+// a few GOPs doesn't starve the decoder of its buffers
+static frame_obj*  _rev_pool_frame              (ff_filter_obj* fffilter,
+                                                frame_obj* f)
+{
+    frame_api*  api = frame_get_api(f);
+    size_t      dataSize = api->get_data_size(f);
+    const void* data = api->get_data(f);
+    if ( data == NULL || dataSize == 0 ) {
+        return f;
+    }
+
+    basic_frame_obj* res = alloc_basic_frame2(FF_FILTER_MAGIC,
+                                            dataSize,
+                                            fffilter->logCb,
+                                            fffilter->fa );
+    if ( res == NULL ) {
+        return f;
+    }
+    res->pts = api->get_pts(f);
+    res->dts = api->get_dts(f);
+    res->keyframe = api->get_keyframe_flag(f);
+    res->width = api->get_width(f);
+    res->height = api->get_height(f);
+    res->pixelFormat = api->get_pixel_format(f);
+    res->mediaType = mediaVideo;
+    res->dataSize = dataSize;
+    memcpy(res->data, data, dataSize);
+    frame_unref(&f);
+    return (frame_obj*)res;
+}
+
+//-----------------------------------------------------------------------------
+// Finds a cached GOP holding every frame up to, and including, pts
+static rev_gop*    _rev_find_gop                (ff_filter_obj* fffilter,
+                                                INT64_T pts)
+{
+    for (GopList::iterator it = fffilter->gops->begin(); it != fffilter->gops->end(); it++) {
+        rev_gop* gop = *it;
+        if ( gop->firstPts <= pts && pts < gop->endPts ) {
+            fffilter->gops->erase(it);
+            fffilter->gops->push_front(gop);
+            return gop;
+        }
+    }
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Caches refs to the frames about to be served; least recently used GOPs are
+// evicted to stay within the cap (the newest one is always kept)
+static void        _rev_cache_gop               (ff_filter_obj* fffilter,
+                                                INT64_T firstPts,
+                                                INT64_T endPts)
+{
+    size_t   maxSize = (size_t)fffilter->maxCacheSizeMb*1024*1024;
+    rev_gop* gop = new rev_gop;
+    gop->firstPts = firstPts;
+    gop->endPts = endPts;
+    gop->size = 0;
+    for (FrameIter it = fffilter->frames->begin(); it != fffilter->frames->end(); it++) {
+        frame_ref(*it);
+        gop->frames.push_back(*it);
+        gop->size += frame_get_api(*it)->get_data_size(*it);
+    }
+    fffilter->gops->push_front(gop);
+    fffilter->gopsSize += gop->size;
+
+    while ( fffilter->gops->size() > 1 && fffilter->gopsSize > maxSize ) {
+        rev_gop* last = fffilter->gops->back();
+        fffilter->gops->pop_back();
+        fffilter->gopsSize -= last->size;
+        TRACE(_FMT("Evicting GOP firstPts=" << last->firstPts << " endPts=" << last->endPts));
+        _rev_free_frames(&last->frames);
+        delete last;
+    }
+}
+
 //-----------------------------------------------------------------------------
 static int         ff_filter_set_param             (stream_obj* stream,
                                             const CHAR_T* name,
@@ -142,7 +271,7 @@ static int         ff_filter_set_param             (stream_obj* stream,
 {
     DECLARE_FF_FILTER(stream, fffilter);
     name = stream_param_name_apply_scope(stream, name);
-
+    SET_PARAM_IF(stream, name, "maxCacheSizeMb", int, fffilter->maxCacheSizeMb);
     return default_set_param(stream, name, value);
 }
 
@@ -155,6 +284,9 @@ static int         ff_stream_get_param          (stream_obj* stream,
     DECLARE_FF_FILTER(stream, fffilter);
     name = stream_param_name_apply_scope(stream, name);
     COPY_PARAM_IF(fffilter, name, "eof", int, fffilter->eof);
+    COPY_PARAM_IF(fffilter, name, "cacheHits", int, fffilter->cacheHits);
+    COPY_PARAM_IF(fffilter, name, "cacheMisses", int, fffilter->cacheMisses);
+    COPY_PARAM_IF(fffilter, name, "gopsCached", int, (int)fffilter->gops->size());
     return default_get_param(stream, name, value, size);
 
 }
@@ -197,6 +329,21 @@ static int         ff_filter_open_in                (stream_obj* stream)
     return res;
 }
 
+//-----------------------------------------------------------------------------
+// Repositions reverse playback, so that the next frame returned is the last
+// one at or before offset. The actual seek happens on next refill, unless
+// the GOP is already in the cache.
+static int         ff_filter_seek               (stream_obj* stream,
+                                                INT64_T offset,
+                                                int flags)
+{
+    DECLARE_FF_FILTER(stream, fffilter);
+    _rev_free_frames(fffilter->frames);
+    fffilter->lastPtsProcessed = offset + 1;
+    fffilter->eof = 0;
+    TRACE(_FMT("Seeking to " << offset));
+    return 0;
+}
 
 //-----------------------------------------------------------------------------
 static int         ff_filter_read_frame        (stream_obj* stream,
@@ -210,6 +357,24 @@ static int         ff_filter_read_frame        (stream_obj* stream,
             fffilter->eof = 1;
             return -1;
         }
+
+        rev_gop* cached = _rev_find_gop(fffilter, fffilter->lastPtsProcessed - 1);
+        if ( cached != NULL ) {
+            for (FrameIter it = cached->frames.begin(); it != cached->frames.end(); it++) {
+                if ( frame_get_api(*it)->get_pts(*it) < fffilter->lastPtsProcessed ) {
+                    frame_ref(*it);
+                    fffilter->frames->push_back(*it);
+                }
+            }
+            fffilter->cacheHits++;
+            TRACE(_FMT("Serving GOP from cache: count=" << fffilter->frames->size() <<
+                                " firstPts=" << cached->firstPts <<
+                                " prevPts=" << fffilter->lastPtsProcessed));
+            fffilter->lastPtsProcessed = cached->firstPts;
+        }
+    }
+
+    if (fffilter->frames->empty()) {
         static  const int seekRetryDelta = 5;
         int     delta = 1;
         int64_t nextSeekPts = fffilter->lastPtsProcessed - delta,
@@ -265,6 +430,7 @@ Retry:
                             firstPtsRead = pts;
                         if ( pts <= nextPts ) {
                             TRACE(_FMT("Read frame pts="<< pts << " ptr=" << (void*)f));
+                            f = _rev_pool_frame(fffilter, f);
                             fffilter->frames->push_back(f);
                             added = true;
                         }
@@ -285,6 +451,10 @@ Retry:
                                 " firstPts=" << firstPtsRead <<
                                 " lastPts=" << lastPtsRead <<
                                 " prevPts=" << fffilter->lastPtsProcessed));
+        fffilter->cacheMisses++;
+        if ( !fffilter->frames->empty() ) {
+            _rev_cache_gop(fffilter, firstPtsRead, fffilter->lastPtsProcessed);
+        }
         fffilter->lastPtsProcessed = firstPtsRead;
     }
 
@@ -307,12 +477,11 @@ static void ff_filter_destroy         (stream_obj* stream)
 {
     DECLARE_FF_FILTER_V(stream, fffilter);
     fffilter->logCb(logTrace, _FMT("Destroying stream object " << (void*)stream));
-    while (fffilter->frames->size()) {
-        frame_obj* f = fffilter->frames->front();
-        fffilter->frames->pop_front();
-        frame_unref(&f);
-    }
+    _rev_free_frames(fffilter->frames);
     delete fffilter->frames;
+    _rev_clear_cache(fffilter);
+    delete fffilter->gops;
+    destroy_frame_allocator( &fffilter->fa, fffilter->logCb );
     ff_filter_close(stream); // make sure all the internals had been freed
     stream_destroy( stream );
 }
@@ -0,0 +1,375 @@
+/*****************************************************************************
+ *
+ * stream_seek_cache.cpp
+ *   Node taking clip seeks straight to the governing keyframe, using a frame
+ *   table, and keeping frames decoded on the way to the target.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#undef SV_MODULE_VAR
+#define SV_MODULE_VAR seekcache
+#define SV_MODULE_ID "SEEKCACHE"
+#include "sv_module_def.hpp"
+
+#include "streamprv.h"
+#include "clip_index.h"
+
+#include <deque>
+
+#include "videolibUtils.h"
+
+#define SEEKCACHE_FILTER_MAGIC 0x1227
+static const int kDefaultMaxCacheSizeMb = 64;
+
+//-----------------------------------------------------------------------------
+typedef struct seekcache_filter  : public stream_base  {
+    char*                   indexFile;      // media file, for locating the sidecar index
+    int                     keyframeOnly;
+    int                     maxCacheSizeMb;
+
+    clip_index*             index;
+    int                     indexQueried;
+
+    // Contiguous run of decoded video frames. The source is always positioned
+    // right after the last one.
+    std::deque<frame_obj*>* frames;
+    size_t                  framesSize;
+    size_t                  nextFrame;      // position in frames to serve next
+    INT64_T                 seekTarget;     // pts pending seek needs to decode up to
+
+    int                     cacheHits;
+    int                     cacheMisses;
+} seekcache_filter_obj;
+
+//-----------------------------------------------------------------------------
+// Stream API
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+//  Forward declarations
+//-----------------------------------------------------------------------------
+static stream_obj* seekcache_filter_create             (const char* name);
+static int         seekcache_filter_set_param          (stream_obj* stream,
+                                                const CHAR_T* name,
+                                                const void* value);
+static int         seekcache_filter_seek               (stream_obj* stream,
+                                                INT64_T offset,
+                                                int flags);
+static int         seekcache_filter_get_param          (stream_obj* stream,
+                                                const CHAR_T* name,
+                                                void* value,
+                                                size_t* size);
+static int         seekcache_filter_read_frame         (stream_obj* stream, frame_obj** frame);
+static int         seekcache_filter_close              (stream_obj* stream);
+static void        seekcache_filter_destroy            (stream_obj* stream);
+
+
+//-----------------------------------------------------------------------------
+stream_api_t _g_seekcache_filter_provider = {
+    seekcache_filter_create,
+    get_default_stream_api()->set_source,
+    get_default_stream_api()->set_log_cb,
+    get_default_stream_api()->get_name,
+    get_default_stream_api()->find_element,
+    get_default_stream_api()->remove_element,
+    get_default_stream_api()->insert_element,
+    seekcache_filter_set_param,
+    seekcache_filter_get_param,
+    get_default_stream_api()->open_in,
+    seekcache_filter_seek,
+    get_default_stream_api()->get_width,
+    get_default_stream_api()->get_height,
+    get_default_stream_api()->get_pixel_format,
+    seekcache_filter_read_frame,
+    get_default_stream_api()->print_pipeline,
+    seekcache_filter_close,
+    _set_module_trace_level
+};
+
+
+//-----------------------------------------------------------------------------
+#define DECLARE_SEEKCACHE_FILTER(stream, name) \
+    DECLARE_OBJ(seekcache_filter_obj, name,  stream, SEEKCACHE_FILTER_MAGIC, -1)
+
+#define DECLARE_SEEKCACHE_FILTER_V(stream, name) \
+    DECLARE_OBJ_V(seekcache_filter_obj, name,  stream, SEEKCACHE_FILTER_MAGIC)
+
+static stream_obj*   seekcache_filter_create                (const char* name)
+{
+    seekcache_filter_obj* res = (seekcache_filter_obj*)stream_init(sizeof(seekcache_filter_obj),
+                SEEKCACHE_FILTER_MAGIC,
+                &_g_seekcache_filter_provider,
+                name,
+                seekcache_filter_destroy );
+    res->indexFile = NULL;
+    res->keyframeOnly = 0;
+    res->maxCacheSizeMb = kDefaultMaxCacheSizeMb;
+    res->index = NULL;
+    res->indexQueried = 0;
+    res->frames = new std::deque<frame_obj*>;
+    res->framesSize = 0;
+    res->nextFrame = 0;
+    res->seekTarget = INVALID_PTS;
+    res->cacheHits = 0;
+    res->cacheMisses = 0;
+
+    return (stream_obj*)res;
+}
+
+//-----------------------------------------------------------------------------
+static void        _seekcache_clear                 (seekcache_filter_obj* sc)
+{
+    while ( !sc->frames->empty() ) {
+        frame_obj* f = sc->frames->front();
+        sc->frames->pop_front();
+        frame_unref(&f);
+    }
+    sc->framesSize = 0;
+    sc->nextFrame = 0;
+    sc->seekTarget = INVALID_PTS;
+}
+
+//-----------------------------------------------------------------------------
+// Takes ownership of the frame; evicts from the front to stay within the cap
+static void        _seekcache_append                (seekcache_filter_obj* sc,
+                                                    frame_obj* f)
+{
+    size_t maxSize = (size_t)sc->maxCacheSizeMb*1024*1024;
+
+    sc->frames->push_back(f);
+    sc->framesSize += frame_get_api(f)->get_data_size(f);
+    while ( sc->frames->size() > 1 && sc->framesSize > maxSize ) {
+        frame_obj* front = sc->frames->front();
+        sc->frames->pop_front();
+        sc->framesSize -= frame_get_api(front)->get_data_size(front);
+        frame_unref(&front);
+        if ( sc->nextFrame > 0 ) {
+            sc->nextFrame--;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Frame table comes from the sidecar index if there's one, from the
+// container's own index otherwise. Only looked up once per open.
+static clip_index* _seekcache_get_index             (seekcache_filter_obj* sc)
+{
+    if ( sc->indexQueried ) {
+        return sc->index;
+    }
+    sc->indexQueried = 1;
+
+    if ( sc->indexFile ) {
+        sc->index = clip_index_open(sc->indexFile, sc->logCb);
+    }
+    if ( sc->index == NULL ) {
+        clip_index* index = NULL;
+        size_t      size = sizeof(clip_index*);
+        if ( default_get_param((stream_obj*)sc, "containerFrameIndex", &index, &size) >= 0 ) {
+            sc->index = index;
+        }
+    }
+    if ( sc->index != NULL && clip_index_get_count(sc->index) == 0 ) {
+        clip_index_close(&sc->index);
+    }
+    TRACE(_FMT("Frame table " << (sc->index ? "available" : "not available") <<
+                " for " << (sc->indexFile ? sc->indexFile : "stream") <<
+                ": entries=" << (sc->index ? clip_index_get_count(sc->index) : 0)));
+    return sc->index;
+}
+
+//-----------------------------------------------------------------------------
+static int         seekcache_filter_set_param             (stream_obj* stream,
+                                            const CHAR_T* name,
+                                            const void* value)
+{
+    DECLARE_SEEKCACHE_FILTER(stream, sc);
+    name = stream_param_name_apply_scope(stream, name);
+    if ( !_stricmp(name, "indexFile") ) {
+        free(sc->indexFile);
+        sc->indexFile = value ? strdup((const char*)value) : NULL;
+        clip_index_close(&sc->index);
+        sc->indexQueried = 0;
+        return 0;
+    }
+    if ( !_stricmp(name, "flush") ) {
+        // cached frames no longer match what's downstream of us (e.g. output
+        // size had changed); if some of them haven't been served yet, the source
+        // has to be taken back to the first of those
+        INT64_T resumePts = INVALID_PTS;
+        if ( sc->nextFrame < sc->frames->size() ) {
+            frame_obj* f = (*sc->frames)[sc->nextFrame];
+            resumePts = frame_get_api(f)->get_pts(f);
+        }
+        _seekcache_clear(sc);
+        if ( resumePts != INVALID_PTS ) {
+            return seekcache_filter_seek(stream, resumePts, sfBackward|sfPrecise);
+        }
+        return 0;
+    }
+    SET_PARAM_IF(stream, name, "keyframeOnly", int, sc->keyframeOnly);
+    SET_PARAM_IF(stream, name, "maxCacheSizeMb", int, sc->maxCacheSizeMb);
+    return default_set_param(stream, name, value);
+}
+
+//-----------------------------------------------------------------------------
+static int         seekcache_filter_get_param             (stream_obj* stream,
+                                            const CHAR_T* name,
+                                            void* value,
+                                            size_t* size)
+{
+    DECLARE_SEEKCACHE_FILTER(stream, sc);
+    name = stream_param_name_apply_scope(stream, name);
+    COPY_PARAM_IF(sc, name, "hasFrameIndex", int, _seekcache_get_index(sc) != NULL);
+    COPY_PARAM_IF(sc, name, "cacheHits", int, sc->cacheHits);
+    COPY_PARAM_IF(sc, name, "cacheMisses", int, sc->cacheMisses);
+    COPY_PARAM_IF(sc, name, "framesCached", int, (int)sc->frames->size());
+    return default_get_param(stream, name, value, size);
+}
+
+//-----------------------------------------------------------------------------
+static int         seekcache_filter_seek               (stream_obj* stream,
+                                                       INT64_T offset,
+                                                       int flags)
+{
+    DECLARE_SEEKCACHE_FILTER(stream, sc);
+    clip_index* index = _seekcache_get_index(sc);
+    int         pos = -1;
+
+    // only precise seeks have a specific frame in mind
+    if ( index != NULL && (flags & sfPrecise) ) {
+        pos = clip_index_find(index, offset, sc->keyframeOnly);
+    }
+    if ( pos < 0 ) {
+        _seekcache_clear(sc);
+        return default_seek(stream, offset, flags);
+    }
+
+    INT64_T target = clip_index_get_pts(index, pos);
+    for (size_t nI=0; nI<sc->frames->size(); nI++) {
+        frame_obj* f = (*sc->frames)[nI];
+        if ( frame_get_api(f)->get_pts(f) == target ) {
+            sc->nextFrame = nI;
+            sc->seekTarget = INVALID_PTS;
+            sc->cacheHits++;
+            TRACE(_FMT("Seek to " << offset << " served from cache: pts=" << target));
+            return 0;
+        }
+    }
+
+    sc->cacheMisses++;
+    _seekcache_clear(sc);
+
+    int     key = clip_index_get_keyframe(index, pos);
+    INT64_T keyPts = ( key >= 0 ) ? clip_index_get_pts(index, key) : target;
+    // not precise -- the frames leading up to the target are what we're after
+    int res = default_seek(stream, keyPts, sfBackward);
+    if ( res >= 0 ) {
+        sc->seekTarget = target;
+    }
+    TRACE(_FMT("Seek to " << offset << ": target=" << target << " keyframe=" << keyPts << " res=" << res));
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+static int         seekcache_filter_read_frame        (stream_obj* stream,
+                                                    frame_obj** frame)
+{
+    DECLARE_SEEKCACHE_FILTER(stream, sc);
+    int res;
+
+    *frame = NULL;
+    if ( sc->nextFrame < sc->frames->size() ) {
+        *frame = (*sc->frames)[sc->nextFrame++];
+        frame_ref(*frame);
+        return 0;
+    }
+
+    while (true) {
+        frame_obj*   tmp = NULL;
+        frame_api_t* frameApi;
+        res = default_read_frame(stream, &tmp);
+        if ( res < 0 || tmp == NULL ) {
+            *frame = tmp;
+            sc->seekTarget = INVALID_PTS;
+            return res;
+        }
+
+        frameApi = frame_get_api(tmp);
+        if ( frameApi->get_media_type(tmp) != mediaVideo ) {
+            if ( sc->seekTarget != INVALID_PTS ) {
+                // precedes the frame seek was meant to land on
+                frame_unref(&tmp);
+                continue;
+            }
+            *frame = tmp;
+            return 0;
+        }
+
+        INT64_T pts = frameApi->get_pts(tmp);
+        _seekcache_append(sc, tmp);
+        if ( sc->seekTarget != INVALID_PTS && pts < sc->seekTarget ) {
+            continue;
+        }
+
+        sc->seekTarget = INVALID_PTS;
+        sc->nextFrame = sc->frames->size();
+        *frame = sc->frames->back();
+        frame_ref(*frame);
+        return 0;
+    }
+}
+
+//-----------------------------------------------------------------------------
+static int         seekcache_filter_close             (stream_obj* stream)
+{
+    DECLARE_SEEKCACHE_FILTER(stream, sc);
+    _seekcache_clear(sc);
+    clip_index_close(&sc->index);
+    sc->indexQueried = 0;
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+static void seekcache_filter_destroy         (stream_obj* stream)
+{
+    DECLARE_SEEKCACHE_FILTER_V(stream, sc);
+    sc->logCb(logTrace, _FMT("Destroying stream object " << (void*)stream));
+    seekcache_filter_close(stream); // make sure all the internals had been freed
+    delete sc->frames;
+    free(sc->indexFile);
+    stream_destroy( stream );
+}
+
+//-----------------------------------------------------------------------------
+SVVIDEOLIB_API stream_api_t*     get_seek_cache_api                    ()
+{
+    return &_g_seekcache_filter_provider;
+}
@@ -41,14 +41,58 @@
 #include "sv_module_def.hpp"
 
 #include "streamprv.h"
+#include "sv_internal.h"
 
 
 #include "videolibUtils.h"
+#include "frame_props.h"
 
 #include <list>
+#include <mutex>
 
 #define SPLITTER_DEMUX_MAGIC 0x1275
 
+static const int kDefaultAsyncQueueSize = 30;
+// how often a blocked producer rechecks whether the worker is still there
+static const int kAsyncBlockWaitMs = 100;
+// deepest nesting of splitters one thread may be running subgraphs of
+static const int kMaxNestedSplitters = 8;
+static const int kFpsAccumulatorSize = 64;
+// decisions a gate remembers, for splitters seeing its frames later than others
+static const int kFpsGateHistory = 64;
+
+// What async mode does, when the subgraph falls behind by more than maxQueueSize
+enum {
+    splitterOverflowBlock = 0,          // wait for the subgraph
+    splitterOverflowDropOldest,         // for branches of independent frames (decoded video)
+    splitterOverflowDropToKeyframe,     // for branches of compressed video
+};
+
+struct splitter_stream;
+
+// One fps_limiter decision shared by all the splitters of a pipeline limiting
+// to the same rate: the first one to see a frame decides, the rest look it up
+typedef struct splitter_fps_gate {
+    const void*     pipeline;           // head of the graph the frames come from
+    int             fps;
+    int             useWallClock;
+    int             useSecondIntervals;
+    fps_limiter*    limiter;
+    INT64_T         pts[kFpsGateHistory];
+    bool            accepted[kFpsGateHistory];
+    int             historySize;
+    int             historyPos;
+    int             refs;
+} splitter_fps_gate;
+
+static std::mutex                       _gFpsGatesMutex;
+static std::list<splitter_fps_gate*>    _gFpsGates;
+
+// Splitters whose subgraph is being run on this thread, innermost last:
+// reads coming from one of these are the subgraph asking for its input
+static thread_local splitter_stream*   _gRunningSplitters[kMaxNestedSplitters];
+static thread_local int                _gRunningSplitterCount = 0;
+
 typedef struct splitter_stream  : public stream_base  {
     FrameList*      source_frames;
     stream_api_t*   subgraph_api;
@@ -60,6 +104,27 @@ typedef struct splitter_stream  : public stream_base  {
     bool            subgraph_set_log_cb;
     bool            flushing_subgraph;
     sv_mutex*       subgraphMutex;
+
+    // async mode: the subgraph runs on a worker thread of its own, fed
+    // through source_frames, rather than from within our read_frame
+    int             async;
+    int             maxQueueSize;
+    int             overflowPolicy;
+    sv_thread*      worker;
+    sv_mutex*       queueMutex;         // guards source_frames and the fields below
+    sv_event*       queueEvent;         // set when frames are queued, or the worker is to exit
+    sv_event*       spaceEvent;         // set when the worker takes a frame
+    bool            workerExiting;
+    bool            dropUntilKeyframe;
+    int             framesDropped;
+
+    // rate limit of the subgraph, applied before frames are queued for it;
+    // guarded by _gFpsGatesMutex
+    int             fps;
+    int             fpsUseWallClock;
+    int             fpsUseSecondIntervals;
+    splitter_fps_gate* fpsGate;
+    int             framesSkipped;
 } splitter_stream_obj;
 
 
@@ -86,6 +151,8 @@ static void        splitter_stream_destroy            (stream_obj* stream);
 
 static int         _splitter_generate_frame           (splitter_stream_obj* splitter);
 static int         _splitter_open_subgraph            (splitter_stream_obj* splitter);
+static void        _splitter_stop_worker              (splitter_stream_obj* splitter);
+static void        _splitter_release_fps_gate         (splitter_stream_obj* splitter);
 
 //-----------------------------------------------------------------------------
 stream_api_t _g_splitter_stream_provider = {
@@ -135,6 +202,23 @@ static stream_obj*   splitter_stream_create                (const char* name)
     res->subgraph_set_log_cb = false;
     res->flushing_subgraph = false;
     res->subgraphMutex = sv_mutex_create();
+
+    res->async = 0;
+    res->maxQueueSize = kDefaultAsyncQueueSize;
+    res->overflowPolicy = splitterOverflowBlock;
+    res->worker = NULL;
+    res->queueMutex = sv_mutex_create();
+    res->queueEvent = sv_event_create(0, 0);
+    res->spaceEvent = sv_event_create(0, 0);
+    res->workerExiting = false;
+    res->dropUntilKeyframe = false;
+    res->framesDropped = 0;
+
+    res->fps = 0;
+    res->fpsUseWallClock = 0;
+    res->fpsUseSecondIntervals = 1;
+    res->fpsGate = NULL;
+    res->framesSkipped = 0;
     return (stream_obj*)res;
 }
 
@@ -201,9 +285,13 @@ static int        _splitter_subgraph_assign              (splitter_stream_obj* s
             }
         }
     } else {
+        sv_mutex_enter(splitter->queueMutex);
         frame_list_clear(splitter->source_frames);
+        sv_mutex_exit(splitter->queueMutex);
     }
 
+    // handles crossing into the subgraph must find the new one
+    stream_param_graph_changed();
     sv_mutex_exit(splitter->subgraphMutex);
 
     return res;
@@ -247,6 +335,19 @@ static int         splitter_stream_set_param             (stream_obj* stream,
         return _splitter_subgraph_assign(splitter, (stream_obj*)value);
     }
 
+    SET_PARAM_IF(stream, name, "async", int, splitter->async);
+    SET_PARAM_IF(stream, name, "maxQueueSize", int, splitter->maxQueueSize);
+    SET_PARAM_IF(stream, name, "overflowPolicy", int, splitter->overflowPolicy);
+    if ( !_stricmp(name, "fps") ||
+         !_stricmp(name, "fpsUseWallClock") ||
+         !_stricmp(name, "fpsUseSecondIntervals") ) {
+        // takes effect with the next frame, which looks up the gate again
+        std::lock_guard<std::mutex> guard(_gFpsGatesMutex);
+        SET_PARAM_IF(stream, name, "fps", int, splitter->fps);
+        SET_PARAM_IF(stream, name, "fpsUseWallClock", int, splitter->fpsUseWallClock);
+        SET_PARAM_IF(stream, name, "fpsUseSecondIntervals", int, splitter->fpsUseSecondIntervals);
+    }
+
     return default_set_param(stream, name, value);
 }
 
@@ -269,6 +370,9 @@ static int         splitter_stream_get_param             (stream_obj* stream,
         return res;
     }
     COPY_PARAM_IF(splitter, name, "subgraph", stream_obj*, splitter->subgraph);
+    COPY_PARAM_IF_SAFE(splitter, name, "framesDropped", int, splitter->framesDropped, splitter->queueMutex);
+    COPY_PARAM_IF_SAFE(splitter, name, "framesQueued", int, (int)splitter->source_frames->size(), splitter->queueMutex);
+    COPY_PARAM_IF(splitter, name, "framesSkipped", int, splitter->framesSkipped);
     return default_get_param(stream, name, value, size);
 }
 
@@ -314,6 +418,10 @@ static int         _splitter_run_subgraph          (splitter_stream_obj* splitte
     frame_obj*  tmp = NULL;
     int         res;
     int         gotFrame = 0;
+    bool        tracked = _gRunningSplitterCount < kMaxNestedSplitters;
+    if ( tracked ) {
+        _gRunningSplitters[_gRunningSplitterCount++] = splitter;
+    }
     splitter->subgraph_read = true;
     do {
         res = splitter->subgraph_api->read_frame(splitter->subgraph, &tmp);
@@ -321,12 +429,282 @@ static int         _splitter_run_subgraph          (splitter_stream_obj* splitte
         frame_unref(&tmp);
     } while ( gotFrame );
     splitter->subgraph_read = false;
+    if ( tracked ) {
+        _gRunningSplitterCount--;
+    }
 
     sv_mutex_exit(splitter->subgraphMutex);
 
     return res;
 }
 
+//-----------------------------------------------------------------------------
+// Whether this thread is running the subgraph of the splitter
+static bool        _splitter_runs_on_this_thread   (splitter_stream_obj* splitter)
+{
+    if ( _gRunningSplitterCount >= kMaxNestedSplitters ) {
+        // nesting too deep to track -- go by the flag alone, as in sync mode
+        return splitter->subgraph_read;
+    }
+    for (int nI=0; nI<_gRunningSplitterCount; nI++) {
+        if ( _gRunningSplitters[nI] == splitter ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+static void*       _splitter_worker_thread_func    (void* param)
+{
+    splitter_stream_obj* splitter = (splitter_stream_obj*)param;
+    TRACE(_FMT("Starting worker thread for " << splitter->name));
+
+    while (true) {
+        sv_mutex_enter(splitter->queueMutex);
+        if ( splitter->source_frames->empty() ) {
+            if ( splitter->workerExiting ) {
+                sv_mutex_exit(splitter->queueMutex);
+                break;
+            }
+            sv_event_reset(splitter->queueEvent);
+            sv_mutex_exit(splitter->queueMutex);
+            sv_event_wait(splitter->queueEvent, 0);
+            continue;
+        }
+        size_t queued = splitter->source_frames->size();
+        sv_mutex_exit(splitter->queueMutex);
+
+        _splitter_run_subgraph(splitter);
+
+        sv_mutex_enter(splitter->queueMutex);
+        if ( splitter->source_frames->size() >= queued ) {
+            // the subgraph didn't take anything -- don't spin on it
+            if ( splitter->workerExiting ) {
+                sv_mutex_exit(splitter->queueMutex);
+                break;
+            }
+            sv_event_reset(splitter->queueEvent);
+            sv_mutex_exit(splitter->queueMutex);
+            sv_event_wait(splitter->queueEvent, kAsyncBlockWaitMs);
+            continue;
+        }
+        sv_mutex_exit(splitter->queueMutex);
+    }
+
+    TRACE(_FMT("Exiting worker thread for " << splitter->name));
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Hands the frame over to the worker, applying the overflow policy if the
+// subgraph is too far behind. Takes over the caller's reference.
+static void        _splitter_queue_frame           (splitter_stream_obj* splitter,
+                                                   frame_obj* frame)
+{
+    bool         isVideo = (frame_props_media_type(frame) == mediaVideo);
+    int          warned = 0;
+
+    sv_mutex_enter(splitter->queueMutex);
+    if ( splitter->worker == NULL ) {
+        splitter->workerExiting = false;
+        splitter->worker = sv_thread_create(_splitter_worker_thread_func, splitter);
+    }
+
+    if ( splitter->dropUntilKeyframe ) {
+        if ( isVideo && frame_props_keyframe(frame) > 0 &&
+             (int)splitter->source_frames->size() < splitter->maxQueueSize ) {
+            splitter->logCb(logInfo, _FMT("Subgraph of " << splitter->name << " caught up; resuming after dropping " <<
+                                    splitter->framesDropped << " frames so far"));
+            splitter->dropUntilKeyframe = false;
+        } else {
+            splitter->framesDropped++;
+            sv_mutex_exit(splitter->queueMutex);
+            frame_unref(&frame);
+            return;
+        }
+    }
+
+    while ( (int)splitter->source_frames->size() >= splitter->maxQueueSize &&
+            splitter->maxQueueSize > 0 ) {
+        if ( splitter->overflowPolicy == splitterOverflowDropOldest ) {
+            frame_obj* oldest = splitter->source_frames->front();
+            splitter->source_frames->pop_front();
+            frame_unref(&oldest);
+            splitter->framesDropped++;
+            continue;
+        }
+        if ( splitter->overflowPolicy == splitterOverflowDropToKeyframe ) {
+            splitter->logCb(logWarning, _FMT("Subgraph of " << splitter->name << " is " <<
+                                    splitter->source_frames->size() << " frames behind; dropping until the next keyframe"));
+            splitter->dropUntilKeyframe = true;
+            splitter->framesDropped++;
+            sv_mutex_exit(splitter->queueMutex);
+            frame_unref(&frame);
+            return;
+        }
+        if ( !warned++ ) {
+            splitter->logCb(logWarning, _FMT("Subgraph of " << splitter->name << " is " <<
+                                    splitter->source_frames->size() << " frames behind; waiting for it"));
+        }
+        sv_event_reset(splitter->spaceEvent);
+        sv_mutex_exit(splitter->queueMutex);
+        sv_event_wait(splitter->spaceEvent, kAsyncBlockWaitMs);
+        sv_mutex_enter(splitter->queueMutex);
+    }
+
+    splitter->source_frames->push_back(frame);
+    sv_event_set(splitter->queueEvent);
+    sv_mutex_exit(splitter->queueMutex);
+}
+
+//-----------------------------------------------------------------------------
+// Lets the worker run the subgraph through what's queued, and waits for it to exit
+static void        _splitter_stop_worker           (splitter_stream_obj* splitter)
+{
+    sv_mutex_enter(splitter->queueMutex);
+    sv_thread* worker = splitter->worker;
+    splitter->worker = NULL;
+    splitter->workerExiting = true;
+    sv_event_set(splitter->queueEvent);
+    sv_mutex_exit(splitter->queueMutex);
+
+    if ( worker != NULL ) {
+        sv_thread_destroy(&worker);
+        if ( splitter->framesDropped > 0 ) {
+            splitter->logCb(logInfo, _FMT("Worker of " << splitter->name << " stopped: dropped=" <<
+                                    splitter->framesDropped));
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// The graph the splitter's frames originate from: splitters of one camera
+// share gates, those of different cameras mustn't
+static const void* _splitter_get_pipeline          (splitter_stream_obj* splitter)
+{
+    stream_obj* head = splitter->source;
+    while ( head != NULL ) {
+        stream_obj* parent = stream_get_api(head)->find_element(head, NULL);
+        if ( parent == NULL ) {
+            break;
+        }
+        head = parent;
+    }
+    return head;
+}
+
+//-----------------------------------------------------------------------------
+// Called with _gFpsGatesMutex held
+static void        _splitter_release_fps_gate_l    (splitter_stream_obj* splitter)
+{
+    splitter_fps_gate* gate = splitter->fpsGate;
+    splitter->fpsGate = NULL;
+    if ( gate != NULL && --gate->refs == 0 ) {
+        _gFpsGates.remove(gate);
+        fps_limiter_destroy(&gate->limiter);
+        delete gate;
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void        _splitter_release_fps_gate      (splitter_stream_obj* splitter)
+{
+    std::lock_guard<std::mutex> guard(_gFpsGatesMutex);
+    _splitter_release_fps_gate_l(splitter);
+}
+
+//-----------------------------------------------------------------------------
+// Called with _gFpsGatesMutex held
+static splitter_fps_gate* _splitter_get_fps_gate_l (splitter_stream_obj* splitter)
+{
+    const void*        pipeline = _splitter_get_pipeline(splitter);
+    splitter_fps_gate* gate = splitter->fpsGate;
+
+    if ( gate != NULL &&
+         gate->pipeline == pipeline &&
+         gate->fps == splitter->fps &&
+         gate->useWallClock == splitter->fpsUseWallClock &&
+         gate->useSecondIntervals == splitter->fpsUseSecondIntervals ) {
+        return gate;
+    }
+    _splitter_release_fps_gate_l(splitter);
+
+    for (std::list<splitter_fps_gate*>::iterator it = _gFpsGates.begin(); it != _gFpsGates.end(); it++) {
+        gate = *it;
+        if ( gate->pipeline == pipeline &&
+             gate->fps == splitter->fps &&
+             gate->useWallClock == splitter->fpsUseWallClock &&
+             gate->useSecondIntervals == splitter->fpsUseSecondIntervals ) {
+            gate->refs++;
+            splitter->fpsGate = gate;
+            return gate;
+        }
+    }
+
+    gate = new splitter_fps_gate;
+    gate->pipeline = pipeline;
+    gate->fps = splitter->fps;
+    gate->useWallClock = splitter->fpsUseWallClock;
+    gate->useSecondIntervals = splitter->fpsUseSecondIntervals;
+    gate->limiter = fps_limiter_create( kFpsAccumulatorSize, gate->fps );
+    fps_limiter_use_wall_clock(gate->limiter, gate->useWallClock);
+    fps_limiter_use_second_intervals(gate->limiter, gate->useSecondIntervals);
+    gate->historySize = 0;
+    gate->historyPos = 0;
+    gate->refs = 1;
+    _gFpsGates.push_back(gate);
+    splitter->fpsGate = gate;
+    TRACE(_FMT("Created fps gate " << (void*)gate << " fps=" << gate->fps << " for " << splitter->name));
+    return gate;
+}
+
+//-----------------------------------------------------------------------------
+// Whether the rate limit of the subgraph lets the frame through. A limiter at
+// the head of the subgraph configured the same way makes the same decisions,
+// so a frame it would have dropped is never queued for it.
+static bool        _splitter_fps_accept            (splitter_stream_obj* splitter,
+                                                   frame_obj* frame)
+{
+    if ( splitter->fps <= 0 && splitter->fpsGate == NULL ) {
+        return true;
+    }
+
+    if ( frame_props_media_type(frame) != mediaVideo ) {
+        return true;
+    }
+
+    std::lock_guard<std::mutex> guard(_gFpsGatesMutex);
+    if ( splitter->fps <= 0 ) {
+        _splitter_release_fps_gate_l(splitter);
+        return true;
+    }
+
+    splitter_fps_gate* gate = _splitter_get_fps_gate_l(splitter);
+    INT64_T            pts = frame_props_pts(frame);
+
+    for (int nI=0; nI<gate->historySize; nI++) {
+        if ( gate->pts[nI] == pts ) {
+            if ( !gate->accepted[nI] ) {
+                splitter->framesSkipped++;
+            }
+            return gate->accepted[nI];
+        }
+    }
+
+    bool accepted = (fps_limiter_report_frame(gate->limiter, NULL, pts) != 0);
+    gate->pts[gate->historyPos] = pts;
+    gate->accepted[gate->historyPos] = accepted;
+    gate->historyPos = (gate->historyPos + 1) % kFpsGateHistory;
+    if ( gate->historySize < kFpsGateHistory ) {
+        gate->historySize++;
+    }
+    if ( !accepted ) {
+        splitter->framesSkipped++;
+    }
+    return accepted;
+}
+
 //-----------------------------------------------------------------------------
 static int         splitter_stream_read_frame        (stream_obj* stream, frame_obj** frame)
 {
@@ -344,15 +722,19 @@ static int         splitter_stream_read_frame        (stream_obj* stream, frame_
     }
 
     // recursive read from subgraph
-    if ( splitter->subgraph_read ) {
+    if ( splitter->subgraph_read && _splitter_runs_on_this_thread(splitter) ) {
+        sv_mutex_enter(splitter->queueMutex);
         size_t size = splitter->source_frames->size();
         TRACE_C(10, _FMT("reading the source frame in subgraph " << splitter->name <<
                     " - have " << size));
         if ( size > 0 ) {
             *frame = splitter->source_frames->front();
             splitter->source_frames->pop_front();
+            sv_event_set(splitter->spaceEvent);
+            sv_mutex_exit(splitter->queueMutex);
             return 0;
         } else {
+            sv_mutex_exit(splitter->queueMutex);
             *frame = NULL;
             return (splitter->flushing_subgraph?-1:0);
         }
@@ -361,6 +743,20 @@ static int         splitter_stream_read_frame        (stream_obj* stream, frame_
 
     // read and save the next frame from our provider
     res = default_read_frame( stream, frame );
+    if ( res >= 0 && *frame && splitter->subgraph &&
+         !_splitter_fps_accept(splitter, *frame) ) {
+        // the subgraph would have dropped it at its limiter anyway
+        TRACE_C(10, _FMT("Skipping a frame rate limited by subgraph " << splitter->name));
+        return res;
+    }
+    if ( splitter->async ) {
+        if (res >=0 && *frame && splitter->subgraph ) {
+            frame_ref(*frame);
+            _splitter_queue_frame(splitter, *frame);
+        }
+        return res;
+    }
+
     if (res >=0 && *frame && splitter->subgraph ) {
         frame_ref(*frame);
         splitter->source_frames->push_back(*frame);
@@ -381,6 +777,7 @@ static int         splitter_stream_close             (stream_obj* stream)
         return 0;
     }
     TRACE(_FMT("Flushing splitter object " << splitter->name));
+    _splitter_stop_worker(splitter);
     if (splitter->subgraph) {
         splitter->flushing_subgraph = true;
         _splitter_run_subgraph(splitter);
@@ -388,6 +785,7 @@ static int         splitter_stream_close             (stream_obj* stream)
     }
     TRACE(_FMT("Closing splitter object " << splitter->name));
     _splitter_subgraph_assign(splitter, NULL);
+    _splitter_release_fps_gate(splitter);
     return 0;
 }
 
@@ -401,6 +799,9 @@ static void splitter_stream_destroy         (stream_obj* stream)
                 (void*)stream));
     splitter_stream_close(stream); // make sure all the internals had been freed
     frame_list_destroy(&splitter->source_frames);
+    sv_mutex_destroy(&splitter->queueMutex);
+    sv_event_destroy(&splitter->queueEvent);
+    sv_event_destroy(&splitter->spaceEvent);
     stream_destroy( stream );
 }
 
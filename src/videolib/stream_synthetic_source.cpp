@@ -0,0 +1,515 @@
+/*****************************************************************************
+ *
+ * stream_synthetic_source.cpp
+ *   Source node standing in for a live H264 camera. A short loop of a
+ *   generated picture is encoded up front (frame injector -> encoder), and
+ *   then served in real time, over and over, for as long as it is read.
+ *   Meant for soak and scale testing of the live graph.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+
+#undef SV_MODULE_VAR
+#define SV_MODULE_VAR synth
+#define SV_MODULE_ID "SYNTHETIC"
+#include "sv_module_def.hpp"
+
+#include "streamprv.h"
+#include "sv_ffmpeg.h"
+
+#include "videolibUtils.h"
+#include "frame_basic.h"
+#include "frame_trace.h"
+
+#include <vector>
+
+#define SYNTH_SOURCE_MAGIC 0x7542
+
+// defaults for whatever the url leaves out
+static const int _kDefWidth       = 1280;
+static const int _kDefHeight      = 720;
+static const int _kDefFps         = 15;
+static const int _kDefBitrateKbps = 2000;
+static const int _kDefLoopSec     = 10;
+
+//-----------------------------------------------------------------------------
+typedef struct synthetic_source_stream : public stream_base {
+    char*                   url;
+    int                     width;
+    int                     height;
+    int                     fps;
+    int                     bitrateKbps;
+    int                     gop;
+    int                     loopSec;
+
+    std::vector<frame_obj*>* packets;   // encoded loop, starting on a keyframe
+    INT64_T                 loopDuration;
+    void*                   sps;
+    int                     spsSize;
+    void*                   pps;
+    int                     ppsSize;
+
+    size_t                  nextPacket;
+    INT64_T                 loopBase;   // pts of the current pass over the loop
+    INT64_T                 startTime;
+} synthetic_source_stream;
+
+//-----------------------------------------------------------------------------
+// Stream API
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+//  Forward declarations
+//-----------------------------------------------------------------------------
+static stream_obj* synth_stream_create             (const char* name);
+static int         synth_stream_set_param          (stream_obj* stream,
+                                                const CHAR_T* name,
+                                                const void* value);
+static int         synth_stream_get_param          (stream_obj* stream,
+                                                const CHAR_T* name,
+                                                void* value,
+                                                size_t* size);
+static int         synth_stream_open_in            (stream_obj* stream);
+static size_t      synth_stream_get_width          (stream_obj* stream);
+static size_t      synth_stream_get_height         (stream_obj* stream);
+static int         synth_stream_get_pixel_format   (stream_obj* stream);
+static int         synth_stream_read_frame         (stream_obj* stream, frame_obj** frame);
+static int         synth_stream_close              (stream_obj* stream);
+static void        synth_stream_destroy            (stream_obj* stream);
+
+extern "C" stream_api_t* get_frame_injector_stream_api ();
+extern "C" stream_api_t* get_ffenc_stream_api          ();
+
+
+//-----------------------------------------------------------------------------
+static stream_api_t _g_synth_stream_provider = {
+    synth_stream_create,
+    NULL, // set_source,
+    get_default_stream_api()->set_log_cb,
+    get_default_stream_api()->get_name,
+    get_default_stream_api()->find_element,
+    get_default_stream_api()->remove_element,
+    get_default_stream_api()->insert_element,
+    synth_stream_set_param,
+    synth_stream_get_param,
+    synth_stream_open_in,
+    NULL, // seek
+    synth_stream_get_width,
+    synth_stream_get_height,
+    synth_stream_get_pixel_format,
+    synth_stream_read_frame,
+    get_default_stream_api()->print_pipeline,
+    synth_stream_close,
+    _set_module_trace_level
+} ;
+
+
+//-----------------------------------------------------------------------------
+#define DECLARE_STREAM_SYNTH(stream, name) \
+    DECLARE_OBJ(synthetic_source_stream, name,  stream, SYNTH_SOURCE_MAGIC, -1)
+
+#define DECLARE_STREAM_SYNTH_V(stream, name) \
+    DECLARE_OBJ_V(synthetic_source_stream, name,  stream, SYNTH_SOURCE_MAGIC)
+
+static stream_obj*   synth_stream_create                (const char* name)
+{
+    synthetic_source_stream* res = (synthetic_source_stream*)stream_init(sizeof(synthetic_source_stream),
+                                        SYNTH_SOURCE_MAGIC,
+                                        &_g_synth_stream_provider,
+                                        name,
+                                        synth_stream_destroy );
+    res->url = NULL;
+    res->width = _kDefWidth;
+    res->height = _kDefHeight;
+    res->fps = _kDefFps;
+    res->bitrateKbps = _kDefBitrateKbps;
+    res->gop = 0;
+    res->loopSec = _kDefLoopSec;
+    res->packets = new std::vector<frame_obj*>();
+    res->loopDuration = 0;
+    res->sps = res->pps = NULL;
+    res->spsSize = res->ppsSize = 0;
+    res->nextPacket = 0;
+    res->loopBase = 0;
+    res->startTime = 0;
+    return (stream_obj*)res;
+}
+
+//-----------------------------------------------------------------------------
+static int         synth_stream_set_param             (stream_obj* stream,
+                                            const CHAR_T* name,
+                                            const void* value)
+{
+    DECLARE_STREAM_SYNTH(stream, synth);
+    name = stream_param_name_apply_scope(stream, name);
+    SET_STR_PARAM_IF(stream, name, "url", synth->url);
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+static int         synth_stream_get_param             (stream_obj* stream,
+                                            const CHAR_T* name,
+                                            void* value,
+                                            size_t* size)
+{
+    static const rational_t timebase = { 1, 1000 };
+
+    DECLARE_STREAM_SYNTH(stream, synth);
+
+    name = stream_param_name_apply_scope(stream, name);
+
+    COPY_PARAM_IF(synth, name, "fps",          double,   synth->fps);
+    COPY_PARAM_IF(synth, name, "timebase",     rational_t,  timebase);
+    COPY_PARAM_IF(synth, name, "videoCodecId", int,   streamH264);
+    COPY_PARAM_IF(synth, name, "audioCodecId", int,   streamUnknown);
+    COPY_PARAM_IF(synth, name, "eof",          int,   0);
+    COPY_PARAM_IF(synth, name, "spsSize",      int,   synth->spsSize);
+    COPY_PARAM_IF(synth, name, "ppsSize",      int,   synth->ppsSize);
+    COPY_PARAM_IF(synth, name, "sps",          char*, synth->sps);
+    COPY_PARAM_IF(synth, name, "pps",          char*, synth->pps);
+    COPY_PARAM_IF(synth, name, "width",        int,   synth->width);
+    COPY_PARAM_IF(synth, name, "height",       int,   synth->height);
+    COPY_PARAM_IF(synth, name, "videoBitrate", int,   synth->bitrateKbps*1000);
+
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+// synthetic:<width>x<height>@<fps>?bitrate=<kbps>&gop=<frames>&loop=<seconds>
+// Every part is optional, e.g. "synthetic:" or "synthetic:640x480@10"
+static int         _synth_parse_url                 (synthetic_source_stream* synth)
+{
+    const char* p = synth->url ? strchr(synth->url, ':') : NULL;
+    if ( p == NULL ) {
+        synth->logCb(logError, _FMT("Invalid synthetic source url: " << (synth->url?synth->url:"NULL")));
+        return -1;
+    }
+    p++;
+
+    int width, height, fps;
+    if ( sscanf(p, "%dx%d@%d", &width, &height, &fps) == 3 ) {
+        synth->fps = fps;
+    }
+    if ( sscanf(p, "%dx%d", &width, &height) == 2 ) {
+        synth->width = width;
+        synth->height = height;
+    }
+
+    const char* q = strchr(p, '?');
+    while ( q != NULL ) {
+        q++;
+        int v;
+        if ( sscanf(q, "bitrate=%d", &v) == 1 ) {
+            synth->bitrateKbps = v;
+        } else if ( sscanf(q, "gop=%d", &v) == 1 ) {
+            synth->gop = v;
+        } else if ( sscanf(q, "loop=%d", &v) == 1 ) {
+            synth->loopSec = v;
+        }
+        q = strchr(q, '&');
+    }
+
+    // encoders want even dimensions for 4:2:0
+    synth->width &= ~1;
+    synth->height &= ~1;
+    if ( synth->width <= 0 || synth->height <= 0 || synth->fps <= 0 ||
+         synth->bitrateKbps <= 0 || synth->loopSec <= 0 ) {
+        synth->logCb(logError, _FMT("Invalid synthetic source settings: " << synth->url));
+        return -1;
+    }
+    if ( synth->gop <= 0 ) {
+        synth->gop = 2*synth->fps;
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// A gradient sliding across the picture, with a bar sweeping down it: enough
+// motion for the encoder to produce realistic P frames, and for motion
+// detection to have something to look at.
+static frame_obj*  _synth_generate_frame           (synthetic_source_stream* synth,
+                                                    int index)
+{
+    int w = synth->width, h = synth->height;
+    int dataSize = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, w, h, _kDefAlign);
+    basic_frame_obj* f = alloc_basic_frame(SYNTH_SOURCE_MAGIC, dataSize, synth->logCb);
+    f->keyframe = 1;
+    f->width = w;
+    f->height = h;
+    f->pixelFormat = pfmtYUV420P;
+    f->mediaType = mediaVideo;
+    f->dataSize = dataSize;
+    f->pts = f->dts = (INT64_T)index*1000/synth->fps;
+
+    uint8_t* data[4];
+    int      linesize[4];
+    av_image_fill_arrays(data, linesize, f->data, AV_PIX_FMT_YUV420P, w, h, _kDefAlign);
+
+    int shift = index*4;
+    int barTop = (index*h/(2*synth->fps)) % h;
+    int barBottom = barTop + h/16;
+    for (int y=0; y<h; y++) {
+        uint8_t* row = data[0] + y*linesize[0];
+        int inBar = (y >= barTop && y < barBottom);
+        for (int x=0; x<w; x++) {
+            row[x] = inBar ? 235 : (uint8_t)(16 + ((x+y+shift)&0x7f));
+        }
+    }
+    for (int y=0; y<h/2; y++) {
+        memset(data[1] + y*linesize[1], 128 + ((y+index)&0x1f), w/2);
+        memset(data[2] + y*linesize[2], 128 - ((y+index)&0x1f), w/2);
+    }
+    return (frame_obj*)f;
+}
+
+//-----------------------------------------------------------------------------
+static void        _synth_free_packets             (synthetic_source_stream* synth)
+{
+    for (size_t nI=0; nI<synth->packets->size(); nI++) {
+        frame_unref(&(*synth->packets)[nI]);
+    }
+    synth->packets->clear();
+}
+
+//-----------------------------------------------------------------------------
+// Encodes the loop, with the frame injector feeding the encoder one frame
+// per read, and keeps whole GOPs of it, so it can be repeated seamlessly
+static int         _synth_encode_loop              (synthetic_source_stream* synth)
+{
+    stream_api_t*   injApi = get_frame_injector_stream_api();
+    stream_api_t*   encApi = get_ffenc_stream_api();
+    stream_obj*     enc = encApi->create("synthEncode");
+    stream_obj*     inj = injApi->create("synthInject");
+    int             frames = synth->loopSec*synth->fps;
+    int             mediaType = mediaVideo;
+    int             codecId = streamH264;
+    int             bitrate = synth->bitrateKbps*1000;
+    int             res = -1;
+    size_t          size;
+    void*           ptr;
+
+    stream_ref(enc);
+    encApi->set_log_cb(enc, synth->logCb);
+    injApi->set_log_cb(inj, synth->logCb);
+    encApi->set_source(enc, inj, svFlagNone);
+    injApi->set_param(inj, "synthInject.frameAPI", get_basic_frame_api());
+    encApi->set_param(enc, "synthEncode.encoderType", &mediaType);
+    encApi->set_param(enc, "synthEncode.dstCodecId", &codecId);
+    encApi->set_param(enc, "synthEncode.max_bitrate", &bitrate);
+    encApi->set_param(enc, "synthEncode.gop_size", &synth->gop);
+    encApi->set_param(enc, "synthEncode.keyint_min", &synth->gop);
+    encApi->set_param(enc, "synthEncode.preset", "ultrafast");
+
+    for (int nI=0; nI<frames; nI++) {
+        // the injector hands our reference over to the encoder
+        frame_obj* raw = _synth_generate_frame(synth, nI);
+        injApi->set_param(inj, "synthInject.currentFrame", raw);
+        if ( nI == 0 && encApi->open_in(enc) < 0 ) {
+            synth->logCb(logError, _FMT("Failed to open the encoder of the synthetic source"));
+            frame_unref(&raw);
+            goto Error;
+        }
+
+        frame_obj* pkt = NULL;
+        if ( encApi->read_frame(enc, &pkt) < 0 ) {
+            synth->logCb(logError, _FMT("Failed to encode frame " << nI << " of the synthetic source"));
+            goto Error;
+        }
+        if ( pkt != NULL ) {
+            if ( synth->packets->empty() && !frame_get_api(pkt)->get_keyframe_flag(pkt) ) {
+                frame_unref(&pkt);
+                continue;
+            }
+            synth->packets->push_back(pkt);
+        }
+    }
+
+    // drop the partial GOP at the end, unless it's all we have
+    {
+        size_t lastKey = 0;
+        for (size_t nI=1; nI<synth->packets->size(); nI++) {
+            frame_obj* pkt = (*synth->packets)[nI];
+            if ( frame_get_api(pkt)->get_keyframe_flag(pkt) ) {
+                lastKey = nI;
+            }
+        }
+        if ( lastKey > 0 ) {
+            for (size_t nI=lastKey; nI<synth->packets->size(); nI++) {
+                frame_unref(&(*synth->packets)[nI]);
+            }
+            synth->packets->resize(lastKey);
+        }
+    }
+    if ( synth->packets->empty() ) {
+        synth->logCb(logError, _FMT("The encoder produced no keyframe for the synthetic source"));
+        goto Error;
+    }
+
+    size = sizeof(ptr);
+    if ( encApi->get_param(enc, "synthEncode.sps", &ptr, &size) >= 0 && ptr != NULL ) {
+        size = sizeof(synth->spsSize);
+        encApi->get_param(enc, "synthEncode.spsSize", &synth->spsSize, &size);
+        synth->sps = av_malloc(synth->spsSize);
+        memcpy(synth->sps, ptr, synth->spsSize);
+    }
+    size = sizeof(ptr);
+    if ( encApi->get_param(enc, "synthEncode.pps", &ptr, &size) >= 0 && ptr != NULL ) {
+        size = sizeof(synth->ppsSize);
+        encApi->get_param(enc, "synthEncode.ppsSize", &synth->ppsSize, &size);
+        synth->pps = av_malloc(synth->ppsSize);
+        memcpy(synth->pps, ptr, synth->ppsSize);
+    }
+
+    {
+        frame_obj* first = synth->packets->front();
+        frame_obj* last = synth->packets->back();
+        synth->loopDuration = frame_get_api(last)->get_pts(last) - frame_get_api(first)->get_pts(first) +
+                              1000/synth->fps;
+    }
+    res = 0;
+
+Error:
+    encApi->close(enc);
+    stream_unref(&enc);
+    if ( res < 0 ) {
+        _synth_free_packets(synth);
+    }
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+static int         synth_stream_open_in                (stream_obj* stream)
+{
+    DECLARE_STREAM_SYNTH(stream, synth);
+
+    if ( _synth_parse_url(synth) < 0 ) {
+        return -1;
+    }
+
+    INT64_T started = sv_time_get_current_epoch_time();
+    if ( _synth_encode_loop(synth) < 0 ) {
+        return -1;
+    }
+
+    synth->logCb(logInfo, _FMT("Synthetic source " << synth->width << "x" << synth->height <<
+                            "@" << synth->fps << " bitrate=" << synth->bitrateKbps <<
+                            "kbps gop=" << synth->gop << ": " << synth->packets->size() <<
+                            " frames (" << synth->loopDuration << "ms) encoded in " <<
+                            sv_time_get_elapsed_time(started) << "ms"));
+    synth->nextPacket = 0;
+    synth->loopBase = 0;
+    synth->startTime = sv_time_get_current_epoch_time();
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static size_t      synth_stream_get_width          (stream_obj* stream)
+{
+    DECLARE_STREAM_SYNTH(stream, synth);
+    return synth->width;
+}
+
+//-----------------------------------------------------------------------------
+static size_t      synth_stream_get_height         (stream_obj* stream)
+{
+    DECLARE_STREAM_SYNTH(stream, synth);
+    return synth->height;
+}
+
+//-----------------------------------------------------------------------------
+static int         synth_stream_get_pixel_format   (stream_obj* stream)
+{
+    DECLARE_STREAM_SYNTH(stream, synth);
+    return pfmtYUV420P;
+}
+
+//-----------------------------------------------------------------------------
+static int         synth_stream_read_frame        (stream_obj* stream, frame_obj** frame)
+{
+    DECLARE_STREAM_SYNTH(stream, synth);
+
+    *frame = NULL;
+    if ( synth->packets->empty() ) {
+        synth->logCb(logError, _FMT("Failed to read from synthetic source - it isn't opened"));
+        return -1;
+    }
+
+    frame_obj* first = synth->packets->front();
+    frame_obj* pkt = (*synth->packets)[synth->nextPacket];
+    frame_api_t* api = frame_get_api(pkt);
+    INT64_T    pts = synth->loopBase + api->get_pts(pkt) - api->get_pts(first);
+
+    // deliver at the camera's pace
+    INT64_T    wait = synth->startTime + pts - sv_time_get_current_epoch_time();
+    if ( wait > 0 ) {
+        sv_sleep(wait);
+    }
+
+    frame_obj* res = alloc_clone_frame(SYNTH_SOURCE_MAGIC, NULL, pkt, pts);
+    frame_get_api(res)->set_dts(res, pts);
+    frame_trace_begin(res, 0);
+
+    if ( ++synth->nextPacket == synth->packets->size() ) {
+        synth->nextPacket = 0;
+        synth->loopBase += synth->loopDuration;
+    }
+
+    TRACE(_FMT("Read frame: pts=" << pts << " keyframe=" << api->get_keyframe_flag(pkt) <<
+                            " size=" << api->get_data_size(pkt)));
+    *frame = res;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static int         synth_stream_close             (stream_obj* stream)
+{
+    DECLARE_STREAM_SYNTH(stream, synth);
+    _synth_free_packets(synth);
+    av_freep(&synth->sps);
+    av_freep(&synth->pps);
+    synth->spsSize = synth->ppsSize = 0;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static void synth_stream_destroy         (stream_obj* stream)
+{
+    DECLARE_STREAM_SYNTH_V(stream, synth);
+    TRACE(_FMT("Destroying stream object " << (void*)stream));
+    synth_stream_close(stream);
+    delete synth->packets;
+    sv_freep(&synth->url);
+    stream_destroy( stream );
+}
+
+//-----------------------------------------------------------------------------
+SVVIDEOLIB_API stream_api_t*     get_synthetic_source_api             ()
+{
+    return &_g_synth_stream_provider;
+}
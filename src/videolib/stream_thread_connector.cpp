@@ -38,11 +38,16 @@
 #include "sv_module_def.hpp"
 
 #include "streamprv.h"
+#include "sv_internal.h"
 #include "frame_basic.h"
 
 #include "videolibUtils.h"
+#include "frame_trace.h"
+#include "frame_props.h"
 
 #include <list>
+#include <atomic>
+#include <algorithm>
 
 
 #define TC_DEMUX_MAGIC 0x1925
@@ -84,10 +89,17 @@ typedef struct channel_state_tc {
     stats_snapshot_tc_t     lifetimeStats;
     int64_t                 lastFrameWriteTime;
     int64_t                 lastFrameReadTime;
-    int64_t                 lastPtsInQueue;
-    int64_t                 lastPtsRead;
-    int                     framesDropped;
-    int                     framesInQueue;
+    std::atomic<int64_t>    lastPtsInQueue;
+    std::atomic<int64_t>    lastPtsRead;
+    std::atomic<int>        framesDropped;      // video only
+    std::atomic<int>        framesInQueue;
+
+    // in ring mode, each side accumulates its stats locally, and only folds
+    // them into intervalStats (under dataMutex) every kTcRingStatsBatch frames
+    stats_snapshot_tc_t     pendingWriteStats;
+    stats_snapshot_tc_t     pendingReadStats;
+    int                     pendingWrites;
+    int                     pendingReads;
 
     fps_limiter*            readLimiter;
     fps_limiter*            writeLimiter;
@@ -113,6 +125,10 @@ typedef struct channel_state_tc {
         lastPtsRead = INVALID_PTS;
         framesDropped = 0;
         framesInQueue = 0;
+        pendingWriteStats.reset();
+        pendingReadStats.reset();
+        pendingWrites = 0;
+        pendingReads = 0;
     }
 
     void reset() {
@@ -127,6 +143,27 @@ typedef struct channel_state_tc {
     }
 } channel_state_tc_t;
 
+//-----------------------------------------------------------------------------
+// Bounded single-producer/single-consumer ring, used in place of the locked
+// FrameList when "lockFreeQueue" is set. The producer is always _tc_thread_func;
+// the consumer is the caller of read_frame (seek must come from the same thread).
+// Events are only touched when either side has to park on an empty or full ring.
+typedef struct tc_ring {
+    frame_obj**             slots;
+    size_t                  capacity;
+    size_t                  mask;
+    // next slot to be read; only advanced by the consumer
+    std::atomic<size_t>     head;
+    // next slot to be written; only advanced by the producer
+    std::atomic<size_t>     tail;
+    std::atomic<int>        consumerParked;
+    std::atomic<int>        producerParked;
+} tc_ring_t;
+
+static const size_t kTcRingMinCapacity = 16;
+static const size_t kTcRingDefaultCapacity = 256;
+static const int    kTcRingStatsBatch = 16;
+
 //-----------------------------------------------------------------------------
 typedef struct tc_stream  : public stream_base  {
     sv_thread*      thread;
@@ -160,6 +197,16 @@ typedef struct tc_stream  : public stream_base  {
     int             silentFpsLimiter;
     channel_state_tc_t*  videoState;
     frame_allocator*     fa;
+    // use SPSC ring instead of the mutex-protected queue
+    int             lockFreeQueue;
+    tc_ring_t*      ring;
+    // scheduling class of the thread, see sv_thread_set_class; inherited if NULL
+    char*           threadClass;
+    // if set, ready is created on open: it is set while video frames are queued,
+    // or once the connector stopped running, so the consumer can poll on it
+    // instead of blocking in read_frame
+    int             pollable;
+    sv_pollable_event* ready;
 } tc_stream_obj;
 
 
@@ -259,6 +306,11 @@ static stream_obj*   tc_stream_create                (const char* name)
     res->fpsLimit = 0;
     res->silentFpsLimiter = 0;
     res->videoState = new channel_state_tc_t();
+    res->lockFreeQueue = 0;
+    res->ring = NULL;
+    res->threadClass = NULL;
+    res->pollable = 0;
+    res->ready = NULL;
 
     if (_gTraceLevel>15) res->statsIntervalMsec = 1;
     else if (_gTraceLevel>10) res->statsIntervalMsec = 5;
@@ -282,6 +334,148 @@ static void       _tc_log_stats(tc_stream_obj* tc)
     tc->logCb(logDebug, _FMT(stats.str()));
 }
 
+//-----------------------------------------------------------------------------
+static tc_ring_t*  _tc_ring_create              (int maxQueueSize)
+{
+    // maxQueueSize only accounts for video frames, leave room for the rest
+    size_t desired = maxQueueSize > 0 ? 2*maxQueueSize + 2 : kTcRingDefaultCapacity;
+    size_t capacity = kTcRingMinCapacity;
+    while ( capacity < desired ) {
+        capacity <<= 1;
+    }
+
+    tc_ring_t* ring = new tc_ring_t;
+    ring->slots = (frame_obj**)calloc(capacity, sizeof(frame_obj*));
+    ring->capacity = capacity;
+    ring->mask = capacity - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->consumerParked = 0;
+    ring->producerParked = 0;
+    return ring;
+}
+
+//-----------------------------------------------------------------------------
+static void        _tc_ring_destroy             (tc_ring_t** pRing)
+{
+    if ( pRing && *pRing ) {
+        tc_ring_t* ring = *pRing;
+        for (size_t nI=0; nI<ring->capacity; nI++) {
+            frame_unref(&ring->slots[nI]);
+        }
+        free(ring->slots);
+        delete ring;
+        *pRing = NULL;
+    }
+}
+
+//-----------------------------------------------------------------------------
+static size_t      _tc_ring_size                (tc_ring_t* ring)
+{
+    return ring->tail.load(std::memory_order_acquire) -
+           ring->head.load(std::memory_order_acquire);
+}
+
+//-----------------------------------------------------------------------------
+// Producer side only
+static bool        _tc_ring_push                (tc_ring_t* ring, frame_obj* frame)
+{
+    size_t tail = ring->tail.load(std::memory_order_relaxed);
+    if ( tail - ring->head.load(std::memory_order_acquire) >= ring->capacity ) {
+        return false;
+    }
+    ring->slots[tail & ring->mask] = frame;
+    ring->tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Consumer side only
+static frame_obj*  _tc_ring_front               (tc_ring_t* ring)
+{
+    size_t head = ring->head.load(std::memory_order_relaxed);
+    if ( head == ring->tail.load(std::memory_order_acquire) ) {
+        return NULL;
+    }
+    return ring->slots[head & ring->mask];
+}
+
+//-----------------------------------------------------------------------------
+// Consumer side only
+static frame_obj*  _tc_ring_pop                 (tc_ring_t* ring)
+{
+    size_t head = ring->head.load(std::memory_order_relaxed);
+    if ( head == ring->tail.load(std::memory_order_acquire) ) {
+        return NULL;
+    }
+    frame_obj* frame = ring->slots[head & ring->mask];
+    ring->slots[head & ring->mask] = NULL;
+    ring->head.store(head + 1, std::memory_order_release);
+    return frame;
+}
+
+//-----------------------------------------------------------------------------
+static bool        _tc_queue_empty              (tc_stream_obj* tc)
+{
+    if ( tc->ring ) {
+        return _tc_ring_size(tc->ring) == 0;
+    }
+    return tc->queue->empty();
+}
+
+//-----------------------------------------------------------------------------
+// Whether the readiness handle should be set: read_frame has a video frame to
+// return, or the consumer should find out the connector stopped running
+static bool        _tc_ready_pending            (tc_stream_obj* tc)
+{
+    if ( tc->videoState->framesInQueue > 0 ) {
+        return true;
+    }
+    sv_rwlock_lock_read(tc->streamLock);
+    bool stopped = (tc->state != tcsRunning);
+    sv_rwlock_unlock_read(tc->streamLock);
+    return stopped;
+}
+
+//-----------------------------------------------------------------------------
+// Called by the producer once there's something for the consumer to pick up
+static void        _tc_ready_set                (tc_stream_obj* tc)
+{
+    if ( tc->ready != NULL ) {
+        sv_pollable_event_set(tc->ready);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Called whenever the queue may have drained
+static void        _tc_ready_update             (tc_stream_obj* tc)
+{
+    if ( tc->ready != NULL && !_tc_ready_pending(tc) ) {
+        sv_pollable_event_reset(tc->ready);
+        // the producer may have deposited a frame, or stopped, before the reset
+        if ( _tc_ready_pending(tc) ) {
+            sv_pollable_event_set(tc->ready);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Folds locally accumulated stats of one side of the ring into the interval stats
+static void        _tc_ring_fold_stats          (tc_stream_obj* tc,
+                                                 stats_snapshot_tc_t* pending,
+                                                 int* pendingCount,
+                                                 bool force)
+{
+    if ( !force && ++(*pendingCount) < kTcRingStatsBatch ) {
+        return;
+    }
+    sv_mutex_enter(tc->dataMutex);
+    tc->videoState->intervalStats.combine(pending);
+    sv_mutex_exit(tc->dataMutex);
+    pending->reset();
+    *pendingCount = 0;
+}
+
 //-----------------------------------------------------------------------------
 int                tc_set_source                (stream_obj* stream,
                                                  stream_obj* source,
@@ -363,6 +557,9 @@ static int         tc_stream_set_param             (stream_obj* stream,
     SET_PARAM_IF(stream, name, "maxQueueSize", int, tc->maxQueueSize);
     SET_PARAM_IF(stream, name, "fpsLimit", int, tc->fpsLimit);
     SET_PARAM_IF(stream, name, "silentFpsLimiter", int, tc->silentFpsLimiter);
+    SET_PARAM_IF(stream, name, "lockFreeQueue", int, tc->lockFreeQueue);
+    SET_STR_PARAM_IF(stream, name, "threadClass", tc->threadClass);
+    SET_PARAM_IF(stream, name, "pollable", int, tc->pollable);
 
     int res;
     sv_rwlock_lock_write(tc->streamLock);
@@ -383,7 +580,12 @@ static int         tc_stream_get_param             (stream_obj* stream,
 
     COPY_PARAM_IF_SAFE(tc, name, "requestFps", float, fps_limiter_get_fps(tc->videoState->readLimiter), tc->dataMutex);
     COPY_PARAM_IF_SAFE(tc, name, "captureFps", float, fps_limiter_get_fps(tc->videoState->writeLimiter), tc->dataMutex);
-    COPY_PARAM_IF_SAFE(tc, name, "eof", int, (tc->queue->empty()&&tc->state==tcsEOF)?1:0, tc->dataMutex);
+    COPY_PARAM_IF_SAFE(tc, name, "eof", int, (_tc_queue_empty(tc)&&tc->state==tcsEOF)?1:0, tc->dataMutex);
+    COPY_PARAM_IF(tc, name, "framesQueued", int, (int)tc->videoState->framesInQueue);
+    COPY_PARAM_IF_SAFE(tc, name, "stopped", int, (tc->videoState->framesInQueue==0&&tc->state!=tcsRunning)?1:0, tc->dataMutex);
+    if ( tc->ready != NULL ) {
+        COPY_PARAM_IF(tc, name, "readyHandle", INT64_T, sv_pollable_event_get_handle(tc->ready));
+    }
 
     return default_get_param(stream, name, value, size);
 }
@@ -393,12 +595,27 @@ static void       _tc_flush_queue               (tc_stream_obj* tc,
                                                  INT64_T pts = INVALID_PTS,
                                                  int mediaType = mediaUnknown)
 {
+    if ( tc->ring ) {
+        frame_obj* retFrame;
+        while ( (retFrame = _tc_ring_front(tc->ring)) != NULL ) {
+            int type = frame_props_media_type(retFrame);
+            if ( pts != INVALID_PTS && type && frame_props_pts(retFrame) >= pts ) {
+                break;
+            }
+            _tc_ring_pop(tc->ring);
+            if ( type == mediaVideo ) {
+                tc->videoState->framesInQueue--;
+            }
+            frame_unref(&retFrame);
+        }
+        return;
+    }
+
     while (!tc->queue->empty()) {
         frame_obj* retFrame = tc->queue->front();
         if ( pts != INVALID_PTS ) {
-            frame_api_t* api = frame_get_api(retFrame);
-            if ( api->get_media_type(retFrame) &&
-                 api->get_pts(retFrame) >= pts ) {
+            if ( frame_props_media_type(retFrame) &&
+                 frame_props_pts(retFrame) >= pts ) {
                 break;
             }
         }
@@ -443,11 +660,28 @@ static void       _tc_format_stats              (tc_stream_obj* tc,
     cs->intervalStats.reset();
 }
 
+//-----------------------------------------------------------------------------
+// Number of video frames the queue may hold. Lossy queues are the first to
+// give up memory when it runs short: half of their depth under soft pressure,
+// all but one frame under hard pressure.
+static int  _tc_queue_limit(tc_stream_obj* tc)
+{
+    if ( !tc->lossy || tc->maxQueueSize <= 1 ) {
+        return tc->maxQueueSize;
+    }
+    switch ( sv_memory_get_pressure() ) {
+    case SV_MEMORY_PRESSURE_HARD:   return 1;
+    case SV_MEMORY_PRESSURE_SOFT:   return std::max(1, tc->maxQueueSize/2);
+    default:                        return tc->maxQueueSize;
+    }
+}
+
 //-----------------------------------------------------------------------------
 static bool _tc_check_queue_size(tc_stream_obj* tc)
 {
-    if ( tc->videoState->framesInQueue <= tc->maxQueueSize ||
-         tc->maxQueueSize == 0 ) {
+    int limit = _tc_queue_limit(tc);
+    if ( tc->videoState->framesInQueue <= limit ||
+         limit == 0 ) {
         return true;
     }
 
@@ -455,56 +689,75 @@ static bool _tc_check_queue_size(tc_stream_obj* tc)
         return false;
     }
 
-    FrameIterator           it = tc->queue->begin();
-    FrameIterator           remove;
-    frame_obj*              toRemove = NULL;
-
-    int64_t              prevFramePts = tc->videoState->lastPtsRead;
-    int64_t              distance = 1000000;
-    int64_t              framePts;
-
-    while (it != tc->queue->end()) {
-        frame_obj*   f = *it;
-        frame_api_t* api = frame_get_api(f);
-        if (api->get_media_type(f) == mediaVideo) {
-            framePts = api->get_pts(f);
-            int64_t      d = framePts - prevFramePts;
-            if ( d < distance ) {
-                remove = it;
-                toRemove = *remove;
-                distance = d;
+    // normally one frame over, but more once the limit drops under pressure
+    bool                    dropped;
+    do {
+        FrameIterator           it = tc->queue->begin();
+        FrameIterator           remove;
+        frame_obj*              toRemove = NULL;
+
+        int64_t              prevFramePts = tc->videoState->lastPtsRead;
+        int64_t              distance = 1000000;
+        int64_t              framePts;
+
+        dropped = false;
+        while (it != tc->queue->end()) {
+            frame_obj*   f = *it;
+            if (frame_props_media_type(f) == mediaVideo) {
+                framePts = frame_props_pts(f);
+                int64_t      d = framePts - prevFramePts;
+                if ( d < distance ) {
+                    remove = it;
+                    toRemove = *remove;
+                    distance = d;
+                }
+                prevFramePts = framePts;
             }
-            prevFramePts = framePts;
+            it++;
         }
-        it++;
-    }
 
-    if ( toRemove != NULL ) {
-        frame_unref(&toRemove);
-        tc->queue->erase(remove);
-        tc->videoState->framesDropped++;
-        tc->videoState->framesInQueue--;
-        TRACE(_FMT("Dropping frame with pts=" << framePts << " totalDropped=" << tc->videoState->framesDropped));
-    }
+        if ( toRemove != NULL ) {
+            frame_unref(&toRemove);
+            tc->queue->erase(remove);
+            tc->videoState->framesDropped++;
+            tc->videoState->framesInQueue--;
+            TRACE(_FMT("Dropping frame with pts=" << framePts << " totalDropped=" << tc->videoState->framesDropped));
+            dropped = true;
+        }
+    } while ( dropped && tc->videoState->framesInQueue > limit );
 
     return true;
 }
 
 #define IS_RUNNING(tc) (tc->state&tcsRunning)!=0
 
+//-----------------------------------------------------------------------------
+// Queue operations on the timeline: 0 is returned while tracing is off
+static INT64_T    _tc_trace_begin()
+{
+    return sv_trace_enabled() ? sv_trace_now_us() : 0;
+}
+
+//-----------------------------------------------------------------------------
+static void       _tc_trace_end(tc_stream_obj* tc, const char* category, INT64_T start)
+{
+    if ( start != 0 ) {
+        sv_trace_span(category, tc->name, start, sv_trace_now_us());
+    }
+}
+
 //-----------------------------------------------------------------------------
 static frame_obj* _tc_convert_video_frame(tc_stream_obj* tc, frame_obj* frame)
 {
-    frame_api_t* api = frame_get_api(frame);
     basic_frame_obj* newFrame = alloc_basic_frame2 (TC_DEMUX_MAGIC,
                                                     0,
                                                     tc->logCb,
                                                     tc->fa );
-    newFrame->pts = api->get_pts(frame);
-    newFrame->dts = api->get_dts(frame);
-    newFrame->width = api->get_width(frame);
-    newFrame->height = api->get_height(frame);
-    newFrame->pixelFormat = api->get_pixel_format(frame);
+    newFrame->pts = frame_props_pts(frame);
+    newFrame->dts = frame_props_dts(frame);
+    newFrame->width = frame_props_width(frame);
+    newFrame->height = frame_props_height(frame);
+    newFrame->pixelFormat = frame_props_pixel_format(frame);
     newFrame->mediaType = mediaVideoTime;
     newFrame->dataSize = 0;
     newFrame->data = NULL;
@@ -522,12 +775,11 @@ static void      _tc_deposit_frame              (tc_stream_obj* tc,
 
     size_t sizeBeforeDeposit = tc->queue->size();
 
-    frame_api_t* api = frame_get_api(frame);
     channel_state_tc_t* cs = NULL;
-    if (api->get_media_type(frame) == mediaVideo) {
+    if (frame_props_media_type(frame) == mediaVideo) {
         cs = tc->videoState;
     }
-    int64_t pts = api->get_pts(frame);
+    int64_t pts = frame_props_pts(frame);
     size_t  queueDepth = 0;
 
     if ( cs != NULL ) {
@@ -577,6 +829,9 @@ static void      _tc_deposit_frame              (tc_stream_obj* tc,
     if (sizeBeforeDeposit == 0) {
         sv_event_set(tc->event);
     }
+    if ( cs != NULL ) {
+        _tc_ready_set(tc);
+    }
 
     sv_mutex_exit(tc->dataMutex);
 }
@@ -621,6 +876,148 @@ static bool   _tc_wait_for_space_in_queue    (tc_stream_obj* tc)
     return running;
 }
 
+//-----------------------------------------------------------------------------
+// Ring mode counterpart of _tc_deposit_frame. Only called from the producer thread.
+static void      _tc_ring_deposit_frame         (tc_stream_obj* tc,
+                                                 frame_obj* frame)
+{
+    tc_ring_t* ring = tc->ring;
+    channel_state_tc_t* cs = NULL;
+    if (frame_props_media_type(frame) == mediaVideo) {
+        cs = tc->videoState;
+    }
+    int64_t pts = frame_props_pts(frame);
+    size_t  queueDepth = 0;
+    bool    video = false;
+
+    if ( cs != NULL ) {
+        if ( fps_limiter_report_frame(cs->writeLimiter, NULL, pts) == 0 ) {
+            // limiter instructs us to discard this frame
+            if ( tc->silentFpsLimiter ) {
+                frame_unref(&frame);
+                return;
+            }
+            frame = _tc_convert_video_frame(tc, frame);
+        } else {
+            video = true;
+        }
+    }
+
+    // lossy queues are trimmed by the consumer (see _tc_ring_read_frame): the
+    // ring stays single producer, and the newest frame makes it in, unless
+    // the consumer stopped reading altogether and the ring is full
+
+    if ( video ) {
+        int64_t now = sv_time_get_current_epoch_time();
+        int64_t dur = sv_time_get_time_diff(cs->lastFrameWriteTime, now);
+        cs->framesInQueue++;
+        cs->lastFrameWriteTime = now;
+        if (pts > cs->lastPtsInQueue ||
+            cs->lastPtsInQueue == INVALID_PTS)
+            cs->lastPtsInQueue = pts;
+        queueDepth = _tc_ring_size(ring) + 1;
+        stats_int_update(&cs->pendingWriteStats.queueDepth, queueDepth);
+        stats_int_update(&cs->pendingWriteStats.writeInterval, dur);
+        if ( cs->lastPtsRead != INVALID_PTS ) {
+            int64_t diff = cs->lastPtsInQueue - cs->lastPtsRead;
+            stats_int_update(&cs->pendingWriteStats.ptsSpread, diff);
+        }
+        _tc_ring_fold_stats(tc, &cs->pendingWriteStats, &cs->pendingWrites, false);
+
+        int64_t diff = sv_time_get_time_diff(tc->lastStatsTime, now);
+        if ( tc->statsIntervalMsec && diff > tc->statsIntervalMsec ) {
+            std::ostringstream stats;
+            _tc_ring_fold_stats(tc, &cs->pendingWriteStats, &cs->pendingWrites, true);
+            sv_mutex_enter(tc->dataMutex);
+            _tc_format_stats(tc, stats, cs);
+            sv_mutex_exit(tc->dataMutex);
+            tc->lastStatsTime = now;
+            tc->logCb(logInfo, _FMT(stats.str()));
+        }
+    }
+
+    if ( queueDepth>5 && (queueDepth%5)==0 && tc->lastQueueDepthWarningVal != queueDepth) {
+        TRACE(_FMT("Queue depth is currently at " << queueDepth << " with " <<
+                    tc->videoState->framesInQueue << " video frames"));
+        tc->lastQueueDepthWarningVal = queueDepth;
+    }
+
+    if ( !_tc_ring_push(ring, frame) ) {
+        // a lossy source never waits for a stalled consumer; otherwise
+        // _tc_ring_wait_for_space makes sure this doesn't happen, unless we're shutting down
+        if ( video ) {
+            cs->framesInQueue--;
+            cs->framesDropped++;
+        }
+        frame_unref(&frame);
+        return;
+    }
+
+    // wake up the consumer, if it had parked on an empty ring
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if ( ring->consumerParked.load(std::memory_order_relaxed) ) {
+        sv_event_set(tc->event);
+    }
+    if ( video ) {
+        _tc_ready_set(tc);
+    }
+}
+
+//-----------------------------------------------------------------------------
+static bool   _tc_ring_has_space             (tc_stream_obj* tc)
+{
+    // like the locked queue, lossy mode never holds up the source: what
+    // doesn't fit is dropped in _tc_ring_deposit_frame
+    if ( tc->lossy ) {
+        return true;
+    }
+    if ( _tc_ring_size(tc->ring) >= tc->ring->capacity ) {
+        return false;
+    }
+    return tc->maxQueueSize == 0 ||
+           tc->videoState->framesInQueue <= tc->maxQueueSize;
+}
+
+//-----------------------------------------------------------------------------
+// Ring mode counterpart of _tc_wait_for_space_in_queue
+static bool   _tc_ring_wait_for_space        (tc_stream_obj* tc)
+{
+    tc_ring_t* ring = tc->ring;
+    bool  running = true;
+    bool  waited = false;
+
+    while ( !_tc_ring_has_space(tc) ) {
+        sv_event_reset(tc->queueEvent);
+        ring->producerParked.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if ( _tc_ring_has_space(tc) ) {
+            ring->producerParked.store(0, std::memory_order_relaxed);
+            break;
+        }
+
+        // check this after resetting the event, so closure can't slip in between
+        sv_rwlock_lock_read(tc->streamLock);
+        running = IS_RUNNING(tc);
+        sv_rwlock_unlock_read(tc->streamLock);
+        if ( !running ) {
+            ring->producerParked.store(0, std::memory_order_relaxed);
+            break;
+        }
+
+        TRACE(_FMT("Waiting for queue to recede ... " << (void*)tc <<
+                    " " << " - " << tc->videoState->framesInQueue));
+        sv_event_wait(tc->queueEvent, 0);
+        ring->producerParked.store(0, std::memory_order_relaxed);
+        waited = true;
+    }
+
+    if ( waited ) {
+        TRACE(_FMT("Done waiting for queue to recede ... " << (void*)tc));
+    }
+
+    return running;
+}
+
 //-----------------------------------------------------------------------------
 static void*      _tc_thread_func               (void* param)
 {
@@ -665,7 +1062,14 @@ static void*      _tc_thread_func               (void* param)
                 eof = 0;
             }
         } else if ( frame != NULL ) {
-            _tc_deposit_frame(tc, frame);
+            frame_trace_stamp(frame, ftEnqueued);
+            INT64_T traceStart = _tc_trace_begin();
+            if ( tc->ring ) {
+                _tc_ring_deposit_frame(tc, frame);
+            } else {
+                _tc_deposit_frame(tc, frame);
+            }
+            _tc_trace_end(tc, "tc_deposit", traceStart);
         }
 
         // update the flag for local consumption outside of mutex
@@ -681,6 +1085,7 @@ static void*      _tc_thread_func               (void* param)
                 tc->logCb(logDebug, _FMT("Thread connector reached EOF. Waiting for seek or close event"));
             }
             sv_event_set(tc->event);
+            _tc_ready_set(tc);
             sv_event_wait(tc->queueEvent, 0);
             continue;
         } else if ( !running ) {
@@ -688,11 +1093,14 @@ static void*      _tc_thread_func               (void* param)
             break;
         }
 
-        running = _tc_wait_for_space_in_queue(tc);
+        INT64_T traceStart = _tc_trace_begin();
+        running = tc->ring ? _tc_ring_wait_for_space(tc) : _tc_wait_for_space_in_queue(tc);
+        _tc_trace_end(tc, "tc_wait_space", traceStart);
     }
 
     // make sure to signal event, in case someone is waiting on it
     sv_event_set(tc->event);
+    _tc_ready_set(tc);
     TRACE(_FMT("Exiting thread " << (void*)tc));
     return NULL;
 }
@@ -708,8 +1116,19 @@ static int         tc_stream_open_in            (stream_obj* stream)
         return -1;
     }
 
+    if ( tc->lockFreeQueue && !tc->ring ) {
+        tc->ring = _tc_ring_create(tc->maxQueueSize);
+        tc->logCb(logDebug, _FMT("Using lock-free queue with capacity " << tc->ring->capacity));
+    }
+    if ( tc->pollable && !tc->ready ) {
+        tc->ready = sv_pollable_event_create();
+        if ( !tc->ready ) {
+            tc->logCb(logError, _FMT("Failed to create the readiness handle"));
+        }
+    }
+
     tc->state = tcsRunning;
-    tc->thread = sv_thread_create(_tc_thread_func, tc);
+    tc->thread = sv_thread_create_ex(_tc_thread_func, tc, _STR("tc:" << tc->name), tc->threadClass);
     if (!tc->thread) {
         tc->logCb(logError, _FMT("Failed to start thread"));
         tc->state = tcsError;
@@ -747,10 +1166,89 @@ static int         tc_stream_seek               (stream_obj* stream,
     sv_event_set(tc->queueEvent);
     sv_mutex_exit(tc->dataMutex);
     sv_rwlock_unlock_write(tc->streamLock);
+    _tc_ready_update(tc);
     return res;
 }
 
 
+//-----------------------------------------------------------------------------
+// Ring mode: attempts to dequeue a frame without taking dataMutex. If the ring
+// is empty, tc->event is reset and the producer is asked to set it on its next deposit.
+static bool        _tc_ring_read_frame         (tc_stream_obj* tc,
+                                                frame_obj** frame,
+                                                int64_t elapsedSinceLastRead,
+                                                int64_t* pts)
+{
+    tc_ring_t* ring = tc->ring;
+    frame_obj* retFrame = _tc_ring_pop(ring);
+
+    if ( retFrame == NULL ) {
+        sv_event_reset(tc->event);
+        ring->consumerParked.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // the producer may have deposited a frame before it could see the flag
+        retFrame = _tc_ring_pop(ring);
+        if ( retFrame == NULL ) {
+            TRACE(_FMT("Queue is empty"));
+            return false;
+        }
+    }
+    if ( ring->consumerParked.load(std::memory_order_relaxed) ) {
+        ring->consumerParked.store(0, std::memory_order_relaxed);
+    }
+
+    // lossy: go past the video frames that went stale while we weren't reading,
+    // until the queue is back within its limit
+    if ( tc->lossy ) {
+        channel_state_tc_t* cs = tc->videoState;
+        int limit = _tc_queue_limit(tc);
+        while ( limit > 0 &&
+                cs->framesInQueue > limit &&
+                frame_props_media_type(retFrame) == mediaVideo ) {
+            frame_obj* next = _tc_ring_pop(ring);
+            if ( next == NULL ) {
+                break;
+            }
+            cs->framesInQueue--;
+            cs->framesDropped++;
+            TRACE(_FMT("Dropping frame with pts=" << frame_props_pts(retFrame) << " totalDropped=" << cs->framesDropped));
+            frame_unref(&retFrame);
+            retFrame = next;
+        }
+    }
+
+    // release the producer, if it is waiting for space
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if ( ring->producerParked.load(std::memory_order_relaxed) ) {
+        sv_event_set(tc->queueEvent);
+    }
+
+    *frame = retFrame;
+
+    if (frame_props_media_type(retFrame) == mediaVideo) {
+        channel_state_tc_t* cs = tc->videoState;
+        int64_t now = sv_time_get_current_epoch_time();
+        int64_t dur = sv_time_get_time_diff(cs->lastFrameReadTime, now);
+
+        *pts = frame_props_pts(retFrame);
+        cs->lastFrameReadTime = now;
+        if (*pts > cs->lastPtsRead || cs->lastPtsRead == INVALID_PTS) {
+            cs->lastPtsRead = *pts;
+        }
+        cs->framesInQueue--;
+        stats_int_update(&cs->pendingReadStats.queueDepth, _tc_ring_size(ring));
+        stats_int_update(&cs->pendingReadStats.readInterval, dur);
+        stats_int_update(&cs->pendingReadStats.ptsSpread, cs->lastPtsInQueue - cs->lastPtsRead);
+        _tc_ring_fold_stats(tc, &cs->pendingReadStats, &cs->pendingReads, false);
+
+        fps_limiter_report_frame(cs->readLimiter, NULL, elapsedSinceLastRead);
+        tc->elapsedAccumulator = 0;
+    } else {
+        tc->elapsedAccumulator = elapsedSinceLastRead;
+    }
+    return true;
+}
+
 //-----------------------------------------------------------------------------
 static int         tc_stream_read_frame        (stream_obj* stream, frame_obj** frame)
 {
@@ -772,48 +1270,51 @@ static int         tc_stream_read_frame        (stream_obj* stream, frame_obj**
 
 
     while (!gotFrame && !timeout && keepTrying) {
-        sv_mutex_enter(tc->dataMutex);
-        size = tc->queue->size();
-        if (tc->queue->empty()) {
-            TRACE(_FMT("Queue is empty"));
-            gotFrame = false;
-            sv_event_reset( tc->event );
+        if ( tc->ring ) {
+            gotFrame = _tc_ring_read_frame(tc, frame, elapsedSinceLastRead, &pts);
         } else {
-            frame_obj* retFrame = tc->queue->front();
-            tc->queue->pop_front();
-            sv_event_set(tc->queueEvent);
-            // set the return value
-            *frame = retFrame;
-
-            gotFrame = true;
-
-            frame_api_t* api = frame_get_api(*frame);
-            channel_state_tc_t* cs = NULL;
-            if (api->get_media_type(*frame) == mediaVideo) {
-                cs = tc->videoState;
-            }
+            sv_mutex_enter(tc->dataMutex);
+            size = tc->queue->size();
+            if (tc->queue->empty()) {
+                TRACE(_FMT("Queue is empty"));
+                gotFrame = false;
+                sv_event_reset( tc->event );
+            } else {
+                frame_obj* retFrame = tc->queue->front();
+                tc->queue->pop_front();
+                sv_event_set(tc->queueEvent);
+                // set the return value
+                *frame = retFrame;
 
-            if ( cs != NULL ) {
-                int64_t now = sv_time_get_current_epoch_time();
-                int64_t dur = sv_time_get_time_diff(cs->lastFrameReadTime, now);
+                gotFrame = true;
 
-                pts = api->get_pts(*frame);
-                cs->lastFrameReadTime = now;
-                if (pts > cs->lastPtsRead || cs->lastPtsRead == INVALID_PTS) {
-                    cs->lastPtsRead = pts;
+                channel_state_tc_t* cs = NULL;
+                if (frame_props_media_type(*frame) == mediaVideo) {
+                    cs = tc->videoState;
                 }
-                stats_int_update(&cs->intervalStats.queueDepth, tc->queue->size());
-                stats_int_update(&cs->intervalStats.readInterval, dur);
-                stats_int_update(&cs->intervalStats.ptsSpread, cs->lastPtsInQueue - cs->lastPtsRead);
-                cs->framesInQueue--;
 
-                fps_limiter_report_frame(cs->readLimiter, NULL, elapsedSinceLastRead);
-                tc->elapsedAccumulator = 0;
-            } else {
-                tc->elapsedAccumulator = elapsedSinceLastRead;
+                if ( cs != NULL ) {
+                    int64_t now = sv_time_get_current_epoch_time();
+                    int64_t dur = sv_time_get_time_diff(cs->lastFrameReadTime, now);
+
+                    pts = frame_props_pts(*frame);
+                    cs->lastFrameReadTime = now;
+                    if (pts > cs->lastPtsRead || cs->lastPtsRead == INVALID_PTS) {
+                        cs->lastPtsRead = pts;
+                    }
+                    stats_int_update(&cs->intervalStats.queueDepth, tc->queue->size());
+                    stats_int_update(&cs->intervalStats.readInterval, dur);
+                    stats_int_update(&cs->intervalStats.ptsSpread, cs->lastPtsInQueue - cs->lastPtsRead);
+                    cs->framesInQueue--;
+
+                    fps_limiter_report_frame(cs->readLimiter, NULL, elapsedSinceLastRead);
+                    tc->elapsedAccumulator = 0;
+                } else {
+                    tc->elapsedAccumulator = elapsedSinceLastRead;
+                }
             }
+            sv_mutex_exit(tc->dataMutex);
         }
-        sv_mutex_exit(tc->dataMutex);
 
         if ( !gotFrame ) {
             sv_rwlock_lock_read(tc->streamLock);
@@ -824,7 +1325,9 @@ static int         tc_stream_read_frame        (stream_obj* stream, frame_obj**
             if ( running ) {
                 int res = 0;
                 TRACE(_FMT("Waiting for a frame"));
+                INT64_T traceStart = _tc_trace_begin();
                 res = sv_event_wait(tc->event, tc->timeoutMs);
+                _tc_trace_end(tc, "tc_wait_frame", traceStart);
                 TRACE(_FMT("Done waiting for a frame, res=" << res));
                 if ( res > 0 ) {
                     timeout = true;
@@ -834,7 +1337,7 @@ static int         tc_stream_read_frame        (stream_obj* stream, frame_obj**
             } else if ( eof ) {
                 // queue may have been refilled since our last attempt to access it
                 sv_mutex_enter(tc->dataMutex);
-                keepTrying = !tc->queue->empty();
+                keepTrying = !_tc_queue_empty(tc);
                 sv_mutex_exit(tc->dataMutex);
             } else {
                 keepTrying = false;
@@ -844,6 +1347,7 @@ static int         tc_stream_read_frame        (stream_obj* stream, frame_obj**
 
     int retval = 0;
     if ( gotFrame ) {
+        frame_trace_stamp(*frame, ftDequeued);
         TRACE(_FMT("Got frame " << (void*)tc << " pts=" << pts ));
     } else
     if ( !running && !eof ) {
@@ -863,6 +1367,7 @@ static int         tc_stream_read_frame        (stream_obj* stream, frame_obj**
     }
 
     tc->lastFrameReadTime = sv_time_get_current_epoch_time();
+    _tc_ready_update(tc);
 
     return retval;
 }
@@ -885,12 +1390,19 @@ static int         tc_stream_close             (stream_obj* stream)
     sv_mutex_enter(tc->dataMutex);
     sv_event_set(tc->queueEvent);
     sv_mutex_exit(tc->dataMutex);
+    _tc_ready_set(tc);
 
     int err = sv_thread_destroy(&tc->thread);
     if ( err != 0 ) {
         tc->logCb(logError, _FMT("Error " << err << " terminating thread"));
     }
 
+    if ( tc->ring ) {
+        // producer is gone by now, so both sides are safe to fold
+        channel_state_tc_t* cs = tc->videoState;
+        _tc_ring_fold_stats(tc, &cs->pendingWriteStats, &cs->pendingWrites, true);
+        _tc_ring_fold_stats(tc, &cs->pendingReadStats, &cs->pendingReads, true);
+    }
     _tc_log_stats(tc);
     _tc_flush_queue(tc);
     tc->videoState->close();
@@ -910,12 +1422,15 @@ static void tc_stream_destroy         (stream_obj* stream)
 
     sv_event_destroy(&tc->event);
     sv_event_destroy(&tc->queueEvent);
+    sv_pollable_event_destroy(&tc->ready);
     sv_mutex_destroy(&tc->dataMutex);
     sv_rwlock_destroy(&tc->streamLock);
     frame_list_destroy (&tc->queue);
+    _tc_ring_destroy (&tc->ring);
 
     destroy_frame_allocator( &tc->fa, tc->logCb );
     delete tc->videoState;
+    sv_freep(&tc->threadClass);
     stream_destroy( stream );
 }
 
@@ -0,0 +1,785 @@
+/*****************************************************************************
+ *
+ * stream_timestamp_overlay.cpp
+ *   Node drawing the timestamp overlay from a glyph atlas rasterized once per
+ *   font size, rather than through a drawtext filter graph on every frame.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#undef SV_MODULE_VAR
+#define SV_MODULE_VAR tsoverlay
+#define SV_MODULE_ID "TSOVERLAY"
+#include "sv_module_def.hpp"
+
+#include "streamprv.h"
+
+#include "frame_basic.h"
+#include "sv_ffmpeg.h"
+#include "sv_pixfmt.h"
+
+#include "videolibUtils.h"
+
+extern "C" {
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersrc.h>
+#include <libavfilter/buffersink.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include <time.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TSOVERLAY_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define TSOVERLAY_NEON 1
+#include <arm_neon.h>
+#endif
+
+#define TSOVERLAY_FILTER_MAGIC 0x1251
+
+// the atlas covers printable ASCII; anything else is drawn as '?'
+static const char   kFirstGlyph = ' ';
+static const char   kLastGlyph = '~';
+static const int    kGlyphCount = kLastGlyph - kFirstGlyph + 1;
+// same look as the drawtext overlay: fontcolor=white@0.75, boxcolor=black@0.35
+static const float  kTextAlpha = 0.75f;
+static const float  kBoxAlpha = 0.35f;
+static const char*  kDefaultStrftime = "%Y-%m-%d %H:%M:%S";
+
+//-----------------------------------------------------------------------------
+// Coverage of every glyph in a cell of advance x cellHeight, in one row
+typedef struct tso_atlas {
+    int                     advance;
+    int                     cellHeight;
+    std::vector<uint8_t>    coverage;   // kGlyphCount*advance wide
+} tso_atlas;
+
+// What blending a glyph's cell takes, for the frame format at hand:
+// dst = (dst*mul + add + 128) >> 8, for every byte of the first plane
+typedef struct tso_glyph {
+    bool                    ready;
+    std::vector<uint16_t>   mul;
+    std::vector<uint16_t>   add;
+} tso_glyph;
+
+// atlases are only ever built once per font and size
+static std::mutex                           _gAtlasMutex;
+static std::map<std::string, tso_atlas*>    _gAtlases;
+
+//-----------------------------------------------------------------------------
+typedef struct tso_filter  : public stream_base  {
+    char*                   filterType;
+    INT64_T                 timestampOffset;
+    int                     showDate;
+    char*                   strftime;
+    char*                   font;
+    int                     fontsize;
+    int                     modifyInPlace;
+    int                     sharingDisabled;    // told the resize we draw on not to share its output
+    rational_t              timebase;
+    int                     timebaseQueried;
+
+    // what the glyphs were compiled for
+    int                     width;
+    int                     height;
+    int                     pixfmt;
+    int                     supported;
+    int                     step;               // bytes per pixel in the first plane
+    int                     alphaOffset;        // of the byte left alone; -1 if none
+    int                     black;
+    int                     white;
+    int                     chromaPlanes[2];    // -1 if unused
+    int                     chromaStep;
+    int                     chromaShiftX;
+    int                     chromaShiftY;
+    tso_atlas*              atlas;
+    int                     atlasFailed;
+    std::vector<tso_glyph>* glyphs;
+
+    INT64_T                 textKey;            // what text was last formatted for
+    std::string*            text;
+    frame_allocator*        fa;
+} tso_filter_obj;
+
+//-----------------------------------------------------------------------------
+// Stream API
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+//  Forward declarations
+//-----------------------------------------------------------------------------
+static stream_obj* tso_filter_create             (const char* name);
+static int         tso_filter_set_param          (stream_obj* stream,
+                                                const CHAR_T* name,
+                                                const void* value);
+static int         tso_filter_seek               (stream_obj* stream,
+                                                INT64_T offset,
+                                                int flags);
+static int         tso_filter_read_frame         (stream_obj* stream, frame_obj** frame);
+static int         tso_filter_close              (stream_obj* stream);
+static void        tso_filter_destroy            (stream_obj* stream);
+
+
+//-----------------------------------------------------------------------------
+stream_api_t _g_tso_filter_provider = {
+    tso_filter_create,
+    get_default_stream_api()->set_source,
+    get_default_stream_api()->set_log_cb,
+    get_default_stream_api()->get_name,
+    get_default_stream_api()->find_element,
+    get_default_stream_api()->remove_element,
+    get_default_stream_api()->insert_element,
+    tso_filter_set_param,
+    get_default_stream_api()->get_param,
+    get_default_stream_api()->open_in,
+    tso_filter_seek,
+    get_default_stream_api()->get_width,
+    get_default_stream_api()->get_height,
+    get_default_stream_api()->get_pixel_format,
+    tso_filter_read_frame,
+    get_default_stream_api()->print_pipeline,
+    tso_filter_close,
+    _set_module_trace_level
+};
+
+
+//-----------------------------------------------------------------------------
+#define DECLARE_TSO_FILTER(stream, name) \
+    DECLARE_OBJ(tso_filter_obj, name,  stream, TSOVERLAY_FILTER_MAGIC, -1)
+
+#define DECLARE_TSO_FILTER_V(stream, name) \
+    DECLARE_OBJ_V(tso_filter_obj, name,  stream, TSOVERLAY_FILTER_MAGIC)
+
+static stream_obj*   tso_filter_create                (const char* name)
+{
+    tso_filter_obj* res = (tso_filter_obj*)stream_init(sizeof(tso_filter_obj),
+                TSOVERLAY_FILTER_MAGIC,
+                &_g_tso_filter_provider,
+                name,
+                tso_filter_destroy );
+    res->filterType = strdup("timestamp");
+    res->timestampOffset = 0;
+    res->showDate = 1;
+    res->strftime = NULL;
+    res->font = NULL;
+    res->fontsize = 0;
+    res->modifyInPlace = 0;
+    res->sharingDisabled = 0;
+    res->timebase.num = 1;
+    res->timebase.denum = 1000;
+    res->timebaseQueried = 0;
+    res->width = 0;
+    res->height = 0;
+    res->pixfmt = pfmtUndefined;
+    res->supported = 0;
+    res->atlas = NULL;
+    res->atlasFailed = 0;
+    res->glyphs = new std::vector<tso_glyph>;
+    res->textKey = INVALID_PTS;
+    res->text = new std::string;
+    res->fa = create_frame_allocator(_STR("tsoverlay_"<<name));
+    return (stream_obj*)res;
+}
+
+//-----------------------------------------------------------------------------
+static int         tso_filter_set_param             (stream_obj* stream,
+                                            const CHAR_T* name,
+                                            const void* value)
+{
+    DECLARE_TSO_FILTER(stream, tso);
+    name = stream_param_name_apply_scope(stream, name);
+    if ( !_stricmp(name, "filterType") ) {
+        const char* ft = (const char*)value;
+        if ( _stricmp(ft, "timestamp") && _stricmp(ft, "timer") ) {
+            tso->logCb(logError, _FMT("Filter type '" << ft << "' isn't supported by the timestamp overlay"));
+            return -1;
+        }
+        sv_freep(&tso->filterType);
+        tso->filterType = strdup(ft);
+        tso->textKey = INVALID_PTS;
+        return 0;
+    }
+    if ( !_stricmp(name, "timestampOffset") ) {
+        tso->timestampOffset = *(INT64_T*)value;
+        tso->textKey = INVALID_PTS;
+        return 0;
+    }
+    if ( !_stricmp(name, "strftime") ) {
+        // the string is escaped for drawtext; we take it as is
+        sv_freep(&tso->strftime);
+        if ( value ) {
+            const char* src = (const char*)value;
+            tso->strftime = (char*)malloc(strlen(src)+1);
+            char* dst = tso->strftime;
+            for ( ; *src; src++ ) {
+                if ( *src == '\\' && *(src+1) ) {
+                    src++;
+                }
+                *dst++ = *src;
+            }
+            *dst = '\0';
+        }
+        tso->textKey = INVALID_PTS;
+        return 0;
+    }
+    SET_PARAM_IF(stream, name, "showDate", int, tso->showDate);
+    SET_PARAM_IF(stream, name, "modifyInPlace", int, tso->modifyInPlace);
+    SET_STR_PARAM_IF(stream, name, "font", tso->font);
+    return default_set_param(stream, name, value);
+}
+
+//-----------------------------------------------------------------------------
+// Rightmost column with any ink in rows [top,bottom), or -1
+static int         _tso_ink_right                  (const AVFrame* f, int top, int bottom)
+{
+    int right = -1;
+    for (int y=top; y<bottom && y<f->height; y++) {
+        const uint8_t* row = f->data[0] + y*f->linesize[0];
+        for (int x=f->width-1; x>right; x--) {
+            if ( row[x] ) {
+                right = x;
+                break;
+            }
+        }
+    }
+    return right;
+}
+
+//-----------------------------------------------------------------------------
+// Has drawtext render, white on black, "0" and "00000000" to learn the advance
+// of the (monospace) font, and then the whole range of glyphs in one line
+static tso_atlas*  _tso_render_atlas               (tso_filter_obj* tso,
+                                                    const char* font,
+                                                    int fontsize)
+{
+    static const int    kBands = 3;
+    const int           bandHeight = 2*fontsize;
+    const int           w = (kGlyphCount+8)*fontsize;
+    const int           h = kBands*bandHeight;
+    std::string         glyphs;
+    for (char c=kFirstGlyph; c<=kLastGlyph; c++) {
+        glyphs += c;
+    }
+    const char*         texts[kBands] = { "0", "00000000", glyphs.c_str() };
+
+    tso_atlas*          atlas = NULL;
+    AVFilterGraph*      graph = avfilter_graph_alloc();
+    AVFilterContext*    src = NULL;
+    AVFilterContext*    sink = NULL;
+    AVFilterContext*    prev = NULL;
+    AVFrame*            in = av_frame_alloc();
+    AVFrame*            out = av_frame_alloc();
+    const AVFilter*     drawtext = avfilter_get_by_name("drawtext");
+    std::string         args = _STR("video_size=" << w << "x" << h <<
+                                    ":pix_fmt=" << AV_PIX_FMT_GRAY8 <<
+                                    ":time_base=1/1000");
+
+    if ( drawtext == NULL ) {
+        tso->logCb(logError, _FMT("drawtext filter isn't available; can't rasterize " << font));
+        goto Error;
+    }
+    if ( graph == NULL || in == NULL || out == NULL ||
+         avfilter_graph_create_filter(&src, avfilter_get_by_name("buffer"), "in", args.c_str(), NULL, graph) < 0 ||
+         avfilter_graph_create_filter(&sink, avfilter_get_by_name("buffersink"), "out", NULL, NULL, graph) < 0 ) {
+        tso->logCb(logError, _FMT("Couldn't create the graph rasterizing glyphs"));
+        goto Error;
+    }
+
+    // no string parsing on the way, so nothing in the text or the path needs escaping
+    prev = src;
+    for (int band=0; band<kBands; band++) {
+        AVFilterContext* dt = avfilter_graph_alloc_filter(graph, drawtext, _STR("glyphs" << band).c_str());
+        if ( dt == NULL ||
+             av_opt_set(dt, "fontfile", font, 0) < 0 ||
+             av_opt_set(dt, "text", texts[band], 0) < 0 ||
+             av_opt_set(dt, "expansion", "none", 0) < 0 ||
+             av_opt_set(dt, "fontsize", _STR(fontsize).c_str(), 0) < 0 ||
+             av_opt_set(dt, "fontcolor", "white", 0) < 0 ||
+             av_opt_set(dt, "x", "0", 0) < 0 ||
+             av_opt_set(dt, "y", _STR(band*bandHeight).c_str(), 0) < 0 ||
+             avfilter_init_str(dt, NULL) < 0 ||
+             avfilter_link(prev, 0, dt, 0) < 0 ) {
+            tso->logCb(logError, _FMT("Couldn't set up drawtext for " << font << "; does it exist?"));
+            goto Error;
+        }
+        prev = dt;
+    }
+    if ( avfilter_link(prev, 0, sink, 0) < 0 ||
+         avfilter_graph_config(graph, NULL) < 0 ) {
+        tso->logCb(logError, _FMT("Couldn't configure the graph rasterizing glyphs"));
+        goto Error;
+    }
+
+    in->width = w;
+    in->height = h;
+    in->format = AV_PIX_FMT_GRAY8;
+    in->pts = 0;
+    if ( av_frame_get_buffer(in, 0) < 0 ) {
+        goto Error;
+    }
+    for (int y=0; y<h; y++) {
+        memset(in->data[0] + y*in->linesize[0], 0, w);
+    }
+    if ( av_buffersrc_add_frame(src, in) < 0 ||
+         av_buffersink_get_frame(sink, out) < 0 ) {
+        tso->logCb(logError, _FMT("Couldn't rasterize glyphs of " << font));
+        goto Error;
+    }
+
+    {
+        int one = _tso_ink_right(out, 0, bandHeight);
+        int eight = _tso_ink_right(out, bandHeight, 2*bandHeight);
+        int advance = (one >= 0 && eight > one) ? (eight - one)/7 : 0;
+        if ( advance <= 0 ) {
+            tso->logCb(logError, _FMT("Couldn't measure the advance of " << font));
+            goto Error;
+        }
+
+        int top = -1, bottom = -1;
+        for (int y=2*bandHeight; y<h; y++) {
+            const uint8_t* row = out->data[0] + y*out->linesize[0];
+            for (int x=0; x<kGlyphCount*advance; x++) {
+                if ( row[x] ) {
+                    if ( top < 0 ) top = y;
+                    bottom = y;
+                    break;
+                }
+            }
+        }
+        if ( top < 0 ) {
+            goto Error;
+        }
+
+        atlas = new tso_atlas;
+        atlas->advance = advance;
+        atlas->cellHeight = bottom - top + 1;
+        const int rowSize = kGlyphCount*advance;
+        atlas->coverage.resize(rowSize*atlas->cellHeight);
+        for (int y=0; y<atlas->cellHeight; y++) {
+            memcpy(&atlas->coverage[y*rowSize], out->data[0] + (top+y)*out->linesize[0], rowSize);
+        }
+        tso->logCb(logDebug, _FMT("Rasterized " << kGlyphCount << " glyphs of " << font <<
+                                  " at size " << fontsize << ": cell=" << advance << "x" << atlas->cellHeight));
+    }
+
+Error:
+    av_frame_free(&in);
+    av_frame_free(&out);
+    avfilter_graph_free(&graph);
+    return atlas;
+}
+
+//-----------------------------------------------------------------------------
+// Same sizing as the drawtext overlay
+static tso_atlas*  _tso_get_atlas                  (tso_filter_obj* tso)
+{
+    int fontsize = tso->fontsize;
+    if ( fontsize <= 0 ) {
+        if (tso->height <= 300)
+            fontsize = 14;
+        else if (tso->height <= 500)
+            fontsize = 24;
+        else if (tso->height <= 1000)
+            fontsize = 26;
+        else
+            fontsize = (int)(tso->height / 40);
+    }
+
+    if ( !tso->font ) {
+        char* path = sv_get_path(DataPath);
+        if ( path != NULL ) {
+            tso->font = strdup(_STR(path << PATH_SEPA << "fonts" << PATH_SEPA << "Inconsolata.otf").c_str());
+            sv_freep(&path);
+        }
+    }
+    if ( !tso->font ) {
+        return NULL;
+    }
+
+    std::string key = _STR(tso->font << "|" << fontsize);
+    std::lock_guard<std::mutex> guard(_gAtlasMutex);
+    std::map<std::string, tso_atlas*>::iterator it = _gAtlases.find(key);
+    if ( it != _gAtlases.end() ) {
+        return it->second;
+    }
+    tso_atlas* atlas = _tso_render_atlas(tso, tso->font, fontsize);
+    if ( atlas != NULL ) {
+        _gAtlases[key] = atlas;
+    }
+    return atlas;
+}
+
+//-----------------------------------------------------------------------------
+static void        _tso_configure                  (tso_filter_obj* tso,
+                                                    int width,
+                                                    int height,
+                                                    int pixfmt)
+{
+    enum AVColorRange        range = AVCOL_RANGE_UNSPECIFIED;
+    enum AVPixelFormat       ffpfmt = svpfmt_to_ffpfmt(pixfmt, &range);
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(ffpfmt);
+
+    tso->width = width;
+    tso->height = height;
+    tso->pixfmt = pixfmt;
+    tso->supported = 0;
+    tso->glyphs->clear();
+    tso->chromaPlanes[0] = tso->chromaPlanes[1] = -1;
+
+    if ( desc == NULL ||
+         (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL)) ||
+         desc->comp[0].depth != 8 ) {
+        tso->logCb(logWarning, _FMT("Timestamp can't be drawn on frames of pixfmt=" << pixfmt));
+        return;
+    }
+    if ( desc->flags & AV_PIX_FMT_FLAG_RGB ) {
+        if ( (desc->flags & AV_PIX_FMT_FLAG_PLANAR) || desc->nb_components < 3 ) {
+            tso->logCb(logWarning, _FMT("Timestamp can't be drawn on frames of pixfmt=" << pixfmt));
+            return;
+        }
+        tso->step = desc->comp[0].step;
+        tso->alphaOffset = (desc->flags & AV_PIX_FMT_FLAG_ALPHA) ? desc->comp[3].offset : -1;
+        tso->black = 0;
+        tso->white = 255;
+    } else {
+        // luma on a plane of its own, in any of our planar or semi-planar formats
+        if ( desc->comp[0].step != 1 || desc->nb_components < 3 ) {
+            tso->logCb(logWarning, _FMT("Timestamp can't be drawn on frames of pixfmt=" << pixfmt));
+            return;
+        }
+        bool full = ( range == AVCOL_RANGE_JPEG );
+        tso->step = 1;
+        tso->alphaOffset = -1;
+        tso->black = full ? 0 : 16;
+        tso->white = full ? 255 : 235;
+        tso->chromaPlanes[0] = desc->comp[1].plane;
+        if ( desc->comp[2].plane != desc->comp[1].plane ) {
+            tso->chromaPlanes[1] = desc->comp[2].plane;
+        }
+        // interleaved chroma: every byte of the sample is pulled the same way
+        tso->chromaStep = ( tso->chromaPlanes[1] < 0 ) ? desc->comp[1].step : 1;
+        tso->chromaShiftX = desc->log2_chroma_w;
+        tso->chromaShiftY = desc->log2_chroma_h;
+    }
+
+    if ( tso->atlas == NULL && !tso->atlasFailed ) {
+        tso->atlas = _tso_get_atlas(tso);
+        tso->atlasFailed = ( tso->atlas == NULL );
+    }
+    if ( tso->atlas == NULL ) {
+        return;
+    }
+    tso->glyphs->resize(kGlyphCount);
+    for (size_t nI=0; nI<tso->glyphs->size(); nI++) {
+        (*tso->glyphs)[nI].ready = false;
+    }
+    tso->supported = 1;
+}
+
+//-----------------------------------------------------------------------------
+// Box, then text over it, as drawtext does:
+//   dst*(1-box)*(1-text) + black*box*(1-text) + white*text
+static tso_glyph&  _tso_get_glyph                  (tso_filter_obj* tso, int index)
+{
+    tso_glyph& g = (*tso->glyphs)[index];
+    if ( g.ready ) {
+        return g;
+    }
+
+    const tso_atlas* atlas = tso->atlas;
+    const int        adv = atlas->advance;
+    const int        rowSize = kGlyphCount*adv;
+    g.mul.resize(adv*tso->step*atlas->cellHeight);
+    g.add.resize(g.mul.size());
+    for (int y=0; y<atlas->cellHeight; y++) {
+        const uint8_t* cov = &atlas->coverage[y*rowSize + index*adv];
+        uint16_t*      mul = &g.mul[y*adv*tso->step];
+        uint16_t*      add = &g.add[y*adv*tso->step];
+        for (int x=0; x<adv; x++) {
+            float text = kTextAlpha*cov[x]/255.0f;
+            uint16_t m = (uint16_t)(256*(1-kBoxAlpha)*(1-text) + 0.5f);
+            uint16_t a = (uint16_t)(256*(tso->black*kBoxAlpha*(1-text) + tso->white*text) + 0.5f);
+            for (int c=0; c<tso->step; c++) {
+                bool alpha = ( c == tso->alphaOffset );
+                mul[x*tso->step+c] = alpha ? 256 : m;
+                add[x*tso->step+c] = alpha ? 0 : a;
+            }
+        }
+    }
+    g.ready = true;
+    return g;
+}
+
+//-----------------------------------------------------------------------------
+static void        _tso_blend_row                  (uint8_t* dst,
+                                                    const uint16_t* mul,
+                                                    const uint16_t* add,
+                                                    int count)
+{
+    int nI = 0;
+#if TSOVERLAY_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+    for ( ; nI+8<=count; nI+=8 ) {
+        // products stay under 2^16: mul+add/255 never exceeds 256
+        __m128i d = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(dst+nI)), zero);
+        __m128i r = _mm_mullo_epi16(d, _mm_loadu_si128((const __m128i*)(mul+nI)));
+        r = _mm_add_epi16(r, _mm_loadu_si128((const __m128i*)(add+nI)));
+        r = _mm_srli_epi16(_mm_add_epi16(r, round), 8);
+        _mm_storel_epi64((__m128i*)(dst+nI), _mm_packus_epi16(r, zero));
+    }
+#elif TSOVERLAY_NEON
+    for ( ; nI+8<=count; nI+=8 ) {
+        uint16x8_t r = vmlaq_u16(vld1q_u16(add+nI), vmovl_u8(vld1_u8(dst+nI)), vld1q_u16(mul+nI));
+        vst1_u8(dst+nI, vrshrn_n_u16(r, 8));
+    }
+#endif
+    for ( ; nI<count; nI++ ) {
+        dst[nI] = (uint8_t)((dst[nI]*mul[nI] + add[nI] + 128) >> 8);
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void        _tso_format_text                (tso_filter_obj* tso, INT64_T pts)
+{
+    double  seconds = pts*(double)tso->timebase.num/tso->timebase.denum +
+                      tso->timestampOffset/1000.0;
+    char    buffer[128] = "";
+
+    if ( !_stricmp(tso->filterType, "timer") ) {
+        snprintf(buffer, sizeof(buffer), "%.6f", seconds);
+        tso->textKey = INVALID_PTS;
+    } else if ( !tso->showDate ) {
+        INT64_T ms = (INT64_T)(seconds*1000 + (seconds < 0 ? -0.5 : 0.5));
+        const char* sign = ms < 0 ? "-" : "";
+        ms = ms < 0 ? -ms : ms;
+        snprintf(buffer, sizeof(buffer), "%s%02d:%02d:%02d.%03d", sign,
+                    (int)(ms/3600000), (int)(ms/60000%60), (int)(ms/1000%60), (int)(ms%1000));
+        tso->textKey = INVALID_PTS;
+    } else {
+        // the text only changes once a second, and so does localtime
+        time_t  t = (time_t)seconds;
+        if ( tso->textKey == (INT64_T)t ) {
+            return;
+        }
+        struct tm tm;
+#ifdef _WIN32
+        localtime_s(&tm, &t);
+#else
+        localtime_r(&t, &tm);
+#endif
+        strftime(buffer, sizeof(buffer), tso->strftime ? tso->strftime : kDefaultStrftime, &tm);
+        tso->textKey = (INT64_T)t;
+    }
+    *tso->text = buffer;
+}
+
+//-----------------------------------------------------------------------------
+static void        _tso_draw                       (tso_filter_obj* tso,
+                                                    uint8_t* planes[4],
+                                                    const int linesizes[4])
+{
+    const tso_atlas*    atlas = tso->atlas;
+    const int           adv = atlas->advance;
+    const int           rows = std::min(atlas->cellHeight, tso->height);
+    const int           chars = std::min((int)tso->text->size(), tso->width/adv);
+    std::vector<int>    indices(chars);
+
+    for (int ch=0; ch<chars; ch++) {
+        char c = (*tso->text)[ch];
+        indices[ch] = ( c >= kFirstGlyph && c <= kLastGlyph ) ? c - kFirstGlyph : '?' - kFirstGlyph;
+        const tso_glyph& g = _tso_get_glyph(tso, indices[ch]);
+        const int        rowBytes = adv*tso->step;
+        for (int y=0; y<rows; y++) {
+            _tso_blend_row(planes[0] + y*linesizes[0] + ch*rowBytes,
+                           &g.mul[y*rowBytes],
+                           &g.add[y*rowBytes],
+                           rowBytes);
+        }
+    }
+
+    // chroma goes neutral the way luma goes black/white; each sample takes
+    // the weight of the luma pixel at its top left
+    for (int p=0; p<2 && tso->chromaPlanes[p] >= 0; p++) {
+        uint8_t*  plane = planes[tso->chromaPlanes[p]];
+        const int stride = linesizes[tso->chromaPlanes[p]];
+        const int cols = (chars*adv) >> tso->chromaShiftX;
+        const int chromaRows = (rows + (1<<tso->chromaShiftY) - 1) >> tso->chromaShiftY;
+        for (int y=0; y<chromaRows; y++) {
+            const int ly = y << tso->chromaShiftY;
+            uint8_t*  row = plane + y*stride;
+            for (int x=0; x<cols; x++) {
+                const int lx = x << tso->chromaShiftX;
+                const tso_glyph& g = (*tso->glyphs)[indices[lx/adv]];
+                const int m = g.mul[ly*adv + lx%adv];
+                for (int c=0; c<tso->chromaStep; c++) {
+                    uint8_t* d = &row[x*tso->chromaStep + c];
+                    *d = (uint8_t)((*d*m + 128*(256-m) + 128) >> 8);
+                }
+            }
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+static int         tso_filter_seek                 (stream_obj* stream,
+                                                    INT64_T offset,
+                                                    int flags)
+{
+    DECLARE_TSO_FILTER(stream, tso);
+    tso->textKey = INVALID_PTS;
+    return default_seek(stream, offset, flags);
+}
+
+//-----------------------------------------------------------------------------
+static int         tso_filter_read_frame           (stream_obj* stream,
+                                                    frame_obj** frame)
+{
+    DECLARE_TSO_FILTER(stream, tso);
+    frame_obj*      tmp = NULL;
+    frame_api_t*    api;
+
+    *frame = NULL;
+    if ( tso->modifyInPlace && !tso->sharingDisabled ) {
+        // other branches mustn't be handed the frames we draw on
+        int allow = 0;
+        default_set_param(stream, "allowSharedResults", &allow);
+        tso->sharingDisabled = 1;
+    }
+    int res = default_read_frame(stream, &tmp);
+    if ( res < 0 || tmp == NULL ||
+         (api = frame_get_api(tmp)) == NULL ||
+         api->get_media_type(tmp) != mediaVideo ) {
+        *frame = tmp;
+        return res;
+    }
+
+    if ( !tso->timebaseQueried ) {
+        size_t size = sizeof(rational_t);
+        rational_t timebase;
+        if ( default_get_param(stream, "timebase", &timebase, &size) >= 0 && timebase.denum != 0 ) {
+            tso->timebase = timebase;
+        }
+        tso->timebaseQueried = 1;
+    }
+
+    int width = (int)api->get_width(tmp);
+    int height = (int)api->get_height(tmp);
+    int pixfmt = api->get_pixel_format(tmp);
+    if ( width != tso->width || height != tso->height || pixfmt != tso->pixfmt ) {
+        _tso_configure(tso, width, height, pixfmt);
+    }
+    if ( !tso->supported ) {
+        *frame = tmp;
+        return 0;
+    }
+
+    INT64_T ts = api->get_pts(tmp);
+    _tso_format_text(tso, ts);
+
+    // draw on our own copy (one out of the pool), unless told it's ours to change
+    enum AVPixelFormat ffpfmt = svpfmt_to_ffpfmt(pixfmt, NULL);
+    AVFrame*    avframe = (AVFrame*)api->get_backing_obj(tmp, "avframe");
+    frame_obj*  retFrame = tmp;
+    uint8_t*    dst = (uint8_t*)api->get_data(tmp);
+    if ( avframe != NULL || !tso->modifyInPlace ) {
+        int size = av_image_get_buffer_size(ffpfmt, width, height, _kDefAlign);
+        basic_frame_obj* newFrame = alloc_basic_frame2(TSOVERLAY_FILTER_MAGIC,
+                                    size,
+                                    tso->logCb,
+                                    tso->fa );
+        newFrame->pts = ts;
+        newFrame->dts = api->get_dts(tmp);
+        newFrame->keyframe = api->get_keyframe_flag(tmp);
+        newFrame->width = width;
+        newFrame->height = height;
+        newFrame->pixelFormat = pixfmt;
+        newFrame->mediaType = mediaVideo;
+        newFrame->dataSize = size;
+        if ( avframe != NULL ) {
+            av_image_copy_to_buffer(newFrame->data, size,
+                                    avframe->data, avframe->linesize,
+                                    ffpfmt, width, height, _kDefAlign);
+        } else {
+            memcpy(newFrame->data, dst, std::min((size_t)size, api->get_data_size(tmp)));
+        }
+        dst = newFrame->data;
+        retFrame = (frame_obj*)newFrame;
+        frame_unref(&tmp);
+    }
+
+    uint8_t*    planes[4];
+    int         linesizes[4];
+    av_image_fill_arrays(planes, linesizes, dst, ffpfmt, width, height, _kDefAlign);
+    _tso_draw(tso, planes, linesizes);
+
+    *frame = retFrame;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+static int         tso_filter_close                (stream_obj* stream)
+{
+    DECLARE_TSO_FILTER(stream, tso);
+    tso->textKey = INVALID_PTS;
+    tso->sharingDisabled = 0;
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+static void tso_filter_destroy         (stream_obj* stream)
+{
+    DECLARE_TSO_FILTER_V(stream, tso);
+    tso->logCb(logTrace, _FMT("Destroying stream object " << (void*)stream));
+    tso_filter_close(stream); // make sure all the internals had been freed
+    sv_freep(&tso->filterType);
+    sv_freep(&tso->strftime);
+    sv_freep(&tso->font);
+    delete tso->glyphs;
+    delete tso->text;
+    destroy_frame_allocator( &tso->fa, tso->logCb );
+    stream_destroy( stream );
+}
+
+//-----------------------------------------------------------------------------
+SVVIDEOLIB_API stream_api_t*     get_timestamp_overlay_api            ()
+{
+    ffmpeg_init();
+    return &_g_tso_filter_provider;
+}
@@ -35,8 +35,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <map>
 #include <mutex>
+#include <string>
 
 extern "C" {
 #include <libavutil/opt.h>
@@ -45,8 +47,15 @@ extern "C" {
 
 #include "logging.h"
 #include "sv_os.h"
+#include "sv_internal.h"
 #include "sv_ffmpeg.h"
 #include "buffered_file.h"
+#include "clip_index.h"
+
+extern "C" {
+SVVIDEOLIB_API AVIOContext* ffmpeg_create_mmap_io (const char* filename, int access);
+SVVIDEOLIB_API void         ffmpeg_close_mmap_io  (AVIOContext** pCtx);
+}
 
 static log_fn_t   _ffmpegLogFn = NULL;
 static int        _ffmpegLogEnabled = 0;
@@ -266,10 +275,124 @@ int         ffmpeg_close_buffered_io(AVIOContext* ctx)
     return 0;
 }
 
+//-----------------------------------------------------------------------------
+// Read-only AVIO over a memory mapping of a local file: the demuxer's reads
+// become copies out of the page cache, with no system call once the pages are
+// resident, which is what repeated scrubbing and scanning of the same clips
+// mostly hits. The mapping covers the file as of the time it was made; a
+// read at its end looks again, in case the file is still being written.
+//-----------------------------------------------------------------------------
+typedef struct mmap_io {
+    sv_mmap*        map;
+    std::string     filename;
+    int             access;
+    int64_t         pos;
+} mmap_io;
+
+static const int kMmapIoBufferSize = 64*1024;
+
+//-----------------------------------------------------------------------------
+static void _mmap_io_remap(mmap_io* io)
+{
+    sv_mmap* map = sv_open_mmap_readonly(io->filename.c_str(), io->access);
+    if ( map != NULL && sv_mmap_get_size(map) > sv_mmap_get_size(io->map) ) {
+        std::swap(map, io->map);
+    }
+    sv_close_mmap(&map);
+}
+
+//-----------------------------------------------------------------------------
+static int _mmap_read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    mmap_io* io = (mmap_io*)opaque;
+    int64_t size = (int64_t)sv_mmap_get_size(io->map);
+    if ( io->pos >= size ) {
+        _mmap_io_remap(io);
+        size = (int64_t)sv_mmap_get_size(io->map);
+        if ( io->pos >= size ) {
+            return AVERROR_EOF;
+        }
+    }
+    int toRead = (int)std::min<int64_t>(buf_size, size - io->pos);
+    memcpy(buf, sv_mmap_get_ptr(io->map) + io->pos, toRead);
+    io->pos += toRead;
+    return toRead;
+}
+
+//-----------------------------------------------------------------------------
+static int64_t _mmap_seek(void *opaque, int64_t offset, int whence)
+{
+    mmap_io* io = (mmap_io*)opaque;
+    int64_t size = (int64_t)sv_mmap_get_size(io->map);
+    int64_t pos;
+
+    switch ( whence & ~AVSEEK_FORCE ) {
+    case AVSEEK_SIZE:   return size;
+    case SEEK_SET:      pos = offset; break;
+    case SEEK_CUR:      pos = io->pos + offset; break;
+    case SEEK_END:      pos = size + offset; break;
+    default:            return AVERROR(EINVAL);
+    }
+    if ( pos < 0 ) {
+        return AVERROR(EINVAL);
+    }
+    io->pos = pos;
+    return pos;
+}
+
+//-----------------------------------------------------------------------------
+// access is one of SV_MMAP_ACCESS_*; NULL if the file can't be mapped, in which
+// case the caller should fall back to the file protocol
 SVVIDEOLIB_API
-int         ffmpeg_flush_buffered_io(log_fn_t logFn,
-                                    const char* src,
-                                    const char* dst)
+AVIOContext* ffmpeg_create_mmap_io(const char* filename, int access)
+{
+    sv_mmap* map = sv_open_mmap_readonly(filename, access);
+    if ( map == NULL ) {
+        return NULL;
+    }
+    uint8_t* buffer = (uint8_t*)av_malloc(kMmapIoBufferSize);
+    if ( buffer == NULL ) {
+        sv_close_mmap(&map);
+        return NULL;
+    }
+
+    mmap_io* io = new mmap_io;
+    io->map = map;
+    io->filename = filename;
+    io->access = access;
+    io->pos = 0;
+    AVIOContext* pIOCtx = avio_alloc_context(buffer, kMmapIoBufferSize, 0, io,
+                                             _mmap_read_packet, NULL, _mmap_seek);
+    if ( pIOCtx ) {
+        // large reads go straight from the mapping into the caller's buffer
+        pIOCtx->direct = 1;
+    } else {
+        av_free(buffer);
+        sv_close_mmap(&io->map);
+        delete io;
+    }
+    return pIOCtx;
+}
+
+//-----------------------------------------------------------------------------
+SVVIDEOLIB_API
+void         ffmpeg_close_mmap_io(AVIOContext** pCtx)
+{
+    if ( pCtx == NULL || *pCtx == NULL ) {
+        return;
+    }
+    mmap_io* io = (mmap_io*)(*pCtx)->opaque;
+    // avio may have replaced the buffer we gave it
+    av_freep(&(*pCtx)->buffer);
+    avio_context_free( pCtx );
+    sv_close_mmap(&io->map);
+    delete io;
+}
+
+static int  _flush_buffered_file(log_fn_t logFn,
+                                const char* src,
+                                const char* dst,
+                                bool optional)
 {
     int          retval = -1;
     IBufferedFile* bf = NULL;
@@ -280,6 +403,9 @@ int         ffmpeg_flush_buffered_io(log_fn_t logFn,
 
         auto it = _gClosedFiles.find(_pathToName(src));
         if ( it == _gClosedFiles.end() ) {
+            if ( optional ) {
+                return 0;
+            }
             log_err( logFn, "Could not copy the file -- no entry associated with %s", src);
             for ( auto ent: _gClosedFiles ) {
                 log_err(logFn, "    entry=%s", ent.first.c_str());
@@ -312,4 +438,19 @@ int         ffmpeg_flush_buffered_io(log_fn_t logFn,
     return retval;
 }
 
+SVVIDEOLIB_API
+int         ffmpeg_flush_buffered_io(log_fn_t logFn,
+                                    const char* src,
+                                    const char* dst)
+{
+    int retval = _flush_buffered_file(logFn, src, dst, false);
+
+    // frame index of the clip, if the recorder wrote one, travels with it
+    std::string srcIndex = std::string(src) + CLIP_INDEX_EXT;
+    std::string dstIndex = std::string(dst) + CLIP_INDEX_EXT;
+    _flush_buffered_file(logFn, srcIndex.c_str(), dstIndex.c_str(), true);
+
+    return retval;
+}
+
 AVRational AVRATIONAL_MS = {1, 1000};
\ No newline at end of file
@@ -32,12 +32,22 @@
  *****************************************************************************/
 
 #include "sv_os.h"
+#include "sv_internal.h"
 #include "sv_pcap.h"
 #include "sv_ffmpeg.h"
 
 #include "videolib.h"
 #include "videolibUtils.h"
 #include "streamFactories.h"
+#include "clip_index.h"
+#include "jpeg_snapshot.h"
+#include "frame_trace.h"
+#include "frame_props.h"
+#include "box_metadata.h"
+#include "clip_cache.h"
+#include "clip_prefetch.h"
+#include "export_scheduler.h"
+#include "decode_demand.h"
 
 #include <stdarg.h>
 #include <stdio.h>
@@ -88,6 +98,38 @@
 #define GET_FPS() sv_get_int_env_var(PROC_FPS_VAR, DEFAULT_PROC_FPS)
 #define GET_FPS_EX(def) sv_get_int_env_var(PROC_FPS_VAR, def)
 
+// Set to 1 to have the edge thread connector use the lock-free frame queue
+#define TC_LOCKFREE_QUEUE_VAR "SV_TC_LOCKFREE_QUEUE"
+
+// Set to 1 to have the recorder write files from its own thread
+#define RECORDER_ASYNC_VAR "SV_RECORDER_ASYNC"
+#define RECORDER_ASYNC_ROTATION_VAR "SV_RECORDER_ASYNC_ROTATION"
+#define RECORDER_FRAGMENTED_VAR "SV_RECORDER_FRAGMENTED"
+#define AUDIO_CALLBACK_VAR "SV_AUDIO_CALLBACK"
+#define SPLITTER_ASYNC_VAR "SV_SPLITTER_ASYNC"
+// Set to 1 to have the recorder write around the page cache, and/or reserve disk
+// space for each file up front
+#define RECORDER_DIRECT_IO_VAR "SV_RECORDER_DIRECT_IO"
+#define RECORDER_PREALLOCATE_VAR "SV_RECORDER_PREALLOCATE"
+
+// Set to 1 to keep hardware-decoded frames on the device until they're resized
+#define HW_ZERO_COPY_VAR "SV_HW_ZERO_COPY"
+
+// Set to 1 to have clip exports and HLS reuse opened encoders rather than open their own
+#define ENCODER_POOL_VAR "SV_ENCODER_POOL"
+// Set to 1 to have clip exports and HLS encode on the GPU where one's available
+#define HW_ENCODE_VAR "SV_HW_ENCODE"
+// Set to 1 to have software decoders cut corners while only analytics look at the frames
+#define FAST_DECODE_VAR "SV_FAST_DECODE"
+// Set to a change threshold (mean per-pixel difference, 1-255) to keep frames of
+// a scene that hasn't changed from analytics
+#define MOTION_GATE_VAR "SV_MOTION_GATE"
+// Set to 1 to draw timestamps with the drawtext filter, rather than from a glyph atlas
+#define TIMESTAMP_DRAWTEXT_VAR "SV_TIMESTAMP_DRAWTEXT"
+// Set to 1 to rotate frames of streams reporting rotation upright, as part of
+// the resize (at the output size)
+#define AUTO_ROTATE_VAR "SV_AUTO_ROTATE"
+
 // Users can put this in their URL to hack a different value for analyzeduration
 #define ANALYZE_DURATION_URL_KEY     "analyzeduration="
 #define FORCE_MJPEG_URL_KEY          "svforcemjpeg"
@@ -113,6 +155,21 @@ static CodecConfig* copy_codec_config(CodecConfig* config);
 static void free_codec_config(CodecConfig** config);
 static int _pause_mmap(StreamData* data, int pause);
 static void _close_mmap(StreamData* data);
+SVVIDEOLIB_API int open_mmap2(StreamData* data, char* mmapFilename, int layout);
+void _check_live_stream_demand(StreamData* data);
+void _release_live_stream_demand(StreamData* data);
+void videolibutils_release_proc_frame_state(StreamData* data);
+int videolibutils_get_queued_frame_count(StreamData* data);
+int videolibutils_large_frames_wanted();
+int videolibutils_large_frame_demand_changed(StreamData* data);
+stream_api_t* get_seek_cache_api();
+stream_api_t* get_packet_ring_api();
+stream_api_t* get_motion_gate_api();
+stream_api_t* get_timestamp_overlay_api();
+stream_api_t* get_synthetic_source_api();
+
+// generated H264 camera, for soak/scale tests (stream_synthetic_source.cpp)
+#define URI_SYNTHETIC_CAMERA "synthetic:"
 
 static sv_lib*                  pcapLib = NULL;
 static sv_capture_traffic_t     sv_pcap_start = NULL;
@@ -120,6 +177,23 @@ static sv_stop_capture_t        sv_pcap_stop = NULL;
 static sv_capture_possible_t    sv_pcap_check = NULL;
 static sv_pcap*                 activeCapture = NULL;
 
+// svpcap capture replay (sv_pcap_replay.cpp)
+typedef struct sv_pcap_replay sv_pcap_replay;
+typedef sv_pcap_replay* (*sv_replay_start_t)(const char* capturePath, int port,
+                                             double speed, int loop,
+                                             sv_pcap_log_cb_t logCb, void* logCtx);
+typedef int             (*sv_replay_get_port_t)(sv_pcap_replay* replay);
+typedef int             (*sv_replay_get_stats_t)(sv_pcap_replay* replay,
+                                             INT64_T* sessions, INT64_T* packets,
+                                             INT64_T* bytes, INT64_T* maxLagUs);
+typedef void            (*sv_replay_stop_t)(sv_pcap_replay** replay);
+
+// a handle of its own, so enable_packet_capture can't unload it from under us
+static sv_lib*                  replayLib = NULL;
+static sv_replay_get_stats_t    sv_replay_stats = NULL;
+static sv_replay_stop_t         sv_replay_stop = NULL;
+static sv_pcap_replay*          activeReplay = NULL;
+
 
 typedef stream_api_t*    (*module_factory)             ();
 
@@ -148,7 +222,12 @@ const char* gModuleNames [] = {
 #endif
     "Recorder Sync",
     "Sync Buffer",
+    "Seek Cache",
+    "Packet Ring",
+    "Motion Gate",
+    "Timestamp Overlay",
     "Clip Reader",
+    "Timeline",
     NULL
 };
 
@@ -177,6 +256,10 @@ module_factory gModules[] = {
 #endif
     get_recorder_sync_api         ,
     get_jitbuf_stream_api         ,
+    get_seek_cache_api            ,
+    get_packet_ring_api           ,
+    get_motion_gate_api           ,
+    get_timestamp_overlay_api     ,
 };
 
 const char** get_module_names()
@@ -186,6 +269,10 @@ const char** get_module_names()
 
 static int _gClipDebugEnabled = -1;
 
+// ring size of the timeline trace, when enabled through set_module_trace_level
+// (about 80 bytes each); SV_TRACE=<events> picks a different one at startup
+static const int _kTimelineTraceEvents = 65536;
+
 void set_module_trace_level(const char* module, int level)
 {
     int nI=0;
@@ -195,6 +282,10 @@ void set_module_trace_level(const char* module, int level)
         _gClipDebugEnabled = level;
         return;
     }
+    if (!_stricmp(module, "Timeline")) {
+        sv_trace_enable(level > 0 ? _kTimelineTraceEvents : 0);
+        return;
+    }
 
     while (gModuleNames[nI] != NULL) {
         if (!_stricmp(gModuleNames[nI], module)) {
@@ -315,6 +406,11 @@ int        _enable_file_recording(int enable,
             log_err(logFn, "Failed to configure recorder splitter");
             goto Cleanup;
         }
+        int asyncSplitter = sv_get_int_env_var(SPLITTER_ASYNC_VAR, 0);
+        if ( asyncSplitter ) {
+            // blocks when behind: the recorder's async output is what drops packets
+            splitter_api->set_param(splitter, "fileRecorder.async", &asyncSplitter);
+        }
 
         int counter = 1;
         if ( subgraph_api->set_param(subgraph, "encoder.hls", &_kZero) < 0 || counter++ == 0 ||
@@ -331,6 +427,28 @@ int        _enable_file_recording(int enable,
             goto Cleanup;
         }
 
+        int asyncOutput = sv_get_int_env_var(RECORDER_ASYNC_VAR, 0);
+        if ( asyncOutput ) {
+            subgraph_api->set_param(subgraph, "recorder.asyncOutput", &asyncOutput);
+        }
+        int asyncRotation = sv_get_int_env_var(RECORDER_ASYNC_ROTATION_VAR, 0);
+        if ( asyncRotation ) {
+            subgraph_api->set_param(subgraph, "recorder.asyncRotation", &asyncRotation);
+        }
+        // writer/closer threads keep up with the camera, ahead of analytics
+        subgraph_api->set_param(subgraph, "recorder.threadClass", "live");
+        int fragmented = sv_get_int_env_var(RECORDER_FRAGMENTED_VAR, 0);
+        if ( fragmented ) {
+            subgraph_api->set_param(subgraph, "recorder.fragmented", &fragmented);
+        }
+        int directIO = sv_get_int_env_var(RECORDER_DIRECT_IO_VAR, 0);
+        if ( directIO ) {
+            subgraph_api->set_param(subgraph, "recorder.ioDirect", &directIO);
+        }
+        int preallocate = sv_get_int_env_var(RECORDER_PREALLOCATE_VAR, 0);
+        if ( preallocate ) {
+            subgraph_api->set_param(subgraph, "recorder.ioPreallocate", &preallocate);
+        }
 
         if ( codecConfig != NULL ) {
             if ( codecConfig->gop_size > 0) {
@@ -429,6 +547,10 @@ int        _enable_audio_playback(InputData2* input,
         api->set_param(*pCtx, "audio_decode.dstCodecId", &_kCodecLinear);
 
         api->insert_element(pCtx, &api, "audio_decode", render, svFlagNone);
+        int callbackMode = sv_get_int_env_var(AUDIO_CALLBACK_VAR, 0);
+        if ( callbackMode ) {
+            api->set_param(*pCtx, "audio_render.callbackMode", &callbackMode);
+        }
 
         if (initFlag) {
             stream_get_api(render)->open_in(render);
@@ -504,6 +626,7 @@ static int   open_input(InputData2* input,
     int threaded = (flags & oifEdgeThread) ? 1 : 0;
     int recordInMemory = (flags & oifRecordInMemory) ? 1 : 0;
     int simulation = (flags & oifSimulation) ? 1 : 0;
+    int hwZeroCopy = sv_get_int_env_var(HW_ZERO_COPY_VAR, 0);
 
     if (!strncmp(filename, URI_LOCAL_CAMERA, strlen(URI_LOCAL_CAMERA))) {
 #if LOCAL_CAMERA_SUPPORT
@@ -516,6 +639,9 @@ static int   open_input(InputData2* input,
     } else
     if (!strncmp(filename, URI_RTSP_CAMERA, strlen(URI_RTSP_CAMERA))) {
         api = get_live555_demux_stream_api();
+    } else
+    if (!strncmp(filename, URI_SYNTHETIC_CAMERA, strlen(URI_SYNTHETIC_CAMERA))) {
+        api = get_synthetic_source_api();
     } else {
         api = get_ffmpeg_demux_api();
     }
@@ -526,6 +652,12 @@ static int   open_input(InputData2* input,
     api->set_param(ctx, "demux.keyframeOnly", &keyframeOnly);
     if (needDecoder) {
         inserted = APPEND_FILTER(api, ctx, ffdec_stream_api, "decoder");
+        if ( liveStream ) {
+            api->set_param(ctx, "decoder.threadClass", "live");
+        }
+        if ( hwZeroCopy ) {
+            api->set_param(ctx, "decoder.hwFramesOutput", &hwZeroCopy);
+        }
         // we can tap recorder/HLS/mmap here now
         input->auxInsertionPoint = "decoder";
     } else {
@@ -543,9 +675,16 @@ static int   open_input(InputData2* input,
         // live555 demux will timeout in 5 seconds -- this timeout should
         // never take effect, unless using mjpeg camera
         int timeout = 8000;
+        // opt-in for the lock-free SPSC queue between edge thread and the consumer
+        int lockFreeQueue = sv_get_int_env_var(TC_LOCKFREE_QUEUE_VAR, 0);
         inserted = APPEND_FILTER(api, ctx, tc_api, "tc_edge");
+        api->set_param(ctx, "tc_edge.threadClass", liveStream ? "live" : "analytics");
         api->set_param(ctx, "tc_edge.maxQueueSize", &maxQueueSize);
         api->set_param(ctx, "tc_edge.timeout", &timeout);
+        api->set_param(ctx, "tc_edge.pollable", &_kOne);
+        if ( lockFreeQueue ) {
+            api->set_param(ctx, "tc_edge.lockFreeQueue", &lockFreeQueue);
+        }
         if ( fpsLimit ) {
             api->set_param(ctx, "tc_edge.fpsLimit", &fpsLimit);
         }
@@ -561,34 +700,63 @@ static int   open_input(InputData2* input,
          requestedHeight >= 0 &&
          requestedPixFmt != pfmtUndefined) {
         // only add the resize filter if we're not in a remux/clip creation mode
+        int autoRotate = sv_get_int_env_var(AUTO_ROTATE_VAR, 0);
 
         // for local clips playback, we want to resize before queueing
         const char* insertionPoint = (liveStream && threaded ? "tc_edge" : input->auxInsertionPoint);
 
-        inserted = INSERT_FILTER(api, ctx, resize_factory_api, "procPixfmt", insertionPoint);
-        api->set_param(ctx, "procPixfmt.pixfmt", &requestedPixFmt);
-        filterInsertionPoint = "procPixfmt";
-
-        if ( liveStream && (requestedWidth > 0 || requestedHeight > 0) ) {
-            // retaining original frames is memory intensive, so we limit those
-            // to the specified interval
-            int originalFrameInterval = 500;
-
-            // for analytics we may need to retain the source frame; in this case
-            // make resize a separate filter, and ask it to retain the source frame
-            inserted = INSERT_FILTER(api, ctx, resize_factory_api, "procResize", filterInsertionPoint);
+        if ( hwZeroCopy && needDecoder && liveStream && (requestedWidth > 0 || requestedHeight > 0) ) {
+            // Frames are still on the device at this point: resize (on the device) and
+            // convert in one go, so only the small frame ever gets downloaded.
+            // Full-sized source frames aren't retained in this mode.
+            inserted = INSERT_FILTER(api, ctx, resize_factory_api, "procResize", insertionPoint);
+            api->set_param(ctx, "procResize.pixfmt", &requestedPixFmt);
             api->set_param(ctx, "procResize.width", &requestedWidth);
             api->set_param(ctx, "procResize.height", &requestedHeight);
-            api->set_param(ctx, "procResize.retainSourceFrameInterval", &originalFrameInterval);
+            api->set_param(ctx, "procResize.autoRotate", &autoRotate);
             filterInsertionPoint = "procResize";
         } else {
-            // if the source frame isn't needed, resize as needed in the context
-            // of the pixfmt conversion filter
-            api->set_param(ctx, "procPixfmt.width", &requestedWidth);
-            api->set_param(ctx, "procPixfmt.height", &requestedHeight);
+            inserted = INSERT_FILTER(api, ctx, resize_factory_api, "procPixfmt", insertionPoint);
+            api->set_param(ctx, "procPixfmt.pixfmt", &requestedPixFmt);
+            // when procResize retains source frames, those have to be upright too
+            api->set_param(ctx, "procPixfmt.autoRotate", &autoRotate);
+            filterInsertionPoint = "procPixfmt";
+
+            if ( liveStream && (requestedWidth > 0 || requestedHeight > 0) ) {
+                // retaining original frames is memory intensive, so we limit those
+                // to the specified interval
+                int originalFrameInterval = 500;
+
+                // for analytics we may need to retain the source frame; in this case
+                // make resize a separate filter, and ask it to retain the source frame
+                inserted = INSERT_FILTER(api, ctx, resize_factory_api, "procResize", filterInsertionPoint);
+                api->set_param(ctx, "procResize.width", &requestedWidth);
+                api->set_param(ctx, "procResize.height", &requestedHeight);
+                api->set_param(ctx, "procResize.retainSourceFrameInterval", &originalFrameInterval);
+                filterInsertionPoint = "procResize";
+            } else {
+                // if the source frame isn't needed, resize as needed in the context
+                // of the pixfmt conversion filter
+                api->set_param(ctx, "procPixfmt.width", &requestedWidth);
+                api->set_param(ctx, "procPixfmt.height", &requestedHeight);
+            }
         }
     }
 
+    // Frames of a quiet scene go on as placeholders; ahead of the overlays,
+    // which would otherwise look like changes
+    int motionGate = sv_get_int_env_var(MOTION_GATE_VAR, 0);
+    if ( motionGate > 0 && filterInsertionPoint != NULL &&
+         !strcmp(filterInsertionPoint, "procResize") ) {
+        inserted = api->insert_element(&ctx,
+                                &api,
+                                filterInsertionPoint,
+                                get_motion_gate_api()->create("motionGate"),
+                                svFlagNone);
+        api->set_param(ctx, "motionGate.threshold", &motionGate);
+        filterInsertionPoint = "motionGate";
+    }
+
     // draw on return image only if necessary, and after resizing had been done
     if ( !shouldRecord ) {
         api = _enable_timestamp(&ctx, flags, timestampFlags, timestampOffset, "ts", filterInsertionPoint, logFn );
@@ -644,6 +812,10 @@ static int   open_input(InputData2* input,
     if (ctx) {
         api->set_param(ctx, "url", filenameCopy);
         api->set_param(ctx, "liveStream", &liveStream);
+        if ( !liveStream ) {
+            // clips opened with open_clip are mostly scrubbed through
+            api->set_param(ctx, "demux.mmapAccess", "random");
+        }
         if (bufferSize)       api->set_param(ctx, "bufferSizeKb", &bufferSize);
         if (socketBufferSize) api->set_param(ctx, "socketBufferSizeKb", &socketBufferSize);
         api->set_param(ctx, "forceTCP", &forceTcp);
@@ -697,6 +869,9 @@ static int   open_input(InputData2* input,
             if ( flags & oifRenderAudio ) {
                 _enable_audio_playback(input, &ctx, NULL, 1, svFlagStreamInitialized);
                 api = stream_get_api(ctx);
+            } else if ( input->hasAudio && !(shouldRecord && enableAudioRecording) ) {
+                // nobody is going to consume it -- don't read it
+                api->set_param(ctx, "demux.discardAudio", &_kOne);
             }
         }
 
@@ -797,6 +972,70 @@ SVVIDEOLIB_API int enable_packet_capture(const char* captureLocation, const char
     return 0;
 }
 
+//-------------------------------------------------------------------------------------------------
+// Serves a capture made by enable_packet_capture back over RTSP, on
+// rtsp://127.0.0.1:<port>/<anything>, for repeatable load tests of the live
+// pipeline: every stream opened on it is a virtual camera playing the capture
+// from the start. speedPct scales its timing (200 is twice as fast; 0 as fast
+// as the streams read), and loop has it start over at the end. Streams must
+// use RTP over RTSP (oifWantTCP).
+// returns
+// the port on success (port 0 picks a free one),
+// -2 if svpcap can't be loaded,
+// -3 if a replay is already running,
+// -4 if the capture can't be served
+SVVIDEOLIB_API int enable_packet_replay(const char* capturePath, int port, int speedPct,
+                                        int loop, log_fn_t logFn)
+{
+    sv_replay_start_t       replayStart;
+    sv_replay_get_port_t    replayPort;
+
+    if ( activeReplay != NULL ) {
+        return -3;
+    }
+
+    if ( replayLib == NULL ) {
+        replayLib = sv_load("svpcap");
+        if (!replayLib) {
+            return -2;
+        }
+    }
+    replayStart     = sv_get_sym( replayLib, "sv_replay_start" );
+    replayPort      = sv_get_sym( replayLib, "sv_replay_get_port" );
+    sv_replay_stats = sv_get_sym( replayLib, "sv_replay_get_stats" );
+    sv_replay_stop  = sv_get_sym( replayLib, "sv_replay_stop" );
+    if ( !replayStart || !replayPort || !sv_replay_stats || !sv_replay_stop ) {
+        return -2;
+    }
+
+    activeReplay = replayStart(capturePath, port, speedPct/100.0, loop, pcap_log_cb, (void*)logFn );
+    if ( activeReplay == NULL ) {
+        return -4;
+    }
+    return replayPort(activeReplay);
+}
+
+//-------------------------------------------------------------------------------------------------
+// Streams being served, and what was sent to them; maxLagUs is how late the
+// replay was sending a packet at worst, if it couldn't keep up itself.
+// returns 0 on success, -1 if no replay is running
+SVVIDEOLIB_API int get_packet_replay_stats(int64_t* sessions, int64_t* packets,
+                                           int64_t* bytes, int64_t* maxLagUs)
+{
+    if ( activeReplay == NULL ) {
+        return -1;
+    }
+    return sv_replay_stats(activeReplay, sessions, packets, bytes, maxLagUs);
+}
+
+//-------------------------------------------------------------------------------------------------
+SVVIDEOLIB_API void disable_packet_replay()
+{
+    if ( activeReplay != NULL ) {
+        sv_replay_stop(&activeReplay);
+    }
+}
+
 
 //-----------------------------------------------------------------------------
 // Attempts to open an input stream and begin a read thread.  Returns a pointer
@@ -893,6 +1132,7 @@ SVVIDEOLIB_API StreamData* open_stream(const char* inputFilename,
             prepare_live_stream(data, nI);
         }
     }
+    videolib_update_decode_demand(data);
 
     data->openEndTime = sv_time_get_current_epoch_time();
     return data;
@@ -951,6 +1191,248 @@ SVVIDEOLIB_API void get_fps_info(StreamData *data, float* requestFps, float* cap
 }
 
 
+//-----------------------------------------------------------------------------
+// Lets the decoder skip decoding frames nobody will look at, see decode_demand.h
+void videolib_update_decode_demand(StreamData* data)
+{
+    char  name[32];
+    float maxFps = (float)data->inputData2.fps;
+    // analytics, and the small mmap view, are fine with a lower quality picture
+    int   fullQuality = !sv_get_int_env_var(FAST_DECODE_VAR, 0) ||
+                        videolibutils_large_frames_wanted();
+
+    sv_mutex_enter(data->graphMutex);
+
+    stream_obj*       ctx = data->inputData2.streamCtx;
+    stream_api_t*     api = stream_get_api(ctx);
+
+    if ( api && ctx && api->find_element(ctx, "decoder") != NULL ) {
+        // mmap placed ahead of the fps limit runs at its own rate
+        if ( maxFps > 0 &&
+             data->mmapFilename != NULL &&
+             !data->mmapPaused &&
+             data->mmapPosition == data->inputData2.auxInsertionPoint ) {
+            if ( data->mmapFps <= 0 ) {
+                maxFps = 0;
+            } else if ( data->mmapFps > maxFps ) {
+                maxFps = (float)data->mmapFps;
+            }
+        }
+        if ( data->mmapFilename != NULL &&
+             !data->mmapPaused &&
+             (data->mmapHeight > PROC_IMAGE_HEIGHT || data->mmapHeight == 0) ) {
+            fullQuality = 1;
+        }
+        // transcoded HLS streams and recordings of decoded frames need everything
+        for (int nI=1; nI<=data->hlsProfilesCount; nI++) {
+            sprintf(name, "hls%d", nI);
+            if ( !data->hlsProfiles[nI-1].remux && api->find_element(ctx, name) != NULL ) {
+                maxFps = 0;
+                fullQuality = 1;
+            }
+        }
+        // ... as does the branch they share with SV_HLS_LADDER=1
+        if ( api->find_element(ctx, "hlsLadder") != NULL ) {
+            maxFps = 0;
+            fullQuality = 1;
+        }
+        if ( !data->inputData2.rawFrameRecording &&
+             api->find_element(ctx, "fileRecorder") != NULL ) {
+            maxFps = 0;
+            fullQuality = 1;
+        }
+
+        int fastDecode = !fullQuality;
+        log_dbg(data->logFn, "Decoder demand: maxFps=%.2f fastDecode=%d", maxFps, fastDecode);
+        api->set_param(ctx, "decoder.maxFps", &maxFps);
+        api->set_param(ctx, "decoder.fastDecode", &fastDecode);
+    }
+
+    sv_mutex_exit(data->graphMutex);
+}
+
+//-----------------------------------------------------------------------------
+// Returns the decode cost of the stream:
+// - decodeTimeUs: total time spent in the decoder since the stream was opened
+// - framesDecoded: number of frames produced by the decoder in that time
+// - decodeThreads: number of threads assigned to the decoder
+// - decodeTimeSavedUs: estimated decoder time saved by skipping frames
+//   no consumer needed
+// Returns -1, if the stream isn't being decoded
+SVVIDEOLIB_API int get_decode_stats(StreamData *data, int64_t* decodeTimeUs,
+                                    int* framesDecoded, int* decodeThreads,
+                                    int64_t* decodeTimeSavedUs)
+{
+    int res = -1;
+    if (data) {
+        sv_mutex_enter(data->graphMutex);
+
+        stream_obj*       ctx = data->inputData2.streamCtx;
+        stream_api_t*     api = stream_get_api(ctx);
+
+        if ( api && ctx ) {
+            INT64_T timeUs = 0, savedUs = 0;
+            int     frames = 0, threads = 0;
+            size_t  size = sizeof(timeUs);
+            if ( api->get_param(ctx, "decoder.decodeTimeUs", &timeUs, &size) >= 0 ) {
+                size = sizeof(int);
+                api->get_param(ctx, "decoder.framesProcessed", &frames, &size);
+                size = sizeof(int);
+                api->get_param(ctx, "decoder.decodeThreads", &threads, &size);
+                size = sizeof(savedUs);
+                api->get_param(ctx, "decoder.decodeTimeSavedUs", &savedUs, &size);
+                res = 0;
+            }
+            if ( decodeTimeUs )  *decodeTimeUs = timeUs;
+            if ( framesDecoded ) *framesDecoded = frames;
+            if ( decodeThreads ) *decodeThreads = threads;
+            if ( decodeTimeSavedUs ) *decodeTimeSavedUs = savedUs;
+        }
+        sv_mutex_exit(data->graphMutex);
+    }
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+// Returns how many of the decoder's picture buffers are held by the codec or
+// downstream of it, how many are free for reuse, and the most ever held at
+// once. A count that keeps growing means frames are being held on to.
+// 0 on success, -1 if the stream isn't decoded from a pool.
+SVVIDEOLIB_API int get_decoder_pool_stats(StreamData *data, int* outstanding,
+                                          int* pooled, int* maxOutstanding)
+{
+    int res = -1;
+    if (data) {
+        sv_mutex_enter(data->graphMutex);
+
+        stream_obj*       ctx = data->inputData2.streamCtx;
+        stream_api_t*     api = stream_get_api(ctx);
+
+        if ( api && ctx ) {
+            int    held = 0, idle = 0, maxHeld = 0;
+            size_t size = sizeof(int);
+            if ( api->get_param(ctx, "decoder.bufferPoolOutstanding", &held, &size) >= 0 ) {
+                size = sizeof(int);
+                api->get_param(ctx, "decoder.bufferPoolFree", &idle, &size);
+                size = sizeof(int);
+                api->get_param(ctx, "decoder.bufferPoolMaxOutstanding", &maxHeld, &size);
+                res = 0;
+            }
+            if ( outstanding )    *outstanding = held;
+            if ( pooled )         *pooled = idle;
+            if ( maxOutstanding ) *maxOutstanding = maxHeld;
+        }
+        sv_mutex_exit(data->graphMutex);
+    }
+    return res;
+}
+
+
+//-----------------------------------------------------------------------------
+// Copies per-node read_frame stats of the stream's graph into buffer, one
+// "name: key=value ..." line per node, downstream first (see "pipelineStats"
+// in stream_api.cpp). Returns the size needed for the whole text if the
+// buffer is too small, 0 on success and -1 on error.
+SVVIDEOLIB_API int get_pipeline_stats(StreamData *data, char* buffer, int bufferSize)
+{
+    int res = -1;
+    if (data && buffer && bufferSize > 0) {
+        sv_mutex_enter(data->graphMutex);
+
+        stream_obj*       ctx = data->inputData2.streamCtx;
+        stream_api_t*     api = stream_get_api(ctx);
+
+        if ( api && ctx ) {
+            size_t size = bufferSize;
+            if ( api->get_param(ctx, "pipelineStats", buffer, &size) >= 0 ) {
+                res = 0;
+            } else if ( size > (size_t)bufferSize ) {
+                res = (int)size;
+            }
+        }
+        sv_mutex_exit(data->graphMutex);
+    }
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+// Returns latency of frames delivered by get_new_frame, in microseconds:
+// - stage is one of 0=total (packet arrival to delivery), 1=decode,
+//   2=resize, 3=into a thread connector, 4=in a thread connector queue,
+//   5=from the last thread connector to delivery; each covering the time
+//   since the previous stage the frame went through
+// - p50Us/p90Us/p99Us are upper bounds of the histogram bucket the percentile
+//   falls into
+// Returns -1, if no traced frames had been delivered, or tracing is disabled
+SVVIDEOLIB_API int get_latency_stats(StreamData *data, int stage, int64_t* count,
+                                     int64_t* avgUs, int64_t* p50Us, int64_t* p90Us,
+                                     int64_t* p99Us, int64_t* maxUs)
+{
+    frame_trace_stats stats;
+    if ( !data || frame_trace_get_stats(data, stage, &stats) < 0 ) {
+        return -1;
+    }
+    if ( count ) *count = stats.count;
+    if ( avgUs ) *avgUs = stats.avgUs;
+    if ( p50Us ) *p50Us = stats.p50Us;
+    if ( p90Us ) *p90Us = stats.p90Us;
+    if ( p99Us ) *p99Us = stats.p99Us;
+    if ( maxUs ) *maxUs = stats.maxUs;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Writes the timeline trace recorded so far to path, as Chrome trace JSON
+// (chrome://tracing or ui.perfetto.dev). Tracing is enabled with
+// set_module_trace_level("Timeline", 1), or SV_TRACE=<events>; it is also
+// dumped to SV_TRACE_DIR on its own when a span exceeds SV_TRACE_STALL_MS.
+// Returns the number of events written, or -1 if tracing was never enabled
+// or the file couldn't be written.
+SVVIDEOLIB_API int dump_timeline_trace(const char* path)
+{
+    return sv_trace_dump(path);
+}
+
+//-----------------------------------------------------------------------------
+// Copies the process-wide memory breakdown into buffer: a "pressure=<level>"
+// line (0=none, 1=soft, 2=hard), then "<category>: bytes=.. peak=.. budget=.."
+// for the total, frame payloads and buffered files, and a
+// "tag=<ownerTag> name=<allocator> bytes=.. peak=.." line per frame owner.
+// Budgets are set with SV_MEMORY_BUDGET_MB, SV_MEMORY_BUDGET_FRAMES_MB and
+// SV_MEMORY_BUDGET_FILES_MB. Returns the size needed for the whole text if the
+// buffer is too small, 0 on success and -1 on error.
+SVVIDEOLIB_API int get_memory_stats(char* buffer, int bufferSize)
+{
+    size_t size;
+    if ( !buffer || bufferSize <= 0 ) {
+        return -1;
+    }
+    size = bufferSize;
+    if ( sv_memory_get_breakdown(buffer, &size) < 0 ) {
+        return (int)size;
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Copies the CPU features detected, those allowed (see SV_CPU_FEATURES), and a
+// "<kernel>=<variant>" line for each SIMD kernel selected so far into buffer.
+// Returns the size needed if the buffer is too small, 0 on success and -1 on
+// error.
+SVVIDEOLIB_API int get_cpu_kernels(char* buffer, int bufferSize)
+{
+    size_t size;
+    if ( !buffer || bufferSize <= 0 ) {
+        return -1;
+    }
+    size = bufferSize;
+    if ( sv_cpu_get_kernels(buffer, &size) < 0 ) {
+        return (int)size;
+    }
+    return 0;
+}
+
+
 //-----------------------------------------------------------------------------
 // Return info about the size we're processing video at.
 SVVIDEOLIB_API int get_proc_width(StreamData *data)
@@ -972,6 +1454,35 @@ SVVIDEOLIB_API int is_running(StreamData* data)
     return 0;
 }
 
+//-----------------------------------------------------------------------------
+// Describes the pixel buffer behind a frame, for callers wrapping it without
+// copying (the buffer lives as long as the frame). stride and bytesPerPixel
+// are 0 for planar formats, where only the size is meaningful.
+static int _get_frame_buffer_layout(frame_obj* frame, int* size, int* stride,
+                                    int* bytesPerPixel)
+{
+    frame_api_t* api = frame_get_api(frame);
+    if ( api == NULL ) {
+        return -1;
+    }
+
+    int pixfmt = api->get_pixel_format(frame);
+    int height = (int)api->get_height(frame);
+    *size = (int)api->get_data_size(frame);
+    switch (pixfmt) {
+    case pfmtRGB24:
+    case pfmtBGR24:     *bytesPerPixel = 3; break;
+    case pfmtRGBA:
+    case pfmtARGB:      *bytesPerPixel = 4; break;
+    case pfmtYUYV422:   *bytesPerPixel = 2; break;
+    case pfmtRGB8:      *bytesPerPixel = 1; break;
+    default:            *bytesPerPixel = 0; break;
+    }
+    // rows of packed frames may be padded, so don't assume width*bytesPerPixel
+    *stride = ( *bytesPerPixel && height > 0 ) ? *size / height : 0;
+    return 0;
+}
+
 //-----------------------------------------------------------------------------
 // Returns a FrameData* for the most recently obtained frame, or NULL if there
 // has been no new frame since the last call.
@@ -988,7 +1499,6 @@ SVVIDEOLIB_API void* get_new_frame(StreamData* data, int isLive)
 Retry:
     sv_mutex_enter(data->graphMutex);
 
-    frame_api_t*  frameAPI  = NULL;
     stream_obj*   streamCtx = data->inputData2.streamCtx;
     stream_api_t* streamAPI = stream_get_api(streamCtx);
 
@@ -1007,15 +1517,19 @@ Retry:
     }
     sv_mutex_exit(data->graphMutex);
 
-    frameAPI = frame_get_api(graphFrame);
-    int nType = frameAPI->get_media_type(graphFrame);
+    _check_live_stream_demand(data);
+    if ( videolibutils_large_frame_demand_changed(data) ) {
+        videolib_update_decode_demand(data);
+    }
+
+    int nType = frame_props_media_type(graphFrame);
     if ( nType != mediaVideo && nType != mediaVideoTime ) {
         // this level of code doesn't do anything with audio frames
         // log_info(data->logFn, "Ignoring frame with media type %d", frameAPI->get_media_type(myFrame));
         frame_unref(&graphFrame);
         goto Retry;
     }
-    frameMs  = frameAPI->get_pts(graphFrame);
+    frameMs  = frame_props_pts(graphFrame);
     if ( frameMs != INVALID_PTS ) {
         ms = frameMs;
         sv_time_ms_to_timeval(frameMs, &readTime );
@@ -1031,6 +1545,7 @@ Retry:
         frame_unref(&graphFrame);
         return NULL; // may as well give up here ...
     }
+    frame_trace_deliver(data, graphFrame);
 
 
 #if DEBUG_FRAME_FLOW
@@ -1060,6 +1575,118 @@ Retry:
     return frameData;
 }
 
+//-----------------------------------------------------------------------------
+// Number of video frames queued at the edge of the pipeline, i.e. those the next
+// get_new_frame will return without waiting; -1 if the pipeline isn't threaded.
+static int _get_queued_frame_count(StreamData* data)
+{
+    sv_mutex_enter(data->graphMutex);
+    int queued = videolibutils_get_queued_frame_count(data);
+    sv_mutex_exit(data->graphMutex);
+    return queued;
+}
+
+//-----------------------------------------------------------------------------
+// Whether the edge of the pipeline stopped running with no video frames left,
+// in which case the next read fails instead of waiting
+static int _is_edge_stopped(StreamData* data)
+{
+    int stopped = 0;
+    size_t size = sizeof(stopped);
+
+    sv_mutex_enter(data->graphMutex);
+    stream_obj*   ctx = data->inputData2.streamCtx;
+    stream_api_t* api = stream_get_api(ctx);
+    if ( !api || !ctx ||
+         api->get_param(ctx, "tc_edge.stopped", &stopped, &size) < 0 ) {
+        stopped = 0;
+    }
+    sv_mutex_exit(data->graphMutex);
+    return stopped;
+}
+
+//-----------------------------------------------------------------------------
+// Returns a file descriptor (a HANDLE on Windows) which is readable (signaled)
+// while get_new_frames has frames to return without waiting, or once the
+// stream stopped and get_new_frames would report it. This lets one thread
+// select/poll on many streams and drain each with get_new_frames(..., 0).
+// The handle is owned by the stream and must not be read from or closed.
+// Returns -1 if the pipeline isn't threaded.
+SVVIDEOLIB_API int64_t get_frame_ready_handle(StreamData* data)
+{
+    int64_t handle = -1;
+    size_t  size = sizeof(handle);
+
+    if (!data)
+        return -1;
+
+    sv_mutex_enter(data->graphMutex);
+    stream_obj*   ctx = data->inputData2.streamCtx;
+    stream_api_t* api = stream_get_api(ctx);
+    if ( !api || !ctx ||
+         api->get_param(ctx, "tc_edge.readyHandle", &handle, &size) < 0 ) {
+        handle = -1;
+    }
+    sv_mutex_exit(data->graphMutex);
+    return handle;
+}
+
+//-----------------------------------------------------------------------------
+// Fills frames with up to maxFrames FrameData*, each to be freed with
+// free_frame_data. Only frames already decoded and queued are returned; when
+// there are none, waits up to timeoutMs for the first one. Returns the number
+// of frames returned, or -1 if the stream isn't running and none were.
+SVVIDEOLIB_API int get_new_frames(StreamData* data, void** frames, int maxFrames,
+                                  int timeoutMs)
+{
+    static const int kPollIntervalMs = 5;
+    int     count = 0;
+    int64_t start = sv_time_get_current_epoch_time();
+
+    if (!data || !frames || maxFrames <= 0)
+        return -1;
+
+    while ( count < maxFrames && data->isRunning ) {
+        int queued = _get_queued_frame_count(data);
+        if ( queued == 0 && count == 0 && _is_edge_stopped(data) ) {
+            // let the read fail, so the stream is no longer considered running
+            queued = 1;
+        } else if ( queued == 0 ) {
+            if ( count > 0 || sv_time_get_elapsed_time(start) >= timeoutMs ) {
+                break;
+            }
+            sv_sleep(kPollIntervalMs);
+            continue;
+        }
+
+        // without a queue, there's no telling whether the next read would block
+        int batch = ( queued < 0 ) ? 1 : queued;
+        for ( ; batch > 0 && count < maxFrames; batch-- ) {
+            void* frame = get_new_frame(data, 1);
+            if ( frame == NULL ) {
+                return ( count > 0 || data->isRunning ) ? count : -1;
+            }
+            frames[count++] = frame;
+        }
+
+        if ( queued < 0 ) {
+            break;
+        }
+    }
+
+    return ( count > 0 || data->isRunning ) ? count : -1;
+}
+
+//-----------------------------------------------------------------------------
+SVVIDEOLIB_API int get_frame_buffer_layout(FrameData* frame, int* size, int* stride,
+                                           int* bytesPerPixel)
+{
+    if ( !frame || !frame->frame ) {
+        return -1;
+    }
+    return _get_frame_buffer_layout(frame->frame, size, stride, bytesPerPixel);
+}
+
 //-----------------------------------------------------------------------------
 static const char* _get_mmap_position(StreamData* data)
 {
@@ -1093,14 +1720,39 @@ static const char* _get_mmap_position(StreamData* data)
 // be passing NULL to open_mmap is enable_large_frames().
 SVVIDEOLIB_API int open_mmap(StreamData* data, char* mmapFilename)
 {
-    log_dbg(data->logFn, "open mmap");
+    return open_mmap2(data, mmapFilename, 1);
+}
+
+//-----------------------------------------------------------------------------
+// Layout of the currently open (or paused) mmap; 1 if there isn't one
+static int _get_mmap_layout(StreamData* data)
+{
+    int           layout = 1;
+    size_t        size = sizeof(layout);
+    stream_obj*   obj = data->mmapSubgraph ? data->mmapSubgraph : data->inputData2.streamCtx;
+
+    if ( obj == NULL ||
+         stream_get_api(obj)->get_param(obj, "mmapSplitter.subgraph.mmap.layout", &layout, &size) < 0 ) {
+        return 1;
+    }
+    return layout;
+}
+
+//-----------------------------------------------------------------------------
+// Same as open_mmap, with the reader choosing the shared memory layout:
+// 1 is the original single-frame ASCII-headered one, 2 has rotating
+// seqlock-protected slots (see stream_mmap.cpp for both)
+SVVIDEOLIB_API int open_mmap2(StreamData* data, char* mmapFilename, int layout)
+{
+    log_dbg(data->logFn, "open mmap: layout=%d", layout);
     char before[2048], after[2048];
     if (mmapFilename == NULL) {
         return 1;
     }
 
     if ( data->mmapFilename != NULL &&
-        !_stricmp(data->mmapFilename, mmapFilename)) {
+        !_stricmp(data->mmapFilename, mmapFilename) &&
+        _get_mmap_layout(data) == layout ) {
         // mmap is active and doesn't need to be reopened ... make sure it isn't paused
         _pause_mmap(data, 0);
         return 1;
@@ -1140,6 +1792,9 @@ SVVIDEOLIB_API int open_mmap(StreamData* data, char* mmapFilename)
 
 
     int kMmapPixFmt = GET_FRAME_PIX_FMT;
+    // a no-op behind procPixfmt/procResize, which report their frames upright
+    int autoRotate = sv_get_int_env_var(AUTO_ROTATE_VAR, 0);
+    subgraph_api->set_param(subgraph, "resize.autoRotate", &autoRotate);
     if ( (data->mmapHeight > 0 && subgraph_api->set_param(subgraph, "resize.height", &data->mmapHeight) < 0) ||
             (data->mmapWidth > 0 && subgraph_api->set_param(subgraph, "resize.width",  &data->mmapWidth) < 0 ) ||
             subgraph_api->set_param(subgraph, "resize.pixfmt",  &kMmapPixFmt) < 0 ) {
@@ -1153,7 +1808,8 @@ SVVIDEOLIB_API int open_mmap(StreamData* data, char* mmapFilename)
         goto Cleanup;
     }
 
-    if (subgraph_api->set_param(subgraph, "mmap.filename", data->mmapFilename) < 0 ) {
+    if (subgraph_api->set_param(subgraph, "mmap.filename", data->mmapFilename) < 0 ||
+        subgraph_api->set_param(subgraph, "mmap.layout", &layout) < 0 ) {
         log_err(data->logFn, "Failed to configure mmap sink");
         goto Cleanup;
     }
@@ -1167,6 +1823,13 @@ SVVIDEOLIB_API int open_mmap(StreamData* data, char* mmapFilename)
         log_err(data->logFn, "Failed to configure mmap splitter");
         goto Cleanup;
     }
+    int asyncSplitter = sv_get_int_env_var(SPLITTER_ASYNC_VAR, 0);
+    if ( asyncSplitter ) {
+        // decoded frames stand on their own: a late one is better dropped
+        int dropOldest = 1;
+        s_api->set_param(splitter, "mmapSplitter.async", &asyncSplitter);
+        s_api->set_param(splitter, "mmapSplitter.overflowPolicy", &dropOldest);
+    }
 
     inserted = api->insert_element(&data->inputData2.streamCtx,
                                 &api,
@@ -1202,6 +1865,8 @@ Cleanup:
 
     sv_mutex_exit(data->graphMutex);
 
+    videolib_update_decode_demand(data);
+
     // mmap has reversed return values
     return res==0?1:0;
 }
@@ -1229,6 +1894,7 @@ static void _close_mmap(StreamData* data)
         stream_unref(&data->mmapSubgraph);
     }
     sv_freep(&data->mmapFilename);
+    videolib_update_decode_demand(data);
     log_dbg(data->logFn, "pipeline (close_mmap): before=%s", before);
     log_dbg(data->logFn, "pipeline (close_mmap): after=%s", after);
 }
@@ -1279,6 +1945,7 @@ static int _pause_mmap(StreamData* data, int pause)
     }
 
     log_dbg(data->logFn, "pause mmap - done %d %d", pause, res);
+    videolib_update_decode_demand(data);
     return res >= 0 ? 1 : -1;
 }
 
@@ -1332,8 +1999,9 @@ SVVIDEOLIB_API void set_mmap_params(StreamData* data, int enableLargeView, int w
             // it's cheaper to reopen mmap, so it'll be positioned in a different location in the graph
             log_dbg(data->logFn, "Repositioning mmap ...");
             char* oldFilename = strdup(data->mmapFilename);
+            int   layout = _get_mmap_layout(data);
             _close_mmap(data);
-            open_mmap(data, oldFilename);
+            open_mmap2(data, oldFilename, layout);
             free(oldFilename);
             return;
         }
@@ -1417,6 +2085,10 @@ SVVIDEOLIB_API void free_stream_data(StreamData** dataPtr)
         av_log_set_callback(av_log_default_callback);
 
         frame_unref(&data->lastFrameRead);
+        jpeg_snapshot_release(data);
+        frame_trace_release(data);
+        _release_live_stream_demand(data);
+        videolibutils_release_proc_frame_state(data);
 
         sv_freep(&data->hlsProfiles);
         stream_set_default_log_cb(NULL);
@@ -1494,8 +2166,8 @@ static int _preload_metadata( stream_obj** pCtx,
                                 log_fn_t logFn)
 {
         INT64_T         currPts;
-        int             boxesCount = 0;
-        char*           buffer;
+        box_metadata_header* hdr;
+        box_t*          box;
         char            color[16];
         char            name[128];
         int             x,y,w,h,t,procW,procH,nBox,uid;
@@ -1506,57 +2178,75 @@ static int _preload_metadata( stream_obj** pCtx,
         }
 
         api = stream_get_api(*pCtx);
-        buffer = (char*)malloc(numBoxes*128);
+        // boxes are handed over in binary form, so the filters don't have to
+        // parse them back out of text for every frame
+        hdr = (box_metadata_header*)malloc(box_metadata_size(numBoxes));
+        hdr->count = 0;
 
         for ( nBox=0; nBox<numBoxes; nBox++ ) {
             // boxOverlay.append([frameTime, "drawbox=%d:%d:%d:%d:%s:t=%d" %
             //        (x1, y1, x2-x1, y2-y1, labelColor, lineSize)])
             if ( !isRegionMarkers &&
-                boxesCount>0 &&
+                hdr->count>0 &&
                 currPts != (boxes[nBox].readTimeMs - fileStart) ) {
                 // set param
-                sprintf( name, "%s.metadata."I64FMT, sFilterName, currPts );
-                api->set_param(*pCtx, name, buffer);
-                boxesCount = 0;
+                sprintf( name, "%s.boxes."I64FMT, sFilterName, currPts );
+                api->set_param(*pCtx, name, hdr);
+                hdr->count = 0;
             }
 
-            if ( boxesCount == 0 ) {
+            if ( hdr->count == 0 ) {
                 // with approx. 33ms between frames, we wouldn't want a bounding
                 // box to linger more than 1.5 frames
                 // interpolation algorithm may extend this value, if the object
                 // appears in both frames being interpolated
-                #define BBOX_DURATION "duration=50;"
+                #define BBOX_DURATION 50
 
                 // starting a new set of boxes
                 currPts = (boxes[nBox].readTimeMs - fileStart);
+                memcpy(hdr->magic, BOX_METADATA_MAGIC, BOX_METADATA_MAGIC_SIZE);
+                hdr->duration = BBOX_DURATION;
                 if ( isRegionMarkers ) {
-                    strcpy(buffer, "type=drawline;");
+                    strcpy(hdr->types, "drawline;");
                 } else {
-                    strcpy(buffer, "type=boundingbox;");
+                    strcpy(hdr->types, "boundingbox;");
                     if (flags&oifDebugClips)
-                        strcat(buffer, "type=bboxid;");
+                        strcat(hdr->types, "bboxid;");
                 }
-                strcat(buffer, BBOX_DURATION);
             }
 
             int nRead = sscanf(boxes[nBox].drawboxParams,
-                 "drawbox=%d:%d:%d:%d:%d:%d:%d:%[a-z]:t=%d",
+                 "drawbox=%d:%d:%d:%d:%d:%d:%d:%15[a-z]:t=%d",
                  &x, &y, &w,
                  &h, &procW, &procH, &uid, color, &t);
-            sprintf( &buffer[strlen(buffer)], "%d:%d:%d:%d:%d:%d:%d:%d:%s;", x, y, w, h, procW, procH, t, uid, color);
-            boxesCount++;
+            if ( nRead != 9 ) {
+                log_err(logFn, "Failed to parse bounding box: %s", boxes[nBox].drawboxParams);
+                continue;
+            }
+            box = &box_metadata_boxes(hdr)[hdr->count];
+            box->timestamp = currPts;
+            box->r.x = x;
+            box->r.y = y;
+            box->r.w = w;
+            box->r.h = h;
+            box->procW = procW;
+            box->procH = procH;
+            box->thickness = t;
+            box->uid = uid;
+            box_metadata_set_color(box, color);
+            hdr->count++;
         }
 
-        if ( boxesCount > 0 ) {
+        if ( hdr->count > 0 ) {
             if ( isRegionMarkers ) {
-                sprintf( name, "%s.metadata", sFilterName );
+                sprintf( name, "%s.boxes", sFilterName );
             } else {
-                sprintf( name, "%s.metadata."I64FMT, sFilterName, currPts );
+                sprintf( name, "%s.boxes."I64FMT, sFilterName, currPts );
             }
-            api->set_param(*pCtx, name, buffer);
+            api->set_param(*pCtx, name, hdr);
         }
 
-        sv_freep(&buffer);
+        sv_freep(&hdr);
         return 0;
 }
 
@@ -1669,7 +2359,15 @@ stream_api_t* _enable_timestamp( stream_obj** pCtx,
     strcat(buffer, (timestampFlags&tsfUSDate) ? USDate : intlDate);
     strcat(buffer, (timestampFlags&tsf12HrTime) ? USTime : militaryTime);
 
-    INSERT_FILTER(api, ctx, ff_filter_api, name, sInsertAfter );
+    if ( sv_get_int_env_var(TIMESTAMP_DRAWTEXT_VAR, 0) ) {
+        INSERT_FILTER(api, ctx, ff_filter_api, name, sInsertAfter );
+    } else {
+        api->insert_element(&ctx,
+                            &api,
+                            sInsertAfter,
+                            get_timestamp_overlay_api()->create(name),
+                            svFlagNone);
+    }
     CONFIG_FILTER(ctx, name, logFn, Cleanup,
                 "filterType", (flags&oifDebugClips)?"timer":"timestamp",
                 "timestampOffset", &offset,
@@ -1709,8 +2407,33 @@ static const char* _formatFileList(const char** filenames, char* buffer, int buf
     return buffer;
 }
 
+//-----------------------------------------------------------------------------
+// Progress of a single export pass. Passes running on worker threads report to
+// their export job; the job's owner forwards the combined value to progCb.
+typedef struct clip_export_job clip_export_job;
+
+typedef struct clip_progress {
+    progress_fn_t       progCb;
+    int                 base;       // progCb gets base + pct*range/100
+    int                 range;
+    clip_export_job*    job;
+    int                 chunk;
+} clip_progress;
+
+static int _clip_report_progress(clip_progress* prog, int pct);
+
 //-----------------------------------------------------------------------------
 // Create a single clip from a one or more video files
+//-----------------------------------------------------------------------------
+// What the H.264 video of a clip was encoded with, for smart render: GOPs it
+// re-encodes have to be decodable with the same decoder setup as copied ones
+typedef struct clip_source_format {
+    int                 profile;            // h264xxx
+    int                 level;              // level_idc, e.g. 31 for 3.1
+    int                 width;
+    int                 height;
+} clip_source_format;
+
 static uint64_t create_clip_base(int numFiles,
                 const char** filenames,
                 uint64_t* fileOffsetMs,
@@ -1723,8 +2446,9 @@ static uint64_t create_clip_base(int numFiles,
                 BoxOverlayInfo* boxes,
                 const char* format,
                 int fps,
+                const clip_source_format* smartRender,
                 log_fn_t logFn,
-                progress_fn_t progCb)
+                clip_progress* progress)
 {
     int64_t       realFirstMs = -1;
     size_t        framesRead = 0, videoFramesRead = 0;
@@ -1780,12 +2504,26 @@ static uint64_t create_clip_base(int numFiles,
                 "urls", filenames,
                 "offsets", fileOffsetMs,
                 NULL);
+    if ( numFiles > 1 ) {
+        // open the next file while the current one is being exported
+        api->set_param(ctx, "inputIterator.prefetch", &_kOne);
+    }
 
     if ( useDecoder ) {
-        // if we're applying filters, we'd want pixfmt of RGB
-        // otherwise, we'd want it to be whatever came out of decoded H264
-        int pixfmt = (timestampFlags || numBoxes>0) ? pfmtRGB24 : pfmtUndefined;
+        // whatever came out of decoded H264: boxes and timestamps are drawn
+        // on YUV as it is, and that's what the encoder wants too
+        int pixfmt = pfmtUndefined;
+        // exports shouldn't take decode threads away from the live streams
+        int decodePriority = 0;
+        int hwEncode = sv_get_int_env_var(HW_ENCODE_VAR, 0);
+        // with nothing to draw, frames can go from the decoder to the encoder without leaving the GPU
+        int keepOnDevice = hwEncode && !timestampFlags && numBoxes == 0 && dstCodecId == streamH264 &&
+                           sv_get_int_env_var(HW_ZERO_COPY_VAR, 0);
         APPEND_FILTER(api, ctx, ffdec_stream_api, "decoder");
+        api->set_param(ctx, "decoder.decodePriority", &decodePriority);
+        if ( keepOnDevice ) {
+            api->set_param(ctx, "decoder.hwFramesOutput", &keepOnDevice);
+        }
 
         if ( fps > 0 ) {
             APPEND_FILTER(api, ctx, limiter_filter_api, "fpslimit");
@@ -1803,9 +2541,10 @@ static uint64_t create_clip_base(int numFiles,
                     "height", &codecConfig->max_height,
                     "pixfmt", &pixfmt,
                     "allowUpsize", &_kZero,
+                    "keepOnDevice", &keepOnDevice,
                     NULL);
 
-        // if we need any boxes, we're likely to need RGB anyway
+        // the pixelate filter draws boxes on YUV as it comes
         int useFFMPEGForBoxes = 0;
         api = _enable_bounding_boxes( &ctx, 0, numBoxes, boxes, 0,
                             NULL, useFFMPEGForBoxes, logFn);
@@ -1817,6 +2556,18 @@ static uint64_t create_clip_base(int numFiles,
                             "encoderType", &_kMediaVideo,
                             "canUpdatePixfmt", &_kZero,
                             NULL);
+        if ( smartRender ) {
+            // lets re-encoded GOPs sit next to stream-copied ones
+            api->set_param(ctx, "encoder.inbandHeaders", &_kOne);
+            api->set_param(ctx, "encoder.h264profile", &smartRender->profile);
+            api->set_param(ctx, "encoder.h264level", &smartRender->level);
+        }
+        if ( sv_get_int_env_var(ENCODER_POOL_VAR, 0) ) {
+            api->set_param(ctx, "encoder.pooled", &_kOne);
+        }
+        if ( hwEncode ) {
+            api->set_param(ctx, "encoder.hwEncoder", &hwEncode);
+        }
 
         if ( codecConfig->gop_size > 0) {
             sprintf(&buffer[strlen(buffer)], " gop_size=%d", codecConfig->gop_size );
@@ -1854,6 +2605,7 @@ static uint64_t create_clip_base(int numFiles,
                         NULL );
 
     api->set_param(ctx, "liveStream", &_kZero);
+    api->set_param(ctx, "demux.mmapAccess", "sequential");
 
     if (api->open_in(ctx) < 0) {
         log_err(logFn, "Failed to open clip at %s", _formatFileList(filenames, fileList, 1024) );
@@ -1877,14 +2629,14 @@ static uint64_t create_clip_base(int numFiles,
         if ( videoFramesRead == 0 && isVideo ) {
             realFirstMs = frameMs;
         }
-        if ( progCb != NULL ) {
+        if ( progress != NULL ) {
             if ( frameMs < firstMs || lastMs == firstMs ) {
                 // seek may cause a couple of frames prior to the requested ts to be returned
                 currentPct = 0;
             } else {
                 currentPct = (frameMs - firstMs)*100 / (lastMs - firstMs);
             }
-            int progRes = progCb( currentPct );
+            int progRes = _clip_report_progress( progress, currentPct );
             if ( progRes < 0 ) {
                 log_dbg(logFn, "Clip creation canceled %d!", progRes);
                 canceled = 1;
@@ -1912,23 +2664,653 @@ create_clip_cleanup:
 }
 
 //-----------------------------------------------------------------------------
-// Create a single clip from a one or more video files
-SVVIDEOLIB_API uint64_t create_clip(int numFiles,
-                const char** filenames,
-                uint64_t* fileOffsetMs,
-                uint64_t firstMs,
-                uint64_t lastMs,
-                const char* outfile,
-                CodecConfig* codecConfig,
-                int timestampFlags,
-                int numBoxes,
-                BoxOverlayInfo* boxes,
-                const char* format,
+// Chunked export: the clip is exported as a series of chunk files on a pool of
+// workers (each with its own graph and encoder), then the chunks are joined
+// without re-encoding. Used to re-encode several segments in parallel, and to
+// only re-encode the GOPs that have bounding boxes drawn on them.
+//-----------------------------------------------------------------------------
+static const int kExportEncodePct = 90;    // share of progress for the encode pass
+static const int kMaxExportWorkers = 8;
+static const int kBoxDisplayMs = 50;       // see BBOX_DURATION
+static int       _gExportWorkers = -1;
+static int       _gSmartRender = -1;
+
+typedef struct clip_export_chunk {
+    const char*         filenames[2];       // input, NULL-terminated like the caller's list
+    uint64_t            fileOffsetMs;
+    uint64_t            firstMs;
+    uint64_t            lastMs;
+    char*               outfile;
+    int64_t             realFirstMs;
+    int                 reencode;           // stream-copied otherwise
+    int                 pct;
+} clip_export_chunk;
+
+struct clip_export_job {
+    sv_mutex*           mutex;
+    sv_event*           doneEvent;
+    int                 nextChunk;
+    int                 runningWorkers;
+    int                 canceled;
+    int                 failed;
+    int                 chunkCount;
+    int                 chunkAlloc;
+    clip_export_chunk*  chunks;
+
+    // settings shared by all the chunks
+    clip_source_format* smartRender;        // set for smart render, see source
+    clip_source_format  source;
+    int                 sourceMismatch;     // inputs differ, or their format isn't known
+    CodecConfig*        codecConfig;
+    int                 timestampFlags;
+    int                 numBoxes;
+    BoxOverlayInfo*     boxes;
+    const char*         format;
+    int                 fps;
+    log_fn_t            logFn;
+};
+
+//-----------------------------------------------------------------------------
+// Sets the number of segments a clip export may re-encode at once; 1 disables
+// parallel export. Defaults to SV_CLIP_EXPORT_WORKERS, or a quarter of the
+// CPUs, leaving the rest to the live streams.
+SVVIDEOLIB_API void set_clip_export_workers(int workers)
+{
+    _gExportWorkers = workers < 1 ? 1 : (workers > kMaxExportWorkers ? kMaxExportWorkers : workers);
+}
+
+//-----------------------------------------------------------------------------
+static int _get_clip_export_workers()
+{
+    if ( _gExportWorkers < 0 ) {
+        int def = sv_get_cpu_count()/4;
+        set_clip_export_workers(sv_get_int_env_var("SV_CLIP_EXPORT_WORKERS", def));
+    }
+    return _gExportWorkers;
+}
+
+//-----------------------------------------------------------------------------
+static int _clip_report_progress(clip_progress* prog, int pct)
+{
+    if ( prog->job != NULL ) {
+        clip_export_job* job = prog->job;
+        int              res;
+        sv_mutex_enter(job->mutex);
+        job->chunks[prog->chunk].pct = pct;
+        res = job->canceled ? -1 : 0;
+        sv_mutex_exit(job->mutex);
+        return res;
+    }
+    if ( prog->progCb != NULL ) {
+        return prog->progCb(prog->base + pct*prog->range/100);
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// "dir/clip.mp4" -> "dir/clip.partN.mp4"
+static char* _clip_chunk_filename(const char* outfile, int index)
+{
+    const char* ext = strrchr(outfile, '.');
+    const char* sep = strrchr(outfile, '/');
+    const char* bsep = strrchr(outfile, '\\');
+    size_t      len = strlen(outfile) + 32;
+    char*       res = (char*)malloc(len);
+
+    if ( bsep > sep ) sep = bsep;
+    if ( ext == NULL || (sep != NULL && ext < sep) ) {
+        ext = outfile + strlen(outfile);
+    }
+    snprintf(res, len, "%.*s.part%d%s", (int)(ext-outfile), outfile, index, ext);
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+static void* _clip_export_worker(void* param)
+{
+    clip_export_job* job = (clip_export_job*)param;
+
+    for (;;) {
+        int chunkIndex;
+
+        sv_mutex_enter(job->mutex);
+        chunkIndex = ( job->canceled || job->failed || job->nextChunk >= job->chunkCount ) ?
+                        -1 : job->nextChunk++;
+        sv_mutex_exit(job->mutex);
+        if ( chunkIndex < 0 ) {
+            break;
+        }
+
+        clip_export_chunk* chunk = &job->chunks[chunkIndex];
+        clip_progress      prog = { NULL, 0, 100, job, chunkIndex };
+        int                reencode = chunk->reencode;
+        chunk->realFirstMs = create_clip_base(1,
+                                chunk->filenames,
+                                &chunk->fileOffsetMs,
+                                chunk->firstMs,
+                                chunk->lastMs,
+                                chunk->outfile,
+                                reencode ? job->codecConfig : NULL,
+                                reencode ? job->timestampFlags : 0,
+                                reencode ? job->numBoxes : 0,
+                                reencode ? job->boxes : NULL,
+                                job->format,
+                                reencode ? job->fps : 0,
+                                job->smartRender,
+                                job->logFn,
+                                &prog );
+
+        sv_mutex_enter(job->mutex);
+        chunk->pct = 100;
+        if ( chunk->realFirstMs < 0 && !job->canceled ) {
+            log_err(job->logFn, "Failed to export chunk %d of %d", chunkIndex, job->chunkCount);
+            job->failed = 1;
+        }
+        sv_mutex_exit(job->mutex);
+    }
+
+    sv_mutex_enter(job->mutex);
+    if ( --job->runningWorkers == 0 ) {
+        sv_event_set(job->doneEvent);
+    }
+    sv_mutex_exit(job->mutex);
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+static int _is_h264_clip_format(const char* format)
+{
+    return _stricmp(format, "hls") && _stricmp(format, "mjpeg") &&
+           _stricmp(format, "jpg") && _stricmp(format, "gif");
+}
+
+//-----------------------------------------------------------------------------
+// What the export costs, for the export scheduler; follows the choice of
+// create_clip_base between copying the stream and decoding it
+static int _get_clip_export_kind(CodecConfig* codecConfig,
+                int timestampFlags,
+                int numBoxes,
+                const char* format)
+{
+    int reencode = codecConfig ? (codecConfig->sv_profile != svvpOriginal)
+                               : (timestampFlags != 0 || numBoxes > 0 ||
+                                  !_stricmp(format, "mjpeg") ||
+                                  !_stricmp(format, "jpg") ||
+                                  !_stricmp(format, "gif"));
+    return reencode ? exportJobReencode : exportJobRemux;
+}
+
+//-----------------------------------------------------------------------------
+// Returns 1 if the clip is worth exporting in parallel: it is re-encoded to
+// H264 (a stream copy is already I/O bound), and it spans several segments.
+static int _can_export_in_parallel(int numFiles,
+                uint64_t* fileOffsetMs,
+                uint64_t firstMs,
+                uint64_t lastMs,
+                CodecConfig* codecConfig,
+                int timestampFlags,
+                int numBoxes,
+                const char* format)
+{
+    int reencode, nI, segments = 0;
+
+    if ( _get_clip_export_workers() < 2 || numFiles < 2 || !_is_h264_clip_format(format) ) {
+        return 0;
+    }
+    reencode = codecConfig ? (codecConfig->sv_profile != svvpOriginal)
+                           : (timestampFlags != 0 || numBoxes > 0);
+    if ( !reencode ) {
+        return 0;
+    }
+    for (nI=0; nI<numFiles; nI++) {
+        if ( fileOffsetMs[nI] <= lastMs &&
+             ( nI == numFiles-1 || fileOffsetMs[nI+1] > firstMs ) ) {
+            segments++;
+        }
+    }
+    return segments > 1;
+}
+
+//-----------------------------------------------------------------------------
+// Returns 1 if the clip is only re-encoded to draw bounding boxes, in which
+// case the GOPs without any boxes in them can be stream-copied instead.
+// Timestamps, frame rate limits and codec settings touch every frame.
+static int _can_smart_render(CodecConfig* codecConfig,
+                int timestampFlags,
+                int numBoxes,
+                const char* format,
+                int fps)
+{
+    if ( _gSmartRender < 0 ) {
+        _gSmartRender = sv_get_int_env_var("SV_CLIP_SMART_RENDER", 1);
+    }
+    return _gSmartRender &&
+           codecConfig == NULL &&
+           timestampFlags == 0 &&
+           numBoxes > 0 &&
+           fps <= 0 &&
+           _is_h264_clip_format(format);
+}
+
+//-----------------------------------------------------------------------------
+static clip_export_chunk* _clip_job_add_chunk(clip_export_job* job,
+                const char* filename,
+                uint64_t fileOffsetMs,
+                uint64_t firstMs,
+                uint64_t lastMs,
+                int reencode,
+                const char* outfile)
+{
+    clip_export_chunk* chunk;
+
+    if ( job->chunkCount == job->chunkAlloc ) {
+        job->chunkAlloc = job->chunkAlloc ? job->chunkAlloc*2 : 16;
+        job->chunks = (clip_export_chunk*)realloc(job->chunks,
+                                    job->chunkAlloc*sizeof(clip_export_chunk));
+    }
+    chunk = &job->chunks[job->chunkCount];
+    memset(chunk, 0, sizeof(*chunk));
+    chunk->filenames[0] = filename;
+    chunk->filenames[1] = NULL;
+    chunk->fileOffsetMs = fileOffsetMs;
+    chunk->firstMs = firstMs;
+    chunk->lastMs = lastMs;
+    chunk->outfile = _clip_chunk_filename(outfile, job->chunkCount);
+    chunk->realFirstMs = -1;
+    chunk->reencode = reencode;
+    job->chunkCount++;
+    return chunk;
+}
+
+//-----------------------------------------------------------------------------
+// Visits each segment overlapping [firstMs, lastMs], with the part of the
+// range it covers; a segment ends right before the next one starts
+#define FOR_EACH_CLIP_SEGMENT(nI, segFirst, segLast) \
+    for (nI=0; nI<numFiles; nI++) \
+        if ( fileOffsetMs[nI] <= lastMs && \
+             ( nI == numFiles-1 || fileOffsetMs[nI+1] > firstMs ) && \
+             ( (segFirst = firstMs > fileOffsetMs[nI] ? firstMs : fileOffsetMs[nI]), \
+               (segLast = ( nI == numFiles-1 || fileOffsetMs[nI+1]-1 > lastMs ) ? \
+                                lastMs : fileOffsetMs[nI+1]-1), 1 ) )
+
+//-----------------------------------------------------------------------------
+// Parallel export: one re-encoded chunk per segment
+static void _clip_job_plan_segments(clip_export_job* job,
+                int numFiles,
+                const char** filenames,
+                uint64_t* fileOffsetMs,
+                uint64_t firstMs,
+                uint64_t lastMs,
+                const char* outfile)
+{
+    uint64_t segFirst, segLast;
+    int      nI;
+
+    FOR_EACH_CLIP_SEGMENT(nI, segFirst, segLast) {
+        _clip_job_add_chunk(job, filenames[nI], fileOffsetMs[nI],
+                            segFirst, segLast, 1, outfile);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Returns 1 if any of the boxes is on screen between fromMs and toMs
+static int _clip_has_boxes(int numBoxes,
+                BoxOverlayInfo* boxes,
+                uint64_t fromMs,
+                uint64_t toMs)
+{
+    int nI;
+    for (nI=0; nI<numBoxes; nI++) {
+        uint64_t shownAt = boxes[nI].readTimeMs;
+        if ( shownAt <= toMs && shownAt + kBoxDisplayMs >= fromMs ) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Reads the video format of a clip from its index; returns -1 if the index was
+// written without it, or if the encoder can't produce that profile
+static int _clip_get_source_format(clip_index* index,
+                clip_source_format* fmt)
+{
+    int            codecId, width, height;
+    int            w = -1, h = -1, profile = -1, level = -1;
+    size_t         size = 0;
+    const uint8_t* sps;
+
+    if ( index == NULL ||
+         clip_index_get_codec(index, &codecId, &width, &height) < 0 ||
+         codecId != streamH264 ||
+         (sps = clip_index_get_param_set(index, 0, &size)) == NULL ||
+         size == 0 ) {
+        return -1;
+    }
+    videolibapi_parse_sps((unsigned char*)sps, (unsigned short)size, &w, &h, &profile, &level);
+    switch (profile) {
+    case 66:    fmt->profile = h264Baseline; break;
+    case 77:    fmt->profile = h264Main; break;
+    case 100:   fmt->profile = h264High; break;
+    default:    return -1;
+    }
+    fmt->level = level;
+    fmt->width = w > 0 ? w : width;
+    fmt->height = h > 0 ? h : height;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Smart render: cuts a segment into runs of GOPs, re-encoding the ones with
+// boxes in them (or the one the clip starts in the middle of), and copying
+// the rest. Runs end at the last frame before the next run's keyframe.
+static void _clip_job_plan_smart_segment(clip_export_job* job,
+                const char* filename,
+                uint64_t fileOffsetMs,
+                uint64_t segFirst,
+                uint64_t segLast,
+                int numBoxes,
+                BoxOverlayInfo* boxes,
+                const char* outfile,
+                log_fn_t logFn)
+{
+    clip_index*         index = clip_index_open(filename, (fn_stream_log)logFn);
+    clip_export_chunk*  run = NULL;
+    clip_source_format  fmt;
+    int64_t             gopStart;
+    int                 kf;
+
+    // all the inputs have to match, as the output has a single set of them
+    if ( _clip_get_source_format(index, &fmt) < 0 ) {
+        job->sourceMismatch = 1;
+    } else if ( job->smartRender == NULL ) {
+        job->source = fmt;
+        job->smartRender = &job->source;
+    } else if ( memcmp(&fmt, &job->source, sizeof(fmt)) ) {
+        job->sourceMismatch = 1;
+    }
+
+    if ( index == NULL || clip_index_get_count(index) == 0 ) {
+        // no keyframe positions to cut at: all or nothing
+        int dirty = segFirst != fileOffsetMs ||
+                    _clip_has_boxes(numBoxes, boxes, segFirst, segLast);
+        _clip_job_add_chunk(job, filename, fileOffsetMs, segFirst, segLast, dirty, outfile);
+        clip_index_close(&index);
+        return;
+    }
+
+    kf = clip_index_find(index, segFirst - fileOffsetMs, 1);
+    if ( kf < 0 ) {
+        kf = clip_index_find_next_keyframe(index, segFirst - fileOffsetMs);
+    }
+    gopStart = kf < 0 ? segFirst - fileOffsetMs : clip_index_get_pts(index, kf);
+
+    for (;;) {
+        int      next = clip_index_find_next_keyframe(index, gopStart);
+        int64_t  nextStart = next < 0 ? -1 : clip_index_get_pts(index, next);
+        uint64_t from = gopStart + fileOffsetMs;
+        uint64_t to = segLast;
+        int      dirty;
+
+        if ( next >= 0 ) {
+            int lastFrame = clip_index_find(index, nextStart-1, 0);
+            uint64_t gopLast = fileOffsetMs +
+                        (lastFrame >= 0 ? clip_index_get_pts(index, lastFrame) : nextStart-1);
+            if ( gopLast < to ) {
+                to = gopLast;
+            }
+        }
+        if ( from < segFirst ) {
+            from = segFirst;
+        }
+
+        dirty = from != gopStart + fileOffsetMs ||
+                _clip_has_boxes(numBoxes, boxes, from, to);
+        if ( run != NULL && run->reencode == dirty ) {
+            run->lastMs = to;
+        } else {
+            run = _clip_job_add_chunk(job, filename, fileOffsetMs, from, to, dirty, outfile);
+        }
+
+        if ( next < 0 || to >= segLast ) {
+            break;
+        }
+        gopStart = nextStart;
+    }
+    clip_index_close(&index);
+}
+
+//-----------------------------------------------------------------------------
+static void _clip_job_plan_smart(clip_export_job* job,
+                int numFiles,
+                const char** filenames,
+                uint64_t* fileOffsetMs,
+                uint64_t firstMs,
+                uint64_t lastMs,
+                int numBoxes,
+                BoxOverlayInfo* boxes,
+                const char* outfile,
+                log_fn_t logFn)
+{
+    uint64_t segFirst, segLast;
+    int      nI, reencoded = 0;
+
+    FOR_EACH_CLIP_SEGMENT(nI, segFirst, segLast) {
+        _clip_job_plan_smart_segment(job, filenames[nI], fileOffsetMs[nI],
+                            segFirst, segLast, numBoxes, boxes, outfile, logFn);
+    }
+    for (nI=0; nI<job->chunkCount; nI++) {
+        reencoded += job->chunks[nI].reencode;
+    }
+    log_dbg(logFn, "Smart render of %s: %d runs, %d re-encoded", outfile,
+                        job->chunkCount, reencoded);
+}
+
+//-----------------------------------------------------------------------------
+// Exports the job's chunks on up to maxWorkers threads, and joins them into outfile
+static int64_t _clip_job_run(clip_export_job* job,
+                uint64_t lastMs,
+                const char* outfile,
+                const char* format,
+                int maxWorkers,
+                log_fn_t logFn,
+                progress_fn_t progCb)
+{
+    sv_thread*          workers[kMaxExportWorkers];
+    int                 workerCount = maxWorkers < kMaxExportWorkers ? maxWorkers : kMaxExportWorkers;
+    int64_t             realFirstMs = -1;
+    uint64_t            totalMs = 0;
+    uint64_t            t = sv_time_get_current_epoch_time();
+    int                 nI;
+
+    for (nI=0; nI<job->chunkCount; nI++) {
+        totalMs += job->chunks[nI].lastMs - job->chunks[nI].firstMs + 1;
+    }
+    if ( workerCount > job->chunkCount ) {
+        workerCount = job->chunkCount;
+    }
+
+    log_info(logFn, "Exporting clip %s in %d chunks using %d workers",
+                        outfile, job->chunkCount, workerCount);
+
+    job->mutex = sv_mutex_create();
+    job->doneEvent = sv_event_create(0, 0);
+    for (nI=0; nI<workerCount; nI++) {
+        sv_mutex_enter(job->mutex);
+        job->runningWorkers++;
+        sv_mutex_exit(job->mutex);
+        // decoders and encoders opened by the worker run their threads where it runs
+        workers[nI] = sv_thread_create_ex(_clip_export_worker, job, "clip-export", "export");
+        if ( workers[nI] == NULL ) {
+            sv_mutex_enter(job->mutex);
+            job->runningWorkers--;
+            job->failed = 1;
+            sv_mutex_exit(job->mutex);
+            workerCount = nI;
+            break;
+        }
+    }
+
+    // progress is reported from this thread only, as it is with a serial export
+    for (;;) {
+        int      running;
+        uint64_t doneMs = 0;
+
+        if ( workerCount > 0 ) {
+            sv_event_wait(job->doneEvent, 100);
+        }
+
+        sv_mutex_enter(job->mutex);
+        running = job->runningWorkers;
+        for (nI=0; nI<job->chunkCount; nI++) {
+            clip_export_chunk* chunk = &job->chunks[nI];
+            doneMs += (chunk->lastMs - chunk->firstMs + 1)*chunk->pct/100;
+        }
+        sv_mutex_exit(job->mutex);
+
+        if ( progCb != NULL && !job->canceled ) {
+            int pct = totalMs ? (int)(doneMs*kExportEncodePct/totalMs) : 0;
+            if ( progCb(pct) < 0 ) {
+                log_dbg(logFn, "Clip creation canceled!");
+                sv_mutex_enter(job->mutex);
+                job->canceled = 1;
+                sv_mutex_exit(job->mutex);
+            }
+        }
+        if ( running == 0 ) {
+            break;
+        }
+    }
+    for (nI=0; nI<workerCount; nI++) {
+        sv_thread_destroy(&workers[nI]);
+    }
+
+    log_info(logFn, "Exported %d chunks of clip %s in " I64FMT "ms, canceled=%d failed=%d",
+                        job->chunkCount, outfile, sv_time_get_elapsed_time(t),
+                        job->canceled, job->failed);
+
+    if ( !job->canceled && !job->failed && job->chunkCount > 0 ) {
+        // join the chunks; their timestamps start at 0, and the offset of
+        // each is where its first frame actually was
+        const char**    chunkFiles = (const char**)calloc(job->chunkCount+1, sizeof(char*));
+        uint64_t*       chunkOffsets = (uint64_t*)calloc(job->chunkCount, sizeof(uint64_t));
+        clip_progress   prog = { progCb, kExportEncodePct, 100-kExportEncodePct, NULL, 0 };
+
+        for (nI=0; nI<job->chunkCount; nI++) {
+            chunkFiles[nI] = job->chunks[nI].outfile;
+            chunkOffsets[nI] = job->chunks[nI].realFirstMs;
+        }
+        realFirstMs = create_clip_base(job->chunkCount,
+                                chunkFiles,
+                                chunkOffsets,
+                                chunkOffsets[0],
+                                lastMs,
+                                outfile,
+                                NULL,
+                                0,
+                                0,
+                                NULL,
+                                format,
+                                0,
+                                NULL,
+                                logFn,
+                                &prog );
+        free(chunkFiles);
+        free(chunkOffsets);
+    }
+
+    for (nI=0; nI<job->chunkCount; nI++) {
+        remove(job->chunks[nI].outfile);
+        free(job->chunks[nI].outfile);
+    }
+    free(job->chunks);
+    job->chunks = NULL;
+    job->chunkCount = job->chunkAlloc = 0;
+    sv_event_destroy(&job->doneEvent);
+    sv_mutex_destroy(&job->mutex);
+    return realFirstMs;
+}
+
+//-----------------------------------------------------------------------------
+// Create a single clip from a one or more video files
+SVVIDEOLIB_API uint64_t create_clip(int numFiles,
+                const char** filenames,
+                uint64_t* fileOffsetMs,
+                uint64_t firstMs,
+                uint64_t lastMs,
+                const char* outfile,
+                CodecConfig* codecConfig,
+                int timestampFlags,
+                int numBoxes,
+                BoxOverlayInfo* boxes,
+                const char* format,
                 int fps,
                 log_fn_t logFn,
                 progress_fn_t progCb)
 {
-    int64_t realFirstMs = create_clip_base(numFiles,
+    clip_progress   prog = { progCb, 0, 100, NULL, 0 };
+    clip_export_job job;
+    export_ticket*  ticket;
+    int             wantThreads = 1;
+    int64_t         realFirstMs;
+    int             nI;
+
+    memset(&job, 0, sizeof(job));
+    job.codecConfig = codecConfig;
+    job.timestampFlags = timestampFlags;
+    job.numBoxes = numBoxes;
+    job.boxes = boxes;
+    job.format = format;
+    job.fps = fps;
+    job.logFn = logFn;
+
+    if ( _can_smart_render(codecConfig, timestampFlags, numBoxes, format, fps) ) {
+        // copied and re-encoded GOPs have their own SPS/PPS in the stream, and
+        // the encoder matches the profile and level of the copied ones
+        _clip_job_plan_smart(&job, numFiles, filenames, fileOffsetMs,
+                            firstMs, lastMs, numBoxes, boxes, outfile, logFn);
+        if ( job.sourceMismatch ) {
+            log_dbg(logFn, "Can't match the format of %s, re-encoding all of it", outfile);
+        }
+        if ( job.sourceMismatch ||
+             ( job.chunkCount == 1 && job.chunks[0].reencode ) ) {
+            // nothing to copy, don't bother with the extra pass
+            for (nI=0; nI<job.chunkCount; nI++) {
+                free(job.chunks[nI].outfile);
+            }
+            free(job.chunks);
+            job.chunks = NULL;
+            job.chunkCount = 0;
+            job.smartRender = NULL;
+        }
+    } else
+    if ( _can_export_in_parallel(numFiles, fileOffsetMs, firstMs, lastMs,
+                                 codecConfig, timestampFlags, numBoxes, format) ) {
+        _clip_job_plan_segments(&job, numFiles, filenames, fileOffsetMs,
+                            firstMs, lastMs, outfile);
+    }
+
+    if ( job.chunkCount > 0 ) {
+        wantThreads = _get_clip_export_workers();
+        if ( wantThreads > job.chunkCount ) {
+            wantThreads = job.chunkCount;
+        }
+    }
+    ticket = export_scheduler_enter(_get_clip_export_kind(codecConfig, timestampFlags, numBoxes, format),
+                            wantThreads, outfile, progCb, (fn_stream_log)logFn);
+    if ( ticket == NULL ) {
+        for (nI=0; nI<job.chunkCount; nI++) {
+            free(job.chunks[nI].outfile);
+        }
+        free(job.chunks);
+        return -1;
+    }
+
+    if ( job.chunkCount > 0 ) {
+        realFirstMs = _clip_job_run(&job, lastMs, outfile, format,
+                            export_ticket_get_threads(ticket), logFn, progCb);
+    } else {
+        realFirstMs = create_clip_base(numFiles,
                             filenames,
                             fileOffsetMs,
                             firstMs,
@@ -1940,8 +3322,11 @@ SVVIDEOLIB_API uint64_t create_clip(int numFiles,
                             boxes,
                             format,
                             fps,
+                            NULL,
                             logFn,
-                            progCb );
+                            &prog );
+    }
+    export_scheduler_leave(&ticket);
     return realFirstMs>=0 ? 0 : -1;
 }
 
@@ -1954,7 +3339,15 @@ SVVIDEOLIB_API uint64_t fast_create_clip(int numFiles, const char** filenames, u
                      uint64_t firstMs, uint64_t lastMs, const char* outfile,
                      const char* format, log_fn_t logFn, progress_fn_t progCb)
 {
-    uint64_t realFirstMs = create_clip_base(numFiles,
+    clip_progress   prog = { progCb, 0, 100, NULL, 0 };
+    export_ticket*  ticket = export_scheduler_enter(exportJobRemux, 1, outfile, progCb,
+                                                    (fn_stream_log)logFn);
+    uint64_t        realFirstMs;
+
+    if ( ticket == NULL ) {
+        return (uint64_t)-1;
+    }
+    realFirstMs = create_clip_base(numFiles,
                             filenames,
                             fileOffsetMs,
                             firstMs,
@@ -1966,11 +3359,37 @@ SVVIDEOLIB_API uint64_t fast_create_clip(int numFiles, const char** filenames, u
                             NULL,
                             format,
                             0,
+                            NULL,
                             logFn,
-                            progCb );
+                            &prog );
+    export_scheduler_leave(&ticket);
     return realFirstMs;
 }
 
+//-----------------------------------------------------------------------------
+// Limits how many clip exports run at once, how many of those may re-encode,
+// and how many threads they have between them. Values <= 0 leave a limit as
+// it is; the defaults are SV_EXPORT_MAX_JOBS (2), SV_EXPORT_MAX_REENCODES (1)
+// and SV_EXPORT_THREAD_BUDGET (all the CPUs). Whatever the budget, the cores
+// of the live decoders, and at least SV_EXPORT_RESERVED_CORES (1), are left
+// to the live pipelines.
+SVVIDEOLIB_API void set_export_limits(int maxJobs, int maxReencodeJobs, int threadBudget)
+{
+    export_scheduler_set_limits(maxJobs, maxReencodeJobs, threadBudget);
+}
+
+//-----------------------------------------------------------------------------
+// State of the export queue: exports running (re-encodes among them), waiting
+// to start, and the threads they hold out of the budget.
+SVVIDEOLIB_API int get_export_queue_state(int* runningJobs, int* runningReencodes,
+                                          int* queuedJobs, int* threadsInUse,
+                                          int* threadBudget)
+{
+    export_scheduler_get_state(runningJobs, runningReencodes, queuedJobs,
+                               threadsInUse, threadBudget);
+    return 0;
+}
+
 
 //-----------------------------------------------------------------------------
 // Returns a count of the number of local cameras on the system, and
@@ -2081,34 +3500,19 @@ static void free_codec_config(CodecConfig** config)
 }
 
 //-----------------------------------------------------------------------------
-// TODO: we could make the JPEG grabbing/generation more efficient by keeping
-//       context and saving the scaling and buffer instances, but our current
-//       performance tests show that there seems to be no significant bottleneck
-//       right now ...
+// The web UI polls these for every camera, so the scaler and encoder are kept
+// around between calls (see jpeg_snapshot.cpp)
 SVVIDEOLIB_API void* get_newest_frame_as_jpeg(StreamData* data, int width, int height,
                                int* size) {
-    int                sz, err;
     frame_obj*         lastFrameRead = NULL;
-    frame_api_t*       frameApi;
-    int                inputWidth;
-    int                inputHeight;
-    int                finished;
     void*              result = NULL;
-    uint8_t*           resizedFrameBuffer = NULL;
-    AVFrame*           frameCopy = NULL;
-    AVFrame*           resizedFrame = NULL;
-    AVCodecContext*    codecCtx = NULL;
-    AVCodec*           codec;
-    AVPacket           packet;
-    struct SwsContext* swsCtx = NULL;
-    int                inputPixFmt;
 
      // some sanity checks to avoid the worst
     if (width < 0 || height < 0 || !data) {
-        goto get_newest_frame_as_jpeg_exit;
+        return NULL;
     }
 
-    // grab a 1:1 copy of the latest frame as quickly and safely as possible,
+    // grab a reference to the latest frame as quickly and safely as possible,
     // so regular queue processing does not get paused for too long; this
     // function is usually called from a different thread (from the web server
     // or application respectively at the time of this writing) ...
@@ -2119,158 +3523,14 @@ SVVIDEOLIB_API void* get_newest_frame_as_jpeg(StreamData* data, int width, int h
 
     if (lastFrameRead==NULL) {
         log_err(data->logFn, "no frame available!");
-        goto get_newest_frame_as_jpeg_exit;
-    }
-
-    // assumption: the input data (if available) never changes
-    frameApi = frame_get_api(lastFrameRead);
-    inputPixFmt = frameApi->get_pixel_format(lastFrameRead);
-    inputWidth  = frameApi->get_width(lastFrameRead);
-    inputHeight = frameApi->get_height(lastFrameRead);
-
-    frameCopy = av_frame_alloc();
-    if (!frameCopy) {
-        log_err(data->logFn, "no frame allocated");
-        goto get_newest_frame_as_jpeg_exit;
-    }
-
-    err = av_image_fill_arrays(frameCopy->data,
-                    frameCopy->linesize,
-                    frameApi->get_data(lastFrameRead),
-                    svpfmt_to_ffpfmt(inputPixFmt, NULL),
-                    inputWidth,
-                    inputHeight,
-                    _kDefAlign);
-    frameCopy->width = inputWidth;
-    frameCopy->height = inputHeight;
-    frameCopy->format = svpfmt_to_ffpfmt(inputPixFmt, NULL);
-    frameCopy->color_range = AVCOL_RANGE_JPEG;
-    if (err < 0) {
-        log_err(data->logFn, "cannot allocate frame copy buffer fmt=%d, w=%d, h=%d, err=%s", inputPixFmt, inputWidth, inputHeight, av_err2str(err) );
-        goto get_newest_frame_as_jpeg_exit;
-    }
-
-    // resize the frame to the final size needed, and avoid ever scaling up;
-    // also force a minimum size of 16x16 because at the time we got a crash in
-    // sws_getCachedContext() on very small sizes (e.g. 3x2)
-    width = width < 16 ? 16 : width;
-    width = width > inputWidth ? inputWidth : width;
-    height = height < 16 ? 16 : height;
-    height = height > inputHeight ? inputHeight : height;
-    preserve_aspect_ratio( inputWidth, inputHeight, &width, &height, 1);
-    swsCtx = sws_getCachedContext(NULL,
-        inputWidth, inputHeight, svpfmt_to_ffpfmt(inputPixFmt, NULL),
-        width, height, AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR,
-        0, NULL, NULL);
-        // NOTE: AV_PIX_FMT_YUV420P instead of AV_PIX_FMT_YUVJ420P, as below, to avoid
-        //       warnings saying "deprecated pixel format used, make sure you
-        //       did set range correctly" flooding the log for no good reason
-    if (!swsCtx) {
-        log_err(data->logFn, "cannot get scaling context");
-        goto get_newest_frame_as_jpeg_exit;
-    }
-    resizedFrame = av_frame_alloc();
-    if (!resizedFrame) {
-        log_err(data->logFn, "cannot allocate frame");
-        goto get_newest_frame_as_jpeg_exit;
-    }
-    sz = av_image_get_buffer_size(AV_PIX_FMT_YUVJ420P, width, height + 1, _kDefAlign);
-    resizedFrameBuffer = (uint8_t*)av_malloc(sz);
-    if (!resizedFrameBuffer) {
-        log_err(data->logFn, "cannot allocated resized frame buffer");
-        goto get_newest_frame_as_jpeg_exit;
-    }
-
-    av_image_fill_arrays(resizedFrame->data,
-                   resizedFrame->linesize,
-                   resizedFrameBuffer,
-                   AV_PIX_FMT_YUVJ420P,
-                   width,
-                   height,
-                   _kDefAlign);
-    sws_scale(swsCtx,
-        (const uint8_t* const*)frameCopy->data,
-        frameCopy->linesize,
-        0,
-        inputHeight,
-        resizedFrame->data,
-        resizedFrame->linesize);
-    resizedFrame->width = width;
-    resizedFrame->height = height;
-    resizedFrame->format = AV_PIX_FMT_YUV420P;
-
-    // do the JPEG compression by leveraging FFmpeg's MJPEG codec
-    codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
-    if (!codec) {
-        log_err(data->logFn, "cannot find encoder");
-        goto get_newest_frame_as_jpeg_exit;
-    }
-    codecCtx = avcodec_alloc_context3(codec);
-    if (!codecCtx) {
-        log_err(data->logFn, "cannot allocated codec context");
-        goto get_newest_frame_as_jpeg_exit;
-    }
-    codecCtx->bit_rate = 100*1000*1000; // dummy
-    codecCtx->width = width;
-    codecCtx->height = height;
-    codecCtx->pix_fmt = AV_PIX_FMT_YUVJ420P;
-    codecCtx->codec_id = AV_CODEC_ID_MJPEG;
-    codecCtx->codec_type = AVMEDIA_TYPE_VIDEO;
-    codecCtx->time_base.num = 1; // dummy
-    codecCtx->time_base.den = 1; // dummy
-    codecCtx->mb_lmin = codecCtx->qmin * FF_QP2LAMBDA;
-    codecCtx->mb_lmax = codecCtx->qmax * FF_QP2LAMBDA;
-    codecCtx->flags = AV_CODEC_FLAG_QSCALE;
-    codecCtx->global_quality = codecCtx->qmin * FF_QP2LAMBDA;
-    // TODO: don't let all of this quality setting fool you, as it turns out it
-    //       does not change a thing - at this moment the FFMPEG MJPEG codec
-    //       always uses the same quality (there seems to be a lossless option,
-    //       but we don't use it) - ideally we'd use a more flexible encoder
-    //       (e.g. libjepg) to support different quality settings and thus
-    //       better adaption in different bandwidth scenarios...
-    err = avcodec_open2(codecCtx, codec, NULL);
-    if (err) {
-        log_err(data->logFn, "cannot open codec (%d)", err);
-        goto get_newest_frame_as_jpeg_exit;
-    }
-    resizedFrame->pts = 1;
-    resizedFrame->quality = codecCtx->global_quality;
-
-
-    av_init_packet(&packet);
-    packet.data = NULL;
-    packet.size = 0;
-    err = avcodec_send_frame(codecCtx, resizedFrame);
-    if (err) {
-        goto get_newest_frame_as_jpeg_exit;
-    }
-
-    err = avcodec_receive_packet(codecCtx, &packet);
-    if (err) {
-        goto get_newest_frame_as_jpeg_exit;
-    }
-
-    // extract the data from the packet, no need for another copy action
-    result = av_malloc(packet.size);
-    if (!result) {
-        goto get_newest_frame_as_jpeg_exit;
-    }
-    memcpy(result, packet.data, packet.size);
-    *size = packet.size;
-
-get_newest_frame_as_jpeg_exit:
-    // cleanup, any "exception" also lands here...
-    if (resizedFrame) {
-        av_free(resizedFrameBuffer);
-        av_frame_free(&resizedFrame);
-    }
-    sws_freeContext(swsCtx);
-    if (codecCtx) {
-        avcodec_close(codecCtx);
-        avcodec_free_context(&codecCtx);
-    }
-    av_packet_unref(&packet);
-    av_frame_free(&frameCopy);
+        return NULL;
+    }
+
+    result = jpeg_snapshot_encode(jpeg_snapshot_get(data, (fn_stream_log)data->logFn),
+                                  lastFrameRead,
+                                  width,
+                                  height,
+                                  size);
     frame_unref(&lastFrameRead);
     return result;
 }
@@ -2309,6 +3569,54 @@ SVVIDEOLIB_API int get_initial_frame_buffer_size(StreamData* data)
 #define CLIP_INF(...) if ( _gClipDebugEnabled > 0 ) log_info (__VA_ARGS__)
 #define CLIP_DBG(...) if ( _gClipDebugEnabled > 0 ) log_dbg (__VA_ARGS__)
 
+// rough number of frames a clip stream keeps around, for the purposes of
+// accounting for idle streams in the clip cache
+#define CLIP_CACHE_FRAMES_PER_STREAM 8
+
+// default bounds of the frames decoded ahead of the playhead, see
+// set_clip_decode_ahead
+#define CLIP_DECODE_AHEAD_FRAMES_VAR "SV_CLIP_DECODE_AHEAD_FRAMES"
+#define CLIP_DECODE_AHEAD_MB_VAR "SV_CLIP_DECODE_AHEAD_MB"
+#define DEFAULT_CLIP_DECODE_AHEAD_FRAMES 8
+#define DEFAULT_CLIP_DECODE_AHEAD_MB 64
+
+//-----------------------------------------------------------------------------
+// Whatever can be changed on an open clip stream, and would have to match for
+// it to be handed out again
+static void _clip_stream_state(ClipStream* stream, char* buffer, size_t size)
+{
+    snprintf(buffer, size, "%dx%d muted=%d", stream->outWidth, stream->outHeight, stream->muted);
+}
+
+//-----------------------------------------------------------------------------
+static void _clip_stream_destroy(void* ptr)
+{
+    ClipStream* data = (ClipStream*)ptr;
+    clip_prefetch_stop(data);
+    clip_cache_unregister_stream(data);
+    CLIP_INF(data->logFn, "ClipUtils-%p: Closing clip stream for %s", data, data->filename);
+    free_input_data(&data->input);
+    sv_freep(&data->filename);
+    free_clip_frame(&data->nextFrame);
+    sv_freep(&data);
+}
+
+//-----------------------------------------------------------------------------
+// Rewinds an idle clip stream taken from the clip cache
+static int _clip_stream_reuse(ClipStream* stream, log_fn_t logFn)
+{
+    stream->logFn = logFn;
+    stream->lastMsReturned = (int64_t)-1;
+    stream->freed = 0;
+    stream->api->set_log_cb(stream->input.streamCtx, (fn_stream_log)logFn);
+    if ( stream->api->seek(stream->input.streamCtx, 0, sfBackward|sfPrecise) < 0 ) {
+        log_warn(logFn, "Failed to rewind cached clip stream for %s", stream->filename);
+        return -1;
+    }
+    CLIP_INF(logFn, "ClipUtils-%p: Reusing clip stream for %s", stream, stream->filename);
+    return 0;
+}
+
 //-----------------------------------------------------------------------------
 // Attempts to open a clip to be read
 SVVIDEOLIB_API ClipStream* open_clip(const char* filename, int width, int height,
@@ -2318,6 +3626,24 @@ SVVIDEOLIB_API ClipStream* open_clip(const char* filename, int width, int height
                     int numRegions, BoxOverlayInfo* regions,
                     log_fn_t logFn)
 {
+    // boxes are too specific to the caller for the stream to be worth keeping,
+    // and an idle stream shouldn't be holding on to the audio device
+    int  cacheable = (numBoxes <= 0 && numRegions <= 0 && !enableAudio);
+    char cacheConfig[256];
+    if ( cacheable ) {
+        snprintf(cacheConfig, sizeof(cacheConfig),
+                    "%dx%d ts="I64FMT" audio=%d thread=%d debug=%d tsflags=%d keyonly=%d",
+                    width, height, timestampOffset, enableAudio, enableThread,
+                    enableDebug, timestampFlags, keyframeOnly);
+        ClipStream* cached = (ClipStream*)clip_cache_take_stream(filename, cacheConfig);
+        if ( cached != NULL ) {
+            if ( _clip_stream_reuse(cached, logFn) == 0 ) {
+                return cached;
+            }
+            _clip_stream_destroy(cached);
+        }
+    }
+
     ClipStream* stream = (ClipStream*)malloc(sizeof(ClipStream));
     stream->lastMsReturned = (int64_t)-1;
     stream->logFn = logFn;
@@ -2380,9 +3706,38 @@ SVVIDEOLIB_API ClipStream* open_clip(const char* filename, int width, int height
             free_clip_stream(&stream);
         }
 
-        char buffer[2048];
-        api->print_pipeline(ctx, buffer, 2047);
-        log_dbg(stream->logFn, "Clip pipeline: %s", buffer);
+        if ( stream != NULL ) {
+            // clip seeks go straight to the governing keyframe when there's a
+            // frame table for the file, and stepping forward from the target
+            // doesn't have to decode anything twice
+            stream_api_t* scApi = get_seek_cache_api();
+            stream_obj* seekCache = scApi->create("seekCache");
+            scApi->set_param(seekCache, "indexFile", filename);
+            scApi->set_param(seekCache, "keyframeOnly", &keyframeOnly);
+            if ( api->insert_element(&stream->input.streamCtx,
+                                &stream->api,
+                                NULL,
+                                seekCache,
+                                svFlagStreamInitialized | svFlagStreamOpen) < 0 ) {
+                log_warn(logFn, "Failed to initialize seek cache for %s", filename);
+            }
+            ctx = stream->input.streamCtx;
+            api = stream->api;
+        }
+
+        if ( stream != NULL ) {
+            char buffer[2048];
+            api->print_pipeline(ctx, buffer, 2047);
+            log_dbg(stream->logFn, "Clip pipeline: %s", buffer);
+        }
+
+        if ( stream != NULL && cacheable ) {
+            char   state[64];
+            size_t cost = (size_t)stream->outWidth*stream->outHeight*3*CLIP_CACHE_FRAMES_PER_STREAM +
+                          (size_t)stream->srcWidth*stream->srcHeight*3/2*CLIP_CACHE_FRAMES_PER_STREAM;
+            _clip_stream_state(stream, state, sizeof(state));
+            clip_cache_register_stream(stream, filename, cacheConfig, state, cost);
+        }
     }
 
     return stream;
@@ -2395,6 +3750,10 @@ SVVIDEOLIB_API int clip_has_audio(ClipStream* stream)
     return stream->input.streamCtx != NULL && stream->input.hasAudio;
 }
 
+//-----------------------------------------------------------------------------
+static int  _clip_pause_decode_ahead(ClipStream* stream);
+static void _clip_rewind_to_playhead(ClipStream* stream);
+
 //-----------------------------------------------------------------------------
 // Set the desired size for returned frames. 0 on success, -1 on error.
 SVVIDEOLIB_API int set_output_size(ClipStream* stream, int width, int height)
@@ -2421,6 +3780,9 @@ SVVIDEOLIB_API int set_output_size(ClipStream* stream, int width, int height)
         return 0;
     }
 
+    // frames decoded ahead are of the old size
+    int dropped = _clip_pause_decode_ahead(stream);
+
     int newSize[] = { width, height };
     if (api->set_param(ctx, "procResize.updateSize", &newSize[0]) < 0 ) {
         log_err(stream->logFn, "failed to modify resize parameters");
@@ -2430,6 +3792,13 @@ SVVIDEOLIB_API int set_output_size(ClipStream* stream, int width, int height)
     stream->outWidth = api->get_width(ctx);
     stream->outHeight = api->get_height(ctx);
 
+    int flush = 1;
+    api->set_param(ctx, "seekCache.flush", &flush);
+
+    if ( dropped > 0 ) {
+        _clip_rewind_to_playhead(stream);
+    }
+
     return 0;
 }
 
@@ -2467,11 +3836,14 @@ static void free_clip_stream_internal(ClipStream** dataPtr)
     ClipStream* data = *dataPtr;
     if (data->freed) {
         if (data->outstandingFrames==0) {
-            CLIP_INF(data->logFn, "ClipUtils-%p: Closing clip stream for %s", data, data->filename);
-            free_input_data(&data->input);
-            sv_freep(&data->filename);
-            free_clip_frame(&data->nextFrame);
-            sv_freep(dataPtr);
+            char state[64];
+            _clip_stream_state(data, state, sizeof(state));
+            if ( clip_cache_park_stream(data, state, _clip_stream_destroy) ) {
+                CLIP_INF(data->logFn, "ClipUtils-%p: Parked clip stream for %s", data, data->filename);
+            } else {
+                _clip_stream_destroy(data);
+            }
+            *dataPtr = NULL;
         } else {
             CLIP_INF(data->logFn,
                     "ClipUtils-%p: Not yet closing clip stream for %s, %d frames are still out there",
@@ -2508,6 +3880,8 @@ SVVIDEOLIB_API void free_clip_stream(ClipStream** dataPtr)
 
     ClipStream* data = *dataPtr;
     if (data) {
+        // the decode-ahead worker is the only other user of the stream
+        clip_prefetch_stop(data);
         // free any frames the stream itself may reference
         free_clip_frame(&data->nextFrame);
         // set the flag
@@ -2535,9 +3909,52 @@ static void* create_frame(ClipStream* stream,
 
 
 //-----------------------------------------------------------------------------
-// Retrieve the next frame from a file. Returns a ClipFrame*, NULL on error
-// or when there are no more frames.
-SVVIDEOLIB_API void* get_next_frame(ClipStream* stream)
+SVVIDEOLIB_API int get_clip_frame_buffer_layout(ClipFrame* frame, int* size, int* stride,
+                                                int* bytesPerPixel)
+{
+    if ( !frame || !frame->frame ) {
+        return -1;
+    }
+    return _get_frame_buffer_layout(frame->frame, size, stride, bytesPerPixel);
+}
+
+//-----------------------------------------------------------------------------
+// Reads the next video frame off a clip stream; NULL on error or at the end
+static frame_obj* _clip_read_video_frame(ClipStream* stream, int* retries)
+{
+    stream_obj* ctx = stream->input.streamCtx;
+    stream_api_t* api = stream->api;
+    frame_obj* frame = NULL;
+
+    while ( api->read_frame(ctx, &frame) >= 0 && frame != NULL ) {
+        if ( frame_get_api(frame)->get_media_type(frame) == mediaVideo ) {
+            return frame;
+        }
+        frame_unref(&frame);
+        (*retries)++;
+    }
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Read function of the decode-ahead worker
+static frame_obj* _clip_decode_ahead_read(void* ctx)
+{
+    int retries = 0;
+    return _clip_read_video_frame((ClipStream*)ctx, &retries);
+}
+
+//-----------------------------------------------------------------------------
+// Pauses decode-ahead, if the stream has it, before the stream is used from
+// this thread. Returns the number of frames it had read past the playhead.
+static int _clip_pause_decode_ahead(ClipStream* stream)
+{
+    clip_prefetch* prefetch = clip_prefetch_get(stream);
+    return prefetch ? clip_prefetch_pause(prefetch) : 0;
+}
+
+//-----------------------------------------------------------------------------
+static void* _get_next_frame(ClipStream* stream, int decodeAhead)
 {
     INT64_T startTime = sv_time_get_current_epoch_time();
     int retries = 0;
@@ -2552,19 +3969,19 @@ SVVIDEOLIB_API void* get_next_frame(ClipStream* stream)
         res = stream->nextFrame;
         stream->nextFrame = NULL;
     } else {
-        stream_obj* ctx = stream->input.streamCtx;
-        stream_api_t* api = stream->api;
+        // decode-ahead is paused by seeks, and only picks up again once
+        // frames are read in sequence; audio is rendered as it's read, so the
+        // stream can't be read ahead of the playhead while it's playing
+        clip_prefetch* prefetch = decodeAhead ? clip_prefetch_get(stream) : NULL;
         frame_obj* frame = NULL;
-
-Retry:
-        if ( api->read_frame(ctx, &frame) < 0 || frame == NULL) {
-            res = NULL;
-        } else
-        if ( frame_get_api(frame)->get_media_type(frame) != mediaVideo ) {
-            frame_unref(&frame);
-            retries ++;
-            goto Retry;
+        if ( prefetch != NULL && stream->muted != 0 ) {
+            clip_prefetch_resume(prefetch);
+            frame = clip_prefetch_take(prefetch);
         } else {
+            frame = _clip_read_video_frame(stream, &retries);
+        }
+
+        if ( frame != NULL ) {
             res = (ClipFrame*)create_frame(stream, frame);
             stream->lastMsReturned = res->ms;
         }
@@ -2579,6 +3996,14 @@ Retry:
     return res;
 }
 
+//-----------------------------------------------------------------------------
+// Retrieve the next frame from a file. Returns a ClipFrame*, NULL on error
+// or when there are no more frames.
+SVVIDEOLIB_API void* get_next_frame(ClipStream* stream)
+{
+    return _get_next_frame(stream, 1);
+}
+
 //-----------------------------------------------------------------------------
 static void* get_frame_at_or_before(ClipStream* stream, INT64_T ms)
 {
@@ -2589,6 +4014,7 @@ static void* get_frame_at_or_before(ClipStream* stream, INT64_T ms)
     ClipFrame*          prevFrame = NULL;
     ClipFrame*          curFrame = NULL;
 
+    _clip_pause_decode_ahead(stream);
     free_clip_frame(&stream->nextFrame);
 
     if ( ms < 0 ) {
@@ -2598,6 +4024,24 @@ static void* get_frame_at_or_before(ClipStream* stream, INT64_T ms)
 
     CLIP_DBG(stream->logFn, "ClipUtils-%p: Getting frame at ts="I64FMT, stream, ms);
 
+    // with a frame table, the seek cache knows exactly which frame is wanted,
+    // and gets there in one seek (or none at all, if the frame had already been
+    // decoded); otherwise, grope around for it below
+    int    hasFrameIndex = 0;
+    size_t size = sizeof(hasFrameIndex);
+    if ( api->get_param(ctx, "seekCache.hasFrameIndex", &hasFrameIndex, &size) >= 0 &&
+         hasFrameIndex &&
+         api->seek(ctx, ms, sfBackward|sfPrecise) >= 0 ) {
+        curFrame = (ClipFrame*)_get_next_frame(stream, 0);
+        if ( curFrame != NULL && curFrame->ms <= ms ) {
+            CLIP_DBG(stream->logFn, "ClipUtils-%p: Returning indexed frame at ts="I64FMT, stream, curFrame->ms);
+            return curFrame;
+        }
+        CLIP_INF(stream->logFn, "ClipUtils-%p: Frame table of %s is off: wanted ts="I64FMT" got "I64FMT,
+                        stream, stream->filename, ms, curFrame ? curFrame->ms : -1);
+        free_clip_frame(&curFrame);
+    }
+
     do {
         // seek backwards to a previous keyframe
         seekTo = ms > goBackMs ? ms - goBackMs : 0;
@@ -2610,7 +4054,7 @@ static void* get_frame_at_or_before(ClipStream* stream, INT64_T ms)
         int keepReading = 0;
 
         do {
-            curFrame = (ClipFrame*)get_next_frame(stream);
+            curFrame = (ClipFrame*)_get_next_frame(stream, 0);
             if ( curFrame == NULL ) {
                 int64_t prevPts = ( prevFrame ? prevFrame->ms : -1 );
                 CLIP_DBG(stream->logFn, "ClipUtils-%p: Couldn't read a frame ... prevPts="I64FMT" requested="I64FMT, stream, prevPts, ms);
@@ -2667,6 +4111,27 @@ static void* get_frame_at_or_before(ClipStream* stream, INT64_T ms)
 
 }
 
+//-----------------------------------------------------------------------------
+// Puts the stream back right after the last frame returned, once the frames
+// decode-ahead had read past it were dropped
+static void _clip_rewind_to_playhead(ClipStream* stream)
+{
+    CLIP_DBG(stream->logFn, "ClipUtils-%p: Rewinding to ts="I64FMT, stream, stream->lastMsReturned);
+    if ( stream->lastMsReturned < 0 ) {
+        free_clip_frame(&stream->nextFrame);
+        if ( stream->api->seek(stream->input.streamCtx, 0, sfBackward|sfPrecise) < 0 ) {
+            log_warn(stream->logFn, "Failed to rewind clip %s", stream->filename);
+        }
+        return;
+    }
+    // the frame at the playhead was already returned; whatever follows it
+    // is read next
+    int64_t    playhead = stream->lastMsReturned;
+    ClipFrame* frame = (ClipFrame*)get_frame_at_or_before(stream, playhead);
+    free_clip_frame(&frame);
+    stream->lastMsReturned = playhead;
+}
+
 //-----------------------------------------------------------------------------
 // Retrieve the prev frame from a file. Returns a ClipFrame*, NULL on error
 // or when there are no more frames.
@@ -2718,6 +4183,63 @@ SVVIDEOLIB_API void* get_frame_at(ClipStream* stream, int64_t ms)
 }
 
 
+//-----------------------------------------------------------------------------
+// Turns decode-ahead on or off. With it on, get_next_frame hands out frames
+// a worker thread decoded, filtered and resized ahead of the playhead: up to
+// maxFrames of them, taking up to maxMb megabytes (<= 0 for the defaults).
+// Seeking, stepping back or resizing drops what was queued, and the worker
+// picks up again on the next get_next_frame; it stays idle while audio is
+// playing. 0 on success, -1 on error.
+SVVIDEOLIB_API int set_clip_decode_ahead(ClipStream* stream, int enable,
+                                         int maxFrames, int maxMb)
+{
+    if (!stream || !stream->input.streamCtx ) {
+        log_err(stream->logFn, "no stream is currently open");
+        return -1;
+    }
+
+    if ( clip_prefetch_get(stream) != NULL ) {
+        if ( _clip_pause_decode_ahead(stream) > 0 ) {
+            _clip_rewind_to_playhead(stream);
+        }
+        clip_prefetch_stop(stream);
+    }
+    if ( !enable ) {
+        return 0;
+    }
+
+    if ( maxFrames <= 0 ) {
+        maxFrames = sv_get_int_env_var(CLIP_DECODE_AHEAD_FRAMES_VAR, DEFAULT_CLIP_DECODE_AHEAD_FRAMES);
+    }
+    if ( maxMb <= 0 ) {
+        maxMb = sv_get_int_env_var(CLIP_DECODE_AHEAD_MB_VAR, DEFAULT_CLIP_DECODE_AHEAD_MB);
+    }
+    if ( clip_prefetch_start(stream, _clip_decode_ahead_read, stream, maxFrames,
+                             (size_t)maxMb*1024*1024, (fn_stream_log)stream->logFn) == NULL ) {
+        log_err(stream->logFn, "Failed to enable decode-ahead for %s", stream->filename);
+        return -1;
+    }
+    CLIP_INF(stream->logFn, "ClipUtils-%p: Decoding up to %d frames, %dMB ahead in %s",
+                    stream, maxFrames, maxMb, stream->filename);
+    return 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// Frames get_next_frame took from decode-ahead, how many of them it had to
+// wait for, and how many are queued now. -1 if decode-ahead is off.
+SVVIDEOLIB_API int get_clip_decode_ahead_stats(ClipStream* stream, int64_t* taken,
+                                               int64_t* starved, int* queued)
+{
+    clip_prefetch* prefetch = stream ? clip_prefetch_get(stream) : NULL;
+    if ( prefetch == NULL ) {
+        return -1;
+    }
+    clip_prefetch_get_stats(prefetch, taken, starved, queued, NULL);
+    return 0;
+}
+
+
 //-----------------------------------------------------------------------------
 // Return an array of millisecond offsets for each frame in the clip.  The
 // first entry in the array is the number of frames.  Returns NULL on error.
@@ -2738,8 +4260,25 @@ SVVIDEOLIB_API int64_t* get_ms_list2(const char* filename, log_fn_t logFn)
 
 
     stream_api_t*   api = get_ffmpeg_demux_api();
-    stream_obj*     ctx = api->create("demux");
+    stream_obj*     ctx = NULL;
     frame_obj*      frame = NULL;
+    int             scanned = 0;
+    clip_index*     index = clip_index_open(filename, (fn_stream_log)logFn);
+
+    if ( index != NULL && clip_index_get_count(index) > 0 ) {
+        numFrames = clip_index_get_count(index);
+        msList = (int64_t*)malloc((numFrames+1)*sizeof(int64_t));
+        for (int nI=0; nI<numFrames; nI++) {
+            msList[nI+1] = clip_index_get_pts(index, nI);
+        }
+    } else if ( clip_cache_get_ms_list(filename, &msList) == 0 ) {
+        // scanned before, and the file hasn't changed since
+        numFrames = msList[0];
+    } else {
+        ctx = api->create("demux");
+        scanned = 1;
+    }
+    clip_index_close(&index);
 
     if ( ctx ) {
         stream_ref(ctx);
@@ -2747,6 +4286,7 @@ SVVIDEOLIB_API int64_t* get_ms_list2(const char* filename, log_fn_t logFn)
         api->set_log_cb(ctx, (fn_stream_log)logFn);
         api->set_param(ctx, "url", filename);
         api->set_param(ctx, "liveStream", &_kZero);
+        api->set_param(ctx, "mmapAccess", "sequential");
         if (api->open_in(ctx) >= 0) {
             while ( api->read_frame(ctx, &frame)>=0 && frame ) {
                 frame_api_t* fapi = frame_get_api(frame);
@@ -2773,6 +4313,9 @@ SVVIDEOLIB_API int64_t* get_ms_list2(const char* filename, log_fn_t logFn)
                         msList[2],
                         msList[numFrames],
                         numFrames);
+        if ( scanned ) {
+            clip_cache_put_ms_list(filename, msList);
+        }
     } else {
         log_err(logFn, "Failed to retrieve ms list for %s", filename);
     }
@@ -2784,10 +4327,20 @@ SVVIDEOLIB_API int64_t* get_ms_list2(const char* filename, log_fn_t logFn)
 SVVIDEOLIB_API int64_t get_duration(const char* filename, log_fn_t logFn)
 {
     stream_api_t*   api = get_ffmpeg_demux_api();
-    stream_obj*     ctx = api->create("demux");
+    stream_obj*     ctx = NULL;
     frame_obj*      frame = NULL;
     int64_t         duration = -1;
     size_t          size = sizeof(duration);
+    clip_index*     index = clip_index_open(filename, (fn_stream_log)logFn);
+
+    if ( index != NULL ) {
+        duration = clip_index_get_duration(index);
+        clip_index_close(&index);
+    } else if ( clip_cache_get_duration(filename, &duration) == 0 ) {
+        // probed before, and the file hasn't changed since
+    } else {
+        ctx = api->create("demux");
+    }
 
     if ( ctx ) {
         stream_ref(ctx);
@@ -2798,6 +4351,8 @@ SVVIDEOLIB_API int64_t get_duration(const char* filename, log_fn_t logFn)
         if (api->open_in(ctx) >= 0) {
             if (api->get_param(ctx, "demux.duration", &duration, &size) < 0 ) {
                 duration = -1;
+            } else {
+                clip_cache_put_duration(filename, duration);
             }
         }
         stream_unref(&ctx);
@@ -2810,6 +4365,422 @@ SVVIDEOLIB_API int64_t get_duration(const char* filename, log_fn_t logFn)
 }
 
 
+//-----------------------------------------------------------------------------
+// Bulk building of frame indexes, for clips recorded before the recorder
+// wrote them. Each clip is demuxed (nothing is decoded) by one of a few
+// workers of the "background" class, so the live streams are not starved;
+// clips that already have a valid index are skipped, which makes a run that
+// was canceled or interrupted resumable by starting it over.
+//-----------------------------------------------------------------------------
+#define CLIP_INDEX_WORKERS_VAR "SV_CLIP_INDEX_WORKERS"
+
+static const int kMaxIndexWorkers = 8;
+
+typedef struct clip_index_job {
+    sv_mutex*           mutex;
+    sv_event*           doneEvent;
+    int                 nextFile;
+    int                 runningWorkers;
+    int                 canceled;
+    int                 numFiles;
+    const char**        filenames;
+    int                 done;
+    int                 built;
+    int                 skipped;
+    int                 failed;
+    log_fn_t            logFn;
+} clip_index_job;
+
+//-----------------------------------------------------------------------------
+static int64_t _get_clip_size(const char* filename)
+{
+    FILE*   f = fopen(filename, "rb");
+    int64_t res = -1;
+    if ( f == NULL ) {
+        return -1;
+    }
+    if ( fseek(f, 0, SEEK_END) == 0 ) {
+        res = ftell(f);
+    }
+    fclose(f);
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+// Returns 1 if an index was written, 0 if the clip already had one, -1 on error
+static int _build_clip_index(clip_index_job* job, const char* filename)
+{
+    stream_api_t*       api = get_ffmpeg_demux_api();
+    stream_obj*         ctx;
+    frame_obj*          frame = NULL;
+    clip_index_writer*  w;
+    clip_index*         index = clip_index_open(filename, (fn_stream_log)job->logFn);
+    int64_t             mediaSize = _get_clip_size(filename);
+    int64_t             duration = -1;
+    int                 codecId = streamUnknown, width = 0, height = 0;
+    int                 spsSize = 0, ppsSize = 0;
+    char*               sps = NULL;
+    char*               pps = NULL;
+    size_t              size;
+    int                 frames = 0;
+    int                 res = -1;
+
+    if ( index != NULL ) {
+        clip_index_close(&index);
+        return 0;
+    }
+    if ( mediaSize <= 0 ) {
+        log_err(job->logFn, "Can't index %s: the file can't be read", filename);
+        return -1;
+    }
+
+    ctx = api->create("demux");
+    if ( ctx == NULL ) {
+        return -1;
+    }
+    stream_ref(ctx);
+    api->set_log_cb(ctx, (fn_stream_log)job->logFn);
+    api->set_param(ctx, "url", filename);
+    api->set_param(ctx, "liveStream", &_kZero);
+    api->set_param(ctx, "mmapAccess", "sequential");
+    if ( api->open_in(ctx) < 0 ) {
+        log_err(job->logFn, "Can't index %s: failed to open it", filename);
+        stream_unref(&ctx);
+        return -1;
+    }
+
+    size = sizeof(duration);
+    if ( api->get_param(ctx, "duration", &duration, &size) < 0 ) {
+        duration = -1;
+    }
+    size = sizeof(int);
+    api->get_param(ctx, "videoCodecId", &codecId, &size);
+    api->get_param(ctx, "width", &width, &size);
+    api->get_param(ctx, "height", &height, &size);
+    api->get_param(ctx, "spsSize", &spsSize, &size);
+    api->get_param(ctx, "ppsSize", &ppsSize, &size);
+    size = sizeof(char*);
+    api->get_param(ctx, "sps", &sps, &size);
+    api->get_param(ctx, "pps", &pps, &size);
+
+    w = clip_index_writer_create();
+    clip_index_writer_set_codec(w, codecId, width, height,
+                                (const uint8_t*)sps, sps ? spsSize : 0,
+                                (const uint8_t*)pps, pps ? ppsSize : 0);
+
+    // the same pts get_ms_list2 would have found scanning it
+    while ( api->read_frame(ctx, &frame) >= 0 && frame ) {
+        if ( frame_props_media_type(frame) == mediaVideo ) {
+            AVPacket*   pkt = (AVPacket*)frame_get_api(frame)->get_backing_obj(frame, "avpacket");
+            clip_index_writer_add(w,
+                                  frame_props_pts(frame),
+                                  pkt ? pkt->pos : -1,
+                                  frame_props_keyframe(frame));
+            frames++;
+        }
+        frame_unref(&frame);
+
+        if ( (frames % 256) == 0 && job->canceled ) {
+            break;
+        }
+    }
+
+    if ( !job->canceled && frames > 0 && duration >= 0 ) {
+        res = clip_index_writer_save(w, filename, duration, mediaSize, 0,
+                                     (fn_stream_log)job->logFn) < 0 ? -1 : 1;
+    } else if ( !job->canceled ) {
+        log_err(job->logFn, "Can't index %s: frames=%d duration=" I64FMT,
+                        filename, frames, duration);
+    }
+    clip_index_writer_destroy(&w);
+    stream_unref(&ctx);
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+static void* _clip_index_worker(void* param)
+{
+    clip_index_job* job = (clip_index_job*)param;
+
+    for (;;) {
+        int fileIndex, res;
+
+        sv_mutex_enter(job->mutex);
+        fileIndex = ( job->canceled || job->nextFile >= job->numFiles ) ?
+                        -1 : job->nextFile++;
+        sv_mutex_exit(job->mutex);
+        if ( fileIndex < 0 ) {
+            break;
+        }
+
+        res = _build_clip_index(job, job->filenames[fileIndex]);
+
+        sv_mutex_enter(job->mutex);
+        job->done++;
+        if ( res > 0 ) {
+            job->built++;
+        } else if ( res == 0 ) {
+            job->skipped++;
+        } else if ( !job->canceled ) {
+            job->failed++;
+        }
+        sv_mutex_exit(job->mutex);
+    }
+
+    sv_mutex_enter(job->mutex);
+    if ( --job->runningWorkers == 0 ) {
+        sv_event_set(job->doneEvent);
+    }
+    sv_mutex_exit(job->mutex);
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Builds the missing frame indexes of numFiles clips, on up to maxWorkers
+// threads (0 for SV_CLIP_INDEX_WORKERS, or a quarter of the CPUs). Progress is
+// the share of the clips done; a negative return from progCb cancels, leaving
+// the indexes built so far in place. Returns the number of clips that still
+// have no index (0 when all of them do), or -1 if canceled.
+SVVIDEOLIB_API int build_clip_indexes(int numFiles,
+                const char** filenames,
+                int maxWorkers,
+                log_fn_t logFn,
+                progress_fn_t progCb)
+{
+    clip_index_job      job;
+    sv_thread*          workers[kMaxIndexWorkers];
+    int                 workerCount = maxWorkers;
+    uint64_t            t = sv_time_get_current_epoch_time();
+    int                 nI;
+
+    if ( workerCount <= 0 ) {
+        workerCount = sv_get_int_env_var(CLIP_INDEX_WORKERS_VAR, sv_get_cpu_count()/4);
+    }
+    if ( workerCount > kMaxIndexWorkers ) workerCount = kMaxIndexWorkers;
+    if ( workerCount > numFiles ) workerCount = numFiles;
+    if ( workerCount < 1 ) workerCount = 1;
+
+    memset(&job, 0, sizeof(job));
+    job.numFiles = numFiles;
+    job.filenames = filenames;
+    job.logFn = logFn;
+    job.mutex = sv_mutex_create();
+    job.doneEvent = sv_event_create(0, 0);
+
+    log_info(logFn, "Indexing %d clips using %d workers", numFiles, workerCount);
+
+    for (nI=0; nI<workerCount && numFiles>0; nI++) {
+        sv_mutex_enter(job.mutex);
+        job.runningWorkers++;
+        sv_mutex_exit(job.mutex);
+        workers[nI] = sv_thread_create_ex(_clip_index_worker, &job, "clip-index", "background");
+        if ( workers[nI] == NULL ) {
+            sv_mutex_enter(job.mutex);
+            job.runningWorkers--;
+            sv_mutex_exit(job.mutex);
+            break;
+        }
+    }
+    workerCount = nI;
+    if ( workerCount == 0 && numFiles > 0 ) {
+        // no threads to be had; index on the caller's
+        job.runningWorkers = 1;
+        _clip_index_worker(&job);
+    }
+
+    for (;;) {
+        int running, done;
+
+        if ( workerCount > 0 ) {
+            sv_event_wait(job.doneEvent, 100);
+        }
+
+        sv_mutex_enter(job.mutex);
+        running = job.runningWorkers;
+        done = job.done;
+        sv_mutex_exit(job.mutex);
+
+        if ( progCb != NULL && !job.canceled ) {
+            if ( progCb(numFiles ? done*100/numFiles : 100) < 0 ) {
+                log_dbg(logFn, "Clip indexing canceled!");
+                sv_mutex_enter(job.mutex);
+                job.canceled = 1;
+                sv_mutex_exit(job.mutex);
+            }
+        }
+        if ( running == 0 ) {
+            break;
+        }
+    }
+    for (nI=0; nI<workerCount; nI++) {
+        sv_thread_destroy(&workers[nI]);
+    }
+    sv_event_destroy(&job.doneEvent);
+    sv_mutex_destroy(&job.mutex);
+
+    log_info(logFn, "Indexed %d of %d clips in " I64FMT "ms: built=%d skipped=%d failed=%d canceled=%d",
+                        job.done, numFiles, sv_time_get_elapsed_time(t),
+                        job.built, job.skipped, job.failed, job.canceled);
+
+    return job.canceled ? -1 : job.failed;
+}
+
+
+//-----------------------------------------------------------------------------
+// Reads the next video frame of a thumbnail pipeline
+static frame_obj* _read_thumbnail_frame(stream_api_t* api, stream_obj* ctx)
+{
+    frame_obj* frame = NULL;
+    while ( api->read_frame(ctx, &frame) >= 0 && frame != NULL ) {
+        if ( frame_get_api(frame)->get_media_type(frame) == mediaVideo ) {
+            return frame;
+        }
+        frame_unref(&frame);
+    }
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Extracts a strip of thumbnails in one pass: count of them spread evenly
+// across the clip, or (with count of 0) one every intervalMs. Only keyframes
+// are visited -- each thumbnail is the keyframe at or before its slot, and
+// slots sharing a keyframe share a thumbnail. Keyframes are decoded with
+// whatever shortcuts the codec offers, and scaled straight to width x height.
+// Stores up to maxFrames ClipFrame* to frames, each to be released with
+// free_clip_frame, and returns the number stored, or -1 on error.
+SVVIDEOLIB_API int get_thumbnails(const char* filename, int count, int intervalMs,
+                                  int width, int height,
+                                  void** frames, int maxFrames, log_fn_t logFn)
+{
+    if ( width <= 0 || height <= 0 || maxFrames <= 0 || (count <= 0 && intervalMs <= 0) ) {
+        log_err(logFn, "Invalid thumbnails request for %s: count=%d interval=%d size=%dx%d max=%d",
+                        filename, count, intervalMs, width, height, maxFrames);
+        return -1;
+    }
+
+    int64_t duration = get_duration(filename, logFn);
+    if ( duration < 0 ) {
+        return -1;
+    }
+    if ( count <= 0 ) {
+        int64_t slots = duration / intervalMs + 1;
+        count = (int)( slots < maxFrames ? slots : maxFrames );
+    }
+    if ( count > maxFrames ) {
+        count = maxFrames;
+    }
+
+    INT64_T startTime = sv_time_get_current_epoch_time();
+    int          pixfmt = GET_FRAME_PIX_FMT;
+    size_t       size = sizeof(int);
+    stream_api_t* api = get_ffmpeg_demux_api();
+    stream_obj*  ctx = api->create("demux");
+    stream_ref(ctx);
+    api->set_log_cb(ctx, (fn_stream_log)logFn);
+
+    APPEND_FILTER(api, ctx, ffdec_stream_api, "decoder");
+    APPEND_FILTER(api, ctx, resize_factory_api, "thumbResize");
+    api->set_param(ctx, "url", filename);
+    api->set_param(ctx, "liveStream", &_kZero);
+    api->set_param(ctx, "demux.keyframeOnly", &_kOne);
+    api->set_param(ctx, "decoder.fastDecode", &_kOne);
+    api->set_param(ctx, "decoder.lowresWidth", &width);
+    api->set_param(ctx, "decoder.lowresHeight", &height);
+    api->set_param(ctx, "thumbResize.pixfmt", &pixfmt);
+    api->set_param(ctx, "thumbResize.width", &width);
+    api->set_param(ctx, "thumbResize.height", &height);
+    if ( api->open_in(ctx) < 0 ) {
+        log_err(logFn, "Failed to open %s for thumbnails", filename);
+        api->close(ctx);
+        stream_unref(&ctx);
+        return -1;
+    }
+    api->set_param(ctx, "demux.discardAudio", &_kOne);
+
+    // frames hold on to the stream, which goes away with the last of them
+    ClipStream* stream = (ClipStream*)malloc(sizeof(ClipStream));
+    memset(stream, 0, sizeof(ClipStream));
+    stream->lastMsReturned = (int64_t)-1;
+    stream->logFn = logFn;
+    stream->filename = strdup(filename);
+    stream->muted = -1;
+    stream->keyframeOnly = 1;
+    stream->input.streamCtx = ctx;
+    stream->input.logFn = logFn;
+    stream->api = api;
+    stream->outWidth = width;
+    stream->outHeight = height;
+    api->get_param(ctx, "demux.width", &stream->srcWidth, &size);
+    api->get_param(ctx, "demux.height", &stream->srcHeight, &size);
+
+    // with a frame table, we know exactly which keyframe each slot maps to,
+    // and only have to seek when it isn't the one that comes next anyway
+    clip_index* index = clip_index_open(filename, (fn_stream_log)logFn);
+    if ( index != NULL && clip_index_get_count(index) <= 0 ) {
+        clip_index_close(&index);
+    }
+
+    int     stored = 0, seeks = 0;
+    int64_t lastPts = -1;
+    for (int nI=0; nI<count && stored<maxFrames; nI++) {
+        int64_t slot = ( intervalMs > 0 ) ? (int64_t)nI*intervalMs : duration*nI/count;
+        int64_t seekTo = slot;
+
+        if ( index != NULL ) {
+            int pos = clip_index_find(index, slot, 1);
+            if ( pos < 0 ) {
+                continue;
+            }
+            seekTo = clip_index_get_pts(index, pos);
+            if ( seekTo <= lastPts ) {
+                continue;
+            }
+            int next = ( lastPts < 0 ) ? -1 : clip_index_find_next_keyframe(index, lastPts);
+            if ( next >= 0 && clip_index_get_pts(index, next) == seekTo ) {
+                seekTo = -1;
+            }
+        } else if ( slot <= lastPts ) {
+            continue;
+        }
+
+        if ( seekTo >= 0 ) {
+            if ( api->seek(ctx, seekTo, sfBackward) < 0 ) {
+                log_err(logFn, "Failed to seek to "I64FMT" in %s", seekTo, filename);
+                break;
+            }
+            seeks++;
+        }
+
+        frame_obj* frame = _read_thumbnail_frame(api, ctx);
+        while ( frame != NULL && frame_get_api(frame)->get_pts(frame) <= lastPts ) {
+            // landed on the keyframe of the previous slot
+            frame_unref(&frame);
+            frame = _read_thumbnail_frame(api, ctx);
+        }
+        if ( frame == NULL ) {
+            break;
+        }
+        ClipFrame* res = (ClipFrame*)create_frame(stream, frame);
+        lastPts = res->ms;
+        frames[stored++] = res;
+    }
+    clip_index_close(&index);
+
+    log_info(logFn, "Extracted %d thumbnails of %s in "I64FMT"ms, %d seeks",
+                    stored, filename, sv_time_get_current_epoch_time()-startTime, seeks);
+    free_clip_stream(&stream);
+    return stored;
+}
+
+//-----------------------------------------------------------------------------
+// Drops whatever the clip cache holds for the file (or for all files, if NULL),
+// e.g. before the file is deleted.
+SVVIDEOLIB_API void flush_clip_cache(const char* filename)
+{
+    clip_cache_flush(filename);
+}
+
+
 //-----------------------------------------------------------------------------
 // Frees the memory allocated by a call to get_ms_list.
 SVVIDEOLIB_API void free_ms_list(int64_t** msListPtr)
@@ -2859,11 +4830,18 @@ SVVIDEOLIB_API int set_mute_audio(ClipStream* stream, int mute)
     }
     stream->muted = mute;
     if ( stream->input.streamCtx ) {
+        // audio that's playing is rendered as it's read, at the playhead
+        int dropped = mute ? 0 : _clip_pause_decode_ahead(stream);
+        if ( dropped > 0 ) {
+            _clip_rewind_to_playhead(stream);
+        }
         if ( stream->api->set_param(stream->input.streamCtx, "audio_render.mute", &stream->muted) < 0 ) {
             log_err(stream->logFn, "Failed to mute/unmute audio");
             stream->muted = !stream->muted;
             return -1;
         }
+        // while muted, audio isn't read (or decoded) at all
+        stream->api->set_param(stream->input.streamCtx, "demux.discardAudio", &stream->muted);
     }
     return 0;
 }
@@ -32,14 +32,62 @@
  *****************************************************************************/
 
 #include "sv_os.h"
+#include "sv_internal.h"
 #include "videolibUtils.h"
+#include "frame_props.h"
 
 extern "C" {
 #include <libavutil/mem.h>
 }
 
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
 #if SIGHTHOUND_VIDEO
 
+// FrameData structures are recycled: those with filenames up to this long
+// (which is all of them, in practice) come from, and go back to, a pool
+static const size_t kPooledFilenameSize = 512;
+static const size_t kMaxPooledFrameData = 256;
+
+static std::mutex               _gFrameDataPoolMutex;
+static std::vector<FrameData*>  _gFrameDataPool;
+
+// Per-StreamData state of the frame delivery path. Params it needs with every
+// frame are read through handles resolved once. The recording filename frames
+// are attributed to only changes when fileRecorderSync moves on to the next
+// file, so it's only copied out when the file generation changes.
+typedef struct proc_frame_state {
+    stream_param_handle*    fileGeneration;
+    stream_param_handle*    filename;
+    stream_param_handle*    framesQueued;
+    int                     generation;
+    std::string             currentFilename;
+    int                     largeFramesWanted;  // as of the last videolibutils_large_frame_demand_changed
+} proc_frame_state;
+
+static std::mutex                                       _gProcStateMutex;
+static std::map<const StreamData*, proc_frame_state>    _gProcState;
+
+//-----------------------------------------------------------------------------
+static proc_frame_state&    _get_proc_frame_state( StreamData* data )
+{
+    std::map<const StreamData*, proc_frame_state>::iterator it = _gProcState.find(data);
+    if ( it == _gProcState.end() ) {
+        proc_frame_state st;
+        st.fileGeneration = NULL;
+        st.filename = NULL;
+        st.framesQueued = NULL;
+        st.generation = -1;
+        st.largeFramesWanted = 0;
+        it = _gProcState.insert(std::make_pair(data, st)).first;
+    }
+    return it->second;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////
 SVVIDEOLIB_API
 int  flush_output(StreamData* data)
@@ -63,6 +111,40 @@ int  flush_output(StreamData* data)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////////////////////
+static
+FrameData*  videolibutils_alloc_frame_data( size_t filenameSize )
+{
+    if ( filenameSize > kPooledFilenameSize ) {
+        return (FrameData*)malloc(sizeof(FrameData)+filenameSize);
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(_gFrameDataPoolMutex);
+        if ( !_gFrameDataPool.empty() ) {
+            FrameData* res = _gFrameDataPool.back();
+            _gFrameDataPool.pop_back();
+            return res;
+        }
+    }
+    return (FrameData*)malloc(sizeof(FrameData)+kPooledFilenameSize);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+static
+void        videolibutils_release_frame_data( FrameData* data )
+{
+    // the size of the allocation can be told from the filename it was made for
+    if ( data->filename == NULL || strlen(data->filename) < kPooledFilenameSize ) {
+        std::lock_guard<std::mutex> guard(_gFrameDataPoolMutex);
+        if ( _gFrameDataPool.size() < kMaxPooledFrameData ) {
+            _gFrameDataPool.push_back(data);
+            return;
+        }
+    }
+    free(data);
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////
 static
 FrameData*  videolibutils_prepare_proc_frame_base( const char* filename,
@@ -70,17 +152,19 @@ FrameData*  videolibutils_prepare_proc_frame_base( const char* filename,
                                                 frame_obj* srcFrame )
 {
     FrameData*      result;
-    frame_api_t*    frameAPI = frame_get_api(srcFrame);
     size_t          filenameSize = 0;
-    int64_t         frameTs = frameAPI->get_pts(srcFrame);
-    size_t          frameW = frameAPI->get_width(srcFrame);
-    size_t          frameH = frameAPI->get_height(srcFrame);
+    int64_t         frameTs = frame_props_pts(srcFrame);
+    size_t          frameW = frame_props_width(srcFrame);
+    size_t          frameH = frame_props_height(srcFrame);
 
     if ( filename != NULL ) {
         filenameSize = strlen(filename)+1;
     }
 
-    result = (FrameData*)malloc(sizeof(FrameData)+filenameSize);
+    result = videolibutils_alloc_frame_data(filenameSize);
+    if ( result == NULL ) {
+        return NULL;
+    }
 
     if ( filenameSize ) {
         // Set the filename the frame was stored in
@@ -93,7 +177,7 @@ FrameData*  videolibutils_prepare_proc_frame_base( const char* filename,
     }
 
     result->frame      = srcFrame;
-    result->procBuffer = (uint8_t*)frameAPI->get_data(srcFrame);
+    result->procBuffer = (uint8_t*)frame_props_data(srcFrame);
     result->procWidth  = frameW;
     result->procHeight = frameH;
     result->isRunning = isRunning;
@@ -102,25 +186,57 @@ FrameData*  videolibutils_prepare_proc_frame_base( const char* filename,
     return result;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////
+// FrameData for a frame that didn't come out of a StreamData's graph, such as
+// one handed over by a camera worker process; takes over the caller's reference
+extern "C"
+FrameData*  videolibutils_wrap_proc_frame( const char* filename,
+                                           int isRunning,
+                                           int wasResized,
+                                           frame_obj* srcFrame )
+{
+    FrameData* res = videolibutils_prepare_proc_frame_base(filename, isRunning, srcFrame);
+    if (res) {
+        res->wasResized = wasResized;
+    }
+    return res;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////
 extern "C"
 FrameData*  videolibutils_prepare_proc_frame( StreamData* data,
                                               frame_obj* srcFrame )
 {
-    const char*     filename = NULL;
-    size_t          size = sizeof(filename);
+    if ( !data->shouldRecord ) {
+        FrameData* res = videolibutils_prepare_proc_frame_base(NULL,
+                                            data->isRunning, srcFrame);
+        if (res) {
+            res->wasResized = data->inputData2.hasResize;
+        }
+        return res;
+    }
+
+    std::lock_guard<std::mutex> guard(_gProcStateMutex);
+    proc_frame_state& st = _get_proc_frame_state(data);
+    if ( st.filename == NULL ) {
+        st.fileGeneration = stream_param_resolve(&data->inputData2.streamCtx, "fileRecorderSync.fileGeneration");
+        st.filename = stream_param_resolve(&data->inputData2.streamCtx, "fileRecorderSync.filename");
+    }
 
-    if ( data->shouldRecord ) {
-        stream_obj*   ctx = data->inputData2.streamCtx;
-        stream_api_t* api = stream_get_api(ctx);
-        if ( api->get_param(ctx, "fileRecorderSync.filename", &filename, &size) < 0 ||
+    int generation = -1;
+    if ( stream_param_get_int(st.fileGeneration, &generation) < 0 ||
+         generation != st.generation ) {
+        void* filename = NULL;
+        if ( stream_param_get_ptr(st.filename, &filename) < 0 ||
              filename == NULL ) {
             log_err(data->logFn, "Failed to determine filename for frame");
             return NULL;
         }
+        st.currentFilename = (const char*)filename;
+        st.generation = generation;
     }
 
-    FrameData* res = videolibutils_prepare_proc_frame_base(filename,
+    FrameData* res = videolibutils_prepare_proc_frame_base(st.currentFilename.c_str(),
                                         data->isRunning, srcFrame);
     if (res) {
         res->wasResized = data->inputData2.hasResize;
@@ -139,11 +255,77 @@ void            videolibapi_free_proc_frame( FrameData** dataPtr )
         if (data->frame) {
             frame_unref(&data->frame);
         }
-        free(data);
+        videolibutils_release_frame_data(data);
+        *dataPtr = NULL;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+// Number of video frames queued at tc_edge, or -1 if there's no such element.
+// Called with graphMutex held.
+extern "C"
+int         videolibutils_get_queued_frame_count( StreamData* data )
+{
+    std::lock_guard<std::mutex> guard(_gProcStateMutex);
+    proc_frame_state& st = _get_proc_frame_state(data);
+    if ( st.framesQueued == NULL ) {
+        st.framesQueued = stream_param_resolve(&data->inputData2.streamCtx, "tc_edge.framesQueued");
+    }
+
+    int queued = -1;
+    if ( stream_param_get_int(st.framesQueued, &queued) < 0 ) {
+        return -1;
+    }
+    return queued;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+extern "C"
+void        videolibutils_release_proc_frame_state( StreamData* data )
+{
+    std::lock_guard<std::mutex> guard(_gProcStateMutex);
+    std::map<const StreamData*, proc_frame_state>::iterator it = _gProcState.find(data);
+    if ( it != _gProcState.end() ) {
+        stream_param_release(&it->second.fileGeneration);
+        stream_param_release(&it->second.filename);
+        stream_param_release(&it->second.framesQueued);
+        _gProcState.erase(it);
     }
 }
 
 
+// Large frames don't know which stream they came from, so the demand for them
+// is tracked for the process as a whole; it's considered gone once no large
+// frame had been asked for in this long
+static const INT64_T            kLargeFrameDemandMs = 10000;
+static std::atomic<INT64_T>     _gLargeFrameRequested(0);
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+// 1 if someone had been reading large frames recently, 0 otherwise
+extern "C"
+int         videolibutils_large_frames_wanted( )
+{
+    INT64_T requested = _gLargeFrameRequested.load(std::memory_order_relaxed);
+    return requested != 0 &&
+           sv_time_get_current_epoch_time() - requested < kLargeFrameDemandMs;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////
+// Returns 1 if the demand for large frames had changed since the last time this
+// was called for the stream
+extern "C"
+int         videolibutils_large_frame_demand_changed( StreamData* data )
+{
+    int wanted = videolibutils_large_frames_wanted();
+    std::lock_guard<std::mutex> guard(_gProcStateMutex);
+    proc_frame_state& st = _get_proc_frame_state(data);
+    if ( st.largeFramesWanted == wanted ) {
+        return 0;
+    }
+    st.largeFramesWanted = wanted;
+    return 1;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////
 // Get the frame prior to resize, or NULL if doesn't exist
 extern "C"
@@ -152,6 +334,7 @@ FrameData* get_large_frame(FrameData* smallFrame)
     if (smallFrame == NULL) {
         return NULL;
     }
+    _gLargeFrameRequested.store(sv_time_get_current_epoch_time(), std::memory_order_relaxed);
     frame_obj* srcFrameSmall = smallFrame->frame;
     frame_api* fapi = frame_get_api(srcFrameSmall);
     if ( fapi == NULL ) {
@@ -176,7 +359,7 @@ FrameData*  videolibutils_get_empty_proc_frame( )
 {
     // If the stream is no longer being read, we need to return a
     // FrameData structure with isRunning = 0 to convey this.
-    FrameData* frameData = (FrameData*)malloc(sizeof(FrameData));
+    FrameData* frameData = videolibutils_alloc_frame_data(0);
     if (!frameData)
         return NULL;
     frameData->procBuffer = NULL;
@@ -324,23 +507,36 @@ int videolibapi_extradata_to_spspps(uint8_t *extradata,
                                 uint8_t** pps,
                                 size_t* ppsSize )
 {
-    int res;
+    int res = 0;
     uint8_t *data = extradata;
     int dataSize = extradataSize;
+    uint8_t *nal;
+    size_t nalSize;
 
     if ( extradata[0] == 1 ) {
         if ( ff_avc_write_annexb_extradata(extradata, &data, &dataSize) )
             return -1;
     }
 
-
-    if ( videolibapi_extract_nalu(data, dataSize, kNALPPS, pps, ppsSize, NULL, NULL ) < 0 )
-        res = -1;
-    else
-    if ( videolibapi_extract_nalu(data, dataSize, kNALSPS, sps, spsSize, NULL, NULL ) < 0 )
-        res = -1;
-    else
-        res = 0;
+    // the caller owns what we return, but data may not outlive this call:
+    // copy the two units found, and nothing else
+    if ( (nal = videolibapi_find_nalu(data, dataSize, kNALPPS, &nalSize, NULL, NULL)) != NULL ) {
+        if ( (*pps = (uint8_t*)malloc(nalSize)) == NULL ) {
+            res = -1;
+        } else {
+            memcpy(*pps, nal, nalSize);
+            *ppsSize = nalSize;
+        }
+    }
+    if ( res == 0 &&
+         (nal = videolibapi_find_nalu(data, dataSize, kNALSPS, &nalSize, NULL, NULL)) != NULL ) {
+        if ( (*sps = (uint8_t*)malloc(nalSize)) == NULL ) {
+            res = -1;
+        } else {
+            memcpy(*sps, nal, nalSize);
+            *spsSize = nalSize;
+        }
+    }
     if ( data != extradata )
         sv_freep(&data);
     if ( res < 0 ) {
@@ -37,8 +37,13 @@
 
 extern "C" {
 #include "videolib.h"
+stream_api_t* get_packet_ring_api();
 };
 #include "videolibUtils.h"
+#include "packet_ring.h"
+#include "llhls_writer.h"
+#include "hls_store.h"
+#include "decode_demand.h"
 
 #include <stdarg.h>
 #include <stdio.h>
@@ -50,6 +55,10 @@ extern "C" {
 #include <assert.h>
 #include <ctype.h>
 
+#include <map>
+#include <mutex>
+#include <string>
+
 
 
 
@@ -70,7 +79,12 @@ static const HLSProfile _kHLSProfiles[] = {
 static const int _kProfilesCount = sizeof(_kHLSProfiles)/sizeof(HLSProfile);
 
 static const int _kBufferDurationWhenRunning = 1000;
+// low-latency HLS (SV_HLS_LOW_LATENCY=1) can't afford to sit on a second's worth
+static const int _kBufferDurationWhenRunningLowLatency = 300;
 static const int _kBufferDurationWhenPaused  = 10000;
+// bounds for the adaptive jitter buffer, enabled with SV_HLS_ADAPTIVE_JITTER=1
+static const int _kAdaptiveBufferDurationMin = 200;
+static const int _kAdaptiveBufferDurationMax = 5000;
 static const int _kOne=1;
 static const int _kTwo=2;
 static const int _kJumpstartFps=1;
@@ -81,7 +95,33 @@ static const int _kCodecH264=streamH264;
 static const int _kCodecAAC=streamAAC;
 static const int _kCodecLinear=streamLinear;
 static const int _kFPS10=10;
+// let the resize filters slice-thread large frames (e.g. 4K sources)
+static const int _kAutoSlices=-1;
 static const int _kDummyBitrate = 5000000;
+static const char* _kLadderName = "hlsLadder";
+static const char* _kLadderFpsName = "hlsLadderFps";
+static const char* _kLadderResizeName = "hlsLadderResize";
+static const char* _kLadderTailName = "hlsLadderTail";
+// matches the recorder's hls_time for live streams
+static const int _kSegmentDurationMs = 2000;
+
+
+//-----------------------------------------------------------------------------
+// Profiles enabled on demand are kept paused at their splitter until someone
+// reads from them, and paused again once nobody has for idleTimeoutMs.
+// StreamData isn't defined in this part of the tree, so they're kept per owner.
+typedef struct hls_demand {
+    std::string     path;
+    int             timestampFlags;
+    int64_t         startIndex;
+    int             idleTimeoutMs;
+    bool            active;
+    UINT64_T        lastAccess;
+    UINT64_T        activeSince;
+} hls_demand;
+
+static std::mutex                                       _gDemandMutex;
+static std::map<const void*, std::map<int, hls_demand> > _gDemand;
 
 
 //-----------------------------------------------------------------------------
@@ -318,6 +358,155 @@ static const char* _uniqf(char* buffer, const char* name, int id)
     return buffer;
 }
 
+//-----------------------------------------------------------------------------
+// Remuxed profiles all want the same packets retained while paused; they get
+// them from one ring per camera, placed right after the demux. Called with the
+// graph mutex held.
+static packet_ring* _get_packet_ring(StreamData* data)
+{
+    stream_api_t*   api = stream_get_api(data->inputData2.streamCtx);
+    packet_ring*    ring = NULL;
+    size_t          size = sizeof(packet_ring*);
+
+    if ( api->find_element(data->inputData2.streamCtx, "packetRing") == NULL ) {
+        stream_obj* ringObj = get_packet_ring_api()->create("packetRing");
+        if ( api->insert_element(&data->inputData2.streamCtx,
+                                &api,
+                                "demux",
+                                ringObj,
+                                svFlagStreamInitialized | svFlagStreamOpen) < 0 ) {
+            log_warn(data->logFn, "Failed to insert packet ring; HLS profiles will buffer on their own");
+            return NULL;
+        }
+    }
+    if ( api->get_param(data->inputData2.streamCtx, "packetRing.ring", &ring, &size) < 0 ) {
+        return NULL;
+    }
+    return ring;
+}
+
+//-----------------------------------------------------------------------------
+// With SV_HLS_LADDER=1, transcoded profiles don't each tap the decoder. They
+// hang off one shared branch, which limits the frame rate to that of the
+// fastest profile and scales down to the largest one; each profile's own
+// resize then starts from that output (and the largest passes straight
+// through). Returns the branch's subgraph, creating it if needed, or NULL if
+// profiles should be attached to the decoder. Called with the graph mutex held.
+static stream_obj* _get_ladder(StreamData* data)
+{
+    stream_api_t*   api = stream_get_api(data->inputData2.streamCtx);
+    stream_obj*     ladder = NULL;
+    stream_api_t*   ladderApi = get_default_stream_api();
+    size_t          size = sizeof(stream_obj*);
+    int             pixfmt = pfmtRGB24;
+
+    if ( api->find_element(data->inputData2.streamCtx, _kLadderName) == NULL ) {
+        APPEND_FILTER(ladderApi, ladder, limiter_filter_api, _kLadderFpsName);
+        CONFIG_FILTER(ladder, _kLadderFpsName, data->logFn, Cleanup,
+                     "variable", &_kOne,
+                     "useWallClock", &_kZero,
+                     "useSecondIntervals", &_kOne,
+                     "fps", &_kJumpstartFps,
+                     NULL );
+        // sized by _update_ladder, once there's a profile to size it for
+        int autoRotate = sv_get_int_env_var("SV_AUTO_ROTATE", 0);
+        APPEND_FILTER(ladderApi, ladder, resize_factory_api, _kLadderResizeName);
+        CONFIG_FILTER(ladder, _kLadderResizeName, data->logFn, Cleanup,
+                     "pixfmt", &pixfmt,
+                     "slices", &_kAutoSlices,
+                     "autoRotate", &autoRotate,
+                     NULL );
+        // profiles are inserted after the resize; with a fixed tail, that
+        // never replaces the head of the subgraph the splitter holds on to
+        APPEND_FILTER(ladderApi, ladder, splitter_api, _kLadderTailName);
+
+        INSERT_FILTER_F(api, data->inputData2.streamCtx, splitter_api, _kLadderName,
+                        "decoder", svFlagStreamInitialized | svFlagStreamOpen)
+        CONFIG_FILTER(data->inputData2.streamCtx, _kLadderName, data->logFn, Cleanup,
+                     "subgraph", ladder,
+                     NULL );
+        stream_unref(&ladder);
+        log_info(data->logFn, "Created shared HLS transcoding branch");
+    }
+
+    if ( api->get_param(data->inputData2.streamCtx, "hlsLadder.subgraph", &ladder, &size) < 0 ) {
+        log_err(data->logFn, "Failed to query for shared HLS transcoding branch");
+        return NULL;
+    }
+    return ladder;
+
+Cleanup:
+    log_warn(data->logFn, "Failed to create shared HLS transcoding branch; profiles will scale on their own");
+    stream_unref(&ladder);
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Keeps the shared branch at the rate of its fastest profile (paused ones run
+// at the jumpstart rate), and, if resize is set, at the size of its largest.
+// Called with the graph mutex held.
+static void _update_ladder(StreamData* data, bool resize)
+{
+    char            name[256];
+    stream_obj*     ladder = NULL;
+    stream_api_t*   api = stream_get_api(data->inputData2.streamCtx);
+    size_t          size = sizeof(stream_obj*);
+    int             fps = 0, profileFps;
+    int             dims[2] = { 0, 0 };
+
+    if ( api->find_element(data->inputData2.streamCtx, _kLadderName) == NULL ||
+         api->get_param(data->inputData2.streamCtx, "hlsLadder.subgraph", &ladder, &size) < 0 ||
+         ladder == NULL ) {
+        return;
+    }
+
+    stream_api_t*   ladderApi = stream_get_api(ladder);
+    for (int nI=1; nI<=data->hlsProfilesCount; nI++) {
+        HLSProfile* profile = &data->hlsProfiles[nI-1];
+        sprintf(name, "hls%d", nI);
+        if ( ladderApi->find_element(ladder, name) == NULL ) {
+            continue;
+        }
+        sprintf(name, "hls%d.subgraph.hls%dfpslimit.desiredFps", nI, nI);
+        size = sizeof(int);
+        if ( ladderApi->get_param(ladder, name, &profileFps, &size) >= 0 && profileFps > fps ) {
+            fps = profileFps;
+        }
+        if ( profile->height > dims[1] ) {
+            dims[0] = profile->width;
+            dims[1] = profile->height;
+        }
+    }
+
+    log_dbg(data->logFn, "Shared HLS transcoding branch: fps=%d size=%dx%d", fps, dims[0], dims[1]);
+    if ( fps > 0 ) {
+        ladderApi->set_param(ladder, "hlsLadderFps.fps", &fps);
+    }
+    if ( resize && dims[1] > 0 ) {
+        ladderApi->set_param(ladder, "hlsLadderResize.updateSize", dims);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Returns the graph the splitter of a profile lives in: the top one, or the
+// shared branch. Called with the graph mutex held.
+static stream_obj* _get_profile_parent(StreamData* data, int profileId)
+{
+    char            name[32];
+    stream_obj*     ladder = NULL;
+    stream_api_t*   api = stream_get_api(data->inputData2.streamCtx);
+    size_t          size = sizeof(stream_obj*);
+
+    sprintf(name, "hls%d", profileId);
+    if ( api->find_element(data->inputData2.streamCtx, name) == NULL &&
+         api->get_param(data->inputData2.streamCtx, "hlsLadder.subgraph", &ladder, &size) >= 0 &&
+         ladder != NULL &&
+         stream_get_api(ladder)->find_element(ladder, name) != NULL ) {
+        return ladder;
+    }
+    return data->inputData2.streamCtx;
+}
+
 //-----------------------------------------------------------------------------
 static
 int enable_live_stream_base(StreamData* data, int profileId, const char* path,
@@ -349,8 +538,11 @@ int enable_live_stream_base(StreamData* data, int profileId, const char* path,
 
     stream_obj*     ctx     = data->inputData2.streamCtx;
     stream_api_t*   api     = stream_get_api(ctx);
-    stream_obj*     hlsObj  = api->find_element(ctx, _U("hls%d"));
+    stream_obj*     parent  = _get_profile_parent(data, profileId);
+    stream_obj*     hlsObj  = stream_get_api(parent)->find_element(parent, _U("hls%d"));
     stream_api_t*   hlsObjApi = stream_get_api(hlsObj);
+    stream_obj*     ladder  = NULL;
+    stream_api_t*   ladderApi = NULL;
     stream_obj*     subgraph = NULL;
     stream_api_t*   subgraphApi = get_default_stream_api();
     stream_obj*     recSubgraph = NULL;
@@ -362,6 +554,8 @@ int enable_live_stream_base(StreamData* data, int profileId, const char* path,
     bool            hasDecoder = (api->find_element(ctx, "decoder") != NULL);
     bool            needsEncoder = (!profile->remux || !hasDecoder);
     int             fps =  paused ? _kJumpstartFps : profile->fps;
+    int             lowLatency = sv_get_int_env_var("SV_HLS_LOW_LATENCY", 0);
+    int             inMemory = sv_get_int_env_var("SV_HLS_IN_MEMORY", 0);
 
     if ( !hlsObj ) {
         if ( needsEncoder ) {
@@ -375,30 +569,65 @@ int enable_live_stream_base(StreamData* data, int profileId, const char* path,
                          NULL );
         }
 
+        // a remux profile sees the same packets as the ring; rather than
+        // keep its own copy while paused, it replays them from the ring
+        packet_ring* ring = needsEncoder ? NULL : _get_packet_ring(data);
+
         name = _U("hls%djitbuf");
         APPEND_FILTER(subgraphApi, subgraph, jitbuf_stream_api, name);
         CONFIG_FILTER(subgraph, name, data->logFn, Cleanup,
-                        "bufferDuration", &_kBufferDurationWhenRunning,
+                        "bufferDuration", lowLatency ? &_kBufferDurationWhenRunningLowLatency
+                                                     : &_kBufferDurationWhenRunning,
                         "jumpstartWithPastFrames", &_kOne,
                         "jumpstartFps", &_kJumpstartFps,
                         "targetFps", &profile->fps,
                         "bufferDurationWhenPaused", &_kBufferDurationWhenPaused,
                         "paused", &paused,
                         NULL);
+        if ( ring != NULL ) {
+            CONFIG_FILTER(subgraph, name, data->logFn, Cleanup,
+                        "ring", ring,
+                        NULL);
+        }
+        if ( sv_get_int_env_var("SV_HLS_ADAPTIVE_JITTER", 0) ) {
+            CONFIG_FILTER(subgraph, name, data->logFn, Cleanup,
+                        "adaptive", &_kOne,
+                        "bufferDurationMin", &_kAdaptiveBufferDurationMin,
+                        "bufferDurationMax", &_kAdaptiveBufferDurationMax,
+                        NULL);
+        }
 
         name = _U("hls%drecordSubgraph");
         APPEND_FILTER(subgraphApi, subgraph, splitter_api, name);
 
         insertBefore = ( needsEncoder && hasDecoder ) ? "decoder" : "demux";
 
+        if ( needsEncoder && hasDecoder && sv_get_int_env_var("SV_HLS_LADDER", 0) ) {
+            ladder = _get_ladder(data);
+            ladderApi = stream_get_api(ladder);
+        }
+
         name = _U("hls%d");
-        INSERT_FILTER_F(api, data->inputData2.streamCtx, splitter_api, name,
-                        insertBefore, svFlagStreamInitialized | svFlagStreamOpen)
-        CONFIG_FILTER(data->inputData2.streamCtx, name, data->logFn, Cleanup,
-                     "subgraph", subgraph,
-                     NULL );
+        if ( ladder != NULL ) {
+            INSERT_FILTER_F(ladderApi, ladder, splitter_api, name,
+                            _kLadderResizeName, svFlagStreamInitialized | svFlagStreamOpen)
+            CONFIG_FILTER(ladder, name, data->logFn, Cleanup,
+                         "subgraph", subgraph,
+                         "fps", needsEncoder ? &fps : &_kZero,
+                         NULL );
 
-        hlsObj = api->find_element(data->inputData2.streamCtx, name);
+            hlsObj = ladderApi->find_element(ladder, name);
+            _update_ladder(data, true);
+        } else {
+            INSERT_FILTER_F(api, data->inputData2.streamCtx, splitter_api, name,
+                            insertBefore, svFlagStreamInitialized | svFlagStreamOpen)
+            CONFIG_FILTER(data->inputData2.streamCtx, name, data->logFn, Cleanup,
+                         "subgraph", subgraph,
+                         "fps", needsEncoder ? &fps : &_kZero,
+                         NULL );
+
+            hlsObj = api->find_element(data->inputData2.streamCtx, name);
+        }
         hlsObjApi = stream_get_api(hlsObj);
     } else {
         if ( needsEncoder ) {
@@ -406,6 +635,9 @@ int enable_live_stream_base(StreamData* data, int profileId, const char* path,
             CONFIG_FILTER(hlsObj, b, data->logFn, Cleanup,
                          "fps", &fps,
                          NULL );
+            // frames the limiter is going to drop needn't be queued for it
+            hlsObjApi->set_param(hlsObj, "fps", &fps);
+            _update_ladder(data, false);
         }
     }
 
@@ -430,6 +662,8 @@ int enable_live_stream_base(StreamData* data, int profileId, const char* path,
 
     if ( needsEncoder ) {
         int pixfmt = pfmtRGB24;
+        // behind the ladder's resize, frames are already upright
+        int autoRotate = sv_get_int_env_var("SV_AUTO_ROTATE", 0);
 
         name = _U("hls%dresize");
         APPEND_FILTER(recSubgraphApi, recSubgraph, resize_factory_api, name);
@@ -437,6 +671,8 @@ int enable_live_stream_base(StreamData* data, int profileId, const char* path,
                     "height", &profile->height,
                     "width", &profile->width,
                     "pixfmt", &pixfmt,
+                    "slices", &_kAutoSlices,
+                    "autoRotate", &autoRotate,
                     NULL);
 
         recSubgraphApi = _enable_timestamp(&recSubgraph, 0, timestampFlags, 0, _U("ts%d"), NULL, data->logFn);
@@ -451,6 +687,8 @@ int enable_live_stream_base(StreamData* data, int profileId, const char* path,
                     "max_bitrate", &profile->bitrate,
                     "h264profile", &profile->h264profile,
                     "h264level", &profile->h264level,
+                    "pooled", sv_get_int_env_var("SV_ENCODER_POOL", 0) ? &_kOne : &_kZero,
+                    "hwEncoder", sv_get_int_env_var("SV_HW_ENCODE", 0) ? &_kOne : &_kZero,
                     NULL);
 
         // encoder may affect ordering of the A/V frames ... and iOS doesn't like it
@@ -467,6 +705,17 @@ int enable_live_stream_base(StreamData* data, int profileId, const char* path,
                     "audioOn", &data->enableAudioRecording,
                     "hlsStartIndex", &startIndex,
                     NULL);
+    if ( lowLatency ) {
+        CONFIG_FILTER(recSubgraph, name, data->logFn, Cleanup,
+                    "hlsLowLatency", &_kOne,
+                    NULL);
+    }
+    if ( inMemory ) {
+        // served through get_live_stream_file, nothing goes to disk
+        CONFIG_FILTER(recSubgraph, name, data->logFn, Cleanup,
+                    "hlsInMemory", &_kOne,
+                    NULL);
+    }
 
     if ( hlsObjApi->set_param(hlsObj, _U("subgraph.hls%drecordSubgraph.subgraph"), recSubgraph) < 0 ||
          hlsObjApi->set_param(hlsObj, _U("subgraph.hls%djitbuf.paused"), &_kZero ) ) {
@@ -480,19 +729,172 @@ Cleanup:
     sv_mutex_exit(data->graphMutex);
     stream_unref(&subgraph);
     stream_unref(&recSubgraph);
+    videolib_update_decode_demand(data);
 
     return res;
 #undef _U
 }
 
+//-----------------------------------------------------------------------------
+static void _forget_live_stream_demand(StreamData* data, int profileId)
+{
+    std::lock_guard<std::mutex> guard(_gDemandMutex);
+    std::map<const void*, std::map<int, hls_demand> >::iterator it = _gDemand.find(data);
+    if ( it != _gDemand.end() ) {
+        it->second.erase(profileId);
+        if ( it->second.empty() ) {
+            _gDemand.erase(it);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+static void _pause_live_stream(StreamData* data, int profileId)
+{
+    char paramName[1024];
+
+    sv_mutex_enter(data->graphMutex);
+    stream_obj*     ctx     = _get_profile_parent(data, profileId);
+    stream_api_t*   api     = stream_get_api(ctx);
+
+    sprintf(paramName, "hls%d.subgraph.hls%drecordSubgraph.subgraph", profileId, profileId);
+    api->set_param(ctx, paramName, NULL);
+    sprintf(paramName, "hls%d.subgraph.hls%djitbuf.paused", profileId, profileId );
+    api->set_param(ctx, paramName, &_kOne );
+    sprintf( paramName, "hls%d.subgraph.hls%dfpslimit.fps", profileId, profileId );
+    if ( api->set_param(ctx, paramName, &_kJumpstartFps ) >= 0 ) {
+        sprintf( paramName, "hls%d.fps", profileId );
+        api->set_param(ctx, paramName, &_kJumpstartFps );
+    }
+    _update_ladder(data, false);
+
+    sv_mutex_exit(data->graphMutex);
+}
+
 //-----------------------------------------------------------------------------
 SVVIDEOLIB_API
 int enable_live_stream(StreamData* data, int profileId, const char* path,
                          int timestampFlags, int64_t startIndex )
 {
+    _forget_live_stream_demand(data, profileId);
     return enable_live_stream_base(data, profileId, path, timestampFlags, 0, startIndex );
 }
 
+//-----------------------------------------------------------------------------
+// Like enable_live_stream, but the profile doesn't resize or encode anything
+// until touch_live_stream reports a read of its playlist or segments, and
+// goes back to that state idleTimeoutMs after the last one.
+SVVIDEOLIB_API
+int enable_live_stream_on_demand(StreamData* data, int profileId, const char* path,
+                         int timestampFlags, int64_t startIndex, int idleTimeoutMs )
+{
+    if ( data == NULL || path == NULL || profileId < 1 ) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> guard(_gDemandMutex);
+    std::map<int, hls_demand>& profiles = _gDemand[data];
+    std::map<int, hls_demand>::iterator it = profiles.find(profileId);
+    if ( it != profiles.end() && it->second.active ) {
+        // already running; only the timeout may have changed
+        it->second.idleTimeoutMs = idleTimeoutMs;
+        return 0;
+    }
+
+    if ( enable_live_stream_base(data, profileId, NULL, 0, 1, 0 ) < 0 ) {
+        profiles.erase(profileId);
+        if ( profiles.empty() ) {
+            _gDemand.erase(data);
+        }
+        return -1;
+    }
+
+    hls_demand& demand = profiles[profileId];
+    demand.path = path;
+    demand.timestampFlags = timestampFlags;
+    demand.startIndex = startIndex;
+    demand.idleTimeoutMs = idleTimeoutMs;
+    demand.active = false;
+    demand.lastAccess = 0;
+    demand.activeSince = 0;
+    log_info(data->logFn, "HLS stream %d enabled on demand, idleTimeout=%dms",
+                        profileId, idleTimeoutMs);
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// To be called whenever the playlist or a segment of an on-demand profile is
+// read. Starts it up if it had been idle; the jitter buffer's paused history
+// lets the first segment be cut without waiting for a new one's worth of frames.
+SVVIDEOLIB_API
+int touch_live_stream(StreamData* data, int profileId)
+{
+    if ( data == NULL ) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> guard(_gDemandMutex);
+    std::map<const void*, std::map<int, hls_demand> >::iterator it = _gDemand.find(data);
+    if ( it == _gDemand.end() || it->second.find(profileId) == it->second.end() ) {
+        // not on demand -- always running, or not enabled at all
+        return 0;
+    }
+
+    hls_demand& demand = it->second[profileId];
+    demand.lastAccess = sv_time_get_current_epoch_time();
+    if ( demand.active ) {
+        return 0;
+    }
+
+    if ( enable_live_stream_base(data, profileId, demand.path.c_str(),
+                                 demand.timestampFlags, 0, demand.startIndex ) < 0 ) {
+        log_err(data->logFn, "Failed to start HLS stream %d on demand", profileId);
+        return -1;
+    }
+    demand.active = true;
+    demand.activeSince = demand.lastAccess;
+    log_info(data->logFn, "HLS stream %d started on demand", profileId);
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Pauses on-demand profiles nobody has read from in a while. Called by the
+// reader, without any locks held.
+extern "C"
+void _check_live_stream_demand(StreamData* data)
+{
+    std::lock_guard<std::mutex> guard(_gDemandMutex);
+    std::map<const void*, std::map<int, hls_demand> >::iterator it = _gDemand.find(data);
+    if ( it == _gDemand.end() ) {
+        return;
+    }
+
+    UINT64_T now = sv_time_get_current_epoch_time();
+    for (std::map<int, hls_demand>::iterator pit = it->second.begin(); pit != it->second.end(); pit++) {
+        hls_demand& demand = pit->second;
+        if ( !demand.active ||
+             demand.idleTimeoutMs <= 0 ||
+             now - demand.lastAccess < (UINT64_T)demand.idleTimeoutMs ) {
+            continue;
+        }
+        _pause_live_stream(data, pit->first);
+        demand.active = false;
+        // the recorder starts numbering from scratch when restarted; make sure
+        // media sequence numbers keep going up for players reloading the playlist
+        demand.startIndex += (now - demand.activeSince)/_kSegmentDurationMs + 2;
+        log_info(data->logFn, "HLS stream %d idle for %dms, pausing; will resume at index %d",
+                        pit->first, (int)(now - demand.lastAccess), (int)demand.startIndex);
+    }
+}
+
+//-----------------------------------------------------------------------------
+extern "C"
+void _release_live_stream_demand(StreamData* data)
+{
+    std::lock_guard<std::mutex> guard(_gDemandMutex);
+    _gDemand.erase(data);
+}
+
 
 //-----------------------------------------------------------------------------
 SVVIDEOLIB_API
@@ -504,28 +906,47 @@ int prepare_live_stream(StreamData* data, int profileId )
 
 
 //-----------------------------------------------------------------------------
+// For blocking playlist reload (_HLS_msn/_HLS_part) of low-latency streams
 SVVIDEOLIB_API
-void disable_live_stream(StreamData* data, int profileId )
+int wait_live_stream_part(const char* path, int64_t msn, int part, int timeoutMs)
 {
-    char paramName[1024];
+    if ( path == NULL ) {
+        return -1;
+    }
+    return llhls_wait(path, msn, part, timeoutMs);
+}
 
+//-----------------------------------------------------------------------------
+// For streams kept in memory (SV_HLS_IN_MEMORY): the current contents of the
+// playlist or segment at path, as it would've been on disk. The data stays
+// valid until the returned handle is released; NULL if there's no such file.
+SVVIDEOLIB_API
+void* get_live_stream_file(const char* path, const uint8_t** data, size_t* size)
+{
+    if ( path == NULL || data == NULL || size == NULL ) {
+        return NULL;
+    }
+    return hls_store_get(path, data, size);
+}
+
+//-----------------------------------------------------------------------------
+SVVIDEOLIB_API
+void release_live_stream_file(void** handle)
+{
+    if ( handle != NULL ) {
+        hls_store_release((hls_store_buffer**)handle);
+    }
+}
+
+//-----------------------------------------------------------------------------
+SVVIDEOLIB_API
+void disable_live_stream(StreamData* data, int profileId )
+{
     if ( data == NULL ||
          profileId > data->hlsProfilesCount ||
          profileId < 1 )
         return;
 
-    sv_mutex_enter(data->graphMutex);
-    stream_obj*     ctx     = data->inputData2.streamCtx;
-    stream_api_t*   api     = stream_get_api(ctx);
-
-    sprintf(paramName, "hls%d.subgraph.hls%drecordSubgraph.subgraph", profileId, profileId);
-    api->set_param(ctx, paramName, NULL);
-    sprintf(paramName, "hls%d.subgraph.hls%djitbuf.paused", profileId, profileId );
-    api->set_param(ctx, paramName, &_kOne );
-    sprintf( paramName, "hls%d.subgraph.hls%dfpslimit.fps", profileId, profileId );
-    api->set_param(ctx, paramName, &_kJumpstartFps );
-
-    sv_mutex_exit(data->graphMutex);
-
+    _forget_live_stream_demand(data, profileId);
+    _pause_live_stream(data, profileId);
 }
-
@@ -0,0 +1,366 @@
+/*****************************************************************************
+ *
+ * worker_ring.cpp
+ *   Shared-memory ring handing frames from a camera worker process to the host.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#undef SV_MODULE_VAR
+#define SV_MODULE_VAR ring
+#define SV_MODULE_ID "WORKERRING"
+#include "sv_module_def.hpp"
+
+#include "streamprv.h"
+#include "sv_internal.h"
+#include "frame_basic.h"
+#include "worker_ring.h"
+
+#include <atomic>
+#include <string.h>
+
+extern "C" FrameData* videolibutils_wrap_proc_frame(const char* filename,
+                                                    int isRunning,
+                                                    int wasResized,
+                                                    frame_obj* srcFrame);
+
+#define WORKER_RING_MAGIC 0x1931
+
+//-----------------------------------------------------------------------------
+// Header, followed by slotCount slots of slotSize bytes each, every one a
+// worker_ring_slot followed by the pixels. writeIndex and readIndex count the
+// frames published and consumed since the start; the slot of frame n is
+// n % slotCount. magic is written last by the creator, so an attaching worker
+// can't see a half-initialized ring. All fields are native endian.
+typedef struct worker_ring_header {
+    char                    magic[4];       // "SVWR"
+    uint32_t                version;        // 1
+    uint32_t                headerSize;     // offset of the first slot
+    uint32_t                slotCount;
+    uint32_t                slotSize;       // including the slot header
+    std::atomic<int32_t>    state;          // wrs*
+    std::atomic<uint64_t>   writeIndex;
+    std::atomic<uint64_t>   readIndex;
+    std::atomic<int64_t>    heartbeat;      // epoch ms of the worker's last sign of life
+    std::atomic<uint32_t>   framesDropped;
+} worker_ring_header;
+
+static const size_t kWorkerRingFilenameSize = 960;
+
+typedef struct worker_ring_slot {
+    int64_t                 ms;
+    uint32_t                width;
+    uint32_t                height;
+    int32_t                 pixfmt;
+    int32_t                 wasResized;
+    uint32_t                dataSize;
+    uint32_t                reserved;
+    char                    filename[kWorkerRingFilenameSize];   // empty if none
+} worker_ring_slot;
+
+static const size_t kWorkerRingHeaderSize = 256;
+static const size_t kWorkerRingSlotHeaderSize = 1024;
+static const int    kWorkerRingReadPollMs = 2;
+// the largest frame dimension the host takes from a worker
+static const uint32_t kWorkerRingMaxDimension = 16384;
+
+// The mapping is shared with the other process, so the layout is checked once
+// and kept here; slots are laid out from these, never from the header
+typedef struct worker_ring {
+    sv_mmap*                map;
+    worker_ring_header*     header;
+    size_t                  headerSize;
+    uint32_t                slotCount;
+    uint32_t                slotSize;
+    fn_stream_log           logCb;
+    int                     creator;
+} worker_ring;
+
+//-----------------------------------------------------------------------------
+static worker_ring_slot* _worker_ring_slot(worker_ring* ring, uint64_t index)
+{
+    uint8_t* base = (uint8_t*)ring->header + ring->headerSize;
+    return (worker_ring_slot*)(base + (index % ring->slotCount) * (size_t)ring->slotSize);
+}
+
+//-----------------------------------------------------------------------------
+static uint8_t* _worker_ring_slot_data(worker_ring_slot* slot)
+{
+    return (uint8_t*)slot + kWorkerRingSlotHeaderSize;
+}
+
+//-----------------------------------------------------------------------------
+SVVIDEOLIB_API worker_ring* worker_ring_create(const char* path,
+                                               int slotCount,
+                                               int slotSize,
+                                               fn_stream_log logCb)
+{
+    if ( path == NULL || slotCount <= 0 || slotSize <= (int)kWorkerRingSlotHeaderSize ) {
+        logCb(logError, _FMT("Invalid worker ring configuration: slots=" << slotCount << " size=" << slotSize));
+        return NULL;
+    }
+    // slot data stays 64-byte aligned
+    slotSize = (slotSize + 63) & ~63;
+
+    size_t   size = kWorkerRingHeaderSize + (size_t)slotCount * slotSize;
+    sv_mmap* map = sv_open_mmap(path, size);
+    if ( map == NULL ) {
+        logCb(logError, _FMT("Failed to map worker ring at " << path));
+        return NULL;
+    }
+
+    worker_ring_header* hdr = (worker_ring_header*)sv_mmap_get_ptr(map);
+    memset(hdr, 0, kWorkerRingHeaderSize);
+    hdr->version = 1;
+    hdr->headerSize = kWorkerRingHeaderSize;
+    hdr->slotCount = slotCount;
+    hdr->slotSize = slotSize;
+    hdr->state.store(wrsStarting);
+    hdr->writeIndex.store(0);
+    hdr->readIndex.store(0);
+    hdr->heartbeat.store(sv_time_get_current_epoch_time());
+    hdr->framesDropped.store(0);
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(hdr->magic, "SVWR", 4);
+
+    worker_ring* ring = new worker_ring;
+    ring->map = map;
+    ring->header = hdr;
+    ring->headerSize = kWorkerRingHeaderSize;
+    ring->slotCount = slotCount;
+    ring->slotSize = slotSize;
+    ring->logCb = logCb;
+    ring->creator = 1;
+    return ring;
+}
+
+//-----------------------------------------------------------------------------
+SVVIDEOLIB_API worker_ring* worker_ring_attach(const char* path,
+                                               fn_stream_log logCb)
+{
+    sv_mmap* map = sv_attach_mmap(path);
+    if ( map == NULL ) {
+        logCb(logError, _FMT("Failed to attach to worker ring at " << path));
+        return NULL;
+    }
+
+    worker_ring_header* hdr = (worker_ring_header*)sv_mmap_get_ptr(map);
+    size_t              size = sv_mmap_get_size(map);
+    if ( size < kWorkerRingHeaderSize ||
+         memcmp(hdr->magic, "SVWR", 4) != 0 ) {
+        logCb(logError, _FMT("Invalid worker ring at " << path));
+        sv_close_mmap(&map);
+        return NULL;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    size_t   headerSize = hdr->headerSize;
+    uint32_t slotCount = hdr->slotCount;
+    uint32_t slotSize = hdr->slotSize;
+    if ( hdr->version != 1 ||
+         headerSize < kWorkerRingHeaderSize ||
+         slotCount == 0 ||
+         slotSize <= kWorkerRingSlotHeaderSize ||
+         headerSize + (size_t)slotCount * slotSize > size ) {
+        logCb(logError, _FMT("Invalid worker ring at " << path));
+        sv_close_mmap(&map);
+        return NULL;
+    }
+
+    worker_ring* ring = new worker_ring;
+    ring->map = map;
+    ring->header = hdr;
+    ring->headerSize = headerSize;
+    ring->slotCount = slotCount;
+    ring->slotSize = slotSize;
+    ring->logCb = logCb;
+    ring->creator = 0;
+    return ring;
+}
+
+//-----------------------------------------------------------------------------
+SVVIDEOLIB_API void        worker_ring_close(worker_ring** pRing)
+{
+    if ( pRing == NULL || *pRing == NULL ) {
+        return;
+    }
+    worker_ring* ring = *pRing;
+    if ( !ring->creator ) {
+        worker_ring_set_state(ring, wrsStopped);
+    }
+    sv_close_mmap(&ring->map);
+    delete ring;
+    *pRing = NULL;
+}
+
+//-----------------------------------------------------------------------------
+SVVIDEOLIB_API int         worker_ring_publish(worker_ring* ring,
+                                               FrameData* frame)
+{
+    if ( ring == NULL || frame == NULL || frame->frame == NULL ) {
+        return -1;
+    }
+
+    worker_ring_header* hdr = ring->header;
+    hdr->heartbeat.store(sv_time_get_current_epoch_time(), std::memory_order_relaxed);
+
+    frame_api_t* api = frame_get_api(frame->frame);
+    size_t dataSize = api->get_data_size(frame->frame);
+    if ( dataSize > ring->slotSize - kWorkerRingSlotHeaderSize ) {
+        TRACE(_FMT("Frame of " << dataSize << " bytes doesn't fit the worker ring"));
+        hdr->framesDropped.fetch_add(1, std::memory_order_relaxed);
+        return 1;
+    }
+
+    uint64_t writeIndex = hdr->writeIndex.load(std::memory_order_relaxed);
+    if ( writeIndex - hdr->readIndex.load(std::memory_order_acquire) >= ring->slotCount ) {
+        // the host is behind; it'll get the newer frames once it catches up
+        hdr->framesDropped.fetch_add(1, std::memory_order_relaxed);
+        return 1;
+    }
+
+    worker_ring_slot* slot = _worker_ring_slot(ring, writeIndex);
+    slot->ms = frame->ms;
+    slot->width = frame->procWidth;
+    slot->height = frame->procHeight;
+    slot->pixfmt = api->get_pixel_format(frame->frame);
+    slot->wasResized = frame->wasResized;
+    slot->dataSize = (uint32_t)dataSize;
+    slot->filename[0] = '\0';
+    if ( frame->filename != NULL ) {
+        strncpy(slot->filename, frame->filename, kWorkerRingFilenameSize-1);
+        slot->filename[kWorkerRingFilenameSize-1] = '\0';
+    }
+    memcpy(_worker_ring_slot_data(slot), frame->procBuffer, dataSize);
+
+    hdr->writeIndex.store(writeIndex+1, std::memory_order_release);
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+SVVIDEOLIB_API void        worker_ring_set_state(worker_ring* ring,
+                                                 int state)
+{
+    if ( ring != NULL ) {
+        ring->header->heartbeat.store(sv_time_get_current_epoch_time(), std::memory_order_relaxed);
+        ring->header->state.store(state);
+    }
+}
+
+//-----------------------------------------------------------------------------
+SVVIDEOLIB_API FrameData*  worker_ring_read(worker_ring* ring,
+                                            int timeoutMs)
+{
+    if ( ring == NULL ) {
+        return NULL;
+    }
+
+    worker_ring_header* hdr = ring->header;
+    uint64_t readIndex = hdr->readIndex.load(std::memory_order_relaxed);
+    INT64_T  start = sv_time_get_current_epoch_time();
+    while ( hdr->writeIndex.load(std::memory_order_acquire) == readIndex ) {
+        // the worker may live in another process, so there's nothing to block on
+        if ( hdr->state.load() == wrsStopped ||
+             (INT64_T)sv_time_get_elapsed_time(start) >= timeoutMs ) {
+            return NULL;
+        }
+        sv_sleep(kWorkerRingReadPollMs);
+    }
+
+    // the slot was written by the other process: read each field once, and
+    // trust none of them
+    worker_ring_slot* slot = _worker_ring_slot(ring, readIndex);
+    int64_t  ms = slot->ms;
+    uint32_t width = slot->width;
+    uint32_t height = slot->height;
+    uint32_t dataSize = slot->dataSize;
+    char     filename[kWorkerRingFilenameSize];
+    memcpy(filename, slot->filename, kWorkerRingFilenameSize);
+    bool     hasFilename = memchr(filename, '\0', kWorkerRingFilenameSize) != NULL;
+    FrameData* res = NULL;
+
+    if ( dataSize > ring->slotSize - kWorkerRingSlotHeaderSize ||
+         width == 0 || width > kWorkerRingMaxDimension ||
+         height == 0 || height > kWorkerRingMaxDimension ||
+         !hasFilename ) {
+        ring->logCb(logError, _FMT("Dropping invalid worker ring frame: size=" << dataSize <<
+                                    " " << width << "x" << height <<
+                                    (hasFilename ? "" : " filename not terminated")));
+        hdr->framesDropped.fetch_add(1, std::memory_order_relaxed);
+        hdr->readIndex.store(readIndex+1, std::memory_order_release);
+        return NULL;
+    }
+
+    basic_frame_obj* newFrame = alloc_basic_frame(WORKER_RING_MAGIC, dataSize, ring->logCb);
+    if ( newFrame == NULL ) {
+        return NULL;
+    }
+    newFrame->pts = ms;
+    newFrame->dts = ms;
+    newFrame->keyframe = 1;
+    newFrame->width = width;
+    newFrame->height = height;
+    newFrame->pixelFormat = slot->pixfmt;
+    newFrame->mediaType = mediaVideo;
+    newFrame->dataSize = dataSize;
+    memcpy(newFrame->data, _worker_ring_slot_data(slot), dataSize);
+
+    res = videolibutils_wrap_proc_frame(filename[0] ? filename : NULL,
+                                        1,
+                                        slot->wasResized,
+                                        (frame_obj*)newFrame);
+    if ( res != NULL ) {
+        res->ms = ms;
+    } else {
+        frame_unref((frame_obj**)&newFrame);
+    }
+
+    // the slot is the worker's again
+    hdr->readIndex.store(readIndex+1, std::memory_order_release);
+    return res;
+}
+
+//-----------------------------------------------------------------------------
+SVVIDEOLIB_API int         worker_ring_get_state(worker_ring* ring,
+                                                 int staleMs)
+{
+    if ( ring == NULL ) {
+        return wrsStopped;
+    }
+    int state = ring->header->state.load();
+    if ( staleMs > 0 && state != wrsStopped &&
+         (INT64_T)sv_time_get_elapsed_time(ring->header->heartbeat.load(std::memory_order_relaxed)) > staleMs ) {
+        state = wrsStopped;
+    }
+    return state;
+}
+
+//-----------------------------------------------------------------------------
+SVVIDEOLIB_API int         worker_ring_get_dropped(worker_ring* ring)
+{
+    return ring ? (int)ring->header->framesDropped.load(std::memory_order_relaxed) : 0;
+}
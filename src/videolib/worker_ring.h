@@ -0,0 +1,91 @@
+/*****************************************************************************
+ *
+ * worker_ring.h
+ *   Shared-memory ring handing frames from a camera worker process to the host.
+ *
+ *****************************************************************************
+ *
+ * Copyright 2013-2022 Sighthound, Inc.
+ *
+ * Licensed under the GNU GPLv3 license found at
+ * https://www.gnu.org/licenses/gpl-3.0.txt
+ *
+ * Alternative licensing available from Sighthound, Inc.
+ * by emailing opensource@sighthound.com
+ *
+ * This file is part of the Sighthound Video project which can be found at
+ * https://github.url/thing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; using version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ *****************************************************************************/
+
+#ifndef WORKER_RING_H
+#define WORKER_RING_H
+
+#include "streamprv.h"
+#include "videolibUtils.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct worker_ring worker_ring;
+
+//-----------------------------------------------------------------------------
+// A camera's graph can run in a worker process of its own, so a crash or a
+// stall in it can't take the others down. The host creates the ring on a file
+// (prefer a RAM-backed location) and starts the worker, which attaches to it
+// and publishes every analytics frame it reads; the host reads them back as
+// FrameData, as if from get_new_frame. It's a single-producer single-consumer
+// ring of fixed-size slots: when the host falls behind, the worker drops new
+// frames, same as the lossy tc_edge queue would.
+enum {
+    wrsStarting   = 0,    // worker hasn't opened the camera yet
+    wrsRunning    = 1,
+    wrsStopped    = 2,    // worker closed the camera, or is gone
+};
+
+SVVIDEOLIB_API worker_ring*        worker_ring_create         (const char* path,
+                                                               int slotCount,
+                                                               int slotSize,
+                                                               fn_stream_log logCb);
+SVVIDEOLIB_API worker_ring*        worker_ring_attach         (const char* path,
+                                                               fn_stream_log logCb);
+SVVIDEOLIB_API void                worker_ring_close          (worker_ring** ring);
+
+// Worker side. Returns 0 if the frame was published, 1 if it was dropped for
+// want of space, and -1 on error.
+SVVIDEOLIB_API int                 worker_ring_publish        (worker_ring* ring,
+                                                               FrameData* frame);
+// Also counts as a sign of life, as does every publish
+SVVIDEOLIB_API void                worker_ring_set_state      (worker_ring* ring,
+                                                               int state);
+
+// Host side. Returns the oldest frame not read yet, waiting up to timeoutMs
+// for one; NULL if there is none, or if it is malformed (it is then counted
+// as dropped, and skipped). Free with free_frame_data.
+SVVIDEOLIB_API FrameData*          worker_ring_read           (worker_ring* ring,
+                                                               int timeoutMs);
+// wrs* of the worker; wrsStopped also if it hasn't shown a sign of life in
+// staleMs (if not 0)
+SVVIDEOLIB_API int                 worker_ring_get_state      (worker_ring* ring,
+                                                               int staleMs);
+SVVIDEOLIB_API int                 worker_ring_get_dropped    (worker_ring* ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif